@@ -1,11 +1,25 @@
+import collections
+import contextlib
 import mmap
+import multiprocessing
 import os
+import shutil
+import socket
+import subprocess
+import sys
 import tempfile
+import threading
+import time
+from pathlib import Path
 
 from memray import AllocatorType
+from memray import FileDestination
 from memray import FileReader
 from memray import MemoryAllocator
+from memray import SocketDestination
 from memray import Tracker
+from memray._memray import compute_statistics
+from memray._test import churn
 
 MAX_ITERS = 100000
 
@@ -36,6 +50,31 @@ class TracebackBenchmarks:
         self.record.stack_trace()
 
 
+def _make_long_function(allocator):
+    # The line number of an allocation is found by decoding the line table of
+    # its code object up to the current instruction, so allocate from the end
+    # of a long function.
+    lines = ["def long_function():"]
+    lines.extend(f"    x{i} = {i}" for i in range(500))
+    lines.append("    for _ in range(MAX_ITERS):")
+    lines.append("        allocator.valloc(1234)")
+    lines.append("        allocator.free()")
+    namespace = {"allocator": allocator, "MAX_ITERS": MAX_ITERS}
+    exec("\n".join(lines), namespace)
+    return namespace["long_function"]
+
+
+class LineNumberBenchmarks:
+    def setup(self):
+        self.tempfile = tempfile.NamedTemporaryFile()
+        self.long_function = _make_long_function(MemoryAllocator())
+
+    def time_allocations_at_the_end_of_a_long_function(self):
+        os.unlink(self.tempfile.name)
+        with Tracker(self.tempfile.name):
+            self.long_function()
+
+
 class AllocatorBenchmarks:
     def setup(self):
         self.tempfile = tempfile.NamedTemporaryFile()
@@ -109,9 +148,42 @@ class ParserBenchmarks:
                 self.allocator.valloc(1234)
                 self.allocator.free()
 
+        self.native_tempfile = tempfile.NamedTemporaryFile()
+        os.unlink(self.native_tempfile.name)
+        with Tracker(self.native_tempfile.name, native_traces=True):
+            for size in range(MAX_ITERS):
+                self.allocator.valloc(size + 1)
+                self.allocator.free()
+
+        self.uncompressed_tempfile = tempfile.NamedTemporaryFile()
+        os.unlink(self.uncompressed_tempfile.name)
+        destination = FileDestination(
+            self.uncompressed_tempfile.name, compress_on_exit=False
+        )
+        with Tracker(destination=destination):
+            for _ in range(MAX_ITERS):
+                self.allocator.valloc(1234)
+                self.allocator.free()
+
     def time_end_to_end_parsing(self):
         list(FileReader(self.tempfile.name).get_allocation_records())
 
+    def time_end_to_end_parsing_uncompressed(self):
+        list(FileReader(self.uncompressed_tempfile.name).get_allocation_records())
+
+    def time_end_to_end_high_watermark(self):
+        list(
+            FileReader(self.tempfile.name).get_high_watermark_allocation_records(
+                merge_threads=False
+            )
+        )
+
+    def time_end_to_end_statistics(self):
+        compute_statistics(self.tempfile.name)
+
+    def time_end_to_end_parsing_with_native_traces(self):
+        list(FileReader(self.native_tempfile.name).get_allocation_records())
+
 
 def recursive(n, chunk_size):
     """Mimics generally-increasing but spiky usage"""
@@ -145,3 +217,319 @@ class HighWatermarkBenchmarks:
                 merge_threads=False
             )
         )
+
+
+class MmapHeavyBenchmarks:
+    def setup(self):
+        self.tempfile = tempfile.NamedTemporaryFile()
+        os.unlink(self.tempfile.name)
+        self.tracker = Tracker(self.tempfile.name)
+
+        with self.tracker:
+            # Keep every mapping alive at once, so that each munmap has to
+            # find its region among many others.
+            mappings = [mmap.mmap(-1, length=4096) for _ in range(MAX_ITERS // 10)]
+            for mapping in mappings:
+                mapping.close()
+
+    def time_high_watermark(self):
+        list(
+            FileReader(self.tempfile.name).get_high_watermark_allocation_records(
+                merge_threads=False
+            )
+        )
+
+    def time_leaks(self):
+        list(
+            FileReader(self.tempfile.name).get_leaked_allocation_records(
+                merge_threads=False
+            )
+        )
+
+
+MULTITHREADED_EXTENSION = (
+    Path(__file__).parent.parent / "tests" / "integration" / "multithreaded_extension"
+)
+
+# Every thread count makes the same number of allocations in total, split
+# between the threads, so that the time it takes only grows with contention.
+THREAD_COUNTS = [1, 8, 16, 32, 64]
+NATIVE_ROUNDS = 640  # Each one is 100 allocations by a native thread
+PYTHON_OBJECTS = 64000
+
+# The options each configuration passes to the tracker. The follow_fork
+# configuration runs the workload in a child process, and the socket one
+# sends the records to a client in another process that reads and drops them.
+TRACKING_CONFIGURATIONS = {
+    "default": {},
+    "native_traces": {"native_traces": True},
+    "trace_python_allocators": {"trace_python_allocators": True},
+    "follow_fork": {"follow_fork": True},
+    "socket": {},
+}
+
+_SOCKET_CLIENT = """
+import socket
+import sys
+import time
+
+buffer = bytearray(1 << 20)
+while True:
+    try:
+        client = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+    except ConnectionRefusedError:
+        time.sleep(0.001)
+        continue
+    with client:
+        while client.recv_into(buffer):
+            pass
+"""
+
+
+def _free_port():
+    with socket.socket() as sock:
+        sock.bind(("127.0.0.1", 0))
+        return sock.getsockname()[1]
+
+
+def _allocate_from_threads(testext, n_threads):
+    testext.run(n_threads, NATIVE_ROUNDS // n_threads)
+
+    def allocate_objects():
+        return [[i] for i in range(PYTHON_OBJECTS // n_threads)]
+
+    threads = [threading.Thread(target=allocate_objects) for _ in range(n_threads)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+
+class ThreadedTrackingBenchmarks:
+    """How much tracking slows down a program that allocates from many
+    threads, and how big a capture it makes, in each configuration."""
+
+    params = [list(TRACKING_CONFIGURATIONS), THREAD_COUNTS]
+    param_names = ["configuration", "threads"]
+    timeout = 300
+
+    def setup_cache(self):
+        # Build the extension in the benchmark's working directory, which is
+        # kept until every benchmark of the class has run.
+        extension_path = Path.cwd() / "multithreaded_extension"
+        shutil.copytree(MULTITHREADED_EXTENSION, extension_path, dirs_exist_ok=True)
+        subprocess.run(
+            [sys.executable, "setup.py", "build_ext", "--inplace"],
+            check=True,
+            cwd=extension_path,
+            capture_output=True,
+        )
+        return str(extension_path)
+
+    def setup(self, extension_path, configuration, threads):
+        sys.path.insert(0, extension_path)
+        import testext
+
+        self.testext = testext
+        self.tempdir = tempfile.TemporaryDirectory()
+        self.output = Path(self.tempdir.name) / "capture.bin"
+        # Start the client up front, and let it connect to every tracker in
+        # turn, so that starting it isn't part of what is measured.
+        self.client = None
+        if configuration == "socket":
+            self.port = _free_port()
+            self.client = subprocess.Popen(
+                [sys.executable, "-c", _SOCKET_CLIENT, str(self.port)]
+            )
+
+    def teardown(self, extension_path, configuration, threads):
+        if self.client:
+            self.client.kill()
+            self.client.wait()
+        sys.path.remove(extension_path)
+        self.tempdir.cleanup()
+
+    @contextlib.contextmanager
+    def _track(self, configuration, **kwargs):
+        kwargs.update(TRACKING_CONFIGURATIONS[configuration])
+        if configuration != "socket":
+            for capture in Path(self.tempdir.name).iterdir():
+                capture.unlink()
+            with Tracker(self.output, **kwargs) as tracker:
+                yield tracker
+            return
+
+        destination = SocketDestination(server_port=self.port)
+        with Tracker(destination=destination, **kwargs) as tracker:
+            yield tracker
+
+    def _run_workload(self, configuration, threads):
+        if configuration != "follow_fork":
+            _allocate_from_threads(self.testext, threads)
+            return
+        pid = os.fork()
+        if pid == 0:
+            try:
+                _allocate_from_threads(self.testext, threads)
+            finally:
+                os._exit(0)
+        os.waitpid(pid, 0)
+
+    def _run_tracked_workload(self, configuration, threads):
+        with self._track(configuration):
+            self._run_workload(configuration, threads)
+
+    def time_tracked(self, extension_path, configuration, threads):
+        self._run_tracked_workload(configuration, threads)
+
+    def track_slowdown(self, extension_path, configuration, threads):
+        def best_of_three(run):
+            timings = []
+            for _ in range(3):
+                start = time.perf_counter()
+                run()
+                timings.append(time.perf_counter() - start)
+            return min(timings)
+
+        untracked = best_of_three(lambda: self._run_workload(configuration, threads))
+        tracked = best_of_three(
+            lambda: self._run_tracked_workload(configuration, threads)
+        )
+        return tracked / untracked
+
+    track_slowdown.unit = "times"
+
+    def track_bytes_per_allocation(self, extension_path, configuration, threads):
+        if configuration == "socket":
+            # The tracker only counts allocations when it measures its
+            # overhead, which doesn't change what it writes.
+            with self._track(configuration, measure_overhead=True) as tracker:
+                self._run_workload(configuration, threads)
+                metrics = tracker.get_metrics()
+            return metrics.bytes_written / metrics.n_tracked_allocations
+
+        # With follow_fork, the child's capture is next to the parent's.
+        self._run_tracked_workload(configuration, threads)
+        captures = list(Path(self.tempdir.name).iterdir())
+        n_bytes = sum(capture.stat().st_size for capture in captures)
+        n_allocations = sum(
+            FileReader(capture).metadata.total_allocations for capture in captures
+        )
+        return n_bytes / n_allocations
+
+    track_bytes_per_allocation.unit = "bytes"
+
+
+# Each capture holds about this many allocation and deallocation records.
+CAPTURE_SIZES = [1_000_000, 10_000_000, 100_000_000]
+CAPTURE_THREADS = 16
+CAPTURE_CHUNK = 1000  # Allocations made from each Python stack in deep_stacks
+
+
+def _churn_from_deep_stacks(n_allocations):
+    def recurse(depth, n):
+        if depth:
+            return recurse(depth - 1, n)
+        churn(n)
+
+    for chunk in range(n_allocations // CAPTURE_CHUNK):
+        recurse(16 + chunk % 112, CAPTURE_CHUNK)
+
+
+def _churn_from_threads(n_allocations):
+    threads = [
+        threading.Thread(target=churn, args=(n_allocations // CAPTURE_THREADS,))
+        for _ in range(CAPTURE_THREADS)
+    ]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+
+# How the allocations of each capture are made, and the tracker options used.
+CAPTURE_SHAPES = {
+    "default": (churn, {}),
+    "threads": (_churn_from_threads, {}),
+    "deep_stacks": (_churn_from_deep_stacks, {}),
+    "mmap_churn": (lambda n: churn(n, mmap_every=4), {}),
+    "native_traces": (churn, {"native_traces": True}),
+}
+
+# Every way of reading a capture that a reporter relies on. native_stacks
+# resolves the native frames of what is live at the high water mark.
+READERS = {
+    "allocation_records": lambda reader: reader.get_allocation_records(),
+    "high_watermark": lambda reader: reader.get_high_watermark_allocation_records(
+        merge_threads=False
+    ),
+    "leaks": lambda reader: reader.get_leaked_allocation_records(merge_threads=False),
+    "temporary": lambda reader: reader.get_temporary_allocation_records(
+        merge_threads=False
+    ),
+    "memory_snapshots": lambda reader: reader.get_memory_snapshots(),
+    "native_stacks": lambda reader: (
+        record.hybrid_stack_trace()
+        for record in reader.get_high_watermark_allocation_records(merge_threads=True)
+    ),
+}
+
+
+def _write_capture(path, shape, n_records):
+    workload, options = CAPTURE_SHAPES[shape]
+    with Tracker(path, **options):
+        workload(n_records // 2)
+
+
+class ReaderScalingBenchmarks:
+    """How much memory and time each way of reading a capture takes, as the
+    capture grows and for captures of different shapes."""
+
+    params = [list(CAPTURE_SHAPES), CAPTURE_SIZES, list(READERS)]
+    param_names = ["shape", "records", "reader"]
+    timeout = 3600
+
+    def setup_cache(self):
+        # The captures are written on first use into the benchmark's working
+        # directory, which is kept until every benchmark of the class has run.
+        captures = Path.cwd() / "captures"
+        captures.mkdir(exist_ok=True)
+        return str(captures)
+
+    def setup(self, captures, shape, records, reader):
+        if reader == "native_stacks" and shape != "native_traces":
+            raise NotImplementedError("Only captures with native traces have them")
+        self.capture = Path(captures) / f"{shape}-{records}.bin"
+        if self.capture.exists():
+            return
+        # Written by a child process, so that what the tracker and the
+        # workload use isn't part of the peak memory measured here.
+        partial = self.capture.with_suffix(".partial")
+        with contextlib.suppress(FileNotFoundError):
+            partial.unlink()
+        process = multiprocessing.get_context("fork").Process(
+            target=_write_capture, args=(partial, shape, records)
+        )
+        process.start()
+        process.join()
+        if process.exitcode != 0:
+            raise RuntimeError(f"Failed to write the {shape} capture")
+        partial.rename(self.capture)
+
+    def _read(self, reader):
+        collections.deque(READERS[reader](FileReader(self.capture)), maxlen=0)
+
+    def peakmem_read(self, captures, shape, records, reader):
+        self._read(reader)
+
+    def track_records_per_second(self, captures, shape, records, reader):
+        start = time.perf_counter()
+        self._read(reader)
+        return records / (time.perf_counter() - start)
+
+    track_records_per_second.unit = "records/s"
+
+    def track_capture_bytes_per_record(self, captures, shape, records, reader):
+        return self.capture.stat().st_size / records
+
+    track_capture_bytes_per_record.unit = "bytes"
@@ -0,0 +1,86 @@
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "frame_tree.h"
+#include "records.h"
+
+namespace {
+
+using namespace memray::tracking_api;
+
+// Finding the stack of an allocation made at the bottom of a deep recursion
+// in a tree that already has it, which is what the tracker does for almost
+// every allocation once a program warms up.
+void
+BM_FrameTreeDeepRecursion(benchmark::State& state)
+{
+    const size_t depth = state.range(0);
+    // A few frames of setup, then the same two mutually recursive frames.
+    std::vector<frame_id_t> stack = {1, 2, 3};
+    while (stack.size() < depth) {
+        stack.push_back(4 + stack.size() % 2);
+    }
+    FrameTree tree;
+    tree.getTraceIndex(stack, FrameTree::tracecallback_t());
+
+    for (auto _ : state) {
+        FrameTree::index_t index = 0;
+        for (frame_id_t frame : stack) {
+            index = tree.getTraceIndex(index, frame);
+        }
+        benchmark::DoNotOptimize(index);
+    }
+    state.SetItemsProcessed(state.iterations() * depth);
+}
+BENCHMARK(BM_FrameTreeDeepRecursion)->Arg(64)->Arg(1024);
+
+// Adding new nodes to the tree, as happens while a program is warming up.
+void
+BM_FrameTreeNewNodes(benchmark::State& state)
+{
+    FrameTree tree;
+    FrameTree::index_t parent = 0;
+    frame_id_t frame = 0;
+    for (auto _ : state) {
+        // Fan out from a few parents, so that the tree gets both wide and deep.
+        const FrameTree::index_t index = tree.getTraceIndex(parent, ++frame);
+        parent = (frame % 8 == 0) ? index : parent;
+        benchmark::DoNotOptimize(index);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FrameTreeNewNodes);
+
+// Interning the frames of a program that has the given number of distinct
+// frames, all of which were seen before.
+void
+BM_FrameCollectionGetIndex(benchmark::State& state)
+{
+    const size_t n_frames = state.range(0);
+    std::vector<std::string> function_names;
+    function_names.reserve(n_frames);
+    for (size_t i = 0; i < n_frames; ++i) {
+        function_names.push_back("function_" + std::to_string(i));
+    }
+    std::vector<RawFrame> frames;
+    frames.reserve(n_frames);
+    for (size_t i = 0; i < n_frames; ++i) {
+        frames.push_back(RawFrame{function_names[i].c_str(), "module.py", static_cast<int>(i), false});
+    }
+
+    FrameCollection<RawFrame> collection;
+    for (const auto& frame : frames) {
+        collection.getIndex(frame);
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(collection.getIndex(frames[i++ % n_frames]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FrameCollectionGetIndex)->Arg(64)->Arg(64 * 1024);
+
+}  // namespace
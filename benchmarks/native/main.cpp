@@ -0,0 +1,19 @@
+#include <Python.h>
+
+#include <benchmark/benchmark.h>
+
+// Parts of the reader and the writer use the Python C API (to build frames,
+// or to check the interpreter's state), so it must be initialized even
+// though nothing here runs any Python code.
+int
+main(int argc, char** argv)
+{
+    Py_InitializeEx(0);
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
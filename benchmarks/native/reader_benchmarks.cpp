@@ -0,0 +1,117 @@
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+
+#include "record_reader.h"
+#include "record_writer.h"
+#include "records.h"
+#include "sink.h"
+#include "source.h"
+
+namespace {
+
+using namespace memray;
+using namespace memray::api;
+using namespace memray::tracking_api;
+
+// A capture of a few threads that allocate and free memory in functions
+// called at assorted depths, written once and read by every benchmark.
+class Capture
+{
+  public:
+    Capture()
+    : d_path("/tmp/memray-benchmark-" + std::to_string(::getpid()) + ".bin")
+    {
+        RecordWriter writer(std::make_unique<io::FileSink>(d_path, true, false), "benchmark", false);
+        if (!writer.writeHeader(false)) {
+            throw std::runtime_error("Failed to write the header");
+        }
+
+        const frame_id_t n_frames = 64;
+        for (frame_id_t frame_id = 0; frame_id < n_frames; ++frame_id) {
+            writer.writeRecord(
+                    pyrawframe_map_val_t{frame_id, RawFrame{"function", "module.py", 1, false}});
+        }
+
+        const thread_id_t n_threads = 4;
+        const size_t n_iterations = 50000;
+        for (size_t i = 0; i < n_iterations; ++i) {
+            const thread_id_t tid = 1 + i % n_threads;
+            const size_t depth = 1 + i % 16;
+            for (size_t frame = 0; frame < depth; ++frame) {
+                writer.writeThreadSpecificRecord(tid, FramePush{(i + frame) % n_frames});
+            }
+            const uintptr_t address = (tid << 40) + (i % 512) * 4096;
+            writer.writeThreadSpecificRecord(
+                    tid,
+                    AllocationRecord{address, 16 + i % 1024, hooks::Allocator::MALLOC});
+            if (i % 2) {
+                writer.writeThreadSpecificRecord(
+                        tid,
+                        AllocationRecord{address, 0, hooks::Allocator::FREE});
+            }
+            writer.writeThreadSpecificRecord(tid, FramePop{depth});
+        }
+
+        if (!writer.writeTrailer() || !writer.writeHeader(true)) {
+            throw std::runtime_error("Failed to finish the capture");
+        }
+        const TrackerMetrics metrics = writer.metrics();
+        d_bytes_per_record = static_cast<double>(metrics.bytes_written) / metrics.n_records_written;
+    }
+
+    ~Capture()
+    {
+        std::remove(d_path.c_str());
+    }
+
+    const std::string& path() const
+    {
+        return d_path;
+    }
+
+    double bytesPerRecord() const
+    {
+        return d_bytes_per_record;
+    }
+
+  private:
+    std::string d_path;
+    double d_bytes_per_record;
+};
+
+const Capture&
+capture()
+{
+    static const Capture s_capture;
+    return s_capture;
+}
+
+// Reading every allocation in a capture, rebuilding the stack of each one
+// from the frame pushes and pops before it, as building any report does.
+void
+BM_ReadAllocations(benchmark::State& state)
+{
+    const Capture& file = capture();
+    size_t n_allocations = 0;
+    for (auto _ : state) {
+        RecordReader reader(std::make_unique<io::FileSource>(file.path()));
+        RecordReader::RecordResult result;
+        while ((result = reader.nextRecord()) != RecordReader::RecordResult::END_OF_FILE) {
+            if (result == RecordReader::RecordResult::ERROR) {
+                state.SkipWithError("Failed to read the capture");
+                return;
+            }
+            benchmark::DoNotOptimize(reader.getLatestAllocation());
+            ++n_allocations;
+        }
+    }
+    state.SetItemsProcessed(n_allocations);
+    state.counters["bytes_per_record"] = file.bytesPerRecord();
+}
+BENCHMARK(BM_ReadAllocations)->Unit(benchmark::kMillisecond);
+
+}  // namespace
@@ -0,0 +1,111 @@
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <link.h>
+
+#include "native_resolver.h"
+#include "records.h"
+
+namespace {
+
+using namespace memray::native_resolver;
+using namespace memray::tracking_api;
+
+// The code of this executable, loaded into a resolver the way the reader
+// loads the memory maps the tracker writes.
+struct Executable
+{
+    uintptr_t addr{0};
+    std::vector<Segment> segments;
+    uintptr_t code_start{0};
+    uintptr_t code_end{0};
+};
+
+int
+findExecutable(struct dl_phdr_info* info, size_t, void* data)
+{
+    if (info->dlpi_name[0]) {
+        return 0;
+    }
+    auto executable = static_cast<Executable*>(data);
+    executable->addr = info->dlpi_addr;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const auto& phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_LOAD) {
+            continue;
+        }
+        executable->segments.push_back(Segment{phdr.p_vaddr, phdr.p_memsz});
+        if (phdr.p_flags & PF_X) {
+            executable->code_start = info->dlpi_addr + phdr.p_vaddr;
+            executable->code_end = executable->code_start + phdr.p_memsz;
+        }
+    }
+    return 1;
+}
+
+// Instruction pointers spread evenly across the code of this executable.
+std::vector<uintptr_t>
+instructionPointers(SymbolResolver* resolver, size_t n_ips)
+{
+    Executable executable;
+    dl_iterate_phdr(&findExecutable, &executable);
+    if (executable.code_start == executable.code_end) {
+        throw std::runtime_error("Failed to find the code of the executable");
+    }
+    resolver->clearSegments();
+    resolver->addSegments("/proc/self/exe", executable.addr, executable.segments);
+
+    std::vector<uintptr_t> ips;
+    ips.reserve(n_ips);
+    const uintptr_t step = (executable.code_end - executable.code_start) / n_ips;
+    for (size_t i = 0; i < n_ips; ++i) {
+        ips.push_back(executable.code_start + i * step);
+    }
+    return ips;
+}
+
+// Resolving frames that were resolved before, as happens for the frames
+// that most stacks share.
+void
+BM_ResolveCached(benchmark::State& state)
+{
+    SymbolResolver resolver;
+    const std::vector<uintptr_t> ips = instructionPointers(&resolver, state.range(0));
+    const size_t generation = resolver.currentSegmentGeneration();
+    for (uintptr_t ip : ips) {
+        resolver.resolve(ip, generation);
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(resolver.resolve(ips[i++ % ips.size()], generation));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ResolveCached)->Arg(64)->Arg(4096);
+
+// Resolving frames that were never resolved before, which means looking up
+// their symbols and their debug information. Every pass over the frames
+// starts a new generation of segments, so that none of them is cached.
+void
+BM_ResolveUncached(benchmark::State& state)
+{
+    SymbolResolver resolver;
+    const std::vector<uintptr_t> ips = instructionPointers(&resolver, state.range(0));
+
+    size_t i = 0;
+    for (auto _ : state) {
+        if (i % ips.size() == 0) {
+            state.PauseTiming();
+            resolver.copySegments();
+            state.ResumeTiming();
+        }
+        benchmark::DoNotOptimize(
+                resolver.resolve(ips[i++ % ips.size()], resolver.currentSegmentGeneration()));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ResolveUncached)->Arg(4096);
+
+}  // namespace
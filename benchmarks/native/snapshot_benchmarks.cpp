@@ -0,0 +1,49 @@
+#include <random>
+
+#include <benchmark/benchmark.h>
+
+#include "snapshot.h"
+
+namespace {
+
+using namespace memray::api;
+
+// A process that keeps the given number of mappings around while it maps
+// new ones and unmaps parts of old ones, as allocators that return memory to
+// the system in pages do. Unmapping from the middle of a mapping splits it.
+void
+BM_IntervalTreeMmapChurn(benchmark::State& state)
+{
+    const size_t n_mappings = state.range(0);
+    const size_t page_size = 4096;
+    const size_t mapping_size = 64 * page_size;
+    // Leave a gap after every mapping, so that they don't touch.
+    const size_t stride = 2 * mapping_size;
+    const uintptr_t base = uintptr_t(1) << 40;
+
+    IntervalTree<size_t> tree;
+    for (size_t i = 0; i < n_mappings; ++i) {
+        tree.addInterval(base + i * stride, mapping_size, i);
+    }
+
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<size_t> pick_mapping(0, n_mappings - 1);
+    std::uniform_int_distribution<size_t> pick_page(0, mapping_size / page_size - 1);
+    size_t i = 0;
+    for (auto _ : state) {
+        const size_t mapping = pick_mapping(rng);
+        const uintptr_t start = base + mapping * stride;
+        const uintptr_t page = start + pick_page(rng) * page_size;
+        benchmark::DoNotOptimize(tree.removeInterval(page, page_size));
+        // Map a whole range again every now and then, so that there are
+        // always mappings left to split.
+        if (++i % 16 == 0) {
+            tree.removeInterval(start, mapping_size);
+            tree.addInterval(start, mapping_size, mapping);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IntervalTreeMmapChurn)->Arg(64)->Arg(16 * 1024);
+
+}  // namespace
@@ -0,0 +1,132 @@
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "record_writer.h"
+#include "records.h"
+#include "sink.h"
+
+namespace {
+
+using namespace memray;
+using namespace memray::tracking_api;
+
+std::unique_ptr<RecordWriter>
+makeWriter(bool per_thread_buffers)
+{
+    auto writer = std::make_unique<RecordWriter>(
+            std::make_unique<io::NullSink>(),
+            "benchmark",
+            false,
+            per_thread_buffers);
+    if (!writer->writeHeader(false)) {
+        throw std::runtime_error("Failed to write the header");
+    }
+    return writer;
+}
+
+void
+reportBytesPerRecord(benchmark::State& state, RecordWriter* writer)
+{
+    const TrackerMetrics metrics = writer->metrics();
+    if (metrics.n_records_written) {
+        state.counters["bytes_per_record"] =
+                static_cast<double>(metrics.bytes_written) / metrics.n_records_written;
+    }
+}
+
+// The varints that most records are made of, with values of up to the
+// given number of bits.
+void
+BM_WriteVarint(benchmark::State& state)
+{
+    auto writer = makeWriter(false);
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<size_t> distribution(0, (size_t(1) << state.range(0)) - 1);
+    std::vector<size_t> values(4096);
+    for (auto& value : values) {
+        value = distribution(rng);
+    }
+
+    const size_t bytes_before = writer->metrics().bytes_written;
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(writer->writeVarint(values[i++ % values.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["bytes_per_varint"] =
+            static_cast<double>(writer->metrics().bytes_written - bytes_before) / state.iterations();
+}
+BENCHMARK(BM_WriteVarint)->Arg(7)->Arg(14)->Arg(28)->Arg(56);
+
+// Every thread allocates and frees memory as fast as it can, each keeping a
+// working set of a few hundred live allocations of assorted sizes, which is
+// what the writer sees from a tracker following a multi-threaded program
+// that allocates a lot. The argument selects per-thread buffering.
+std::unique_ptr<RecordWriter> s_storm_writer;
+
+void
+BM_MallocStorm(benchmark::State& state)
+{
+    if (state.thread_index() == 0) {
+        s_storm_writer = makeWriter(state.range(0) != 0);
+    }
+
+    const thread_id_t tid = 1 + state.thread_index();
+    const uintptr_t heap_start = static_cast<uintptr_t>(1 + state.thread_index()) << 40;
+    const size_t working_set = 512;
+    size_t i = 0;
+    for (auto _ : state) {
+        const uintptr_t address = heap_start + (i % working_set) * 4096;
+        const size_t size = 16 + (i * 37) % 1024;
+        bool ok = s_storm_writer->writeThreadSpecificRecord(
+                tid,
+                AllocationRecord{address, size, hooks::Allocator::MALLOC});
+        if (i >= working_set / 2) {
+            const uintptr_t freed = heap_start + ((i - working_set / 2) % working_set) * 4096;
+            ok = ok
+                 && s_storm_writer->writeThreadSpecificRecord(
+                         tid,
+                         AllocationRecord{freed, 0, hooks::Allocator::FREE});
+        }
+        benchmark::DoNotOptimize(ok);
+        ++i;
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0) {
+        // Buffered records only reach the sink when they're flushed.
+        s_storm_writer->writeTrailer();
+        reportBytesPerRecord(state, s_storm_writer.get());
+        s_storm_writer.reset();
+    }
+}
+BENCHMARK(BM_MallocStorm)->Arg(0)->Arg(1)->ThreadRange(1, 8)->UseRealTime();
+
+// Python frames being pushed and popped between the allocations of a deeply
+// recursive function.
+void
+BM_WriteFramePushesAndPops(benchmark::State& state)
+{
+    auto writer = makeWriter(false);
+    const size_t depth = state.range(0);
+    for (frame_id_t frame_id = 0; frame_id < depth; ++frame_id) {
+        writer->writeRecord(
+                pyrawframe_map_val_t{frame_id, RawFrame{"recurse", "recursion.py", 1, false}});
+    }
+
+    for (auto _ : state) {
+        for (frame_id_t frame_id = 0; frame_id < depth; ++frame_id) {
+            writer->writeThreadSpecificRecord(1, FramePush{frame_id});
+        }
+        writer->writeThreadSpecificRecord(1, AllocationRecord{0x1000, 64, hooks::Allocator::MALLOC});
+        writer->writeThreadSpecificRecord(1, FramePop{depth});
+    }
+    state.SetItemsProcessed(state.iterations() * (depth + 2));
+    reportBytesPerRecord(state, writer.get());
+}
+BENCHMARK(BM_WriteFramePushesAndPops)->Arg(16)->Arg(256);
+
+}  // namespace
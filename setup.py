@@ -228,6 +228,9 @@ MEMRAY_EXTENSION = Extension(
         "src/memray/_memray/snapshot.cpp",
         "src/memray/_memray/socket_reader_thread.cpp",
         "src/memray/_memray/native_resolver.cpp",
+        "src/memray/_memray/pprof.cpp",
+        "src/memray/_memray/ptrace_attach.cpp",
+        "src/memray/_memray/string_interner.cpp",
     ],
     libraries=[
         "lz4",
@@ -235,7 +238,14 @@ MEMRAY_EXTENSION = Extension(
     library_dirs=[str(LIBBACKTRACE_LIBDIR)],
     include_dirs=["src", str(LIBBACKTRACE_INCLUDEDIRS)],
     language="c++",
-    extra_compile_args=["-std=c++17", "-Wall", *EXTRA_COMPILE_ARGS],
+    # Our own frames must have frame pointers for the frame pointer unwinder
+    # to get past them to the frames of the tracked program.
+    extra_compile_args=[
+        "-std=c++17",
+        "-Wall",
+        "-fno-omit-frame-pointer",
+        *EXTRA_COMPILE_ARGS,
+    ],
     extra_link_args=["-std=c++17", "-lbacktrace", *EXTRA_LINK_ARGS],
     define_macros=DEFINE_MACROS,
     undef_macros=UNDEF_MACROS,
@@ -1,33 +1,45 @@
+from ._allocation_filter import AllocationFilter
+from ._include import get_include
 from ._ipython import load_ipython_extension
 from ._memray import AllocationRecord
 from ._memray import AllocatorType
 from ._memray import Destination
 from ._memray import FileDestination
+from ._memray import FileFormat
 from ._memray import FileReader
+from ._memray import LiveHeapDestination
 from ._memray import MemorySnapshot
 from ._memray import SocketDestination
 from ._memray import SocketReader
+from ._memray import TrackedRegion
 from ._memray import Tracker
 from ._memray import dump_all_records
+from ._memray import get_live_snapshot
 from ._memray import set_log_level
 from ._memray import start_thread_trace
 from ._metadata import Metadata
 from ._version import __version__
 
 __all__ = [
+    "AllocationFilter",
     "AllocationRecord",
     "AllocatorType",
     "MemorySnapshot",
     "dump_all_records",
     "start_thread_trace",
     "Tracker",
+    "TrackedRegion",
     "FileReader",
+    "FileFormat",
     "SocketReader",
     "Destination",
     "FileDestination",
     "SocketDestination",
+    "LiveHeapDestination",
+    "get_live_snapshot",
     "Metadata",
     "__version__",
     "set_log_level",
+    "get_include",
     "load_ipython_extension",
 ]
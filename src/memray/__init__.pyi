@@ -1,3 +1,4 @@
+from memray._allocation_filter import AllocationFilter as AllocationFilter
 from memray._destination import Destination as Destination
 from memray._destination import FileDestination as FileDestination
 from memray._destination import SocketDestination as SocketDestination
@@ -0,0 +1,27 @@
+from dataclasses import dataclass
+from datetime import datetime
+from typing import Optional
+
+
+@dataclass(frozen=True)
+class AllocationFilter:
+    """Which allocations to report on when reading a capture file.
+
+    An allocation is reported only if it passes every check that is set: it
+    was made by the thread with id ``tid``, its size in bytes is between
+    ``min_size`` and ``max_size``, it was made between ``start_time`` and
+    ``end_time``, and one of the Python frames in its stack is in a file
+    whose name contains ``filename``.
+
+    The time of an allocation is that of the latest memory snapshot taken
+    before it, so it's only as precise as the interval between snapshots.
+    The checks are done while the capture is read, so the allocations that
+    don't pass them are never aggregated.
+    """
+
+    tid: Optional[int] = None
+    min_size: int = 0
+    max_size: Optional[int] = None
+    start_time: Optional[datetime] = None
+    end_time: Optional[datetime] = None
+    filename: Optional[str] = None
@@ -0,0 +1,309 @@
+"""Keep the results of analyzing a capture file in a sidecar file next to it.
+
+Reports on the same capture file usually need the same snapshots, so the
+reduced records are stored the first time they are computed together with
+everything needed to show them, and later reports read them back instead of
+replaying the capture file. The sidecar is only used while the size and the
+modification time of the capture file match the ones it was written for.
+"""
+import contextlib
+import json
+import os
+import tempfile
+from datetime import datetime
+from pathlib import Path
+from typing import Any
+from typing import Dict
+from typing import Iterable
+from typing import List
+from typing import Optional
+from typing import Tuple
+from typing import Union
+
+from ._memray import AllocatorType
+from ._memray import size_fmt
+from ._metadata import Metadata
+from ._stats import Stats
+from ._version import __version__
+
+SIDECAR_SUFFIX = ".memray.idx"
+SIDECAR_VERSION = 1
+
+Frame = Tuple[str, str, int]
+
+
+class CachedAllocationRecord:
+    """An allocation record read back from a sidecar file.
+
+    It behaves like the records returned by a FileReader, but its stack
+    traces were resolved when the sidecar was written.
+    """
+
+    __slots__ = (
+        "tid",
+        "address",
+        "size",
+        "allocator",
+        "stack_id",
+        "n_allocations",
+        "thread_name",
+        "_stack",
+        "_native_stack",
+        "_hybrid_stack",
+    )
+
+    def __init__(
+        self,
+        tid: int,
+        address: int,
+        size: int,
+        allocator: AllocatorType,
+        stack_id: int,
+        n_allocations: int,
+        thread_name: str,
+        stack: List[Frame],
+        native_stack: List[Frame],
+        hybrid_stack: Optional[List[Frame]],
+    ) -> None:
+        self.tid = tid
+        self.address = address
+        self.size = size
+        self.allocator = allocator
+        self.stack_id = stack_id
+        self.n_allocations = n_allocations
+        self.thread_name = thread_name
+        self._stack = stack
+        self._native_stack = native_stack
+        self._hybrid_stack = hybrid_stack
+
+    def stack_trace(self, max_stacks: Optional[int] = None) -> List[Frame]:
+        return self._stack[:max_stacks]
+
+    def native_stack_trace(self, max_stacks: Optional[int] = None) -> List[Frame]:
+        return self._native_stack[:max_stacks]
+
+    def hybrid_stack_trace(self, max_stacks: Optional[int] = None) -> List[Frame]:
+        if self._hybrid_stack is None:
+            # Without native frames there is nothing to pair the Python ones with.
+            if self._stack:
+                return [("<unknown stack>", "<unknown>", 0)]
+            return []
+        return self._hybrid_stack[:max_stacks]
+
+    def __repr__(self) -> str:
+        return (
+            f"AllocationRecord<tid={hex(self.tid)}, address={hex(self.address)}, "
+            f"size={'N/A' if not self.size else size_fmt(self.size)}, "
+            f"allocator={self.allocator!r}, allocations={self.n_allocations}>"
+        )
+
+
+class AnalysisCache:
+    def __init__(self, capture_file: Union[str, Path]) -> None:
+        self._path = Path(os.fspath(capture_file) + SIDECAR_SUFFIX)
+        stat = os.stat(capture_file)
+        self._capture = {"size": stat.st_size, "mtime_ns": stat.st_mtime_ns}
+        self._frames: List[Frame] = []
+        self._frame_ids: Dict[Frame, int] = {}
+        self._stacks: List[List[int]] = []
+        self._stack_ids: Dict[Tuple[int, ...], int] = {}
+        self._entries: Dict[str, Any] = {}
+        self._load()
+
+    @property
+    def path(self) -> Path:
+        return self._path
+
+    def _load(self) -> None:
+        try:
+            with open(self._path) as f:
+                contents = json.load(f)
+        except (OSError, ValueError):
+            return
+        if not isinstance(contents, dict) or (
+            contents.get("version") != SIDECAR_VERSION
+            or contents.get("memray_version") != __version__
+            or contents.get("capture") != self._capture
+        ):
+            return
+        self._frames = [tuple(frame) for frame in contents["frames"]]  # type: ignore
+        self._frame_ids = {frame: i for i, frame in enumerate(self._frames)}
+        self._stacks = contents["stacks"]
+        self._stack_ids = {tuple(stack): i for i, stack in enumerate(self._stacks)}
+        self._entries = contents["entries"]
+
+    def _save(self) -> None:
+        contents = {
+            "version": SIDECAR_VERSION,
+            "memray_version": __version__,
+            "capture": self._capture,
+            "frames": self._frames,
+            "stacks": self._stacks,
+            "entries": self._entries,
+        }
+        # Failing to write the sidecar must never fail the report, so errors
+        # (like the capture file being in a read-only directory) are ignored.
+        # The file is replaced atomically so readers never see half of it.
+        with contextlib.suppress(OSError):
+            fd, tmp_path = tempfile.mkstemp(
+                dir=self._path.parent, prefix=self._path.name, suffix=".tmp"
+            )
+            try:
+                with os.fdopen(fd, "w") as f:
+                    json.dump(contents, f, separators=(",", ":"))
+                os.replace(tmp_path, self._path)
+            except BaseException:
+                os.unlink(tmp_path)
+                raise
+
+    def _intern_stack(self, stack: Optional[Iterable[Frame]]) -> int:
+        if stack is None:
+            return -1
+        frame_ids = []
+        for frame in stack:
+            frame = tuple(frame)  # type: ignore
+            frame_id = self._frame_ids.get(frame)
+            if frame_id is None:
+                frame_id = self._frame_ids[frame] = len(self._frames)
+                self._frames.append(frame)
+            frame_ids.append(frame_id)
+        key = tuple(frame_ids)
+        stack_id = self._stack_ids.get(key)
+        if stack_id is None:
+            stack_id = self._stack_ids[key] = len(self._stacks)
+            self._stacks.append(frame_ids)
+        return stack_id
+
+    def _resolve_stack(self, stack_id: int) -> List[Frame]:
+        frames = self._frames
+        return [frames[frame_id] for frame_id in self._stacks[stack_id]]
+
+    def get_reader_state(self) -> Optional[Tuple[int, int, int, List[List[int]]]]:
+        """Get the results of the initial pass of a FileReader.
+
+        Returns the number of allocations, the index and size of the high
+        water mark, and the ``[time, rss, heap]`` memory snapshots.
+        """
+        state = self._entries.get("reader")
+        if state is None:
+            return None
+        return (
+            state["n_allocations"],
+            state["high_watermark_index"],
+            state["peak_memory"],
+            state["memory_snapshots"],
+        )
+
+    def put_reader_state(
+        self,
+        n_allocations: int,
+        high_watermark_index: int,
+        peak_memory: int,
+        memory_snapshots: List[Tuple[int, int, int]],
+    ) -> None:
+        self._entries["reader"] = {
+            "n_allocations": n_allocations,
+            "high_watermark_index": high_watermark_index,
+            "peak_memory": peak_memory,
+            "memory_snapshots": memory_snapshots,
+        }
+        self._save()
+
+    def get_records(self, key: str) -> Optional[List[CachedAllocationRecord]]:
+        records = self._entries.get(f"records:{key}")
+        if records is None:
+            return None
+        return [
+            CachedAllocationRecord(
+                tid,
+                address,
+                size,
+                AllocatorType(allocator),
+                stack_id,
+                n_allocations,
+                thread_name,
+                self._resolve_stack(stack),
+                self._resolve_stack(native_stack) if native_stack >= 0 else [],
+                self._resolve_stack(hybrid_stack) if hybrid_stack >= 0 else None,
+            )
+            for (
+                tid,
+                address,
+                size,
+                allocator,
+                stack_id,
+                n_allocations,
+                thread_name,
+                stack,
+                native_stack,
+                hybrid_stack,
+            ) in records
+        ]
+
+    def put_records(
+        self, key: str, records: Iterable[Any], native_traces: bool
+    ) -> List[Any]:
+        """Store the records of a snapshot, and return them as a list."""
+        records = list(records)
+        self._entries[f"records:{key}"] = [
+            [
+                record.tid,
+                record.address,
+                record.size,
+                int(record.allocator),
+                record.stack_id,
+                record.n_allocations,
+                record.thread_name,
+                self._intern_stack(record.stack_trace()),
+                self._intern_stack(
+                    record.native_stack_trace() if native_traces else None
+                ),
+                self._intern_stack(
+                    record.hybrid_stack_trace() if native_traces else None
+                ),
+            ]
+            for record in records
+        ]
+        self._save()
+        return records
+
+    def get_stats(self, num_largest: int) -> Optional[Stats]:
+        stats = self._entries.get(f"stats:{num_largest}")
+        if stats is None:
+            return None
+        metadata = dict(stats["metadata"])
+        metadata["start_time"] = datetime.fromisoformat(metadata["start_time"])
+        metadata["end_time"] = datetime.fromisoformat(metadata["end_time"])
+        return Stats(
+            metadata=Metadata(**metadata),
+            total_num_allocations=stats["total_num_allocations"],
+            total_memory_allocated=stats["total_memory_allocated"],
+            peak_memory_allocated=stats["peak_memory_allocated"],
+            allocation_count_by_size=dict(stats["allocation_count_by_size"]),
+            allocation_count_by_allocator=stats["allocation_count_by_allocator"],
+            top_locations_by_size=[
+                (tuple(location), size)
+                for location, size in stats["top_locations_by_size"]
+            ],
+            top_locations_by_count=[
+                (tuple(location), count)
+                for location, count in stats["top_locations_by_count"]
+            ],
+        )
+
+    def put_stats(self, num_largest: int, stats: Stats) -> None:
+        metadata = dict(vars(stats.metadata))
+        metadata["start_time"] = stats.metadata.start_time.isoformat()
+        metadata["end_time"] = stats.metadata.end_time.isoformat()
+        self._entries[f"stats:{num_largest}"] = {
+            "metadata": metadata,
+            "total_num_allocations": stats.total_num_allocations,
+            "total_memory_allocated": stats.total_memory_allocated,
+            "peak_memory_allocated": stats.peak_memory_allocated,
+            # JSON objects only have string keys, but these are sizes.
+            "allocation_count_by_size": list(stats.allocation_count_by_size.items()),
+            "allocation_count_by_allocator": stats.allocation_count_by_allocator,
+            "top_locations_by_size": stats.top_locations_by_size,
+            "top_locations_by_count": stats.top_locations_by_count,
+        }
+        self._save()
@@ -45,7 +45,28 @@ class SocketDestination(Destination):
             :ref:`Native Tracking`, because the client on the remote machine
             won't have access to the shared libraries used by the tracked
             process.
+        compress: By default, the records are sent uncompressed. If you
+            provide ``compress=True``, they are compressed with lz4 before
+            being sent, which lets a client on the other end of a slow link
+            keep up with a process that allocates a lot. Clients detect
+            compressed streams on their own.
     """
 
     server_port: int
     address: str = "127.0.0.1"
+    compress: bool = False
+
+
+@dataclass(frozen=True)
+class LiveHeapDestination(Destination):
+    """Keep the live heap of the tracked process in the process itself.
+
+    When a ``LiveHeapDestination`` is passed to the `Tracker` constructor, the
+    records the tracker captures aren't written anywhere. Instead, a
+    background thread of the process reads them as they come and keeps the
+    memory that is still allocated at each location, which
+    `get_live_snapshot` returns at any time while the tracker is active (see
+    :ref:`Live heap queries`). This is meant for services that want to report
+    where their memory goes, e.g. on a debug endpoint, without writing and
+    parsing a capture file.
+    """
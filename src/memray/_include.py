@@ -0,0 +1,10 @@
+import pathlib
+
+
+def get_include() -> str:
+    """Return the directory that holds memray's C header.
+
+    Extension modules that report the allocations of their own allocators to
+    memray include ``memray.h`` from this directory.
+    """
+    return str(pathlib.Path(__file__).parent / "include")
@@ -3,28 +3,86 @@ from pathlib import Path
 from types import FrameType
 from types import TracebackType
 from typing import Any
+from typing import Callable
+from typing import Dict
 from typing import Iterable
 from typing import Iterator
 from typing import List
 from typing import NamedTuple
 from typing import Optional
+from typing import Set
 from typing import Tuple
 from typing import Type
+from typing import TypeVar
 from typing import Union
 from typing import overload
 
 from memray._destination import FileDestination as FileDestination
+from memray._destination import LiveHeapDestination as LiveHeapDestination
 from memray._destination import SocketDestination as SocketDestination
+from memray._allocation_filter import AllocationFilter
 from memray._metadata import Metadata
 from memray._stats import Stats
 
 from . import Destination
 
+_F = TypeVar("_F", bound=Callable[..., Any])
+
 PythonStackElement = Tuple[str, str, int]
 NativeStackElement = Tuple[str, str, int]
 MemorySnapshot = NamedTuple(
     "MemorySnapshot", [("time", int), ("rss", int), ("heap", int)]
 )
+ProfileInterval = NamedTuple(
+    "ProfileInterval",
+    [
+        ("time", int),
+        ("allocated", List[AllocationRecord]),
+        ("freed", List[AllocationRecord]),
+        ("live", List[AllocationRecord]),
+    ],
+)
+AllocationLifetimes = NamedTuple(
+    "AllocationLifetimes",
+    [
+        ("record", AllocationRecord),
+        ("freed", int),
+        ("never_freed", int),
+        ("by_allocations", List[Tuple[int, int]]),
+        ("by_time", List[Tuple[int, int]]),
+    ],
+)
+MemoryCounters = NamedTuple(
+    "MemoryCounters",
+    [
+        ("time", int),
+        ("rss", int),
+        ("pss", int),
+        ("uss", int),
+        ("swap", int),
+        ("cgroup_usage", int),
+        ("minor_faults", int),
+        ("major_faults", int),
+    ],
+)
+TrackerMetrics = NamedTuple(
+    "TrackerMetrics",
+    [
+        ("n_tracked_allocations", int),
+        ("allocation_ns", int),
+        ("n_tracked_deallocations", int),
+        ("deallocation_ns", int),
+        ("n_unwinds", int),
+        ("unwind_ns", int),
+        ("n_records_written", int),
+        ("bytes_written", int),
+        ("n_lock_waits", int),
+        ("lock_wait_ns", int),
+        ("n_flushes", int),
+        ("flush_ns", int),
+        ("max_flush_ns", int),
+    ],
+)
 
 def set_log_level(level: int) -> None: ...
 
@@ -77,27 +135,114 @@ class AllocatorType(enum.IntEnum):
     PYMALLOC_CALLOC: int
     PYMALLOC_REALLOC: int
     PYMALLOC_FREE: int
+    CUSTOM_MALLOC: int
+    CUSTOM_FREE: int
+    PYMALLOC_ARENA_ALLOC: int
+    PYMALLOC_ARENA_FREE: int
+
+class FileFormat(enum.IntEnum):
+    ALL_ALLOCATIONS: int
+    AGGREGATED_ALLOCATIONS: int
 
 def start_thread_trace(frame: FrameType, event: str, arg: Any) -> None: ...
 
+class AllocationSnapshot:
+    def __len__(self) -> int: ...
+    def __iter__(self) -> Iterator[AllocationRecord]: ...
+    @property
+    def total_size(self) -> int: ...
+    @property
+    def total_allocations(self) -> int: ...
+    def thread_ids(self) -> List[int]: ...
+    def aggregate_by_location(
+        self, memory_threshold: float = ...
+    ) -> Optional[Dict[Tuple[str, str], Tuple[int, int, int, Set[int]]]]: ...
+    def build_flame_graph(
+        self,
+        frame_flags: Callable[[PythonStackElement], Tuple[bool, bool]],
+        max_depth: int,
+    ) -> Optional[
+        Tuple[
+            List[PythonStackElement],
+            List[Tuple[int, int, int, int, int, bool, bool]],
+            Dict[int, str],
+        ]
+    ]: ...
+    def table_rows(
+        self,
+    ) -> Optional[List[Tuple[str, int, int, int, Optional[PythonStackElement]]]]: ...
+
+class TemporalIndex:
+    def __len__(self) -> int: ...
+    def live_allocation_records(
+        self, snapshot: int, merge_threads: bool = ...
+    ) -> List[AllocationRecord]: ...
+    def allocation_records_between(
+        self, start: int, end: int, merge_threads: bool = ...
+    ) -> List[AllocationRecord]: ...
+
 class FileReader:
     @property
     def metadata(self) -> Metadata: ...
+    @property
+    def tracker_metrics(self) -> TrackerMetrics: ...
     def __init__(
-        self, file_name: Union[str, Path], *, report_progress: bool = False
+        self,
+        file_name: Union[str, Path],
+        *,
+        report_progress: bool = False,
+        cache_analysis: bool = False,
+        native_symbols_only: bool = False,
     ) -> None: ...
     def get_allocation_records(self) -> Iterable[AllocationRecord]: ...
+    def get_allocation_columns(
+        self, batch_size: int = ...
+    ) -> Iterator[Dict[str, memoryview]]: ...
     def get_high_watermark_allocation_records(
         self,
         merge_threads: bool = ...,
+        *,
+        allocation_filter: Optional[AllocationFilter] = ...,
+        largest: Optional[int] = ...,
     ) -> Iterable[AllocationRecord]: ...
     def get_leaked_allocation_records(
-        self, merge_threads: bool = ...
+        self,
+        merge_threads: bool = ...,
+        *,
+        allocation_filter: Optional[AllocationFilter] = ...,
+        largest: Optional[int] = ...,
     ) -> Iterable[AllocationRecord]: ...
     def get_temporary_allocation_records(
-        self, merge_threads: bool = ..., threshold: int = ...
+        self,
+        merge_threads: bool = ...,
+        threshold: int = ...,
+        *,
+        allocation_filter: Optional[AllocationFilter] = ...,
+        largest: Optional[int] = ...,
     ) -> Iterable[AllocationRecord]: ...
+    def get_snapshot(
+        self,
+        merge_threads: bool = ...,
+        *,
+        leaks: bool = ...,
+        temporary_allocation_threshold: int = ...,
+        allocation_filter: Optional[AllocationFilter] = ...,
+        largest: Optional[int] = ...,
+    ) -> AllocationSnapshot: ...
+    def get_allocation_lifetimes(
+        self, merge_threads: bool = ...
+    ) -> Iterator[AllocationLifetimes]: ...
+    def get_snapshots(
+        self,
+        indices: Optional[Iterable[int]] = ...,
+        *,
+        timestamps: Optional[Iterable[int]] = ...,
+        merge_threads: bool = ...,
+    ) -> Iterator[Tuple[int, List[AllocationRecord]]]: ...
+    def get_temporal_index(self) -> TemporalIndex: ...
     def get_memory_snapshots(self) -> Iterable[MemorySnapshot]: ...
+    def get_memory_counters(self) -> Iterable[MemoryCounters]: ...
+    def get_profile_intervals(self) -> Iterable[ProfileInterval]: ...
     def __enter__(self) -> Any: ...
     def __exit__(
         self,
@@ -114,8 +259,37 @@ def compute_statistics(
     *,
     report_progress: bool = False,
     num_largest: int = 5,
+    cache_analysis: bool = False,
+    allocation_filter: Optional[AllocationFilter] = None,
 ) -> Stats: ...
+def aggregate_allocations_by_location(
+    allocations: Iterable[AllocationRecord], memory_threshold: float
+) -> Optional[Dict[Tuple[str, str], Tuple[int, int, int, Set[int]]]]: ...
+def build_flame_graph(
+    allocations: Iterable[AllocationRecord],
+    frame_flags: Callable[[PythonStackElement], Tuple[bool, bool]],
+    max_depth: int,
+) -> Optional[
+    Tuple[
+        List[PythonStackElement],
+        List[Tuple[int, int, int, int, int, bool, bool]],
+        Dict[int, str],
+    ]
+]: ...
+def encode_pprof_profile(
+    allocations: Iterable[AllocationRecord],
+    native_traces: bool,
+    sample_kind: str,
+    time_nanos: int,
+    duration_nanos: int,
+) -> Optional[bytes]: ...
+def diff_snapshots(
+    before: Iterable[AllocationRecord], after: Iterable[AllocationRecord]
+) -> Optional[List[Tuple[Tuple[PythonStackElement, ...], int, int, int, int]]]: ...
 def dump_all_records(file_name: Union[str, Path]) -> None: ...
+def get_live_snapshot(
+    top: Optional[int] = None, *, merge_threads: bool = True
+) -> List[AllocationRecord]: ...
 
 class SocketReader:
     def __init__(self, port: int) -> None: ...
@@ -150,6 +324,27 @@ class Tracker:
         memory_interval_ms: int = ...,
         follow_fork: bool = ...,
         trace_python_allocators: bool = ...,
+        per_thread_buffers: bool = ...,
+        sampling_interval_bytes: int = ...,
+        file_format: FileFormat = ...,
+        intern_python_stacks: bool = ...,
+        min_allocation_size: int = ...,
+        flight_recorder_size: int = ...,
+        flight_recorder_rss_threshold: int = ...,
+        flight_recorder_signal: int = ...,
+        frame_pointer_unwinding: bool = ...,
+        trace_asyncio_tasks: bool = ...,
+        detailed_memory_counters: bool = ...,
+        measure_overhead: bool = ...,
+        rotation_size: int = ...,
+        rotation_interval_s: int = ...,
+        rotation_max_files: int = ...,
+        profile_interval_ms: int = ...,
+        regions_only: bool = ...,
+        max_python_depth: int = ...,
+        max_native_depth: int = ...,
+        trace_pymalloc_arenas: bool = ...,
+        overhead_budget: float = ...,
     ) -> None: ...
     @overload
     def __init__(
@@ -160,8 +355,31 @@ class Tracker:
         memory_interval_ms: int = ...,
         follow_fork: bool = ...,
         trace_python_allocators: bool = ...,
+        per_thread_buffers: bool = ...,
+        sampling_interval_bytes: int = ...,
+        file_format: FileFormat = ...,
+        intern_python_stacks: bool = ...,
+        min_allocation_size: int = ...,
+        flight_recorder_size: int = ...,
+        flight_recorder_rss_threshold: int = ...,
+        flight_recorder_signal: int = ...,
+        frame_pointer_unwinding: bool = ...,
+        trace_asyncio_tasks: bool = ...,
+        detailed_memory_counters: bool = ...,
+        measure_overhead: bool = ...,
+        rotation_size: int = ...,
+        rotation_interval_s: int = ...,
+        rotation_max_files: int = ...,
+        profile_interval_ms: int = ...,
+        regions_only: bool = ...,
+        max_python_depth: int = ...,
+        max_native_depth: int = ...,
+        trace_pymalloc_arenas: bool = ...,
+        overhead_budget: float = ...,
     ) -> None: ...
     def __enter__(self) -> Any: ...
+    def dump_flight_recorder(self) -> None: ...
+    def get_metrics(self) -> TrackerMetrics: ...
     def __exit__(
         self,
         exctype: Optional[Type[BaseException]],
@@ -169,6 +387,16 @@ class Tracker:
         exctb: Optional[TracebackType],
     ) -> bool: ...
 
+class TrackedRegion:
+    def __enter__(self) -> TrackedRegion: ...
+    def __exit__(
+        self,
+        exctype: Optional[Type[BaseException]],
+        excinst: Optional[BaseException],
+        exctb: Optional[TracebackType],
+    ) -> None: ...
+    def __call__(self, func: _F) -> _F: ...
+
 def greenlet_trace(event: str, args: Any) -> None: ...
 
 class PymallocDomain(enum.IntEnum):
@@ -187,3 +415,8 @@ def get_symbolic_support() -> SymbolicSupport: ...
 
 RTLD_NOW: int
 RTLD_DEFAULT: int
+
+def ptrace_attach_supported() -> bool: ...
+def ptrace_attach(
+    pid: int, library_path: Union[str, Path], port: int, timeout_ms: int
+) -> None: ...
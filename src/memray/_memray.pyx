@@ -1,7 +1,9 @@
 import collections
 import contextlib
+import functools
 import os
 import pathlib
+import signal
 import sys
 
 cimport cython
@@ -17,38 +19,74 @@ from posix.time cimport CLOCK_MONOTONIC
 from posix.time cimport clock_gettime
 from posix.time cimport timespec
 
-from _memray.algorithm cimport count
 from _memray.hooks cimport Allocator
 from _memray.hooks cimport isDeallocator
 from _memray.logging cimport setLogThreshold
 from _memray.native_resolver cimport unwindHere
+from _memray.pipe cimport Pipe
+from _memray.ptrace_attach cimport injectClient as ptraceInjectClient
+from _memray.ptrace_attach cimport isSupported as ptraceAttachIsSupported
+from _memray.record_reader cimport AllocationColumns
+from _memray.record_reader cimport AllocationFilter as _AllocationFilter
 from _memray.record_reader cimport RecordReader
 from _memray.record_reader cimport RecordResult
 from _memray.record_writer cimport RecordWriter
 from _memray.records cimport Allocation as _Allocation
+from _memray.records cimport CaptureSummary
+from _memray.records cimport FileFormat as _FileFormat
+from _memray.records cimport FilteredAllocationTotals
 from _memray.records cimport MemoryRecord
 from _memray.records cimport MemorySnapshot as _MemorySnapshot
+from _memray.records cimport ProfileInterval as _ProfileInterval
+from _memray.records cimport TrackerMetrics as _TrackerMetrics
 from _memray.sink cimport FileSink
 from _memray.sink cimport NullSink
+from _memray.sink cimport PipeSink
 from _memray.sink cimport Sink
 from _memray.sink cimport SocketSink
 from _memray.snapshot cimport AbstractAggregator
+from _memray.snapshot cimport AggregatedCaptureReaggregator
+from _memray.snapshot cimport AllocationLifetimeAggregator
 from _memray.snapshot cimport AllocationStatsAggregator
 from _memray.snapshot cimport HighWatermark
 from _memray.snapshot cimport HighWatermarkFinder
+from _memray.snapshot cimport LocationLifetimes
+from _memray.snapshot cimport ParallelHighWatermarkAggregator
+from _memray.snapshot cimport ParallelSnapshotAggregator
+from _memray.snapshot cimport ParallelTemporaryAllocationsAggregator
 from _memray.snapshot cimport Py_GetSnapshotAllocationRecords
 from _memray.snapshot cimport Py_ListFromSnapshotAllocationRecords
 from _memray.snapshot cimport SnapshotAllocationAggregator
-from _memray.snapshot cimport TemporaryAllocationsAggregator
+from _memray.snapshot cimport SnapshotDiff
+from _memray.snapshot cimport SnapshotDiffAfter
+from _memray.snapshot cimport SnapshotDiffBefore
+from _memray.snapshot cimport TemporalSnapshotAggregator
+from _memray.snapshot cimport getNativeStacks
+from _memray.snapshot cimport largestAllocations
+from _memray.snapshot cimport reduced_snapshot_map_t
+from _memray.snapshot cimport snapshotAllocations
 from _memray.socket_reader_thread cimport BackgroundSocketReader
 from _memray.source cimport FileSource
+from _memray.source cimport PipeSource
 from _memray.source cimport SocketSource
+from _memray.source cimport Source
+from _memray.tracking_api cimport MEMRAY_ALLOCATOR_API_CAPSULE
+from _memray.tracking_api cimport TrackedRegion as NativeTrackedRegion
 from _memray.tracking_api cimport Tracker as NativeTracker
+from _memray.tracking_api cimport TrackerOptions
+from _memray.tracking_api cimport allocator_api
 from _memray.tracking_api cimport begin_tracking_greenlets
 from _memray.tracking_api cimport forget_python_stack
 from _memray.tracking_api cimport handle_greenlet_switch
 from _memray.tracking_api cimport install_trace_function
+from _memray.tracking_api cimport uses_sys_monitoring
 from cpython cimport PyErr_CheckSignals
+from cpython.buffer cimport PyBUF_FORMAT
+from cpython.buffer cimport PyBUF_ND
+from cpython.buffer cimport PyBUF_STRIDES
+from cpython.buffer cimport PyBUF_WRITABLE
+from cpython.pycapsule cimport PyCapsule_New
+from libc.stdint cimport uint8_t
 from libc.stdint cimport uint64_t
 from libcpp cimport bool
 from libcpp.limits cimport numeric_limits
@@ -59,10 +97,12 @@ from libcpp.memory cimport unique_ptr
 from libcpp.string cimport string as cppstring
 from libcpp.unordered_map cimport unordered_map
 from libcpp.utility cimport move
+from libcpp.utility cimport pair
 from libcpp.vector cimport vector
 
 from ._destination import Destination
 from ._destination import FileDestination
+from ._destination import LiveHeapDestination
 from ._destination import SocketDestination
 from ._metadata import Metadata
 from ._stats import Stats
@@ -97,6 +137,10 @@ cpdef enum AllocatorType:
     PYMALLOC_CALLOC = 13
     PYMALLOC_REALLOC = 14
     PYMALLOC_FREE = 15
+    CUSTOM_MALLOC = 16
+    CUSTOM_FREE = 17
+    PYMALLOC_ARENA_ALLOC = 18
+    PYMALLOC_ARENA_FREE = 19
 
 cpdef enum PythonAllocatorType:
     PYTHON_ALLOCATOR_PYMALLOC = 1
@@ -104,6 +148,10 @@ cpdef enum PythonAllocatorType:
     PYTHON_ALLOCATOR_MALLOC = 3
     PYTHON_ALLOCATOR_OTHER = 4
 
+cpdef enum FileFormat:
+    ALL_ALLOCATIONS = 1
+    AGGREGATED_ALLOCATIONS = 2
+
 def size_fmt(num, suffix='B'):
     for unit in ['','K','M','G','T','P','E','Z']:
         if abs(num) < 1024.0:
@@ -115,6 +163,14 @@ def size_fmt(num, suffix='B'):
 
 PYTHON_VERSION = (sys.version_info.major, sys.version_info.minor)
 
+cdef object _thread_name(RecordReader* reader, long tid):
+    if tid == -1:
+        return "merged thread"
+    cdef object name = reader.getThreadName(tid)
+    thread_id = hex(tid)
+    return f"{thread_id} ({name})" if name else f"{thread_id}"
+
+
 @cython.freelist(1024)
 cdef class AllocationRecord:
     cdef object _tuple
@@ -165,9 +221,7 @@ cdef class AllocationRecord:
         if self.tid == -1:
             return "merged thread"
         assert self._reader.get() != NULL, "Cannot get thread name without reader."
-        cdef object name = self._reader.get().getThreadName(self.tid)
-        thread_id = hex(self.tid)
-        return f"{thread_id} ({name})" if name else f"{thread_id}"
+        return _thread_name(self._reader.get(), self.tid)
 
     def stack_trace(self, max_stacks=None):
         assert self._reader.get() != NULL, "Cannot get stack trace without reader."
@@ -201,83 +255,19 @@ cdef class AllocationRecord:
                         self._tuple[6], self._tuple[7], max_stacks)
         return self._native_stack_trace
 
-    cdef _is_eval_frame(self, object symbol):
-        return "_PyEval_EvalFrameDefault" in symbol
-
     def hybrid_stack_trace(self, max_stacks=None):
-        # This function merges a Python stack and a native stack into
-        # a "hybrid" stack. It substitutes _PyFrame_EvalFrameDefault calls in
-        # the native stack with the corresponding frame in the Python stack.
-        # This sounds easy, but there are several tricky aspects:
-        # 1. For the thread that called Tracker.__enter__, we want to hide
-        #    frames (both Python and C) above the one that made that call.
-        #    For other threads we want to keep all frames.
-        # 2. If _PyFrame_EvalFrameDefault allocates memory before calling our
-        #    profile function, we'll have too few Python frames to pair up
-        #    every _PyFrame_EvalFrameDefault call. This happens in 3.11.
-        # 3. Since Python 3.11, one _PyFrame_EvalFrameDefault call can evaluate
-        #    many Python frames. If a frame's is_entry_frame flag is unset, it
-        #    uses the same _PyFrame_EvalFrameDefault call as its caller.
-        # 4. If the interpreter was stripped, we may not be able to recognize
-        #    every (or even any) _PyFrame_EvalFrameDefault call, so we may
-        #    have extra Python frames left after pairing.
-        cdef vector[unsigned char] is_entry_frame
-        python_stack = self._reader.get().Py_GetStackFrameAndEntryInfo(
-            self._tuple[4], &is_entry_frame
-        )
-        native_stack = self.native_stack_trace()
-
-        cdef ssize_t num_non_entry_frames = count(
-            is_entry_frame.begin(), is_entry_frame.end(), 0
-        )
-
-        # Entry frames replace native frames; non-entry frames are inserted.
-        hybrid_stack = [None] * (len(native_stack) + num_non_entry_frames)
-
-        # Both stacks are from most recent to least, but we must pair things up
-        # least recent to most to handle cases where _PyFrame_EvalFrameDefault
-        # allocated memory before calling the profile function.
-        native_stack.reverse()
-        cdef ssize_t pidx = len(python_stack) - 1
-        cdef ssize_t hidx = len(hybrid_stack) - 1
-
-        cdef ssize_t to_skip = 0
-        if self._tuple[0] == self._reader.get().getMainThreadTid():
-            to_skip = self._reader.get().getSkippedFramesOnMainThread()
-        cdef ssize_t first_kept_frame = pidx - to_skip
-
-        for native_frame in native_stack:
-            symbol = native_frame[0]
-            if pidx >= 0 and self._is_eval_frame(symbol):
-                while True:
-                    # If we're not keeping all frames and we've reached the
-                    # first one we want to keep, remove frames above it.
-                    if to_skip != 0 and pidx == first_kept_frame:
-                        del hybrid_stack[hidx + 1:]
-
-                    assert hidx >= 0
-                    hybrid_stack[hidx] = python_stack[pidx]
-                    hidx -= 1
-                    pidx -= 1
-
-                    # Stop when we either run out of Python frames or reach the
-                    # entry frame being evaluated by the next eval loop.
-                    if pidx < 0 or is_entry_frame[pidx]:
-                        break
-            else:
-                assert hidx >= 0
-                hybrid_stack[hidx] = native_frame
-                hidx -= 1
-
-        assert hidx == -1
-        if pidx >= 0:
-            # We ran out of native frames without using up all of our Python
-            # frames. We've seen this happen on stripped interpreters on Alpine
-            # Linux in CI. Presumably this indicates that unwinding failed to
-            # symbolify some of the calls to _PyEval_EvalFrameDefault.
-            return [("<unknown stack>", "<unknown>", 0)]
-
-        return hybrid_stack[:max_stacks]
+        # The Python and native stacks are merged by the reader, which
+        # replaces the calls to the eval loop with the Python frames they ran.
+        assert self._reader.get() != NULL, "Cannot get stack trace without reader."
+        if self.allocator in (AllocatorType.FREE, AllocatorType.MUNMAP):
+            raise NotImplementedError("Stack traces for deallocations aren't captured.")
+        if max_stacks is None:
+            return self._reader.get().Py_GetHybridStackFrame(
+                self._tuple[4], self._tuple[6], self._tuple[7], self._tuple[0]
+            )
+        return self._reader.get().Py_GetHybridStackFrame(
+            self._tuple[4], self._tuple[6], self._tuple[7], self._tuple[0], max_stacks
+        )
 
     def __repr__(self):
         return (f"AllocationRecord<tid={hex(self.tid)}, address={hex(self.address)}, "
@@ -286,6 +276,49 @@ cdef class AllocationRecord:
 
 
 MemorySnapshot = collections.namedtuple("MemorySnapshot", "time rss heap")
+ProfileInterval = collections.namedtuple("ProfileInterval", "time allocated freed live")
+AllocationLifetimes = collections.namedtuple(
+    "AllocationLifetimes", "record freed never_freed by_allocations by_time"
+)
+MemoryCounters = collections.namedtuple(
+    "MemoryCounters",
+    "time rss pss uss swap cgroup_usage minor_faults major_faults",
+)
+TrackerMetrics = collections.namedtuple(
+    "TrackerMetrics",
+    "n_tracked_allocations allocation_ns n_tracked_deallocations deallocation_ns"
+    " n_unwinds unwind_ns n_records_written bytes_written n_lock_waits lock_wait_ns"
+    " n_flushes flush_ns max_flush_ns",
+)
+
+
+cdef class _LiveHeap:
+    """The reader of the records of an active tracker with a LiveHeapDestination."""
+    cdef BackgroundSocketReader* _impl
+    cdef shared_ptr[RecordReader] _reader
+
+    def __cinit__(self):
+        self._impl = NULL
+
+    cdef void start(self, shared_ptr[Pipe] pipe) except *:
+        cdef unique_ptr[Source] source = unique_ptr[Source](new PipeSource(pipe))
+        self._reader = make_shared[RecordReader](move(source))
+        self._impl = new BackgroundSocketReader(self._reader)
+        self._impl.start()
+
+    cdef void stop(self):
+        with nogil:
+            del self._impl
+        self._impl = NULL
+
+    def __dealloc__(self):
+        if self._impl is not NULL:
+            self.stop()
+
+
+# The live heap of the active tracker, if it has a LiveHeapDestination.
+cdef _LiveHeap _live_heap = None
+
 
 cdef class ProfileFunctionGuard:
     def __dealloc__(self):
@@ -321,9 +354,11 @@ cdef class Tracker:
             captured allocations into. This is the only argument that can be
             passed positionally. If not provided, the *destination* keyword
             argument must be provided.
-        destination (FileDestination or SocketDestination): The destination to
-            write captured allocations to. If provided, the *file_name*
-            argument must not be.
+        destination (FileDestination, SocketDestination or LiveHeapDestination):
+            The destination to write captured allocations to. If provided, the
+            *file_name* argument must not be. With a `LiveHeapDestination`,
+            nothing is written out and `get_live_snapshot` reports the memory
+            in use while the tracker is active (see :ref:`Live heap queries`).
         native_traces (bool): Whether or not to capture native stack frames, in
             addition to Python stack frames (see :ref:`Native Tracking`).
             Defaults to False.
@@ -338,14 +373,155 @@ cdef class Tracker:
             memory usage over time that appears at the top of the flame graph,
             for instance. This parameter lets you adjust the frequency between
             updates, though you shouldn't need to change it.
+        per_thread_buffers (bool): Whether or not each thread should collect
+            its records in a buffer of its own, handing them over to a
+            background thread, instead of writing every record to the
+            destination under a lock shared by all threads. This greatly
+            reduces the overhead of tracking programs with many threads that
+            allocate concurrently, at the cost of some extra memory per thread
+            and of records reaching the destination slightly later. Defaults to
+            False.
+        sampling_interval_bytes (int): If non-zero, only record a sample of
+            the allocations, such that on average one allocation is recorded
+            every *sampling_interval_bytes* bytes allocated (see
+            :ref:`Sampling`). Larger allocations are more likely to be
+            recorded, and the sizes and counts reported for the recorded ones
+            are scaled to estimate the allocations that weren't. Deallocations
+            are only recorded for sampled allocations. Defaults to 0, which
+            records every allocation.
+        file_format (FileFormat): The format of the capture file (see
+            :ref:`Aggregated capture files`). By default, every allocation and
+            deallocation is written to the file, which lets any report be
+            generated from it. With ``FileFormat.AGGREGATED_ALLOCATIONS``, the
+            tracked process keeps the memory used by each distinct stack
+            itself and only writes out the memory in use at the high water
+            mark and at the end of tracking, which makes the file much smaller
+            and faster to read but only supports the high water mark and
+            leaks reports. This format requires an output file.
+        intern_python_stacks (bool): Whether or not the tracked process should
+            number each distinct Python call stack itself and record the
+            number of the stack each allocation was made from, instead of
+            recording every function call and return. This makes the capture
+            file smaller and faster to read, especially for deeply recursive
+            code. Defaults to False.
+        min_allocation_size (int): If non-zero, allocations made through
+            ``malloc`` and its related functions, or through the Python
+            allocators, that request fewer than *min_allocation_size* bytes
+            are not recorded individually (see :ref:`Skipping small
+            allocations`). Only the number of such allocations and the bytes
+            they requested are counted, so that the totals reported stay
+            correct, and their deallocations are not recorded either.
+            Defaults to 0, which records every allocation.
+        flight_recorder_size (int): If non-zero, run as a flight recorder
+            (see :ref:`Flight recorder mode`): the records are kept in memory
+            instead of being written to the output file, in a ring that holds
+            roughly the last *flight_recorder_size* bytes of them, and the
+            file is only written when a dump is requested with
+            `dump_flight_recorder`, with *flight_recorder_signal* or by
+            *flight_recorder_rss_threshold*. Each dump replaces the previous
+            one. Python stacks are always interned in this mode (see
+            *intern_python_stacks*). This mode requires an output file.
+            Defaults to 0.
+        flight_recorder_rss_threshold (int): If non-zero, dump the flight
+            recorder whenever the resident set size of the process rises to
+            this many bytes or more. Defaults to 0.
+        flight_recorder_signal (int): If non-zero, dump the flight recorder
+            whenever the process receives this signal, e.g.
+            ``signal.SIGUSR2``. The previous handler of the signal is restored
+            when tracking stops. Defaults to 0.
+        frame_pointer_unwinding (bool): Whether or not native stacks should
+            be unwound by following frame pointers instead of with libunwind
+            (see :ref:`Frame pointer unwinding`). This is much faster, but
+            the native stack of an allocation is cut short at the first
+            function that was compiled without frame pointers. Only supported
+            on x86-64 and AArch64, and ignored elsewhere. This requires
+            *native_traces*. Defaults to False.
+        trace_asyncio_tasks (bool): Whether or not each asyncio task should
+            get a stack of its own (see :ref:`Asyncio task stacks`). The stack
+            of an allocation made by a task then continues with the stack
+            that created the task, instead of with the frames of the event
+            loop, and each task is reported as a separate thread named after
+            it. Defaults to False.
+        detailed_memory_counters (bool): Whether or not to sample the
+            proportional and unique set sizes, the swap usage, the memory
+            usage of the process's cgroup and the number of page faults
+            along with the resident set size (see
+            :ref:`Detailed memory counters`). They're read back with
+            `FileReader.get_memory_counters`. Reading some of them takes the
+            kernel time proportional to the size of the process, so this
+            makes every sample more expensive. Defaults to False.
+        measure_overhead (bool): Whether or not to measure how much time is
+            spent tracking allocations and deallocations and unwinding their
+            native stacks, which `get_metrics` and `FileReader.tracker_metrics`
+            then report along with what the tracker always counts (see
+            :ref:`Tracker overhead metrics`). This reads the clock twice for
+            every allocation, which is a noticeable part of what tracking it
+            costs. Defaults to False.
+        rotation_size (int): If non-zero, start a new output file once the
+            current one holds this many bytes of records (see :ref:`Rotating
+            capture files`). The first file has the name that was given, and
+            the following ones have ``.part1``, ``.part2`` and so on appended
+            to it. Every file starts with the frames, stacks, thread names
+            and memory maps seen so far, so that each of them can be read and
+            reported on by itself, and only holds the allocations made while
+            it was being written. Python stacks are always interned in this
+            mode (see *intern_python_stacks*). This mode requires an output
+            file. Defaults to 0.
+        rotation_interval_s (int): If non-zero, start a new output file once
+            the current one was started this many seconds ago, in the same
+            way as for *rotation_size*. Both can be combined. Defaults to 0.
+        rotation_max_files (int): If non-zero, remove the oldest output files
+            so that no more than this many of them are kept, including the
+            one being written. Defaults to 0, which keeps all of them.
+        profile_interval_ms (int): If non-zero, write out what every stack
+            allocated and freed in each interval of this many milliseconds,
+            and how much of it is live at its end, as the capture goes (see
+            :ref:`Profile intervals`). Only the stacks whose allocations
+            changed in an interval are written for it, and the output file is
+            flushed after each one, so they can be followed while the tracked
+            process runs. They're read back with
+            `FileReader.get_profile_intervals`. This requires
+            ``FileFormat.AGGREGATED_ALLOCATIONS``. Defaults to 0.
+        regions_only (bool): Whether or not to only record the allocations
+            made by a thread while it is inside a `TrackedRegion` (see
+            :ref:`Tracked regions`). Allocations made outside of any region
+            cost a single check of a thread-local flag, and their
+            deallocations are not recorded. Defaults to False.
+        max_python_depth (int): If non-zero, only keep the innermost this
+            many Python frames of each stack, below a single ``<truncated>``
+            frame standing for all of the others (see :ref:`Limiting stack
+            depth`). Python stacks are always interned in this mode (see
+            *intern_python_stacks*). Defaults to 0, which keeps every frame.
+        max_native_depth (int): If non-zero, stop unwinding the native stack
+            of an allocation after its innermost this many frames, and report
+            a single ``<truncated>`` frame for the rest in the same way. This
+            requires *native_traces*. Defaults to 0, which keeps every frame.
+        trace_pymalloc_arenas (bool): Whether or not to record the arenas
+            that pymalloc allocates its pools of small objects from, as
+            ``PYMALLOC_ARENA_ALLOC`` and ``PYMALLOC_ARENA_FREE`` allocations
+            (see :ref:`Tracking pymalloc arenas`). This shows which code
+            makes the memory used by small Python objects grow at a tiny
+            fraction of the cost of *trace_python_allocators*, with which it
+            can't be combined. Ignored, with a warning, if pymalloc isn't the
+            Python allocator. Defaults to False.
+        overhead_budget (float): If non-zero, the percentage of one CPU's
+            time that tracking may take (see :ref:`Overhead budget`). Once a
+            second, the tracker compares what the allocator hooks and writing
+            the records cost against it. It samples allocations, starting from
+            *sampling_interval_bytes*, with a larger interval while tracking
+            takes more than its budget, and a smaller one again once it takes
+            well under it. Every change is recorded in the capture, so the
+            reported sizes and counts are scaled by the interval each
+            allocation was sampled with. Defaults to 0, which never changes
+            the sampling interval.
     """
-    cdef bool _native_traces
-    cdef unsigned int _memory_interval_ms
-    cdef bool _follow_fork
-    cdef bool _trace_python_allocators
+    cdef TrackerOptions _options
+    cdef bool _per_thread_buffers
+    cdef bool _rotating
     cdef object _previous_profile_func
     cdef object _previous_thread_profile_func
     cdef unique_ptr[RecordWriter] _writer
+    cdef shared_ptr[Pipe] _live_heap_pipe
 
     cdef unique_ptr[Sink] _make_writer(self, destination) except*:
         # Creating a Sink can raise Python exceptions (if is interrupted by signal
@@ -363,31 +539,137 @@ cdef class Tracker:
                                                  destination.compress_on_exit))
 
         elif isinstance(destination, SocketDestination):
-            return unique_ptr[Sink](new SocketSink(destination.address, destination.server_port))
+            return unique_ptr[Sink](new SocketSink(destination.address,
+                                                   destination.server_port,
+                                                   destination.compress))
+        elif isinstance(destination, LiveHeapDestination):
+            self._live_heap_pipe = make_shared[Pipe]()
+            return unique_ptr[Sink](new PipeSink(self._live_heap_pipe))
         else:
-            raise TypeError("destination must be a SocketDestination or FileDestination")
+            raise TypeError(
+                "destination must be a SocketDestination, FileDestination"
+                " or LiveHeapDestination"
+            )
 
     def __cinit__(self, object file_name=None, *, object destination=None,
                   bool native_traces=False, unsigned int memory_interval_ms = 10,
-                  bool follow_fork=False, bool trace_python_allocators=False):
+                  bool follow_fork=False, bool trace_python_allocators=False,
+                  bool per_thread_buffers=False, size_t sampling_interval_bytes=0,
+                  FileFormat file_format=FileFormat.ALL_ALLOCATIONS,
+                  bool intern_python_stacks=False, size_t min_allocation_size=0,
+                  size_t flight_recorder_size=0, size_t flight_recorder_rss_threshold=0,
+                  int flight_recorder_signal=0, bool frame_pointer_unwinding=False,
+                  bool trace_asyncio_tasks=False, bool detailed_memory_counters=False,
+                  bool measure_overhead=False, size_t rotation_size=0,
+                  unsigned int rotation_interval_s=0, size_t rotation_max_files=0,
+                  size_t profile_interval_ms=0, bool regions_only=False,
+                  size_t max_python_depth=0, size_t max_native_depth=0,
+                  bool trace_pymalloc_arenas=False, double overhead_budget=0):
         if (file_name, destination).count(None) != 1:
             raise TypeError("Exactly one of 'file_name' or 'destination' argument must be specified")
 
         cdef cppstring command_line = " ".join(sys.argv)
-        self._native_traces = native_traces
-        self._memory_interval_ms = memory_interval_ms
-        self._follow_fork = follow_fork
-        self._trace_python_allocators = trace_python_allocators
+        self._options.native_traces = native_traces
+        self._options.memory_interval = memory_interval_ms
+        self._options.follow_fork = follow_fork
+        self._options.trace_python_allocators = trace_python_allocators
+        self._options.sampling_interval = sampling_interval_bytes
+        self._options.intern_python_stacks = intern_python_stacks
+        self._options.min_allocation_size = min_allocation_size
+        self._options.flight_recorder_size = flight_recorder_size
+        self._options.flight_recorder_rss_threshold = flight_recorder_rss_threshold
+        self._options.flight_recorder_signal = flight_recorder_signal
+        self._options.frame_pointer_unwinding = frame_pointer_unwinding
+        self._options.trace_asyncio_tasks = trace_asyncio_tasks
+        self._options.detailed_memory_counters = detailed_memory_counters
+        self._options.measure_overhead = measure_overhead
+        self._options.regions_only = regions_only
+        self._options.max_python_depth = max_python_depth
+        self._options.max_native_depth = max_native_depth
+        self._options.trace_pymalloc_arenas = trace_pymalloc_arenas
+        self._options.overhead_budget = overhead_budget / 100
+        self._per_thread_buffers = per_thread_buffers
 
         if file_name is not None:
             destination = FileDestination(path=file_name)
 
         if follow_fork and not isinstance(destination, FileDestination):
             raise RuntimeError("follow_fork requires an output file")
+        if (
+            file_format == FileFormat.AGGREGATED_ALLOCATIONS
+            and not isinstance(destination, FileDestination)
+        ):
+            raise RuntimeError("The aggregated file format requires an output file")
+        if (
+            flight_recorder_rss_threshold or flight_recorder_signal
+        ) and not flight_recorder_size:
+            raise ValueError("The flight recorder triggers require a flight_recorder_size")
+        if flight_recorder_size:
+            if not isinstance(destination, FileDestination):
+                raise RuntimeError("The flight recorder requires an output file")
+            if file_format == FileFormat.AGGREGATED_ALLOCATIONS:
+                raise ValueError(
+                    "The flight recorder can't write the aggregated file format"
+                )
+            if per_thread_buffers:
+                raise ValueError("The flight recorder can't use per-thread buffers")
+        if flight_recorder_signal:
+            # Raises a ValueError if this is not a valid signal number.
+            signal.Signals(flight_recorder_signal)
+        if frame_pointer_unwinding and not native_traces:
+            raise ValueError("Frame pointer unwinding requires native_traces")
+        if max_native_depth and not native_traces:
+            raise ValueError("max_native_depth requires native_traces")
+        if trace_pymalloc_arenas and trace_python_allocators:
+            # Every object would be counted once more in its arena.
+            raise ValueError(
+                "trace_pymalloc_arenas can't be combined with trace_python_allocators"
+            )
+        if not 0 <= overhead_budget < 100:
+            raise ValueError("overhead_budget must be a percentage below 100")
+        self._rotating = bool(rotation_size or rotation_interval_s)
+        if rotation_max_files and not self._rotating:
+            raise ValueError(
+                "rotation_max_files requires a rotation_size or a rotation_interval_s"
+            )
+        if self._rotating:
+            if not isinstance(destination, FileDestination):
+                raise RuntimeError("Rotating the output requires an output file")
+            if file_format == FileFormat.AGGREGATED_ALLOCATIONS:
+                raise ValueError("Rotating the output can't use the aggregated file format")
+            if per_thread_buffers:
+                raise ValueError("Rotating the output can't use per-thread buffers")
+            if flight_recorder_size:
+                raise ValueError("The flight recorder can't rotate its output")
+            # Every file must be readable without the frame pushes and pops
+            # written to the ones before it.
+            self._options.intern_python_stacks = True
+        if profile_interval_ms and file_format != FileFormat.AGGREGATED_ALLOCATIONS:
+            raise ValueError("Profile intervals require the aggregated file format")
 
         self._writer = make_unique[RecordWriter](
-                move(self._make_writer(destination)), command_line, native_traces
+                move(self._make_writer(destination)),
+                command_line,
+                native_traces,
+                per_thread_buffers,
+                <_FileFormat>file_format,
             )
+        if (
+            isinstance(destination, FileDestination)
+            and file_format == FileFormat.ALL_ALLOCATIONS
+            and not per_thread_buffers
+            and not flight_recorder_size
+            and not self._rotating
+        ):
+            self._writer.get().enableCaptureSummary()
+        if self._rotating:
+            self._writer.get().enableRotation(
+                rotation_size,
+                <size_t>rotation_interval_s * 1000,
+                rotation_max_files,
+            )
+        if profile_interval_ms:
+            self._writer.get().enableProfileIntervals(profile_interval_ms)
 
     @cython.profile(False)
     def __enter__(self):
@@ -407,22 +689,112 @@ cdef class Tracker:
         if "greenlet._greenlet" in sys.modules:
             begin_tracking_greenlets()
 
-        NativeTracker.createTracker(
-            move(writer),
-            self._native_traces,
-            self._memory_interval_ms,
-            self._follow_fork,
-            self._trace_python_allocators,
-        )
+        NativeTracker.createTracker(move(writer), self._options)
+        if self._live_heap_pipe != NULL:
+            # The header was handed over to the pipe when the tracker started,
+            # so reading it right away doesn't wait on anything.
+            global _live_heap
+            live_heap = _LiveHeap()
+            live_heap.start(self._live_heap_pipe)
+            _live_heap = live_heap
+        if uses_sys_monitoring():
+            # New threads are followed without a profile function.
+            threading.setprofile(self._previous_thread_profile_func)
         return self
 
+    def dump_flight_recorder(self):
+        """Write what the flight recorder holds to the output file.
+
+        The file is replaced by a capture file containing the records kept in
+        the ring, which can be read and reported on like any other while the
+        tracker keeps running.
+
+        Raises:
+            RuntimeError: If the tracker isn't an active flight recorder.
+            OSError: If the output file couldn't be written.
+        """
+        if not self._options.flight_recorder_size:
+            raise RuntimeError("This tracker is not a flight recorder")
+        if self._writer != NULL or NativeTracker.getTracker() == NULL:
+            raise RuntimeError("The tracker is not active")
+        if not NativeTracker.dumpFlightRecorder():
+            raise OSError("Failed to dump the flight recorder")
+
+    def get_metrics(self):
+        """Get what tracking has cost the process so far.
+
+        The times spent tracking allocations and deallocations and unwinding
+        native stacks are only measured when the tracker was created with
+        ``measure_overhead=True``, and are 0 otherwise. Times are in
+        nanoseconds.
+
+        Returns:
+            TrackerMetrics: The metrics of the tracker.
+
+        Raises:
+            RuntimeError: If the tracker isn't active.
+        """
+        cdef _TrackerMetrics metrics
+        if self._writer != NULL or not NativeTracker.getMetrics(&metrics):
+            raise RuntimeError("The tracker is not active")
+        cdef object fields = metrics
+        return TrackerMetrics(**fields)
+
     @cython.profile(False)
     def __exit__(self, exc_type, exc_value, exc_traceback):
+        global _live_heap
         NativeTracker.destroyTracker()
+        if _live_heap is not None:
+            _live_heap.stop()
+            _live_heap = None
         sys.setprofile(self._previous_profile_func)
         threading.setprofile(self._previous_thread_profile_func)
 
 
+cdef class TrackedRegion:
+    """Context manager and decorator marking code whose allocations are tracked.
+
+    When the active `Tracker` was created with ``regions_only=True``, only the
+    allocations made by a thread while it runs the body of a ``with`` block
+    using a `TrackedRegion`, or a function decorated with one, are recorded::
+
+        with memray.Tracker("output.bin", regions_only=True):
+            ...
+            with memray.TrackedRegion():
+                handle_request()
+
+    Entering and leaving a region only sets a thread-local flag, so the
+    tracker can stay active for the whole life of the process while only
+    small parts of it are tracked. Regions can be nested, and only apply to
+    the thread that entered them: threads started inside of a region are not
+    tracked unless they enter a region themselves. Since asyncio tasks share
+    the thread of their event loop, a region entered by one of them also
+    covers the other tasks that run until it is left.
+    """
+
+    def __enter__(self):
+        NativeTrackedRegion.enter()
+        return self
+
+    def __exit__(self, exc_type, exc_value, exc_traceback):
+        NativeTrackedRegion.exit()
+
+    def __call__(self, func):
+        @functools.wraps(func)
+        def wrapper(*args, **kwargs):
+            NativeTrackedRegion.enter()
+            try:
+                return func(*args, **kwargs)
+            finally:
+                NativeTrackedRegion.exit()
+
+        return wrapper
+
+
+# Looked up by extension modules through memray.h.
+_allocator_api = PyCapsule_New(<void*>allocator_api(), MEMRAY_ALLOCATOR_API_CAPSULE, NULL)
+
+
 def start_thread_trace(frame, event, arg):
     if event in {"call", "c_call"}:
         install_trace_function()
@@ -466,9 +838,313 @@ cdef _create_metadata(header, peak_memory):
         pid=header["pid"],
         python_allocator=allocator_id_to_name[header["python_allocator"]],
         has_native_traces=header["native_traces"],
+        sampling_interval_bytes=header["sampling_interval"],
+        min_allocation_size=header["min_allocation_size"],
     )
 
 
+cdef _AllocationFilter _native_allocation_filter(allocation_filter) except *:
+    cdef _AllocationFilter native_filter
+    if allocation_filter.tid is not None:
+        native_filter.has_tid = True
+        native_filter.tid = allocation_filter.tid
+    native_filter.min_size = allocation_filter.min_size
+    if allocation_filter.max_size is not None:
+        native_filter.max_size = allocation_filter.max_size
+    if allocation_filter.start_time is not None:
+        native_filter.start_time = int(allocation_filter.start_time.timestamp() * 1000)
+    if allocation_filter.end_time is not None:
+        native_filter.end_time = int(allocation_filter.end_time.timestamp() * 1000)
+    if allocation_filter.filename:
+        native_filter.filename = allocation_filter.filename.encode()
+    return native_filter
+
+
+cdef class _AllocationColumn:
+    """A column of a batch of allocation records, as a read-only buffer."""
+    cdef shared_ptr[AllocationColumns] _columns
+    cdef const void* _data
+    cdef const char* _format
+    cdef Py_ssize_t _itemsize
+    cdef Py_ssize_t _shape[1]
+
+    def __getbuffer__(self, Py_buffer* buffer, int flags):
+        if flags & PyBUF_WRITABLE:
+            raise BufferError("allocation columns are read-only")
+        buffer.buf = <void*> self._data
+        buffer.obj = self
+        buffer.len = self._shape[0] * self._itemsize
+        buffer.readonly = 1
+        buffer.itemsize = self._itemsize
+        buffer.format = <char*> self._format if flags & PyBUF_FORMAT else NULL
+        buffer.ndim = 1
+        buffer.shape = self._shape if flags & PyBUF_ND else NULL
+        if (flags & PyBUF_STRIDES) == PyBUF_STRIDES:
+            buffer.strides = &self._itemsize
+        else:
+            buffer.strides = NULL
+        buffer.suboffsets = NULL
+        buffer.internal = NULL
+
+    def __releasebuffer__(self, Py_buffer* buffer):
+        pass
+
+
+cdef object _allocation_column(
+    shared_ptr[AllocationColumns] columns,
+    const void* data,
+    Py_ssize_t itemsize,
+    const char* format,
+):
+    cdef _AllocationColumn column = _AllocationColumn.__new__(_AllocationColumn)
+    # The column keeps the whole batch alive, since its data is still there.
+    column._columns = columns
+    column._data = data
+    column._format = format
+    column._itemsize = itemsize
+    column._shape[0] = columns.get().length()
+    return memoryview(column)
+
+
+cdef dict _allocation_columns_batch(shared_ptr[AllocationColumns] columns):
+    cdef AllocationColumns* batch = columns.get()
+    return {
+        "tid": _allocation_column(columns, batch.tid.data(), sizeof(uint64_t), b"Q"),
+        "address": _allocation_column(
+            columns, batch.address.data(), sizeof(uint64_t), b"Q"
+        ),
+        "size": _allocation_column(columns, batch.size.data(), sizeof(uint64_t), b"Q"),
+        "allocator": _allocation_column(
+            columns, batch.allocator.data(), sizeof(uint8_t), b"B"
+        ),
+        "stack_id": _allocation_column(
+            columns, batch.stack_id.data(), sizeof(uint64_t), b"Q"
+        ),
+        "n_allocations": _allocation_column(
+            columns, batch.n_allocations.data(), sizeof(uint64_t), b"Q"
+        ),
+    }
+
+
+cdef list _records_from_snapshot(
+    const reduced_snapshot_map_t& snapshot,
+    shared_ptr[RecordReader] reader_sp,
+    bool native_traces,
+):
+    if native_traces:
+        reader_sp.get().resolveNativeStacks(getNativeStacks(snapshot))
+
+    cdef list records = []
+    for elem in Py_ListFromSnapshotAllocationRecords(snapshot):
+        alloc = AllocationRecord(elem)
+        (<AllocationRecord> alloc)._reader = reader_sp
+        records.append(alloc)
+    return records
+
+
+cdef object _record_from_allocation(
+    _Allocation allocation,
+    shared_ptr[RecordReader] reader_sp,
+):
+    alloc = AllocationRecord(allocation.toPythonObject())
+    (<AllocationRecord> alloc)._reader = reader_sp
+    return alloc
+
+
+cdef object _flame_graph(
+    shared_ptr[RecordReader] reader,
+    const vector[_Allocation]& allocations,
+    frame_flags,
+    size_t max_depth,
+):
+    frames, nodes = reader.get().Py_BuildFlameGraph(allocations, frame_flags, max_depth)
+    thread_names = {
+        tid: _thread_name(reader.get(), tid) for tid in {node[1] for node in nodes[1:]}
+    }
+    return frames, nodes, thread_names
+
+
+cdef class AllocationSnapshot:
+    """The locations of a snapshot of the heap, as `FileReader.get_snapshot`
+    returns them.
+
+    Iterating over it gives an `AllocationRecord` for every location, like
+    the ``get_*_allocation_records`` methods of `FileReader` do. The
+    reporters aggregate it with its methods instead, which work on the
+    reader's own records and only build the Python objects of the result.
+    Those return None if the snapshot was loaded from the analysis cache,
+    which only keeps the records.
+    """
+    cdef vector[_Allocation] _allocations
+    cdef shared_ptr[RecordReader] _reader
+    cdef bool _native_traces
+    cdef object _records
+
+    def __len__(self):
+        if self._records is not None:
+            return len(self._records)
+        return self._allocations.size()
+
+    def __iter__(self):
+        if self._records is not None:
+            return iter(self._records)
+        cdef list records = []
+        cdef size_t i
+        for i in range(self._allocations.size()):
+            records.append(_record_from_allocation(self._allocations[i], self._reader))
+        return iter(records)
+
+    @property
+    def total_size(self):
+        """The memory allocated by all the locations."""
+        if self._records is not None:
+            return sum(record.size for record in self._records)
+        cdef size_t total = 0
+        cdef size_t i
+        for i in range(self._allocations.size()):
+            total += self._allocations[i].size
+        return total
+
+    @property
+    def total_allocations(self):
+        """The number of allocations made by all the locations."""
+        if self._records is not None:
+            return sum(record.n_allocations for record in self._records)
+        cdef size_t total = 0
+        cdef size_t i
+        for i in range(self._allocations.size()):
+            total += self._allocations[i].n_allocations
+        return total
+
+    def thread_ids(self):
+        """Get the distinct thread ids of the locations, in snapshot order."""
+        if self._records is not None:
+            return list(dict.fromkeys(record.tid for record in self._records))
+        cdef list tids = []
+        cdef set seen = set()
+        cdef size_t i
+        for i in range(self._allocations.size()):
+            tid = self._allocations[i].tid
+            if tid not in seen:
+                seen.add(tid)
+                tids.append(tid)
+        return tids
+
+    def aggregate_by_location(self, double memory_threshold=float("inf")):
+        """Aggregate the Python stacks of the locations by (function, file).
+
+        Returns a dict mapping every location to a tuple of its own memory,
+        total memory, allocation count and set of thread ids, the way the
+        TUI's ``aggregate_allocations()`` computes them, or None.
+        """
+        if self._records is not None:
+            return None
+        return self._reader.get().Py_AggregateByLocation(
+            self._allocations, memory_threshold
+        )
+
+    def build_flame_graph(self, frame_flags, size_t max_depth):
+        """Build the nodes of a flame graph of the Python stacks of the
+        locations, as the module level ``build_flame_graph()`` does, or
+        return None.
+        """
+        if self._records is not None:
+            return None
+        return _flame_graph(self._reader, self._allocations, frame_flags, max_depth)
+
+    def table_rows(self):
+        """Get a ``(thread name, size, allocator, n_allocations, frame)``
+        tuple for every location, where the frame is the innermost one of
+        its stack (hybrid if the capture has native traces) or None if its
+        stack is empty. Returns None if the snapshot has no reader.
+        """
+        if self._records is not None:
+            return None
+        cdef RecordReader* reader = self._reader.get()
+        cdef list rows = []
+        cdef _Allocation allocation
+        cdef size_t i
+        for i in range(self._allocations.size()):
+            allocation = self._allocations[i]
+            if self._native_traces:
+                frames = reader.Py_GetHybridStackFrame(
+                    allocation.frame_index,
+                    allocation.native_frame_id,
+                    allocation.native_segment_generation,
+                    allocation.tid,
+                    1,
+                )
+            else:
+                frames = reader.Py_GetStackFrame(allocation.frame_index, 1)
+            rows.append(
+                (
+                    _thread_name(reader, allocation.tid),
+                    allocation.size,
+                    <int>allocation.allocator,
+                    allocation.n_allocations,
+                    frames[0] if frames else None,
+                )
+            )
+        return rows
+
+
+cdef AllocationSnapshot _snapshot_from_map(
+    const reduced_snapshot_map_t& snapshot,
+    shared_ptr[RecordReader] reader_sp,
+    bool native_traces,
+):
+    if native_traces:
+        reader_sp.get().resolveNativeStacks(getNativeStacks(snapshot))
+
+    cdef AllocationSnapshot result = AllocationSnapshot.__new__(AllocationSnapshot)
+    result._allocations = snapshotAllocations(snapshot)
+    result._reader = reader_sp
+    result._native_traces = native_traces
+    return result
+
+
+cdef AllocationSnapshot _snapshot_from_records(list records):
+    cdef AllocationSnapshot result = AllocationSnapshot.__new__(AllocationSnapshot)
+    result._records = records
+    return result
+
+
+cdef class TemporalIndex:
+    """The heap of a capture over time, built in a single pass over it.
+
+    Snapshot ``i`` is the heap when the ``i``-th memory snapshot (as yielded
+    by `FileReader.get_memory_snapshots`) was taken, and the last snapshot,
+    one past those, is the heap at the end of the capture.
+    """
+    cdef unique_ptr[TemporalSnapshotAggregator] _aggregator
+    cdef shared_ptr[RecordReader] _reader
+    cdef bool _native_traces
+
+    def __len__(self):
+        return self._aggregator.get().numSnapshots()
+
+    def live_allocation_records(self, size_t snapshot, bool merge_threads=True):
+        """Get the allocations that were alive when a snapshot was taken."""
+        return _records_from_snapshot(
+            self._aggregator.get().liveAt(snapshot, merge_threads),
+            self._reader,
+            self._native_traces,
+        )
+
+    def allocation_records_between(
+        self, size_t start, size_t end, bool merge_threads=True
+    ):
+        """Get the allocations made after one snapshot and up to another.
+
+        Allocations that were freed again before the end snapshot count too.
+        """
+        return _records_from_snapshot(
+            self._aggregator.get().allocatedBetween(start, end, merge_threads),
+            self._reader,
+            self._native_traces,
+        )
+
+
 cdef class ProgressIndicator:
     cdef bool _report_progress
     cdef object _indicator
@@ -566,8 +1242,11 @@ cdef class FileReader:
     cdef HighWatermark _high_watermark
     cdef object _header
     cdef bool _report_progress
+    cdef bool _native_symbols_only
+    cdef object _cache
 
-    def __cinit__(self, object file_name, *, bool report_progress=False):
+    def __cinit__(self, object file_name, *, bool report_progress=False,
+                  bool cache_analysis=False, bool native_symbols_only=False):
         try:
             self._file = open(file_name)
         except OSError as exc:
@@ -578,6 +1257,7 @@ cdef class FileReader:
         ELSE:
             self._path = str(file_name)
         self._report_progress = report_progress
+        self._native_symbols_only = native_symbols_only
 
         # Initial pass to populate _header, _high_watermark, and _memory_snapshots.
         cdef shared_ptr[RecordReader] reader_sp = make_shared[RecordReader](
@@ -589,6 +1269,43 @@ cdef class FileReader:
         self._header = reader.getHeader()
         stats = self._header["stats"]
 
+        if cache_analysis:
+            # Imported here, because the cache needs this module's types.
+            from ._analysis_cache import AnalysisCache
+            self._cache = AnalysisCache(file_name)
+
+        # Files written by a tracker that saw every record in order end with a
+        # summary of what this pass would compute, so it can be skipped.
+        cdef CaptureSummary summary
+        if not self._is_aggregated() and self._header["summary_offset"]:
+            if reader.readCaptureSummary(&summary):
+                self._high_watermark.index = summary.peak_index
+                self._high_watermark.peak_memory = summary.peak_memory
+                self._memory_snapshots = summary.memory_snapshots
+                stats["n_allocations"] = (
+                    summary.n_allocations + summary.filtered_allocations.n_allocations
+                )
+                return
+            # The reader may have skipped past the records, so start over.
+            reader_sp = make_shared[RecordReader](
+                unique_ptr[FileSource](new FileSource(self._path)),
+                False
+            )
+            reader = reader_sp.get()
+
+        if self._cache is not None:
+            state = self._cache.get_reader_state()
+            if state is not None:
+                n_allocations, index, peak_memory, memory_snapshots = state
+                self._high_watermark.index = index
+                self._high_watermark.peak_memory = peak_memory
+                for ms_since_epoch, rss, heap in memory_snapshots:
+                    self._memory_snapshots.push_back(
+                        _MemorySnapshot(ms_since_epoch, rss, heap)
+                    )
+                stats["n_allocations"] = n_allocations
+                return
+
         n_memory_snapshots_approx = 2048
         if 0 < stats["start_time"] < stats["end_time"]:
             n_memory_snapshots_approx = (stats["end_time"] - stats["start_time"]) / 10
@@ -596,6 +1313,7 @@ cdef class FileReader:
 
         cdef object total = stats['n_allocations'] or None
         cdef HighWatermarkFinder finder
+        cdef size_t aggregated_peak_memory = 0
 
         cdef ProgressIndicator progress_indicator = ProgressIndicator(
             "Calculating high watermark",
@@ -610,6 +1328,11 @@ cdef class FileReader:
                 if ret == RecordResult.RecordResultAllocationRecord:
                     finder.processAllocation(reader.getLatestAllocation())
                     progress_indicator.update(1)
+                elif ret == RecordResult.RecordResultAggregatedAllocationRecord:
+                    aggregated_peak_memory += (
+                        reader.getLatestAggregatedAllocation()
+                        .contributionToHighWaterMark().size
+                    )
                 elif ret == RecordResult.RecordResultMemoryRecord:
                     memory_record = reader.getLatestMemoryRecord()
                     self._memory_snapshots.push_back(
@@ -621,8 +1344,24 @@ cdef class FileReader:
                     )
                 else:
                     break
-        self._high_watermark = finder.getHighWatermark()
-        stats["n_allocations"] = progress_indicator.num_processed
+        if self._is_aggregated():
+            # The tracked process found the peak, and counted the allocations.
+            self._high_watermark.peak_memory = aggregated_peak_memory
+        else:
+            self._high_watermark = finder.getHighWatermark()
+            stats["n_allocations"] = progress_indicator.num_processed
+        stats["n_allocations"] += reader.getFilteredAllocationTotals().n_allocations
+
+        if self._cache is not None:
+            self._cache.put_reader_state(
+                stats["n_allocations"],
+                self._high_watermark.index,
+                self._high_watermark.peak_memory,
+                [
+                    (snapshot.ms_since_epoch, snapshot.rss, snapshot.heap)
+                    for snapshot in self._memory_snapshots
+                ],
+            )
 
     def __dealloc__(self):
         self.close()
@@ -637,6 +1376,15 @@ cdef class FileReader:
         if self._file is None:
             raise ValueError("Operation on a closed FileReader")
 
+    cdef bool _is_aggregated(self):
+        return self._header["file_format"] == FileFormat.AGGREGATED_ALLOCATIONS
+
+    cdef void _ensure_not_aggregated(self, str operation) except *:
+        if self._is_aggregated():
+            raise NotImplementedError(
+                f"Can't {operation} from an aggregated capture file"
+            )
+
     @property
     def closed(self):
         return self._file is None
@@ -647,21 +1395,38 @@ cdef class FileReader:
     def __exit__(self, exc_type, exc_value, exc_traceback):
         self.close()
 
-    def _aggregate_allocations(self, size_t records_to_process, bool merge_threads,
-                               size_t temporary_buffer_size=0):
+    def _aggregate_allocations(self, *args, **kwargs):
+        yield from self._aggregate_snapshot(*args, **kwargs)
+
+    def _aggregate_snapshot(self, size_t records_to_process, bool merge_threads,
+                            size_t temporary_buffer_size=0,
+                            bool high_watermark=False,
+                            allocation_filter=None,
+                            size_t largest=0):
         cdef unique_ptr[AbstractAggregator] the_aggregator
         if temporary_buffer_size:
             the_aggregator.reset(
-                new TemporaryAllocationsAggregator(temporary_buffer_size)
+                new ParallelTemporaryAllocationsAggregator(temporary_buffer_size)
             )
+        elif high_watermark:
+            the_aggregator.reset(new ParallelHighWatermarkAggregator())
         else:
-            the_aggregator.reset(new SnapshotAllocationAggregator())
+            the_aggregator.reset(new ParallelSnapshotAggregator())
         cdef AbstractAggregator* aggregator = the_aggregator.get()
 
+        # Finding temporary allocations is the only aggregation that copes
+        # with a run of repeated allocations being read as a single record.
         cdef shared_ptr[RecordReader] reader_sp = make_shared[RecordReader](
-            unique_ptr[FileSource](new FileSource(self._path))
+            unique_ptr[FileSource](new FileSource(self._path)),
+            True,
+            temporary_buffer_size == 0,
         )
         cdef RecordReader* reader = reader_sp.get()
+        reader.setNativeSymbolsOnly(self._native_symbols_only)
+        cdef _Allocation allocation
+        cdef size_t n_records
+        if allocation_filter is not None:
+            reader.setAllocationFilter(_native_allocation_filter(allocation_filter))
 
         cdef ProgressIndicator progress_indicator = ProgressIndicator(
             "Processing allocation records",
@@ -673,50 +1438,446 @@ cdef class FileReader:
             while records_to_process > 0:
                 PyErr_CheckSignals()
                 ret = reader.nextRecord()
-                if ret == RecordResult.RecordResultAllocationRecord:
-                    aggregator.addAllocation(reader.getLatestAllocation())
-                    records_to_process -= 1
-                    progress_indicator.update(1)
+                if (
+                    ret == RecordResult.RecordResultAllocationRecord
+                    or ret == RecordResult.RecordResultFilteredAllocationRecord
+                ):
+                    allocation = reader.getLatestAllocation()
+                    if ret == RecordResult.RecordResultAllocationRecord:
+                        aggregator.addAllocation(allocation)
+                    n_records = max(2 * allocation.n_repeats, 1)
+                    records_to_process -= min(n_records, records_to_process)
+                    progress_indicator.update(n_records)
                 elif ret == RecordResult.RecordResultMemoryRecord:
                     pass
                 else:
                     break
 
-        for elem in Py_ListFromSnapshotAllocationRecords(
-            aggregator.getSnapshotAllocations(merge_threads)
-        ):
-            alloc = AllocationRecord(elem)
-            (<AllocationRecord> alloc)._reader = reader_sp
-            yield alloc
+        cdef AllocationSnapshot snapshot = self._snapshot(
+            aggregator, reader_sp, merge_threads, largest
+        )
+        reader.close()
+        return snapshot
+
+    def _reaggregate_allocations(self, *args, **kwargs):
+        yield from self._reaggregate_snapshot(*args, **kwargs)
+
+    def _reaggregate_snapshot(
+        self, bool merge_threads, bool high_watermark, size_t largest=0
+    ):
+        cdef AggregatedCaptureReaggregator aggregator
+        cdef shared_ptr[RecordReader] reader_sp = make_shared[RecordReader](
+            unique_ptr[FileSource](new FileSource(self._path))
+        )
+        cdef RecordReader* reader = reader_sp.get()
+        reader.setNativeSymbolsOnly(self._native_symbols_only)
 
+        while True:
+            PyErr_CheckSignals()
+            ret = reader.nextRecord()
+            if ret == RecordResult.RecordResultAggregatedAllocationRecord:
+                if high_watermark:
+                    aggregator.addAllocation(
+                        reader.getLatestAggregatedAllocation()
+                        .contributionToHighWaterMark()
+                    )
+                else:
+                    aggregator.addAllocation(
+                        reader.getLatestAggregatedAllocation().contributionToLeaks()
+                    )
+            elif ret == RecordResult.RecordResultMemoryRecord:
+                pass
+            else:
+                break
+
+        cdef AllocationSnapshot snapshot = self._snapshot(
+            &aggregator, reader_sp, merge_threads, largest
+        )
         reader.close()
+        return snapshot
+
+    cdef void _ensure_not_filtered(self, allocation_filter) except *:
+        if allocation_filter is not None and self._is_aggregated():
+            raise NotImplementedError(
+                "Can't filter allocations from an aggregated capture file"
+            )
+
+    def _cached_records(self, key, records, allocation_filter=None, largest=None):
+        if allocation_filter is not None:
+            key = f"{key}:{allocation_filter!r}"
+        if largest is not None:
+            key = f"{key}:largest={largest}"
+        if self._native_symbols_only:
+            key = f"{key}:native-symbols-only"
+        if self._cache is None:
+            yield from records
+            return
+        cached = self._cache.get_records(key)
+        if cached is None:
+            cached = self._cache.put_records(
+                key, records, self._header["native_traces"]
+            )
+        yield from cached
+
+    # With ``largest``, only that many records are returned: the ones of the
+    # locations that allocated the most memory. They are picked before any
+    # record is created, which is a lot cheaper than sorting all of them.
+    cdef void _ensure_valid_largest(self, largest) except *:
+        if largest is not None and largest < 1:
+            raise ValueError("largest must be a positive number of records")
 
-    def get_high_watermark_allocation_records(self, merge_threads=True):
+    def get_high_watermark_allocation_records(
+        self, merge_threads=True, *, allocation_filter=None, largest=None
+    ):
         self._ensure_not_closed()
-        # If allocation 0 caused the peak, we need to process 1 record, etc
-        cdef size_t max_records = self._high_watermark.index + 1
-        yield from self._aggregate_allocations(max_records, merge_threads)
+        self._ensure_not_filtered(allocation_filter)
+        self._ensure_valid_largest(largest)
+        if self._is_aggregated():
+            records = self._reaggregate_allocations(merge_threads, True, largest or 0)
+        else:
+            # If allocation 0 caused the peak, we need to process 1 record, etc
+            records = self._aggregate_allocations(
+                self._high_watermark.index + 1,
+                merge_threads,
+                high_watermark=True,
+                allocation_filter=allocation_filter,
+                largest=largest or 0,
+            )
+        yield from self._cached_records(
+            f"high_watermark:{merge_threads}", records, allocation_filter, largest
+        )
 
-    def get_leaked_allocation_records(self, merge_threads=True):
+    def get_leaked_allocation_records(
+        self, merge_threads=True, *, allocation_filter=None, largest=None
+    ):
         self._ensure_not_closed()
-        cdef size_t max_records = self._header["stats"]["n_allocations"]
-        yield from self._aggregate_allocations(max_records, merge_threads)
+        self._ensure_not_filtered(allocation_filter)
+        self._ensure_valid_largest(largest)
+        if self._is_aggregated():
+            records = self._reaggregate_allocations(merge_threads, False, largest or 0)
+        else:
+            records = self._aggregate_allocations(
+                self._header["stats"]["n_allocations"],
+                merge_threads,
+                allocation_filter=allocation_filter,
+                largest=largest or 0,
+            )
+        yield from self._cached_records(
+            f"leaks:{merge_threads}", records, allocation_filter, largest
+        )
 
-    def get_temporary_allocation_records(self, merge_threads=True, threshold=1):
+    def get_temporary_allocation_records(
+        self, merge_threads=True, threshold=1, *, allocation_filter=None, largest=None
+    ):
+        # With a filter, the threshold only counts the allocations that pass it.
         self._ensure_not_closed()
+        self._ensure_not_aggregated("find temporary allocations")
+        self._ensure_valid_largest(largest)
         cdef size_t max_records = self._header["stats"]["n_allocations"]
-        yield from self._aggregate_allocations(
+        records = self._aggregate_allocations(
             max_records,
             merge_threads,
             temporary_buffer_size=threshold + 1,
+            allocation_filter=allocation_filter,
+            largest=largest or 0,
+        )
+        yield from self._cached_records(
+            f"temporary:{merge_threads}:{threshold}",
+            records,
+            allocation_filter,
+            largest,
+        )
+
+    def get_snapshot(
+        self,
+        merge_threads=True,
+        *,
+        leaks=False,
+        temporary_allocation_threshold=-1,
+        allocation_filter=None,
+        largest=None,
+    ):
+        """Get the heap at its high watermark, or what leaked or the
+        temporary allocations if asked to, as an `AllocationSnapshot`.
+
+        It holds the same locations that the matching
+        ``get_*_allocation_records`` method yields, but keeps them in the
+        reader, so the reporters can aggregate them without creating an
+        `AllocationRecord` for every one.
+        """
+        if self._cache is not None:
+            # The analysis cache only keeps the records.
+            if temporary_allocation_threshold >= 0:
+                records = self.get_temporary_allocation_records(
+                    merge_threads,
+                    temporary_allocation_threshold,
+                    allocation_filter=allocation_filter,
+                    largest=largest,
+                )
+            elif leaks:
+                records = self.get_leaked_allocation_records(
+                    merge_threads, allocation_filter=allocation_filter, largest=largest
+                )
+            else:
+                records = self.get_high_watermark_allocation_records(
+                    merge_threads, allocation_filter=allocation_filter, largest=largest
+                )
+            return _snapshot_from_records(list(records))
+
+        self._ensure_not_closed()
+        self._ensure_valid_largest(largest)
+        if temporary_allocation_threshold >= 0:
+            self._ensure_not_aggregated("find temporary allocations")
+            return self._aggregate_snapshot(
+                self._header["stats"]["n_allocations"],
+                merge_threads,
+                temporary_buffer_size=temporary_allocation_threshold + 1,
+                allocation_filter=allocation_filter,
+                largest=largest or 0,
+            )
+        self._ensure_not_filtered(allocation_filter)
+        if self._is_aggregated():
+            return self._reaggregate_snapshot(merge_threads, not leaks, largest or 0)
+        if leaks:
+            return self._aggregate_snapshot(
+                self._header["stats"]["n_allocations"],
+                merge_threads,
+                allocation_filter=allocation_filter,
+                largest=largest or 0,
+            )
+        return self._aggregate_snapshot(
+            self._high_watermark.index + 1,
+            merge_threads,
+            high_watermark=True,
+            allocation_filter=allocation_filter,
+            largest=largest or 0,
+        )
+
+    def get_allocation_lifetimes(self, merge_threads=True):
+        """Get how long the allocations of every location lived.
+
+        Each location gets an ``AllocationLifetimes`` with a record of all
+        that was allocated there, how many of those allocations were freed
+        and how many never were, and two histograms of the lifetimes of the
+        freed ones: by the number of allocations made in between, and by the
+        milliseconds elapsed between the memory records before them. The
+        histograms are lists of ``(lower_bound, count)`` for every non empty
+        bucket, where the buckets go by powers of two.
+        """
+        self._ensure_not_closed()
+        self._ensure_not_aggregated("measure allocation lifetimes")
+        cdef AllocationLifetimeAggregator aggregator
+        cdef shared_ptr[RecordReader] reader_sp = make_shared[RecordReader](
+            unique_ptr[FileSource](new FileSource(self._path)), True, False
+        )
+        cdef RecordReader* reader = reader_sp.get()
+        reader.setNativeSymbolsOnly(self._native_symbols_only)
+        cdef _Allocation allocation
+        cdef size_t n_records
+        aggregator.setCurrentTime(self._header["stats"]["start_time"])
+
+        cdef ProgressIndicator progress_indicator = ProgressIndicator(
+            "Processing allocation records",
+            total=self._header["stats"]["n_allocations"] or None,
+            report_progress=self._report_progress
+        )
+        with progress_indicator:
+            while True:
+                PyErr_CheckSignals()
+                ret = reader.nextRecord()
+                if ret == RecordResult.RecordResultAllocationRecord:
+                    allocation = reader.getLatestAllocation()
+                    aggregator.addAllocation(allocation)
+                    n_records = max(2 * allocation.n_repeats, 1)
+                    progress_indicator.update(n_records)
+                elif ret == RecordResult.RecordResultMemoryRecord:
+                    aggregator.setCurrentTime(
+                        reader.getLatestMemoryRecord().ms_since_epoch
+                    )
+                else:
+                    break
+
+        cdef vector[LocationLifetimes] lifetimes = aggregator.getLifetimes(merge_threads)
+        cdef vector[pair[size_t, size_t]] native_stacks
+        cdef size_t i
+        if self._header["native_traces"]:
+            for i in range(lifetimes.size()):
+                if lifetimes[i].record.native_frame_id != 0:
+                    native_stacks.push_back(
+                        pair[size_t, size_t](
+                            lifetimes[i].record.native_frame_id,
+                            lifetimes[i].record.native_segment_generation,
+                        )
+                    )
+            reader.resolveNativeStacks(native_stacks)
+
+        cdef list results = []
+        for i in range(lifetimes.size()):
+            results.append(
+                AllocationLifetimes(
+                    _record_from_allocation(lifetimes[i].record, reader_sp),
+                    lifetimes[i].lifetimes.freed(),
+                    lifetimes[i].lifetimes.neverFreed(),
+                    lifetimes[i].lifetimes.byAllocations(),
+                    lifetimes[i].lifetimes.byTime(),
+                )
+            )
+        reader.close()
+        yield from results
+
+    def get_snapshots(self, indices=None, *, timestamps=None, merge_threads=True):
+        """Get snapshots of the heap at several points of the capture.
+
+        The points are either allocation record indices, where the snapshot
+        at index ``i`` includes records ``0`` to ``i`` like the high water
+        mark does, or times in milliseconds since the epoch, where the
+        snapshot includes the allocations from before the first memory
+        snapshot taken after that time. All the snapshots are computed in a
+        single pass over the capture file.
+
+        Yields a ``(point, allocation_records)`` tuple for each distinct
+        point, in increasing order.
+        """
+        self._ensure_not_closed()
+        self._ensure_not_aggregated("take snapshots")
+        if (indices is None) == (timestamps is None):
+            raise ValueError("Exactly one of indices or timestamps must be given")
+        cdef bool by_time = timestamps is not None
+        cdef list points = sorted(set(timestamps if by_time else indices))
+        cdef size_t n_points = len(points)
+        cdef size_t next_point = 0
+
+        cdef SnapshotAllocationAggregator aggregator
+        cdef shared_ptr[RecordReader] reader_sp = make_shared[RecordReader](
+            unique_ptr[FileSource](new FileSource(self._path))
+        )
+        cdef RecordReader* reader = reader_sp.get()
+        reader.setNativeSymbolsOnly(self._native_symbols_only)
+        cdef size_t records_processed = 0
+
+        cdef ProgressIndicator progress_indicator = ProgressIndicator(
+            "Processing allocation records",
+            total=self._header["stats"]["n_allocations"] or None,
+            report_progress=self._report_progress
+        )
+        cdef list snapshots = []
+        with progress_indicator:
+            while next_point < n_points:
+                PyErr_CheckSignals()
+                if not by_time and records_processed > points[next_point]:
+                    records = self._snapshot_records(&aggregator, reader_sp, merge_threads)
+                    snapshots.append((points[next_point], records))
+                    next_point += 1
+                    continue
+                ret = reader.nextRecord()
+                if ret == RecordResult.RecordResultAllocationRecord:
+                    aggregator.addAllocation(reader.getLatestAllocation())
+                    records_processed += 1
+                    progress_indicator.update(1)
+                elif ret == RecordResult.RecordResultMemoryRecord:
+                    if not by_time:
+                        continue
+                    ms_since_epoch = reader.getLatestMemoryRecord().ms_since_epoch
+                    while next_point < n_points and ms_since_epoch > points[next_point]:
+                        records = self._snapshot_records(&aggregator, reader_sp, merge_threads)
+                        snapshots.append((points[next_point], records))
+                        next_point += 1
+                else:
+                    break
+
+        # Points past the end of the capture all see the final heap.
+        if next_point < n_points:
+            records = self._snapshot_records(&aggregator, reader_sp, merge_threads)
+            for point in points[next_point:]:
+                snapshots.append((point, records))
+
+        reader.close()
+        yield from snapshots
+
+    cdef list _snapshot_records(
+        self,
+        AbstractAggregator* aggregator,
+        shared_ptr[RecordReader] reader_sp,
+        bool merge_threads,
+        size_t largest=0,
+    ):
+        cdef reduced_snapshot_map_t snapshot = aggregator.getSnapshotAllocations(
+            merge_threads
+        )
+        if largest:
+            snapshot = largestAllocations(snapshot, largest)
+        return _records_from_snapshot(
+            snapshot,
+            reader_sp,
+            self._header["native_traces"],
+        )
+
+    cdef AllocationSnapshot _snapshot(
+        self,
+        AbstractAggregator* aggregator,
+        shared_ptr[RecordReader] reader_sp,
+        bool merge_threads,
+        size_t largest=0,
+    ):
+        cdef reduced_snapshot_map_t snapshot = aggregator.getSnapshotAllocations(
+            merge_threads
+        )
+        if largest:
+            snapshot = largestAllocations(snapshot, largest)
+        return _snapshot_from_map(
+            snapshot,
+            reader_sp,
+            self._header["native_traces"],
         )
 
+    def get_temporal_index(self):
+        """Get an index of the heap at each memory snapshot of the capture.
+
+        It takes a single pass over the capture file to build the index, and
+        then the heap at any memory snapshot, or the allocations made between
+        two of them, can be had from it without reading the file again.
+        """
+        self._ensure_not_closed()
+        self._ensure_not_aggregated("index the heap over time")
+        cdef TemporalIndex index = TemporalIndex.__new__(TemporalIndex)
+        index._aggregator = make_unique[TemporalSnapshotAggregator]()
+        index._reader = make_shared[RecordReader](
+            unique_ptr[FileSource](new FileSource(self._path))
+        )
+        index._native_traces = self._header["native_traces"]
+        cdef TemporalSnapshotAggregator* aggregator = index._aggregator.get()
+        cdef RecordReader* reader = index._reader.get()
+        reader.setNativeSymbolsOnly(self._native_symbols_only)
+
+        cdef ProgressIndicator progress_indicator = ProgressIndicator(
+            "Indexing allocation records",
+            total=self._header["stats"]["n_allocations"] or None,
+            report_progress=self._report_progress
+        )
+        with progress_indicator:
+            while True:
+                PyErr_CheckSignals()
+                ret = reader.nextRecord()
+                if ret == RecordResult.RecordResultAllocationRecord:
+                    aggregator.addAllocation(reader.getLatestAllocation())
+                    progress_indicator.update(1)
+                elif ret == RecordResult.RecordResultMemoryRecord:
+                    aggregator.takeSnapshot()
+                else:
+                    break
+        aggregator.takeSnapshot()
+
+        reader.close()
+        return index
+
     def get_allocation_records(self):
         self._ensure_not_closed()
+        self._ensure_not_aggregated("get all allocation records")
         cdef shared_ptr[RecordReader] reader_sp = make_shared[RecordReader](
             unique_ptr[FileSource](new FileSource(self._path))
         )
         cdef RecordReader* reader = reader_sp.get()
+        reader.setNativeSymbolsOnly(self._native_symbols_only)
 
         while True:
             PyErr_CheckSignals()
@@ -732,27 +1893,197 @@ cdef class FileReader:
 
         reader.close()
 
+    def get_allocation_columns(self, size_t batch_size=1_000_000):
+        """Get every allocation record, as batches of columns.
+
+        Each batch is a dict mapping ``tid``, ``address``, ``size``,
+        ``allocator``, ``stack_id`` and ``n_allocations`` to a read-only
+        memoryview of unsigned integers, with an element per record. The
+        records are decoded straight into these arrays, without building an
+        object for each of them, and the memoryviews can be wrapped without
+        copying them (e.g. with ``numpy.asarray``) to load them into pandas
+        or Arrow.
+
+        The ``allocator`` column holds `AllocatorType` values, and records
+        with the same ``stack_id`` have the same Python stack. Batches hold
+        up to ``batch_size`` records, and only the ones still referenced are
+        kept in memory.
+        """
+        self._ensure_not_closed()
+        self._ensure_not_aggregated("get all allocation records")
+        if batch_size == 0:
+            raise ValueError("The batch size must be positive")
+        cdef unique_ptr[RecordReader] reader = make_unique[RecordReader](
+            unique_ptr[FileSource](new FileSource(self._path))
+        )
+        cdef shared_ptr[AllocationColumns] columns
+
+        while True:
+            PyErr_CheckSignals()
+            columns = make_shared[AllocationColumns]()
+            ret = reader.get().readAllocationColumns(columns.get(), batch_size)
+            if columns.get().length():
+                yield _allocation_columns_batch(columns)
+            if ret != RecordResult.RecordResultAllocationRecord:
+                break
+
+        reader.get().close()
+
     def get_memory_snapshots(self):
         for record in self._memory_snapshots:
             yield MemorySnapshot(record.ms_since_epoch, record.rss, record.heap)
 
+    def get_memory_counters(self):
+        """Get the detailed memory counters sampled by the tracker.
+
+        There are none unless the capture was made with
+        ``detailed_memory_counters=True``.
+        """
+        self._ensure_not_closed()
+        cdef shared_ptr[RecordReader] reader_sp = make_shared[RecordReader](
+            unique_ptr[FileSource](new FileSource(self._path)),
+            False
+        )
+        cdef RecordReader* reader = reader_sp.get()
+        cdef MemoryRecord record
+
+        while True:
+            PyErr_CheckSignals()
+            ret = reader.nextRecord()
+            if ret == RecordResult.RecordResultMemoryRecord:
+                record = reader.getLatestMemoryRecord()
+                if record.has_counters:
+                    yield MemoryCounters(
+                        record.ms_since_epoch,
+                        record.rss,
+                        record.counters.pss,
+                        record.counters.uss,
+                        record.counters.swap,
+                        record.counters.cgroup_usage,
+                        record.counters.minor_faults,
+                        record.counters.major_faults,
+                    )
+            elif (
+                ret == RecordResult.RecordResultAllocationRecord
+                or ret == RecordResult.RecordResultAggregatedAllocationRecord
+            ):
+                pass
+            else:
+                break
+
+        reader.close()
+
+    def get_profile_intervals(self):
+        """Get the profile intervals written by the tracker.
+
+        There are none unless the capture was made with a
+        ``profile_interval_ms``. Each interval has the time it ended at and
+        three lists of records, with an entry for every stack whose
+        allocations changed in it: what was allocated there during the
+        interval, what was freed, and what was still live at its end.
+        """
+        self._ensure_not_closed()
+        cdef shared_ptr[RecordReader] reader_sp = make_shared[RecordReader](
+            unique_ptr[FileSource](new FileSource(self._path))
+        )
+        cdef RecordReader* reader = reader_sp.get()
+        reader.setNativeSymbolsOnly(self._native_symbols_only)
+        reader.setReportProfileIntervals(True)
+        cdef bool native_traces = self._header["native_traces"]
+        cdef _ProfileInterval interval
+        cdef vector[pair[size_t, size_t]] native_stacks
+        cdef size_t i
+
+        while True:
+            PyErr_CheckSignals()
+            ret = reader.nextRecord()
+            if ret == RecordResult.RecordResultProfileInterval:
+                interval = reader.getLatestProfileInterval()
+                if native_traces:
+                    native_stacks.clear()
+                    for i in range(interval.entries.size()):
+                        if interval.entries[i].native_frame_id != 0:
+                            native_stacks.push_back(
+                                pair[size_t, size_t](
+                                    interval.entries[i].native_frame_id,
+                                    interval.entries[i].native_segment_generation,
+                                )
+                            )
+                    reader.resolveNativeStacks(native_stacks)
+                allocated = []
+                freed = []
+                live = []
+                for i in range(interval.entries.size()):
+                    allocated.append(
+                        _record_from_allocation(
+                            interval.entries[i].allocated(), reader_sp
+                        )
+                    )
+                    freed.append(
+                        _record_from_allocation(interval.entries[i].freed(), reader_sp)
+                    )
+                    live.append(
+                        _record_from_allocation(interval.entries[i].live(), reader_sp)
+                    )
+                yield ProfileInterval(interval.ms_since_epoch, allocated, freed, live)
+            elif (
+                ret == RecordResult.RecordResultAllocationRecord
+                or ret == RecordResult.RecordResultAggregatedAllocationRecord
+                or ret == RecordResult.RecordResultMemoryRecord
+            ):
+                pass
+            else:
+                break
+
+        reader.close()
+
     @property
     def metadata(self):
         return _create_metadata(self._header, self._high_watermark.peak_memory)
 
+    @property
+    def tracker_metrics(self):
+        """What tracking cost the process, as of when tracking stopped.
+
+        See `Tracker.get_metrics`.
+        """
+        return TrackerMetrics(**self._header["stats"]["metrics"])
+
 
 def compute_statistics(
     file_name,
     *,
     report_progress=False,
     num_largest=5,
+    cache_analysis=False,
+    allocation_filter=None,
 ):
+    if cache_analysis and allocation_filter is None:
+        from ._analysis_cache import AnalysisCache
+        cache = AnalysisCache(file_name)
+        stats = cache.get_stats(num_largest)
+        if stats is None:
+            stats = compute_statistics(
+                file_name, report_progress=report_progress, num_largest=num_largest
+            )
+            cache.put_stats(num_largest, stats)
+        return stats
+
     cdef shared_ptr[RecordReader] reader_sp = make_shared[RecordReader](
-        unique_ptr[FileSource](new FileSource(file_name))
+        unique_ptr[FileSource](new FileSource(file_name)), True, False
     )
     cdef RecordReader* reader = reader_sp.get()
+    cdef _Allocation allocation
+    cdef size_t n_records
+    cdef size_t n_filtered_out = 0
+    if allocation_filter is not None:
+        reader.setAllocationFilter(_native_allocation_filter(allocation_filter))
 
     cdef header = reader.getHeader()
+    if header["file_format"] == FileFormat.AGGREGATED_ALLOCATIONS:
+        raise NotImplementedError(
+            "Can't compute statistics from an aggregated capture file"
+        )
     total = header["stats"]["n_allocations"] or None
 
     cdef AllocationStatsAggregator aggregator
@@ -766,23 +2097,37 @@ def compute_statistics(
             PyErr_CheckSignals()
             ret = reader.nextRecord()
             if ret == RecordResult.RecordResultAllocationRecord:
+                allocation = reader.getLatestAllocation()
                 aggregator.addAllocation(
-                    reader.getLatestAllocation(),
-                    reader.getLatestPythonFrameId(reader.getLatestAllocation()),
+                    allocation, reader.getLatestPythonFrameId(allocation)
                 )
-                progress_indicator.update(1)
+                # A run of repeats stands for that many allocations and frees.
+                progress_indicator.update(max(2 * allocation.n_repeats, 1))
+            elif ret == RecordResult.RecordResultFilteredAllocationRecord:
+                n_records = max(2 * reader.getLatestAllocation().n_repeats, 1)
+                n_filtered_out += n_records
+                progress_indicator.update(n_records)
             elif ret == RecordResult.RecordResultMemoryRecord:
                 pass
             else:
                 break
 
-    # Ignore the n_allocations in the header, use our observed value.
-    header["stats"]["n_allocations"] = progress_indicator.num_processed
+    # Ignore the n_allocations in the header, use our observed value. The
+    # allocations that were too small to be recorded only count towards the
+    # totals, unless they are filtered out like the ones we can't tell apart.
+    cdef FilteredAllocationTotals filtered = reader.getFilteredAllocationTotals()
+    if allocation_filter is not None:
+        filtered.n_allocations = 0
+        filtered.bytes = 0
+    header["stats"]["n_allocations"] = (
+        progress_indicator.num_processed - n_filtered_out + filtered.n_allocations
+    )
 
-    # Convert allocation counts by allocator/by size to Python dicts.
+    # Convert allocation counts by allocator/by size to Python dicts. Sizes
+    # are counted in buckets, each keyed by the smallest size that it holds.
     cdef dict tmp = aggregator.allocationCountByAllocator()
     allocation_count_by_allocator = {AllocatorType(k).name: v for k, v in tmp.items()}
-    cdef dict allocation_count_by_size = aggregator.allocationCountBySize();
+    cdef dict allocation_count_by_size = dict(aggregator.allocationCountBySize())
 
     # Convert top locations by bytes allocated/by allocation count to dicts
     unknown = ("<unknown>", "<unknown>", 0)
@@ -801,8 +2146,8 @@ def compute_statistics(
     cdef uint64_t peak_memory = aggregator.peakBytesAllocated()
     return Stats(
         metadata=_create_metadata(header, peak_memory),
-        total_num_allocations=aggregator.totalAllocations(),
-        total_memory_allocated=aggregator.totalBytesAllocated(),
+        total_num_allocations=aggregator.totalAllocations() + filtered.n_allocations,
+        total_memory_allocated=aggregator.totalBytesAllocated() + filtered.bytes,
         peak_memory_allocated=peak_memory,
         allocation_count_by_size=allocation_count_by_size,
         allocation_count_by_allocator=allocation_count_by_allocator,
@@ -811,6 +2156,141 @@ def compute_statistics(
     )
 
 
+cdef shared_ptr[RecordReader] _get_native_allocations(
+    allocations,
+    vector[_Allocation]* native_allocations,
+    double memory_threshold=float("inf"),
+) except *:
+    # Returns a null reader if the records aren't all allocations read by
+    # the same reader, in which case they must be processed in Python.
+    cdef shared_ptr[RecordReader] reader
+    cdef shared_ptr[RecordReader] no_reader
+    cdef _Allocation native_allocation
+    cdef AllocationRecord record
+    cdef double current_total = 0
+    for allocation in allocations:
+        if current_total >= memory_threshold:
+            break
+        if type(allocation) is not AllocationRecord:
+            return no_reader
+        record = allocation
+        if record._reader.get() == NULL or record.allocator in (
+            AllocatorType.FREE,
+            AllocatorType.MUNMAP,
+        ):
+            return no_reader
+        if reader.get() == NULL:
+            reader = record._reader
+        elif reader.get() != record._reader.get():
+            return no_reader
+        native_allocation.tid = record._tuple[0]
+        native_allocation.size = record._tuple[2]
+        native_allocation.frame_index = record._tuple[4]
+        native_allocation.n_allocations = record._tuple[5]
+        native_allocation.native_frame_id = record._tuple[6]
+        native_allocation.native_segment_generation = record._tuple[7]
+        native_allocations.push_back(native_allocation)
+        current_total += native_allocation.size
+    return reader
+
+
+def aggregate_allocations_by_location(allocations, double memory_threshold):
+    """Aggregate the Python stacks of allocation records by location in C++.
+
+    Returns None if the records can't be handled here, which is the case
+    unless they are all allocations read by the same reader.
+    """
+    cdef vector[_Allocation] native_allocations
+    cdef shared_ptr[RecordReader] reader = _get_native_allocations(
+        allocations, &native_allocations, memory_threshold
+    )
+    if reader.get() == NULL:
+        return None
+    return reader.get().Py_AggregateByLocation(native_allocations, memory_threshold)
+
+
+def build_flame_graph(allocations, frame_flags, size_t max_depth):
+    """Build the nodes of a flame graph of the Python stacks of allocations.
+
+    ``frame_flags`` is called with each distinct frame and returns a tuple
+    telling whether the frame is hidden and whether it belongs to the import
+    system. Returns a tuple of the distinct frames, the
+    ``(frame index, thread id, parent index, size, n_allocations,
+    import system, too deep)`` nodes and a dict mapping the thread ids to
+    thread names, or None if the records can't be handled here.
+    """
+    cdef vector[_Allocation] native_allocations
+    cdef shared_ptr[RecordReader] reader = _get_native_allocations(
+        allocations, &native_allocations
+    )
+    if reader.get() == NULL:
+        return None
+    return _flame_graph(reader, native_allocations, frame_flags, max_depth)
+
+
+def encode_pprof_profile(
+    allocations,
+    bool native_traces,
+    str sample_kind,
+    long long time_nanos,
+    long long duration_nanos,
+):
+    """Encode allocation records as a heap profile in pprof's format.
+
+    Every record becomes a sample with its number of allocations and its
+    size, in sample types named ``<sample_kind>_objects`` and
+    ``<sample_kind>_space``. Returns the uncompressed protocol buffer, or
+    None if the records can't be handled here.
+    """
+    cdef vector[_Allocation] native_allocations
+    cdef shared_ptr[RecordReader] reader = _get_native_allocations(
+        allocations, &native_allocations
+    )
+    if reader.get() == NULL:
+        return None
+    return reader.get().Py_EncodePprofProfile(
+        native_allocations,
+        native_traces,
+        sample_kind.encode(),
+        time_nanos,
+        duration_nanos,
+    )
+
+
+def diff_snapshots(before, after):
+    """Compare two snapshots by the Python stacks of their allocations.
+
+    The snapshots may come from different captures, since stacks are matched
+    by the content of their frames. Returns a list of ``(stack, size before,
+    size after, allocations before, allocations after)`` tuples sorted by how
+    much the memory of each stack changed, biggest changes first, or None if
+    the records can't be handled here.
+    """
+    # An empty snapshot is fine on either side, even though it has no reader.
+    before = list(before)
+    after = list(after)
+    cdef vector[_Allocation] before_allocations
+    cdef vector[_Allocation] after_allocations
+    cdef shared_ptr[RecordReader] before_reader = _get_native_allocations(
+        before, &before_allocations
+    )
+    cdef shared_ptr[RecordReader] after_reader = _get_native_allocations(
+        after, &after_allocations
+    )
+    if (before and before_reader.get() == NULL) or (
+        after and after_reader.get() == NULL
+    ):
+        return None
+    cdef SnapshotDiff diff
+    if before_reader.get() != NULL:
+        before_reader.get().addToSnapshotDiff(
+            before_allocations, SnapshotDiffBefore, &diff
+        )
+    if after_reader.get() != NULL:
+        after_reader.get().addToSnapshotDiff(after_allocations, SnapshotDiffAfter, &diff)
+    return diff.Py_GetDeltas()
+
+
 def dump_all_records(object file_name):
     cdef str path = str(file_name)
     if not pathlib.Path(path).exists():
@@ -826,6 +2306,7 @@ cdef class SocketReader:
     cdef shared_ptr[RecordReader] _reader
     cdef object _header
     cdef object _port
+    cdef dict _live_locations
 
     def __cinit__(self, int port):
         self._impl = NULL
@@ -833,6 +2314,7 @@ cdef class SocketReader:
     def __init__(self, port: int):
         self._header = {}
         self._port = port
+        self._live_locations = {}
 
     cdef _teardown(self):
         with nogil:
@@ -855,6 +2337,7 @@ cdef class SocketReader:
 
         self._reader = make_shared[RecordReader](move(self._make_source()))
         self._header = self._reader.get().getHeader()
+        self._live_locations = {}
 
         self._impl = new BackgroundSocketReader(self._reader)
         self._impl.start()
@@ -899,11 +2382,64 @@ cdef class SocketReader:
         if self._impl is NULL:
             return
 
-        snapshot_allocations = self._impl.Py_GetSnapshotAllocationRecords(merge_threads=merge_threads)
-        for elem in snapshot_allocations:
+        if merge_threads:
+            snapshot_allocations = self._impl.Py_GetSnapshotAllocationRecords(merge_threads=True)
+            for elem in snapshot_allocations:
+                alloc = AllocationRecord(elem)
+                (<AllocationRecord> alloc)._reader = self._reader
+                yield alloc
+            return
+
+        # Only the locations that changed since the previous snapshot are
+        # sent over, and the records of every other location are reused.
+        for location, elem in self._impl.Py_GetSnapshotDelta():
+            if elem is None:
+                self._live_locations.pop(location, None)
+                continue
             alloc = AllocationRecord(elem)
             (<AllocationRecord> alloc)._reader = self._reader
-            yield alloc
+            self._live_locations[location] = alloc
+        yield from tuple(self._live_locations.values())
+
+def get_live_snapshot(top=None, *, bool merge_threads=True):
+    """Get the memory in use at each location, from within the tracked process.
+
+    This requires an active `Tracker` created with a `LiveHeapDestination`
+    (see :ref:`Live heap queries`). The records of the tracker are read by
+    a background thread of the process as they're flushed, which happens
+    every *memory_interval_ms*, so allocations and deallocations made less
+    than that long ago may not be reflected yet.
+
+    Args:
+        top (int): If provided, only return the records of the *top*
+            locations holding the most memory.
+        merge_threads (bool): Whether or not to merge the allocations made at
+            the same location by different threads. Defaults to True.
+
+    Returns:
+        list[AllocationRecord]: The records of the locations with memory in
+        use, from the one holding the most memory to the one holding the
+        least.
+
+    Raises:
+        RuntimeError: If no tracker with a `LiveHeapDestination` is active.
+        ValueError: If *top* is not a positive number of records.
+    """
+    if _live_heap is None:
+        raise RuntimeError("No tracker with a LiveHeapDestination is active")
+    if top is not None and top < 1:
+        raise ValueError("top must be a positive number of records")
+
+    cdef _LiveHeap live_heap = _live_heap
+    cdef size_t largest = top or 0
+    records = []
+    for elem in live_heap._impl.Py_GetSnapshotAllocationRecords(merge_threads, largest):
+        alloc = AllocationRecord(elem)
+        (<AllocationRecord> alloc)._reader = live_heap._reader
+        records.append(alloc)
+    records.sort(key=lambda record: record.size, reverse=True)
+    return records
+
 
 cpdef enum SymbolicSupport:
     NONE = 1
@@ -929,3 +2465,18 @@ cdef extern from "<dlfcn.h>":
 
 RTLD_NOW = _RTLD_NOW
 RTLD_DEFAULT = <long long>_RTLD_DEFAULT
+
+
+def ptrace_attach_supported():
+    return ptraceAttachIsSupported()
+
+
+def ptrace_attach(int pid, library_path, int port, unsigned int timeout_ms):
+    """Load a library into a process and call its memray_spawn_client(port).
+
+    This uses ptrace directly instead of driving a debugger. Raises
+    RuntimeError with a description of the problem if it fails.
+    """
+    cdef cppstring path = os.fsencode(library_path)
+    with nogil:
+        ptraceInjectClient(pid, path, port, timeout_ms)
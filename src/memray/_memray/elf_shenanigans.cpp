@@ -1,3 +1,4 @@
+#include <cstddef>
 #include <cstring>
 #include <set>
 #include <string>
@@ -17,7 +18,9 @@ namespace {
 struct elf_patcher_context_t
 {
     bool restore_original;
-    std::set<std::string> patched;
+    std::set<std::string>* patched;
+    unsigned long long* unloaded_objects;
+    bool checked_unloaded_objects;
 };
 
 }  // namespace
@@ -152,18 +155,26 @@ patch_symbols(const Dyn* dyn_info_struct, const Addr base, bool restore_original
 }
 
 static int
-phdrs_callback(dl_phdr_info* info, [[maybe_unused]] size_t size, void* data) noexcept
+phdrs_callback(dl_phdr_info* info, size_t size, void* data) noexcept
 {
-    elf_patcher_context_t context = *reinterpret_cast<elf_patcher_context_t*>(data);
-    std::set<std::string> patched = context.patched;
-
-    if (context.restore_original) {
-        patched.clear();
-    } else {
-        if (patched.find(info->dlpi_name) != patched.end()) {
-            return 0;
+    auto& context = *reinterpret_cast<elf_patcher_context_t*>(data);
+
+    if (!context.checked_unloaded_objects) {
+        // An object that was unloaded can be loaded again under the same
+        // name with none of its symbols patched, so everything is patched
+        // again whenever the dynamic linker has unloaded something.
+        context.checked_unloaded_objects = true;
+        if (size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)
+            && info->dlpi_subs != *context.unloaded_objects)
+        {
+            *context.unloaded_objects = info->dlpi_subs;
+            context.patched->clear();
         }
-        patched.insert(info->dlpi_name);
+    }
+
+    if (!context.restore_original && !context.patched->insert(info->dlpi_name).second) {
+        // Already patched by a previous call.
+        return 0;
     }
 
     if (strstr(info->dlpi_name, "/ld-linux") || strstr(info->dlpi_name, "linux-vdso.so.1")) {
@@ -191,15 +202,16 @@ phdrs_callback(dl_phdr_info* info, [[maybe_unused]] size_t size, void* data) noe
 void
 SymbolPatcher::overwrite_symbols() noexcept
 {
-    elf_patcher_context_t context{false, symbols};
+    elf_patcher_context_t context{false, &symbols, &unloaded_objects, false};
     dl_iterate_phdr(&phdrs_callback, (void*)&context);
 }
 
 void
 SymbolPatcher::restore_symbols() noexcept
 {
-    elf_patcher_context_t context{true, symbols};
+    elf_patcher_context_t context{true, &symbols, &unloaded_objects, false};
     dl_iterate_phdr(&phdrs_callback, (void*)&context);
+    symbols.clear();
 }
 
 }  // namespace memray::linker
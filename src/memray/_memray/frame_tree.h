@@ -1,5 +1,10 @@
 #pragma once
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <vector>
 
@@ -11,11 +16,26 @@ class FrameTree
   public:
     using index_t = uint32_t;
 
+    FrameTree()
+    {
+        d_edge_tables.push_back(std::make_unique<EdgeTable>(INITIAL_EDGE_CAPACITY));
+        d_edges.store(d_edge_tables.back().get(), std::memory_order_release);
+        appendNode({0, 0});
+    }
+
     inline std::pair<frame_id_t, index_t> nextNode(index_t index) const
     {
-        std::lock_guard<std::mutex> lock(d_mutex);
-        assert(1 <= index && index <= d_graph.size());
-        return std::make_pair(d_graph[index].frame_id, d_graph[index].parent_index);
+        assert(1 <= index && index < d_size.load(std::memory_order_acquire));
+        const Node& node = nodeAt(index);
+        return std::make_pair(node.frame_id, node.parent_index);
+    }
+
+    // The number of nodes in the tree, including the root. Nodes are
+    // numbered in the order they were created, so every node comes after
+    // its parent.
+    inline size_t size() const
+    {
+        return d_size.load(std::memory_order_acquire);
     }
 
     using tracecallback_t = std::function<bool(frame_id_t, index_t)>;
@@ -23,54 +43,228 @@ class FrameTree
     template<typename T>
     size_t getTraceIndex(const T& stack_trace, const tracecallback_t& callback)
     {
-        std::lock_guard<std::mutex> lock(d_mutex);
         index_t index = 0;
         for (const auto& frame : stack_trace) {
-            index = getTraceIndexUnsafe(index, frame, callback);
+            index = getTraceIndexImpl(index, frame, callback);
+            if (index == 0) {
+                return 0;
+            }
         }
         return index;
     }
 
     size_t getTraceIndex(index_t parent_index, frame_id_t frame)
     {
-        std::lock_guard<std::mutex> lock(d_mutex);
-        return getTraceIndexUnsafe(parent_index, frame, tracecallback_t());
+        return getTraceIndexImpl(parent_index, frame, tracecallback_t());
     }
 
-  private:
-    size_t getTraceIndexUnsafe(index_t parent_index, frame_id_t frame, const tracecallback_t& callback)
-    {
-        Node& parent = d_graph[parent_index];
-        auto it = std::lower_bound(parent.children.begin(), parent.children.end(), frame);
-        if (it == parent.children.end() || it->frame_id != frame) {
-            index_t new_index = d_graph.size();
-            it = parent.children.insert(it, {frame, new_index});
-            if (callback && !callback(frame, parent_index)) {
-                return 0;
-            }
-            d_graph.push_back({frame, parent_index});
+    size_t getTraceIndex(index_t parent_index, frame_id_t frame, const tracecallback_t& callback)
+    {
+        return getTraceIndexImpl(parent_index, frame, callback);
+    }
+
+    // Keep any new node from being added until unlock() is called.
+    void lock()
+    {
+        d_mutex.lock();
+    }
+
+    void unlock()
+    {
+        d_mutex.unlock();
+    }
+
+    // Neither tree may be used by another thread while they are swapped.
+    void swap(FrameTree& other)
+    {
+        const index_t size = d_size.load(std::memory_order_relaxed);
+        d_size.store(other.d_size.load(std::memory_order_relaxed), std::memory_order_release);
+        other.d_size.store(size, std::memory_order_release);
+        for (size_t i = 0; i < MAX_CHUNKS; ++i) {
+            Node* nodes = d_node_chunks[i].load(std::memory_order_relaxed);
+            d_node_chunks[i].store(
+                    other.d_node_chunks[i].load(std::memory_order_relaxed),
+                    std::memory_order_release);
+            other.d_node_chunks[i].store(nodes, std::memory_order_release);
         }
-        return it->child_index;
+        d_node_storage.swap(other.d_node_storage);
+        std::swap(d_num_edges, other.d_num_edges);
+        EdgeTable* edges = d_edges.load(std::memory_order_relaxed);
+        d_edges.store(other.d_edges.load(std::memory_order_relaxed), std::memory_order_release);
+        other.d_edges.store(edges, std::memory_order_release);
+        d_edge_tables.swap(other.d_edge_tables);
     }
 
-    struct DescendentEdge
+  private:
+    index_t getTraceIndexImpl(index_t parent_index, frame_id_t frame, const tracecallback_t& callback)
     {
-        frame_id_t frame_id;
-        index_t child_index;
+        // Fast path: once a program warms up almost every edge already exists,
+        // and finding it only takes a few acquire loads on the edge table.
+        index_t child_index = d_edges.load(std::memory_order_acquire)->find(parent_index, frame);
+        if (child_index != 0) {
+            return child_index;
+        }
 
-        bool operator<(frame_id_t the_frame_id) const
-        {
-            return this->frame_id < the_frame_id;
+        // New nodes are created under a lock. This keeps the callback calls in
+        // the same order as the indices that are handed out, which is what the
+        // reader relies on to rebuild the tree from the emitted records.
+        std::lock_guard<std::mutex> lock(d_mutex);
+        EdgeTable* edges = d_edges.load(std::memory_order_relaxed);
+        child_index = edges->find(parent_index, frame);
+        if (child_index != 0) {
+            return child_index;
         }
-    };
+
+        child_index = d_size.load(std::memory_order_relaxed);
+        if (callback && !callback(frame, parent_index)) {
+            return 0;
+        }
+        appendNode({frame, parent_index});
+
+        if (2 * (d_num_edges + 1) > edges->capacity()) {
+            edges = growEdgeTable(edges);
+        }
+        edges->insert(parent_index, frame, child_index);
+        ++d_num_edges;
+        return child_index;
+    }
 
     struct Node
     {
         frame_id_t frame_id;
         index_t parent_index;
-        std::vector<DescendentEdge> children;
     };
+
+    // Open addressing table mapping (parent index, frame id) to the index of
+    // the child node. Slots are filled once by the single writer and never
+    // modified afterwards, so readers only need to acquire the child index
+    // before looking at the rest of the slot.
+    class EdgeTable
+    {
+      public:
+        explicit EdgeTable(size_t capacity)
+        : d_mask(capacity - 1)
+        , d_slots(new Slot[capacity])
+        {
+        }
+
+        size_t capacity() const
+        {
+            return d_mask + 1;
+        }
+
+        index_t find(index_t parent_index, frame_id_t frame_id) const
+        {
+            for (size_t i = hash(parent_index, frame_id) & d_mask;; i = (i + 1) & d_mask) {
+                const Slot& slot = d_slots[i];
+                index_t child_index = slot.child_index.load(std::memory_order_acquire);
+                if (child_index == 0) {
+                    return 0;
+                }
+                if (slot.parent_index == parent_index && slot.frame_id == frame_id) {
+                    return child_index;
+                }
+            }
+        }
+
+        void insert(index_t parent_index, frame_id_t frame_id, index_t child_index)
+        {
+            size_t i = hash(parent_index, frame_id) & d_mask;
+            while (d_slots[i].child_index.load(std::memory_order_relaxed) != 0) {
+                i = (i + 1) & d_mask;
+            }
+            d_slots[i].parent_index = parent_index;
+            d_slots[i].frame_id = frame_id;
+            d_slots[i].child_index.store(child_index, std::memory_order_release);
+        }
+
+        void copyInto(EdgeTable* other) const
+        {
+            for (size_t i = 0; i <= d_mask; ++i) {
+                const Slot& slot = d_slots[i];
+                index_t child_index = slot.child_index.load(std::memory_order_relaxed);
+                if (child_index != 0) {
+                    other->insert(slot.parent_index, slot.frame_id, child_index);
+                }
+            }
+        }
+
+      private:
+        struct Slot
+        {
+            // The root is never a child, so 0 marks a slot that is not in use.
+            std::atomic<index_t> child_index{0};
+            index_t parent_index{0};
+            frame_id_t frame_id{0};
+        };
+
+        static size_t hash(index_t parent_index, frame_id_t frame_id)
+        {
+            size_t h = static_cast<size_t>(frame_id) ^ (static_cast<size_t>(parent_index) << 32);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            return h;
+        }
+
+        size_t d_mask;
+        std::unique_ptr<Slot[]> d_slots;
+    };
+
+    EdgeTable* growEdgeTable(EdgeTable* edges)
+    {
+        auto new_edges = std::make_unique<EdgeTable>(2 * edges->capacity());
+        edges->copyInto(new_edges.get());
+        // Readers may still be probing the old table, so it is kept alive
+        // until the tree is destroyed.
+        d_edge_tables.push_back(std::move(new_edges));
+        edges = d_edge_tables.back().get();
+        d_edges.store(edges, std::memory_order_release);
+        return edges;
+    }
+
+    // Nodes live in chunks whose sizes double, so that they never move once
+    // created and can be read by index without holding the lock.
+    static const unsigned int FIRST_CHUNK_BITS = 10;
+    static const size_t MAX_CHUNKS = 8 * sizeof(index_t) - FIRST_CHUNK_BITS + 1;
+    static constexpr size_t INITIAL_EDGE_CAPACITY = 4096;
+
+    static size_t chunkFor(size_t index, size_t* offset)
+    {
+        const size_t biased = index + (size_t(1) << FIRST_CHUNK_BITS);
+        const size_t chunk = (8 * sizeof(size_t) - 1 - __builtin_clzl(biased)) - FIRST_CHUNK_BITS;
+        *offset = biased - (size_t(1) << (chunk + FIRST_CHUNK_BITS));
+        return chunk;
+    }
+
+    const Node& nodeAt(index_t index) const
+    {
+        size_t offset;
+        size_t chunk = chunkFor(index, &offset);
+        return d_node_chunks[chunk].load(std::memory_order_acquire)[offset];
+    }
+
+    void appendNode(const Node& node)
+    {
+        const index_t index = d_size.load(std::memory_order_relaxed);
+        size_t offset;
+        size_t chunk = chunkFor(index, &offset);
+        Node* nodes = d_node_chunks[chunk].load(std::memory_order_relaxed);
+        if (nodes == nullptr) {
+            d_node_storage[chunk].reset(new Node[size_t(1) << (chunk + FIRST_CHUNK_BITS)]);
+            nodes = d_node_storage[chunk].get();
+            d_node_chunks[chunk].store(nodes, std::memory_order_release);
+        }
+        nodes[offset] = node;
+        d_size.store(index + 1, std::memory_order_release);
+    }
+
     mutable std::mutex d_mutex;
-    std::vector<Node> d_graph{{0, 0, {}}};
+    std::atomic<index_t> d_size{0};
+    std::array<std::atomic<Node*>, MAX_CHUNKS> d_node_chunks{};
+    std::array<std::unique_ptr<Node[]>, MAX_CHUNKS> d_node_storage{};
+    size_t d_num_edges{0};
+    std::atomic<EdgeTable*> d_edges{nullptr};
+    std::vector<std::unique_ptr<EdgeTable>> d_edge_tables{};
 };
 }  // namespace memray::tracking_api
@@ -57,11 +57,15 @@ allocatorKind(const Allocator& allocator)
         case Allocator::VALLOC:
         case Allocator::PYMALLOC_MALLOC:
         case Allocator::PYMALLOC_CALLOC:
-        case Allocator::PYMALLOC_REALLOC: {
+        case Allocator::PYMALLOC_REALLOC:
+        case Allocator::CUSTOM_MALLOC:
+        case Allocator::PYMALLOC_ARENA_ALLOC: {
             return AllocatorKind::SIMPLE_ALLOCATOR;
         }
         case Allocator::FREE:
-        case Allocator::PYMALLOC_FREE: {
+        case Allocator::PYMALLOC_FREE:
+        case Allocator::CUSTOM_FREE:
+        case Allocator::PYMALLOC_ARENA_FREE: {
             return AllocatorKind::SIMPLE_DEALLOCATOR;
         }
         case Allocator::MMAP: {
@@ -161,6 +165,33 @@ pymalloc_free(void* ctx, void* ptr) noexcept
     }
 }
 
+void*
+pymalloc_arena_alloc(void* ctx, size_t size) noexcept
+{
+    auto* arena_allocator = (PyObjectArenaAllocator*)ctx;
+    void* ptr;
+    {
+        // The mapping the arena is made from is recorded as the arena.
+        tracking_api::RecursionGuard guard;
+        ptr = arena_allocator->alloc(arena_allocator->ctx, size);
+    }
+    tracking_api::Tracker::trackAllocation(ptr, size, hooks::Allocator::PYMALLOC_ARENA_ALLOC);
+    return ptr;
+}
+
+void
+pymalloc_arena_free(void* ctx, void* ptr, size_t size) noexcept
+{
+    auto* arena_allocator = (PyObjectArenaAllocator*)ctx;
+    {
+        tracking_api::RecursionGuard guard;
+        arena_allocator->free(arena_allocator->ctx, ptr, size);
+    }
+    if (ptr) {
+        tracking_api::Tracker::trackDeallocation(ptr, size, hooks::Allocator::PYMALLOC_ARENA_FREE);
+    }
+}
+
 void*
 malloc(size_t size) noexcept
 {
@@ -125,6 +125,12 @@ enum class Allocator : unsigned char {
     PYMALLOC_CALLOC = 13,
     PYMALLOC_REALLOC = 14,
     PYMALLOC_FREE = 15,
+    // Reported by extension modules through the C API in memray.h.
+    CUSTOM_MALLOC = 16,
+    CUSTOM_FREE = 17,
+    // The arenas pymalloc carves its pools of small objects out of.
+    PYMALLOC_ARENA_ALLOC = 18,
+    PYMALLOC_ARENA_FREE = 19,
 };
 
 enum class AllocatorKind {
@@ -206,4 +212,9 @@ pymalloc_calloc(void* ctx, size_t nelem, size_t size) noexcept;
 void
 pymalloc_free(void* ctx, void* ptr) noexcept;
 
+void*
+pymalloc_arena_alloc(void* ctx, size_t size) noexcept;
+void
+pymalloc_arena_free(void* ctx, void* ptr, size_t size) noexcept;
+
 }  // namespace memray::intercept
@@ -8,7 +8,11 @@ namespace memray::linker {
 class SymbolPatcher
 {
   private:
+    // The names of the objects whose symbols are patched, so that only the
+    // ones loaded since the last call need to be patched.
     std::set<std::string> symbols;
+    // The number of objects the dynamic linker had unloaded by then.
+    unsigned long long unloaded_objects{0};
 
   public:
     void overwrite_symbols() noexcept;
@@ -1,7 +1,20 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_set>
 #include <utility>
 
+#ifdef __linux__
+#    include <elf.h>
+#    include <link.h>
+#endif
+
 #include "native_resolver.h"
 
 #include "logging.h"
@@ -14,54 +27,19 @@ static const logLevel RESOLVE_LIB_LOG_LEVEL = DEBUG;
 static const logLevel RESOLVE_LIB_LOG_LEVEL = WARNING;
 #endif
 
-StringStorage::StringStorage()
-{
-    d_interned_data.reserve(4096);
-    d_interned_data_storage.reserve(4096);
-}
-
-size_t
-StringStorage::internString(const std::string& str, const char** interned_string)
-{
-    if (str.empty()) {
-        return 0;
-    }
-
-    const size_t id = d_interned_data.size() + 1;
-    auto inserted = d_interned_data.insert({str, id});
-    if (interned_string) {
-        *interned_string = inserted.first->first.c_str();
-    }
-
-    if (!inserted.second) {
-        return inserted.first->second;
-    }
-    //  C++11 standard § 23.2.5/8: Rehashing the elements of an unordered associative container
-    //  invalidates iterators, changes ordering between elements, and changes which buckets elements
-    //  appear in, but does not invalidate pointers or references to elements.
-    d_interned_data_storage.push_back(&inserted.first->first);
-
-    return id;
-}
-
-const std::string&
-StringStorage::resolveString(size_t index) const
-{
-    assert(index != 0);
-    return *d_interned_data_storage.at(index - 1);
-}
-
 MemorySegment::MemorySegment(
         std::string filename,
         uintptr_t start,
         uintptr_t end,
-        backtrace_state* state,
+        uintptr_t load_address,
+        ObjectFile* object_file,
         size_t filename_index)
 : d_filename(std::move(filename))
 , d_start(start)
 , d_end(end)
+, d_load_address(load_address)
 , d_index(filename_index)
-, d_state(state)
+, d_object_file(object_file)
 {
 }
 
@@ -87,8 +65,10 @@ demangle(const char* function)
 }
 
 void
-MemorySegment::resolveFromSymbolTable(uintptr_t address, MemorySegment::ExpandedFrame& expanded_frame)
-        const
+MemorySegment::resolveFromSymbolTable(
+        backtrace_state* state,
+        uintptr_t address,
+        MemorySegment::ExpandedFrame& expanded_frame) const
 {
     struct CallbackData
     {
@@ -110,12 +90,14 @@ MemorySegment::resolveFromSymbolTable(uintptr_t address, MemorySegment::Expanded
                    << " in segment " << data->segment->d_filename << " (errno " << errnum
                    << "): " << msg;
     };
-    backtrace_syminfo(d_state, address, callback, error_callback, &data);
+    backtrace_syminfo(state, address, callback, error_callback, &data);
 }
 
 void
-MemorySegment::resolveFromDebugInfo(uintptr_t address, MemorySegment::ExpandedFrame& expanded_frame)
-        const
+MemorySegment::resolveFromDebugInfo(
+        backtrace_state* state,
+        uintptr_t address,
+        MemorySegment::ExpandedFrame& expanded_frame) const
 {
     auto callback =
             [](void* data, uintptr_t /*addr*/, const char* file, int line, const char* symbol) -> int {
@@ -134,22 +116,50 @@ MemorySegment::resolveFromDebugInfo(uintptr_t address, MemorySegment::ExpandedFr
         // callback has been called previously.
         expanded_frame->clear();
     };
-    backtrace_pcinfo(d_state, address, callback, error_callback, &expanded_frame);
+    backtrace_pcinfo(state, address, callback, error_callback, &expanded_frame);
 }
 
 MemorySegment::ExpandedFrame
 MemorySegment::resolveIp(uintptr_t address) const
 {
+    SymbolCache* symbol_cache = d_object_file->symbolCache();
+    const uintptr_t offset = address - d_load_address;
+    if (symbol_cache) {
+        const ExpandedFrame* cached_frame = symbol_cache->find(offset);
+        if (cached_frame) {
+            return *cached_frame;
+        }
+    }
+
     ExpandedFrame expanded_frame{};
-    assert(d_state != nullptr);
     // libbacktrace expects a program counter that is 1 byte less than the one produced by
     // libunwind (and any other unwinder that I tested). This is because libbacktrace's native
     // unwinder does indeed produce program counters with one byte less for some reason and
     // libbacktrace's symbolizer is prepared to work with libbacktrace's machinery convention.
     uintptr_t corrected_address = address - 1;
-    resolveFromDebugInfo(corrected_address, expanded_frame);
+    if (d_object_file->symbolsOnly()) {
+        // These frames aren't cached, since a later full resolution of the
+        // same file would take them for what its debug information says.
+        const ElfSymbolTable* symbol_table = d_object_file->symbolTable();
+        if (symbol_table) {
+            const std::string symbol = demangle(symbol_table->find(corrected_address - d_load_address));
+            expanded_frame.push_back(Frame{symbol.empty() ? "<unknown>" : symbol, "<unknown>", 0});
+        } else if (backtrace_state* state = d_object_file->backtraceState()) {
+            resolveFromSymbolTable(state, corrected_address, expanded_frame);
+        }
+        return expanded_frame;
+    }
+
+    backtrace_state* state = d_object_file->backtraceState();
+    if (state == nullptr) {
+        return expanded_frame;
+    }
+    resolveFromDebugInfo(state, corrected_address, expanded_frame);
     if (expanded_frame.empty()) {
-        resolveFromSymbolTable(corrected_address, expanded_frame);
+        resolveFromSymbolTable(state, corrected_address, expanded_frame);
+    }
+    if (symbol_cache) {
+        symbol_cache->insert(offset, expanded_frame);
     }
     return expanded_frame;
 }
@@ -185,6 +195,12 @@ MemorySegment::end() const
     return d_end;
 }
 
+uintptr_t
+MemorySegment::loadAddress() const
+{
+    return d_load_address;
+}
+
 uintptr_t
 MemorySegment::filenameIndex() const
 {
@@ -197,26 +213,421 @@ MemorySegment::filename() const
     return d_filename;
 }
 
+ObjectFile*
+MemorySegment::objectFile() const
+{
+    return d_object_file;
+}
+
+static const char SYMBOL_CACHE_FORMAT[] = "memray symbol cache 1";
+static const size_t MAX_CACHED_FRAMES_PER_ADDRESS = 4096;
+
+#ifdef __linux__
+static std::string
+findBuildIdNote(const char* notes, size_t size, size_t alignment)
+{
+    auto align = [alignment](size_t value) { return (value + alignment - 1) & ~(alignment - 1); };
+
+    size_t pos = 0;
+    while (pos + sizeof(ElfW(Nhdr)) <= size) {
+        ElfW(Nhdr) note;
+        ::memcpy(&note, notes + pos, sizeof(note));
+        pos += sizeof(note);
+        const size_t name_size = align(note.n_namesz);
+        const size_t desc_size = align(note.n_descsz);
+        if (name_size + desc_size > size - pos) {
+            break;
+        }
+        if (note.n_type == NT_GNU_BUILD_ID && note.n_namesz == sizeof("GNU")
+            && 0 == ::memcmp(notes + pos, "GNU", sizeof("GNU")))
+        {
+            static const char hex_digits[] = "0123456789abcdef";
+            std::string build_id;
+            const auto* desc = reinterpret_cast<const unsigned char*>(notes + pos + name_size);
+            for (size_t i = 0; i < note.n_descsz; ++i) {
+                build_id += hex_digits[desc[i] >> 4];
+                build_id += hex_digits[desc[i] & 0xf];
+            }
+            return build_id;
+        }
+        pos += name_size + desc_size;
+    }
+    return {};
+}
+#endif
+
+static std::string
+readBuildId(const char* filename)
+{
+#ifdef __linux__
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return {};
+    }
+
+    std::string build_id;
+    ElfW(Ehdr) header;
+    if (::pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && 0 == ::memcmp(header.e_ident, ELFMAG, SELFMAG)
+        && header.e_phentsize == sizeof(ElfW(Phdr)))
+    {
+        std::vector<ElfW(Phdr)> program_headers(header.e_phnum);
+        const ssize_t headers_size = program_headers.size() * sizeof(ElfW(Phdr));
+        if (::pread(fd, program_headers.data(), headers_size, header.e_phoff) == headers_size) {
+            for (const auto& program_header : program_headers) {
+                if (program_header.p_type != PT_NOTE || program_header.p_filesz > (1 << 20)) {
+                    continue;
+                }
+                std::vector<char> notes(program_header.p_filesz);
+                const ssize_t notes_size = notes.size();
+                if (::pread(fd, notes.data(), notes_size, program_header.p_offset) != notes_size) {
+                    continue;
+                }
+                build_id = findBuildIdNote(
+                        notes.data(),
+                        notes.size(),
+                        program_header.p_align == 8 ? 8 : 4);
+                if (!build_id.empty()) {
+                    break;
+                }
+            }
+        }
+    }
+    ::close(fd);
+    return build_id;
+#else
+    return {};
+#endif
+}
+
+static std::string
+symbolCacheDirectory()
+{
+    // An empty MEMRAY_SYMBOL_CACHE_DIR disables the cache.
+    const char* directory = ::getenv("MEMRAY_SYMBOL_CACHE_DIR");
+    if (directory) {
+        return directory;
+    }
+    directory = ::getenv("XDG_CACHE_HOME");
+    if (directory && *directory) {
+        return std::string(directory) + "/memray/symbols";
+    }
+    directory = ::getenv("HOME");
+    if (directory && *directory) {
+        return std::string(directory) + "/.cache/memray/symbols";
+    }
+    return {};
+}
+
+static bool
+makeDirectories(const std::string& path)
+{
+    for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        if (::mkdir(path.substr(0, pos).c_str(), 0755) == -1 && errno != EEXIST) {
+            return false;
+        }
+    }
+    if (::mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+        return false;
+    }
+    struct stat info;
+    return ::stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+SymbolCache::SymbolCache(std::string path)
+: d_path(std::move(path))
+{
+    load();
+}
+
+SymbolCache::~SymbolCache()
+{
+    save();
+}
+
+std::unique_ptr<SymbolCache>
+SymbolCache::forFile(const char* filename)
+{
+    const std::string build_id = readBuildId(filename);
+    if (build_id.empty()) {
+        return nullptr;
+    }
+    const std::string directory = symbolCacheDirectory();
+    if (directory.empty() || !makeDirectories(directory)) {
+        return nullptr;
+    }
+
+    // Addresses resolved before separate debug information was installed
+    // would otherwise keep their symbol table names forever.
+    std::string name = build_id;
+    const std::string debug_file =
+            "/usr/lib/debug/.build-id/" + build_id.substr(0, 2) + "/" + build_id.substr(2) + ".debug";
+    if (::access(debug_file.c_str(), F_OK) == 0) {
+        name += "-debug";
+    }
+    return std::make_unique<SymbolCache>(directory + "/" + name + ".symbols");
+}
+
+const MemorySegment::ExpandedFrame*
+SymbolCache::find(uintptr_t offset) const
+{
+    auto it = d_entries.find(offset);
+    return it == d_entries.end() ? nullptr : &it->second;
+}
+
+void
+SymbolCache::insert(uintptr_t offset, const MemorySegment::ExpandedFrame& frames)
+{
+    if (d_entries.emplace(offset, frames).second) {
+        d_new_entries.push_back(offset);
+    }
+}
+
+void
+SymbolCache::load()
+{
+    // Every field is a NUL terminated string. After the format marker, each
+    // entry is an offset in hex and a number of frames, followed by the
+    // symbol, file name and line number of every frame. Anything after an
+    // entry that can't be parsed is ignored.
+    std::ifstream file(d_path, std::ios::binary);
+    std::string field;
+    if (!std::getline(file, field, '\0') || field != SYMBOL_CACHE_FORMAT) {
+        return;
+    }
+
+    auto readNumber = [&](int base, unsigned long long* number) {
+        if (!std::getline(file, field, '\0') || field.empty()) {
+            return false;
+        }
+        char* end;
+        *number = std::strtoull(field.c_str(), &end, base);
+        return *end == '\0';
+    };
+
+    unsigned long long offset;
+    unsigned long long num_frames;
+    while (readNumber(16, &offset) && readNumber(10, &num_frames)
+           && num_frames <= MAX_CACHED_FRAMES_PER_ADDRESS)
+    {
+        MemorySegment::ExpandedFrame frames(num_frames);
+        for (auto& frame : frames) {
+            unsigned long long lineno;
+            if (!std::getline(file, frame.symbol, '\0') || !std::getline(file, frame.filename, '\0')
+                || !readNumber(10, &lineno))
+            {
+                return;
+            }
+            frame.lineno = static_cast<int>(lineno);
+        }
+        d_entries.emplace(offset, std::move(frames));
+    }
+}
+
+void
+SymbolCache::save() const
+{
+    if (d_new_entries.empty()) {
+        return;
+    }
+
+    std::string buffer;
+    for (const auto offset : d_new_entries) {
+        const auto& frames = d_entries.at(offset);
+        char offset_str[2 * sizeof(uintptr_t) + 1];
+        ::snprintf(offset_str, sizeof(offset_str), "%zx", static_cast<size_t>(offset));
+        buffer.append(offset_str).append(1, '\0');
+        buffer.append(std::to_string(frames.size())).append(1, '\0');
+        for (const auto& frame : frames) {
+            buffer.append(frame.symbol).append(1, '\0');
+            buffer.append(frame.filename).append(1, '\0');
+            buffer.append(std::to_string(frame.lineno)).append(1, '\0');
+        }
+    }
+
+    // Several reports may share the cache, so entries are only appended, with
+    // a single write each time.
+    int fd = ::open(d_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        buffer.insert(0, SYMBOL_CACHE_FORMAT, sizeof(SYMBOL_CACHE_FORMAT));
+    } else {
+        fd = ::open(d_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    if (fd == -1) {
+        LOG(DEBUG) << "Could not open symbol cache " << d_path << ": " << strerror(errno);
+        return;
+    }
+    const char* data = buffer.data();
+    size_t remaining = buffer.size();
+    while (remaining > 0) {
+        ssize_t written = ::write(fd, data, remaining);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            LOG(DEBUG) << "Could not write symbol cache " << d_path << ": " << strerror(errno);
+            break;
+        }
+        data += written;
+        remaining -= written;
+    }
+    ::close(fd);
+}
+
+std::unique_ptr<ElfSymbolTable>
+ElfSymbolTable::forFile(const char* filename)
+{
+#ifdef __linux__
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return nullptr;
+    }
+    std::unique_ptr<ElfSymbolTable> symbol_table(new ElfSymbolTable());
+    const bool loaded = symbol_table->load(fd);
+    ::close(fd);
+    return loaded ? std::move(symbol_table) : nullptr;
+#else
+    return nullptr;
+#endif
+}
+
+bool
+ElfSymbolTable::load(int fd)
+{
+#ifdef __linux__
+    ElfW(Ehdr) header;
+    if (::pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || 0 != ::memcmp(header.e_ident, ELFMAG, SELFMAG)
+        || header.e_shentsize != sizeof(ElfW(Shdr)))
+    {
+        return false;
+    }
+    std::vector<ElfW(Shdr)> sections(header.e_shnum);
+    const ssize_t sections_size = sections.size() * sizeof(ElfW(Shdr));
+    if (::pread(fd, sections.data(), sections_size, header.e_shoff) != sections_size) {
+        return false;
+    }
+
+    // Most libraries are stripped of their full symbol table, but they still
+    // have the dynamic one.
+    const ElfW(Shdr)* symbols_section = nullptr;
+    for (const auto& section : sections) {
+        if (section.sh_type == SHT_SYMTAB) {
+            symbols_section = &section;
+            break;
+        }
+        if (section.sh_type == SHT_DYNSYM && !symbols_section) {
+            symbols_section = &section;
+        }
+    }
+    if (!symbols_section || symbols_section->sh_link >= sections.size()
+        || symbols_section->sh_entsize != sizeof(ElfW(Sym)))
+    {
+        return false;
+    }
+
+    const ElfW(Shdr)& names_section = sections[symbols_section->sh_link];
+    d_names.resize(names_section.sh_size);
+    const ssize_t names_size = d_names.size();
+    if (::pread(fd, d_names.data(), names_size, names_section.sh_offset) != names_size) {
+        return false;
+    }
+    d_names.push_back('\0');
+
+    std::vector<ElfW(Sym)> symbols(symbols_section->sh_size / sizeof(ElfW(Sym)));
+    const ssize_t symbols_size = symbols.size() * sizeof(ElfW(Sym));
+    if (::pread(fd, symbols.data(), symbols_size, symbols_section->sh_offset) != symbols_size) {
+        return false;
+    }
+    for (const auto& symbol : symbols) {
+#if __ELF_NATIVE_CLASS == 64
+        const auto type = ELF64_ST_TYPE(symbol.st_info);
+#else
+        const auto type = ELF32_ST_TYPE(symbol.st_info);
+#endif
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) || symbol.st_shndx == SHN_UNDEF
+            || symbol.st_value == 0 || symbol.st_name >= names_size)
+        {
+            continue;
+        }
+        const uintptr_t size = std::max<uintptr_t>(symbol.st_size, 1);
+        d_symbols.push_back({symbol.st_value, symbol.st_value + size, symbol.st_name});
+    }
+    std::sort(d_symbols.begin(), d_symbols.end(), [](const Symbol& lhs, const Symbol& rhs) {
+        return lhs.start < rhs.start;
+    });
+    return !d_symbols.empty();
+#else
+    return false;
+#endif
+}
+
+const char*
+ElfSymbolTable::find(uintptr_t offset) const
+{
+    auto it = std::upper_bound(
+            d_symbols.begin(),
+            d_symbols.end(),
+            offset,
+            [](uintptr_t value, const Symbol& symbol) { return value < symbol.start; });
+    if (it == d_symbols.begin()) {
+        return nullptr;
+    }
+    --it;
+    return offset < it->end ? d_names.data() + it->name : nullptr;
+}
+
+ObjectFile::ObjectFile(const char* filename, uintptr_t address_start, bool symbols_only)
+: d_filename(filename)
+, d_address_start(address_start)
+, d_symbols_only(symbols_only)
+, d_symbol_cache(SymbolCache::forFile(filename))
+{
+}
+
+SymbolCache*
+ObjectFile::symbolCache() const
+{
+    return d_symbol_cache.get();
+}
+
+bool
+ObjectFile::symbolsOnly() const
+{
+    return d_symbols_only;
+}
+
+const ElfSymbolTable*
+ObjectFile::symbolTable()
+{
+    if (!d_symbol_table_created) {
+        d_symbol_table_created = true;
+        d_symbol_table = ElfSymbolTable::forFile(d_filename);
+    }
+    return d_symbol_table.get();
+}
+
 ResolvedFrame::ResolvedFrame(
         const MemorySegment::Frame& frame,
-        const std::shared_ptr<StringStorage>& d_string_storage)
-: d_string_storage(d_string_storage)
-, d_symbol_index(d_string_storage->internString(frame.symbol))
-, d_file_index(d_string_storage->internString(frame.filename))
+        const std::shared_ptr<api::StringInterner>& strings)
+: d_strings(strings)
+, d_symbol_id(strings->intern(frame.symbol))
+, d_file_id(strings->intern(frame.filename))
 , d_line(frame.lineno)
+, d_is_eval_frame(frame.symbol.find("_PyEval_EvalFrameDefault") != std::string::npos)
 {
 }
 
-const std::string&
+std::string_view
 ResolvedFrame::Symbol() const
 {
-    return d_string_storage->resolveString(d_symbol_index);
+    return d_strings->get(d_symbol_id);
 }
 
-const std::string&
+std::string_view
 ResolvedFrame::File() const
 {
-    return d_string_storage->resolveString(d_file_index);
+    return d_strings->get(d_file_id);
 }
 
 int
@@ -224,14 +635,21 @@ ResolvedFrame::Line() const
 {
     return d_line;
 }
+
+bool
+ResolvedFrame::IsEvalFrame() const
+{
+    return d_is_eval_frame;
+}
+
 PyObject*
 ResolvedFrame::toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) const
 {
-    PyObject* pyfunction_name = pystring_cache.getUnicodeObject(Symbol());  // Borrowed
+    PyObject* pyfunction_name = pystring_cache.getUnicodeObject(d_symbol_id);  // Borrowed
     if (pyfunction_name == nullptr) {
         return nullptr;
     }
-    PyObject* pyfilename = pystring_cache.getUnicodeObject(File());  // Borrowed
+    PyObject* pyfilename = pystring_cache.getUnicodeObject(d_file_id);  // Borrowed
     if (pyfilename == nullptr) {
         return nullptr;
     }
@@ -252,10 +670,10 @@ ResolvedFrame::toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) c
     return tuple;
 }
 
-const std::string&
+std::string_view
 ResolvedFrames::memoryMap() const
 {
-    return d_string_storage->resolveString(d_memory_map_index);
+    return d_strings->get(d_memory_map_id);
 }
 
 const std::vector<ResolvedFrame>&
@@ -265,8 +683,14 @@ ResolvedFrames::frames() const
 }
 
 SymbolResolver::SymbolResolver()
+: SymbolResolver(std::make_shared<api::StringInterner>())
+{
+}
+
+SymbolResolver::SymbolResolver(std::shared_ptr<api::StringInterner> strings)
+: d_strings(std::move(strings))
 {
-    d_backtrace_states.reserve(PREALLOCATED_BACKTRACE_STATES);
+    d_object_files.reserve(PREALLOCATED_BACKTRACE_STATES);
     d_resolved_ips_cache.reserve(PREALLOCATED_IPS_CACHE_ITEMS);
 }
 
@@ -278,7 +702,7 @@ findModule(const uintptr_t ip, const T& segments)
             segments.begin(),
             segments.end(),
             ip,
-            [](const MemorySegment& segment, const uintptr_t ip) { return segment.end() < ip; });
+            [](const MemorySegment* segment, const uintptr_t ip) { return segment->end() < ip; });
 }
 
 SymbolResolver::resolved_frames_t
@@ -295,47 +719,155 @@ SymbolResolver::resolve(uintptr_t ip, size_t generation)
     return it->second;
 }
 
-SymbolResolver::resolved_frames_t
-SymbolResolver::resolveFromSegments(uintptr_t ip, size_t generation)
+void
+SymbolResolver::sortSegmentsIfDirty()
 {
     if (d_are_segments_dirty) {
-        // Sort the segments so the binary search below works
-        sort(currentSegments().begin(), currentSegments().end());
+        // Sort the segments so the binary search in findSegment() works
+        auto& segments = currentSegments();
+        std::sort(segments.begin(), segments.end(), [](const auto* lhs, const auto* rhs) {
+            return *lhs < *rhs;
+        });
         d_are_segments_dirty = false;
     }
+}
 
+const MemorySegment*
+SymbolResolver::findSegment(uintptr_t ip, size_t generation) const
+{
     const auto& segments = d_segments.at(generation);
     auto segment = findModule(ip, segments);
-    if (segment == segments.end() || !segment->isAddressInRange(ip)) {
+    if (segment == segments.end() || !(*segment)->isAddressInRange(ip)) {
         return nullptr;
     }
+    return *segment;
+}
 
-    std::vector<ResolvedFrame> frames;
-    const auto expanded_frame = segment->resolveIp(ip);
+SymbolResolver::resolved_frames_t
+SymbolResolver::resolveFromSegments(uintptr_t ip, size_t generation)
+{
+    if (ip == tracking_api::TRUNCATED_NATIVE_FRAME_IP) {
+        std::vector<ResolvedFrame> frames{
+                ResolvedFrame{{tracking_api::TRUNCATED_FRAME_NAME, "", 0}, d_strings}};
+        return std::make_shared<ResolvedFrames>(d_strings->intern(""), std::move(frames), d_strings);
+    }
+    sortSegmentsIfDirty();
+    const MemorySegment* segment = findSegment(ip, generation);
+    if (segment == nullptr) {
+        return nullptr;
+    }
+    return makeResolvedFrames(*segment, segment->resolveIp(ip));
+}
+
+SymbolResolver::resolved_frames_t
+SymbolResolver::makeResolvedFrames(
+        const MemorySegment& segment,
+        const MemorySegment::ExpandedFrame& expanded_frame)
+{
     if (expanded_frame.empty()) {
         return nullptr;
     }
-    auto segment_index = segment->filenameIndex();
+    std::vector<ResolvedFrame> frames;
+    auto segment_index = segment.filenameIndex();
     std::transform(
             expanded_frame.begin(),
             expanded_frame.end(),
             std::back_inserter(frames),
             [this](const auto& frame) {
-                return ResolvedFrame{frame, d_string_storage};
+                return ResolvedFrame{frame, d_strings};
             });
-    return std::make_shared<ResolvedFrames>(segment_index, std::move(frames), d_string_storage);
+    return std::make_shared<ResolvedFrames>(segment_index, std::move(frames), d_strings);
+}
+
+void
+SymbolResolver::resolveBatch(const std::vector<std::pair<uintptr_t, size_t>>& ips)
+{
+    struct Job
+    {
+        uintptr_t ip;
+        size_t generation;
+        const MemorySegment* segment;
+        MemorySegment::ExpandedFrame expanded_frame;
+    };
+
+    // libbacktrace states and symbol caches are not thread safe, so all the
+    // addresses in one object file are resolved by the same thread.
+    sortSegmentsIfDirty();
+    std::unordered_map<ObjectFile*, std::vector<Job>> jobs_by_object_file;
+    std::unordered_set<ips_cache_pair_t, ips_cache_pair_hash> seen;
+    for (const auto& [ip, generation] : ips) {
+        // The truncation marker belongs to no segment, but resolve() knows it.
+        if (ip == tracking_api::TRUNCATED_NATIVE_FRAME_IP || d_resolved_ips_cache.count({ip, generation})
+            || !d_segments.count(generation) || !seen.emplace(ip, generation).second)
+        {
+            continue;
+        }
+        const MemorySegment* segment = findSegment(ip, generation);
+        if (segment == nullptr) {
+            d_resolved_ips_cache.emplace(ips_cache_pair_t(ip, generation), nullptr);
+            continue;
+        }
+        jobs_by_object_file[segment->objectFile()].push_back({ip, generation, segment, {}});
+    }
+
+    std::vector<std::vector<Job>*> groups;
+    for (auto& [object_file, jobs] : jobs_by_object_file) {
+        groups.push_back(&jobs);
+    }
+    if (groups.empty()) {
+        return;
+    }
+    // Start with the largest groups, so they don't end up alone at the end.
+    std::sort(groups.begin(), groups.end(), [](auto* lhs, auto* rhs) {
+        return lhs->size() > rhs->size();
+    });
+
+    std::atomic<size_t> next_group{0};
+    auto worker = [&]() {
+        for (size_t i = next_group++; i < groups.size(); i = next_group++) {
+            for (auto& job : *groups[i]) {
+                job.expanded_frame = job.segment->resolveIp(job.ip);
+            }
+        }
+    };
+
+    const size_t n_threads =
+            std::min<size_t>({groups.size(), std::max(std::thread::hardware_concurrency(), 1u), 8});
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (const auto* jobs : groups) {
+        for (const auto& job : *jobs) {
+            d_resolved_ips_cache.emplace(
+                    ips_cache_pair_t(job.ip, job.generation),
+                    makeResolvedFrames(*job.segment, job.expanded_frame));
+        }
+    }
 }
 
 void
 SymbolResolver::addSegment(
         const std::string& filename,
-        backtrace_state* backtrace_state,
+        ObjectFile* object_file,
         const size_t filename_index,
+        const uintptr_t load_address,
         const uintptr_t address_start,
         const uintptr_t address_end)
 {
-    currentSegments()
-            .emplace_back(filename, address_start, address_end, backtrace_state, filename_index);
+    d_segment_storage.emplace_back(
+            filename,
+            address_start,
+            address_end,
+            load_address,
+            object_file,
+            filename_index);
+    currentSegments().push_back(&d_segment_storage.back());
     d_are_segments_dirty = true;
 }
 
@@ -347,29 +879,30 @@ SymbolResolver::addSegments(
 {
     // We use a char* for the filename to reduce the memory footprint and
     // because the libbacktrace callback in findBacktraceState operates on char*
-    const char* interned_filename = nullptr;
-    auto filename_index = d_string_storage->internString(filename, &interned_filename);
+    auto filename_index = d_strings->intern(filename);
+    const char* interned_filename = d_strings->c_str(filename_index);
 
-    auto state = findBacktraceState(interned_filename, addr);
-    if (state == nullptr) {
-        LOG(RESOLVE_LIB_LOG_LEVEL) << "Failed to prepare a backtrace state for " << filename;
+    // Files that can't use the symbol cache need a backtrace state to be
+    // useful at all, so create it right away to find out if that's possible.
+    auto object_file = findObjectFile(interned_filename, addr);
+    if (object_file->symbolCache() == nullptr
+        && !(d_symbols_only && object_file->symbolTable() != nullptr)
+        && object_file->backtraceState() == nullptr)
+    {
         return;
     }
 
     for (const auto& segment : segments) {
         const uintptr_t segment_start = addr + segment.vaddr;
         const uintptr_t segment_end = addr + segment.vaddr + segment.memsz;
-        addSegment(filename, state, filename_index, segment_start, segment_end);
+        addSegment(filename, object_file, filename_index, addr, segment_start, segment_end);
     }
 }
 
 void
 SymbolResolver::clearSegments()
 {
-    if (d_are_segments_dirty) {
-        // Sort the segments so the binary search in resolve() works
-        sort(currentSegments().begin(), currentSegments().end());
-    }
+    sortSegmentsIfDirty();
     size_t reserve_size = 256;
     if (currentSegmentGeneration() > 0) {
         reserve_size = currentSegments().size();
@@ -377,17 +910,40 @@ SymbolResolver::clearSegments()
     d_segments[currentSegmentGeneration() + 1].reserve(reserve_size);
 }
 
-backtrace_state*
-SymbolResolver::findBacktraceState(const char* filename, uintptr_t address_start)
+void
+SymbolResolver::copySegments()
 {
-    // We hash into "d_backtrace_states" using a char* as it's safe on the condition that every
-    // const char* used as a key in the map is one that was returned by "d_string_storage",
-    // and it's safe because no pointer that's returned by "d_string_storage" is ever invalidated.
-    auto it = d_backtrace_states.find(filename);
-    if (it != d_backtrace_states.end()) {
-        return it->second;
+    if (currentSegmentGeneration() == 0) {
+        clearSegments();
+        return;
     }
+    sortSegmentsIfDirty();
+    // The segments don't change once created, so the new generation can
+    // point to the same ones as the current generation.
+    auto segments = currentSegments();
+    d_segments.emplace(currentSegmentGeneration() + 1, std::move(segments));
+}
 
+void
+SymbolResolver::removeSegments(const std::string& filename, uintptr_t addr)
+{
+    if (currentSegmentGeneration() == 0) {
+        return;
+    }
+    auto& segments = currentSegments();
+    segments.erase(
+            std::remove_if(
+                    segments.begin(),
+                    segments.end(),
+                    [&](const MemorySegment* segment) {
+                        return segment->loadAddress() == addr && segment->filename() == filename;
+                    }),
+            segments.end());
+}
+
+static backtrace_state*
+createBacktraceState(const char* filename, uintptr_t address_start)
+{
     struct CallbackData
     {
         const char* fileName;
@@ -447,11 +1003,49 @@ SymbolResolver::findBacktraceState(const char* filename, uintptr_t address_start
         return nullptr;
 #endif
     }
-    d_backtrace_states.insert(it, {filename, state});
     return state;
 }
 
-std::vector<MemorySegment>&
+backtrace_state*
+ObjectFile::backtraceState()
+{
+    if (!d_state_created) {
+        d_state_created = true;
+        d_state = createBacktraceState(d_filename, d_address_start);
+        if (d_state == nullptr) {
+            LOG(RESOLVE_LIB_LOG_LEVEL) << "Failed to prepare a backtrace state for " << d_filename;
+        }
+    }
+    return d_state;
+}
+
+ObjectFile*
+SymbolResolver::findObjectFile(const char* filename, uintptr_t address_start)
+{
+    // We hash into "d_object_files" using a char* as it's safe on the condition that every
+    // const char* used as a key in the map is one that was returned by "d_strings",
+    // and it's safe because no pointer that's returned by "d_strings" is ever invalidated.
+    auto it = d_object_files.find(filename);
+    if (it == d_object_files.end()) {
+        auto object_file = std::make_unique<ObjectFile>(filename, address_start, d_symbols_only);
+        it = d_object_files.emplace(filename, std::move(object_file)).first;
+    }
+    return it->second.get();
+}
+
+backtrace_state*
+SymbolResolver::findBacktraceState(const char* filename, uintptr_t address_start)
+{
+    return findObjectFile(filename, address_start)->backtraceState();
+}
+
+void
+SymbolResolver::setSymbolsOnly(bool symbols_only)
+{
+    d_symbols_only = symbols_only;
+}
+
+std::vector<const MemorySegment*>&
 SymbolResolver::currentSegments()
 {
     return d_segments.at(d_segments.size());
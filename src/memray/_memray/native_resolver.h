@@ -4,6 +4,7 @@
 #include <Python.h>
 
 #include <algorithm>
+#include <deque>
 #include <memory>
 #include <string>
 #include <tuple>
@@ -19,31 +20,14 @@
 
 #include "python_helpers.h"
 #include "records.h"
+#include "string_interner.h"
 
 namespace memray::native_resolver {
 
 static constexpr int PREALLOCATED_BACKTRACE_STATES = 64;
 static constexpr int PREALLOCATED_IPS_CACHE_ITEMS = 32768;
 
-class StringStorage
-{
-  public:
-    // Constructors
-    StringStorage();
-    StringStorage(StringStorage& other) = delete;
-    StringStorage(StringStorage&& other) = delete;
-    void operator=(const StringStorage&) = delete;
-    void operator=(StringStorage&&) = delete;
-
-    // Methods
-    size_t internString(const std::string& str, const char** interned_string = nullptr);
-    const std::string& resolveString(size_t index) const;
-
-  private:
-    // Data members
-    std::unordered_map<std::string, size_t> d_interned_data;
-    std::vector<const std::string*> d_interned_data_storage;
-};
+class ObjectFile;
 
 class MemorySegment
 {
@@ -63,7 +47,8 @@ class MemorySegment
             std::string filename,
             uintptr_t start,
             uintptr_t end,
-            backtrace_state* state,
+            uintptr_t load_address,
+            ObjectFile* object_file,
             size_t filename_index);
     ExpandedFrame resolveIp(uintptr_t address) const;
     bool operator<(const MemorySegment& segment) const;
@@ -73,20 +58,121 @@ class MemorySegment
     // Getters
     uintptr_t start() const;
     uintptr_t end() const;
+    uintptr_t loadAddress() const;
     size_t filenameIndex() const;
     const std::string& filename() const;
+    ObjectFile* objectFile() const;
 
   private:
     // Methods
-    void resolveFromDebugInfo(uintptr_t address, ExpandedFrame& expanded_frame) const;
-    void resolveFromSymbolTable(uintptr_t address, ExpandedFrame& expanded_frame) const;
+    void resolveFromDebugInfo(
+            backtrace_state* state,
+            uintptr_t address,
+            ExpandedFrame& expanded_frame) const;
+    void resolveFromSymbolTable(
+            backtrace_state* state,
+            uintptr_t address,
+            ExpandedFrame& expanded_frame) const;
 
     // Data members
     std::string d_filename;
     uintptr_t d_start;
     uintptr_t d_end;
+    uintptr_t d_load_address;
     size_t d_index;
-    backtrace_state* d_state;
+    ObjectFile* d_object_file;
+};
+
+// Symbols resolved for an ELF file in previous runs, stored on disk and keyed
+// by the file's build id and by the offset of each address from the address
+// the file was loaded at. New entries are appended to the file on disk when
+// the cache is destroyed.
+class SymbolCache
+{
+  public:
+    // Constructors
+    explicit SymbolCache(std::string path);
+    ~SymbolCache();
+    SymbolCache(SymbolCache& other) = delete;
+    SymbolCache(SymbolCache&& other) = delete;
+    void operator=(const SymbolCache&) = delete;
+    void operator=(SymbolCache&&) = delete;
+
+    // Returns nullptr if the file has no build id or no cache directory can be used.
+    static std::unique_ptr<SymbolCache> forFile(const char* filename);
+
+    // Methods
+    const MemorySegment::ExpandedFrame* find(uintptr_t offset) const;
+    void insert(uintptr_t offset, const MemorySegment::ExpandedFrame& frames);
+
+  private:
+    // Methods
+    void load();
+    void save() const;
+
+    // Data members
+    std::string d_path;
+    std::unordered_map<uintptr_t, MemorySegment::ExpandedFrame> d_entries;
+    std::vector<uintptr_t> d_new_entries;
+};
+
+// The functions in the symbol table of an ELF file, sorted by address. This
+// is all that symbols-only resolution reads from a file, which is much less
+// than its debug information.
+class ElfSymbolTable
+{
+  public:
+    // Returns nullptr if the file has no symbol table that can be read.
+    static std::unique_ptr<ElfSymbolTable> forFile(const char* filename);
+
+    // Methods
+    // The name of the function containing the given offset from the address
+    // the file was loaded at, or nullptr if there is none.
+    const char* find(uintptr_t offset) const;
+
+  private:
+    // Aliases and helpers
+    struct Symbol
+    {
+        uintptr_t start;
+        uintptr_t end;
+        size_t name;
+    };
+
+    // Methods
+    bool load(int fd);
+
+    // Data members
+    std::vector<Symbol> d_symbols;
+    std::vector<char> d_names;
+};
+
+// An executable or shared library loaded by the tracked process. Creating
+// its backtrace state means parsing its symbol table and debug information,
+// so this only happens the first time an address in it misses the cache.
+// When only symbols are resolved, its symbol table is read instead.
+class ObjectFile
+{
+  public:
+    // Constructors
+    ObjectFile(const char* filename, uintptr_t address_start, bool symbols_only = false);
+
+    // Methods
+    backtrace_state* backtraceState();
+    const ElfSymbolTable* symbolTable();
+    SymbolCache* symbolCache() const;
+    bool symbolsOnly() const;
+
+  private:
+    // Data members
+    const char* d_filename;
+    uintptr_t d_address_start;
+    bool d_symbols_only;
+    bool d_state_created{false};
+    backtrace_state* d_state{nullptr};
+    bool d_symbol_table_created{false};
+    std::unique_ptr<ElfSymbolTable> d_symbol_table;
+    std::unique_ptr<SymbolCache> d_symbol_cache;
 };
 
 class ResolvedFrame
@@ -95,22 +181,26 @@ class ResolvedFrame
     // Constructors
     ResolvedFrame(
             const MemorySegment::Frame& frame,
-            const std::shared_ptr<StringStorage>& string_storage);
+            const std::shared_ptr<api::StringInterner>& strings);
 
     // Methods
     PyObject* toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) const;
 
     // Getters
-    const std::string& Symbol() const;
-    const std::string& File() const;
+    std::string_view Symbol() const;
+    std::string_view File() const;
     int Line() const;
+    // Whether this is a call to the eval loop, where Python frames go in
+    // hybrid stacks.
+    bool IsEvalFrame() const;
 
   private:
     // Data members
-    std::shared_ptr<StringStorage> d_string_storage;
-    size_t d_symbol_index;
-    size_t d_file_index;
+    std::shared_ptr<api::StringInterner> d_strings;
+    api::StringInterner::id_t d_symbol_id;
+    api::StringInterner::id_t d_file_id;
     int d_line;
+    bool d_is_eval_frame;
 };
 
 class ResolvedFrames
@@ -118,22 +208,25 @@ class ResolvedFrames
   public:
     // Constructors
     template<typename T>
-    ResolvedFrames(size_t memory_map_index, T&& frames, std::shared_ptr<StringStorage> strings_storage)
-    : d_memory_map_index(memory_map_index)
+    ResolvedFrames(
+            api::StringInterner::id_t memory_map_id,
+            T&& frames,
+            std::shared_ptr<api::StringInterner> strings)
+    : d_memory_map_id(memory_map_id)
     , d_frames(std::forward<T>(frames))
-    , d_string_storage(std::move(strings_storage))
+    , d_strings(std::move(strings))
     {
     }
 
     // Getters
-    const std::string& memoryMap() const;
+    std::string_view memoryMap() const;
     const std::vector<ResolvedFrame>& frames() const;
 
   private:
     // Data members
-    size_t d_memory_map_index{0};
+    api::StringInterner::id_t d_memory_map_id{0};
     std::vector<ResolvedFrame> d_frames{};
-    std::shared_ptr<StringStorage> d_string_storage{nullptr};
+    std::shared_ptr<api::StringInterner> d_strings{nullptr};
 };
 
 class SymbolResolver
@@ -143,15 +236,32 @@ class SymbolResolver
 
     // Constructors
     SymbolResolver();
+    // Symbols, file names and names of memory maps are interned in the
+    // given interner, which can be shared with the reader that owns the
+    // resolver.
+    explicit SymbolResolver(std::shared_ptr<api::StringInterner> strings);
 
     // Methods
     resolved_frames_t resolve(uintptr_t ip, size_t generation);
+    // Resolve many (instruction pointer, segment generation) pairs at once,
+    // spreading the object files they belong to across several threads. The
+    // results are cached, so that resolve() finds them later.
+    void resolveBatch(const std::vector<std::pair<uintptr_t, size_t>>& ips);
     void addSegments(
             const std::string& filename,
             uintptr_t addr,
             const std::vector<tracking_api::Segment>& segments);
+    // Start a new generation of segments, either empty or with the segments
+    // of the current one, in which case they are shared rather than copied.
     void clearSegments();
+    void copySegments();
+    void removeSegments(const std::string& filename, uintptr_t addr);
     backtrace_state* findBacktraceState(const char* filename, uintptr_t address_start);
+    // Only find the names of functions, from the symbol tables of the files
+    // they are in, without ever loading their debug information. Their file
+    // names and line numbers are unknown, and inlined calls aren't expanded.
+    // This must be set before any segments are added.
+    void setSymbolsOnly(bool symbols_only);
 
     // Getters
     size_t currentSegmentGeneration() const;
@@ -171,18 +281,29 @@ class SymbolResolver
     // Methods
     void addSegment(
             const std::string& filename,
-            backtrace_state* backtrace_state,
+            ObjectFile* object_file,
             size_t filename_index,
+            uintptr_t load_address,
             uintptr_t address_start,
             uintptr_t address_end);
-    std::vector<MemorySegment>& currentSegments();
+    ObjectFile* findObjectFile(const char* filename, uintptr_t address_start);
+    std::vector<const MemorySegment*>& currentSegments();
+    void sortSegmentsIfDirty();
+    const MemorySegment* findSegment(uintptr_t ip, size_t generation) const;
     resolved_frames_t resolveFromSegments(uintptr_t ip, size_t generation);
+    resolved_frames_t makeResolvedFrames(
+            const MemorySegment& segment,
+            const MemorySegment::ExpandedFrame& expanded_frame);
 
     // Data members
-    std::unordered_map<size_t, std::vector<MemorySegment>> d_segments;
+    // Every generation is a sorted list of segments, which live in the
+    // storage for as long as the resolver does.
+    std::deque<MemorySegment> d_segment_storage;
+    std::unordered_map<size_t, std::vector<const MemorySegment*>> d_segments;
     bool d_are_segments_dirty = false;
-    std::unordered_map<const char*, backtrace_state*> d_backtrace_states;
-    std::shared_ptr<StringStorage> d_string_storage{std::make_shared<StringStorage>()};
+    bool d_symbols_only = false;
+    std::unordered_map<const char*, std::unique_ptr<ObjectFile>> d_object_files;
+    std::shared_ptr<api::StringInterner> d_strings;
     mutable std::unordered_map<ips_cache_pair_t, resolved_frames_t, ips_cache_pair_hash>
             d_resolved_ips_cache;
 };
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+
+namespace memray::io {
+
+// Carries the bytes written to a PipeSink over to a PipeSource in the same
+// process, in the order they were written. Writers never wait for the
+// reader, so that a reader thread can't deadlock with the writers it is
+// keeping up with, even if something it does while holding a lock of its own
+// allocates memory that gets tracked.
+class Pipe
+{
+  public:
+    void write(std::string&& data)
+    {
+        if (data.empty()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            if (d_closed) {
+                return;
+            }
+            d_chunks.push_back(std::move(data));
+        }
+        d_cv.notify_one();
+    }
+
+    // Wait for the next chunk of bytes. Returns false once the pipe is
+    // closed and everything written to it was read.
+    bool read(std::string* chunk)
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_cv.wait(lock, [this]() { return d_closed || !d_chunks.empty(); });
+        if (d_chunks.empty()) {
+            return false;
+        }
+        *chunk = std::move(d_chunks.front());
+        d_chunks.pop_front();
+        return true;
+    }
+
+    // Once closed, nothing more can be written. The writing side closes it
+    // without discarding anything, so that the reader still gets what's left.
+    void close(bool discard)
+    {
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            d_closed = true;
+            if (discard) {
+                d_chunks.clear();
+            }
+        }
+        d_cv.notify_all();
+    }
+
+  private:
+    std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::deque<std::string> d_chunks{};
+    bool d_closed{false};
+};
+
+}  // namespace memray::io
@@ -0,0 +1,3 @@
+cdef extern from "pipe.h" namespace "memray::io":
+    cdef cppclass Pipe:
+        pass
@@ -0,0 +1,219 @@
+#include "pprof.h"
+
+namespace memray::api {
+
+namespace {  // unnamed
+
+// Field numbers of the messages in profile.proto.
+enum ProfileField : int {
+    PROFILE_SAMPLE_TYPE = 1,
+    PROFILE_SAMPLE = 2,
+    PROFILE_LOCATION = 4,
+    PROFILE_FUNCTION = 5,
+    PROFILE_STRING_TABLE = 6,
+    PROFILE_TIME_NANOS = 9,
+    PROFILE_DURATION_NANOS = 10,
+    PROFILE_DEFAULT_SAMPLE_TYPE = 14,
+};
+
+enum ValueTypeField : int {
+    VALUE_TYPE_TYPE = 1,
+    VALUE_TYPE_UNIT = 2,
+};
+
+enum SampleField : int {
+    SAMPLE_LOCATION_ID = 1,
+    SAMPLE_VALUE = 2,
+    SAMPLE_LABEL = 3,
+};
+
+enum LabelField : int {
+    LABEL_KEY = 1,
+    LABEL_STR = 2,
+};
+
+enum LocationField : int {
+    LOCATION_ID = 1,
+    LOCATION_ADDRESS = 3,
+    LOCATION_LINE = 4,
+};
+
+enum LineField : int {
+    LINE_FUNCTION_ID = 1,
+    LINE_LINE = 2,
+};
+
+enum FunctionField : int {
+    FUNCTION_ID = 1,
+    FUNCTION_NAME = 2,
+    FUNCTION_SYSTEM_NAME = 3,
+    FUNCTION_FILENAME = 4,
+};
+
+enum class WireType : int {
+    VARINT = 0,
+    LENGTH_DELIMITED = 2,
+};
+
+void
+appendVarint(std::string* out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+}
+
+void
+appendTag(std::string* out, int field, WireType wire_type)
+{
+    appendVarint(out, (static_cast<uint64_t>(field) << 3) | static_cast<int>(wire_type));
+}
+
+void
+appendVarintField(std::string* out, int field, uint64_t value)
+{
+    appendTag(out, field, WireType::VARINT);
+    appendVarint(out, value);
+}
+
+void
+appendBytesField(std::string* out, int field, std::string_view bytes)
+{
+    appendTag(out, field, WireType::LENGTH_DELIMITED);
+    appendVarint(out, bytes.size());
+    out->append(bytes);
+}
+
+}  // namespace
+
+PprofProfile::PprofProfile(std::string_view sample_kind)
+{
+    // The first string of the table must be the empty one.
+    stringId("");
+
+    const std::string kind(sample_kind);
+    std::string value_type;
+    appendVarintField(&value_type, VALUE_TYPE_TYPE, stringId(kind + "_objects"));
+    appendVarintField(&value_type, VALUE_TYPE_UNIT, stringId("count"));
+    appendBytesField(&d_sample_types, PROFILE_SAMPLE_TYPE, value_type);
+
+    value_type.clear();
+    d_default_sample_type = stringId(kind + "_space");
+    appendVarintField(&value_type, VALUE_TYPE_TYPE, d_default_sample_type);
+    appendVarintField(&value_type, VALUE_TYPE_UNIT, stringId("bytes"));
+    appendBytesField(&d_sample_types, PROFILE_SAMPLE_TYPE, value_type);
+
+    d_thread_label = stringId("thread");
+}
+
+PprofProfile::id_t
+PprofProfile::stringId(std::string_view string)
+{
+    auto [it, inserted] = d_string_ids.emplace(string, d_strings.size());
+    if (inserted) {
+        d_strings.push_back(&it->first);
+    }
+    return it->second;
+}
+
+PprofProfile::id_t
+PprofProfile::functionId(std::string_view name, std::string_view filename)
+{
+    const id_t name_id = stringId(name);
+    const id_t filename_id = stringId(filename);
+    std::string key;
+    appendVarint(&key, name_id);
+    appendVarint(&key, filename_id);
+    // Ids start at 1, since 0 means that there is none.
+    auto [it, inserted] = d_function_ids.emplace(std::move(key), d_function_ids.size() + 1);
+    if (inserted) {
+        std::string function;
+        appendVarintField(&function, FUNCTION_ID, it->second);
+        appendVarintField(&function, FUNCTION_NAME, name_id);
+        appendVarintField(&function, FUNCTION_SYSTEM_NAME, name_id);
+        appendVarintField(&function, FUNCTION_FILENAME, filename_id);
+        appendBytesField(&d_functions, PROFILE_FUNCTION, function);
+    }
+    return it->second;
+}
+
+PprofProfile::id_t
+PprofProfile::locationId(uint64_t address, const std::vector<line_t>& lines)
+{
+    // The location without its id is what tells locations apart.
+    std::string contents;
+    if (address) {
+        appendVarintField(&contents, LOCATION_ADDRESS, address);
+    }
+    std::string line;
+    for (const auto& [function_id, lineno] : lines) {
+        line.clear();
+        appendVarintField(&line, LINE_FUNCTION_ID, function_id);
+        appendVarintField(&line, LINE_LINE, static_cast<uint64_t>(lineno));
+        appendBytesField(&contents, LOCATION_LINE, line);
+    }
+    auto [it, inserted] = d_location_ids.emplace(contents, d_location_ids.size() + 1);
+    if (inserted) {
+        std::string location;
+        appendVarintField(&location, LOCATION_ID, it->second);
+        location.append(contents);
+        appendBytesField(&d_locations, PROFILE_LOCATION, location);
+    }
+    return it->second;
+}
+
+void
+PprofProfile::addSample(
+        const std::vector<id_t>& location_ids,
+        size_t n_allocations,
+        size_t size,
+        std::string_view thread_name)
+{
+    std::string sample;
+    std::string packed;
+    for (id_t location_id : location_ids) {
+        appendVarint(&packed, location_id);
+    }
+    appendBytesField(&sample, SAMPLE_LOCATION_ID, packed);
+
+    packed.clear();
+    appendVarint(&packed, n_allocations);
+    appendVarint(&packed, size);
+    appendBytesField(&sample, SAMPLE_VALUE, packed);
+
+    std::string label;
+    appendVarintField(&label, LABEL_KEY, d_thread_label);
+    appendVarintField(&label, LABEL_STR, stringId(thread_name));
+    appendBytesField(&sample, SAMPLE_LABEL, label);
+
+    appendBytesField(&d_samples, PROFILE_SAMPLE, sample);
+}
+
+std::string
+PprofProfile::serialize(int64_t time_nanos, int64_t duration_nanos) const
+{
+    std::string profile;
+    size_t strings_size = 0;
+    for (const std::string* string : d_strings) {
+        strings_size += string->size() + 6;
+    }
+    profile.reserve(
+            d_sample_types.size() + d_samples.size() + d_locations.size() + d_functions.size()
+            + strings_size + 32);
+
+    profile.append(d_sample_types);
+    profile.append(d_samples);
+    profile.append(d_locations);
+    profile.append(d_functions);
+    for (const std::string* string : d_strings) {
+        appendBytesField(&profile, PROFILE_STRING_TABLE, *string);
+    }
+    appendVarintField(&profile, PROFILE_TIME_NANOS, static_cast<uint64_t>(time_nanos));
+    appendVarintField(&profile, PROFILE_DURATION_NANOS, static_cast<uint64_t>(duration_nanos));
+    appendVarintField(&profile, PROFILE_DEFAULT_SAMPLE_TYPE, d_default_sample_type);
+    return profile;
+}
+
+}  // namespace memray::api
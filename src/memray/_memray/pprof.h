@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace memray::api {
+
+// A profile in the protocol buffer format that pprof reads (see profile.proto
+// in https://github.com/google/pprof), built one sample at a time. Strings,
+// functions and locations are deduplicated as they are added, and the
+// samples are encoded right away, so that only the tables are held until
+// the profile is serialized.
+class PprofProfile
+{
+  public:
+    using id_t = uint64_t;
+
+    // A line of a location: the function it's in and the line number.
+    using line_t = std::pair<id_t, int64_t>;
+
+    // Constructors
+    // The profile has two values per sample, the number of allocations and
+    // their size in bytes, in sample types named after ``sample_kind``
+    // ("inuse_objects" and "inuse_space" for "inuse").
+    explicit PprofProfile(std::string_view sample_kind);
+
+    // Methods
+    id_t stringId(std::string_view string);
+    id_t functionId(std::string_view name, std::string_view filename);
+    // Get the location at an instruction address (0 for Python code), with
+    // the lines of the functions inlined at it, innermost first.
+    id_t locationId(uint64_t address, const std::vector<line_t>& lines);
+    // Add a sample whose stack has the given locations, innermost first,
+    // with a label for the thread that made the allocations.
+    void addSample(
+            const std::vector<id_t>& location_ids,
+            size_t n_allocations,
+            size_t size,
+            std::string_view thread_name);
+    std::string serialize(int64_t time_nanos, int64_t duration_nanos) const;
+
+  private:
+    // Data members
+    std::unordered_map<std::string, id_t> d_string_ids{};
+    std::vector<const std::string*> d_strings{};
+    std::unordered_map<std::string, id_t> d_function_ids{};
+    std::string d_functions{};
+    std::unordered_map<std::string, id_t> d_location_ids{};
+    std::string d_locations{};
+    std::string d_samples{};
+    std::string d_sample_types{};
+    id_t d_default_sample_type;
+    id_t d_thread_label;
+};
+
+}  // namespace memray::api
@@ -0,0 +1,694 @@
+#include "ptrace_attach.h"
+
+#include <stdexcept>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#    define MEMRAY_HAS_PTRACE_ATTACH 1
+#endif
+
+#ifdef MEMRAY_HAS_PTRACE_ATTACH
+#    include <algorithm>
+#    include <cerrno>
+#    include <chrono>
+#    include <cstdint>
+#    include <cstdio>
+#    include <cstring>
+#    include <fstream>
+#    include <map>
+#    include <thread>
+#    include <unordered_set>
+#    include <vector>
+
+#    include <dirent.h>
+#    include <dlfcn.h>
+#    include <elf.h>
+#    include <signal.h>
+#    include <sys/ptrace.h>
+#    include <sys/uio.h>
+#    include <sys/user.h>
+#    include <sys/wait.h>
+#endif
+
+namespace memray::ptrace_attach {
+
+#ifdef MEMRAY_HAS_PTRACE_ATTACH
+
+namespace {  // unnamed
+
+using Clock = std::chrono::steady_clock;
+using Registers = struct user_regs_struct;
+
+// The allocator entry points we wait for a thread to reach. Our gdb and lldb
+// scripts also break on the PyMem_* functions, but we have no way to find
+// those for an arbitrary interpreter before we can run code in the process.
+const char* const BREAKPOINT_SYMBOLS[] = {"malloc", "calloc", "realloc", "free"};
+
+#    if defined(__x86_64__)
+// int3 leaves the program counter after itself.
+const unsigned long TRAP_INSTRUCTION = 0xcc;
+const unsigned long TRAP_INSTRUCTION_MASK = 0xff;
+const uintptr_t TRAP_PC_OFFSET = 1;
+const uintptr_t RED_ZONE_SIZE = 128;
+
+uintptr_t&
+programCounter(Registers& regs)
+{
+    return reinterpret_cast<uintptr_t&>(regs.rip);
+}
+
+uintptr_t&
+stackPointer(Registers& regs)
+{
+    return reinterpret_cast<uintptr_t&>(regs.rsp);
+}
+
+uintptr_t
+returnValue(const Registers& regs)
+{
+    return regs.rax;
+}
+#    elif defined(__aarch64__)
+// brk #0 leaves the program counter pointing at itself.
+const unsigned long TRAP_INSTRUCTION = 0xd4200000;
+const unsigned long TRAP_INSTRUCTION_MASK = 0xffffffff;
+const uintptr_t TRAP_PC_OFFSET = 0;
+const uintptr_t RED_ZONE_SIZE = 0;
+
+uintptr_t&
+programCounter(Registers& regs)
+{
+    return reinterpret_cast<uintptr_t&>(regs.pc);
+}
+
+uintptr_t&
+stackPointer(Registers& regs)
+{
+    return reinterpret_cast<uintptr_t&>(regs.sp);
+}
+
+uintptr_t
+returnValue(const Registers& regs)
+{
+    return regs.regs[0];
+}
+#    endif
+
+bool
+getRegisters(pid_t tid, Registers* regs)
+{
+    struct iovec iov = {regs, sizeof(*regs)};
+    return ::ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov) == 0;
+}
+
+bool
+setRegisters(pid_t tid, const Registers& regs)
+{
+    struct iovec iov = {const_cast<Registers*>(&regs), sizeof(regs)};
+    return ::ptrace(PTRACE_SETREGSET, tid, NT_PRSTATUS, &iov) == 0;
+}
+
+std::runtime_error
+errnoError(const std::string& what)
+{
+    return std::runtime_error(what + ": " + ::strerror(errno));
+}
+
+struct Mapping
+{
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t offset;
+    std::string device;
+    unsigned long inode;
+};
+
+std::vector<Mapping>
+readMappings(const std::string& proc_dir)
+{
+    std::ifstream maps(proc_dir + "/maps");
+    if (!maps) {
+        throw std::runtime_error("The given process ID does not exist.");
+    }
+
+    std::vector<Mapping> mappings;
+    std::string line;
+    while (std::getline(maps, line)) {
+        Mapping mapping;
+        unsigned long start, end, offset;
+        char device[32];
+        const char* format = "%lx-%lx %*s %lx %31s %lu";
+        if (std::sscanf(line.c_str(), format, &start, &end, &offset, device, &mapping.inode) != 5) {
+            continue;
+        }
+        mapping.start = start;
+        mapping.end = end;
+        mapping.offset = offset;
+        mapping.device = device;
+        mappings.push_back(mapping);
+    }
+    return mappings;
+}
+
+// Find where a function we can see in our own address space lives in the
+// traced process. We can't look symbols up in the traced process before we
+// can run code in it, but the C library it uses is almost always the very
+// same file we use, loaded at a different base address.
+class SymbolLocator
+{
+  public:
+    explicit SymbolLocator(pid_t pid)
+    : d_local_mappings(readMappings("/proc/self"))
+    , d_remote_mappings(readMappings("/proc/" + std::to_string(pid)))
+    {
+    }
+
+    uintptr_t remoteAddress(const char* symbol) const
+    {
+        void* local_address = ::dlsym(RTLD_DEFAULT, symbol);
+        Dl_info info;
+        if (!local_address || !::dladdr(local_address, &info)) {
+            throw std::runtime_error(std::string("Failed to find ") + symbol + " in our own process.");
+        }
+        const auto local_base = reinterpret_cast<uintptr_t>(info.dli_fbase);
+
+        const Mapping* local_mapping = nullptr;
+        for (const auto& mapping : d_local_mappings) {
+            if (mapping.start <= local_base && local_base < mapping.end) {
+                local_mapping = &mapping;
+                break;
+            }
+        }
+
+        if (local_mapping && local_mapping->inode) {
+            for (const auto& mapping : d_remote_mappings) {
+                if (mapping.offset == 0 && mapping.inode == local_mapping->inode
+                    && mapping.device == local_mapping->device)
+                {
+                    return mapping.start + (reinterpret_cast<uintptr_t>(local_address) - local_base);
+                }
+            }
+        }
+
+        throw std::runtime_error(
+                std::string("The process does not use the same C library as memray (looking for ")
+                + (info.dli_fname ? info.dli_fname : symbol) + "). Try attaching with --method=gdb.");
+    }
+
+  private:
+    std::vector<Mapping> d_local_mappings;
+    std::vector<Mapping> d_remote_mappings;
+};
+
+std::string
+attachFailureReason(pid_t pid)
+{
+    const std::string reason =
+            std::string("Failed to attach to the process (") + ::strerror(errno) + ").\n";
+    if (::kill(pid, 0) != 0) {
+        if (errno == ESRCH) {
+            return reason + "The given process ID does not exist.";
+        }
+        if (errno == EPERM) {
+            return reason + "The given process ID is owned by a different user.";
+        }
+    }
+    return reason + "You most likely do not have permission to trace the process.";
+}
+
+struct Thread
+{
+    bool stopped{false};
+    int pending_signal{0};
+};
+
+enum class Event {
+    EXITED,
+    STOPPED,
+    BREAKPOINT,
+    SIGNAL,
+};
+
+// Drives every thread of a traced process through one injection: attaching,
+// waiting at the breakpoints, making the calls and detaching again. All of
+// this must happen on the thread that created the Injector.
+class Injector
+{
+  public:
+    explicit Injector(pid_t pid)
+    : d_pid(pid)
+    {
+    }
+
+    Injector(const Injector&) = delete;
+    Injector& operator=(const Injector&) = delete;
+
+    ~Injector()
+    {
+        try {
+            detach();
+        } catch (const std::exception&) {
+            // Nothing more we can do; the kernel detaches us when we exit.
+        }
+    }
+
+    void attach();
+    pid_t waitForBreakpoint(const std::vector<uintptr_t>& addresses, Clock::time_point deadline);
+    Registers hijack(pid_t tid);
+    uintptr_t call(pid_t tid, uintptr_t sp, uintptr_t function, uintptr_t arg0, uintptr_t arg1);
+    void writeMemory(pid_t tid, uintptr_t address, const void* data, size_t size);
+    std::string readString(pid_t tid, uintptr_t address);
+    void detach();
+
+  private:
+    pid_t d_pid;
+    std::map<pid_t, Thread> d_threads;
+    std::vector<std::pair<uintptr_t, unsigned long>> d_breakpoints;
+    // Kept after the breakpoints are removed, to recognize traps taken by
+    // threads that reached a breakpoint while we were removing it.
+    std::unordered_set<uintptr_t> d_breakpoint_addresses;
+    pid_t d_hijacked_tid{0};
+    Registers d_hijacked_registers{};
+
+    bool pollEvent(pid_t* tid, int* status, const Clock::time_point* deadline);
+    Event handleEvent(pid_t tid, int status);
+    void resume(pid_t tid);
+    void stopAll();
+    void removeBreakpoints(pid_t tid);
+};
+
+void
+Injector::attach()
+{
+    // Threads we've attached to report the threads they spawn, but threads we
+    // haven't reached yet can still spawn ones we'd miss, so keep listing the
+    // process's threads until we've found all of them.
+    const std::string task_dir = "/proc/" + std::to_string(d_pid) + "/task";
+    bool found_new_thread = true;
+    while (found_new_thread) {
+        found_new_thread = false;
+        DIR* dir = ::opendir(task_dir.c_str());
+        if (!dir) {
+            if (d_threads.empty()) {
+                throw std::runtime_error("The given process ID does not exist.");
+            }
+            break;
+        }
+        while (struct dirent* entry = ::readdir(dir)) {
+            const pid_t tid = std::atoi(entry->d_name);
+            if (tid <= 0 || d_threads.count(tid)) {
+                continue;
+            }
+            if (::ptrace(PTRACE_SEIZE, tid, nullptr, PTRACE_O_TRACECLONE) != 0) {
+                if (d_threads.empty() && errno != ESRCH) {
+                    ::closedir(dir);
+                    throw std::runtime_error(attachFailureReason(d_pid));
+                }
+                // The thread either exited already, or was spawned by one
+                // we've attached to and so is traced by us already. In the
+                // latter case we'll hear about it once it starts.
+                continue;
+            }
+            d_threads.emplace(tid, Thread{});
+            ::ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr);
+            found_new_thread = true;
+        }
+        ::closedir(dir);
+    }
+    stopAll();
+}
+
+bool
+Injector::pollEvent(pid_t* tid, int* status, const Clock::time_point* deadline)
+{
+    // We can't use waitpid(-1, ...) without risking reaping our own children,
+    // so poll each of the threads we know of in turn.
+    while (true) {
+        if (d_threads.empty()) {
+            throw std::runtime_error("The process exited while attaching to it.");
+        }
+        for (auto it = d_threads.begin(); it != d_threads.end();) {
+            const pid_t ret = ::waitpid(it->first, status, __WALL | WNOHANG);
+            if (ret == it->first) {
+                *tid = ret;
+                return true;
+            }
+            if (ret < 0 && errno == ECHILD) {
+                it = d_threads.erase(it);
+                continue;
+            }
+            ++it;
+        }
+        if (deadline && Clock::now() >= *deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+Event
+Injector::handleEvent(pid_t tid, int status)
+{
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        d_threads.erase(tid);
+        return Event::EXITED;
+    }
+
+    Thread& thread = d_threads[tid];
+    thread.stopped = true;
+    const int sig = WSTOPSIG(status);
+    const int event = status >> 16;
+
+    if (event == PTRACE_EVENT_CLONE) {
+        unsigned long new_tid;
+        if (::ptrace(PTRACE_GETEVENTMSG, tid, nullptr, &new_tid) == 0) {
+            // It reports a stop of its own once it starts running.
+            d_threads.emplace(static_cast<pid_t>(new_tid), Thread{});
+        }
+        return Event::STOPPED;
+    }
+
+    if (event == PTRACE_EVENT_STOP) {
+        return Event::STOPPED;
+    }
+
+    if (sig == SIGTRAP && event == 0) {
+        Registers regs;
+        if (getRegisters(tid, &regs)
+            && d_breakpoint_addresses.count(programCounter(regs) - TRAP_PC_OFFSET))
+        {
+            // Rewind to the start of the instruction we replaced, so that the
+            // thread runs it once the breakpoint has been removed.
+            programCounter(regs) -= TRAP_PC_OFFSET;
+            setRegisters(tid, regs);
+            return Event::BREAKPOINT;
+        }
+    }
+
+    thread.pending_signal = sig;
+    return Event::SIGNAL;
+}
+
+void
+Injector::resume(pid_t tid)
+{
+    Thread& thread = d_threads[tid];
+    // If this fails the thread was killed while stopped, and waitpid tells us.
+    ::ptrace(PTRACE_CONT, tid, nullptr, thread.pending_signal);
+    thread.stopped = false;
+    thread.pending_signal = 0;
+}
+
+void
+Injector::stopAll()
+{
+    for (const auto& [tid, thread] : d_threads) {
+        if (!thread.stopped) {
+            ::ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr);
+        }
+    }
+
+    // Threads started in the meantime report a stop of their own.
+    auto all_stopped = [&]() {
+        for (const auto& [tid, thread] : d_threads) {
+            if (!thread.stopped) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    pid_t tid;
+    int status;
+    while (!all_stopped()) {
+        pollEvent(&tid, &status, nullptr);
+        handleEvent(tid, status);
+    }
+}
+
+pid_t
+Injector::waitForBreakpoint(const std::vector<uintptr_t>& addresses, Clock::time_point deadline)
+{
+    const pid_t any_tid = d_threads.begin()->first;
+    for (uintptr_t address : addresses) {
+        if (d_breakpoint_addresses.count(address)) {
+            continue;
+        }
+        errno = 0;
+        const unsigned long word = ::ptrace(PTRACE_PEEKTEXT, any_tid, address, nullptr);
+        if (errno) {
+            throw errnoError("Failed to read the process's memory");
+        }
+        const unsigned long trap = (word & ~TRAP_INSTRUCTION_MASK) | TRAP_INSTRUCTION;
+        if (::ptrace(PTRACE_POKETEXT, any_tid, address, trap) != 0) {
+            throw errnoError("Failed to set a breakpoint in the process");
+        }
+        d_breakpoints.emplace_back(address, word);
+        d_breakpoint_addresses.insert(address);
+    }
+
+    for (const auto& [tid, thread] : d_threads) {
+        resume(tid);
+    }
+
+    pid_t tid;
+    int status;
+    while (true) {
+        if (!pollEvent(&tid, &status, &deadline)) {
+            stopAll();
+            removeBreakpoints(d_threads.begin()->first);
+            throw std::runtime_error(
+                    "Timed out waiting for the process to call an allocator. The process must be "
+                    "allocating or freeing memory to be attached to.");
+        }
+        Event event = handleEvent(tid, status);
+        if (event == Event::BREAKPOINT) {
+            break;
+        }
+        if (event != Event::EXITED) {
+            resume(tid);
+        }
+    }
+
+    removeBreakpoints(tid);
+    return tid;
+}
+
+void
+Injector::removeBreakpoints(pid_t tid)
+{
+    // Restore them in reverse order in case two of them share a word.
+    for (auto it = d_breakpoints.rbegin(); it != d_breakpoints.rend(); ++it) {
+        ::ptrace(PTRACE_POKETEXT, tid, it->first, it->second);
+    }
+    d_breakpoints.clear();
+}
+
+Registers
+Injector::hijack(pid_t tid)
+{
+    if (!getRegisters(tid, &d_hijacked_registers)) {
+        throw errnoError("Failed to read the registers of a thread of the process");
+    }
+    d_hijacked_tid = tid;
+    return d_hijacked_registers;
+}
+
+uintptr_t
+Injector::call(pid_t tid, uintptr_t sp, uintptr_t function, uintptr_t arg0, uintptr_t arg1)
+{
+    // The function returns to address 0, which crashes the thread with
+    // a SIGSEGV that we intercept before it's delivered.
+    Registers regs = d_hijacked_registers;
+#    if defined(__x86_64__)
+    const uintptr_t return_address = 0;
+    sp -= sizeof(return_address);
+    writeMemory(tid, sp, &return_address, sizeof(return_address));
+    regs.rdi = arg0;
+    regs.rsi = arg1;
+    regs.rax = 0;
+    regs.orig_rax = -1;
+#    elif defined(__aarch64__)
+    regs.regs[0] = arg0;
+    regs.regs[1] = arg1;
+    regs.regs[30] = 0;
+#    endif
+    stackPointer(regs) = sp;
+    programCounter(regs) = function;
+    if (!setRegisters(tid, regs)) {
+        throw errnoError("Failed to set the registers of a thread of the process");
+    }
+    resume(tid);
+
+    pid_t event_tid;
+    int status;
+    while (true) {
+        pollEvent(&event_tid, &status, nullptr);
+        const Event event = handleEvent(event_tid, status);
+        if (event == Event::EXITED) {
+            if (event_tid == tid) {
+                throw std::runtime_error("The process exited while attaching to it.");
+            }
+            continue;
+        }
+        if (event_tid == tid && event == Event::SIGNAL && d_threads[tid].pending_signal == SIGSEGV) {
+            // Whether or not this is our return to address 0, the signal
+            // must not be delivered: restoring the registers undoes a crash.
+            d_threads[tid].pending_signal = 0;
+            if (!getRegisters(tid, &regs) || programCounter(regs) != 0) {
+                throw std::runtime_error("A function called while attaching to the process crashed.");
+            }
+            return returnValue(regs);
+        }
+        resume(event_tid);
+    }
+}
+
+void
+Injector::writeMemory(pid_t tid, uintptr_t address, const void* data, size_t size)
+{
+    const auto* bytes = static_cast<const char*>(data);
+    while (size) {
+        unsigned long word;
+        const size_t count = std::min(size, sizeof(word));
+        if (count < sizeof(word)) {
+            errno = 0;
+            word = ::ptrace(PTRACE_PEEKDATA, tid, address, nullptr);
+            if (errno) {
+                throw errnoError("Failed to read the process's memory");
+            }
+        }
+        std::memcpy(&word, bytes, count);
+        if (::ptrace(PTRACE_POKEDATA, tid, address, word) != 0) {
+            throw errnoError("Failed to write to the process's memory");
+        }
+        address += count;
+        bytes += count;
+        size -= count;
+    }
+}
+
+std::string
+Injector::readString(pid_t tid, uintptr_t address)
+{
+    std::string ret;
+    while (ret.size() < 4096) {
+        errno = 0;
+        const unsigned long word = ::ptrace(PTRACE_PEEKDATA, tid, address, nullptr);
+        if (errno) {
+            break;
+        }
+        const char* bytes = reinterpret_cast<const char*>(&word);
+        for (size_t i = 0; i < sizeof(word); ++i) {
+            if (!bytes[i]) {
+                return ret;
+            }
+            ret += bytes[i];
+        }
+        address += sizeof(word);
+    }
+    return ret;
+}
+
+void
+Injector::detach()
+{
+    if (d_threads.empty()) {
+        return;
+    }
+
+    stopAll();
+    if (!d_breakpoints.empty()) {
+        removeBreakpoints(d_threads.begin()->first);
+    }
+    if (d_hijacked_tid && d_threads.count(d_hijacked_tid)) {
+        setRegisters(d_hijacked_tid, d_hijacked_registers);
+    }
+    d_hijacked_tid = 0;
+
+    for (const auto& [tid, thread] : d_threads) {
+        ::ptrace(PTRACE_DETACH, tid, nullptr, thread.pending_signal);
+    }
+    d_threads.clear();
+}
+
+uintptr_t
+alignDown(uintptr_t address, uintptr_t alignment)
+{
+    return address & ~(alignment - 1);
+}
+
+}  // namespace
+
+bool
+isSupported()
+{
+    return true;
+}
+
+void
+injectClient(pid_t pid, const std::string& library_path, int port, unsigned int timeout_ms)
+{
+    const auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    // Find everything we need before stopping the process.
+    const SymbolLocator locator(pid);
+    std::vector<uintptr_t> breakpoints;
+    for (const char* symbol : BREAKPOINT_SYMBOLS) {
+        breakpoints.push_back(locator.remoteAddress(symbol));
+    }
+    const uintptr_t dlopen_address = locator.remoteAddress("dlopen");
+    const uintptr_t dlerror_address = locator.remoteAddress("dlerror");
+    const uintptr_t dlsym_address = locator.remoteAddress("dlsym");
+
+    Injector injector(pid);
+    injector.attach();
+    const pid_t tid = injector.waitForBreakpoint(breakpoints, deadline);
+    Registers regs = injector.hijack(tid);
+
+    // The strings we pass go on the thread's stack, below anything it uses.
+    uintptr_t sp = alignDown(stackPointer(regs) - RED_ZONE_SIZE, 16);
+    auto push_string = [&](const std::string& str) {
+        sp = alignDown(sp - str.size() - 1, 16);
+        injector.writeMemory(tid, sp, str.c_str(), str.size() + 1);
+        return sp;
+    };
+    const uintptr_t library_path_address = push_string(library_path);
+    const uintptr_t spawn_client_name_address = push_string("memray_spawn_client");
+
+    const uintptr_t handle = injector.call(tid, sp, dlopen_address, library_path_address, RTLD_NOW);
+    if (!handle) {
+        const uintptr_t error = injector.call(tid, sp, dlerror_address, 0, 0);
+        throw std::runtime_error(
+                "Failed to load " + library_path + " into the process: "
+                + (error ? injector.readString(tid, error) : "unknown error"));
+    }
+
+    const uintptr_t spawn_client =
+            injector.call(tid, sp, dlsym_address, handle, spawn_client_name_address);
+    if (!spawn_client) {
+        throw std::runtime_error("Failed to find memray_spawn_client in " + library_path);
+    }
+    const auto ret = static_cast<int>(injector.call(tid, sp, spawn_client, port, 0));
+    injector.detach();
+    if (ret != 0) {
+        throw std::runtime_error("Failed to start a thread to communicate with the process.");
+    }
+}
+
+#else
+
+bool
+isSupported()
+{
+    return false;
+}
+
+void
+injectClient(pid_t, const std::string&, int, unsigned int)
+{
+    throw std::runtime_error("Attaching without a debugger is only supported on Linux.");
+}
+
+#endif
+
+}  // namespace memray::ptrace_attach
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace memray::ptrace_attach {
+
+// Whether injectClient is implemented for this platform.
+bool
+isSupported();
+
+// Load the library at `library_path` into the process `pid` and call its
+// `memray_spawn_client(port)`, using ptrace directly instead of a debugger.
+//
+// Like our gdb and lldb scripts, this waits for one of the process's threads
+// to enter an allocator (where it can't be holding any allocator or loader
+// locks) and makes the calls from that thread. Only that thread is held for
+// the duration of the calls; the others are stopped just long enough to plant
+// and remove the breakpoints. If no thread enters an allocator within
+// `timeout_ms` milliseconds the process is left untouched.
+//
+// Throws std::runtime_error describing the failure if this doesn't succeed.
+void
+injectClient(pid_t pid, const std::string& library_path, int port, unsigned int timeout_ms);
+
+}  // namespace memray::ptrace_attach
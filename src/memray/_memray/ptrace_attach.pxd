@@ -0,0 +1,7 @@
+from libcpp cimport bool
+from libcpp.string cimport string
+
+
+cdef extern from "ptrace_attach.h" namespace "memray::ptrace_attach":
+    bool isSupported()
+    void injectClient(int pid, const string& library_path, int port, unsigned int timeout_ms) nogil except+
@@ -1,18 +1,31 @@
+#include <utility>
+
 #include "python_helpers.h"
 
 namespace memray::python_helpers {
+PyUnicode_Cache::PyUnicode_Cache(std::shared_ptr<const api::StringInterner> strings)
+: d_strings(std::move(strings))
+{
+}
+
+PyUnicode_Cache::~PyUnicode_Cache()
+{
+    for (PyObject* pystring : d_cache) {
+        Py_XDECREF(pystring);
+    }
+}
+
 PyObject*
-PyUnicode_Cache::getUnicodeObject(const std::string& str)
+PyUnicode_Cache::getUnicodeObject(api::StringInterner::id_t id)
 {
-    auto it = d_cache.find(str);
-    if (it == d_cache.end()) {
-        PyObject* pystring = PyUnicode_FromString(str.c_str());
-        if (pystring == nullptr) {
-            return nullptr;
-        }
-        auto pystring_capsule = py_capsule_t(pystring, [](auto obj) { Py_DECREF(obj); });
-        it = d_cache.emplace(str, std::move(pystring_capsule)).first;
+    if (id >= d_cache.size()) {
+        d_cache.resize(d_strings->size(), nullptr);
+    }
+    PyObject*& pystring = d_cache[id];
+    if (pystring == nullptr) {
+        const std::string_view str = d_strings->get(id);
+        pystring = PyUnicode_FromStringAndSize(str.data(), static_cast<Py_ssize_t>(str.size()));
     }
-    return it->second.get();
+    return pystring;
 }
 }  // namespace memray::python_helpers
@@ -3,19 +3,29 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
-#include <functional>
 #include <memory>
-#include <string>
-#include <unordered_map>
+#include <vector>
+
+#include "string_interner.h"
 
 namespace memray::python_helpers {
+// The unicode objects of the strings of an interner, created the first time
+// they're asked for and kept by string id.
 class PyUnicode_Cache
 {
   public:
-    PyObject* getUnicodeObject(const std::string& str);
+    explicit PyUnicode_Cache(std::shared_ptr<const api::StringInterner> strings);
+    ~PyUnicode_Cache();
+    PyUnicode_Cache(PyUnicode_Cache& other) = delete;
+    PyUnicode_Cache(PyUnicode_Cache&& other) = delete;
+    void operator=(const PyUnicode_Cache&) = delete;
+    void operator=(PyUnicode_Cache&&) = delete;
+
+    // Returns a borrowed reference.
+    PyObject* getUnicodeObject(api::StringInterner::id_t id);
 
   private:
-    using py_capsule_t = std::unique_ptr<PyObject, std::function<void(PyObject*)>>;
-    std::unordered_map<std::string, py_capsule_t> d_cache{};
+    std::shared_ptr<const api::StringInterner> d_strings;
+    std::vector<PyObject*> d_cache{};
 };
 }  // namespace memray::python_helpers
@@ -6,10 +6,13 @@
 #include <cinttypes>
 #include <cstdio>
 #include <stdexcept>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "hooks.h"
 #include "logging.h"
+#include "pprof.h"
 #include "record_reader.h"
 #include "records.h"
 #include "source.h"
@@ -21,6 +24,12 @@ using namespace io;
 
 namespace {  // unnamed
 
+ssize_t
+decodeZigzag(size_t zigzag_val)
+{
+    return static_cast<ssize_t>((zigzag_val >> 1) ^ (~(zigzag_val & 1) + 1));
+}
+
 const char*
 allocatorName(hooks::Allocator allocator)
 {
@@ -55,6 +64,14 @@ allocatorName(hooks::Allocator allocator)
             return "pymalloc_realloc";
         case hooks::Allocator::PYMALLOC_FREE:
             return "pymalloc_free";
+        case hooks::Allocator::CUSTOM_MALLOC:
+            return "custom_malloc";
+        case hooks::Allocator::CUSTOM_FREE:
+            return "custom_free";
+        case hooks::Allocator::PYMALLOC_ARENA_ALLOC:
+            return "pymalloc_arena_alloc";
+        case hooks::Allocator::PYMALLOC_ARENA_FREE:
+            return "pymalloc_arena_free";
     }
 
     return nullptr;
@@ -65,42 +82,167 @@ allocatorName(hooks::Allocator allocator)
 void
 RecordReader::readHeader(HeaderRecord& header)
 {
-    if (!d_input->read(header.magic, sizeof(MAGIC)) || (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0))
+    if (!readBytes(header.magic, sizeof(MAGIC)) || (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0))
     {
         throw std::ios_base::failure(
                 "The provided input file does not look like a binary generated by memray.");
     }
-    d_input->read(reinterpret_cast<char*>(&header.version), sizeof(header.version));
+    readBytes(reinterpret_cast<char*>(&header.version), sizeof(header.version));
     if (header.version != CURRENT_HEADER_VERSION) {
         throw std::ios_base::failure(
                 "The provided input file is incompatible with this version of memray.");
     }
     header.command_line.reserve(4096);
-    if (!d_input->read(reinterpret_cast<char*>(&header.native_traces), sizeof(header.native_traces))
-        || !d_input->read(reinterpret_cast<char*>(&header.stats), sizeof(header.stats))
-        || !d_input->getline(header.command_line, '\0')
-        || !d_input->read(reinterpret_cast<char*>(&header.pid), sizeof(header.pid))
-        || !d_input->read(reinterpret_cast<char*>(&header.main_tid), sizeof(header.main_tid))
-        || !d_input->read(
+    if (!readBytes(reinterpret_cast<char*>(&header.native_traces), sizeof(header.native_traces))
+        || !readBytes(reinterpret_cast<char*>(&header.stats), sizeof(header.stats))
+        || !readString(&header.command_line)
+        || !readBytes(reinterpret_cast<char*>(&header.pid), sizeof(header.pid))
+        || !readBytes(reinterpret_cast<char*>(&header.main_tid), sizeof(header.main_tid))
+        || !readBytes(
                 reinterpret_cast<char*>(&header.skipped_frames_on_main_tid),
                 sizeof(header.skipped_frames_on_main_tid))
-        || !d_input->read(
+        || !readBytes(
                 reinterpret_cast<char*>(&header.python_allocator),
-                sizeof(header.python_allocator)))
+                sizeof(header.python_allocator))
+        || !readBytes(
+                reinterpret_cast<char*>(&header.sampling_interval),
+                sizeof(header.sampling_interval))
+        || !readBytes(reinterpret_cast<char*>(&header.file_format), sizeof(header.file_format))
+        || !readBytes(
+                reinterpret_cast<char*>(&header.min_allocation_size),
+                sizeof(header.min_allocation_size))
+        || !readBytes(reinterpret_cast<char*>(&header.summary_offset), sizeof(header.summary_offset))
+        || !readString(&header.parent_file)
+        || !readBytes(reinterpret_cast<char*>(&header.parent_offset), sizeof(header.parent_offset)))
     {
         throw std::ios_base::failure("Failed to read input file header.");
     }
 }
 
+void
+RecordReader::loadParentCapture()
+{
+    // The records of a forked child's capture refer to the frames, stack
+    // trees and memory maps that its parent's capture had when it forked, so
+    // read them from it first, along with those of its own parent if any.
+    const std::string& parent_file = d_header.parent_file;
+    const uint64_t parent_offset = d_header.parent_offset;
+    std::unique_ptr<Source> parent;
+    try {
+        parent = d_input->openSibling(parent_file);
+    } catch (const std::exception& e) {
+        throw std::ios_base::failure(
+                "Failed to read the capture of the parent process, " + parent_file
+                + ", that this one continues from: " + e.what());
+    }
+    if (!parent || !parent->endAt(parent_offset)) {
+        throw std::ios_base::failure(
+                "Failed to read the capture of the parent process, " + parent_file
+                + ", that this one continues from.");
+    }
+
+    HeaderRecord header = d_header;
+    std::swap(d_input, parent);
+    d_mapped_input = d_input->mappedData();
+    readHeader(d_header);
+    if (!d_header.parent_file.empty()) {
+        loadParentCapture();
+    }
+    d_sampling_interval = d_header.sampling_interval;
+
+    RecordResult result;
+    while ((result = nextUnfilteredRecord()) != RecordResult::END_OF_FILE) {
+        if (result == RecordResult::ERROR) {
+            break;
+        }
+    }
+    // The parent's capture must have everything up to where the child's
+    // continues from, which isn't the case if the parent is still running.
+    const bool complete = result == RecordResult::END_OF_FILE && d_input->skipTo(parent_offset);
+    std::swap(d_input, parent);
+    d_mapped_input = d_input->mappedData();
+    d_header = header;
+    if (!complete) {
+        throw std::ios_base::failure(
+                "The capture of the parent process, " + header.parent_file
+                + ", ends before the point that this one continues from.");
+    }
+
+    // Only the state carries over: the records of the child's capture are
+    // encoded as if nothing came before them.
+    d_last = DeltaEncodedFields{};
+    d_thread_deltas = ThreadDeltaStates{};
+    d_stack_traces.clear();
+    d_thread_names.clear();
+    d_latest_allocation = Allocation{};
+    d_previous_allocation = Allocation{};
+    d_repeated_deallocation = Allocation{};
+    d_latest_aggregated_allocation = AggregatedAllocation{};
+    d_latest_profile_interval = ProfileInterval{};
+    d_latest_memory_record = MemoryRecord{};
+    d_filtered_allocation_totals = FilteredAllocationTotals{};
+    d_sequence_watermark = 0;
+    d_next_buffered_record_order = 0;
+    d_input_exhausted = false;
+    d_block_records.clear();
+    d_next_block_record = 0;
+}
+
+bool
+RecordReader::readBytes(char* result, size_t length)
+{
+    if (d_mapped_input) {
+        if (d_mapped_input->size() < length) {
+            return false;
+        }
+        ::memcpy(result, d_mapped_input->data(), length);
+        d_mapped_input->remove_prefix(length);
+        return true;
+    }
+    return d_input->read(result, length);
+}
+
+bool
+RecordReader::readString(std::string* result)
+{
+    if (d_mapped_input) {
+        size_t length = d_mapped_input->find('\0');
+        if (length == std::string_view::npos) {
+            return false;
+        }
+        result->assign(d_mapped_input->data(), length);
+        d_mapped_input->remove_prefix(length + 1);
+        return true;
+    }
+    return d_input->getline(*result, '\0');
+}
+
 bool
 RecordReader::readVarint(size_t* val)
 {
+    if (d_mapped_input) {
+        // A varint is at most 10 bytes long, so a single bounds check covers
+        // the whole decoding loop.
+        const auto* data = reinterpret_cast<const unsigned char*>(d_mapped_input->data());
+        const size_t available = std::min<size_t>(d_mapped_input->size(), 10);
+        size_t result = 0;
+        for (size_t i = 0; i < available; ++i) {
+            result |= static_cast<size_t>(data[i] & 0x7f) << (7 * i);
+            if (0 == (data[i] & 0x80)) {
+                *val = result;
+                d_mapped_input->remove_prefix(i + 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
     *val = 0;
     int shift = 0;
 
     while (true) {
         unsigned char next;
-        if (!d_input->read(reinterpret_cast<char*>(&next), sizeof(next))) {
+        if (!readBytes(reinterpret_cast<char*>(&next), sizeof(next))) {
             return false;
         }
 
@@ -116,6 +258,54 @@ RecordReader::readVarint(size_t* val)
     }
 }
 
+bool
+RecordReader::readVarints(size_t* values, size_t n_values)
+{
+    size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // When the input is held in memory, look at the next 8 bytes at a time.
+    // If none has its continuation bit set, they are 8 varints of a single
+    // byte each. Otherwise the first stop byte gives the length of the next
+    // varint, whose 7-bit groups are then packed together with a few masks
+    // and shifts instead of a loop over its bytes.
+    if (d_mapped_input) {
+        const auto* begin = reinterpret_cast<const unsigned char*>(d_mapped_input->data());
+        const unsigned char* end = begin + d_mapped_input->size();
+        const unsigned char* data = begin;
+        while (i < n_values && end - data >= 8) {
+            uint64_t word;
+            ::memcpy(&word, data, sizeof(word));
+            const uint64_t stops = ~word & 0x8080808080808080ULL;
+            if (stops == 0x8080808080808080ULL && n_values - i >= 8) {
+                for (size_t j = 0; j < 8; ++j) {
+                    values[i + j] = data[j];
+                }
+                i += 8;
+                data += 8;
+                continue;
+            }
+            if (stops == 0) {
+                // Longer than a single word.
+                break;
+            }
+            uint64_t bits = word & (stops ^ (stops - 1)) & 0x7f7f7f7f7f7f7f7fULL;
+            bits = (bits & 0x007f007f007f007fULL) | ((bits & 0x7f007f007f007f00ULL) >> 1);
+            bits = (bits & 0x00003fff00003fffULL) | ((bits & 0x3fff00003fff0000ULL) >> 2);
+            bits = (bits & 0x000000000fffffffULL) | ((bits & 0x0fffffff00000000ULL) >> 4);
+            values[i++] = bits;
+            data += (__builtin_ctzll(stops) >> 3) + 1;
+        }
+        d_mapped_input->remove_prefix(data - begin);
+    }
+#endif
+    for (; i < n_values; ++i) {
+        if (!readVarint(&values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool
 RecordReader::readSignedVarint(ssize_t* val)
 {
@@ -124,15 +314,24 @@ RecordReader::readSignedVarint(ssize_t* val)
         return false;
     }
 
-    *val = static_cast<ssize_t>((zigzag_val >> 1) ^ (~(zigzag_val & 1) + 1));
+    *val = decodeZigzag(zigzag_val);
     return true;
 }
 
-RecordReader::RecordReader(std::unique_ptr<Source> source, bool track_stacks)
+RecordReader::RecordReader(
+        std::unique_ptr<Source> source,
+        bool track_stacks,
+        bool expand_repeated_allocations)
 : d_input(std::move(source))
+, d_mapped_input(d_input->mappedData())
 , d_track_stacks(track_stacks)
+, d_expand_repeated_allocations(expand_repeated_allocations)
 {
     readHeader(d_header);
+    if (!d_header.parent_file.empty()) {
+        loadParentCapture();
+    }
+    d_sampling_interval = d_header.sampling_interval;
 
     // Reserve some space for the different containers
     d_thread_names.reserve(16);
@@ -144,6 +343,18 @@ RecordReader::RecordReader(std::unique_ptr<Source> source, bool track_stacks)
     }
 }
 
+RecordReader::~RecordReader()
+{
+    // Nothing is cached unless stacks were handed out to Python, in which
+    // case the reader is owned by Python objects and dies with the GIL held.
+    for (const PythonFrame& frame : d_python_frames) {
+        Py_XDECREF(frame.frame);
+    }
+    for (const auto& [key, native_frames] : d_native_frames_objects) {
+        Py_DECREF(native_frames.frames);
+    }
+}
+
 void
 RecordReader::close() noexcept
 {
@@ -165,10 +376,10 @@ RecordReader::parseFramePush(FramePush* record)
 bool
 RecordReader::processFramePush(const FramePush& record)
 {
-    if (!d_track_stacks) {
+    thread_id_t tid = d_last.thread_id;
+    if (!d_track_stacks || !followsStacksOf(tid)) {
         return true;
     }
-    thread_id_t tid = d_last.thread_id;
     auto [it, inserted] = d_stack_traces.emplace(tid, stack_t{});
     auto& stack = it->second;
     if (inserted) {
@@ -190,10 +401,10 @@ RecordReader::parseFramePop(FramePop* record, unsigned int flags)
 bool
 RecordReader::processFramePop(const FramePop& record)
 {
-    if (!d_track_stacks) {
+    thread_id_t tid = d_last.thread_id;
+    if (!d_track_stacks || !followsStacksOf(tid)) {
         return true;
     }
-    thread_id_t tid = d_last.thread_id;
 
     assert(!d_stack_traces[tid].empty());
     auto count = record.count;
@@ -208,10 +419,20 @@ bool
 RecordReader::parseFrameIndex(tracking_api::pyframe_map_val_t* pyframe_val, unsigned int flags)
 {
     pyframe_val->second.is_entry_frame = !(flags & 1);
-    return readIntegralDelta(&d_last.python_frame_id, &pyframe_val->first)
-           && d_input->getline(pyframe_val->second.function_name, '\0')
-           && d_input->getline(pyframe_val->second.filename, '\0')
-           && readIntegralDelta(&d_last.python_line_number, &pyframe_val->second.lineno);
+    std::string function_name;
+    std::string filename;
+    if (!readIntegralDelta(&d_last.python_frame_id, &pyframe_val->first)
+        || !readString(&function_name) || !readString(&filename)
+        || !readIntegralDelta(&d_last.python_line_number, &pyframe_val->second.lineno))
+    {
+        return false;
+    }
+    // The interner is shared with the symbol resolver and the unicode cache,
+    // which are used from other threads while a live capture is read.
+    std::lock_guard<std::mutex> lock(d_mutex);
+    pyframe_val->second.function_name = d_strings->intern(function_name);
+    pyframe_val->second.filename = d_strings->intern(filename);
+    return true;
 }
 
 bool
@@ -246,10 +467,22 @@ RecordReader::processNativeFrameIndex(const UnresolvedNativeFrame& frame)
     return true;
 }
 
+bool
+RecordReader::parseAllocator(hooks::Allocator* allocator, unsigned int flags)
+{
+    if (flags) {
+        *allocator = static_cast<hooks::Allocator>(flags);
+        return true;
+    }
+    return readBytes(reinterpret_cast<char*>(allocator), sizeof(*allocator));
+}
+
 bool
 RecordReader::parseAllocationRecord(AllocationRecord* record, unsigned int flags)
 {
-    record->allocator = static_cast<hooks::Allocator>(flags);
+    if (!parseAllocator(&record->allocator, flags)) {
+        return false;
+    }
 
     if (!readIntegralDelta(&d_last.data_pointer, &record->address)) {
         return false;
@@ -267,6 +500,7 @@ RecordReader::parseAllocationRecord(AllocationRecord* record, unsigned int flags
 bool
 RecordReader::processAllocationRecord(const AllocationRecord& record)
 {
+    d_previous_allocation = d_latest_allocation;
     d_latest_allocation.tid = d_last.thread_id;
     d_latest_allocation.address = record.address;
     d_latest_allocation.size = record.size;
@@ -280,13 +514,17 @@ RecordReader::processAllocationRecord(const AllocationRecord& record)
     }
     d_latest_allocation.native_segment_generation = 0;
     d_latest_allocation.n_allocations = 1;
+    d_latest_allocation.n_repeats = 0;
+    scaleSampledAllocation(&d_latest_allocation, d_sampling_interval);
     return true;
 }
 
 bool
 RecordReader::parseNativeAllocationRecord(NativeAllocationRecord* record, unsigned int flags)
 {
-    record->allocator = static_cast<hooks::Allocator>(flags);
+    if (!parseAllocator(&record->allocator, flags)) {
+        return false;
+    }
 
     return readIntegralDelta(&d_last.data_pointer, &record->address) && readVarint(&record->size)
            && readIntegralDelta(&d_last.native_frame_id, &record->native_frame_id);
@@ -295,6 +533,7 @@ RecordReader::parseNativeAllocationRecord(NativeAllocationRecord* record, unsign
 bool
 RecordReader::processNativeAllocationRecord(const NativeAllocationRecord& record)
 {
+    d_previous_allocation = d_latest_allocation;
     d_latest_allocation.tid = d_last.thread_id;
     d_latest_allocation.address = record.address;
     d_latest_allocation.size = record.size;
@@ -310,29 +549,75 @@ RecordReader::processNativeAllocationRecord(const NativeAllocationRecord& record
         d_latest_allocation.native_segment_generation = 0;
     }
     d_latest_allocation.n_allocations = 1;
+    d_latest_allocation.n_repeats = 0;
+    scaleSampledAllocation(&d_latest_allocation, d_sampling_interval);
+    return true;
+}
+
+bool
+RecordReader::parsePythonStackAllocationRecord(PythonStackAllocationRecord* record, unsigned int flags)
+{
+    if (!parseAllocator(&record->allocator, flags)) {
+        return false;
+    }
+
+    return readIntegralDelta(&d_last.data_pointer, &record->address) && readVarint(&record->size)
+           && readIntegralDelta(&d_last.python_stack_index, &record->python_stack_index)
+           && readIntegralDelta(&d_last.native_frame_id, &record->native_frame_id);
+}
+
+bool
+RecordReader::processPythonStackAllocationRecord(const PythonStackAllocationRecord& record)
+{
+    d_previous_allocation = d_latest_allocation;
+    d_latest_allocation.tid = d_last.thread_id;
+    d_latest_allocation.address = record.address;
+    d_latest_allocation.size = record.size;
+    d_latest_allocation.allocator = record.allocator;
+    if (d_track_stacks) {
+        if (record.python_stack_index >= d_tree.size()) {
+            return false;
+        }
+        d_latest_allocation.native_frame_id = record.native_frame_id;
+        d_latest_allocation.frame_index = record.python_stack_index;
+        d_latest_allocation.native_segment_generation =
+                record.native_frame_id ? d_symbol_resolver.currentSegmentGeneration() : 0;
+    } else {
+        d_latest_allocation.native_frame_id = 0;
+        d_latest_allocation.frame_index = 0;
+        d_latest_allocation.native_segment_generation = 0;
+    }
+    d_latest_allocation.n_allocations = 1;
+    d_latest_allocation.n_repeats = 0;
+    scaleSampledAllocation(&d_latest_allocation, d_sampling_interval);
     return true;
 }
 
 bool
-RecordReader::parseMemoryMapStart()
+RecordReader::parseMemoryMapStart(MemoryMapStart* record, unsigned int flags)
 {
-    // Currently nothing to do (this record type has no body)
+    // This record type has no body, only flags.
+    record->incremental = flags & MEMORY_MAP_INCREMENTAL;
     return true;
 }
 
 bool
-RecordReader::processMemoryMapStart()
+RecordReader::processMemoryMapStart(const MemoryMapStart& record)
 {
     std::lock_guard<std::mutex> lock(d_mutex);
-    d_symbol_resolver.clearSegments();
+    if (record.incremental) {
+        d_symbol_resolver.copySegments();
+    } else {
+        d_symbol_resolver.clearSegments();
+    }
     return true;
 }
 
 bool
 RecordReader::parseSegmentHeader(std::string* filename, size_t* num_segments, uintptr_t* addr)
 {
-    return d_input->getline(*filename, '\0') && readVarint(num_segments)
-           && d_input->read(reinterpret_cast<char*>(addr), sizeof(*addr));
+    return readString(filename) && readVarint(num_segments)
+           && readBytes(reinterpret_cast<char*>(addr), sizeof(*addr));
 }
 
 bool
@@ -342,7 +627,7 @@ RecordReader::processSegmentHeader(const std::string& filename, size_t num_segme
     segments.reserve(num_segments);
     for (size_t i = 0; i < num_segments; i++) {
         RecordType record_type;
-        if (!d_input->read(reinterpret_cast<char*>(&record_type), sizeof(record_type))
+        if (!readBytes(reinterpret_cast<char*>(&record_type), sizeof(record_type))
             || (record_type != RecordType::SEGMENT))
         {
             return false;
@@ -364,10 +649,26 @@ RecordReader::processSegmentHeader(const std::string& filename, size_t num_segme
     return true;
 }
 
+bool
+RecordReader::parseUnloadedModule(std::string* filename, uintptr_t* addr)
+{
+    return readString(filename) && readBytes(reinterpret_cast<char*>(addr), sizeof(*addr));
+}
+
+bool
+RecordReader::processUnloadedModule(const std::string& filename, uintptr_t addr)
+{
+    if (d_track_stacks) {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_symbol_resolver.removeSegments(filename, addr);
+    }
+    return true;
+}
+
 bool
 RecordReader::parseSegment(Segment* segment)
 {
-    if (!d_input->read(reinterpret_cast<char*>(&segment->vaddr), sizeof(segment->vaddr))
+    if (!readBytes(reinterpret_cast<char*>(&segment->vaddr), sizeof(segment->vaddr))
         || !readVarint(&segment->memsz))
     {
         return false;
@@ -378,7 +679,7 @@ RecordReader::parseSegment(Segment* segment)
 bool
 RecordReader::parseThreadRecord(std::string* name)
 {
-    return d_input->getline(*name, '\0');
+    return readString(name);
 }
 
 bool
@@ -389,12 +690,24 @@ RecordReader::processThreadRecord(const std::string& name)
 }
 
 bool
-RecordReader::parseMemoryRecord(MemoryRecord* record)
+RecordReader::parseMemoryRecord(MemoryRecord* record, unsigned int flags)
 {
     if (!readVarint(&record->rss) || !readVarint(&record->ms_since_epoch)) {
         return false;
     }
     record->ms_since_epoch += d_header.stats.start_time;
+
+    record->has_counters = flags == MEMORY_RECORD_WITH_COUNTERS;
+    if (record->has_counters) {
+        MemoryCounters& counters = record->counters;
+        MemoryCounters& last = d_last.memory_counters;
+        return readIntegralDelta(&last.pss, &counters.pss)
+               && readIntegralDelta(&last.uss, &counters.uss)
+               && readIntegralDelta(&last.swap, &counters.swap)
+               && readIntegralDelta(&last.cgroup_usage, &counters.cgroup_usage)
+               && readIntegralDelta(&last.minor_faults, &counters.minor_faults)
+               && readIntegralDelta(&last.major_faults, &counters.major_faults);
+    }
     return true;
 }
 
@@ -406,193 +719,1268 @@ RecordReader::processMemoryRecord(const MemoryRecord& record)
 }
 
 bool
-RecordReader::parseContextSwitch(thread_id_t* tid)
+RecordReader::parseRepeatedAllocations(size_t* n_repeats)
 {
-    return d_input->read(reinterpret_cast<char*>(tid), sizeof(*tid));
+    return readVarint(n_repeats);
 }
 
 bool
-RecordReader::processContextSwitch(thread_id_t tid)
+RecordReader::processRepeatedAllocations(size_t n_repeats)
 {
-    d_last.thread_id = tid;
+    // What repeats is the allocation before the latest record and the
+    // deallocation of it that the latest record is.
+    const Allocation& allocation = d_previous_allocation;
+    const Allocation& deallocation = d_latest_allocation;
+    if (n_repeats == 0
+        || hooks::allocatorKind(allocation.allocator) != hooks::AllocatorKind::SIMPLE_ALLOCATOR
+        || hooks::allocatorKind(deallocation.allocator) != hooks::AllocatorKind::SIMPLE_DEALLOCATOR
+        || allocation.address != deallocation.address || allocation.tid != deallocation.tid)
+    {
+        return false;
+    }
+    if (d_expand_repeated_allocations) {
+        d_repeated_deallocation = deallocation;
+        d_repeated_records_left = 2 * n_repeats;
+    } else {
+        d_latest_allocation = allocation;
+        d_latest_allocation.n_repeats = n_repeats;
+    }
     return true;
 }
 
-RecordReader::RecordResult
-RecordReader::nextRecord()
+bool
+RecordReader::parseChunkStart(ChunkStart* entry)
 {
-    while (true) {
-        RecordTypeAndFlags record_type_and_flags;
-        if (!d_input->read(
-                    reinterpret_cast<char*>(&record_type_and_flags),
-                    sizeof(record_type_and_flags))) {
-            return RecordResult::END_OF_FILE;
-        }
-
-        switch (record_type_and_flags.record_type) {
-            case RecordType::OTHER: {
-                switch (static_cast<OtherRecordType>(record_type_and_flags.flags)) {
-                    case OtherRecordType::TRAILER: {
-                        return RecordResult::END_OF_FILE;
-                    } break;
-                    default: {
-                        if (d_input->is_open()) LOG(ERROR) << "Invalid record subtype";
-                        return RecordResult::ERROR;
-                    } break;
-                }
-            } break;
-            case RecordType::ALLOCATION: {
-                AllocationRecord record;
-                if (!parseAllocationRecord(&record, record_type_and_flags.flags)
-                    || !processAllocationRecord(record)) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process allocation record";
-                    return RecordResult::ERROR;
-                }
-                return RecordResult::ALLOCATION_RECORD;
-            } break;
-            case RecordType::ALLOCATION_WITH_NATIVE: {
-                NativeAllocationRecord record;
-                if (!parseNativeAllocationRecord(&record, record_type_and_flags.flags)
-                    || !processNativeAllocationRecord(record))
-                {
-                    if (d_input->is_open()) {
-                        LOG(ERROR) << "Failed to process allocation record with native info";
-                    }
-                    return RecordResult::ERROR;
-                }
-                return RecordResult::ALLOCATION_RECORD;
-            } break;
-            case RecordType::MEMORY_RECORD: {
-                MemoryRecord record;
-                if (!parseMemoryRecord(&record) || !processMemoryRecord(record)) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process memory record";
-                    return RecordResult::ERROR;
-                }
-                return RecordResult::MEMORY_RECORD;
-            } break;
-            case RecordType::CONTEXT_SWITCH: {
-                thread_id_t tid;
-                if (!parseContextSwitch(&tid) || !processContextSwitch(tid)) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process context switch record";
-                    return RecordResult::ERROR;
-                }
-            } break;
-            case RecordType::FRAME_PUSH: {
-                FramePush record;
-                if (!parseFramePush(&record) || !processFramePush(record)) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process frame push";
-                    return RecordResult::ERROR;
-                }
-            } break;
-            case RecordType::FRAME_POP: {
-                FramePop record;
-                if (!parseFramePop(&record, record_type_and_flags.flags) || !processFramePop(record)) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process frame pop";
-                    return RecordResult::ERROR;
-                }
-            } break;
-            case RecordType::FRAME_INDEX: {
-                tracking_api::pyframe_map_val_t record;
-                if (!parseFrameIndex(&record, record_type_and_flags.flags) || !processFrameIndex(record))
-                {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process frame index";
-                    return RecordResult::ERROR;
-                }
-            } break;
-            case RecordType::NATIVE_TRACE_INDEX: {
-                UnresolvedNativeFrame record;
-                if (!parseNativeFrameIndex(&record) || !processNativeFrameIndex(record)) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process native frame index";
-                    return RecordResult::ERROR;
-                }
-            } break;
-            case RecordType::MEMORY_MAP_START: {
-                if (!parseMemoryMapStart() || !processMemoryMapStart()) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process memory map start";
-                    return RecordResult::ERROR;
-                }
-            } break;
-            case RecordType::SEGMENT_HEADER: {
-                std::string filename;
-                size_t num_segments;
-                uintptr_t addr;
-                if (!parseSegmentHeader(&filename, &num_segments, &addr)
-                    || !processSegmentHeader(filename, num_segments, addr))
-                {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process segment header";
-                    return RecordResult::ERROR;
-                }
-            } break;
-            case RecordType::THREAD_RECORD: {
-                std::string name;
-                if (!parseThreadRecord(&name) || !processThreadRecord(name)) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to process thread record";
-                    return RecordResult::ERROR;
-                }
-            } break;
-            default:
-                if (d_input->is_open()) LOG(ERROR) << "Invalid record type";
-                return RecordResult::ERROR;
-        }
+    size_t ms_since_start;
+    if (!readVarint(&entry->n_allocations) || !readVarint(&ms_since_start)) {
+        return false;
     }
+    entry->ms_since_epoch = d_header.stats.start_time + ms_since_start;
+    return true;
 }
 
-// Python public APIs
-
-PyObject*
-RecordReader::Py_GetStackFrame(unsigned int index, size_t max_stacks)
+bool
+RecordReader::processChunkStart(const ChunkStart&)
 {
-    return Py_GetStackFrameAndEntryInfo(index, nullptr, max_stacks);
+    // The writer resets its delta encoding state at every chunk boundary.
+    d_last = DeltaEncodedFields{};
+    d_thread_deltas.reset();
+    return true;
 }
 
-PyObject*
-RecordReader::Py_GetStackFrameAndEntryInfo(
-        unsigned int index,
-        std::vector<unsigned char>* is_entry_frame,
-        size_t max_stacks)
+bool
+RecordReader::parsePythonStackTree(std::vector<std::pair<frame_id_t, FrameTree::index_t>>* nodes)
+{
+    size_t n_nodes;
+    if (!readVarint(&n_nodes)) {
+        return false;
+    }
+    nodes->resize(n_nodes);
+    for (auto& [frame_id, parent_index] : *nodes) {
+        if (!readVarint(&frame_id) || !readVarint(&parent_index)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+RecordReader::processPythonStackTree(
+        const std::vector<std::pair<frame_id_t, FrameTree::index_t>>& nodes)
+{
+    if (!d_track_stacks) {
+        return true;
+    }
+    // The nodes are listed in the order the tracker created them, so adding
+    // them in that order gives them the same indices in our tree. A tracker
+    // that interns Python stacks sends its nodes a few at a time.
+    FrameTree::index_t expected_index = d_tree.size();
+    for (const auto& [frame_id, parent_index] : nodes) {
+        if (parent_index >= expected_index
+            || d_tree.getTraceIndex(parent_index, frame_id) != expected_index)
+        {
+            return false;
+        }
+        ++expected_index;
+    }
+    return true;
+}
+
+bool
+RecordReader::parseAggregatedAllocationRecord(AggregatedAllocation* record, unsigned int flags)
+{
+    if (!parseAllocator(&record->allocator, flags)) {
+        return false;
+    }
+    return readBytes(reinterpret_cast<char*>(&record->tid), sizeof(record->tid))
+           && readVarint(&record->frame_index) && readVarint(&record->native_frame_id)
+           && readVarint(&record->n_allocations_in_high_water_mark)
+           && readVarint(&record->bytes_in_high_water_mark)
+           && readVarint(&record->n_allocations_leaked) && readVarint(&record->bytes_leaked);
+}
+
+bool
+RecordReader::processAggregatedAllocationRecord(const AggregatedAllocation& record)
+{
+    d_latest_aggregated_allocation = record;
+    if (d_track_stacks) {
+        // These records come after every memory map the tracker saw, so the
+        // native frames are resolved with the latest ones.
+        d_latest_aggregated_allocation.native_segment_generation =
+                d_symbol_resolver.currentSegmentGeneration();
+    } else {
+        d_latest_aggregated_allocation.native_frame_id = 0;
+        d_latest_aggregated_allocation.frame_index = 0;
+        d_latest_aggregated_allocation.native_segment_generation = 0;
+    }
+    return true;
+}
+
+bool
+RecordReader::parseProfileInterval(ProfileInterval* interval)
+{
+    size_t ms_since_start;
+    size_t n_entries;
+    if (!readVarint(&ms_since_start) || !readVarint(&n_entries)) {
+        return false;
+    }
+    interval->ms_since_epoch = d_header.stats.start_time + ms_since_start;
+    interval->entries.resize(n_entries);
+    for (auto& entry : interval->entries) {
+        entry.native_segment_generation = 0;
+        if (!readBytes(reinterpret_cast<char*>(&entry.allocator), sizeof(entry.allocator))
+            || !readBytes(reinterpret_cast<char*>(&entry.tid), sizeof(entry.tid))
+            || !readVarint(&entry.frame_index) || !readVarint(&entry.native_frame_id)
+            || !readVarint(&entry.n_allocated) || !readVarint(&entry.bytes_allocated)
+            || !readVarint(&entry.n_freed) || !readVarint(&entry.bytes_freed)
+            || !readVarint(&entry.n_live) || !readVarint(&entry.bytes_live))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+RecordReader::processProfileInterval(ProfileInterval&& interval)
+{
+    // As for the aggregated allocations, the native frames are resolved with
+    // the memory maps seen so far.
+    const size_t generation = d_symbol_resolver.currentSegmentGeneration();
+    for (auto& entry : interval.entries) {
+        if (d_track_stacks) {
+            entry.native_segment_generation = generation;
+        } else {
+            entry.native_frame_id = 0;
+            entry.frame_index = 0;
+        }
+    }
+    d_latest_profile_interval = std::move(interval);
+    return true;
+}
+
+bool
+RecordReader::parseFilteredAllocationTotals(FilteredAllocationTotals* totals)
+{
+    return readVarint(&totals->n_allocations) && readVarint(&totals->bytes);
+}
+
+bool
+RecordReader::processFilteredAllocationTotals(const FilteredAllocationTotals& totals)
+{
+    // Each record holds the totals since tracking started.
+    d_filtered_allocation_totals = totals;
+    return true;
+}
+
+bool
+RecordReader::parseTrackerMetrics(TrackerMetrics* metrics)
+{
+    return readVarint(&metrics->n_tracked_allocations) && readVarint(&metrics->allocation_ns)
+           && readVarint(&metrics->n_tracked_deallocations) && readVarint(&metrics->deallocation_ns)
+           && readVarint(&metrics->n_unwinds) && readVarint(&metrics->unwind_ns)
+           && readVarint(&metrics->n_records_written) && readVarint(&metrics->bytes_written)
+           && readVarint(&metrics->n_lock_waits) && readVarint(&metrics->lock_wait_ns)
+           && readVarint(&metrics->n_flushes) && readVarint(&metrics->flush_ns)
+           && readVarint(&metrics->max_flush_ns);
+}
+
+bool
+RecordReader::processTrackerMetrics(const TrackerMetrics& metrics)
+{
+    // The header only has them if it could be written again once tracking
+    // stopped, but they're always just before the trailer.
+    d_header.stats.metrics = metrics;
+    return true;
+}
+
+bool
+RecordReader::parseSamplingInterval(size_t* sampling_interval, uint64_t* sequence)
+{
+    return readVarint(sampling_interval) && readVarint(sequence);
+}
+
+bool
+RecordReader::processSamplingInterval(size_t sampling_interval, uint64_t sequence)
+{
+    if (!sequence) {
+        d_sampling_interval = sampling_interval;
+        return true;
+    }
+    // It applies to the buffered records that come after it.
+    BufferedRecord record{
+            sequence,
+            d_next_buffered_record_order++,
+            d_last.thread_id,
+            RecordTypeAndFlags{RecordType::OTHER, int(OtherRecordType::SAMPLING_INTERVAL)}};
+    record.sampling_interval = sampling_interval;
+    d_buffered_records.push(std::move(record));
+    return true;
+}
+
+bool
+RecordReader::parseCaptureSummary(CaptureSummary* summary)
+{
+    size_t n_memory_snapshots;
+    if (!readVarint(&summary->n_allocations) || !readVarint(&summary->peak_index)
+        || !readVarint(&summary->peak_memory)
+        || !parseFilteredAllocationTotals(&summary->filtered_allocations)
+        || !readVarint(&n_memory_snapshots))
+    {
+        return false;
+    }
+
+    // The memory snapshots are delta encoded against each other, starting
+    // with the time tracking started at.
+    summary->memory_snapshots.clear();
+    summary->memory_snapshots.reserve(n_memory_snapshots);
+    MemorySnapshot last{static_cast<unsigned long>(d_header.stats.start_time), 0, 0};
+    for (size_t i = 0; i < n_memory_snapshots; ++i) {
+        size_t ms_delta;
+        if (!readVarint(&ms_delta) || !readIntegralDelta(&last.rss, &last.rss)
+            || !readIntegralDelta(&last.heap, &last.heap))
+        {
+            return false;
+        }
+        last.ms_since_epoch += ms_delta;
+        summary->memory_snapshots.push_back(last);
+    }
+    return true;
+}
+
+bool
+RecordReader::readCaptureSummary(CaptureSummary* summary)
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (!d_header.summary_offset || !d_input->skipTo(d_header.summary_offset)) {
+        return false;
+    }
+    RecordTypeAndFlags token;
+    if (!readBytes(reinterpret_cast<char*>(&token), sizeof(token))
+        || token.record_type != RecordType::OTHER
+        || static_cast<OtherRecordType>(token.flags) != OtherRecordType::CAPTURE_SUMMARY
+        || !parseCaptureSummary(summary))
+    {
+        return false;
+    }
+    d_filtered_allocation_totals = summary->filtered_allocations;
+    return true;
+}
+
+bool
+RecordReader::parseContextSwitch(thread_id_t* tid, unsigned int flags)
+{
+    if (flags == CONTEXT_SWITCH_KNOWN_THREAD) {
+        size_t index;
+        if (!readVarint(&index) || !d_thread_deltas.threadAt(index, tid)) {
+            return false;
+        }
+    } else if (!readBytes(reinterpret_cast<char*>(tid), sizeof(*tid))) {
+        return false;
+    }
+    // This decides how the next records are decoded, so it can't wait until
+    // the record is processed.
+    d_thread_deltas.switchTo(&d_last, *tid);
+    return true;
+}
+
+bool
+RecordReader::processContextSwitch(thread_id_t tid)
+{
+    d_last.thread_id = tid;
+    return true;
+}
+
+bool
+RecordReader::parseThreadBuffer(ThreadBufferHeader* header, std::vector<BufferedRecord>* records)
+{
+    if (!readBytes(reinterpret_cast<char*>(&header->tid), sizeof(header->tid))
+        || !readVarint(&header->watermark) || !readVarint(&header->n_records))
+    {
+        return false;
+    }
+
+    // The records in a thread buffer use their own delta encoding state.
+    DeltaEncodedFields main_stream_last = d_last;
+    d_last = DeltaEncodedFields{};
+
+    records->clear();
+    records->reserve(header->n_records);
+    uint64_t sequence = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < header->n_records; ++i) {
+        size_t sequence_delta;
+        RecordTypeAndFlags token;
+        if (!readVarint(&sequence_delta)
+            || !readBytes(reinterpret_cast<char*>(&token), sizeof(token))) {
+            ok = false;
+            break;
+        }
+        sequence += sequence_delta;
+
+        BufferedRecord record{sequence, 0, header->tid, token};
+        switch (token.record_type) {
+            case RecordType::ALLOCATION: {
+                AllocationRecord allocation;
+                ok = parseAllocationRecord(&allocation, token.flags);
+                record.allocation = {allocation.address, allocation.size, allocation.allocator};
+            } break;
+            case RecordType::ALLOCATION_WITH_NATIVE: {
+                ok = parseNativeAllocationRecord(&record.allocation, token.flags);
+            } break;
+            case RecordType::ALLOCATION_WITH_PYTHON_STACK: {
+                PythonStackAllocationRecord allocation;
+                ok = parsePythonStackAllocationRecord(&allocation, token.flags);
+                record.allocation = {
+                        allocation.address,
+                        allocation.size,
+                        allocation.allocator,
+                        allocation.native_frame_id};
+                record.python_stack_index = allocation.python_stack_index;
+            } break;
+            case RecordType::FRAME_PUSH: {
+                ok = parseFramePush(&record.frame_push);
+            } break;
+            case RecordType::FRAME_POP: {
+                ok = parseFramePop(&record.frame_pop, token.flags);
+            } break;
+            case RecordType::THREAD_RECORD: {
+                ok = parseThreadRecord(&record.thread_name);
+            } break;
+            default: {
+                ok = false;
+            } break;
+        }
+        if (ok) {
+            records->push_back(std::move(record));
+        }
+    }
+
+    d_last = main_stream_last;
+    return ok;
+}
+
+bool
+RecordReader::processThreadBuffer(const ThreadBufferHeader& header, std::vector<BufferedRecord>& records)
+{
+    for (auto& record : records) {
+        record.order = d_next_buffered_record_order++;
+        d_buffered_records.push(std::move(record));
+    }
+    d_sequence_watermark = std::max(d_sequence_watermark, header.watermark);
+    return true;
+}
+
+bool
+RecordReader::parseAllocationBlock(std::vector<BufferedRecord>* records)
+{
+    RecordTypeAndFlags token;
+    size_t n_records;
+    if (!readBytes(reinterpret_cast<char*>(&token), sizeof(token)) || !readVarint(&n_records)) {
+        return false;
+    }
+    const RecordType record_type = token.record_type;
+    if ((record_type != RecordType::ALLOCATION && record_type != RecordType::ALLOCATION_WITH_NATIVE
+         && record_type != RecordType::ALLOCATION_WITH_PYTHON_STACK)
+        || n_records > ALLOCATION_BLOCK_SIZE)
+    {
+        return false;
+    }
+
+    // The records all belong to the current thread. Each column is decoded
+    // in one go, and then spread over the records.
+    records->assign(n_records, BufferedRecord{0, 0, d_last.thread_id, token});
+    std::vector<size_t>& column = d_block_column;
+    column.resize(n_records);
+
+    unsigned char allocators[(ALLOCATION_BLOCK_SIZE + 1) / 2];
+    if (!readBytes(reinterpret_cast<char*>(allocators), (n_records + 1) / 2)) {
+        return false;
+    }
+    bool has_size[ALLOCATION_BLOCK_SIZE];
+    size_t n_sizes = 0;
+    for (size_t i = 0; i < n_records; ++i) {
+        NativeAllocationRecord& allocation = (*records)[i].allocation;
+        allocation.allocator = static_cast<hooks::Allocator>(allocators[i / 2] >> (4 * (i % 2)) & 0x0f);
+        if (!allocatorFlags(allocation.allocator)) {
+            // These are never written in a block.
+            return false;
+        }
+        has_size[i] = record_type != RecordType::ALLOCATION
+                      || hooks::allocatorKind(allocation.allocator)
+                                 != hooks::AllocatorKind::SIMPLE_DEALLOCATOR;
+        n_sizes += has_size[i];
+    }
+
+    if (!readVarints(column.data(), n_records)) {
+        return false;
+    }
+    for (size_t i = 0; i < n_records; ++i) {
+        d_last.data_pointer += decodeZigzag(column[i]);
+        (*records)[i].allocation.address = d_last.data_pointer;
+    }
+
+    if (!readVarints(column.data(), n_sizes)) {
+        return false;
+    }
+    for (size_t i = 0, next_size = 0; i < n_records; ++i) {
+        (*records)[i].allocation.size = has_size[i] ? column[next_size++] : 0;
+    }
+
+    if (record_type == RecordType::ALLOCATION_WITH_PYTHON_STACK) {
+        if (!readVarints(column.data(), n_records)) {
+            return false;
+        }
+        for (size_t i = 0; i < n_records; ++i) {
+            d_last.python_stack_index += decodeZigzag(column[i]);
+            (*records)[i].python_stack_index = d_last.python_stack_index;
+        }
+    }
+    if (record_type != RecordType::ALLOCATION) {
+        if (!readVarints(column.data(), n_records)) {
+            return false;
+        }
+        for (size_t i = 0; i < n_records; ++i) {
+            d_last.native_frame_id += decodeZigzag(column[i]);
+            (*records)[i].allocation.native_frame_id = d_last.native_frame_id;
+        }
+    }
+    return true;
+}
+
+bool
+RecordReader::hasReadyBufferedRecord() const
+{
+    // Records below the watermark can't be preceded by any record that we
+    // haven't read yet. Once the input is exhausted, everything is ready.
+    return !d_buffered_records.empty()
+           && (d_input_exhausted || d_buffered_records.top().sequence < d_sequence_watermark);
+}
+
+bool
+RecordReader::processBufferedRecord(const BufferedRecord& record)
+{
+    thread_id_t main_stream_tid = d_last.thread_id;
+    d_last.thread_id = record.tid;
+
+    bool ret = false;
+    switch (record.token.record_type) {
+        case RecordType::ALLOCATION: {
+            const NativeAllocationRecord& allocation = record.allocation;
+            ret = processAllocationRecord(
+                    AllocationRecord{allocation.address, allocation.size, allocation.allocator});
+        } break;
+        case RecordType::ALLOCATION_WITH_NATIVE: {
+            ret = processNativeAllocationRecord(record.allocation);
+        } break;
+        case RecordType::ALLOCATION_WITH_PYTHON_STACK: {
+            const NativeAllocationRecord& allocation = record.allocation;
+            ret = processPythonStackAllocationRecord(PythonStackAllocationRecord{
+                    allocation.address,
+                    allocation.size,
+                    allocation.allocator,
+                    record.python_stack_index,
+                    allocation.native_frame_id});
+        } break;
+        case RecordType::FRAME_PUSH: {
+            ret = processFramePush(record.frame_push);
+        } break;
+        case RecordType::FRAME_POP: {
+            ret = processFramePop(record.frame_pop);
+        } break;
+        case RecordType::THREAD_RECORD: {
+            ret = processThreadRecord(record.thread_name);
+        } break;
+        case RecordType::OTHER: {
+            d_sampling_interval = record.sampling_interval;
+            ret = true;
+        } break;
+        default:
+            break;
+    }
+
+    d_last.thread_id = main_stream_tid;
+    return ret;
+}
+
+void
+RecordReader::setAllocationFilter(const AllocationFilter& filter)
+{
+    d_filter = filter;
+    d_stack_matches.clear();
+}
+
+void
+RecordReader::setReportProfileIntervals(bool report)
+{
+    d_report_profile_intervals = report;
+}
+
+void
+RecordReader::setNativeSymbolsOnly(bool symbols_only)
+{
+    d_symbol_resolver.setSymbolsOnly(symbols_only);
+}
+
+bool
+RecordReader::followsStacksOf(thread_id_t tid) const
+{
+    return !d_filter || !d_filter->has_tid || d_filter->tid == tid;
+}
+
+bool
+RecordReader::stackHasFilename(FrameTree::index_t index)
+{
+    // Stacks share the answer of their parent unless their innermost frame
+    // is in the file, so follow the stack up to the first one that's known
+    // and remember the answer for every stack on the way.
+    std::vector<FrameTree::index_t> path;
+    StackMatch match = StackMatch::NO;
+    while (index != 0) {
+        if (index < d_stack_matches.size() && d_stack_matches[index] != StackMatch::UNKNOWN) {
+            match = d_stack_matches[index];
+            break;
+        }
+        path.push_back(index);
+        auto [frame_id, parent_index] = d_tree.nextNode(index);
+        auto it = d_frame_map.find(frame_id);
+        if (it != d_frame_map.end()
+            && d_strings->get(it->second.filename).find(d_filter->filename) != std::string_view::npos)
+        {
+            match = StackMatch::YES;
+            break;
+        }
+        index = parent_index;
+    }
+    for (FrameTree::index_t stack : path) {
+        if (stack >= d_stack_matches.size()) {
+            d_stack_matches.resize(stack + 1, StackMatch::UNKNOWN);
+        }
+        d_stack_matches[stack] = match;
+    }
+    return match == StackMatch::YES;
+}
+
+bool
+RecordReader::passesFilter(const Allocation& allocation)
+{
+    const AllocationFilter& filter = *d_filter;
+    if (hooks::isDeallocator(allocation.allocator)) {
+        return true;
+    }
+    if ((filter.has_tid && allocation.tid != filter.tid) || allocation.size < filter.min_size
+        || allocation.size > filter.max_size)
+    {
+        return false;
+    }
+    const millis_t time = d_latest_memory_record.ms_since_epoch
+                                  ? static_cast<millis_t>(d_latest_memory_record.ms_since_epoch)
+                                  : d_header.stats.start_time;
+    if (time < filter.start_time || time > filter.end_time) {
+        return false;
+    }
+    return filter.filename.empty() || stackHasFilename(allocation.frame_index);
+}
+
+RecordReader::RecordResult
+RecordReader::nextRecord()
+{
+    RecordResult ret = nextUnfilteredRecord();
+    if (ret == RecordResult::ALLOCATION_RECORD && d_filter && !passesFilter(d_latest_allocation)) {
+        return RecordResult::FILTERED_ALLOCATION_RECORD;
+    }
+    return ret;
+}
+
+RecordReader::RecordResult
+RecordReader::nextUnfilteredRecord()
+{
+    while (true) {
+        if (d_repeated_records_left) {
+            d_latest_allocation = (--d_repeated_records_left % 2) ? d_previous_allocation
+                                                                  : d_repeated_deallocation;
+            return RecordResult::ALLOCATION_RECORD;
+        }
+        if (d_next_block_record < d_block_records.size()) {
+            if (!processBufferedRecord(d_block_records[d_next_block_record++])) {
+                if (d_input->is_open()) LOG(ERROR) << "Failed to process allocation block";
+                return RecordResult::ERROR;
+            }
+            return RecordResult::ALLOCATION_RECORD;
+        }
+        if (hasReadyBufferedRecord()) {
+            BufferedRecord record = d_buffered_records.top();
+            d_buffered_records.pop();
+            if (!processBufferedRecord(record)) {
+                if (d_input->is_open()) LOG(ERROR) << "Failed to process buffered record";
+                return RecordResult::ERROR;
+            }
+            RecordType record_type = record.token.record_type;
+            if (record_type == RecordType::ALLOCATION
+                || record_type == RecordType::ALLOCATION_WITH_NATIVE
+                || record_type == RecordType::ALLOCATION_WITH_PYTHON_STACK)
+            {
+                return RecordResult::ALLOCATION_RECORD;
+            }
+            continue;
+        }
+        if (d_input_exhausted) {
+            return RecordResult::END_OF_FILE;
+        }
+
+        RecordTypeAndFlags record_type_and_flags;
+        if (!readBytes(
+                    reinterpret_cast<char*>(&record_type_and_flags),
+                    sizeof(record_type_and_flags))) {
+            d_input_exhausted = true;
+            continue;
+        }
+
+        switch (record_type_and_flags.record_type) {
+            case RecordType::OTHER: {
+                switch (static_cast<OtherRecordType>(record_type_and_flags.flags)) {
+                    case OtherRecordType::TRAILER: {
+                        d_input_exhausted = true;
+                    } break;
+                    case OtherRecordType::THREAD_BUFFER: {
+                        ThreadBufferHeader header;
+                        std::vector<BufferedRecord> records;
+                        if (!parseThreadBuffer(&header, &records)
+                            || !processThreadBuffer(header, records)) {
+                            if (d_input->is_open()) LOG(ERROR) << "Failed to process thread buffer";
+                            return RecordResult::ERROR;
+                        }
+                    } break;
+                    case OtherRecordType::ALLOCATION_BLOCK: {
+                        d_next_block_record = 0;
+                        if (!parseAllocationBlock(&d_block_records)) {
+                            d_block_records.clear();
+                            if (d_input->is_open()) LOG(ERROR) << "Failed to process allocation block";
+                            return RecordResult::ERROR;
+                        }
+                    } break;
+                    case OtherRecordType::CHUNK_START: {
+                        ChunkStart entry;
+                        if (!parseChunkStart(&entry) || !processChunkStart(entry)) {
+                            if (d_input->is_open()) LOG(ERROR) << "Failed to process chunk start";
+                            return RecordResult::ERROR;
+                        }
+                    } break;
+                    case OtherRecordType::REPEATED_ALLOCATIONS: {
+                        size_t n_repeats;
+                        if (!parseRepeatedAllocations(&n_repeats)
+                            || !processRepeatedAllocations(n_repeats))
+                        {
+                            if (d_input->is_open()) {
+                                LOG(ERROR) << "Failed to process repeated allocations";
+                            }
+                            return RecordResult::ERROR;
+                        }
+                        if (!d_expand_repeated_allocations) {
+                            return RecordResult::ALLOCATION_RECORD;
+                        }
+                    } break;
+                    case OtherRecordType::FILTERED_ALLOCATIONS: {
+                        FilteredAllocationTotals totals;
+                        if (!parseFilteredAllocationTotals(&totals)
+                            || !processFilteredAllocationTotals(totals))
+                        {
+                            if (d_input->is_open()) {
+                                LOG(ERROR) << "Failed to process filtered allocation totals";
+                            }
+                            return RecordResult::ERROR;
+                        }
+                    } break;
+                    case OtherRecordType::TRACKER_METRICS: {
+                        TrackerMetrics metrics;
+                        if (!parseTrackerMetrics(&metrics) || !processTrackerMetrics(metrics)) {
+                            if (d_input->is_open()) LOG(ERROR) << "Failed to process tracker metrics";
+                            return RecordResult::ERROR;
+                        }
+                    } break;
+                    case OtherRecordType::CAPTURE_SUMMARY: {
+                        // Everything in it is worked out again by reading
+                        // the records.
+                        CaptureSummary summary;
+                        if (!parseCaptureSummary(&summary)) {
+                            if (d_input->is_open()) LOG(ERROR) << "Failed to process capture summary";
+                            return RecordResult::ERROR;
+                        }
+                    } break;
+                    case OtherRecordType::PYTHON_STACK_TREE: {
+                        std::vector<std::pair<frame_id_t, FrameTree::index_t>> nodes;
+                        if (!parsePythonStackTree(&nodes) || !processPythonStackTree(nodes)) {
+                            if (d_input->is_open()) LOG(ERROR) << "Failed to process Python stack tree";
+                            return RecordResult::ERROR;
+                        }
+                    } break;
+                    case OtherRecordType::PROFILE_INTERVAL: {
+                        ProfileInterval interval;
+                        if (!parseProfileInterval(&interval)
+                            || !processProfileInterval(std::move(interval)))
+                        {
+                            if (d_input->is_open()) LOG(ERROR) << "Failed to process profile interval";
+                            return RecordResult::ERROR;
+                        }
+                        if (d_report_profile_intervals) {
+                            return RecordResult::PROFILE_INTERVAL;
+                        }
+                    } break;
+                    case OtherRecordType::SAMPLING_INTERVAL: {
+                        size_t sampling_interval;
+                        uint64_t sequence;
+                        if (!parseSamplingInterval(&sampling_interval, &sequence)
+                            || !processSamplingInterval(sampling_interval, sequence))
+                        {
+                            if (d_input->is_open()) LOG(ERROR) << "Failed to process sampling interval";
+                            return RecordResult::ERROR;
+                        }
+                    } break;
+                    default: {
+                        if (d_input->is_open()) LOG(ERROR) << "Invalid record subtype";
+                        return RecordResult::ERROR;
+                    } break;
+                }
+            } break;
+            case RecordType::ALLOCATION: {
+                AllocationRecord record;
+                if (!parseAllocationRecord(&record, record_type_and_flags.flags)
+                    || !processAllocationRecord(record)) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process allocation record";
+                    return RecordResult::ERROR;
+                }
+                return RecordResult::ALLOCATION_RECORD;
+            } break;
+            case RecordType::ALLOCATION_WITH_NATIVE: {
+                NativeAllocationRecord record;
+                if (!parseNativeAllocationRecord(&record, record_type_and_flags.flags)
+                    || !processNativeAllocationRecord(record))
+                {
+                    if (d_input->is_open()) {
+                        LOG(ERROR) << "Failed to process allocation record with native info";
+                    }
+                    return RecordResult::ERROR;
+                }
+                return RecordResult::ALLOCATION_RECORD;
+            } break;
+            case RecordType::ALLOCATION_WITH_PYTHON_STACK: {
+                PythonStackAllocationRecord record;
+                if (!parsePythonStackAllocationRecord(&record, record_type_and_flags.flags)
+                    || !processPythonStackAllocationRecord(record))
+                {
+                    if (d_input->is_open()) {
+                        LOG(ERROR) << "Failed to process allocation record with Python stack";
+                    }
+                    return RecordResult::ERROR;
+                }
+                return RecordResult::ALLOCATION_RECORD;
+            } break;
+            case RecordType::AGGREGATED_ALLOCATION: {
+                AggregatedAllocation record;
+                if (!parseAggregatedAllocationRecord(&record, record_type_and_flags.flags)
+                    || !processAggregatedAllocationRecord(record))
+                {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process aggregated allocation";
+                    return RecordResult::ERROR;
+                }
+                return RecordResult::AGGREGATED_ALLOCATION_RECORD;
+            } break;
+            case RecordType::MEMORY_RECORD: {
+                MemoryRecord record;
+                if (!parseMemoryRecord(&record, record_type_and_flags.flags)
+                    || !processMemoryRecord(record))
+                {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process memory record";
+                    return RecordResult::ERROR;
+                }
+                return RecordResult::MEMORY_RECORD;
+            } break;
+            case RecordType::CONTEXT_SWITCH: {
+                thread_id_t tid;
+                if (!parseContextSwitch(&tid, record_type_and_flags.flags)
+                    || !processContextSwitch(tid))
+                {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process context switch record";
+                    return RecordResult::ERROR;
+                }
+            } break;
+            case RecordType::FRAME_PUSH: {
+                FramePush record;
+                if (!parseFramePush(&record) || !processFramePush(record)) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process frame push";
+                    return RecordResult::ERROR;
+                }
+            } break;
+            case RecordType::FRAME_POP: {
+                FramePop record;
+                if (!parseFramePop(&record, record_type_and_flags.flags) || !processFramePop(record)) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process frame pop";
+                    return RecordResult::ERROR;
+                }
+            } break;
+            case RecordType::FRAME_INDEX: {
+                tracking_api::pyframe_map_val_t record;
+                if (!parseFrameIndex(&record, record_type_and_flags.flags) || !processFrameIndex(record))
+                {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process frame index";
+                    return RecordResult::ERROR;
+                }
+            } break;
+            case RecordType::NATIVE_TRACE_INDEX: {
+                UnresolvedNativeFrame record;
+                if (!parseNativeFrameIndex(&record) || !processNativeFrameIndex(record)) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process native frame index";
+                    return RecordResult::ERROR;
+                }
+            } break;
+            case RecordType::MEMORY_MAP_START: {
+                MemoryMapStart record;
+                if (!parseMemoryMapStart(&record, record_type_and_flags.flags)
+                    || !processMemoryMapStart(record))
+                {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process memory map start";
+                    return RecordResult::ERROR;
+                }
+            } break;
+            case RecordType::SEGMENT_HEADER: {
+                std::string filename;
+                size_t num_segments;
+                uintptr_t addr;
+                if (record_type_and_flags.flags == SEGMENT_HEADER_UNLOADED) {
+                    if (!parseUnloadedModule(&filename, &addr)
+                        || !processUnloadedModule(filename, addr))
+                    {
+                        if (d_input->is_open()) LOG(ERROR) << "Failed to process unloaded module";
+                        return RecordResult::ERROR;
+                    }
+                } else if (
+                        !parseSegmentHeader(&filename, &num_segments, &addr)
+                        || !processSegmentHeader(filename, num_segments, addr))
+                {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process segment header";
+                    return RecordResult::ERROR;
+                }
+            } break;
+            case RecordType::THREAD_RECORD: {
+                std::string name;
+                if (!parseThreadRecord(&name) || !processThreadRecord(name)) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to process thread record";
+                    return RecordResult::ERROR;
+                }
+            } break;
+            default:
+                if (d_input->is_open()) LOG(ERROR) << "Invalid record type";
+                return RecordResult::ERROR;
+        }
+    }
+}
+
+// Python public APIs
+
+PyObject*
+RecordReader::Py_GetStackFrame(unsigned int index, size_t max_stacks)
+{
+    return Py_GetStackFrameAndEntryInfo(index, nullptr, max_stacks);
+}
+
+const RecordReader::PythonFrame*
+RecordReader::getPythonFrame(FrameTree::index_t index)
+{
+    if (index >= d_python_frames.size()) {
+        d_python_frames.resize(d_tree.size());
+    }
+    PythonFrame& python_frame = d_python_frames[index];
+    if (python_frame.frame == nullptr) {
+        const auto& frame = d_frame_map.at(d_tree.nextNode(index).first);
+        python_frame.frame = frame.toPythonObject(d_pystring_cache);
+        if (python_frame.frame == nullptr) {
+            return nullptr;
+        }
+        python_frame.is_entry_frame = frame.is_entry_frame;
+    }
+    return &python_frame;
+}
+
+const RecordReader::NativeFrames*
+RecordReader::getNativeFrames(uintptr_t ip, size_t generation)
+{
+    auto it = d_native_frames_objects.find({ip, generation});
+    if (it != d_native_frames_objects.end()) {
+        return &it->second;
+    }
+
+    auto resolved_frames = d_symbol_resolver.resolve(ip, generation);
+    const size_t n_frames = resolved_frames ? resolved_frames->frames().size() : 0;
+    NativeFrames native_frames;
+    native_frames.frames = PyTuple_New(n_frames);
+    if (native_frames.frames == nullptr) {
+        return nullptr;
+    }
+    native_frames.is_eval_frame.reserve(n_frames);
+    for (size_t i = 0; i < n_frames; ++i) {
+        const auto& native_frame = resolved_frames->frames()[i];
+        PyObject* pyframe = native_frame.toPythonObject(d_pystring_cache);
+        if (pyframe == nullptr) {
+            Py_DECREF(native_frames.frames);
+            return nullptr;
+        }
+        PyTuple_SET_ITEM(native_frames.frames, i, pyframe);
+        native_frames.is_eval_frame.push_back(native_frame.IsEvalFrame());
+    }
+    return &d_native_frames_objects.emplace(std::make_pair(ip, generation), std::move(native_frames))
+                    .first->second;
+}
+
+PyObject*
+RecordReader::Py_GetStackFrameAndEntryInfo(
+        unsigned int index,
+        std::vector<unsigned char>* is_entry_frame,
+        size_t max_stacks)
+{
+    if (!d_track_stacks) {
+        PyErr_SetString(PyExc_RuntimeError, "Stack tracking is disabled");
+        return NULL;
+    }
+    if (is_entry_frame) {
+        is_entry_frame->clear();
+        is_entry_frame->reserve(64);
+    }
+    std::lock_guard<std::mutex> lock(d_mutex);
+
+    // Walking the tree is cheap, so size the list before filling it with the
+    // frames that earlier stacks already built.
+    size_t n_frames = 0;
+    for (FrameTree::index_t current_index = index; current_index != 0 && n_frames != max_stacks;
+         ++n_frames)
+    {
+        current_index = d_tree.nextNode(current_index).second;
+    }
+    PyObject* list = PyList_New(n_frames);
+    if (list == nullptr) {
+        return nullptr;
+    }
+
+    FrameTree::index_t current_index = index;
+    for (size_t i = 0; i < n_frames; ++i) {
+        const PythonFrame* frame = getPythonFrame(current_index);
+        if (frame == nullptr) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+        Py_INCREF(frame->frame);
+        PyList_SET_ITEM(list, i, frame->frame);
+        if (is_entry_frame) {
+            is_entry_frame->push_back(frame->is_entry_frame);
+        }
+        current_index = d_tree.nextNode(current_index).second;
+    }
+    return list;
+}
+
+PyObject*
+RecordReader::Py_GetNativeStackFrame(FrameTree::index_t index, size_t generation, size_t max_stacks)
+{
+    if (!d_track_stacks) {
+        PyErr_SetString(PyExc_RuntimeError, "Stack tracking is disabled");
+        return NULL;
+    }
+    std::lock_guard<std::mutex> lock(d_mutex);
+
+    size_t stacks_obtained = 0;
+    FrameTree::index_t current_index = index;
+    PyObject* list = PyList_New(0);
+    if (list == nullptr) {
+        return nullptr;
+    }
+
+    while (current_index != 0 && stacks_obtained++ != max_stacks) {
+        auto frame = d_native_frames[current_index - 1];
+        current_index = frame.index;
+        const NativeFrames* native_frames = getNativeFrames(frame.ip, generation);
+        if (native_frames == nullptr) {
+            goto error;
+        }
+        for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(native_frames->frames); ++i) {
+            if (PyList_Append(list, PyTuple_GET_ITEM(native_frames->frames, i)) != 0) {
+                goto error;
+            }
+        }
+    }
+    return list;
+error:
+    Py_XDECREF(list);
+    return nullptr;
+}
+
+PyObject*
+RecordReader::Py_GetHybridStackFrame(
+        FrameTree::index_t index,
+        FrameTree::index_t native_index,
+        size_t generation,
+        thread_id_t tid,
+        size_t max_stacks)
+{
+    // This substitutes the calls to _PyEval_EvalFrameDefault in the native
+    // stack with the Python frames they evaluate. There are several tricky
+    // aspects:
+    // 1. For the thread that called Tracker.__enter__, we want to hide
+    //    frames (both Python and C) above the one that made that call.
+    //    For other threads we want to keep all frames.
+    // 2. If _PyEval_EvalFrameDefault allocates memory before calling our
+    //    profile function, we'll have too few Python frames to pair up
+    //    every _PyEval_EvalFrameDefault call. This happens in 3.11. So the
+    //    frames are paired up from the least recent to the most recent.
+    // 3. Since Python 3.11, one _PyEval_EvalFrameDefault call can evaluate
+    //    many Python frames. If a frame's is_entry_frame flag is unset, it
+    //    uses the same _PyEval_EvalFrameDefault call as its caller.
+    // 4. If the interpreter was stripped, we may not be able to recognize
+    //    every (or even any) _PyEval_EvalFrameDefault call, so we may
+    //    have extra Python frames left after pairing.
+    if (!d_track_stacks) {
+        PyErr_SetString(PyExc_RuntimeError, "Stack tracking is disabled");
+        return NULL;
+    }
+    std::lock_guard<std::mutex> lock(d_mutex);
+
+    // Both stacks are gathered from the most recent frame to the least.
+    std::vector<const PythonFrame*> python_stack;
+    for (FrameTree::index_t current_index = index; current_index != 0;) {
+        const PythonFrame* frame = getPythonFrame(current_index);
+        if (frame == nullptr) {
+            return nullptr;
+        }
+        python_stack.push_back(frame);
+        current_index = d_tree.nextNode(current_index).second;
+    }
+    std::vector<std::pair<PyObject*, bool>> native_stack;
+    for (FrameTree::index_t current_index = native_index; current_index != 0;) {
+        const auto& frame = d_native_frames[current_index - 1];
+        const NativeFrames* native_frames = getNativeFrames(frame.ip, generation);
+        if (native_frames == nullptr) {
+            return nullptr;
+        }
+        for (size_t i = 0; i < native_frames->is_eval_frame.size(); ++i) {
+            native_stack.emplace_back(
+                    PyTuple_GET_ITEM(native_frames->frames, i),
+                    native_frames->is_eval_frame[i]);
+        }
+        current_index = frame.index;
+    }
+
+    // The hybrid stack is built from the least recent frame to the most
+    // recent, and reversed at the end.
+    const ssize_t to_skip = tid == d_header.main_tid ? d_header.skipped_frames_on_main_tid : 0;
+    ssize_t pidx = static_cast<ssize_t>(python_stack.size()) - 1;
+    const ssize_t first_kept_frame = pidx - to_skip;
+    std::vector<PyObject*> hybrid_stack;
+    hybrid_stack.reserve(native_stack.size() + python_stack.size());
+    for (auto it = native_stack.rbegin(); it != native_stack.rend(); ++it) {
+        const auto& [native_frame, is_eval_frame] = *it;
+        if (pidx < 0 || !is_eval_frame) {
+            hybrid_stack.push_back(native_frame);
+            continue;
+        }
+        while (true) {
+            // If we've reached the first frame that we want to keep, remove
+            // the frames above it.
+            if (to_skip != 0 && pidx == first_kept_frame) {
+                hybrid_stack.clear();
+            }
+            hybrid_stack.push_back(python_stack[pidx]->frame);
+            --pidx;
+            // Stop when we either run out of Python frames or reach the
+            // entry frame being evaluated by the next eval loop.
+            if (pidx < 0 || python_stack[pidx]->is_entry_frame) {
+                break;
+            }
+        }
+    }
+    if (pidx >= 0) {
+        // We ran out of native frames without using up all of our Python
+        // frames. We've seen this happen on stripped interpreters on Alpine
+        // Linux in CI. Presumably this indicates that unwinding failed to
+        // symbolify some of the calls to _PyEval_EvalFrameDefault.
+        return Py_BuildValue("[(ssi)]", "<unknown stack>", "<unknown>", 0);
+    }
+
+    const size_t n_frames = std::min(hybrid_stack.size(), max_stacks);
+    PyObject* list = PyList_New(n_frames);
+    if (list == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < n_frames; ++i) {
+        PyObject* frame = hybrid_stack[hybrid_stack.size() - 1 - i];
+        Py_INCREF(frame);
+        PyList_SET_ITEM(list, i, frame);
+    }
+    return list;
+}
+
+PyObject*
+RecordReader::Py_AggregateByLocation(const std::vector<Allocation>& allocations, double memory_threshold)
 {
     if (!d_track_stacks) {
         PyErr_SetString(PyExc_RuntimeError, "Stack tracking is disabled");
         return NULL;
     }
-    if (is_entry_frame) {
-        is_entry_frame->clear();
-        is_entry_frame->reserve(64);
-    }
     std::lock_guard<std::mutex> lock(d_mutex);
 
-    size_t stacks_obtained = 0;
-    FrameTree::index_t current_index = index;
-    PyObject* list = PyList_New(0);
-    if (list == nullptr) {
-        return nullptr;
+    struct LocationEntry
+    {
+        StringInterner::id_t function;
+        StringInterner::id_t file;
+        size_t own_memory{0};
+        size_t total_memory{0};
+        size_t n_allocations{0};
+        std::unordered_set<thread_id_t> thread_ids{};
+        size_t last_visit{0};
+    };
+
+    // Many frames (one per line number) share a location, so frames are
+    // mapped to locations once and the entries are then found by index.
+    // Locations are keyed by the ids of their interned strings.
+    const StringInterner::id_t unknown = d_strings->intern("???");
+    std::vector<LocationEntry> entries;
+    std::unordered_map<uint64_t, size_t> location_by_name;
+    std::unordered_map<frame_id_t, size_t> location_by_frame_id;
+    auto findLocation = [&](StringInterner::id_t function, StringInterner::id_t file) {
+        const uint64_t key = static_cast<uint64_t>(function) << 32 | file;
+        auto [it, inserted] = location_by_name.emplace(key, entries.size());
+        if (inserted) {
+            entries.push_back(LocationEntry{function, file});
+        }
+        return it->second;
+    };
+    auto locationForFrame = [&](frame_id_t frame_id) {
+        auto it = location_by_frame_id.find(frame_id);
+        if (it == location_by_frame_id.end()) {
+            const auto& frame = d_frame_map.at(frame_id);
+            size_t location = findLocation(frame.function_name, frame.filename);
+            it = location_by_frame_id.emplace(frame_id, location).first;
+        }
+        return it->second;
+    };
+
+    double current_total = 0;
+    size_t visit = 0;
+    std::vector<size_t> stack;
+    for (const auto& allocation : allocations) {
+        if (current_total >= memory_threshold) {
+            break;
+        }
+        current_total += allocation.size;
+
+        stack.clear();
+        FrameTree::index_t current_index = allocation.frame_index;
+        while (current_index != 0) {
+            auto [frame_id, next_index] = d_tree.nextNode(current_index);
+            stack.push_back(locationForFrame(frame_id));
+            current_index = next_index;
+        }
+        if (allocation.tid == d_header.main_tid) {
+            const size_t to_skip = d_header.skipped_frames_on_main_tid;
+            stack.resize(stack.size() > to_skip ? stack.size() - to_skip : 0);
+        }
+
+        if (stack.empty()) {
+            LocationEntry& entry = entries[findLocation(unknown, unknown)];
+            entry.own_memory += allocation.size;
+            entry.total_memory += allocation.size;
+            entry.n_allocations += allocation.n_allocations;
+            entry.thread_ids.insert(allocation.tid);
+            continue;
+        }
+
+        // Like aggregate_allocations(), the innermost location's entry is
+        // replaced rather than added to, and it's not marked as visited.
+        LocationEntry& own_entry = entries[stack[0]];
+        own_entry.own_memory = allocation.size;
+        own_entry.total_memory = allocation.size;
+        own_entry.n_allocations = allocation.n_allocations;
+        own_entry.thread_ids = {allocation.tid};
+
+        ++visit;
+        for (size_t i = 1; i < stack.size(); ++i) {
+            LocationEntry& entry = entries[stack[i]];
+            if (entry.last_visit == visit) {
+                continue;
+            }
+            entry.last_visit = visit;
+            entry.total_memory += allocation.size;
+            entry.n_allocations += allocation.n_allocations;
+            entry.thread_ids.insert(allocation.tid);
+        }
     }
 
-    while (current_index != 0 && stacks_obtained++ != max_stacks) {
-        auto [frame_id, next_index] = d_tree.nextNode(current_index);
-        const auto& frame = d_frame_map.at(frame_id);
-        PyObject* pyframe = frame.toPythonObject(d_pystring_cache);
-        if (pyframe == nullptr) {
+    PyObject* result = PyDict_New();
+    if (result == nullptr) {
+        return nullptr;
+    }
+    for (const auto& entry : entries) {
+        if (entry.thread_ids.empty()) {
+            // Locations only seen past the memory threshold.
+            continue;
+        }
+        PyObject* pyfunction = d_pystring_cache.getUnicodeObject(entry.function);  // Borrowed
+        PyObject* pyfile = pyfunction ? d_pystring_cache.getUnicodeObject(entry.file) : nullptr;
+        PyObject* thread_ids = pyfile ? PySet_New(nullptr) : nullptr;
+        if (thread_ids == nullptr) {
             goto error;
         }
-        int ret = PyList_Append(list, pyframe);
-        Py_DECREF(pyframe);
+        for (const auto tid : entry.thread_ids) {
+            PyObject* pytid = PyLong_FromLong(tid);
+            if (pytid == nullptr || PySet_Add(thread_ids, pytid) != 0) {
+                Py_XDECREF(pytid);
+                Py_DECREF(thread_ids);
+                goto error;
+            }
+            Py_DECREF(pytid);
+        }
+        PyObject* key = Py_BuildValue("(OO)", pyfunction, pyfile);
+        PyObject* value = Py_BuildValue(
+                "(nnnN)",
+                static_cast<Py_ssize_t>(entry.own_memory),
+                static_cast<Py_ssize_t>(entry.total_memory),
+                static_cast<Py_ssize_t>(entry.n_allocations),
+                thread_ids);
+        int ret = (key && value) ? PyDict_SetItem(result, key, value) : -1;
+        Py_XDECREF(key);
+        Py_XDECREF(value);
         if (ret != 0) {
             goto error;
         }
-        if (is_entry_frame) {
-            is_entry_frame->push_back(frame.is_entry_frame);
-        }
-        current_index = next_index;
     }
-    return list;
+    return result;
 error:
-    Py_XDECREF(list);
+    Py_DECREF(result);
     return nullptr;
 }
 
 PyObject*
-RecordReader::Py_GetNativeStackFrame(FrameTree::index_t index, size_t generation, size_t max_stacks)
+RecordReader::Py_BuildFlameGraph(
+        const std::vector<Allocation>& allocations,
+        PyObject* frame_flags,
+        size_t max_depth)
 {
     if (!d_track_stacks) {
         PyErr_SetString(PyExc_RuntimeError, "Stack tracking is disabled");
@@ -600,36 +1988,452 @@ RecordReader::Py_GetNativeStackFrame(FrameTree::index_t index, size_t generation
     }
     std::lock_guard<std::mutex> lock(d_mutex);
 
-    size_t stacks_obtained = 0;
-    FrameTree::index_t current_index = index;
-    PyObject* list = PyList_New(0);
-    if (list == nullptr) {
+    struct FrameKey
+    {
+        StringInterner::id_t function;
+        StringInterner::id_t filename;
+        int lineno;
+
+        bool operator==(const FrameKey& other) const
+        {
+            return function == other.function && filename == other.filename && lineno == other.lineno;
+        }
+    };
+
+    struct FrameKeyHash
+    {
+        size_t operator()(const FrameKey& key) const
+        {
+            size_t h = std::hash<StringInterner::id_t>{}(key.function);
+            h = h * 31 + std::hash<StringInterner::id_t>{}(key.filename);
+            return h * 31 + std::hash<int>{}(key.lineno);
+        }
+    };
+
+    struct FrameInfo
+    {
+        bool hidden;
+        bool import_system;
+    };
+
+    struct Node
+    {
+        size_t frame_index;
+        thread_id_t tid;
+        size_t parent_index;
+        size_t size{0};
+        size_t n_allocations{0};
+        bool import_system{false};
+        bool too_deep{false};
+    };
+
+    struct ChildKey
+    {
+        size_t parent_index;
+        size_t frame_index;
+        thread_id_t tid;
+
+        bool operator==(const ChildKey& other) const
+        {
+            return parent_index == other.parent_index && frame_index == other.frame_index
+                   && tid == other.tid;
+        }
+    };
+
+    struct ChildKeyHash
+    {
+        size_t operator()(const ChildKey& key) const
+        {
+            size_t h = std::hash<size_t>{}(key.parent_index);
+            h = h * 31 + std::hash<size_t>{}(key.frame_index);
+            return h * 31 + std::hash<thread_id_t>{}(key.tid);
+        }
+    };
+
+    PyObject* frames = PyList_New(0);
+    if (frames == nullptr) {
         return nullptr;
     }
-
-    while (current_index != 0 && stacks_obtained++ != max_stacks) {
-        auto frame = d_native_frames[current_index - 1];
-        current_index = frame.index;
-        auto resolved_frames = d_symbol_resolver.resolve(frame.ip, generation);
-        if (!resolved_frames) {
-            continue;
+    std::vector<FrameInfo> frame_infos;
+    std::unordered_map<FrameKey, size_t, FrameKeyHash> frame_index_by_key;
+    std::unordered_map<frame_id_t, size_t> frame_index_by_id;
+
+    // Distinct frame ids can describe the same (function, file, lineno)
+    // tuple, and the nodes of the graph are keyed by that tuple.
+    auto frameIndexFor = [&](frame_id_t frame_id) -> std::optional<size_t> {
+        auto it = frame_index_by_id.find(frame_id);
+        if (it != frame_index_by_id.end()) {
+            return it->second;
         }
-        for (auto& native_frame : resolved_frames->frames()) {
-            PyObject* pyframe = native_frame.toPythonObject(d_pystring_cache);
+        const Frame& frame = d_frame_map.at(frame_id);
+        FrameKey key{frame.function_name, frame.filename, frame.lineno};
+        auto key_it = frame_index_by_key.find(key);
+        if (key_it == frame_index_by_key.end()) {
+            PyObject* pyframe = frame.toPythonObject(d_pystring_cache);
             if (pyframe == nullptr) {
-                return nullptr;
+                return std::nullopt;
+            }
+            PyObject* flags = nullptr;
+            if (PyList_Append(frames, pyframe) == 0) {
+                flags = PyObject_CallFunctionObjArgs(frame_flags, pyframe, NULL);
             }
-            int ret = PyList_Append(list, pyframe);
             Py_DECREF(pyframe);
-            if (ret != 0) {
-                goto error;
+            if (flags == nullptr) {
+                return std::nullopt;
+            }
+            int hidden = -1;
+            int import_system = -1;
+            if (PyTuple_Check(flags) && PyTuple_GET_SIZE(flags) == 2) {
+                hidden = PyObject_IsTrue(PyTuple_GET_ITEM(flags, 0));
+                import_system = hidden < 0 ? -1 : PyObject_IsTrue(PyTuple_GET_ITEM(flags, 1));
+            } else {
+                PyErr_SetString(PyExc_TypeError, "frame_flags must return a tuple of two bools");
+            }
+            Py_DECREF(flags);
+            if (hidden < 0 || import_system < 0) {
+                return std::nullopt;
+            }
+            frame_infos.push_back(FrameInfo{hidden == 1, import_system == 1});
+            key_it = frame_index_by_key.emplace(key, frame_infos.size() - 1).first;
+        }
+        frame_index_by_id.emplace(frame_id, key_it->second);
+        return key_it->second;
+    };
+
+    std::vector<Node> nodes;
+    nodes.push_back(Node{0, 0, 0});
+    std::unordered_map<ChildKey, size_t, ChildKeyHash> child_by_key;
+
+    std::vector<size_t> stack;
+    for (const auto& allocation : allocations) {
+        nodes[0].size += allocation.size;
+        nodes[0].n_allocations += allocation.n_allocations;
+
+        stack.clear();
+        FrameTree::index_t current_index = allocation.frame_index;
+        while (current_index != 0) {
+            auto [frame_id, next_index] = d_tree.nextNode(current_index);
+            std::optional<size_t> frame_index = frameIndexFor(frame_id);
+            if (!frame_index) {
+                Py_DECREF(frames);
+                return nullptr;
+            }
+            stack.push_back(*frame_index);
+            current_index = next_index;
+        }
+        if (allocation.tid == d_header.main_tid) {
+            const size_t to_skip = d_header.skipped_frames_on_main_tid;
+            stack.resize(stack.size() > to_skip ? stack.size() - to_skip : 0);
+        }
+
+        // Walk from the outermost frame inwards, the way the Python reporter
+        // does: hidden frames are left out of the graph, and once a frame or
+        // its callee is part of the import system, so is the rest of the stack.
+        size_t current_node = 0;
+        size_t num_skipped_frames = 0;
+        bool is_import_system = false;
+        for (size_t depth = 0; depth < stack.size(); ++depth) {
+            const size_t frame_index = stack[stack.size() - 1 - depth];
+            if (frame_infos[frame_index].hidden) {
+                ++num_skipped_frames;
+                continue;
+            }
+            const bool callee_is_import_system =
+                    depth + 1 < stack.size() && frame_infos[stack[stack.size() - 2 - depth]].import_system;
+            if (frame_infos[frame_index].import_system || callee_is_import_system) {
+                is_import_system = true;
+            }
+
+            ChildKey key{current_node, frame_index, allocation.tid};
+            auto [it, inserted] = child_by_key.emplace(key, nodes.size());
+            if (inserted) {
+                Node node{frame_index, allocation.tid, current_node};
+                node.import_system = is_import_system;
+                nodes.push_back(node);
+            }
+            current_node = it->second;
+            Node& node = nodes[current_node];
+            node.size += allocation.size;
+            node.n_allocations += allocation.n_allocations;
+
+            if (depth - num_skipped_frames > max_depth) {
+                node.too_deep = true;
+                break;
             }
         }
     }
-    return list;
-error:
-    Py_XDECREF(list);
-    return nullptr;
+
+    PyObject* pynodes = PyList_New(nodes.size());
+    if (pynodes == nullptr) {
+        Py_DECREF(frames);
+        return nullptr;
+    }
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const Node& node = nodes[i];
+        PyObject* pynode = Py_BuildValue(
+                "(nlnnnOO)",
+                i == 0 ? Py_ssize_t(-1) : static_cast<Py_ssize_t>(node.frame_index),
+                static_cast<long>(node.tid),
+                static_cast<Py_ssize_t>(node.parent_index),
+                static_cast<Py_ssize_t>(node.size),
+                static_cast<Py_ssize_t>(node.n_allocations),
+                node.import_system ? Py_True : Py_False,
+                node.too_deep ? Py_True : Py_False);
+        if (pynode == nullptr) {
+            Py_DECREF(frames);
+            Py_DECREF(pynodes);
+            return nullptr;
+        }
+        PyList_SET_ITEM(pynodes, i, pynode);
+    }
+    return Py_BuildValue("(NN)", frames, pynodes);
+}
+
+void
+RecordReader::addToSnapshotDiff(
+        const std::vector<Allocation>& allocations,
+        SnapshotDiff::Side side,
+        SnapshotDiff* diff)
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+
+    std::unordered_map<frame_id_t, SnapshotDiff::interned_id_t> interned_frames;
+    auto internFrame = [&](frame_id_t frame_id) {
+        auto it = interned_frames.find(frame_id);
+        if (it == interned_frames.end()) {
+            // Whether a frame is an entry frame depends on how the capture's
+            // interpreter was called into, not on the code the frame runs.
+            Frame frame = d_frame_map.at(frame_id);
+            frame.is_entry_frame = true;
+            it = interned_frames.emplace(frame_id, diff->internFrame(frame, *d_strings)).first;
+        }
+        return it->second;
+    };
+
+    std::vector<SnapshotDiff::interned_id_t> stack;
+    for (const auto& allocation : allocations) {
+        stack.clear();
+        FrameTree::index_t current_index = allocation.frame_index;
+        while (current_index != 0) {
+            auto [frame_id, next_index] = d_tree.nextNode(current_index);
+            stack.push_back(internFrame(frame_id));
+            current_index = next_index;
+        }
+        if (allocation.tid == d_header.main_tid) {
+            const size_t to_skip = d_header.skipped_frames_on_main_tid;
+            stack.resize(stack.size() > to_skip ? stack.size() - to_skip : 0);
+        }
+        diff->add(side, diff->internStack(stack), allocation.size, allocation.n_allocations);
+    }
+}
+
+PyObject*
+RecordReader::Py_EncodePprofProfile(
+        const std::vector<Allocation>& allocations,
+        bool native_traces,
+        const std::string& sample_kind,
+        long long time_nanos,
+        long long duration_nanos)
+{
+    if (!d_track_stacks) {
+        PyErr_SetString(PyExc_RuntimeError, "Stack tracking is disabled");
+        return NULL;
+    }
+    if (native_traces) {
+        std::vector<std::pair<size_t, size_t>> native_stacks;
+        native_stacks.reserve(allocations.size());
+        for (const auto& allocation : allocations) {
+            native_stacks.emplace_back(allocation.native_frame_id, allocation.native_segment_generation);
+        }
+        resolveNativeStacks(native_stacks);
+    }
+
+    std::string encoded;
+    Py_BEGIN_ALLOW_THREADS;
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        PprofProfile profile(sample_kind);
+
+        std::unordered_map<frame_id_t, PprofProfile::id_t> python_locations;
+        auto pythonLocation = [&](frame_id_t frame_id) {
+            auto it = python_locations.find(frame_id);
+            if (it == python_locations.end()) {
+                const Frame& frame = d_frame_map.at(frame_id);
+                const PprofProfile::line_t line{
+                        profile.functionId(
+                                d_strings->get(frame.function_name),
+                                d_strings->get(frame.filename)),
+                        frame.lineno};
+                it = python_locations.emplace(frame_id, profile.locationId(0, {line})).first;
+            }
+            return it->second;
+        };
+
+        // The frames inlined at an instruction are split around the calls to
+        // the eval loop, which make way for Python frames in hybrid stacks.
+        struct NativePiece
+        {
+            PprofProfile::id_t location_id;
+            bool is_eval_frame;
+        };
+        std::map<std::pair<uintptr_t, size_t>, std::vector<NativePiece>> native_pieces;
+        auto nativePieces = [&](uintptr_t ip, size_t generation) -> const std::vector<NativePiece>& {
+            auto [it, inserted] = native_pieces.try_emplace({ip, generation});
+            if (!inserted) {
+                return it->second;
+            }
+            auto resolved_frames = d_symbol_resolver.resolve(ip, generation);
+            if (!resolved_frames) {
+                return it->second;
+            }
+            std::vector<PprofProfile::line_t> lines;
+            for (const auto& native_frame : resolved_frames->frames()) {
+                const PprofProfile::line_t line{
+                        profile.functionId(native_frame.Symbol(), native_frame.File()),
+                        native_frame.Line()};
+                if (!native_frame.IsEvalFrame()) {
+                    lines.push_back(line);
+                    continue;
+                }
+                if (!lines.empty()) {
+                    it->second.push_back(NativePiece{profile.locationId(ip, lines), false});
+                    lines.clear();
+                }
+                it->second.push_back(NativePiece{profile.locationId(ip, {line}), true});
+            }
+            if (!lines.empty()) {
+                it->second.push_back(NativePiece{profile.locationId(ip, lines), false});
+            }
+            return it->second;
+        };
+
+        std::unordered_map<thread_id_t, std::string> thread_labels;
+        auto threadLabel = [&](thread_id_t tid) -> const std::string& {
+            auto [it, inserted] = thread_labels.try_emplace(tid);
+            if (inserted) {
+                // The same names as the thread_name of the Python records.
+                if (static_cast<long>(tid) == -1) {
+                    it->second = "merged thread";
+                } else {
+                    char thread_id[32];
+                    snprintf(thread_id, sizeof(thread_id), "%#lx", static_cast<long>(tid));
+                    it->second = thread_id;
+                    auto name_it = d_thread_names.find(tid);
+                    if (name_it != d_thread_names.end() && !name_it->second.empty()) {
+                        it->second += " (" + name_it->second + ")";
+                    }
+                }
+            }
+            return it->second;
+        };
+
+        std::vector<frame_id_t> python_stack;
+        std::vector<unsigned char> is_entry_frame;
+        std::vector<NativePiece> native_stack;
+        std::vector<PprofProfile::id_t> stack;
+        for (const auto& allocation : allocations) {
+            python_stack.clear();
+            is_entry_frame.clear();
+            FrameTree::index_t current_index = allocation.frame_index;
+            while (current_index != 0) {
+                auto [frame_id, next_index] = d_tree.nextNode(current_index);
+                python_stack.push_back(frame_id);
+                is_entry_frame.push_back(d_frame_map.at(frame_id).is_entry_frame);
+                current_index = next_index;
+            }
+            const size_t to_skip =
+                    allocation.tid == d_header.main_tid ? d_header.skipped_frames_on_main_tid : 0;
+
+            stack.clear();
+            if (!native_traces) {
+                const size_t n_kept =
+                        python_stack.size() > to_skip ? python_stack.size() - to_skip : 0;
+                for (size_t i = 0; i < n_kept; ++i) {
+                    stack.push_back(pythonLocation(python_stack[i]));
+                }
+                profile.addSample(
+                        stack,
+                        allocation.n_allocations,
+                        allocation.size,
+                        threadLabel(allocation.tid));
+                continue;
+            }
+
+            native_stack.clear();
+            current_index = allocation.native_frame_id;
+            while (current_index != 0) {
+                const auto& frame = d_native_frames[current_index - 1];
+                const auto& pieces = nativePieces(frame.ip, allocation.native_segment_generation);
+                native_stack.insert(native_stack.end(), pieces.begin(), pieces.end());
+                current_index = frame.index;
+            }
+
+            // Pair the calls to the eval loop with the Python frames they
+            // evaluate from the outermost inwards, as hybrid_stack_trace()
+            // does. The stack is built outermost first and reversed after.
+            ssize_t pidx = static_cast<ssize_t>(python_stack.size()) - 1;
+            const ssize_t first_kept_frame = pidx - static_cast<ssize_t>(to_skip);
+            for (auto it = native_stack.rbegin(); it != native_stack.rend(); ++it) {
+                if (pidx < 0 || !it->is_eval_frame) {
+                    stack.push_back(it->location_id);
+                    continue;
+                }
+                while (true) {
+                    if (to_skip != 0 && pidx == first_kept_frame) {
+                        stack.clear();
+                    }
+                    stack.push_back(pythonLocation(python_stack[pidx]));
+                    --pidx;
+                    if (pidx < 0 || is_entry_frame[pidx]) {
+                        break;
+                    }
+                }
+            }
+            if (pidx >= 0) {
+                // Unwinding missed some calls to the eval loop.
+                const PprofProfile::line_t line{profile.functionId("<unknown stack>", "<unknown>"), 0};
+                stack.assign({profile.locationId(0, {line})});
+            }
+            std::reverse(stack.begin(), stack.end());
+            profile.addSample(
+                    stack,
+                    allocation.n_allocations,
+                    allocation.size,
+                    threadLabel(allocation.tid));
+        }
+        encoded = profile.serialize(time_nanos, duration_nanos);
+    }
+    Py_END_ALLOW_THREADS;
+    return PyBytes_FromStringAndSize(encoded.data(), encoded.size());
+}
+
+void
+RecordReader::resolveNativeStacks(const std::vector<std::pair<size_t, size_t>>& native_stacks)
+{
+    if (!d_track_stacks) {
+        return;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+
+        // Stacks share most of their frames, so stop walking one as soon as
+        // it reaches a frame that was already seen for the same generation.
+        std::vector<size_t> seen_in_generation(d_native_frames.size(), 0);
+        std::vector<std::pair<uintptr_t, size_t>> ips;
+        for (const auto& [index, generation] : native_stacks) {
+            FrameTree::index_t current_index = index;
+            while (current_index != 0 && seen_in_generation[current_index - 1] != generation + 1) {
+                seen_in_generation[current_index - 1] = generation + 1;
+                const auto& frame = d_native_frames[current_index - 1];
+                ips.emplace_back(frame.ip, generation);
+                current_index = frame.index;
+            }
+        }
+        d_symbol_resolver.resolveBatch(ips);
+    }
+    Py_END_ALLOW_THREADS;
 }
 
 std::optional<frame_id_t>
@@ -678,18 +2482,84 @@ RecordReader::getThreadName(thread_id_t tid)
     return "";
 }
 
+void
+AllocationColumns::reserve(size_t n_records)
+{
+    tid.reserve(n_records);
+    address.reserve(n_records);
+    size.reserve(n_records);
+    allocator.reserve(n_records);
+    stack_id.reserve(n_records);
+    n_allocations.reserve(n_records);
+}
+
+void
+AllocationColumns::append(const Allocation& allocation)
+{
+    tid.push_back(allocation.tid);
+    address.push_back(allocation.address);
+    size.push_back(allocation.size);
+    allocator.push_back(static_cast<uint8_t>(allocation.allocator));
+    stack_id.push_back(allocation.frame_index);
+    n_allocations.push_back(allocation.n_allocations);
+}
+
+size_t
+AllocationColumns::length() const noexcept
+{
+    return tid.size();
+}
+
+RecordReader::RecordResult
+RecordReader::readAllocationColumns(AllocationColumns* columns, size_t max_records)
+{
+    // Don't trust a huge batch size to fit in memory before it's needed.
+    columns->reserve(columns->length() + std::min<size_t>(max_records, 1 << 20));
+    RecordResult ret = RecordResult::ALLOCATION_RECORD;
+    while (columns->length() < max_records) {
+        ret = nextRecord();
+        if (ret == RecordResult::ALLOCATION_RECORD) {
+            columns->append(d_latest_allocation);
+        } else if (
+                ret != RecordResult::MEMORY_RECORD
+                && ret != RecordResult::FILTERED_ALLOCATION_RECORD)
+        {
+            break;
+        }
+    }
+    return ret;
+}
+
 Allocation
 RecordReader::getLatestAllocation() const noexcept
 {
     return d_latest_allocation;
 }
 
+AggregatedAllocation
+RecordReader::getLatestAggregatedAllocation() const noexcept
+{
+    return d_latest_aggregated_allocation;
+}
+
+const ProfileInterval&
+RecordReader::getLatestProfileInterval() const noexcept
+{
+    return d_latest_profile_interval;
+}
+
 MemoryRecord
 RecordReader::getLatestMemoryRecord() const noexcept
 {
     return d_latest_memory_record;
 }
 
+FilteredAllocationTotals
+RecordReader::getFilteredAllocationTotals() const noexcept
+{
+    return d_filtered_allocation_totals;
+}
+
 PyObject*
 RecordReader::dumpAllRecords()
 {
@@ -711,7 +2581,9 @@ RecordReader::dumpAllRecords()
     printf("HEADER magic=%.*s version=%d native_traces=%s"
            " n_allocations=%zd n_frames=%zd start_time=%lld end_time=%lld"
            " pid=%d main_tid=%lu skipped_frames_on_main_tid=%zd"
-           " command_line=%s python_allocator=%s\n",
+           " command_line=%s python_allocator=%s sampling_interval=%zd file_format=%s"
+           " min_allocation_size=%zd summary_offset=%" PRIu64 " parent_file=%s parent_offset=%" PRIu64
+           "\n",
            (int)sizeof(d_header.magic),
            d_header.magic,
            d_header.version,
@@ -724,15 +2596,24 @@ RecordReader::dumpAllRecords()
            d_header.main_tid,
            d_header.skipped_frames_on_main_tid,
            d_header.command_line.c_str(),
-           python_allocator.c_str());
-
+           python_allocator.c_str(),
+           d_header.sampling_interval,
+           d_header.file_format == FILE_FORMAT_AGGREGATED_ALLOCATIONS ? "aggregated" : "all",
+           d_header.min_allocation_size,
+           d_header.summary_offset,
+           d_header.parent_file.c_str(),
+           d_header.parent_offset);
+
+    // Trackers that intern Python stacks write the tree a node at a time. A
+    // child's nodes come after the ones read from its parent's capture.
+    FrameTree::index_t n_python_stack_nodes = d_tree.size() - 1;
     while (true) {
         if (0 != PyErr_CheckSignals()) {
             return nullptr;
         }
 
         RecordTypeAndFlags record_type_and_flags;
-        if (!d_input->read(
+        if (!readBytes(
                     reinterpret_cast<char*>(&record_type_and_flags),
                     sizeof(record_type_and_flags))) {
             Py_RETURN_NONE;
@@ -745,6 +2626,201 @@ RecordReader::dumpAllRecords()
                         printf("TRAILER\n");
                         Py_RETURN_NONE;  // Treat as EOF
                     } break;
+                    case OtherRecordType::THREAD_BUFFER: {
+                        printf("THREAD_BUFFER ");
+
+                        ThreadBufferHeader header;
+                        std::vector<BufferedRecord> records;
+                        if (!parseThreadBuffer(&header, &records)) {
+                            Py_RETURN_NONE;
+                        }
+
+                        printf("tid=%lu watermark=%" PRIu64 " n_records=%zd\n",
+                               header.tid,
+                               header.watermark,
+                               header.n_records);
+                        for (const auto& record : records) {
+                            printf("  seq=%" PRIu64 " ", record.sequence);
+                            switch (record.token.record_type) {
+                                case RecordType::ALLOCATION:
+                                case RecordType::ALLOCATION_WITH_NATIVE: {
+                                    const char* allocator = allocatorName(record.allocation.allocator);
+                                    printf("%s address=%p size=%zd allocator=%s native_frame_id=%zd\n",
+                                           record.token.record_type == RecordType::ALLOCATION
+                                                   ? "ALLOCATION"
+                                                   : "ALLOCATION_WITH_NATIVE",
+                                           (void*)record.allocation.address,
+                                           record.allocation.size,
+                                           allocator ? allocator : "<unknown allocator>",
+                                           record.allocation.native_frame_id);
+                                } break;
+                                case RecordType::FRAME_PUSH: {
+                                    printf("FRAME_PUSH frame_id=%zd\n", record.frame_push.frame_id);
+                                } break;
+                                case RecordType::FRAME_POP: {
+                                    printf("FRAME_POP count=%zd\n", record.frame_pop.count);
+                                } break;
+                                default: {
+                                    printf("THREAD %s\n", record.thread_name.c_str());
+                                } break;
+                            }
+                        }
+                    } break;
+                    case OtherRecordType::ALLOCATION_BLOCK: {
+                        printf("ALLOCATION_BLOCK ");
+
+                        std::vector<BufferedRecord> records;
+                        if (!parseAllocationBlock(&records)) {
+                            Py_RETURN_NONE;
+                        }
+                        printf("n_records=%zd\n", records.size());
+                        for (const auto& record : records) {
+                            const RecordType record_type = record.token.record_type;
+                            const char* allocator = allocatorName(record.allocation.allocator);
+                            printf("  %s address=%p size=%zd allocator=%s",
+                                   record_type == RecordType::ALLOCATION ? "ALLOCATION"
+                                   : record_type == RecordType::ALLOCATION_WITH_NATIVE
+                                           ? "ALLOCATION_WITH_NATIVE"
+                                           : "ALLOCATION_WITH_PYTHON_STACK",
+                                   (void*)record.allocation.address,
+                                   record.allocation.size,
+                                   allocator ? allocator : "<unknown allocator>");
+                            if (record_type == RecordType::ALLOCATION_WITH_PYTHON_STACK) {
+                                printf(" python_stack_index=%zd", record.python_stack_index);
+                            }
+                            if (record_type != RecordType::ALLOCATION) {
+                                printf(" native_frame_id=%zd", record.allocation.native_frame_id);
+                            }
+                            printf("\n");
+                        }
+                    } break;
+                    case OtherRecordType::REPEATED_ALLOCATIONS: {
+                        printf("REPEATED_ALLOCATIONS ");
+
+                        size_t n_repeats;
+                        if (!parseRepeatedAllocations(&n_repeats)) {
+                            Py_RETURN_NONE;
+                        }
+                        printf("n_repeats=%zd\n", n_repeats);
+                    } break;
+                    case OtherRecordType::CHUNK_START: {
+                        printf("CHUNK_START ");
+
+                        ChunkStart entry;
+                        if (!parseChunkStart(&entry) || !processChunkStart(entry)) {
+                            Py_RETURN_NONE;
+                        }
+                        printf("n_allocations=%zd time=%lld\n", entry.n_allocations, entry.ms_since_epoch);
+                    } break;
+                    case OtherRecordType::FILTERED_ALLOCATIONS: {
+                        printf("FILTERED_ALLOCATIONS ");
+
+                        FilteredAllocationTotals totals;
+                        if (!parseFilteredAllocationTotals(&totals)) {
+                            Py_RETURN_NONE;
+                        }
+                        printf("n_allocations=%zd bytes=%zd\n", totals.n_allocations, totals.bytes);
+                    } break;
+                    case OtherRecordType::TRACKER_METRICS: {
+                        printf("TRACKER_METRICS ");
+
+                        TrackerMetrics metrics;
+                        if (!parseTrackerMetrics(&metrics)) {
+                            Py_RETURN_NONE;
+                        }
+                        printf("n_tracked_allocations=%zd allocation_ns=%zd"
+                               " n_tracked_deallocations=%zd deallocation_ns=%zd"
+                               " n_unwinds=%zd unwind_ns=%zd n_records_written=%zd"
+                               " bytes_written=%zd n_lock_waits=%zd lock_wait_ns=%zd"
+                               " n_flushes=%zd flush_ns=%zd max_flush_ns=%zd\n",
+                               metrics.n_tracked_allocations,
+                               metrics.allocation_ns,
+                               metrics.n_tracked_deallocations,
+                               metrics.deallocation_ns,
+                               metrics.n_unwinds,
+                               metrics.unwind_ns,
+                               metrics.n_records_written,
+                               metrics.bytes_written,
+                               metrics.n_lock_waits,
+                               metrics.lock_wait_ns,
+                               metrics.n_flushes,
+                               metrics.flush_ns,
+                               metrics.max_flush_ns);
+                    } break;
+                    case OtherRecordType::CAPTURE_SUMMARY: {
+                        printf("CAPTURE_SUMMARY ");
+
+                        CaptureSummary summary;
+                        if (!parseCaptureSummary(&summary)) {
+                            Py_RETURN_NONE;
+                        }
+                        printf("n_allocations=%zd peak_index=%zd peak_memory=%zd"
+                               " n_memory_snapshots=%zd\n",
+                               summary.n_allocations,
+                               summary.peak_index,
+                               summary.peak_memory,
+                               summary.memory_snapshots.size());
+                    } break;
+                    case OtherRecordType::PYTHON_STACK_TREE: {
+                        printf("PYTHON_STACK_TREE ");
+
+                        std::vector<std::pair<frame_id_t, FrameTree::index_t>> nodes;
+                        if (!parsePythonStackTree(&nodes)) {
+                            Py_RETURN_NONE;
+                        }
+                        printf("n_nodes=%zd\n", nodes.size());
+                        for (const auto& [frame_id, parent_index] : nodes) {
+                            printf("  index=%u frame_id=%zd parent=%u\n",
+                                   ++n_python_stack_nodes,
+                                   frame_id,
+                                   parent_index);
+                        }
+                    } break;
+                    case OtherRecordType::PROFILE_INTERVAL: {
+                        printf("PROFILE_INTERVAL ");
+
+                        ProfileInterval interval;
+                        if (!parseProfileInterval(&interval)) {
+                            Py_RETURN_NONE;
+                        }
+                        printf("ms_since_epoch=%" PRIu64 " n_entries=%zd\n",
+                               interval.ms_since_epoch,
+                               interval.entries.size());
+                        for (const auto& entry : interval.entries) {
+                            const char* allocator = allocatorName(entry.allocator);
+                            std::string unknownAllocator;
+                            if (!allocator) {
+                                unknownAllocator = "<unknown allocator "
+                                                   + std::to_string((int)entry.allocator) + ">";
+                                allocator = unknownAllocator.c_str();
+                            }
+                            printf("  tid=%lu allocator=%s frame_index=%zd native_frame_id=%zd"
+                                   " n_allocated=%zd bytes_allocated=%zd n_freed=%zd"
+                                   " bytes_freed=%zd n_live=%zd bytes_live=%zd\n",
+                                   entry.tid,
+                                   allocator,
+                                   entry.frame_index,
+                                   entry.native_frame_id,
+                                   entry.n_allocated,
+                                   entry.bytes_allocated,
+                                   entry.n_freed,
+                                   entry.bytes_freed,
+                                   entry.n_live,
+                                   entry.bytes_live);
+                        }
+                    } break;
+                    case OtherRecordType::SAMPLING_INTERVAL: {
+                        printf("SAMPLING_INTERVAL ");
+
+                        size_t sampling_interval;
+                        uint64_t sequence;
+                        if (!parseSamplingInterval(&sampling_interval, &sequence)) {
+                            Py_RETURN_NONE;
+                        }
+                        printf("sampling_interval=%zd sequence=%" PRIu64 "\n",
+                               sampling_interval,
+                               sequence);
+                    } break;
                     default: {
                         printf("UNKNOWN OTHER RECORD TYPE %d\n", (int)record_type_and_flags.flags);
                         Py_RETURN_NONE;
@@ -774,6 +2850,31 @@ RecordReader::dumpAllRecords()
                        allocator,
                        record.native_frame_id);
             } break;
+            case RecordType::ALLOCATION_WITH_PYTHON_STACK: {
+                printf("ALLOCATION_WITH_PYTHON_STACK ");
+
+                PythonStackAllocationRecord record;
+                if (!parsePythonStackAllocationRecord(&record, record_type_and_flags.flags)) {
+                    Py_RETURN_NONE;
+                }
+
+                const char* allocator = allocatorName(record.allocator);
+
+                std::string unknownAllocator;
+                if (!allocator) {
+                    unknownAllocator =
+                            "<unknown allocator " + std::to_string((int)record.allocator) + ">";
+                    allocator = unknownAllocator.c_str();
+                }
+
+                printf("address=%p size=%zd allocator=%s python_stack_index=%zd"
+                       " native_frame_id=%zd\n",
+                       (void*)record.address,
+                       record.size,
+                       allocator,
+                       record.python_stack_index,
+                       record.native_frame_id);
+            } break;
             case RecordType::ALLOCATION: {
                 printf("ALLOCATION ");
 
@@ -795,6 +2896,34 @@ RecordReader::dumpAllRecords()
                        record.size,
                        allocator);
             } break;
+            case RecordType::AGGREGATED_ALLOCATION: {
+                printf("AGGREGATED_ALLOCATION ");
+
+                AggregatedAllocation record;
+                if (!parseAggregatedAllocationRecord(&record, record_type_and_flags.flags)) {
+                    Py_RETURN_NONE;
+                }
+
+                const char* allocator = allocatorName(record.allocator);
+
+                std::string unknownAllocator;
+                if (!allocator) {
+                    unknownAllocator =
+                            "<unknown allocator " + std::to_string((int)record.allocator) + ">";
+                    allocator = unknownAllocator.c_str();
+                }
+                printf("tid=%lu allocator=%s frame_index=%zd native_frame_id=%zd"
+                       " n_allocations_in_high_water_mark=%zd bytes_in_high_water_mark=%zd"
+                       " n_allocations_leaked=%zd bytes_leaked=%zd\n",
+                       record.tid,
+                       allocator,
+                       record.frame_index,
+                       record.native_frame_id,
+                       record.n_allocations_in_high_water_mark,
+                       record.bytes_in_high_water_mark,
+                       record.n_allocations_leaked,
+                       record.bytes_leaked);
+            } break;
             case RecordType::FRAME_PUSH: {
                 printf("FRAME_PUSH ");
 
@@ -825,8 +2954,8 @@ RecordReader::dumpAllRecords()
 
                 printf("frame_id=%zd function_name=%s filename=%s lineno=%d is_entry_frame=%d\n",
                        record.first,
-                       record.second.function_name.c_str(),
-                       record.second.filename.c_str(),
+                       d_strings->c_str(record.second.function_name),
+                       d_strings->c_str(record.second.filename),
                        record.second.lineno,
                        record.second.is_entry_frame);
             } break;
@@ -841,10 +2970,11 @@ RecordReader::dumpAllRecords()
                 printf("ip=%p index=%zu\n", (void*)record.ip, record.index);
             } break;
             case RecordType::MEMORY_MAP_START: {
-                printf("MEMORY_MAP_START\n");
-                if (!parseMemoryMapStart()) {
+                MemoryMapStart record;
+                if (!parseMemoryMapStart(&record, record_type_and_flags.flags)) {
                     Py_RETURN_NONE;
                 }
+                printf("MEMORY_MAP_START incremental=%s\n", record.incremental ? "true" : "false");
             } break;
             case RecordType::SEGMENT_HEADER: {
                 printf("SEGMENT_HEADER ");
@@ -852,14 +2982,20 @@ RecordReader::dumpAllRecords()
                 std::string filename;
                 size_t num_segments;
                 uintptr_t addr;
-                if (!parseSegmentHeader(&filename, &num_segments, &addr)) {
-                    Py_RETURN_NONE;
+                if (record_type_and_flags.flags == SEGMENT_HEADER_UNLOADED) {
+                    if (!parseUnloadedModule(&filename, &addr)) {
+                        Py_RETURN_NONE;
+                    }
+                    printf("unloaded filename=%s addr=%p\n", filename.c_str(), (void*)addr);
+                } else {
+                    if (!parseSegmentHeader(&filename, &num_segments, &addr)) {
+                        Py_RETURN_NONE;
+                    }
+                    printf("filename=%s num_segments=%zd addr=%p\n",
+                           filename.c_str(),
+                           num_segments,
+                           (void*)addr);
                 }
-
-                printf("filename=%s num_segments=%zd addr=%p\n",
-                       filename.c_str(),
-                       num_segments,
-                       (void*)addr);
             } break;
             case RecordType::SEGMENT: {
                 printf("SEGMENT ");
@@ -885,17 +3021,29 @@ RecordReader::dumpAllRecords()
                 printf("MEMORY_RECORD ");
 
                 MemoryRecord record;
-                if (!parseMemoryRecord(&record)) {
+                if (!parseMemoryRecord(&record, record_type_and_flags.flags)) {
                     Py_RETURN_NONE;
                 }
 
-                printf("time=%ld memory=%" PRIxPTR "\n", record.ms_since_epoch, record.rss);
+                printf("time=%ld memory=%" PRIxPTR, record.ms_since_epoch, record.rss);
+                if (record.has_counters) {
+                    const MemoryCounters& counters = record.counters;
+                    printf(" pss=%zd uss=%zd swap=%zd cgroup_usage=%zd"
+                           " minor_faults=%zd major_faults=%zd",
+                           counters.pss,
+                           counters.uss,
+                           counters.swap,
+                           counters.cgroup_usage,
+                           counters.minor_faults,
+                           counters.major_faults);
+                }
+                printf("\n");
             } break;
             case RecordType::CONTEXT_SWITCH: {
                 printf("CONTEXT_SWITCH ");
 
                 thread_id_t tid;
-                if (!parseContextSwitch(&tid)) {
+                if (!parseContextSwitch(&tid, record_type_and_flags.flags)) {
                     Py_RETURN_NONE;
                 }
 
@@ -9,9 +9,11 @@
 #include <limits>
 #include <memory>
 #include <optional>
+#include <queue>
 #include <stddef.h>
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -19,7 +21,9 @@
 #include "native_resolver.h"
 #include "python_helpers.h"
 #include "records.h"
+#include "snapshot.h"
 #include "source.h"
+#include "string_interner.h"
 
 namespace memray::api {
 
@@ -27,16 +31,63 @@ using namespace tracking_api;
 
 using allocations_t = std::vector<Allocation>;
 
+// Allocation records stored as one contiguous array per field, so that many
+// of them can be handed out without building an object for each one. The
+// stack id is the index of the record's Python stack in the reader's frame
+// tree: records with the same id have the same stack.
+struct AllocationColumns
+{
+    std::vector<uint64_t> tid;
+    std::vector<uint64_t> address;
+    std::vector<uint64_t> size;
+    std::vector<uint8_t> allocator;
+    std::vector<uint64_t> stack_id;
+    std::vector<uint64_t> n_allocations;
+
+    void reserve(size_t n_records);
+    void append(const Allocation& allocation);
+    size_t length() const noexcept;
+};
+
+// The allocations that a reader with a filter returns as allocation records:
+// the ones that pass every check. The others are returned as filtered
+// allocation records, while deallocations always pass, since they may free
+// allocations that did. An allocation's time is that of the latest memory
+// record before it, or the start of the tracking if there is none.
+struct AllocationFilter
+{
+    bool has_tid{false};
+    thread_id_t tid{0};
+    size_t min_size{0};
+    size_t max_size{std::numeric_limits<size_t>::max()};
+    millis_t start_time{std::numeric_limits<millis_t>::min()};
+    millis_t end_time{std::numeric_limits<millis_t>::max()};
+    // If not empty, a Python frame of the allocation's stack must be in a
+    // file whose name contains this.
+    std::string filename{};
+};
+
 class RecordReader
 {
   public:
     enum class RecordResult {
         ALLOCATION_RECORD,
+        AGGREGATED_ALLOCATION_RECORD,
         MEMORY_RECORD,
+        FILTERED_ALLOCATION_RECORD,
+        PROFILE_INTERVAL,
         ERROR,
         END_OF_FILE,
     };
-    explicit RecordReader(std::unique_ptr<memray::io::Source> source, bool track_stacks = true);
+    // Unless ``expand_repeated_allocations`` is false, every allocation the
+    // tracker wrote as a repeat of the one before it is read as a record of
+    // its own. Otherwise the whole run is read as a single allocation record
+    // whose ``n_repeats`` says how many times it and its deallocation repeat.
+    explicit RecordReader(
+            std::unique_ptr<memray::io::Source> source,
+            bool track_stacks = true,
+            bool expand_repeated_allocations = true);
+    ~RecordReader();
     void close() noexcept;
     bool isOpen() const noexcept;
     PyObject*
@@ -49,51 +100,213 @@ class RecordReader
             FrameTree::index_t index,
             size_t generation,
             size_t max_stacks = std::numeric_limits<size_t>::max());
+    // Merge the Python stack at ``index`` and the native stack at
+    // ``native_index`` into a hybrid one, where the Python frames take the
+    // place of the calls to the eval loop that evaluated them. Frames above
+    // the one that started tracking are left out on the main thread, and the
+    // stack is a single "<unknown stack>" frame if the two can't be paired.
+    PyObject* Py_GetHybridStackFrame(
+            FrameTree::index_t index,
+            FrameTree::index_t native_index,
+            size_t generation,
+            thread_id_t tid,
+            size_t max_stacks = std::numeric_limits<size_t>::max());
+    // Aggregate allocations by the (function, file) location of every Python
+    // frame in their stacks, the way the TUI's aggregate_allocations() does,
+    // and return a dict mapping each location to a tuple of its own memory,
+    // total memory, allocation count and set of thread ids.
+    PyObject*
+    Py_AggregateByLocation(const std::vector<Allocation>& allocations, double memory_threshold);
+    // Build the nodes of a flame graph of the Python stacks of the given
+    // allocations. ``frame_flags`` is called once with each distinct
+    // (function, file, lineno) tuple and must return a tuple of two bools
+    // telling whether the frame is hidden and whether it belongs to the import
+    // system. Returns a tuple of the list of distinct frames and the list of
+    // (frame index, thread id, parent index, size, n_allocations, import
+    // system, too deep) nodes, where node 0 is the root and every node comes
+    // after its parent.
+    PyObject* Py_BuildFlameGraph(
+            const std::vector<Allocation>& allocations,
+            PyObject* frame_flags,
+            size_t max_depth);
+    // Add the Python stacks of the given allocations to one side of a diff
+    // between two snapshots, which may come from another capture. Threads
+    // are merged, since thread ids can't be matched across captures.
+    void addToSnapshotDiff(
+            const std::vector<Allocation>& allocations,
+            SnapshotDiff::Side side,
+            SnapshotDiff* diff);
+    // Encode the given allocations as a heap profile in the protocol buffer
+    // format that pprof reads, with a sample for every allocation and sample
+    // types named after ``sample_kind`` (see PprofProfile). The stacks are
+    // the hybrid ones if ``native_traces`` is set, and the Python ones if not.
+    PyObject* Py_EncodePprofProfile(
+            const std::vector<Allocation>& allocations,
+            bool native_traces,
+            const std::string& sample_kind,
+            long long time_nanos,
+            long long duration_nanos);
+    // Resolve every native frame in the given (native frame id, segment
+    // generation) stacks in one go, so that Py_GetNativeStackFrame() finds
+    // them already resolved.
+    void resolveNativeStacks(const std::vector<std::pair<size_t, size_t>>& native_stacks);
     std::optional<frame_id_t> getLatestPythonFrameId(const Allocation& allocation) const;
     PyObject* Py_GetFrame(std::optional<frame_id_t> frame);
 
+    // Only report the allocations that pass ``filter`` from now on. This
+    // must be called before any record is read, since the stacks of the
+    // threads filtered out aren't followed.
+    void setAllocationFilter(const AllocationFilter& filter);
+    // Stop at every profile interval written by the tracker, returning
+    // PROFILE_INTERVAL, instead of skipping over them.
+    void setReportProfileIntervals(bool report);
+    // Resolve native frames to function names only, without loading any
+    // debug information. This must be called before any record is read.
+    void setNativeSymbolsOnly(bool symbols_only);
     RecordResult nextRecord();
+    // Read allocation records into ``columns`` until it holds ``max_records``
+    // of them, skipping every other kind of record. Returns the result of the
+    // last record read, which is ALLOCATION_RECORD if the columns are full
+    // and more records may follow.
+    RecordResult readAllocationColumns(AllocationColumns* columns, size_t max_records);
     HeaderRecord getHeader() const noexcept;
     thread_id_t getMainThreadTid() const noexcept;
     size_t getSkippedFramesOnMainThread() const noexcept;
     PyObject* dumpAllRecords();
     std::string getThreadName(thread_id_t tid);
     Allocation getLatestAllocation() const noexcept;
+    AggregatedAllocation getLatestAggregatedAllocation() const noexcept;
+    const ProfileInterval& getLatestProfileInterval() const noexcept;
     MemoryRecord getLatestMemoryRecord() const noexcept;
+    FilteredAllocationTotals getFilteredAllocationTotals() const noexcept;
+    // Read the summary written by the tracker, skipping every record before
+    // it. This must be called before any record is read, and returns false if
+    // the capture has no summary (e.g. because the tracker was killed).
+    bool readCaptureSummary(CaptureSummary* summary);
 
   private:
     // Aliases
     using stack_t = std::vector<FrameTree::index_t>;
     using stack_traces_t = std::unordered_map<thread_id_t, stack_t>;
 
+    // A record that was read ahead of being processed: either one that was
+    // written into a per-thread buffer, waiting to be processed in global
+    // sequence order, or one of the records of an allocation block.
+    struct BufferedRecord
+    {
+        uint64_t sequence;
+        size_t order;
+        thread_id_t tid;
+        RecordTypeAndFlags token;
+        NativeAllocationRecord allocation{};
+        size_t python_stack_index{0};
+        FramePush frame_push{};
+        FramePop frame_pop{};
+        std::string thread_name{};
+        size_t sampling_interval{0};
+
+        bool operator>(const BufferedRecord& other) const
+        {
+            return std::tie(sequence, order) > std::tie(other.sequence, other.order);
+        }
+    };
+    using buffered_records_t = std::
+            priority_queue<BufferedRecord, std::vector<BufferedRecord>, std::greater<BufferedRecord>>;
+
     // Private methods
     void readHeader(HeaderRecord& header);
+    void loadParentCapture();
     template<typename T>
     bool readVarint(T* val);
     bool readVarint(size_t* val);
     template<typename T>
     bool readSignedVarint(T* val);
     bool readSignedVarint(ssize_t* val);
+    bool readVarints(size_t* values, size_t n_values);
     template<typename T>
     bool readIntegralDelta(T* cache, T* new_val);
+    bool readBytes(char* result, size_t length);
+    bool readString(std::string* result);
 
     // Data members
     mutable std::mutex d_mutex;
     std::unique_ptr<memray::io::Source> d_input;
+    // Unread bytes of the input when it's held in memory, which lets the
+    // hot parsing routines skip the virtual calls and copies through d_input.
+    std::string_view* d_mapped_input;
     const bool d_track_stacks;
+    const bool d_expand_repeated_allocations;
     HeaderRecord d_header;
+    // The interval the allocations being read were sampled with, which the
+    // tracker may have changed since the header was written.
+    size_t d_sampling_interval{0};
+    // The strings of the frames, the native symbols and the memory maps.
+    std::shared_ptr<StringInterner> d_strings{std::make_shared<StringInterner>()};
     pyframe_map_t d_frame_map{};
     stack_traces_t d_stack_traces{};
     FrameTree d_tree{};
-    mutable python_helpers::PyUnicode_Cache d_pystring_cache{};
-    native_resolver::SymbolResolver d_symbol_resolver;
+    mutable python_helpers::PyUnicode_Cache d_pystring_cache{d_strings};
+    native_resolver::SymbolResolver d_symbol_resolver{d_strings};
     std::vector<UnresolvedNativeFrame> d_native_frames{};
     DeltaEncodedFields d_last;
+    ThreadDeltaStates d_thread_deltas;
     std::unordered_map<thread_id_t, std::string> d_thread_names;
     Allocation d_latest_allocation;
+    // The allocation before the latest one, and how many of the records of
+    // the run of repeats after them are still to be read, the allocation
+    // and its deallocation in turn.
+    Allocation d_previous_allocation;
+    Allocation d_repeated_deallocation;
+    size_t d_repeated_records_left{0};
+    AggregatedAllocation d_latest_aggregated_allocation{};
+    bool d_report_profile_intervals{false};
+    ProfileInterval d_latest_profile_interval{};
     MemoryRecord d_latest_memory_record{};
+    FilteredAllocationTotals d_filtered_allocation_totals{};
+    buffered_records_t d_buffered_records{};
+    uint64_t d_sequence_watermark{0};
+    size_t d_next_buffered_record_order{0};
+    bool d_input_exhausted{false};
+    std::vector<BufferedRecord> d_block_records{};
+    size_t d_next_block_record{0};
+    std::vector<size_t> d_block_column{};
+    std::optional<AllocationFilter> d_filter{};
+    // Whether each stack of the tree has a frame in the filter's file, if
+    // that's known yet.
+    enum class StackMatch : uint8_t { UNKNOWN, NO, YES };
+    std::vector<StackMatch> d_stack_matches{};
+    // The Python objects of the frames of the stacks handed out so far, which
+    // are reused by every stack they appear in: the frame of each node of the
+    // tree, and a tuple of the frames resolved at each native instruction.
+    struct PythonFrame
+    {
+        PyObject* frame{nullptr};
+        bool is_entry_frame{false};
+    };
+    struct NativeFrames
+    {
+        PyObject* frames{nullptr};
+        std::vector<unsigned char> is_eval_frame{};
+    };
+    struct NativeFramesKeyHash
+    {
+        size_t operator()(const std::pair<uintptr_t, size_t>& key) const noexcept
+        {
+            return std::hash<uintptr_t>{}(key.first) ^ (std::hash<size_t>{}(key.second) << 1);
+        }
+    };
+    std::vector<PythonFrame> d_python_frames{};
+    std::unordered_map<std::pair<uintptr_t, size_t>, NativeFrames, NativeFramesKeyHash>
+            d_native_frames_objects{};
 
     // Methods
+    RecordResult nextUnfilteredRecord();
+    bool passesFilter(const Allocation& allocation);
+    bool stackHasFilename(FrameTree::index_t index);
+    bool followsStacksOf(thread_id_t tid) const;
+    // These return borrowed references, or null with an exception set.
+    const PythonFrame* getPythonFrame(FrameTree::index_t index);
+    const NativeFrames* getNativeFrames(uintptr_t ip, size_t generation);
     [[nodiscard]] bool parseFramePush(FramePush* record);
     [[nodiscard]] bool processFramePush(const FramePush& record);
 
@@ -106,30 +319,75 @@ class RecordReader
     [[nodiscard]] bool parseNativeFrameIndex(UnresolvedNativeFrame* frame);
     [[nodiscard]] bool processNativeFrameIndex(const UnresolvedNativeFrame& frame);
 
+    [[nodiscard]] bool parseAllocator(hooks::Allocator* allocator, unsigned int flags);
     [[nodiscard]] bool parseAllocationRecord(AllocationRecord* record, unsigned int flags);
     [[nodiscard]] bool processAllocationRecord(const AllocationRecord& record);
 
     [[nodiscard]] bool parseNativeAllocationRecord(NativeAllocationRecord* record, unsigned int flags);
     [[nodiscard]] bool processNativeAllocationRecord(const NativeAllocationRecord& record);
 
-    [[nodiscard]] static bool parseMemoryMapStart();
-    [[nodiscard]] bool processMemoryMapStart();
+    [[nodiscard]] bool
+    parsePythonStackAllocationRecord(PythonStackAllocationRecord* record, unsigned int flags);
+    [[nodiscard]] bool processPythonStackAllocationRecord(const PythonStackAllocationRecord& record);
+
+    [[nodiscard]] static bool parseMemoryMapStart(MemoryMapStart* record, unsigned int flags);
+    [[nodiscard]] bool processMemoryMapStart(const MemoryMapStart& record);
 
     [[nodiscard]] bool parseSegmentHeader(std::string* filename, size_t* num_segments, uintptr_t* addr);
     [[nodiscard]] bool
     processSegmentHeader(const std::string& filename, size_t num_segments, uintptr_t addr);
 
+    [[nodiscard]] bool parseUnloadedModule(std::string* filename, uintptr_t* addr);
+    [[nodiscard]] bool processUnloadedModule(const std::string& filename, uintptr_t addr);
+
     [[nodiscard]] bool parseSegment(Segment* segment);
 
     [[nodiscard]] bool parseThreadRecord(std::string* name);
     [[nodiscard]] bool processThreadRecord(const std::string& name);
 
-    [[nodiscard]] bool parseMemoryRecord(MemoryRecord* record);
+    [[nodiscard]] bool parseMemoryRecord(MemoryRecord* record, unsigned int flags);
     [[nodiscard]] bool processMemoryRecord(const MemoryRecord& record);
 
-    [[nodiscard]] bool parseContextSwitch(thread_id_t* tid);
+    [[nodiscard]] bool parseFilteredAllocationTotals(FilteredAllocationTotals* totals);
+    [[nodiscard]] bool processFilteredAllocationTotals(const FilteredAllocationTotals& totals);
+    [[nodiscard]] bool parseTrackerMetrics(TrackerMetrics* metrics);
+    [[nodiscard]] bool processTrackerMetrics(const TrackerMetrics& metrics);
+    [[nodiscard]] bool parseSamplingInterval(size_t* sampling_interval, uint64_t* sequence);
+    [[nodiscard]] bool processSamplingInterval(size_t sampling_interval, uint64_t sequence);
+
+    [[nodiscard]] bool parseCaptureSummary(CaptureSummary* summary);
+
+    [[nodiscard]] bool parseContextSwitch(thread_id_t* tid, unsigned int flags);
     [[nodiscard]] bool processContextSwitch(thread_id_t tid);
 
+    [[nodiscard]] bool
+    parseThreadBuffer(ThreadBufferHeader* header, std::vector<BufferedRecord>* records);
+    [[nodiscard]] bool
+    processThreadBuffer(const ThreadBufferHeader& header, std::vector<BufferedRecord>& records);
+
+    [[nodiscard]] bool parseAllocationBlock(std::vector<BufferedRecord>* records);
+
+    [[nodiscard]] bool parseRepeatedAllocations(size_t* n_repeats);
+    [[nodiscard]] bool processRepeatedAllocations(size_t n_repeats);
+
+    [[nodiscard]] bool parseChunkStart(ChunkStart* entry);
+    [[nodiscard]] bool processChunkStart(const ChunkStart& entry);
+
+
+    [[nodiscard]] bool
+    parsePythonStackTree(std::vector<std::pair<frame_id_t, FrameTree::index_t>>* nodes);
+    [[nodiscard]] bool
+    processPythonStackTree(const std::vector<std::pair<frame_id_t, FrameTree::index_t>>& nodes);
+
+    [[nodiscard]] bool parseAggregatedAllocationRecord(AggregatedAllocation* record, unsigned int flags);
+    [[nodiscard]] bool processAggregatedAllocationRecord(const AggregatedAllocation& record);
+
+    [[nodiscard]] bool parseProfileInterval(ProfileInterval* interval);
+    [[nodiscard]] bool processProfileInterval(ProfileInterval&& interval);
+
+    [[nodiscard]] bool hasReadyBufferedRecord() const;
+    [[nodiscard]] bool processBufferedRecord(const BufferedRecord& record);
+
     size_t getAllocationFrameIndex(const AllocationRecord& record);
 };
 
@@ -1,27 +1,66 @@
+from _memray.records cimport AggregatedAllocation
 from _memray.records cimport Allocation
+from _memray.records cimport CaptureSummary
+from _memray.records cimport FilteredAllocationTotals
 from _memray.records cimport HeaderRecord
 from _memray.records cimport MemoryRecord
+from _memray.records cimport ProfileInterval
 from _memray.records cimport optional_frame_id_t
+from _memray.snapshot cimport SnapshotDiff
+from _memray.snapshot cimport SnapshotDiffSide
 from _memray.source cimport Source
+from libc.stdint cimport uint8_t
+from libc.stdint cimport uint64_t
 from libcpp cimport bool
 from libcpp.memory cimport unique_ptr
 from libcpp.string cimport string
+from libcpp.utility cimport pair
 from libcpp.vector cimport vector
 
 
 cdef extern from "record_reader.h" namespace "memray::api":
     cdef enum RecordResult 'memray::api::RecordReader::RecordResult':
         RecordResultAllocationRecord 'memray::api::RecordReader::RecordResult::ALLOCATION_RECORD'
+        RecordResultAggregatedAllocationRecord 'memray::api::RecordReader::RecordResult::AGGREGATED_ALLOCATION_RECORD'
         RecordResultMemoryRecord 'memray::api::RecordReader::RecordResult::MEMORY_RECORD'
+        RecordResultFilteredAllocationRecord 'memray::api::RecordReader::RecordResult::FILTERED_ALLOCATION_RECORD'
+        RecordResultProfileInterval 'memray::api::RecordReader::RecordResult::PROFILE_INTERVAL'
         RecordResultError 'memray::api::RecordReader::RecordResult::ERROR'
         RecordResultEndOfFile 'memray::api::RecordReader::RecordResult::END_OF_FILE'
 
+    cdef cppclass AllocationColumns:
+        vector[uint64_t] tid
+        vector[uint64_t] address
+        vector[uint64_t] size
+        vector[uint8_t] allocator
+        vector[uint64_t] stack_id
+        vector[uint64_t] n_allocations
+        size_t length()
+
+    cdef cppclass AllocationFilter:
+        bool has_tid
+        unsigned long tid
+        size_t min_size
+        size_t max_size
+        long long start_time
+        long long end_time
+        string filename
+
     cdef cppclass RecordReader:
         RecordReader(unique_ptr[Source]) except+
         RecordReader(unique_ptr[Source], bool track_stacks) except+
+        RecordReader(
+            unique_ptr[Source], bool track_stacks, bool expand_repeated_allocations
+        ) except+
         void close()
         bool isOpen() const
+        void setAllocationFilter(const AllocationFilter& filter)
+        void setReportProfileIntervals(bool report)
+        void setNativeSymbolsOnly(bool symbols_only)
         RecordResult nextRecord() except+
+        RecordResult readAllocationColumns(
+            AllocationColumns* columns, size_t max_records
+        ) except+
         object Py_GetStackFrame(unsigned int frame_id) except+
         object Py_GetStackFrame(unsigned int frame_id, size_t max_stacks) except+
         object Py_GetStackFrameAndEntryInfo(
@@ -32,6 +71,33 @@ cdef extern from "record_reader.h" namespace "memray::api":
         ) except+
         object Py_GetNativeStackFrame(int frame_id, size_t generation) except+
         object Py_GetNativeStackFrame(int frame_id, size_t generation, size_t max_stacks) except+
+        object Py_GetHybridStackFrame(
+            unsigned int frame_id, int native_frame_id, size_t generation, unsigned long tid
+        ) except+
+        object Py_GetHybridStackFrame(
+            unsigned int frame_id,
+            int native_frame_id,
+            size_t generation,
+            unsigned long tid,
+            size_t max_stacks,
+        ) except+
+        object Py_AggregateByLocation(
+            const vector[Allocation]& allocations, double memory_threshold
+        ) except+
+        object Py_BuildFlameGraph(
+            const vector[Allocation]& allocations, object frame_flags, size_t max_depth
+        ) except+
+        void addToSnapshotDiff(
+            const vector[Allocation]& allocations, SnapshotDiffSide side, SnapshotDiff* diff
+        ) except+
+        object Py_EncodePprofProfile(
+            const vector[Allocation]& allocations,
+            bool native_traces,
+            const string& sample_kind,
+            long long time_nanos,
+            long long duration_nanos,
+        ) except+
+        void resolveNativeStacks(const vector[pair[size_t, size_t]]& native_stacks) except+
         optional_frame_id_t getLatestPythonFrameId(const Allocation&) except+
         object Py_GetFrame(optional_frame_id_t frame) except+
         HeaderRecord getHeader()
@@ -40,4 +106,8 @@ cdef extern from "record_reader.h" namespace "memray::api":
         object dumpAllRecords() except+
         string getThreadName(long int tid) except+
         Allocation getLatestAllocation()
+        AggregatedAllocation getLatestAggregatedAllocation()
+        const ProfileInterval& getLatestProfileInterval()
         MemoryRecord getLatestMemoryRecord()
+        FilteredAllocationTotals getFilteredAllocationTotals()
+        bool readCaptureSummary(CaptureSummary* summary) except+
@@ -1,6 +1,10 @@
+#include <algorithm>
 #include <chrono>
+#include <deque>
 #include <fcntl.h>
+#include <limits>
 #include <stdexcept>
+#include <thread>
 
 #include "record_writer.h"
 
@@ -8,6 +12,353 @@ namespace memray::tracking_api {
 
 using namespace std::chrono;
 
+namespace {  // unnamed
+
+const uint64_t NO_PENDING_SEQUENCE = std::numeric_limits<uint64_t>::max();
+
+std::atomic<uint64_t> s_next_writer_id{1};
+
+}  // unnamed namespace
+
+// A block of records written by a single thread. The records are encoded
+// exactly like they would be in the main stream (with their own delta
+// encoding state), each one prefixed by the delta of its sequence number.
+struct RecordWriter::ThreadBufferChunk
+{
+    explicit ThreadBufferChunk(thread_id_t tid_)
+    : tid(tid_)
+    {
+    }
+
+    struct Cursor
+    {
+        size_t used{0};
+        size_t n_records{0};
+        size_t n_allocations{0};
+        uint64_t last_sequence{0};
+        DeltaEncodedFields last{};
+    };
+
+    bool write(const void* data, size_t length)
+    {
+        if (length > THREAD_BUFFER_SIZE - cursor.used) {
+            return false;
+        }
+        ::memcpy(buffer + cursor.used, data, length);
+        cursor.used += length;
+        return true;
+    }
+
+    template<typename T>
+    bool writeSimpleType(const T& item)
+    {
+        static_assert(
+                std::is_trivially_copyable<T>::value,
+                "writeSimpleType called on non trivially copyable type");
+        return write(&item, sizeof(item));
+    }
+
+    bool writeVarint(size_t rest)
+    {
+        unsigned char next_7_bits = rest & 0x7f;
+        rest >>= 7;
+        while (rest) {
+            next_7_bits |= 0x80;
+            if (!writeSimpleType(next_7_bits)) {
+                return false;
+            }
+            next_7_bits = rest & 0x7f;
+            rest >>= 7;
+        }
+        return writeSimpleType(next_7_bits);
+    }
+
+    template<typename T>
+    bool writeIntegralDelta(T* prev, T new_val)
+    {
+        ssize_t delta = new_val - *prev;
+        *prev = new_val;
+        size_t zigzag_val = (static_cast<size_t>(delta) << 1)
+                            ^ static_cast<size_t>(delta >> std::numeric_limits<ssize_t>::digits);
+        return writeVarint(zigzag_val);
+    }
+
+    bool writeToken(uint64_t sequence, RecordTypeAndFlags token)
+    {
+        cursor.n_records += 1;
+        uint64_t delta = sequence - cursor.last_sequence;
+        cursor.last_sequence = sequence;
+        return writeVarint(delta) && writeSimpleType(token);
+    }
+
+    bool encode(uint64_t sequence, const AllocationRecord& record)
+    {
+        cursor.n_allocations += 1;
+        RecordTypeAndFlags token{RecordType::ALLOCATION, allocatorFlags(record.allocator)};
+        return writeToken(sequence, token) && (token.flags || writeSimpleType(record.allocator))
+               && writeIntegralDelta(&cursor.last.data_pointer, record.address)
+               && (hooks::allocatorKind(record.allocator) == hooks::AllocatorKind::SIMPLE_DEALLOCATOR
+                   || writeVarint(record.size));
+    }
+
+    bool encode(uint64_t sequence, const NativeAllocationRecord& record)
+    {
+        cursor.n_allocations += 1;
+        RecordTypeAndFlags token{RecordType::ALLOCATION_WITH_NATIVE, allocatorFlags(record.allocator)};
+        return writeToken(sequence, token) && (token.flags || writeSimpleType(record.allocator))
+               && writeIntegralDelta(&cursor.last.data_pointer, record.address)
+               && writeVarint(record.size)
+               && writeIntegralDelta(&cursor.last.native_frame_id, record.native_frame_id);
+    }
+
+    bool encode(uint64_t sequence, const PythonStackAllocationRecord& record)
+    {
+        cursor.n_allocations += 1;
+        RecordTypeAndFlags token{
+                RecordType::ALLOCATION_WITH_PYTHON_STACK,
+                allocatorFlags(record.allocator)};
+        return writeToken(sequence, token) && (token.flags || writeSimpleType(record.allocator))
+               && writeIntegralDelta(&cursor.last.data_pointer, record.address)
+               && writeVarint(record.size)
+               && writeIntegralDelta(&cursor.last.python_stack_index, record.python_stack_index)
+               && writeIntegralDelta(&cursor.last.native_frame_id, record.native_frame_id);
+    }
+
+    bool encode(uint64_t sequence, const FramePush& record)
+    {
+        RecordTypeAndFlags token{RecordType::FRAME_PUSH, 0};
+        return writeToken(sequence, token)
+               && writeIntegralDelta(&cursor.last.python_frame_id, record.frame_id);
+    }
+
+    bool encode(uint64_t sequence, const FramePop& record)
+    {
+        // Like in the main stream, pops are batched 16 at a time. All the
+        // resulting records share a single sequence number.
+        size_t count = record.count;
+        while (count) {
+            uint8_t to_pop = (count > 16 ? 16 : count);
+            count -= to_pop;
+
+            to_pop -= 1;
+            if (!writeToken(sequence, RecordTypeAndFlags{RecordType::FRAME_POP, to_pop})) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool encode(uint64_t sequence, const ThreadRecord& record)
+    {
+        RecordTypeAndFlags token{RecordType::THREAD_RECORD, 0};
+        return writeToken(sequence, token) && write(record.name, strlen(record.name) + 1);
+    }
+
+    ThreadBufferChunk* next{nullptr};
+    const thread_id_t tid;
+    Cursor cursor{};
+    char buffer[THREAD_BUFFER_SIZE];
+};
+
+// The per-thread state. Only the owning thread writes records to it, but the
+// background thread can steal its partially filled chunk while the owning
+// thread is not in the middle of writing, so that the records of idle
+// threads don't get stuck forever. The `busy` flag arbitrates between the
+// two, and is uncontended unless a steal is happening.
+struct alignas(64) RecordWriter::ThreadBuffer
+{
+    void acquire()
+    {
+        while (busy.exchange(true, std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+
+    bool tryAcquire()
+    {
+        return !busy.exchange(true, std::memory_order_acquire);
+    }
+
+    void release()
+    {
+        busy.store(false, std::memory_order_release);
+    }
+
+    ThreadBuffer* next{nullptr};
+    std::atomic<bool> busy{false};
+    // Lower bound for the sequence numbers of the records in `chunk`.
+    std::atomic<uint64_t> first_pending_sequence{NO_PENDING_SEQUENCE};
+    ThreadBufferChunk* chunk{nullptr};
+};
+
+MEMRAY_FAST_TLS thread_local RecordWriter::ThreadBufferSlot RecordWriter::t_thread_buffer{};
+
+// What the writer keeps instead of the allocation records when writing the
+// aggregated format. Python stacks are interned in a tree of our own, which
+// is written out along with the totals so that the reader can rebuild it and
+// look up their frame indices. It stays empty if the tracker interns the
+// Python stacks itself.
+struct RecordWriter::AggregationState
+{
+    FrameTree python_stack_tree{};
+    std::unordered_map<thread_id_t, FrameTree::index_t> current_stack_by_thread{};
+    api::HighWatermarkAggregator aggregator{};
+    // The nodes of python_stack_tree that were already written out, which
+    // always includes its root.
+    FrameTree::index_t n_nodes_written{1};
+    // Only set when profile intervals are written (see
+    // writeProfileIntervalUnsafe).
+    uint64_t profile_interval_ms{0};
+    uint64_t last_profile_ms{0};
+};
+
+// The sink records are written to in flight recorder mode. The records that
+// others refer to (frames, stacks, thread names and memory maps) make up a
+// state that is only ever appended to, with a delta encoding of its own. All
+// other records go into a ring of segments, the oldest of which is dropped
+// when a new one is started and the ring is full. Every segment begins with a
+// chunk start record, after which nothing refers to the records before it, so
+// the state followed by the segments left in the ring is a valid capture.
+// What the writer keeps to work out the capture summary. The memory
+// snapshots are kept encoded exactly as they'll be written out, as there is
+// one of them for every memory record.
+struct RecordWriter::SummaryState
+{
+    size_t n_allocations{0};
+    api::HighWatermarkFinder finder{};
+    MemorySnapshot last_memory_snapshot{};
+    size_t n_memory_snapshots{0};
+    std::string memory_snapshots{};
+};
+
+class RecordWriter::FlightRecorder : public memray::io::Sink
+{
+  public:
+    struct RingSegment
+    {
+        ChunkStart entry;
+        std::string data;
+    };
+
+    explicit FlightRecorder(size_t capacity)
+    : d_segment_size(std::max<size_t>(capacity / FLIGHT_RECORDER_SEGMENTS, 4096))
+    {
+    }
+
+    bool writeAll(const char* data, size_t length) override
+    {
+        (d_writing_state ? d_state : d_segments.back().data).append(data, length);
+        return true;
+    }
+
+    bool seek(off_t, int) override
+    {
+        return false;
+    }
+
+    std::unique_ptr<memray::io::Sink> cloneInChildProcess() override
+    {
+        return {};
+    }
+
+    void startSegment(const ChunkStart& entry)
+    {
+        if (d_segments.size() < FLIGHT_RECORDER_SEGMENTS) {
+            d_segments.push_back(RingSegment{entry, {}});
+            d_segments.back().data.reserve(d_segment_size);
+            return;
+        }
+        // Reuse the oldest segment's memory, so that a full ring never
+        // allocates.
+        RingSegment oldest = std::move(d_segments.front());
+        d_segments.pop_front();
+        oldest.entry = entry;
+        oldest.data.clear();
+        d_segments.push_back(std::move(oldest));
+    }
+
+    size_t segmentSize() const
+    {
+        return d_segment_size;
+    }
+
+    const std::deque<RingSegment>& segments() const
+    {
+        return d_segments;
+    }
+
+    const std::string& state() const
+    {
+        return d_state;
+    }
+
+    void enterState(DeltaEncodedFields* last, ThreadDeltaStates* thread_deltas)
+    {
+        d_writing_state = true;
+        std::swap(*last, d_state_last);
+        std::swap(*thread_deltas, d_state_thread_deltas);
+    }
+
+    void leaveState(DeltaEncodedFields* last, ThreadDeltaStates* thread_deltas)
+    {
+        std::swap(*thread_deltas, d_state_thread_deltas);
+        std::swap(*last, d_state_last);
+        d_writing_state = false;
+    }
+
+  private:
+    const size_t d_segment_size;
+    std::deque<RingSegment> d_segments{};
+    std::string d_state{};
+    DeltaEncodedFields d_state_last{};
+    ThreadDeltaStates d_state_thread_deltas{};
+    bool d_writing_state{false};
+};
+
+// What a rotating writer keeps to start every new file with. The state
+// records are appended to a copy of the state as they are written, encoded
+// as if the copy had been written on its own right after a header, so that
+// the copy followed by a chunk start record is a valid start of a capture.
+struct RecordWriter::RotationState
+{
+    class StateCopy : public memray::io::Sink
+    {
+      public:
+        explicit StateCopy(std::string* data)
+        : d_data(data)
+        {
+        }
+
+        bool writeAll(const char* data, size_t length) override
+        {
+            d_data->append(data, length);
+            return true;
+        }
+
+        bool seek(off_t, int) override
+        {
+            return false;
+        }
+
+        std::unique_ptr<memray::io::Sink> cloneInChildProcess() override
+        {
+            return {};
+        }
+
+      private:
+        std::string* d_data;
+    };
+
+    size_t max_bytes;
+    size_t max_interval_ms;
+    size_t max_files;
+    std::string state{};
+    std::unique_ptr<memray::io::Sink> state_sink{std::make_unique<StateCopy>(&state)};
+    DeltaEncodedFields state_last{};
+    ThreadDeltaStates state_thread_deltas{};
+    uint64_t bytes_written{0};
+};
+
 static PythonAllocatorType
 getPythonAllocator()
 {
@@ -34,9 +385,13 @@ getPythonAllocator()
 RecordWriter::RecordWriter(
         std::unique_ptr<memray::io::Sink> sink,
         const std::string& command_line,
-        bool native_traces)
+        bool native_traces,
+        bool per_thread_buffers,
+        FileFormat file_format)
 : d_sink(std::move(sink))
 , d_stats({0, 0, duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count()})
+, d_per_thread_buffers(per_thread_buffers && file_format == FILE_FORMAT_ALL_ALLOCATIONS)
+, d_writer_id(s_next_writer_id++)
 {
     d_header = HeaderRecord{
             "",
@@ -48,7 +403,25 @@ RecordWriter::RecordWriter(
             0,
             0,
             getPythonAllocator()};
+    d_header.file_format = file_format;
     strncpy(d_header.magic, MAGIC, sizeof(d_header.magic));
+    if (file_format == FILE_FORMAT_AGGREGATED_ALLOCATIONS) {
+        d_aggregation = std::make_unique<AggregationState>();
+    }
+}
+
+RecordWriter::~RecordWriter()
+{
+    ThreadBufferChunk* chunk = d_full_chunks.exchange(nullptr);
+    while (chunk) {
+        delete std::exchange(chunk, chunk->next);
+    }
+
+    ThreadBuffer* buffer = d_thread_buffers.exchange(nullptr);
+    while (buffer) {
+        delete buffer->chunk;
+        delete std::exchange(buffer, buffer->next);
+    }
 }
 
 void
@@ -58,10 +431,85 @@ RecordWriter::setMainTidAndSkippedFrames(thread_id_t main_tid, size_t skipped_fr
     d_header.skipped_frames_on_main_tid = skipped_frames_on_main_tid;
 }
 
+void
+RecordWriter::setSamplingInterval(size_t sampling_interval)
+{
+    d_header.sampling_interval = sampling_interval;
+    d_sampling_interval = sampling_interval;
+}
+
+void
+RecordWriter::setMinAllocationSize(size_t min_allocation_size)
+{
+    d_header.min_allocation_size = min_allocation_size;
+}
+
+PythonAllocatorType
+RecordWriter::pythonAllocator() const
+{
+    return d_header.python_allocator;
+}
+
+void
+RecordWriter::enableFlightRecorder(size_t capacity)
+{
+    // The thread buffers and the aggregated format both keep records out of
+    // the sink, so neither can be combined with a flight recorder.
+    assert(!d_per_thread_buffers && !d_aggregation);
+    std::lock_guard<std::mutex> lock(d_mutex);
+    // Each dump only holds part of the records, which the summary wouldn't
+    // match.
+    d_summary.reset();
+    auto flight_recorder = std::make_unique<FlightRecorder>(capacity);
+    d_flight_recorder = flight_recorder.get();
+    d_dump_sink = std::exchange(d_sink, std::move(flight_recorder));
+    startChunkUnsafe();
+}
+
+void
+RecordWriter::enableRotation(size_t max_bytes, size_t max_interval_ms, size_t max_files)
+{
+    // As for a flight recorder, every file must be readable on its own.
+    assert(!d_per_thread_buffers && !d_aggregation && !d_flight_recorder);
+    std::lock_guard<std::mutex> lock(d_mutex);
+    // A file only holds part of the records, which the summary wouldn't
+    // match.
+    d_summary.reset();
+    d_rotation = std::make_unique<RotationState>();
+    d_rotation->max_bytes = max_bytes;
+    d_rotation->max_interval_ms = max_interval_ms;
+    d_rotation->max_files = max_files;
+}
+
+void
+RecordWriter::enableProfileIntervals(size_t interval_ms)
+{
+    assert(d_aggregation);
+    std::lock_guard<std::mutex> lock(d_mutex);
+    d_aggregation->profile_interval_ms = interval_ms;
+    d_aggregation->last_profile_ms = d_stats.start_time;
+    d_aggregation->aggregator.enableIntervalTotals();
+}
+
+void
+RecordWriter::enableCaptureSummary()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_per_thread_buffers || d_aggregation || d_flight_recorder || d_rotation) {
+        return;
+    }
+    d_summary = std::make_unique<SummaryState>();
+    d_summary->last_memory_snapshot.ms_since_epoch = d_stats.start_time;
+}
+
 bool
 RecordWriter::writeHeader(bool seek_to_start)
 {
     std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_flight_recorder) {
+        // Every dump writes a header of its own.
+        return true;
+    }
     if (seek_to_start) {
         // If we can't seek to the beginning to the stream (e.g. dealing with a socket), just give
         // up.
@@ -69,47 +517,845 @@ RecordWriter::writeHeader(bool seek_to_start)
             return false;
         }
     }
+    d_stats.metrics = metricsUnsafe();
+    return writeHeaderUnsafe();
+}
 
+bool
+RecordWriter::writeHeaderUnsafe()
+{
     d_stats.end_time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
     d_header.stats = d_stats;
     if (!writeSimpleType(d_header.magic) or !writeSimpleType(d_header.version)
         or !writeSimpleType(d_header.native_traces) or !writeSimpleType(d_header.stats)
         or !writeString(d_header.command_line.c_str()) or !writeSimpleType(d_header.pid)
         or !writeSimpleType(d_header.main_tid) or !writeSimpleType(d_header.skipped_frames_on_main_tid)
-        or !writeSimpleType(d_header.python_allocator))
+        or !writeSimpleType(d_header.python_allocator)
+        or !writeSimpleType(d_header.sampling_interval)
+        or !writeSimpleType(d_header.file_format)
+        or !writeSimpleType(d_header.min_allocation_size)
+        or !writeSimpleType(d_header.summary_offset) or !writeString(d_header.parent_file.c_str())
+        or !writeSimpleType(d_header.parent_offset))
     {
         return false;
     }
-    return true;
+    // A compressing sink keeps what is written before it is first flushed
+    // apart, so that the header can be rewritten when tracking stops.
+    return flushSinkUnsafe();
 }
 
 bool
 RecordWriter::writeTrailer()
 {
     std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_flight_recorder) {
+        // Nothing reaches the destination unless a dump is requested.
+        return true;
+    }
+    if (!writeAllocationBlockUnsafe() || !flushThreadBuffersUnsafe(true)) {
+        return false;
+    }
+    if (d_aggregation && d_aggregation->profile_interval_ms) {
+        const auto now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+        if (!writeProfileIntervalUnsafe(now)) {
+            return false;
+        }
+    }
+    if (d_aggregation && !writeAggregatedAllocationsUnsafe()) {
+        return false;
+    }
+    if (d_summary && !writeCaptureSummaryUnsafe()) {
+        return false;
+    }
+    if (!writeTrackerMetricsUnsafe(metricsUnsafe())) {
+        return false;
+    }
     // The FileSource will ignore trailing 0x00 bytes. This non-zero trailer
     // marks the boundary between bytes we wrote and padding bytes.
     RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::TRAILER)};
     return writeSimpleType(token);
 }
 
+bool
+RecordWriter::startChunkUnsafe()
+{
+    // The pending allocations belong to the chunk that is ending.
+    if (!writeAllocationBlockUnsafe()) {
+        return false;
+    }
+    ChunkStart entry{
+            d_stats.n_allocations,
+            duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count()};
+    if (d_flight_recorder) {
+        // The segments of the ring are the chunks.
+        d_flight_recorder->startSegment(entry);
+        d_next_chunk_offset = d_bytes_written + d_flight_recorder->segmentSize();
+    }
+
+    RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::CHUNK_START)};
+    if (!writeSimpleType(token) || !writeVarint(entry.n_allocations)
+        || !writeVarint(entry.ms_since_epoch - d_stats.start_time))
+    {
+        return false;
+    }
+
+    // Nothing after this point is encoded relative to what came before it.
+    d_last = DeltaEncodedFields{};
+    d_thread_deltas.reset();
+    return true;
+}
+
+bool
+RecordWriter::endRepeatedAllocationsUnsafe()
+{
+    RepeatedAllocations& repeated = d_repeated_allocations;
+    if (repeated.n_repeats) {
+        // The repeats come right after the pair they repeat.
+        RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::REPEATED_ALLOCATIONS)};
+        if (!writeAllocationBlockContentsUnsafe() || !writeSimpleType(token)
+            || !writeVarint(repeated.n_repeats))
+        {
+            return false;
+        }
+        repeated.n_repeats = 0;
+    }
+    if (repeated.state == RepeatedAllocations::State::REPEATING) {
+        // The allocation came once more, but wasn't freed right away.
+        const NativeAllocationRecord allocation = repeated.allocation;
+        return appendAllocationUnsafe(repeated.record_type, allocation, repeated.python_stack_index);
+    }
+    return true;
+}
+
+bool
+RecordWriter::writeAllocationBlockUnsafe()
+{
+    // Repeats can only be counted while nothing else is written.
+    bool ret = endRepeatedAllocationsUnsafe() && writeAllocationBlockContentsUnsafe();
+    d_repeated_allocations.state = RepeatedAllocations::State::NONE;
+    return ret;
+}
+
+bool
+RecordWriter::writeAllocationBlockContentsUnsafe()
+{
+    AllocationBlock& block = d_allocation_block;
+    if (block.n_records == 0) {
+        return true;
+    }
+
+    // The columns come in the same order as the fields of a single record,
+    // which is smaller when written on its own.
+    bool ret;
+    if (block.n_records == 1) {
+        const auto allocator = static_cast<hooks::Allocator>(block.allocators[0]);
+        RecordTypeAndFlags token{block.record_type, allocatorFlags(allocator)};
+        ret = writeSimpleType(token) && (token.flags || writeSimpleType(allocator));
+    } else {
+        RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::ALLOCATION_BLOCK)};
+        RecordTypeAndFlags record_type{block.record_type, 0};
+        ret = writeSimpleType(token) && writeSimpleType(record_type) && writeVarint(block.n_records)
+              && writeBytes(block.allocators);
+    }
+    ret = ret && writeBytes(block.addresses) && writeBytes(block.sizes)
+          && writeBytes(block.python_stack_indices) && writeBytes(block.native_frame_ids);
+
+    block.n_records = 0;
+    block.allocators.clear();
+    block.addresses.clear();
+    block.sizes.clear();
+    block.python_stack_indices.clear();
+    block.native_frame_ids.clear();
+    return ret;
+}
+
+bool
+RecordWriter::writeFilteredAllocationTotalsUnsafe()
+{
+    const FilteredAllocationTotals& totals = d_filtered_allocation_totals;
+    RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::FILTERED_ALLOCATIONS)};
+    return writeSimpleType(token) && writeVarint(totals.n_allocations) && writeVarint(totals.bytes);
+}
+
+bool
+RecordWriter::writeTrackerMetricsUnsafe(const TrackerMetrics& metrics)
+{
+    RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::TRACKER_METRICS)};
+    return writeSimpleType(token) && writeVarint(metrics.n_tracked_allocations)
+           && writeVarint(metrics.allocation_ns) && writeVarint(metrics.n_tracked_deallocations)
+           && writeVarint(metrics.deallocation_ns) && writeVarint(metrics.n_unwinds)
+           && writeVarint(metrics.unwind_ns) && writeVarint(metrics.n_records_written)
+           && writeVarint(metrics.bytes_written) && writeVarint(metrics.n_lock_waits)
+           && writeVarint(metrics.lock_wait_ns) && writeVarint(metrics.n_flushes)
+           && writeVarint(metrics.flush_ns) && writeVarint(metrics.max_flush_ns);
+}
+
+TrackerMetrics
+RecordWriter::metrics()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    return metricsUnsafe();
+}
+
+TrackerMetrics
+RecordWriter::metricsUnsafe() const
+{
+    TrackerMetrics metrics = d_metrics;
+    metrics.bytes_written = d_bytes_written;
+    // Every record that went through a thread buffer took a sequence number.
+    metrics.n_records_written += d_next_sequence.load() - 1;
+    return metrics;
+}
+
+void
+RecordWriter::setTrackingOverhead(const TrackerMetrics& overhead)
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    d_metrics.n_tracked_allocations = overhead.n_tracked_allocations;
+    d_metrics.allocation_ns = overhead.allocation_ns;
+    d_metrics.n_tracked_deallocations = overhead.n_tracked_deallocations;
+    d_metrics.deallocation_ns = overhead.deallocation_ns;
+    d_metrics.n_unwinds = overhead.n_unwinds;
+    d_metrics.unwind_ns = overhead.unwind_ns;
+}
+
+void
+RecordWriter::summarizeAllocationUnsafe(uintptr_t address, size_t size, hooks::Allocator allocator)
+{
+    // This must see the allocations exactly like FileReader does.
+    Allocation allocation{0, address, size, allocator};
+    if (hooks::allocatorKind(allocator) == hooks::AllocatorKind::SIMPLE_DEALLOCATOR) {
+        allocation.size = 0;
+    }
+    scaleSampledAllocation(&allocation, d_sampling_interval);
+    d_summary->finder.processAllocation(allocation);
+    d_summary->n_allocations += 1;
+}
+
+void
+RecordWriter::summarizeMemoryRecordUnsafe(const MemoryRecord& record)
+{
+    MemorySnapshot& last = d_summary->last_memory_snapshot;
+    std::string& out = d_summary->memory_snapshots;
+    appendVarint(&out, record.ms_since_epoch - last.ms_since_epoch);
+    last.ms_since_epoch = record.ms_since_epoch;
+    appendIntegralDelta(&out, &last.rss, record.rss);
+    appendIntegralDelta(&out, &last.heap, d_summary->finder.getCurrentWatermark());
+    d_summary->n_memory_snapshots += 1;
+}
+
+bool
+RecordWriter::writeCaptureSummaryUnsafe()
+{
+    // The header is written again once tracking stops, and points readers
+    // here from then on.
+    d_header.summary_offset = d_bytes_written;
+    const api::HighWatermark peak = d_summary->finder.getHighWatermark();
+    const std::string& memory_snapshots = d_summary->memory_snapshots;
+    RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::CAPTURE_SUMMARY)};
+    if (!writeSimpleType(token) || !writeVarint(d_summary->n_allocations)
+        || !writeVarint(peak.index) || !writeVarint(peak.peak_memory)
+        || !writeVarint(d_filtered_allocation_totals.n_allocations)
+        || !writeVarint(d_filtered_allocation_totals.bytes)
+        || !writeVarint(d_summary->n_memory_snapshots))
+    {
+        return false;
+    }
+    return writeBytes(memory_snapshots);
+}
+
+void
+RecordWriter::enterStateRecordsUnsafe()
+{
+    if (d_flight_recorder) {
+        d_flight_recorder->enterState(&d_last, &d_thread_deltas);
+        return;
+    }
+    // The copy of the state isn't part of what has been written to the
+    // current file.
+    std::swap(d_sink, d_rotation->state_sink);
+    std::swap(d_last, d_rotation->state_last);
+    std::swap(d_thread_deltas, d_rotation->state_thread_deltas);
+    std::swap(d_bytes_written, d_rotation->bytes_written);
+}
+
+void
+RecordWriter::leaveStateRecordsUnsafe()
+{
+    if (d_flight_recorder) {
+        d_flight_recorder->leaveState(&d_last, &d_thread_deltas);
+        return;
+    }
+    std::swap(d_bytes_written, d_rotation->bytes_written);
+    std::swap(d_thread_deltas, d_rotation->state_thread_deltas);
+    std::swap(d_last, d_rotation->state_last);
+    std::swap(d_sink, d_rotation->state_sink);
+}
+
+bool
+RecordWriter::dumpFlightRecorder()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (!d_flight_recorder || !writeAllocationBlockUnsafe()) {
+        return false;
+    }
+
+    // Write straight to the destination while the ring is left untouched,
+    // so that recording carries on from where it was after the dump.
+    const uint64_t bytes_written = d_bytes_written;
+    d_stats.metrics = metricsUnsafe();
+    const TrackerStats stats = d_stats;
+    std::swap(d_sink, d_dump_sink);
+    bool ret = writeFlightRecorderDumpUnsafe();
+    std::swap(d_sink, d_dump_sink);
+    d_bytes_written = bytes_written;
+    d_stats = stats;
+    return ret;
+}
+
+bool
+RecordWriter::writeFlightRecorderDumpUnsafe()
+{
+    if (!d_sink->truncate()) {
+        return false;
+    }
+
+    // The counters in the header only cover what is in the dump.
+    const auto& segments = d_flight_recorder->segments();
+    d_stats.n_allocations -= segments.front().entry.n_allocations;
+    d_bytes_written = 0;
+    if (!writeHeaderUnsafe()) {
+        return false;
+    }
+
+    const std::string& state = d_flight_recorder->state();
+    d_bytes_written += state.size();
+    if (!d_sink->writeAll(state.data(), state.size())) {
+        return false;
+    }
+    for (const auto& segment : segments) {
+        d_bytes_written += segment.data.size();
+        if (!d_sink->writeAll(segment.data.data(), segment.data.size())) {
+            return false;
+        }
+    }
+
+    if (d_filtered_allocation_totals.n_allocations && !writeFilteredAllocationTotalsUnsafe()) {
+        return false;
+    }
+    if (!writeTrackerMetricsUnsafe(d_stats.metrics)) {
+        return false;
+    }
+    RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::TRAILER)};
+    return writeSimpleType(token) && flushSinkUnsafe();
+}
+
+bool
+RecordWriter::maybeRotate()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (!d_rotation) {
+        return true;
+    }
+    bool due = d_rotation->max_bytes && d_bytes_written >= d_rotation->max_bytes;
+    if (!due && d_rotation->max_interval_ms) {
+        const auto now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+        due = static_cast<uint64_t>(now - d_stats.start_time) >= d_rotation->max_interval_ms;
+    }
+    return !due || rotateUnsafe();
+}
+
+bool
+RecordWriter::maybeWriteProfileInterval()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (!d_aggregation || !d_aggregation->profile_interval_ms) {
+        return true;
+    }
+    const auto now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    const uint64_t elapsed = static_cast<uint64_t>(now) - d_aggregation->last_profile_ms;
+    if (elapsed < d_aggregation->profile_interval_ms) {
+        return true;
+    }
+    // Flush, so that the interval can be read while the tracked process
+    // keeps running.
+    return writeProfileIntervalUnsafe(now) && flushSinkUnsafe();
+}
+
+bool
+RecordWriter::changeSamplingInterval(size_t sampling_interval)
+{
+    std::unique_lock<std::mutex> lock = lockAndCountWait();
+    d_sampling_interval = sampling_interval;
+    if (d_aggregation) {
+        // The allocations are scaled as they are aggregated.
+        return true;
+    }
+    if (!writeAllocationBlockUnsafe() || !maybeStartChunkUnsafe()) {
+        return false;
+    }
+
+    // Records still in the thread buffers are written after this one. It
+    // takes a sequence number of its own, so that the reader applies it in
+    // order with them, or 0 when it applies from where it is written.
+    uint64_t sequence = 0;
+    if (d_per_thread_buffers) {
+        sequence = d_next_sequence.fetch_add(1);
+    } else {
+        d_metrics.n_records_written += 1;
+    }
+    auto write = [&] {
+        RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::SAMPLING_INTERVAL)};
+        return writeSimpleType(token) && writeVarint(sampling_interval) && writeVarint(sequence);
+    };
+    // Every file of a rotated capture starts with the intervals used so far.
+    // A flight recorder keeps them in its ring too, so that a dump applies
+    // each one to the allocations recorded after it.
+    if (d_flight_recorder && !write()) {
+        return false;
+    }
+    return writeStateRecordUnsafe(write);
+}
+
+bool
+RecordWriter::rotateUnsafe()
+{
+    // Finish the current file like writeTrailer() does, and rewrite its
+    // header with the final counters, like the tracker does when it stops.
+    if (!writeAllocationBlockUnsafe()) {
+        return false;
+    }
+    d_stats.metrics = metricsUnsafe();
+    RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::TRAILER)};
+    if (!writeTrackerMetricsUnsafe(d_stats.metrics) || !writeSimpleType(token) || !d_sink->seek(0, SEEK_SET) || !writeHeaderUnsafe())
+    {
+        return false;
+    }
+    if (!d_sink->rotate(d_rotation->max_files)) {
+        return false;
+    }
+
+    // The counters in the header of the new file only cover what is in it,
+    // and its times are relative to when it was started.
+    d_bytes_written = 0;
+    d_stats.n_allocations = 0;
+    d_stats.start_time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    if (!writeHeaderUnsafe()) {
+        return false;
+    }
+    const std::string& state = d_rotation->state;
+    d_bytes_written += state.size();
+    if (!d_sink->writeAll(state.data(), state.size())) {
+        return false;
+    }
+    return startChunkUnsafe() && flushSinkUnsafe();
+}
+
 std::unique_lock<std::mutex>
 RecordWriter::acquireLock()
 {
-    return std::unique_lock<std::mutex>(d_mutex);
+    return lockAndCountWait();
+}
+
+void
+RecordWriter::prepareFork()
+{
+    d_mutex.lock();
+    // What a flight recorder or the aggregated format hold is only written
+    // out at the end, and a rotated destination may lose its first files.
+    d_fork_offset = 0;
+    if (!d_flight_recorder && !d_aggregation && !d_rotation && !d_sink->fileNameForChildren().empty()
+        && flushSinkUnsafe())
+    {
+        // The pending allocation block isn't written yet, so this is where
+        // the last record written ends.
+        d_fork_offset = d_bytes_written;
+    }
+}
+
+void
+RecordWriter::finishFork()
+{
+    d_fork_offset = 0;
+    d_mutex.unlock();
 }
 
 std::unique_ptr<RecordWriter>
 RecordWriter::cloneInChildProcess()
 {
-    std::unique_ptr<io::Sink> new_sink = d_sink->cloneInChildProcess();
+    // A flight recorder is set up again by the child's tracker.
+    std::unique_ptr<io::Sink> new_sink =
+            (d_flight_recorder ? d_dump_sink : d_sink)->cloneInChildProcess();
     if (!new_sink) {
         return {};
     }
-    return std::make_unique<RecordWriter>(
+    auto new_writer = std::make_unique<RecordWriter>(
             std::move(new_sink),
             d_header.command_line,
-            d_header.native_traces);
+            d_header.native_traces,
+            d_per_thread_buffers,
+            d_header.file_format);
+    if (d_summary) {
+        new_writer->enableCaptureSummary();
+    }
+    if (d_rotation) {
+        new_writer->enableRotation(
+                d_rotation->max_bytes,
+                d_rotation->max_interval_ms,
+                d_rotation->max_files);
+    }
+    if (d_aggregation && d_aggregation->profile_interval_ms) {
+        new_writer->enableProfileIntervals(d_aggregation->profile_interval_ms);
+    }
+    if (d_fork_offset) {
+        new_writer->d_header.parent_file = d_sink->fileNameForChildren();
+        new_writer->d_header.parent_offset = d_fork_offset;
+    }
+    return new_writer;
+}
+
+bool
+RecordWriter::continuesParentCapture() const
+{
+    return d_header.parent_offset != 0;
+}
+
+RecordWriter::ThreadBuffer*
+RecordWriter::getThreadBuffer()
+{
+    // The slot may be left over from a previous writer, in which case its
+    // buffer must not be touched: it may have been freed already.
+    ThreadBufferSlot& slot = t_thread_buffer;
+    if (slot.writer_id != d_writer_id) {
+        auto buffer = new ThreadBuffer();
+        buffer->next = d_thread_buffers.load();
+        while (!d_thread_buffers.compare_exchange_weak(buffer->next, buffer)) {
+        }
+        slot = ThreadBufferSlot{d_writer_id, buffer};
+    }
+    return slot.buffer;
+}
+
+void
+RecordWriter::pushFullChunk(ThreadBufferChunk* chunk)
+{
+    chunk->next = d_full_chunks.load();
+    while (!d_full_chunks.compare_exchange_weak(chunk->next, chunk)) {
+    }
+}
+
+template<typename T>
+bool
+RecordWriter::writeBufferedRecord(thread_id_t tid, const T& item)
+{
+    // Note: callers hold a RecursionGuard, so allocating a new chunk here
+    // can't re-enter the writer.
+    ThreadBuffer* buffer = getThreadBuffer();
+    buffer->acquire();
+
+    bool pushed_chunk = false;
+    if (buffer->chunk && buffer->chunk->tid != tid) {
+        // The thread id changed (e.g. a greenlet switch). Start a new chunk,
+        // as every chunk belongs to a single thread id.
+        pushFullChunk(std::exchange(buffer->chunk, nullptr));
+        pushed_chunk = true;
+    }
+    if (!buffer->chunk) {
+        buffer->chunk = new ThreadBufferChunk(tid);
+    }
+
+    // Publish a lower bound for our sequence number before taking it. This
+    // guarantees that the background thread can never compute a watermark
+    // that is greater than a sequence number that hasn't been written yet.
+    if (buffer->first_pending_sequence.load() == NO_PENDING_SEQUENCE) {
+        buffer->first_pending_sequence.store(d_next_sequence.load());
+    }
+    uint64_t sequence = d_next_sequence.fetch_add(1);
+
+    ThreadBufferChunk::Cursor saved_cursor = buffer->chunk->cursor;
+    bool ret = buffer->chunk->encode(sequence, item);
+    if (!ret) {
+        // The chunk is full: hand it to the background thread and retry on an
+        // empty one. Note that `first_pending_sequence` is left untouched
+        // until the record has been encoded into its new chunk.
+        buffer->chunk->cursor = saved_cursor;
+        pushFullChunk(buffer->chunk);
+        buffer->chunk = new ThreadBufferChunk(tid);
+        pushed_chunk = true;
+        ret = buffer->chunk->encode(sequence, item);
+    }
+    if (pushed_chunk) {
+        buffer->first_pending_sequence.store(sequence);
+    }
+
+    buffer->release();
+    return ret;
+}
+
+template bool
+RecordWriter::writeBufferedRecord(thread_id_t tid, const AllocationRecord& item);
+template bool
+RecordWriter::writeBufferedRecord(thread_id_t tid, const NativeAllocationRecord& item);
+template bool
+RecordWriter::writeBufferedRecord(thread_id_t tid, const PythonStackAllocationRecord& item);
+template bool
+RecordWriter::writeBufferedRecord(thread_id_t tid, const FramePush& item);
+template bool
+RecordWriter::writeBufferedRecord(thread_id_t tid, const FramePop& item);
+template bool
+RecordWriter::writeBufferedRecord(thread_id_t tid, const ThreadRecord& item);
+
+bool
+RecordWriter::flushThreadBuffers()
+{
+    std::unique_lock<std::mutex> lock = lockAndCountWait();
+    return flushThreadBuffersUnsafe(false);
+}
+
+bool
+RecordWriter::flushThreadBuffersUnsafe(bool wait_for_writers)
+{
+    if (!d_per_thread_buffers) {
+        return true;
+    }
+
+    // First, steal the partially filled chunks of threads that are not
+    // currently writing a record.
+    ThreadBufferChunk* stolen = nullptr;
+    ThreadBuffer* buffers = d_thread_buffers.load();
+    for (ThreadBuffer* buffer = buffers; buffer; buffer = buffer->next) {
+        if (wait_for_writers) {
+            buffer->acquire();
+        } else if (!buffer->tryAcquire()) {
+            continue;
+        }
+        if (buffer->chunk) {
+            buffer->chunk->next = stolen;
+            stolen = std::exchange(buffer->chunk, nullptr);
+        }
+        buffer->first_pending_sequence.store(NO_PENDING_SEQUENCE);
+        buffer->release();
+    }
+
+    // Every record with a sequence number below the watermark is either in
+    // the batch or has already been written. This must be computed before
+    // collecting the full chunks, as a thread publishes its chunk before
+    // updating its lower bound.
+    uint64_t watermark = d_next_sequence.load();
+    for (ThreadBuffer* buffer = buffers; buffer; buffer = buffer->next) {
+        watermark = std::min(watermark, buffer->first_pending_sequence.load());
+    }
+
+    // Full chunks were pushed in LIFO order. Reverse them so that each
+    // thread's chunks are written in the order they were filled, followed by
+    // the (more recent) stolen ones.
+    ThreadBufferChunk* batch = stolen;
+    ThreadBufferChunk* full = d_full_chunks.exchange(nullptr);
+    while (full) {
+        ThreadBufferChunk* chunk = std::exchange(full, full->next);
+        chunk->next = batch;
+        batch = chunk;
+    }
+
+    if (!batch && watermark <= d_last_watermark) {
+        return true;
+    }
+
+    bool ret = true;
+    if (!batch) {
+        // Nothing new to write, but let readers know they can make progress.
+        ret = writeRecordUnsafe(ThreadBufferHeader{0, watermark, 0});
+    }
+    while (batch) {
+        ThreadBufferChunk* chunk = std::exchange(batch, batch->next);
+        ret = ret && maybeStartChunkUnsafe();
+        // Only the last chunk of the batch advances the watermark: readers
+        // need to have seen all of the batch before relying on it.
+        d_stats.n_allocations += chunk->cursor.n_allocations;
+        ThreadBufferHeader header{chunk->tid, batch ? 0 : watermark, chunk->cursor.n_records};
+        d_bytes_written += chunk->cursor.used;
+        ret = ret && writeRecordUnsafe(header) && d_sink->writeAll(chunk->buffer, chunk->cursor.used);
+        delete chunk;
+    }
+    d_last_watermark = std::max(d_last_watermark, watermark);
+    return ret;
+}
+
+bool
+RecordWriter::aggregateRecordUnsafe(thread_id_t tid, const FramePush& record)
+{
+    FrameTree::index_t& current_stack = d_aggregation->current_stack_by_thread[tid];
+    current_stack = d_aggregation->python_stack_tree.getTraceIndex(current_stack, record.frame_id);
+    return true;
+}
+
+bool
+RecordWriter::aggregateRecordUnsafe(thread_id_t tid, const FramePop& record)
+{
+    FrameTree::index_t& current_stack = d_aggregation->current_stack_by_thread[tid];
+    for (size_t count = record.count; count && current_stack != 0; --count) {
+        current_stack = d_aggregation->python_stack_tree.nextNode(current_stack).second;
+    }
+    return true;
+}
+
+bool
+RecordWriter::aggregateRecordUnsafe(thread_id_t tid, const AllocationRecord& record)
+{
+    size_t frame_index = 0;
+    if (!hooks::isDeallocator(record.allocator)) {
+        frame_index = d_aggregation->current_stack_by_thread[tid];
+    }
+    aggregateAllocationUnsafe(
+            Allocation{tid, record.address, record.size, record.allocator, 0, frame_index});
+    return true;
+}
+
+bool
+RecordWriter::aggregateRecordUnsafe(thread_id_t tid, const NativeAllocationRecord& record)
+{
+    size_t frame_index = d_aggregation->current_stack_by_thread[tid];
+    aggregateAllocationUnsafe(Allocation{
+            tid,
+            record.address,
+            record.size,
+            record.allocator,
+            record.native_frame_id,
+            frame_index});
+    return true;
+}
+
+bool
+RecordWriter::aggregateRecordUnsafe(thread_id_t tid, const PythonStackAllocationRecord& record)
+{
+    // The stack was interned by the tracker, whose tree is streamed to the
+    // reader as it grows, so our own tree stays empty.
+    aggregateAllocationUnsafe(Allocation{
+            tid,
+            record.address,
+            record.size,
+            record.allocator,
+            record.native_frame_id,
+            record.python_stack_index});
+    return true;
+}
+
+bool
+RecordWriter::aggregateRecordUnsafe(thread_id_t tid, const ThreadRecord& record)
+{
+    // Thread names are written out as usual, so that the reader can still
+    // tell which thread each location belongs to.
+    if (!maybeStartChunkUnsafe()) {
+        return false;
+    }
+    if (d_last.thread_id != tid) {
+        if (!writeRecordUnsafe(ContextSwitch{tid})) {
+            return false;
+        }
+    }
+    return writeRecordUnsafe(record);
+}
+
+void
+RecordWriter::aggregateAllocationUnsafe(Allocation allocation)
+{
+    // Apply the same weights as the reader would to a sampled capture, so
+    // that the peak is found on the estimated sizes.
+    d_stats.n_allocations += 1;
+    scaleSampledAllocation(&allocation, d_sampling_interval);
+    d_aggregation->aggregator.addAllocation(allocation);
+}
+
+bool
+RecordWriter::writePythonStackTreeUnsafe()
+{
+    // The nodes go in index order, so that every parent is known to the
+    // reader before its children. Only the ones the reader hasn't seen yet
+    // are written.
+    const FrameTree& tree = d_aggregation->python_stack_tree;
+    const FrameTree::index_t n_nodes = tree.size();
+    FrameTree::index_t& n_nodes_written = d_aggregation->n_nodes_written;
+    RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::PYTHON_STACK_TREE)};
+    if (!writeSimpleType(token) || !writeVarint(n_nodes - n_nodes_written)) {
+        return false;
+    }
+    for (; n_nodes_written < n_nodes; ++n_nodes_written) {
+        auto [frame_id, parent_index] = tree.nextNode(n_nodes_written);
+        if (!writeVarint(frame_id) || !writeVarint(parent_index)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+RecordWriter::writeAggregatedAllocationsUnsafe()
+{
+    // The Python stacks go first, so that the records can refer to them.
+    if (!writePythonStackTreeUnsafe()) {
+        return false;
+    }
+
+    bool ret = true;
+    d_aggregation->aggregator.visitLocations([&](const Allocation& record,
+                                                 const api::LocationTable::Totals& peak,
+                                                 const api::LocationTable::Totals& leaked) {
+        RecordTypeAndFlags token{RecordType::AGGREGATED_ALLOCATION, allocatorFlags(record.allocator)};
+        ret = ret && writeSimpleType(token) && (token.flags || writeSimpleType(record.allocator))
+              && writeSimpleType(record.tid)
+              && writeVarint(record.frame_index) && writeVarint(record.native_frame_id)
+              && writeVarint(peak.n_allocations) && writeVarint(peak.size)
+              && writeVarint(leaked.n_allocations) && writeVarint(leaked.size);
+    });
+    return ret;
+}
+
+bool
+RecordWriter::writeProfileIntervalUnsafe(uint64_t ms_since_epoch)
+{
+    // What every location that allocated or freed anything since the
+    // previous interval did in it, and what it holds now. The locations that
+    // stayed the same are left out, so an interval costs nothing for them.
+    d_aggregation->last_profile_ms = ms_since_epoch;
+    std::vector<ProfileIntervalEntry> entries;
+    d_aggregation->aggregator.consumeIntervalTotals([&](const Allocation& record,
+                                                        const api::LocationTable::Totals& allocated,
+                                                        const api::LocationTable::Totals& freed,
+                                                        const api::LocationTable::Totals& live) {
+        entries.push_back(ProfileIntervalEntry{
+                record.tid,
+                record.allocator,
+                record.native_frame_id,
+                record.frame_index,
+                0,
+                allocated.n_allocations,
+                allocated.size,
+                freed.n_allocations,
+                freed.size,
+                live.n_allocations,
+                live.size});
+    });
+
+    if (!writePythonStackTreeUnsafe()) {
+        return false;
+    }
+    RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::PROFILE_INTERVAL)};
+    if (!writeSimpleType(token) || !writeVarint(ms_since_epoch - d_stats.start_time)
+        || !writeVarint(entries.size()))
+    {
+        return false;
+    }
+    for (const auto& entry : entries) {
+        if (!writeSimpleType(entry.allocator) || !writeSimpleType(entry.tid)
+            || !writeVarint(entry.frame_index) || !writeVarint(entry.native_frame_id)
+            || !writeVarint(entry.n_allocated) || !writeVarint(entry.bytes_allocated)
+            || !writeVarint(entry.n_freed) || !writeVarint(entry.bytes_freed)
+            || !writeVarint(entry.n_live) || !writeVarint(entry.bytes_live))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
 }  // namespace memray::tracking_api
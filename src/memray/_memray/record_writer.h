@@ -1,6 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <climits>
 #include <cstring>
 #include <memory>
@@ -9,18 +12,49 @@
 #include <type_traits>
 #include <unistd.h>
 
+#include "frame_tree.h"
 #include "records.h"
 #include "sink.h"
+#include "snapshot.h"
+
+#if defined(USE_MEMRAY_TLS_MODEL)
+#    if defined(__GLIBC__)
+#        define MEMRAY_FAST_TLS __attribute__((tls_model("initial-exec")))
+#    else
+#        define MEMRAY_FAST_TLS __attribute__((tls_model("local-dynamic")))
+#    endif
+#else
+#    define MEMRAY_FAST_TLS
+#endif
 
 namespace memray::tracking_api {
+
+// Number of bytes of records each thread accumulates before handing them
+// over to the background thread when per-thread buffering is enabled.
+const size_t THREAD_BUFFER_SIZE = 32 * 1024;
+
+// Number of segments the ring of a flight recorder is split into. The oldest
+// segment is dropped whenever a new one is started and the ring is full.
+const size_t FLIGHT_RECORDER_SEGMENTS = 8;
+
 class RecordWriter
 {
   public:
     explicit RecordWriter(
             std::unique_ptr<memray::io::Sink> sink,
             const std::string& command_line,
-            bool native_traces);
+            bool native_traces,
+            bool per_thread_buffers = false,
+            FileFormat file_format = FILE_FORMAT_ALL_ALLOCATIONS);
+    ~RecordWriter();
     void setMainTidAndSkippedFrames(thread_id_t main_tid, size_t skipped_frames_on_main_tid);
+    void setSamplingInterval(size_t sampling_interval);
+    void setMinAllocationSize(size_t min_allocation_size);
+    PythonAllocatorType pythonAllocator() const;
+    void enableFlightRecorder(size_t capacity);
+    void enableRotation(size_t max_bytes, size_t max_interval_ms, size_t max_files);
+    void enableCaptureSummary();
+    void enableProfileIntervals(size_t interval_ms);
 
     RecordWriter(RecordWriter& other) = delete;
     RecordWriter(RecordWriter&& other) = delete;
@@ -30,6 +64,7 @@ class RecordWriter
     template<typename T>
     bool inline writeSimpleType(const T& item);
     bool inline writeString(const char* the_string);
+    bool inline writeBytes(const std::string& bytes);
     bool inline writeVarint(size_t val);
     bool inline writeSignedVarint(ssize_t val);
     template<typename T>
@@ -45,25 +80,206 @@ class RecordWriter
     bool inline writeRecordUnsafe(const Segment& record);
     bool inline writeRecordUnsafe(const AllocationRecord& record);
     bool inline writeRecordUnsafe(const NativeAllocationRecord& record);
+    bool inline writeRecordUnsafe(const PythonStackAllocationRecord& record);
     bool inline writeRecordUnsafe(const pyrawframe_map_val_t& item);
     bool inline writeRecordUnsafe(const SegmentHeader& item);
+    bool inline writeRecordUnsafe(const UnloadedModule& item);
     bool inline writeRecordUnsafe(const ThreadRecord& record);
     bool inline writeRecordUnsafe(const UnresolvedNativeFrame& record);
+    bool inline writeRecordUnsafe(const PythonStackTreeNode& record);
     bool inline writeRecordUnsafe(const MemoryMapStart&);
+    bool inline writeRecordUnsafe(const ThreadBufferHeader& record);
+    bool inline writeRecordUnsafe(const FilteredAllocationTotals& record);
+    bool inline maybeStartChunkUnsafe();
     bool writeHeader(bool seek_to_start);
     bool writeTrailer();
+    bool flushThreadBuffers();
+    bool dumpFlightRecorder();
+    bool maybeRotate();
+    bool maybeWriteProfileInterval();
+    // Sample the allocations that come after this with a new interval. The
+    // reader applies it from the same point on when scaling them.
+    bool changeSamplingInterval(size_t sampling_interval);
+
+    // The writer counts what it writes, how long threads wait for its
+    // lock and how long flushing its sink takes by itself. The tracker
+    // periodically hands it what it measured of its own overhead, so that
+    // the metrics in the headers and trailers it writes include that too.
+    TrackerMetrics metrics();
+    void setTrackingOverhead(const TrackerMetrics& overhead);
 
     std::unique_lock<std::mutex> acquireLock();
+    // Keep anything from being written from the time a process starts to
+    // fork until finishFork() is called, and note how much of what was
+    // written by then reached the destination. If the child's writer writes
+    // to a file next to it, its capture continues from that point of this
+    // one instead of starting from scratch.
+    void prepareFork();
+    void finishFork();
     std::unique_ptr<RecordWriter> cloneInChildProcess();
+    // Whether the capture continues from the state of the parent's one, in
+    // which case it must start with the same frames, stack trees and memory
+    // maps the parent's tracker had when it forked.
+    bool continuesParentCapture() const;
 
   private:
+    struct ThreadBufferChunk;
+    struct ThreadBuffer;
+    struct AggregationState;
+    class FlightRecorder;
+    struct RotationState;
+    struct SummaryState;
+
+    // Consecutive allocation records of a single type and thread, kept column
+    // by column until they are written out together (see
+    // writeAllocationBlockUnsafe). The columns are delta encoded against
+    // d_last as the records come in, so the block must be written out before
+    // any other record is.
+    struct AllocationBlock
+    {
+        RecordType record_type{RecordType::ALLOCATION};
+        size_t n_records{0};
+        std::string allocators{};
+        std::string addresses{};
+        std::string sizes{};
+        std::string python_stack_indices{};
+        std::string native_frame_ids{};
+    };
+
+    // The simple allocation last added to the block, and whether it was
+    // freed right away. Identical allocations that are freed right away too
+    // are then only counted, and written out as a single REPEATED_ALLOCATIONS
+    // record once anything else comes (see endRepeatedAllocationsUnsafe).
+    struct RepeatedAllocations
+    {
+        enum class State {
+            NONE,
+            // The allocation is the last record in the block.
+            ALLOCATED,
+            // The allocation and its deallocation are the last two records
+            // in the block, and n_repeats more pairs came after them.
+            PAIRED,
+            // As above, and the allocation came once more, which isn't
+            // written out until it's known whether it's freed right away.
+            REPEATING,
+        };
+
+        State state{State::NONE};
+        RecordType record_type{RecordType::ALLOCATION};
+        NativeAllocationRecord allocation{};
+        size_t python_stack_index{0};
+        hooks::Allocator deallocator{};
+        size_t n_repeats{0};
+    };
+
+    // This must be trivially destructible, for the same reasons as the
+    // PythonStackTracker (see tracking_api.cpp).
+    struct ThreadBufferSlot
+    {
+        uint64_t writer_id;
+        ThreadBuffer* buffer;
+    };
+
     // Data members
     int d_version{CURRENT_HEADER_VERSION};
     std::unique_ptr<memray::io::Sink> d_sink;
     std::mutex d_mutex;
     HeaderRecord d_header{};
     TrackerStats d_stats{};
+    // The header has the interval that sampling started with.
+    size_t d_sampling_interval{0};
     DeltaEncodedFields d_last;
+    ThreadDeltaStates d_thread_deltas;
+    uint64_t d_bytes_written{0};
+    // Where a child forked since prepareFork() was called can continue
+    // from, or 0 if it can't.
+    uint64_t d_fork_offset{0};
+    uint64_t d_next_chunk_offset{0};
+    AllocationBlock d_allocation_block{};
+    RepeatedAllocations d_repeated_allocations{};
+    TrackerMetrics d_metrics{};
+
+    // Per-thread buffering state. The hot path only touches the calling
+    // thread's own ThreadBuffer and a few atomics; d_mutex is only taken
+    // by the background thread when the buffers are drained to the sink.
+    const bool d_per_thread_buffers;
+    const uint64_t d_writer_id;
+    std::atomic<uint64_t> d_next_sequence{1};
+    std::atomic<ThreadBuffer*> d_thread_buffers{nullptr};
+    std::atomic<ThreadBufferChunk*> d_full_chunks{nullptr};
+    uint64_t d_last_watermark{0};
+    MEMRAY_FAST_TLS static thread_local ThreadBufferSlot t_thread_buffer;
+
+    // Only set when writing the aggregated format, in which case the
+    // allocations and the frame pushes and pops are folded into it instead
+    // of being written out (see aggregateRecordUnsafe).
+    std::unique_ptr<AggregationState> d_aggregation;
+
+    // Only set in flight recorder mode, in which case d_sink is the flight
+    // recorder and the real destination is only written to by a dump.
+    FlightRecorder* d_flight_recorder{nullptr};
+    std::unique_ptr<memray::io::Sink> d_dump_sink;
+    FilteredAllocationTotals d_filtered_allocation_totals{};
+
+    // Only set when the destination is rotated, in which case the records
+    // that make up the state are written both to it and to a copy that
+    // every new file starts with.
+    std::unique_ptr<RotationState> d_rotation;
+
+    // Only set when the writer works out the capture summary, which it can
+    // only do while it sees the records in the order they are written in.
+    std::unique_ptr<SummaryState> d_summary;
+
+    // Methods
+    static void inline appendVarint(std::string* out, size_t val);
+    template<typename T>
+    static void inline appendIntegralDelta(std::string* out, T* prev, T new_val);
+    bool inline addToAllocationBlockUnsafe(
+            RecordType record_type,
+            hooks::Allocator allocator,
+            uintptr_t address);
+    bool inline addAllocationUnsafe(
+            RecordType record_type,
+            const NativeAllocationRecord& record,
+            size_t python_stack_index);
+    bool inline appendAllocationUnsafe(
+            RecordType record_type,
+            const NativeAllocationRecord& record,
+            size_t python_stack_index);
+    bool endRepeatedAllocationsUnsafe();
+    bool writeAllocationBlockUnsafe();
+    bool writeAllocationBlockContentsUnsafe();
+    ThreadBuffer* getThreadBuffer();
+    void pushFullChunk(ThreadBufferChunk* chunk);
+    bool flushThreadBuffersUnsafe(bool wait_for_writers);
+    bool writeHeaderUnsafe();
+    bool startChunkUnsafe();
+    bool writeFilteredAllocationTotalsUnsafe();
+    bool writeTrackerMetricsUnsafe(const TrackerMetrics& metrics);
+    TrackerMetrics metricsUnsafe() const;
+    std::unique_lock<std::mutex> inline lockAndCountWait();
+    bool inline flushSinkUnsafe();
+    template<typename F>
+    bool inline writeStateRecordUnsafe(F write);
+    void enterStateRecordsUnsafe();
+    void leaveStateRecordsUnsafe();
+    bool writeFlightRecorderDumpUnsafe();
+    bool rotateUnsafe();
+    void summarizeAllocationUnsafe(uintptr_t address, size_t size, hooks::Allocator allocator);
+    void summarizeMemoryRecordUnsafe(const MemoryRecord& record);
+    bool writeCaptureSummaryUnsafe();
+    template<typename T>
+    bool writeBufferedRecord(thread_id_t tid, const T& item);
+    bool aggregateRecordUnsafe(thread_id_t tid, const FramePush& record);
+    bool aggregateRecordUnsafe(thread_id_t tid, const FramePop& record);
+    bool aggregateRecordUnsafe(thread_id_t tid, const AllocationRecord& record);
+    bool aggregateRecordUnsafe(thread_id_t tid, const NativeAllocationRecord& record);
+    bool aggregateRecordUnsafe(thread_id_t tid, const PythonStackAllocationRecord& record);
+    bool aggregateRecordUnsafe(thread_id_t tid, const ThreadRecord& record);
+    void aggregateAllocationUnsafe(Allocation allocation);
+    bool writePythonStackTreeUnsafe();
+    bool writeAggregatedAllocationsUnsafe();
+    bool writeProfileIntervalUnsafe(uint64_t ms_since_epoch);
 };
 
 template<typename T>
@@ -73,12 +289,21 @@ bool inline RecordWriter::writeSimpleType(const T& item)
             std::is_trivially_copyable<T>::value,
             "writeSimpleType called on non trivially copyable type");
 
+    d_bytes_written += sizeof(item);
     return d_sink->writeAll(reinterpret_cast<const char*>(&item), sizeof(item));
 };
 
 bool inline RecordWriter::writeString(const char* the_string)
 {
-    return d_sink->writeAll(the_string, strlen(the_string) + 1);
+    size_t length = strlen(the_string) + 1;
+    d_bytes_written += length;
+    return d_sink->writeAll(the_string, length);
+}
+
+bool inline RecordWriter::writeBytes(const std::string& bytes)
+{
+    d_bytes_written += bytes.size();
+    return d_sink->writeAll(bytes.data(), bytes.size());
 }
 
 bool inline RecordWriter::writeVarint(size_t rest)
@@ -115,19 +340,87 @@ bool inline RecordWriter::writeIntegralDelta(T* prev, T new_val)
     return writeSignedVarint(delta);
 }
 
+void inline RecordWriter::appendVarint(std::string* out, size_t rest)
+{
+    while (rest >= 0x80) {
+        out->push_back(static_cast<char>((rest & 0x7f) | 0x80));
+        rest >>= 7;
+    }
+    out->push_back(static_cast<char>(rest));
+}
+
+template<typename T>
+void inline RecordWriter::appendIntegralDelta(std::string* out, T* prev, T new_val)
+{
+    // Zig-zag encoded, like writeSignedVarint.
+    ssize_t delta = new_val - *prev;
+    *prev = new_val;
+    appendVarint(
+            out,
+            (static_cast<size_t>(delta) << 1)
+                    ^ static_cast<size_t>(delta >> std::numeric_limits<ssize_t>::digits));
+}
+
+std::unique_lock<std::mutex> inline RecordWriter::lockAndCountWait()
+{
+    // Only reading the clock when the lock is contended keeps this as cheap
+    // as taking the lock when it isn't.
+    std::unique_lock<std::mutex> lock(d_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        const auto start = std::chrono::steady_clock::now();
+        lock.lock();
+        d_metrics.n_lock_waits += 1;
+        d_metrics.lock_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                          std::chrono::steady_clock::now() - start)
+                                          .count();
+    }
+    return lock;
+}
+
+bool inline RecordWriter::flushSinkUnsafe()
+{
+    const auto start = std::chrono::steady_clock::now();
+    const bool ret = d_sink->flush();
+    const size_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count();
+    d_metrics.n_flushes += 1;
+    d_metrics.flush_ns += elapsed_ns;
+    d_metrics.max_flush_ns = std::max(d_metrics.max_flush_ns, elapsed_ns);
+    return ret;
+}
+
 template<typename T>
 bool inline RecordWriter::writeRecord(const T& item)
 {
-    std::lock_guard<std::mutex> lock(d_mutex);
-    return writeRecordUnsafe(item);
+    std::unique_lock<std::mutex> lock = lockAndCountWait();
+    d_metrics.n_records_written += 1;
+    return writeAllocationBlockUnsafe() && maybeStartChunkUnsafe() && writeRecordUnsafe(item);
 }
 
 template<typename T>
 bool inline RecordWriter::writeThreadSpecificRecord(thread_id_t tid, const T& item)
 {
-    std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_per_thread_buffers) {
+        return writeBufferedRecord(tid, item);
+    }
+
+    std::unique_lock<std::mutex> lock = lockAndCountWait();
+    d_metrics.n_records_written += 1;
+    if (d_aggregation) {
+        return aggregateRecordUnsafe(tid, item);
+    }
+    // Only allocations of the current thread can be added to its block.
+    constexpr bool is_allocation = std::is_same_v<T, AllocationRecord>
+                                   || std::is_same_v<T, NativeAllocationRecord>
+                                   || std::is_same_v<T, PythonStackAllocationRecord>;
+    if ((!is_allocation || d_last.thread_id != tid) && !writeAllocationBlockUnsafe()) {
+        return false;
+    }
+    if (!maybeStartChunkUnsafe()) {
+        return false;
+    }
     if (d_last.thread_id != tid) {
-        d_last.thread_id = tid;
         if (!writeRecordUnsafe(ContextSwitch{tid})) {
             return false;
         }
@@ -135,6 +428,131 @@ bool inline RecordWriter::writeThreadSpecificRecord(thread_id_t tid, const T& it
     return writeRecordUnsafe(item);
 }
 
+bool inline RecordWriter::maybeStartChunkUnsafe()
+{
+    // Only the segments of a flight recorder's ring are kept to a size.
+    return !d_flight_recorder || d_bytes_written < d_next_chunk_offset || startChunkUnsafe();
+}
+
+bool inline RecordWriter::addToAllocationBlockUnsafe(
+        RecordType record_type,
+        hooks::Allocator allocator,
+        uintptr_t address)
+{
+    AllocationBlock& block = d_allocation_block;
+    // Allocators that don't fit in 4 bits are only written on their own.
+    if (block.n_records
+        && (block.record_type != record_type || block.n_records == ALLOCATION_BLOCK_SIZE
+            || !allocatorFlags(allocator)))
+    {
+        if (!writeAllocationBlockContentsUnsafe()) {
+            return false;
+        }
+    }
+    block.record_type = record_type;
+    // Allocators fit in 4 bits, so two of them are packed into every byte.
+    const auto allocator_bits = static_cast<char>(allocator);
+    if (block.n_records % 2 == 0) {
+        block.allocators.push_back(allocator_bits);
+    } else {
+        block.allocators.back() |= static_cast<char>(allocator_bits << 4);
+    }
+    block.n_records += 1;
+    appendIntegralDelta(&block.addresses, &d_last.data_pointer, address);
+    return true;
+}
+
+bool inline RecordWriter::addAllocationUnsafe(
+        RecordType record_type,
+        const NativeAllocationRecord& record,
+        size_t python_stack_index)
+{
+    RepeatedAllocations& repeated = d_repeated_allocations;
+    if (repeated.state == RepeatedAllocations::State::PAIRED && record_type == repeated.record_type
+        && record.address == repeated.allocation.address && record.size == repeated.allocation.size
+        && record.allocator == repeated.allocation.allocator
+        && record.native_frame_id == repeated.allocation.native_frame_id
+        && python_stack_index == repeated.python_stack_index)
+    {
+        repeated.state = RepeatedAllocations::State::REPEATING;
+        return true;
+    }
+    if (repeated.state == RepeatedAllocations::State::REPEATING
+        && record.allocator == repeated.deallocator && record.address == repeated.allocation.address)
+    {
+        repeated.state = RepeatedAllocations::State::PAIRED;
+        repeated.n_repeats += 1;
+        return true;
+    }
+    return endRepeatedAllocationsUnsafe() && appendAllocationUnsafe(record_type, record, python_stack_index);
+}
+
+bool inline RecordWriter::appendAllocationUnsafe(
+        RecordType record_type,
+        const NativeAllocationRecord& record,
+        size_t python_stack_index)
+{
+    if (!addToAllocationBlockUnsafe(record_type, record.allocator, record.address)) {
+        return false;
+    }
+    const hooks::AllocatorKind kind = hooks::allocatorKind(record.allocator);
+    AllocationBlock& block = d_allocation_block;
+    if (record_type == RecordType::ALLOCATION) {
+        if (kind != hooks::AllocatorKind::SIMPLE_DEALLOCATOR) {
+            appendVarint(&block.sizes, record.size);
+        }
+    } else {
+        appendVarint(&block.sizes, record.size);
+        if (record_type == RecordType::ALLOCATION_WITH_PYTHON_STACK) {
+            appendIntegralDelta(
+                    &block.python_stack_indices,
+                    &d_last.python_stack_index,
+                    python_stack_index);
+        }
+        appendIntegralDelta(&block.native_frame_ids, &d_last.native_frame_id, record.native_frame_id);
+    }
+    if (!allocatorFlags(record.allocator) && !writeAllocationBlockContentsUnsafe()) {
+        return false;
+    }
+
+    RepeatedAllocations& repeated = d_repeated_allocations;
+    if (kind == hooks::AllocatorKind::SIMPLE_ALLOCATOR) {
+        repeated.state = RepeatedAllocations::State::ALLOCATED;
+        repeated.record_type = record_type;
+        repeated.allocation = record;
+        repeated.python_stack_index = python_stack_index;
+    } else if (
+            kind == hooks::AllocatorKind::SIMPLE_DEALLOCATOR
+            && repeated.state == RepeatedAllocations::State::ALLOCATED
+            && record.address == repeated.allocation.address)
+    {
+        repeated.state = RepeatedAllocations::State::PAIRED;
+        repeated.deallocator = record.allocator;
+    } else {
+        repeated.state = RepeatedAllocations::State::NONE;
+    }
+    return true;
+}
+
+template<typename F>
+bool inline RecordWriter::writeStateRecordUnsafe(F write)
+{
+    // The records that others refer to (frames, stacks, thread names and
+    // memory maps) make up the state of the capture. A flight recorder only
+    // writes them to its state, and a rotating writer writes them to its copy
+    // of the state too, each with a delta encoding of its own.
+    if (!d_flight_recorder && !write()) {
+        return false;
+    }
+    if (!d_flight_recorder && !d_rotation) {
+        return true;
+    }
+    enterStateRecordsUnsafe();
+    const bool ret = write();
+    leaveStateRecordsUnsafe();
+    return ret;
+}
+
 bool inline RecordWriter::writeRecordUnsafe(const FramePop& record)
 {
     size_t count = record.count;
@@ -161,76 +579,179 @@ bool inline RecordWriter::writeRecordUnsafe(const FramePush& record)
 
 bool inline RecordWriter::writeRecordUnsafe(const MemoryRecord& record)
 {
-    RecordTypeAndFlags token{RecordType::MEMORY_RECORD, 0};
-    return writeSimpleType(token) && writeVarint(record.rss)
-           && writeVarint(record.ms_since_epoch - d_stats.start_time) && d_sink->flush();
+    if (d_summary) {
+        summarizeMemoryRecordUnsafe(record);
+    }
+    RecordTypeAndFlags token{
+            RecordType::MEMORY_RECORD,
+            record.has_counters ? MEMORY_RECORD_WITH_COUNTERS : MEMORY_RECORD_RSS_ONLY};
+    if (!writeSimpleType(token) || !writeVarint(record.rss)
+        || !writeVarint(record.ms_since_epoch - d_stats.start_time))
+    {
+        return false;
+    }
+    if (record.has_counters) {
+        const MemoryCounters& counters = record.counters;
+        MemoryCounters& last = d_last.memory_counters;
+        if (!writeIntegralDelta(&last.pss, counters.pss) || !writeIntegralDelta(&last.uss, counters.uss)
+            || !writeIntegralDelta(&last.swap, counters.swap)
+            || !writeIntegralDelta(&last.cgroup_usage, counters.cgroup_usage)
+            || !writeIntegralDelta(&last.minor_faults, counters.minor_faults)
+            || !writeIntegralDelta(&last.major_faults, counters.major_faults))
+        {
+            return false;
+        }
+    }
+    return flushSinkUnsafe();
 }
 
 bool inline RecordWriter::writeRecordUnsafe(const ContextSwitch& record)
 {
-    RecordTypeAndFlags token{RecordType::CONTEXT_SWITCH, 0};
-    return writeSimpleType(token) && writeSimpleType(record);
+    const size_t index = d_thread_deltas.switchTo(&d_last, record.tid);
+    if (index == ThreadDeltaStates::NEW_THREAD) {
+        RecordTypeAndFlags token{RecordType::CONTEXT_SWITCH, CONTEXT_SWITCH_NEW_THREAD};
+        return writeSimpleType(token) && writeSimpleType(record);
+    }
+    RecordTypeAndFlags token{RecordType::CONTEXT_SWITCH, CONTEXT_SWITCH_KNOWN_THREAD};
+    return writeSimpleType(token) && writeVarint(index);
 }
 
 bool inline RecordWriter::writeRecordUnsafe(const Segment& record)
 {
-    RecordTypeAndFlags token{RecordType::SEGMENT, 0};
-    return writeSimpleType(token) && writeSimpleType(record.vaddr) && writeVarint(record.memsz);
+    return writeStateRecordUnsafe([&] {
+        RecordTypeAndFlags token{RecordType::SEGMENT, 0};
+        return writeSimpleType(token) && writeSimpleType(record.vaddr) && writeVarint(record.memsz);
+    });
 }
 
 bool inline RecordWriter::writeRecordUnsafe(const AllocationRecord& record)
 {
     d_stats.n_allocations += 1;
-    RecordTypeAndFlags token{RecordType::ALLOCATION, static_cast<unsigned char>(record.allocator)};
-    return writeSimpleType(token) && writeIntegralDelta(&d_last.data_pointer, record.address)
-           && (hooks::allocatorKind(record.allocator) == hooks::AllocatorKind::SIMPLE_DEALLOCATOR
-               || writeVarint(record.size));
+    if (d_summary) {
+        summarizeAllocationUnsafe(record.address, record.size, record.allocator);
+    }
+    return addAllocationUnsafe(
+            RecordType::ALLOCATION,
+            NativeAllocationRecord{record.address, record.size, record.allocator},
+            0);
 }
 
 bool inline RecordWriter::writeRecordUnsafe(const NativeAllocationRecord& record)
 {
     d_stats.n_allocations += 1;
-    RecordTypeAndFlags token{
-            RecordType::ALLOCATION_WITH_NATIVE,
-            static_cast<unsigned char>(record.allocator)};
-    return writeSimpleType(token) && writeIntegralDelta(&d_last.data_pointer, record.address)
-           && writeVarint(record.size)
-           && writeIntegralDelta(&d_last.native_frame_id, record.native_frame_id);
+    if (d_summary) {
+        summarizeAllocationUnsafe(record.address, record.size, record.allocator);
+    }
+    return addAllocationUnsafe(RecordType::ALLOCATION_WITH_NATIVE, record, 0);
+}
+
+bool inline RecordWriter::writeRecordUnsafe(const PythonStackAllocationRecord& record)
+{
+    d_stats.n_allocations += 1;
+    if (d_summary) {
+        summarizeAllocationUnsafe(record.address, record.size, record.allocator);
+    }
+    return addAllocationUnsafe(
+            RecordType::ALLOCATION_WITH_PYTHON_STACK,
+            NativeAllocationRecord{
+                    record.address,
+                    record.size,
+                    record.allocator,
+                    record.native_frame_id},
+            record.python_stack_index);
 }
 
 bool inline RecordWriter::writeRecordUnsafe(const pyrawframe_map_val_t& item)
 {
     d_stats.n_frames += 1;
-    RecordTypeAndFlags token{RecordType::FRAME_INDEX, !item.second.is_entry_frame};
-    return writeSimpleType(token) && writeIntegralDelta(&d_last.python_frame_id, item.first)
-           && writeString(item.second.function_name) && writeString(item.second.filename)
-           && writeIntegralDelta(&d_last.python_line_number, item.second.lineno);
+    return writeStateRecordUnsafe([&] {
+        RecordTypeAndFlags token{RecordType::FRAME_INDEX, !item.second.is_entry_frame};
+        return writeSimpleType(token) && writeIntegralDelta(&d_last.python_frame_id, item.first)
+               && writeString(item.second.function_name) && writeString(item.second.filename)
+               && writeIntegralDelta(&d_last.python_line_number, item.second.lineno);
+    });
 }
 
 bool inline RecordWriter::writeRecordUnsafe(const SegmentHeader& item)
 {
-    RecordTypeAndFlags token{RecordType::SEGMENT_HEADER, 0};
-    return writeSimpleType(token) && writeString(item.filename) && writeVarint(item.num_segments)
-           && writeSimpleType(item.addr);
+    return writeStateRecordUnsafe([&] {
+        RecordTypeAndFlags token{RecordType::SEGMENT_HEADER, 0};
+        return writeSimpleType(token) && writeString(item.filename)
+               && writeVarint(item.num_segments) && writeSimpleType(item.addr);
+    });
+}
+
+bool inline RecordWriter::writeRecordUnsafe(const UnloadedModule& item)
+{
+    return writeStateRecordUnsafe([&] {
+        RecordTypeAndFlags token{RecordType::SEGMENT_HEADER, SEGMENT_HEADER_UNLOADED};
+        return writeSimpleType(token) && writeString(item.filename) && writeSimpleType(item.addr);
+    });
 }
 
 bool inline RecordWriter::writeRecordUnsafe(const ThreadRecord& record)
 {
-    RecordTypeAndFlags token{RecordType::THREAD_RECORD, 0};
-    return writeSimpleType(token) && writeString(record.name);
+    // The name is for the thread whose records are being written, which the
+    // state is told about separately.
+    const thread_id_t tid = d_last.thread_id;
+    return writeStateRecordUnsafe([&] {
+        if (d_last.thread_id != tid) {
+            if (!writeRecordUnsafe(ContextSwitch{tid})) {
+                return false;
+            }
+        }
+        RecordTypeAndFlags token{RecordType::THREAD_RECORD, 0};
+        return writeSimpleType(token) && writeString(record.name);
+    });
 }
 
 bool inline RecordWriter::writeRecordUnsafe(const UnresolvedNativeFrame& record)
 {
-    return writeSimpleType(RecordTypeAndFlags{RecordType::NATIVE_TRACE_INDEX, 0})
-           && writeIntegralDelta(&d_last.instruction_pointer, record.ip)
-           && writeIntegralDelta(&d_last.native_frame_id, record.index);
+    return writeStateRecordUnsafe([&] {
+        return writeSimpleType(RecordTypeAndFlags{RecordType::NATIVE_TRACE_INDEX, 0})
+               && writeIntegralDelta(&d_last.instruction_pointer, record.ip)
+               && writeIntegralDelta(&d_last.native_frame_id, record.index);
+    });
+}
+
+bool inline RecordWriter::writeRecordUnsafe(const PythonStackTreeNode& record)
+{
+    // Nodes are numbered in the order they are written, so they can be
+    // sent one at a time as a tree of a single node.
+    return writeStateRecordUnsafe([&] {
+        RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::PYTHON_STACK_TREE)};
+        return writeSimpleType(token) && writeVarint(1) && writeVarint(record.frame_id)
+               && writeVarint(record.parent_index);
+    });
+}
+
+bool inline RecordWriter::writeRecordUnsafe(const MemoryMapStart& record)
+{
+    // Memory maps are written under acquireLock() instead of writeRecord(),
+    // and every allocation before them must be read before them.
+    if (!writeAllocationBlockUnsafe()) {
+        return false;
+    }
+    const auto flags = record.incremental ? MEMORY_MAP_INCREMENTAL : MEMORY_MAP_FULL;
+    return writeStateRecordUnsafe([&] {
+        RecordTypeAndFlags token{RecordType::MEMORY_MAP_START, flags};
+        return writeSimpleType(token);
+    });
+}
+
+bool inline RecordWriter::writeRecordUnsafe(const ThreadBufferHeader& record)
+{
+    RecordTypeAndFlags token{RecordType::OTHER, int(OtherRecordType::THREAD_BUFFER)};
+    return writeSimpleType(token) && writeSimpleType(record.tid) && writeVarint(record.watermark)
+           && writeVarint(record.n_records);
 }
 
-bool inline RecordWriter::writeRecordUnsafe(const MemoryMapStart&)
+bool inline RecordWriter::writeRecordUnsafe(const FilteredAllocationTotals& record)
 {
-    RecordTypeAndFlags token{RecordType::MEMORY_MAP_START, 0};
-    return writeSimpleType(token);
+    // The totals are cumulative, so a flight recorder only needs to write the
+    // latest ones out with each dump.
+    d_filtered_allocation_totals = record;
+    return d_flight_recorder || writeFilteredAllocationTotalsUnsafe();
 }
 
 }  // namespace memray::tracking_api
@@ -1,3 +1,4 @@
+from _memray.records cimport FileFormat
 from _memray.sink cimport Sink
 from libcpp cimport bool
 from libcpp.memory cimport unique_ptr
@@ -6,4 +7,7 @@ from libcpp.string cimport string
 
 cdef extern from "record_writer.h" namespace "memray::api":
     cdef cppclass RecordWriter:
-        RecordWriter(unique_ptr[Sink], string command_line, bool native_trace) except+
+        RecordWriter(unique_ptr[Sink], string command_line, bool native_trace, bool per_thread_buffers, FileFormat file_format) except+
+        void enableRotation(size_t max_bytes, size_t max_interval_ms, size_t max_files)
+        void enableCaptureSummary()
+        void enableProfileIntervals(size_t interval_ms)
@@ -1,6 +1,8 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <cmath>
+
 #include "python_helpers.h"
 #include "records.h"
 
@@ -52,6 +54,91 @@ Allocation::toPythonObject() const
     return tuple;
 }
 
+void
+scaleSampledAllocation(Allocation* allocation, size_t sampling_interval)
+{
+    if (!sampling_interval || allocation->size == 0
+        || hooks::allocatorKind(allocation->allocator) != hooks::AllocatorKind::SIMPLE_ALLOCATOR)
+    {
+        return;
+    }
+
+    // The tracker samples each byte with probability 1/interval, so an
+    // allocation of `size` bytes is recorded with probability
+    // 1 - exp(-size/interval). Weighting it by the inverse of that
+    // probability makes sums over the recorded allocations unbiased
+    // estimates of the sums over all the allocations.
+    const double interval = static_cast<double>(sampling_interval);
+    const double scale = 1.0 / -std::expm1(-static_cast<double>(allocation->size) / interval);
+    allocation->size = static_cast<size_t>(std::llround(allocation->size * scale));
+    allocation->n_allocations = static_cast<size_t>(std::llround(scale));
+}
+
+Allocation
+AggregatedAllocation::contributionToHighWaterMark() const
+{
+    return {tid,
+            0,
+            bytes_in_high_water_mark,
+            allocator,
+            native_frame_id,
+            frame_index,
+            native_segment_generation,
+            n_allocations_in_high_water_mark};
+}
+
+Allocation
+AggregatedAllocation::contributionToLeaks() const
+{
+    return {tid,
+            0,
+            bytes_leaked,
+            allocator,
+            native_frame_id,
+            frame_index,
+            native_segment_generation,
+            n_allocations_leaked};
+}
+
+Allocation
+ProfileIntervalEntry::allocated() const
+{
+    return {tid,
+            0,
+            bytes_allocated,
+            allocator,
+            native_frame_id,
+            frame_index,
+            native_segment_generation,
+            n_allocated};
+}
+
+Allocation
+ProfileIntervalEntry::freed() const
+{
+    return {tid,
+            0,
+            bytes_freed,
+            allocator,
+            native_frame_id,
+            frame_index,
+            native_segment_generation,
+            n_freed};
+}
+
+Allocation
+ProfileIntervalEntry::live() const
+{
+    return {tid,
+            0,
+            bytes_live,
+            allocator,
+            native_frame_id,
+            frame_index,
+            native_segment_generation,
+            n_live};
+}
+
 PyObject*
 Frame::toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) const
 {
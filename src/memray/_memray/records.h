@@ -3,27 +3,39 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <atomic>
 #include <fstream>
+#include <memory>
 #include <mutex>
-#include <shared_mutex>
 #include <stddef.h>
 #include <string>
 #include <tuple>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "hooks.h"
 #include "python_helpers.h"
+#include "string_interner.h"
 
 namespace memray::tracking_api {
 
 const char MAGIC[] = "memray";
-const int CURRENT_HEADER_VERSION = 9;
+const int CURRENT_HEADER_VERSION = 22;
 
 using frame_id_t = size_t;
 using thread_id_t = unsigned long;
 using millis_t = long long;
 
+// Maximum number of consecutive allocation records that are written out
+// together as a single block, with each of their fields in a column.
+const size_t ALLOCATION_BLOCK_SIZE = 256;
+
+// An allocation followed right away by its deallocation, with no other record
+// of any thread in between, can be followed by a REPEATED_ALLOCATIONS record
+// with the number of times that the same thread made the same allocation
+// (same address, size, allocator and stack) and freed it again right after.
+
 enum class RecordType : unsigned char {
     OTHER = 0,
     ALLOCATION = 1,
@@ -38,10 +50,22 @@ enum class RecordType : unsigned char {
     THREAD_RECORD = 10,
     MEMORY_RECORD = 11,
     CONTEXT_SWITCH = 12,
+    AGGREGATED_ALLOCATION = 13,
+    ALLOCATION_WITH_PYTHON_STACK = 14,
 };
 
 enum class OtherRecordType : unsigned char {
     TRAILER = 1,
+    THREAD_BUFFER = 2,
+    CHUNK_START = 3,
+    PYTHON_STACK_TREE = 5,
+    FILTERED_ALLOCATIONS = 6,
+    CAPTURE_SUMMARY = 7,
+    ALLOCATION_BLOCK = 8,
+    TRACKER_METRICS = 9,
+    REPEATED_ALLOCATIONS = 10,
+    PROFILE_INTERVAL = 11,
+    SAMPLING_INTERVAL = 12,
 };
 
 struct RecordTypeAndFlags
@@ -67,12 +91,44 @@ struct RecordTypeAndFlags
 
 static_assert(sizeof(RecordTypeAndFlags) == 1);
 
+// Allocators that don't fit in the 4 bits of flags of an allocation record
+// are written as 0 there, and in a byte of their own right after its token.
+inline unsigned char
+allocatorFlags(hooks::Allocator allocator)
+{
+    const auto value = static_cast<unsigned char>(allocator);
+    return value <= 0x0f ? value : 0;
+}
+
+// What tracking has cost the process so far. The time spent tracking
+// allocations and deallocations and unwinding their native stacks is only
+// measured when the tracker was asked to, as reading the clock is a
+// noticeable part of the cost of tracking a single allocation. Everything
+// else is always counted. Times are in nanoseconds.
+struct TrackerMetrics
+{
+    size_t n_tracked_allocations{0};
+    size_t allocation_ns{0};
+    size_t n_tracked_deallocations{0};
+    size_t deallocation_ns{0};
+    size_t n_unwinds{0};
+    size_t unwind_ns{0};
+    size_t n_records_written{0};
+    size_t bytes_written{0};
+    size_t n_lock_waits{0};
+    size_t lock_wait_ns{0};
+    size_t n_flushes{0};
+    size_t flush_ns{0};
+    size_t max_flush_ns{0};
+};
+
 struct TrackerStats
 {
     size_t n_allocations{0};
     size_t n_frames{0};
     millis_t start_time{};
     millis_t end_time{};
+    TrackerMetrics metrics{};
 };
 
 enum PythonAllocatorType : unsigned char {
@@ -82,6 +138,14 @@ enum PythonAllocatorType : unsigned char {
     PYTHONALLOCATOR_OTHER = 4,
 };
 
+enum FileFormat : unsigned char {
+    // Every allocation, deallocation and frame push and pop is recorded.
+    FILE_FORMAT_ALL_ALLOCATIONS = 1,
+    // Only the totals of each location at the high water mark and at exit
+    // are recorded, computed by the tracked process itself.
+    FILE_FORMAT_AGGREGATED_ALLOCATIONS = 2,
+};
+
 struct HeaderRecord
 {
     char magic[sizeof(MAGIC)];
@@ -93,12 +157,43 @@ struct HeaderRecord
     thread_id_t main_tid{};
     size_t skipped_frames_on_main_tid{};
     PythonAllocatorType python_allocator;
+    size_t sampling_interval{0};
+    FileFormat file_format{FILE_FORMAT_ALL_ALLOCATIONS};
+    size_t min_allocation_size{0};
+    // Where the capture summary starts, or 0 if the capture has none.
+    uint64_t summary_offset{0};
+    // The capture of a forked child continues from the state (frames, stack
+    // trees and memory maps) that its parent's capture, in a file next to it,
+    // had written up to this offset. The name is empty for any other capture.
+    std::string parent_file{};
+    uint64_t parent_offset{0};
+};
+
+// Counters sampled along with the RSS by a tracker asked for detailed memory
+// counters. Any that can't be read on this system are 0.
+struct MemoryCounters
+{
+    size_t pss{0};
+    size_t uss{0};
+    size_t swap{0};
+    size_t cgroup_usage{0};
+    size_t minor_faults{0};
+    size_t major_faults{0};
+};
+
+// A memory record with counters has them after the RSS, each one encoded as
+// a delta from the one in the previous memory record with counters.
+enum MemoryRecordFlags : unsigned char {
+    MEMORY_RECORD_RSS_ONLY = 0,
+    MEMORY_RECORD_WITH_COUNTERS = 1,
 };
 
 struct MemoryRecord
 {
     unsigned long int ms_since_epoch;
     size_t rss;
+    bool has_counters{false};
+    MemoryCounters counters{};
 };
 
 struct MemorySnapshot
@@ -123,6 +218,18 @@ struct NativeAllocationRecord
     frame_id_t native_frame_id{0};
 };
 
+// An allocation made by a tracker that interns Python stacks: instead of
+// following the frame pushes and pops of each thread, the reader finds the
+// stack in the tree built from the PYTHON_STACK_TREE records.
+struct PythonStackAllocationRecord
+{
+    uintptr_t address;
+    size_t size;
+    hooks::Allocator allocator;
+    size_t python_stack_index;
+    frame_id_t native_frame_id{0};
+};
+
 struct Allocation
 {
     thread_id_t tid;
@@ -133,12 +240,102 @@ struct Allocation
     size_t frame_index{0};
     size_t native_segment_generation{0};
     size_t n_allocations{1};
+    // Only set by a reader that doesn't expand repeated allocations, on a
+    // record that stands for this many more repeats of the allocation before
+    // it and of its deallocation (see REPEATED_ALLOCATIONS).
+    size_t n_repeats{0};
 
     PyObject* toPythonObject() const;
 };
 
+// Weight an allocation recorded by a tracker that samples one byte every
+// `sampling_interval` bytes, so that it stands for the allocations that
+// weren't recorded. Does nothing if the capture isn't sampled.
+void
+scaleSampledAllocation(Allocation* allocation, size_t sampling_interval);
+
+// The allocations made at one location of a capture in the aggregated
+// format: how many of them were live when the heap reached its peak, and how
+// many were still live when tracking stopped.
+struct AggregatedAllocation
+{
+    thread_id_t tid;
+    hooks::Allocator allocator;
+    frame_id_t native_frame_id;
+    size_t frame_index;
+    size_t native_segment_generation;
+
+    size_t n_allocations_in_high_water_mark;
+    size_t bytes_in_high_water_mark;
+    size_t n_allocations_leaked;
+    size_t bytes_leaked;
+
+    Allocation contributionToHighWaterMark() const;
+    Allocation contributionToLeaks() const;
+};
+
+// What the allocations made at one location of a capture in the aggregated
+// format did in one profile interval: how many were made and freed in it,
+// and how many were still live at its end.
+struct ProfileIntervalEntry
+{
+    thread_id_t tid;
+    hooks::Allocator allocator;
+    frame_id_t native_frame_id;
+    size_t frame_index;
+    size_t native_segment_generation;
+
+    size_t n_allocated;
+    size_t bytes_allocated;
+    size_t n_freed;
+    size_t bytes_freed;
+    size_t n_live;
+    size_t bytes_live;
+
+    Allocation allocated() const;
+    Allocation freed() const;
+    Allocation live() const;
+};
+
+// The locations whose allocations changed in a profile interval, which ended
+// at the given time.
+struct ProfileInterval
+{
+    uint64_t ms_since_epoch;
+    std::vector<ProfileIntervalEntry> entries;
+};
+
+// How many allocations were too small to be recorded individually by a
+// tracker with a minimum allocation size, and how many bytes they requested
+// in total, since tracking started.
+struct FilteredAllocationTotals
+{
+    size_t n_allocations{0};
+    size_t bytes{0};
+};
+
+// What reading a whole capture would find, worked out by the writer as it
+// goes and written just before the trailer, so that a reader can learn it
+// without reading any of the records.
+struct CaptureSummary
+{
+    size_t n_allocations{0};
+    size_t peak_index{0};
+    size_t peak_memory{0};
+    FilteredAllocationTotals filtered_allocations{};
+    std::vector<MemorySnapshot> memory_snapshots{};
+};
+
+// An incremental memory map starts from the modules of the previous one,
+// and only lists the modules that were loaded or unloaded since then.
 struct MemoryMapStart
 {
+    bool incremental{false};
+};
+
+enum MemoryMapFlags : unsigned char {
+    MEMORY_MAP_FULL = 0,
+    MEMORY_MAP_INCREMENTAL = 1,
 };
 
 struct SegmentHeader
@@ -148,12 +345,32 @@ struct SegmentHeader
     uintptr_t addr;
 };
 
+// A module of the previous memory map that is not loaded anymore. It is
+// written as a segment header with this flag and without its segments.
+enum SegmentHeaderFlags : unsigned char {
+    SEGMENT_HEADER_LOADED = 0,
+    SEGMENT_HEADER_UNLOADED = 1,
+};
+
+struct UnloadedModule
+{
+    const char* filename;
+    uintptr_t addr;
+};
+
 struct Segment
 {
     uintptr_t vaddr;
     uintptr_t memsz;
 };
 
+// When stacks are cut short to their innermost frames, what's left out is
+// replaced with a single frame: a Python frame with this function name and
+// an empty file name, or a native frame with this instruction pointer, which
+// no real frame ever has.
+const char TRUNCATED_FRAME_NAME[] = "<truncated>";
+const uintptr_t TRUNCATED_NATIVE_FRAME_IP = 0;
+
 struct RawFrame
 {
     const char* function_name;
@@ -188,10 +405,13 @@ struct RawFrame
     };
 };
 
+// A frame as the reader keeps it, with its strings interned in the reader's
+// interner, which makes frames small and cheap to compare and hash. Frames
+// of different readers can only be compared by the content of their strings.
 struct Frame
 {
-    std::string function_name;
-    std::string filename;
+    api::StringInterner::id_t function_name{0};
+    api::StringInterner::id_t filename{0};
     int lineno{0};
     bool is_entry_frame{true};
 
@@ -207,19 +427,10 @@ struct Frame
     {
         auto operator()(memray::tracking_api::Frame const& frame) const noexcept -> std::size_t
         {
-            // Keep this hashing fast and simple as this has a non trivial
-            // performance impact on the tracing functionality. We don't hash
-            // the contents of the strings because the interpreter will give us
-            // the same char* for the same code object. Of course, we can have
-            // some scenarios where two functions with the same function name have
-            // two different char* but in that case we will end registering the
-            // name twice, which is a good compromise given the speed that we
-            // gain keeping this simple.
-
-            auto the_func = std::hash<std::string>{}(frame.function_name);
-            auto the_filename = std::hash<std::string>{}(frame.filename);
-            auto lineno = std::hash<int>{}(frame.lineno);
-            return the_func ^ the_filename ^ lineno ^ frame.is_entry_frame;
+            size_t hash = frame.function_name;
+            hash = hash * 31 + frame.filename;
+            hash = hash * 31 + static_cast<unsigned int>(frame.lineno);
+            return hash * 2 + frame.is_entry_frame;
         }
     };
 };
@@ -240,11 +451,55 @@ struct UnresolvedNativeFrame
     size_t index;
 };
 
+struct PythonStackTreeNode
+{
+    frame_id_t frame_id;
+    uint32_t parent_index;
+};
+
 struct ContextSwitch
 {
     thread_id_t tid;
 };
 
+// A context switch to a thread that was already seen since the last chunk
+// start names it by the index it was given then, instead of by its id.
+enum ContextSwitchFlags : unsigned char {
+    CONTEXT_SWITCH_NEW_THREAD = 0,
+    CONTEXT_SWITCH_KNOWN_THREAD = 1,
+};
+
+struct ThreadBufferHeader
+{
+    thread_id_t tid;
+    uint64_t watermark;
+    size_t n_records;
+};
+
+// How far into the capture a chunk starts. The delta encoded fields are
+// reset at the start of each chunk.
+struct ChunkStart
+{
+    size_t n_allocations;
+    millis_t ms_since_epoch;
+};
+
+// Compressed captures are a series of LZ4 frames that can each be
+// decompressed on their own. When the capture is complete, it ends with a
+// skippable frame that lists where each frame starts in the compressed file
+// and in the stream it decompresses to, followed by an entry with the
+// offsets of the end of both. The payload of that frame (all of it little
+// endian) is the entries, their count as a 64 bit integer, and then the
+// COMPRESSED_FRAME_INDEX_TAG, so that it can be found from the end of the file.
+const uint32_t COMPRESSED_FRAME_INDEX_MAGIC = 0x184D2A51;
+const char COMPRESSED_FRAME_INDEX_TAG[8] = {'m', 'r', 'f', 'i', 'd', 'x', '0', '1'};
+
+struct CompressedFrameIndexEntry
+{
+    uint64_t compressed_offset;
+    uint64_t uncompressed_offset;
+};
+
 struct DeltaEncodedFields
 {
     thread_id_t thread_id{};
@@ -253,34 +508,243 @@ struct DeltaEncodedFields
     frame_id_t native_frame_id{};
     frame_id_t python_frame_id{};
     int python_line_number{};
+    size_t python_stack_index{};
+    MemoryCounters memory_counters{};
+};
+
+// The part of the delta encoding state that belongs to each thread seen
+// since the last chunk start. Keeping it apart means that the allocations of
+// a thread are encoded relative to that thread's previous allocation, even
+// when threads take turns writing. Writers and readers switch threads at the
+// same records, so they agree on both the state and the thread indices.
+class ThreadDeltaStates
+{
+  public:
+    static constexpr size_t NEW_THREAD = static_cast<size_t>(-1);
+
+    // Make `tid` the current thread, saving the per-thread fields of `last`
+    // for the previous one and loading the ones `tid` had. A thread that
+    // wasn't seen yet starts from the current values. Returns the index of
+    // `tid`, or NEW_THREAD if it was given one now.
+    size_t switchTo(DeltaEncodedFields* last, thread_id_t tid)
+    {
+        if (d_current != NEW_THREAD) {
+            save(*last, &d_threads[d_current]);
+        }
+        auto [it, inserted] = d_index_by_tid.emplace(tid, d_threads.size());
+        if (inserted) {
+            d_threads.push_back({tid, 0, 0, 0});
+            save(*last, &d_threads.back());
+        }
+        d_current = it->second;
+
+        const ThreadState& state = d_threads[d_current];
+        last->thread_id = tid;
+        last->data_pointer = state.data_pointer;
+        last->native_frame_id = state.native_frame_id;
+        last->python_stack_index = state.python_stack_index;
+        return inserted ? NEW_THREAD : d_current;
+    }
+
+    bool threadAt(size_t index, thread_id_t* tid) const
+    {
+        if (index >= d_threads.size()) {
+            return false;
+        }
+        *tid = d_threads[index].tid;
+        return true;
+    }
+
+    void reset()
+    {
+        d_threads.clear();
+        d_index_by_tid.clear();
+        d_current = NEW_THREAD;
+    }
+
+  private:
+    struct ThreadState
+    {
+        thread_id_t tid;
+        uintptr_t data_pointer;
+        frame_id_t native_frame_id;
+        size_t python_stack_index;
+    };
+
+    static void save(const DeltaEncodedFields& last, ThreadState* state)
+    {
+        state->data_pointer = last.data_pointer;
+        state->native_frame_id = last.native_frame_id;
+        state->python_stack_index = last.python_stack_index;
+    }
+
+    std::vector<ThreadState> d_threads{};
+    std::unordered_map<thread_id_t, size_t> d_index_by_tid{};
+    size_t d_current{NEW_THREAD};
 };
 
 template<typename FrameType>
 class FrameCollection
 {
   public:
+    FrameCollection()
+    {
+        d_tables.push_back(std::make_unique<Table>(INITIAL_CAPACITY));
+        d_table.store(d_tables.back().get(), std::memory_order_release);
+    }
+
     template<typename T>
     auto getIndex(T&& frame) -> std::pair<frame_id_t, bool>
     {
-        std::shared_lock<std::shared_mutex> r_lock(d_mutex);
-        bool inserted = false;
-        auto it = d_frame_map.find(frame);
-        if (it == d_frame_map.end()) {
-            r_lock.unlock();
-            std::unique_lock<std::shared_mutex> w_lock(d_mutex);
-
-            std::tie(it, inserted) = d_frame_map.emplace(std::forward<T>(frame), d_current_frame_id);
-            if (inserted) {
-                d_current_frame_id++;
-            }
+        return getIndex(std::forward<T>(frame), [](frame_id_t, const FrameType&) {});
+    }
+
+    // The callback is called with every new frame while the lock is held, so
+    // that nothing can see the frame before the callback has dealt with it.
+    template<typename T, typename Callback>
+    auto getIndex(T&& frame, const Callback& callback) -> std::pair<frame_id_t, bool>
+    {
+        // Fast path: frames are interned only once, so almost every lookup is
+        // a hit and can be served from the current table without any lock.
+        frame_id_t frame_id;
+        if (d_table.load(std::memory_order_acquire)->find(frame, &frame_id)) {
+            return std::make_pair(frame_id, false);
         }
-        return std::make_pair(it->second, inserted);
+
+        std::lock_guard<std::mutex> lock(d_mutex);
+        Table* table = d_table.load(std::memory_order_relaxed);
+        if (table->find(frame, &frame_id)) {
+            return std::make_pair(frame_id, false);
+        }
+        if (2 * (d_current_frame_id + 1) > table->capacity()) {
+            table = grow(table);
+        }
+        frame_id = d_current_frame_id++;
+        callback(frame_id, frame);
+        table->insert(std::forward<T>(frame), frame_id);
+        return std::make_pair(frame_id, true);
+    }
+
+    // Keep any new frame from being added until unlock() is called.
+    void lock()
+    {
+        d_mutex.lock();
+    }
+
+    void unlock()
+    {
+        d_mutex.unlock();
+    }
+
+    // Neither collection may be used by another thread while they are swapped.
+    void swap(FrameCollection& other)
+    {
+        std::swap(d_current_frame_id, other.d_current_frame_id);
+        d_tables.swap(other.d_tables);
+        Table* table = d_table.load(std::memory_order_relaxed);
+        d_table.store(other.d_table.load(std::memory_order_relaxed), std::memory_order_release);
+        other.d_table.store(table, std::memory_order_release);
     }
 
   private:
+    // Open addressing table with linear probing. Slots go from empty to
+    // filled exactly once and are never modified afterwards, so readers only
+    // need to acquire the slot's id before looking at its frame. Only one
+    // writer (holding d_mutex) inserts at a time.
+    class Table
+    {
+      public:
+        explicit Table(size_t capacity)
+        : d_mask(capacity - 1)
+        , d_slots(new Slot[capacity])
+        {
+        }
+
+        size_t capacity() const
+        {
+            return d_mask + 1;
+        }
+
+        bool find(const FrameType& frame, frame_id_t* frame_id) const
+        {
+            for (size_t i = hash(frame) & d_mask;; i = (i + 1) & d_mask) {
+                const Slot& slot = d_slots[i];
+                frame_id_t stored = slot.id.load(std::memory_order_acquire);
+                if (stored == EMPTY) {
+                    return false;
+                }
+                if (slot.frame == frame) {
+                    *frame_id = stored - 1;
+                    return true;
+                }
+            }
+        }
+
+        template<typename T>
+        void insert(T&& frame, frame_id_t frame_id)
+        {
+            size_t i = hash(frame) & d_mask;
+            while (d_slots[i].id.load(std::memory_order_relaxed) != EMPTY) {
+                i = (i + 1) & d_mask;
+            }
+            d_slots[i].frame = std::forward<T>(frame);
+            d_slots[i].id.store(frame_id + 1, std::memory_order_release);
+        }
+
+        void copyInto(Table* other) const
+        {
+            for (size_t i = 0; i <= d_mask; ++i) {
+                frame_id_t stored = d_slots[i].id.load(std::memory_order_relaxed);
+                if (stored != EMPTY) {
+                    other->insert(d_slots[i].frame, stored - 1);
+                }
+            }
+        }
+
+      private:
+        static const frame_id_t EMPTY = 0;
+
+        struct Slot
+        {
+            // The frame id plus one, or EMPTY if the slot is not in use.
+            std::atomic<frame_id_t> id{EMPTY};
+            FrameType frame{};
+        };
+
+        static size_t hash(const FrameType& frame)
+        {
+            // The frame hashes are usually derived from pointers, whose low
+            // bits carry little information, so mix them before masking.
+            size_t h = typename FrameType::Hash{}(frame);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            return h;
+        }
+
+        size_t d_mask;
+        std::unique_ptr<Slot[]> d_slots;
+    };
+
+    Table* grow(Table* table)
+    {
+        auto new_table = std::make_unique<Table>(2 * table->capacity());
+        table->copyInto(new_table.get());
+        // Readers may still be probing the old table, so it is kept alive
+        // until the collection is destroyed. Its size is bounded by the size
+        // of the current table, so this at most doubles the memory used.
+        d_tables.push_back(std::move(new_table));
+        table = d_tables.back().get();
+        d_table.store(table, std::memory_order_release);
+        return table;
+    }
+
+    static const size_t INITIAL_CAPACITY = 4096;
+
     frame_id_t d_current_frame_id{};
-    std::unordered_map<FrameType, frame_id_t, typename FrameType::Hash> d_frame_map{};
-    std::shared_mutex d_mutex;
+    std::vector<std::unique_ptr<Table>> d_tables{};
+    std::atomic<Table*> d_table{nullptr};
+    std::mutex d_mutex;
 };
 
 using pyrawframe_map_val_t = std::pair<frame_id_t, RawFrame>;
@@ -1,4 +1,5 @@
 from _memray.hooks cimport Allocator
+from libc.stdint cimport uint32_t
 from libc.stdint cimport uintptr_t
 from libcpp cimport bool
 from libcpp.string cimport string
@@ -7,16 +8,36 @@ from libcpp.vector cimport vector
 
 cdef extern from "records.h" namespace "memray::tracking_api":
 
+   cdef enum FileFormat 'memray::tracking_api::FileFormat':
+       FILE_FORMAT_ALL_ALLOCATIONS 'memray::tracking_api::FILE_FORMAT_ALL_ALLOCATIONS'
+       FILE_FORMAT_AGGREGATED_ALLOCATIONS 'memray::tracking_api::FILE_FORMAT_AGGREGATED_ALLOCATIONS'
+
    struct Frame:
-       string function_name
-       string filename
+       uint32_t function_name
+       uint32_t filename
        int lineno
 
+   struct TrackerMetrics:
+       size_t n_tracked_allocations
+       size_t allocation_ns
+       size_t n_tracked_deallocations
+       size_t deallocation_ns
+       size_t n_unwinds
+       size_t unwind_ns
+       size_t n_records_written
+       size_t bytes_written
+       size_t n_lock_waits
+       size_t lock_wait_ns
+       size_t n_flushes
+       size_t flush_ns
+       size_t max_flush_ns
+
    struct TrackerStats:
        size_t n_allocations
        size_t n_frames
        long long start_time
        long long end_time
+       TrackerMetrics metrics
 
    struct HeaderRecord:
        int version
@@ -27,22 +48,69 @@ cdef extern from "records.h" namespace "memray::tracking_api":
        size_t main_tid
        size_t skipped_frames_on_main_tid
        int python_allocator
+       size_t sampling_interval
+       int file_format
+       size_t min_allocation_size
+       size_t summary_offset
+       string parent_file
+       size_t parent_offset
 
    cdef cppclass Allocation:
+       long tid
+       size_t size
        Allocator allocator
        size_t frame_index
+       size_t native_frame_id
+       size_t native_segment_generation
        size_t n_allocations
+       size_t n_repeats
        object toPythonObject()
 
+   cdef cppclass AggregatedAllocation:
+       Allocation contributionToHighWaterMark()
+       Allocation contributionToLeaks()
+
+   cdef cppclass ProfileIntervalEntry:
+       size_t native_frame_id
+       size_t native_segment_generation
+       Allocation allocated()
+       Allocation freed()
+       Allocation live()
+
+   cdef cppclass ProfileInterval:
+       unsigned long long ms_since_epoch
+       vector[ProfileIntervalEntry] entries
+
+   struct MemoryCounters:
+       size_t pss
+       size_t uss
+       size_t swap
+       size_t cgroup_usage
+       size_t minor_faults
+       size_t major_faults
+
    struct MemoryRecord:
        unsigned long int ms_since_epoch
        size_t rss
+       bool has_counters
+       MemoryCounters counters
+
+   struct FilteredAllocationTotals:
+       size_t n_allocations
+       size_t bytes
 
    struct MemorySnapshot:
        unsigned long int ms_since_epoch
        size_t rss
        size_t heap
 
+   struct CaptureSummary:
+       size_t n_allocations
+       size_t peak_index
+       size_t peak_memory
+       FilteredAllocationTotals filtered_allocations
+       vector[MemorySnapshot] memory_snapshots
+
 
 cdef extern from "<optional>":
    # Cython doesn't have libcpp.optional yet, so just declare this opaquely.
@@ -2,11 +2,16 @@
 #include <Python.h>
 
 #include <cerrno>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <arpa/inet.h>
 #include <fcntl.h>
-#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -55,130 +60,704 @@ removeSuffix(const std::string& s, const std::string& suffix)
     return s.substr(0, s.size() - suffix.size());
 }
 
-}  // unnamed namespace
-
 bool
-FileSink::writeAll(const char* data, size_t length)
+writeAllAt(int fd, const char* data, size_t length, off_t offset)
 {
-    // If the file isn't big enough for all this data, grow it.
-    size_t maxWritableWithoutGrowing = bytesBeyondBufferNeedle();
-    if (maxWritableWithoutGrowing < length) {
-        if (!grow(length - maxWritableWithoutGrowing)) {
+    while (length) {
+        ssize_t ret = ::pwrite(fd, data, length, offset);
+        if (ret < 0 && errno != EINTR) {
             return false;
+        } else if (ret >= 0) {
+            data += ret;
+            length -= ret;
+            offset += ret;
         }
-        assert(bytesBeyondBufferNeedle() >= length);
     }
+    return true;
+}
 
-    while (length) {
-        if (d_bufferNeedle == d_bufferEnd) {
-            // We've reached the end of our window. Slide it forward.
-            if (!seek(d_bufferOffset + (d_bufferEnd - d_buffer), SEEK_SET)) {
+int
+openOutputFile(const std::string& file_name, bool overwrite)
+{
+    int flags = O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC;
+    if (!overwrite) {
+        flags |= O_EXCL;
+    }
+    int fd;
+    do {
+        fd = ::open(file_name.c_str(), flags, 0644);
+    } while (fd < 0 && errno == EINTR);
+    return fd;
+}
+
+// Hands the data written to a sink over to a background thread, which
+// consumes it with the given callback, so that the threads writing records
+// only ever copy them into memory.
+//
+// The data is collected in a buffer that is handed to the background thread
+// whenever it fills up or is handed off explicitly, while a second buffer is
+// filled in the meantime. A writer only blocks when it fills a buffer before
+// the previous one has been consumed. Nothing is ever dropped: the records
+// are delta encoded, so a reader can't resynchronize after a gap.
+class BackgroundWriter
+{
+  public:
+    // Called on the background thread with every buffer that is handed off,
+    // and the offset in the stream that it starts at. Once it fails, every
+    // later hand off fails too.
+    using consumer_t = std::function<bool(const char* data, size_t length, size_t offset)>;
+
+    BackgroundWriter(size_t buffer_size, consumer_t consumer)
+    : d_buffer_size(buffer_size)
+    , d_consumer(std::move(consumer))
+    , d_buffer(new char[buffer_size])
+    {
+        d_thread = std::thread(&BackgroundWriter::run, this);
+    }
+
+    ~BackgroundWriter()
+    {
+        finish();
+    }
+
+    BackgroundWriter(BackgroundWriter&) = delete;
+    BackgroundWriter(BackgroundWriter&&) = delete;
+    void operator=(const BackgroundWriter&) = delete;
+    void operator=(const BackgroundWriter&&) = delete;
+
+    bool writeAll(const char* data, size_t length)
+    {
+        while (length) {
+            if (d_buffer_used == d_buffer_size && !handOff(true)) {
                 return false;
             }
+            size_t toCopy = std::min(d_buffer_size - d_buffer_used, length);
+            memcpy(d_buffer.get() + d_buffer_used, data, toCopy);
+            d_buffer_used += toCopy;
+            data += toCopy;
+            length -= toCopy;
+        }
+        return true;
+    }
+
+    // Hand the buffered data over to the background thread. Unless told to
+    // wait, it stays buffered if the thread is still busy with an earlier
+    // buffer, and is handed off with the next one. An empty buffer is only
+    // handed off if asked to, for consumers that have more to write than
+    // what is buffered.
+    bool handOff(bool wait, bool even_if_empty = false)
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        if (d_has_pending) {
+            if (!wait) {
+                return !d_failed;
+            }
+            d_cv.wait(lock, [this]() { return !d_has_pending; });
+        }
+        if (d_failed) {
+            return false;
+        }
+        if (d_buffer_used == 0 && !even_if_empty) {
+            return true;
+        }
+
+        std::swap(d_pending, d_buffer);
+        d_pending_size = d_buffer_used;
+        d_pending_offset = d_buffer_offset;
+        d_has_pending = true;
+        if (d_spare) {
+            d_buffer = std::move(d_spare);
+        } else if (!d_buffer) {
+            d_buffer.reset(new char[d_buffer_size]);
+        }
+        d_buffer_offset += d_buffer_used;
+        d_buffer_used = 0;
+        d_cv.notify_all();
+        return true;
+    }
+
+    // Make what is written next go to the given offset in the stream, once
+    // what is buffered was handed off.
+    bool moveTo(size_t offset)
+    {
+        if (!handOff(true)) {
+            return false;
+        }
+        d_buffer_offset = offset;
+        return true;
+    }
+
+    // Hand off what is left, wait until everything was consumed and stop the
+    // background thread. Returns whether everything was consumed.
+    bool finish()
+    {
+        if (!d_thread.joinable()) {
+            return !d_failed;
         }
+        bool success = handOff(true);
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            d_stop = true;
+            d_cv.notify_all();
+        }
+        d_thread.join();
+        return success && !d_failed;
+    }
+
+  private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        while (true) {
+            d_cv.wait(lock, [this]() { return d_has_pending || d_stop; });
+            if (!d_has_pending) {
+                break;
+            }
+
+            const char* data = d_pending.get();
+            size_t length = d_pending_size;
+            size_t offset = d_pending_offset;
+
+            lock.unlock();
+            bool success = d_consumer(data, length, offset);
+            lock.lock();
 
-        size_t available = d_bufferEnd - d_bufferNeedle;
-        size_t toCopy = std::min(available, length);
-        memcpy(d_bufferNeedle, data, toCopy);
-        d_bufferNeedle += toCopy;
+            d_spare = std::move(d_pending);
+            d_has_pending = false;
+            d_failed = d_failed || !success;
+            d_cv.notify_all();
+        }
+    }
+
+    const size_t d_buffer_size;
+    const consumer_t d_consumer;
+
+    // Only used by the thread writing records.
+    std::unique_ptr<char[]> d_buffer{nullptr};
+    size_t d_buffer_used{0};
+    size_t d_buffer_offset{0};
+
+    // Shared with the background thread, guarded by d_mutex.
+    std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::unique_ptr<char[]> d_pending{nullptr};
+    size_t d_pending_size{0};
+    size_t d_pending_offset{0};
+    bool d_has_pending{false};
+    std::unique_ptr<char[]> d_spare{nullptr};
+    bool d_stop{false};
+    bool d_failed{false};
+
+    std::thread d_thread;
+};
+
+}  // unnamed namespace
+
+// Compresses the data written to a FileSink as it arrives, so that the file on
+// disk is already compressed (and readable) while tracking is still running.
+//
+// The records are handed to a BackgroundWriter, whose thread appends them to
+// the LZ4 frames after the start of the file. A new frame is started every
+// FRAME_SIZE bytes of input, so that readers can decompress several frames
+// at once, and when the sink is closed the offsets of all the frames are
+// written in a skippable frame at the end (see CompressedFrameIndexEntry).
+//
+// The RecordWriter rewrites the header at the start of the stream when it
+// finishes, which can't be done in place in compressed data. Because of that
+// everything written before the sink is first flushed, which the RecordWriter
+// does right after writing the header, is kept in memory as the prefix of the
+// stream. It is compressed on its own into a region reserved at the start of
+// the file every time it changes, and rewriting the stream past it fails.
+// LZ4 readers decode concatenated frames one after another and ignore
+// skippable frames, which we use to pad that region.
+class FileSink::Compressor
+{
+  public:
+    explicit Compressor(int fd);
+    ~Compressor();
+
+    Compressor(Compressor&) = delete;
+    Compressor(Compressor&&) = delete;
+    void operator=(const Compressor&) = delete;
+    void operator=(const Compressor&&) = delete;
+
+    bool writeAll(const char* data, size_t length);
+    bool seek(off_t offset, int whence);
+    bool flush();
+
+  private:
+    static constexpr size_t BUFFER_SIZE{16 * 1024 * 1024};  // 16 MiB
+    static constexpr size_t FRAME_SIZE{1024 * 1024};  // 1 MiB
+    static constexpr uint32_t SKIPPABLE_FRAME_MAGIC{0x184D2A50};
+
+    void closePrefix();
+    bool prefixDirty();
+    bool compressChunk(const char* data, size_t length);
+    bool startFrame();
+    bool endFrame();
+    bool writePrefix(const std::vector<char>& prefix);
+    bool writeFrameIndex();
+    bool finish();
+
+    int d_fd;
+    LZ4F_preferences_t d_preferences{};
+    // Set by closePrefix(), before anything is handed to the compressing
+    // thread.
+    size_t d_prefix_region_size{0};
+
+    // Only used by the writing thread.
+    size_t d_position{0};
+    size_t d_size{0};
+    bool d_prefix_closed{false};
+    size_t d_prefix_size{0};
+
+    // Shared with the compressing thread, guarded by d_prefix_mutex.
+    std::mutex d_prefix_mutex;
+    std::vector<char> d_prefix{};
+    bool d_prefix_dirty{false};
+
+    // Only used by the compressing thread.
+    LZ4F_cctx* d_ctx{nullptr};
+    std::vector<char> d_output{};
+    off_t d_output_offset{0};
+    bool d_frame_open{false};
+    size_t d_frame_size{0};
+    uint64_t d_frame_start{0};
+    std::vector<tracking_api::CompressedFrameIndexEntry> d_frame_index{};
+
+    BackgroundWriter d_background;
+};
+
+FileSink::Compressor::Compressor(int fd)
+: d_fd(fd)
+, d_background(BUFFER_SIZE, [this](const char* data, size_t length, size_t) {
+    std::vector<char> prefix;
+    {
+        std::lock_guard<std::mutex> lock(d_prefix_mutex);
+        if (d_prefix_dirty) {
+            prefix = d_prefix;
+            d_prefix_dirty = false;
+        }
+    }
+    return compressChunk(data, length) && (prefix.empty() || writePrefix(prefix));
+})
+{
+    d_preferences.frameInfo.blockMode = LZ4F_blockLinked;
+    d_output.resize(LZ4F_compressBound(FRAME_SIZE, &d_preferences));
+
+    size_t ret = LZ4F_createCompressionContext(&d_ctx, LZ4F_VERSION);
+    if (LZ4F_isError(ret)) {
+        throw IoError{std::string("Failed to create LZ4 compression context: ") + LZ4F_getErrorName(ret)};
+    }
+    // The prefix region decompresses to the start of the stream.
+    d_frame_index.push_back({0, 0});
+}
+
+FileSink::Compressor::~Compressor()
+{
+    if (!finish()) {
+        std::cerr << "Failed to compress output file" << std::endl;
+    }
+    LZ4F_freeCompressionContext(d_ctx);
+}
+
+bool
+FileSink::Compressor::writeAll(const char* data, size_t length)
+{
+    const size_t prefix_size = d_prefix_closed ? d_prefix_size : SIZE_MAX;
+    if (length && d_position < prefix_size) {
+        size_t toCopy = std::min(prefix_size - d_position, length);
+        std::lock_guard<std::mutex> lock(d_prefix_mutex);
+        if (d_prefix.size() < d_position + toCopy) {
+            d_prefix.resize(d_position + toCopy);
+        }
+        memcpy(d_prefix.data() + d_position, data, toCopy);
+        d_prefix_dirty = true;
+        d_position += toCopy;
+        d_size = std::max(d_size, d_position);
         data += toCopy;
         length -= toCopy;
     }
-    return true;
+
+    if (length && d_position != d_size) {
+        // Only the prefix can be overwritten, the rest is already compressed.
+        LOG(ERROR) << "Can't rewrite more than the first " << d_prefix_size
+                   << " bytes of a compressed capture file";
+        errno = EINVAL;
+        return false;
+    }
+
+    d_position += length;
+    d_size += length;
+    return d_background.writeAll(data, length);
 }
 
-FileSink::FileSink(const std::string& file_name, bool overwrite, bool compress)
-: d_filename(file_name)
-, d_fileNameStem(removeSuffix(file_name, "." + std::to_string(::getpid())))
-, d_compress(compress)
+bool
+FileSink::Compressor::seek(off_t offset, int whence)
 {
-    int flags = O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC;
-    if (!overwrite) {
-        flags |= O_EXCL;
+    if (whence == SEEK_END) {
+        offset += d_size;
+    } else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return false;
     }
-    do {
-        d_fd = ::open(file_name.c_str(), flags, 0644);
-    } while (d_fd < 0 && errno == EINTR);
-    if (d_fd < 0) {
-        throw IoError{"Could not create output file " + file_name + ": " + std::string(strerror(errno))};
+
+    size_t position = static_cast<size_t>(offset);
+    const size_t prefix_size = d_prefix_closed ? d_prefix_size : d_size;
+    if (offset < 0 || (position != d_size && position > std::min(d_size, prefix_size))) {
+        errno = EINVAL;
+        return false;
     }
+    d_position = position;
+    return true;
 }
 
 bool
-FileSink::seek(off_t offset, int whence)
+FileSink::Compressor::flush()
 {
-    // Don't allow seeking relative to the current offset. We move the offset
-    // when we grow the file, and don't move it when we write, so users can't
-    // possibly know what the offset is.
-    if (whence != SEEK_SET && whence != SEEK_END) {
-        errno = EINVAL;
+    if (!d_prefix_closed && d_size) {
+        closePrefix();
+    }
+    // Don't wait for the compressing thread: if it is still busy with an
+    // earlier chunk, the buffered data will be handed off with the next one.
+    return d_background.handOff(false, prefixDirty());
+}
+
+void
+FileSink::Compressor::closePrefix()
+{
+    // Nothing was handed off yet, so the compressing thread isn't using any
+    // of what is set here.
+    d_prefix_closed = true;
+    d_prefix_size = d_size;
+    d_prefix_region_size =
+            LZ4F_compressFrameBound(d_prefix_size, &d_preferences) + 2 * sizeof(uint32_t);
+    d_output_offset = d_prefix_region_size;
+    d_frame_start = d_prefix_size;
+}
+
+bool
+FileSink::Compressor::prefixDirty()
+{
+    std::lock_guard<std::mutex> lock(d_prefix_mutex);
+    return d_prefix_dirty;
+}
+
+bool
+FileSink::Compressor::compressChunk(const char* data, size_t length)
+{
+    while (length) {
+        if (!d_frame_open && !startFrame()) {
+            return false;
+        }
+        size_t toCompress = std::min(length, FRAME_SIZE - d_frame_size);
+        size_t ret = LZ4F_compressUpdate(d_ctx, d_output.data(), d_output.size(), data, toCompress, nullptr);
+        if (LZ4F_isError(ret) || !writeAllAt(d_fd, d_output.data(), ret, d_output_offset)) {
+            return false;
+        }
+        d_output_offset += ret;
+        d_frame_size += toCompress;
+        data += toCompress;
+        length -= toCompress;
+        if (d_frame_size == FRAME_SIZE && !endFrame()) {
+            return false;
+        }
+    }
+    if (!d_frame_open) {
+        return true;
+    }
+
+    // Flush so that everything handed to us so far can be decompressed, even
+    // if the process is killed before the frame is finished.
+    size_t ret = LZ4F_flush(d_ctx, d_output.data(), d_output.size(), nullptr);
+    if (LZ4F_isError(ret) || !writeAllAt(d_fd, d_output.data(), ret, d_output_offset)) {
         return false;
     }
+    d_output_offset += ret;
+    return true;
+}
 
-    // Convert offset to an absolute position, if it isn't already
-    if (whence != SEEK_SET) {
-        offset = lseek(d_fd, offset, whence);
+bool
+FileSink::Compressor::startFrame()
+{
+    size_t ret = LZ4F_compressBegin(d_ctx, d_output.data(), d_output.size(), &d_preferences);
+    if (LZ4F_isError(ret) || !writeAllAt(d_fd, d_output.data(), ret, d_output_offset)) {
+        return false;
     }
+    d_frame_index.push_back({static_cast<uint64_t>(d_output_offset), d_frame_start});
+    d_output_offset += ret;
+    d_frame_open = true;
+    d_frame_size = 0;
+    return true;
+}
 
-    if (offset < 0) {
-        errno = EINVAL;
+bool
+FileSink::Compressor::endFrame()
+{
+    size_t ret = LZ4F_compressEnd(d_ctx, d_output.data(), d_output.size(), nullptr);
+    if (LZ4F_isError(ret) || !writeAllAt(d_fd, d_output.data(), ret, d_output_offset)) {
         return false;
     }
+    d_output_offset += ret;
+    d_frame_open = false;
+    d_frame_start += d_frame_size;
+    return true;
+}
 
-    // Free our existing buffer, if any
-    if (d_buffer && 0 != munmap(d_buffer, BUFFER_SIZE)) {
+bool
+FileSink::Compressor::writePrefix(const std::vector<char>& prefix)
+{
+    std::vector<char> frame(d_prefix_region_size);
+    size_t ret = LZ4F_compressFrame(
+            frame.data(),
+            frame.size() - 2 * sizeof(uint32_t),
+            prefix.data(),
+            prefix.size(),
+            &d_preferences);
+    if (LZ4F_isError(ret)) {
         return false;
     }
 
-    // Note: It is OK to map beyond the end of the file,
-    //       though not to write beyond the end.
-    d_buffer = static_cast<char*>(mmap(d_buffer, BUFFER_SIZE, PROT_WRITE, MAP_SHARED, d_fd, offset));
-    if (d_buffer == MAP_FAILED) {
-        d_buffer = nullptr;
+    // Pad the rest of the region with a skippable frame (written little endian).
+    uint32_t padding = d_prefix_region_size - ret - 2 * sizeof(uint32_t);
+    for (uint32_t value : {SKIPPABLE_FRAME_MAGIC, padding}) {
+        for (size_t i = 0; i < sizeof(value); ++i) {
+            frame[ret++] = static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+    }
+    return writeAllAt(d_fd, frame.data(), ret, 0);
+}
+
+bool
+FileSink::Compressor::finish()
+{
+    if (!d_prefix_closed) {
+        closePrefix();
+    }
+    bool success = d_background.handOff(true, prefixDirty());
+    if (!d_background.finish() || !success) {
         return false;
     }
-    d_bufferNeedle = d_buffer;
-    d_bufferOffset = offset;
 
-    size_t bytesRemaining = d_fileSize - offset;
-    d_bufferEnd = d_buffer + std::min(bytesRemaining, BUFFER_SIZE);
+    return (!d_frame_open || endFrame()) && writeFrameIndex();
+}
+
+bool
+FileSink::Compressor::writeFrameIndex()
+{
+    d_frame_index.push_back({static_cast<uint64_t>(d_output_offset), d_size});
+    const uint64_t n_entries = d_frame_index.size();
+    const uint32_t payload_size = n_entries * sizeof(tracking_api::CompressedFrameIndexEntry)
+                                  + sizeof(n_entries) + sizeof(tracking_api::COMPRESSED_FRAME_INDEX_TAG);
+
+    // Everything in the frame is little endian, like the LZ4 format itself.
+    std::vector<char> frame;
+    frame.reserve(2 * sizeof(uint32_t) + payload_size);
+    auto append = [&](uint64_t value, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            frame.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+    };
+    append(tracking_api::COMPRESSED_FRAME_INDEX_MAGIC, sizeof(uint32_t));
+    append(payload_size, sizeof(uint32_t));
+    for (const auto& entry : d_frame_index) {
+        append(entry.compressed_offset, sizeof(uint64_t));
+        append(entry.uncompressed_offset, sizeof(uint64_t));
+    }
+    append(n_entries, sizeof(n_entries));
+    const auto& tag = tracking_api::COMPRESSED_FRAME_INDEX_TAG;
+    frame.insert(frame.end(), std::begin(tag), std::end(tag));
+    return writeAllAt(d_fd, frame.data(), frame.size(), d_output_offset);
+}
+
+// Writes the data written to an uncompressed FileSink from a background
+// thread, so that the threads writing records only ever copy them into
+// memory. Mapping the file into memory instead means that the page faults,
+// and the growing and remapping of the file whenever a window of it fills
+// up, happen on whichever thread holds the writer's lock at the time.
+//
+// The records are handed to a BackgroundWriter whenever its buffer fills up,
+// the sink is flushed or the position is moved, along with the offset they go
+// to. Its thread reserves space for the file in large extents ahead of what it
+// writes, so that the file system doesn't allocate blocks for every write, and
+// the unused part of the last extent is given back when the sink is finished.
+// If the process is killed before that, the file ends with the zeroes readers
+// already ignore.
+//
+// Unlike pages of a mapped file, the buffers are lost if the process is
+// killed. The RecordWriter flushes the sink with every memory record, which
+// hands the buffered records off, so what is lost is at most what was written
+// since the last memory record or two.
+class FileSink::Writer
+{
+  public:
+    explicit Writer(int fd);
+    ~Writer();
+
+    Writer(Writer&) = delete;
+    Writer(Writer&&) = delete;
+    void operator=(const Writer&) = delete;
+    void operator=(const Writer&&) = delete;
+
+    bool writeAll(const char* data, size_t length);
+    bool seek(off_t offset, int whence);
+    bool flush();
+
+  private:
+    static constexpr size_t BUFFER_SIZE{4 * 1024 * 1024};  // 4 MiB
+    static constexpr size_t EXTENT_SIZE{64 * 1024 * 1024};  // 64 MiB
+
+    bool writeChunk(const char* data, size_t length, size_t offset);
+    bool finish();
+
+    int d_fd;
+
+    // Only used by the thread writing records.
+    size_t d_position{0};
+    size_t d_size{0};
+
+    // Only used by the writing thread.
+    size_t d_reserved{0};
+    bool d_reserve_extents{true};
+
+    BackgroundWriter d_background;
+};
+
+FileSink::Writer::Writer(int fd)
+: d_fd(fd)
+, d_background(BUFFER_SIZE, [this](const char* data, size_t length, size_t offset) {
+    return writeChunk(data, length, offset);
+})
+{
+}
+
+FileSink::Writer::~Writer()
+{
+    if (!finish()) {
+        std::cerr << "Failed to write output file" << std::endl;
+    }
+}
+
+bool
+FileSink::Writer::writeAll(const char* data, size_t length)
+{
+    d_position += length;
+    d_size = std::max(d_size, d_position);
+    return d_background.writeAll(data, length);
+}
+
+bool
+FileSink::Writer::seek(off_t offset, int whence)
+{
+    if (whence == SEEK_END) {
+        offset += d_size;
+    } else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return false;
+    }
+    if (offset < 0) {
+        errno = EINVAL;
+        return false;
+    }
 
+    // What is buffered goes where it was written, before the position moves.
+    if (!d_background.moveTo(static_cast<size_t>(offset))) {
+        return false;
+    }
+    d_position = static_cast<size_t>(offset);
     return true;
 }
 
 bool
-FileSink::grow(size_t needed)
+FileSink::Writer::flush()
+{
+    // Don't wait for the writing thread: if it is still busy with an earlier
+    // chunk, the buffered data will be handed off with the next one.
+    return d_background.handOff(false);
+}
+
+bool
+FileSink::Writer::writeChunk(const char* data, size_t length, size_t offset)
+{
+    const size_t end = offset + length;
+    if (d_reserve_extents && end > d_reserved) {
+        // Reserving space is only an optimization, so writing is attempted
+        // anyway if the file system doesn't support it.
+        const size_t reserved = (end / EXTENT_SIZE + 1) * EXTENT_SIZE;
+        if (posix_fallocate(d_fd, d_reserved, reserved - d_reserved) == 0) {
+            d_reserved = reserved;
+        } else {
+            d_reserve_extents = false;
+        }
+    }
+    return writeAllAt(d_fd, data, length, offset);
+}
+
+bool
+FileSink::Writer::finish()
 {
-    static size_t pagesize = sysconf(_SC_PAGESIZE);
-    // Grow to next multiple of the page size that is strictly > 110% of current size + needed
-    size_t new_size = (d_fileSize + needed) * 1.1;
-    new_size = (new_size / pagesize + 1) * pagesize;
-    assert(new_size > d_fileSize);  // check for overflow
+    if (!d_background.finish()) {
+        return false;
+    }
 
-    off_t delta = new_size - d_fileSize;
+    // Give back the part of the last extent that wasn't written to.
     int rc;
     do {
-        // posix_fallocate returns an error number instead of setting errno
-        rc = posix_fallocate(d_fd, d_fileSize, delta);
-    } while (rc == EINTR);
+        rc = ::ftruncate(d_fd, d_size);
+    } while (rc != 0 && errno == EINTR);
+    return rc == 0;
+}
 
-    if (rc != 0) {
-        errno = rc;
-        return false;
+bool
+FileSink::writeAll(const char* data, size_t length)
+{
+    if (d_compressor) {
+        return d_compressor->writeAll(data, length);
     }
+    return d_writer && d_writer->writeAll(data, length);
+}
 
-    d_fileSize = new_size;
-    assert(static_cast<off_t>(d_fileSize) == lseek(d_fd, 0, SEEK_END));
+FileSink::FileSink(const std::string& file_name, bool overwrite, bool compress)
+: d_filename(file_name)
+, d_fileNameStem(removeSuffix(file_name, "." + std::to_string(::getpid())))
+, d_compress(compress)
+{
+    d_fd = openOutputFile(file_name, overwrite);
+    if (d_fd < 0) {
+        throw IoError{"Could not create output file " + file_name + ": " + std::string(strerror(errno))};
+    }
+    try {
+        startStream();
+    } catch (...) {
+        ::close(d_fd);
+        throw;
+    }
+}
 
-    return true;
+void
+FileSink::startStream()
+{
+    if (d_compress) {
+        d_compressor = std::make_unique<Compressor>(d_fd);
+    } else {
+        d_writer = std::make_unique<Writer>(d_fd);
+    }
 }
 
-size_t
-FileSink::bytesBeyondBufferNeedle()
+bool
+FileSink::seek(off_t offset, int whence)
 {
-    size_t bytesBeyondBuffer = d_fileSize - d_bufferOffset;
-    size_t positionWithinBuffer = d_bufferNeedle - d_buffer;
-    return bytesBeyondBuffer - positionWithinBuffer;
+    // Don't allow seeking relative to the current offset. Nothing is written
+    // to the file right away, so users can't possibly know what it is.
+    if (whence != SEEK_SET && whence != SEEK_END) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (d_compressor) {
+        return d_compressor->seek(offset, whence);
+    }
+    return d_writer && d_writer->seek(offset, whence);
 }
 
 std::unique_ptr<Sink>
@@ -188,108 +767,201 @@ FileSink::cloneInChildProcess()
     return std::make_unique<FileSink>(file_name, true, d_compress);
 }
 
-void
-FileSink::compress() noexcept
+std::string
+FileSink::fileNameForChildren() const
 {
-    std::ifstream in_file(d_filename);
-    std::string tmp_filename = d_filename + ".lz4.tmp";
-    std::ofstream out_file(tmp_filename);
-    bool success = true;
-    constexpr size_t bufsize = 4 * 1024;
+    // The children's files are named after this one, so they are next to it.
+    // Once rotated, what was written first may be gone.
+    if (d_rotations) {
+        return {};
+    }
+    return d_filename.substr(d_filename.rfind('/') + 1);
+}
 
-    // lz4_stream is using exceptions rather than failbit/badbit
-    try {
-        lz4_stream::ostream lz4_stream(out_file);
-        std::vector<char> buf(bufsize);
-        while (in_file) {
-            in_file.read(&buf[0], buf.size());
-            lz4_stream.write(&buf[0], in_file.gcount());
-        }
-    } catch (...) {
-        success = false;
+bool
+FileSink::flush()
+{
+    if (d_compressor) {
+        return d_compressor->flush();
     }
+    return d_writer && d_writer->flush();
+}
+
+bool
+FileSink::truncate()
+{
+    // Finish the current stream first, as doing so writes to the file, and
+    // start a new one once the file is empty again.
+    d_compressor.reset();
+    d_writer.reset();
 
-    out_file.close();
-    if (!in_file.eof() || !out_file) {
-        success = false;
+    int rc;
+    do {
+        rc = ::ftruncate(d_fd, 0);
+    } while (rc != 0 && errno == EINTR);
+    if (rc != 0) {
+        return false;
     }
 
-    if (!success) {
-        std::cerr << "Failed to compress input file" << std::endl;
-        ::unlink(tmp_filename.c_str());
-    } else if (0 != std::rename(tmp_filename.c_str(), d_filename.c_str())) {
-        std::perror("Error moving compressed file back to original name");
-        ::unlink(tmp_filename.c_str());
+    try {
+        startStream();
+    } catch (const std::exception&) {
+        return false;
     }
+    return true;
 }
 
-FileSink::~FileSink()
+bool
+FileSink::rotate(size_t max_files)
 {
-    if (d_buffer) {
-        if (0 != munmap(d_buffer, BUFFER_SIZE)) {
-            LOG(ERROR) << "Failed to unmap output file: " << strerror(errno);
-        }
-        d_buffer = d_bufferNeedle = d_bufferEnd = nullptr;
+    // Finish the current stream, which writes to the file, before closing it.
+    d_compressor.reset();
+    d_writer.reset();
+    ::close(d_fd);
+
+    d_rotations += 1;
+    d_fd = openOutputFile(rotatedFileName(d_rotations), true);
+    if (d_fd < 0) {
+        return false;
     }
-    if (d_fd != -1) {
-        ::close(d_fd);
+    if (max_files && d_rotations >= max_files) {
+        // Only the oldest file that is kept needs checking, since the ones
+        // before it were removed by earlier rotations.
+        const std::string oldest = rotatedFileName(d_rotations - max_files);
+        if (::unlink(oldest.c_str()) != 0 && errno != ENOENT) {
+            LOG(WARNING) << "Failed to remove rotated output file " << oldest << ": "
+                         << strerror(errno);
+        }
     }
 
-    if (d_compress) {
-        compress();
+    try {
+        startStream();
+    } catch (const std::exception&) {
+        return false;
     }
+    return true;
 }
 
-SocketSink::SocketSink(std::string host, uint16_t port)
-: d_host(std::move(host))
-, d_port(port)
-, d_buffer(new char[BUFFER_SIZE])
-, d_bufferNeedle(d_buffer.get())
+std::string
+FileSink::rotatedFileName(size_t rotation) const
 {
-    open();
+    // The first file keeps the name it was given, so that tracking without
+    // rotation writes to the same file.
+    if (rotation == 0) {
+        return d_filename;
+    }
+    return d_filename + ".part" + std::to_string(rotation);
 }
 
-size_t
-SocketSink::freeSpaceInBuffer()
+FileSink::~FileSink()
 {
-    return BUFFER_SIZE - (d_bufferNeedle - d_buffer.get());
+    // Finish the stream (which writes the rest of the file) before closing.
+    d_compressor.reset();
+    d_writer.reset();
+
+    if (d_fd != -1) {
+        ::close(d_fd);
+    }
 }
 
-bool
-SocketSink::writeAll(const char* data, size_t length)
+// Sends the data written to a SocketSink from a background thread, so that
+// the threads writing records don't wait for the network on every flush.
+//
+// The records are handed to a BackgroundWriter whenever its buffer fills up or
+// the sink is flushed. A writer only blocks when it fills a buffer before the
+// previous one has been sent, which is the only way to apply backpressure
+// without dropping parts of the stream.
+//
+// When compressing, the sending thread appends every buffer to a single LZ4
+// frame and flushes it before sending, so that the reader can decode
+// everything it has received so far without waiting for the next buffer.
+class SocketSink::Sender
 {
-    while (freeSpaceInBuffer() < length) {
-        size_t toWrite = freeSpaceInBuffer();
-        memcpy(d_bufferNeedle, data, toWrite);
-        d_bufferNeedle += toWrite;
-        data += toWrite;
-        length -= toWrite;
-        if (!flush()) {
-            return false;
+  public:
+    Sender(int fd, bool compress);
+    ~Sender();
+
+    Sender(Sender&) = delete;
+    Sender(Sender&&) = delete;
+    void operator=(const Sender&) = delete;
+    void operator=(const Sender&&) = delete;
+
+    bool writeAll(const char* data, size_t length);
+    bool flush();
+
+  private:
+    static constexpr size_t BUFFER_SIZE{1024 * 1024};  // 1 MiB
+    static constexpr size_t SLICE_SIZE{256 * 1024};  // 256 KiB
+
+    bool sendAll(const char* data, size_t length);
+    bool compressAndSend(const char* data, size_t length);
+    bool finish();
+
+    int d_fd;
+
+    // Only used by the sending thread, and only when compressing.
+    LZ4F_cctx* d_ctx{nullptr};
+    std::vector<char> d_output{};
+
+    BackgroundWriter d_background;
+};
+
+SocketSink::Sender::Sender(int fd, bool compress)
+: d_fd(fd)
+, d_background(BUFFER_SIZE, [this](const char* data, size_t length, size_t) {
+    return d_ctx ? compressAndSend(data, length) : sendAll(data, length);
+})
+{
+    if (compress) {
+        LZ4F_preferences_t preferences{};
+        preferences.frameInfo.blockMode = LZ4F_blockLinked;
+        d_output.resize(LZ4F_compressBound(SLICE_SIZE, &preferences));
+
+        size_t ret = LZ4F_createCompressionContext(&d_ctx, LZ4F_VERSION);
+        if (LZ4F_isError(ret)) {
+            throw IoError{std::string("Failed to create LZ4 compression context: ") + LZ4F_getErrorName(ret)};
+        }
+        ret = LZ4F_compressBegin(d_ctx, d_output.data(), d_output.size(), &preferences);
+        if (LZ4F_isError(ret)) {
+            LZ4F_freeCompressionContext(d_ctx);
+            throw IoError{std::string("Failed to start LZ4 compression: ") + LZ4F_getErrorName(ret)};
+        }
+        if (!sendAll(d_output.data(), ret)) {
+            LZ4F_freeCompressionContext(d_ctx);
+            throw IoError{"Failed to send to the socket: " + std::string(strerror(errno))};
         }
     }
+}
 
-    memcpy(d_bufferNeedle, data, length);
-    d_bufferNeedle += length;
-    return true;
+SocketSink::Sender::~Sender()
+{
+    if (!finish()) {
+        LOG(ERROR) << "Failed to send the remaining records: " << strerror(errno);
+    }
+    if (d_ctx) {
+        LZ4F_freeCompressionContext(d_ctx);
+    }
 }
 
 bool
-SocketSink::flush()
+SocketSink::Sender::writeAll(const char* data, size_t length)
 {
-    return _flush();
+    return d_background.writeAll(data, length);
 }
 
 bool
-SocketSink::_flush()
+SocketSink::Sender::flush()
 {
-    const char* data = d_buffer.get();
-    size_t length = d_bufferNeedle - data;
-
-    d_bufferNeedle = d_buffer.get();
+    // Don't wait for the sending thread: if it is still busy with an earlier
+    // buffer, the data will be handed off with the next flush.
+    return d_background.handOff(false);
+}
 
+bool
+SocketSink::Sender::sendAll(const char* data, size_t length)
+{
     while (length) {
-        ssize_t ret = ::send(d_socket_fd, data, length, 0);
+        ssize_t ret = ::send(d_fd, data, length, 0);
         if (ret < 0 && errno != EINTR) {
             return false;
         } else if (ret >= 0) {
@@ -300,6 +972,58 @@ SocketSink::_flush()
     return true;
 }
 
+bool
+SocketSink::Sender::compressAndSend(const char* data, size_t length)
+{
+    while (length) {
+        size_t toCompress = std::min(length, SLICE_SIZE);
+        size_t ret = LZ4F_compressUpdate(d_ctx, d_output.data(), d_output.size(), data, toCompress, nullptr);
+        if (LZ4F_isError(ret) || !sendAll(d_output.data(), ret)) {
+            return false;
+        }
+        data += toCompress;
+        length -= toCompress;
+    }
+
+    size_t ret = LZ4F_flush(d_ctx, d_output.data(), d_output.size(), nullptr);
+    return !LZ4F_isError(ret) && sendAll(d_output.data(), ret);
+}
+
+bool
+SocketSink::Sender::finish()
+{
+    if (!d_background.finish()) {
+        return false;
+    }
+    if (d_ctx) {
+        size_t ret = LZ4F_compressEnd(d_ctx, d_output.data(), d_output.size(), nullptr);
+        return !LZ4F_isError(ret) && sendAll(d_output.data(), ret);
+    }
+    return true;
+}
+
+SocketSink::SocketSink(std::string host, uint16_t port, bool compress)
+: d_host(std::move(host))
+, d_port(port)
+{
+    open();
+    if (d_socket_open) {
+        d_sender = std::make_unique<Sender>(d_socket_fd, compress);
+    }
+}
+
+bool
+SocketSink::writeAll(const char* data, size_t length)
+{
+    return d_sender && d_sender->writeAll(data, length);
+}
+
+bool
+SocketSink::flush()
+{
+    return d_sender && d_sender->flush();
+}
+
 bool
 SocketSink::seek(__attribute__((unused)) off_t offset, __attribute__((unused)) int whence)
 {
@@ -319,7 +1043,7 @@ SocketSink::cloneInChildProcess()
 SocketSink::~SocketSink()
 {
     if (d_socket_open) {
-        _flush();
+        d_sender.reset();
         ::close(d_socket_fd);
         d_socket_open = false;
     }
@@ -383,6 +1107,58 @@ SocketSink::open()
     d_socket_open = true;
 }
 
+PipeSink::PipeSink(std::shared_ptr<Pipe> pipe)
+: d_pipe(std::move(pipe))
+{
+    d_buffer.reserve(BUFFER_SIZE);
+}
+
+PipeSink::~PipeSink()
+{
+    flush();
+    d_pipe->close(false);
+}
+
+bool
+PipeSink::writeAll(const char* data, size_t length)
+{
+    d_buffer.append(data, length);
+    if (!d_flushed || d_buffer.size() >= BUFFER_SIZE) {
+        std::string chunk;
+        chunk.reserve(d_flushed ? BUFFER_SIZE : 0);
+        d_buffer.swap(chunk);
+        d_pipe->write(std::move(chunk));
+    }
+    return true;
+}
+
+bool
+PipeSink::seek(__attribute__((unused)) off_t offset, __attribute__((unused)) int whence)
+{
+    return false;
+}
+
+std::unique_ptr<Sink>
+PipeSink::cloneInChildProcess()
+{
+    // The reading thread doesn't survive a fork.
+    return {};
+}
+
+bool
+PipeSink::flush()
+{
+    d_flushed = true;
+    if (d_buffer.empty()) {
+        return true;
+    }
+    std::string chunk;
+    chunk.reserve(BUFFER_SIZE);
+    d_buffer.swap(chunk);
+    d_pipe->write(std::move(chunk));
+    return true;
+}
+
 NullSink::~NullSink()
 {
 }
@@ -405,4 +1181,16 @@ NullSink::cloneInChildProcess()
     return std::make_unique<NullSink>();
 }
 
+bool
+NullSink::truncate()
+{
+    return true;
+}
+
+bool
+NullSink::rotate(size_t)
+{
+    return true;
+}
+
 }  // namespace memray::io
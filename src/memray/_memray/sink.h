@@ -5,6 +5,7 @@
 #include <string>
 #include <unistd.h>
 
+#include "pipe.h"
 #include "records.h"
 
 namespace memray::io {
@@ -20,6 +21,26 @@ class Sink
     {
         return true;
     }
+    // Discard everything written so far, so that the next write starts over
+    // at the beginning of the destination. Not every sink supports this.
+    virtual bool truncate()
+    {
+        return false;
+    }
+    // Finish the destination written so far and carry on in a new one,
+    // keeping at most the given number of them (0 keeps all of them). Not
+    // every sink supports this.
+    virtual bool rotate(size_t)
+    {
+        return false;
+    }
+    // The name of the file written to, relative to the directory that the
+    // sinks cloned in child processes write to, or an empty string if the
+    // sink doesn't write to a file they can read back.
+    virtual std::string fileNameForChildren() const
+    {
+        return {};
+    }
 };
 
 class FileSink : public memray::io::Sink
@@ -36,28 +57,32 @@ class FileSink : public memray::io::Sink
     bool seek(off_t offset, int whence) override;
     std::unique_ptr<Sink> cloneInChildProcess() override;
 
+    bool flush() override;
+    bool truncate() override;
+    bool rotate(size_t max_files) override;
+    std::string fileNameForChildren() const override;
+
   private:
-    void compress() noexcept;
-    bool grow(size_t needed);
-    bool slideWindow();
-    size_t bytesBeyondBufferNeedle();
+    class Compressor;
+    class Writer;
+
+    void startStream();
+    std::string rotatedFileName(size_t rotation) const;
 
     std::string d_filename;
     std::string d_fileNameStem;
     bool d_compress{1};
     int d_fd{-1};
-    size_t d_fileSize{0};
-    const size_t BUFFER_SIZE{16 * 1024 * 1024};  // 16 MiB
-    size_t d_bufferOffset{0};
-    char* d_buffer{nullptr};
-    char* d_bufferEnd{nullptr};  // exclusive
-    char* d_bufferNeedle{nullptr};
+    size_t d_rotations{0};
+    // Exactly one of these is set while the file is open.
+    std::unique_ptr<Compressor> d_compressor{nullptr};
+    std::unique_ptr<Writer> d_writer{nullptr};
 };
 
 class SocketSink : public Sink
 {
   public:
-    explicit SocketSink(std::string host, uint16_t port);
+    SocketSink(std::string host, uint16_t port, bool compress);
     ~SocketSink() override;
 
     SocketSink(SocketSink&) = delete;
@@ -71,18 +96,43 @@ class SocketSink : public Sink
     bool flush() override;
 
   private:
-    size_t freeSpaceInBuffer();
+    class Sender;
+
     void open();
-    bool _flush();
 
     const std::string d_host;
     uint16_t d_port;
     int d_socket_fd{-1};
     bool d_socket_open{false};
+    std::unique_ptr<Sender> d_sender{nullptr};
+};
+
+// Hands what's written over to a PipeSource in the same process. Writes are
+// collected in a buffer that is handed over when it fills up or when the
+// writer flushes, except for the ones before the first flush, which are handed
+// over right away so that the reader gets the header without waiting.
+class PipeSink : public Sink
+{
+  public:
+    explicit PipeSink(std::shared_ptr<Pipe> pipe);
+    ~PipeSink() override;
+
+    PipeSink(PipeSink&) = delete;
+    PipeSink(PipeSink&&) = delete;
+    void operator=(const PipeSink&) = delete;
+    void operator=(const PipeSink&&) = delete;
+
+    bool writeAll(const char* data, size_t length) override;
+    bool seek(off_t offset, int whence) override;
+    std::unique_ptr<Sink> cloneInChildProcess() override;
+    bool flush() override;
+
+  private:
+    static constexpr size_t BUFFER_SIZE{256 * 1024};  // 256 KiB
 
-    const size_t BUFFER_SIZE{PIPE_BUF};
-    std::unique_ptr<char[]> d_buffer{nullptr};
-    char* d_bufferNeedle{nullptr};
+    std::shared_ptr<Pipe> d_pipe;
+    std::string d_buffer{};
+    bool d_flushed{false};
 };
 
 class NullSink : public Sink
@@ -92,6 +142,8 @@ class NullSink : public Sink
     bool writeAll(const char* data, size_t length) override;
     bool seek(off_t offset, int whence) override;
     std::unique_ptr<Sink> cloneInChildProcess() override;
+    bool truncate() override;
+    bool rotate(size_t max_files) override;
 };
 
 }  // namespace memray::io
@@ -1,5 +1,7 @@
+from _memray.pipe cimport Pipe
 from libc.stdint cimport int16_t
 from libcpp cimport bool
+from libcpp.memory cimport shared_ptr
 from libcpp.string cimport string
 
 
@@ -11,7 +13,10 @@ cdef extern from "sink.h" namespace "memray::io":
         FileSink(const string& file_name, bool overwrite, bool compress) except +IOError
 
     cdef cppclass SocketSink(Sink):
-        SocketSink(string host, unsigned int port) except +IOError
+        SocketSink(string host, unsigned int port, bool compress) except +IOError
 
     cdef cppclass NullSink(Sink):
         NullSink() except +IOError
+
+    cdef cppclass PipeSink(Sink):
+        PipeSink(shared_ptr[Pipe] pipe) except +
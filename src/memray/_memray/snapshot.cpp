@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <cstdlib>
 #include <numeric>
+#include <stdexcept>
 
 #include "snapshot.h"
 
@@ -59,69 +62,303 @@ Interval::rightIntersects(const Interval& other) const
     return (begin > other.begin) && (end == other.end);
 }
 
+location_id_t
+LocationTable::idFor(const Allocation& allocation)
+{
+    auto loc_key = LocationKey{allocation.frame_index, allocation.native_frame_id, allocation.tid};
+    auto [it, inserted] = d_ids.emplace(loc_key, d_records.size());
+    if (inserted) {
+        d_records.push_back(allocation);
+    } else {
+        // Keep the latest allocation as the one reported for the location,
+        // so that its native stack is resolved with the latest memory maps.
+        d_records[it->second] = allocation;
+    }
+    return it->second;
+}
+
+const Allocation&
+LocationTable::recordFor(location_id_t location) const
+{
+    return d_records[location];
+}
+
+size_t
+LocationTable::size() const noexcept
+{
+    return d_records.size();
+}
+
+reduced_snapshot_map_t
+LocationTable::reduce(const std::vector<Totals>& totals, bool merge_threads) const
+{
+    reduced_snapshot_map_t stack_to_allocation{};
+
+    for (size_t location = 0; location < totals.size(); ++location) {
+        if (totals[location].n_allocations == 0) {
+            continue;
+        }
+        const Allocation& record = d_records[location];
+        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : record.tid;
+        auto loc_key = LocationKey{record.frame_index, record.native_frame_id, thread_id};
+        auto alloc_it = stack_to_allocation.find(loc_key);
+        if (alloc_it == stack_to_allocation.end()) {
+            Allocation new_alloc = record;
+            new_alloc.size = totals[location].size;
+            new_alloc.n_allocations = totals[location].n_allocations;
+            stack_to_allocation.insert(alloc_it, std::pair(loc_key, new_alloc));
+        } else {
+            alloc_it->second.size += totals[location].size;
+            alloc_it->second.n_allocations += totals[location].n_allocations;
+        }
+    }
+
+    return stack_to_allocation;
+}
+
+location_id_t
+SnapshotAllocationAggregator::locationFor(const Allocation& allocation)
+{
+    const location_id_t location = d_locations.idFor(allocation);
+    if (location == d_totals.size()) {
+        d_totals.emplace_back();
+        d_is_changed.push_back(false);
+    }
+    return location;
+}
+
 void
-SnapshotAllocationAggregator::addAllocation(const Allocation& allocation)
+SnapshotAllocationAggregator::markChanged(location_id_t location)
+{
+    if (!d_is_changed[location]) {
+        d_is_changed[location] = true;
+        d_changed_locations.push_back(location);
+    }
+}
+
+void
+SnapshotAllocationAggregator::addToLocation(location_id_t location, size_t size, size_t n_allocations)
+{
+    d_totals[location].size += size;
+    d_totals[location].n_allocations += n_allocations;
+    markChanged(location);
+    if (d_count_intervals) {
+        countInterval(location, size, n_allocations, true);
+    }
+}
+
+void
+SnapshotAllocationAggregator::removeFromLocation(
+        location_id_t location,
+        size_t size,
+        size_t n_allocations)
+{
+    d_totals[location].size -= size;
+    d_totals[location].n_allocations -= n_allocations;
+    markChanged(location);
+    if (d_count_intervals) {
+        countInterval(location, size, n_allocations, false);
+    }
+}
+
+void
+SnapshotAllocationAggregator::enableIntervalTotals()
+{
+    d_count_intervals = true;
+}
+
+void
+SnapshotAllocationAggregator::countInterval(
+        location_id_t location,
+        size_t size,
+        size_t n_allocations,
+        bool allocated)
+{
+    if (location >= d_interval_totals.size()) {
+        d_interval_totals.resize(d_totals.size());
+    }
+    auto& interval = d_interval_totals[location];
+    if (interval.allocated.n_allocations == 0 && interval.freed.n_allocations == 0) {
+        d_interval_locations.push_back(location);
+    }
+    auto& totals = allocated ? interval.allocated : interval.freed;
+    totals.size += size;
+    totals.n_allocations += n_allocations;
+}
+
+size_t
+SnapshotAllocationAggregator::updateLiveAllocations(const Allocation& allocation)
 {
     switch (hooks::allocatorKind(allocation.allocator)) {
         case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
-            d_ptr_to_allocation[allocation.address] = allocation;
-            break;
+            auto [live, inserted] = d_ptr_to_allocation.tryEmplace(allocation.address);
+            if (!inserted) {
+                removeFromLocation(live->location, live->size, live->n_allocations);
+            }
+            *live = LiveAllocation{
+                    allocation.size,
+                    locationFor(allocation),
+                    static_cast<uint32_t>(allocation.n_allocations)};
+            addToLocation(live->location, live->size, live->n_allocations);
+            return 0;
         }
         case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
-            auto it = d_ptr_to_allocation.find(allocation.address);
-            if (it != d_ptr_to_allocation.end()) {
-                d_ptr_to_allocation.erase(it);
+            const auto live = d_ptr_to_allocation.erase(allocation.address);
+            if (!live) {
+                return 0;
             }
-            break;
+            removeFromLocation(live->location, live->size, live->n_allocations);
+            return live->size;
         }
         case hooks::AllocatorKind::RANGED_ALLOCATOR: {
-            d_interval_tree.addInterval(allocation.address, allocation.size, allocation);
-            break;
+            if (allocation.size > 0) {
+                const LiveRange range{
+                        locationFor(allocation),
+                        static_cast<uint32_t>(allocation.n_allocations)};
+                d_interval_tree.addInterval(allocation.address, allocation.size, range);
+                addToLocation(range.location, allocation.size, range.n_allocations);
+            }
+            return 0;
         }
         case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
-            d_interval_tree.removeInterval(allocation.address, allocation.size);
-            break;
+            // As there can be partial deallocations in mmap'd regions, every
+            // piece of a range that is left behind counts as one allocation.
+            std::vector<std::pair<Interval, LiveRange>> remaining;
+            const auto removed =
+                    d_interval_tree.removeInterval(allocation.address, allocation.size, &remaining);
+            if (!removed.has_value()) {
+                return 0;
+            }
+            size_t removed_size = 0;
+            for (const auto& [interval, range] : removed.value()) {
+                removeFromLocation(range.location, interval.size(), range.n_allocations);
+                removed_size += interval.size();
+            }
+            for (const auto& [interval, range] : remaining) {
+                addToLocation(range.location, 0, range.n_allocations);
+            }
+            return removed_size;
         }
     }
-    d_index++;
+    return 0;
+}
+
+void
+SnapshotAllocationAggregator::addAllocation(const Allocation& allocation)
+{
+    updateLiveAllocations(allocation);
 }
 
 reduced_snapshot_map_t
 SnapshotAllocationAggregator::getSnapshotAllocations(bool merge_threads)
 {
-    reduced_snapshot_map_t stack_to_allocation{};
+    return d_locations.reduce(d_totals, merge_threads);
+}
 
-    for (const auto& it : d_ptr_to_allocation) {
-        const Allocation& record = it.second;
-        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : record.tid;
-        auto loc_key = LocationKey{record.frame_index, record.native_frame_id, thread_id};
-        auto alloc_it = stack_to_allocation.find(loc_key);
-        if (alloc_it == stack_to_allocation.end()) {
-            stack_to_allocation.insert(alloc_it, std::pair(loc_key, record));
-        } else {
-            alloc_it->second.size += record.size;
-            alloc_it->second.n_allocations += 1;
+std::vector<std::pair<location_id_t, Allocation>>
+LiveSnapshotAggregator::takeChangedLocations()
+{
+    std::vector<std::pair<location_id_t, Allocation>> changes;
+    consumeChangedLocations([&](location_id_t location) {
+        const auto& totals = currentTotals()[location];
+        Allocation record = locations().recordFor(location);
+        record.size = totals.size;
+        record.n_allocations = totals.n_allocations;
+        changes.emplace_back(location, record);
+    });
+    return changes;
+}
+
+void
+TemporalSnapshotAggregator::addAllocation(const Allocation& allocation)
+{
+    updateLiveAllocations(allocation);
+    switch (hooks::allocatorKind(allocation.allocator)) {
+        case hooks::AllocatorKind::RANGED_ALLOCATOR:
+            if (allocation.size == 0) {
+                break;
+            }
+            [[fallthrough]];
+        case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
+            const location_id_t location = locationFor(allocation);
+            if (location == d_allocated.size()) {
+                d_allocated.emplace_back();
+            }
+            d_allocated[location].size += allocation.size;
+            d_allocated[location].n_allocations += allocation.n_allocations;
+            break;
         }
+        case hooks::AllocatorKind::SIMPLE_DEALLOCATOR:
+        case hooks::AllocatorKind::RANGED_DEALLOCATOR:
+            break;
     }
+}
 
-    // Process ranged allocations. As there can be partial deallocations in mmap'd regions,
-    // we update the allocation to reflect the actual size at the peak, based on the lengths
-    // of the ranges in the interval tree.
-    for (const auto& [range, allocation] : d_interval_tree) {
-        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : allocation.tid;
-        auto loc_key = LocationKey{allocation.frame_index, allocation.native_frame_id, thread_id};
-        auto alloc_it = stack_to_allocation.find(loc_key);
-        if (alloc_it == stack_to_allocation.end()) {
-            Allocation new_alloc = allocation;
-            new_alloc.size = range.size();
-            stack_to_allocation.insert(alloc_it, std::pair(loc_key, new_alloc));
-        } else {
-            alloc_it->second.size += range.size();
-            alloc_it->second.n_allocations += 1;
-        }
+void
+TemporalSnapshotAggregator::takeSnapshot()
+{
+    const auto& totals = currentTotals();
+    consumeChangedLocations([&](location_id_t location) {
+        const auto& allocated = d_allocated[location];
+        d_changed_location.push_back(location);
+        d_live_size.push_back(totals[location].size);
+        d_live_count.push_back(totals[location].n_allocations);
+        d_allocated_size.push_back(allocated.size);
+        d_allocated_count.push_back(allocated.n_allocations);
+    });
+    d_snapshot_ends.push_back(d_changed_location.size());
+}
+
+size_t
+TemporalSnapshotAggregator::numSnapshots() const noexcept
+{
+    return d_snapshot_ends.size();
+}
+
+void
+TemporalSnapshotAggregator::totalsAt(
+        size_t snapshot,
+        std::vector<LocationTable::Totals>* live,
+        std::vector<LocationTable::Totals>* allocated) const
+{
+    if (snapshot >= d_snapshot_ends.size()) {
+        throw std::out_of_range("Snapshot index out of range");
     }
+    live->assign(locations().size(), LocationTable::Totals{});
+    allocated->assign(locations().size(), LocationTable::Totals{});
+    const size_t end = d_snapshot_ends[snapshot];
+    for (size_t row = 0; row < end; ++row) {
+        const location_id_t location = d_changed_location[row];
+        (*live)[location] = {d_live_size[row], d_live_count[row]};
+        (*allocated)[location] = {d_allocated_size[row], d_allocated_count[row]};
+    }
+}
 
-    return stack_to_allocation;
+reduced_snapshot_map_t
+TemporalSnapshotAggregator::liveAt(size_t snapshot, bool merge_threads) const
+{
+    std::vector<LocationTable::Totals> live;
+    std::vector<LocationTable::Totals> allocated;
+    totalsAt(snapshot, &live, &allocated);
+    return locations().reduce(live, merge_threads);
+}
+
+reduced_snapshot_map_t
+TemporalSnapshotAggregator::allocatedBetween(size_t start, size_t end, bool merge_threads) const
+{
+    if (start > end) {
+        throw std::out_of_range("The start snapshot is after the end one");
+    }
+    std::vector<LocationTable::Totals> live;
+    std::vector<LocationTable::Totals> allocated;
+    totalsAt(end, &live, &allocated);
+    std::vector<LocationTable::Totals> before;
+    totalsAt(start, &live, &before);
+    for (size_t location = 0; location < allocated.size(); ++location) {
+        allocated[location].size -= before[location].size;
+        allocated[location].n_allocations -= before[location].n_allocations;
+    }
+    return locations().reduce(allocated, merge_threads);
 }
 
 TemporaryAllocationsAggregator::TemporaryAllocationsAggregator(size_t max_items)
@@ -129,44 +366,80 @@ TemporaryAllocationsAggregator::TemporaryAllocationsAggregator(size_t max_items)
 {
 }
 
+TemporaryAllocationsAggregator::RecentAllocations&
+TemporaryAllocationsAggregator::recentAllocationsOf(thread_id_t tid)
+{
+    if (d_last_recent_allocations == nullptr || d_last_tid != tid) {
+        d_last_recent_allocations = &d_current_allocations[tid];
+        d_last_tid = tid;
+    }
+    return *d_last_recent_allocations;
+}
+
+void
+TemporaryAllocationsAggregator::addRecentAllocation(
+        RecentAllocations& recent,
+        const Allocation& allocation)
+{
+    if (d_max_items == 0) {
+        return;
+    }
+    const uint64_t position = recent.n_added++;
+    if (recent.ring.size() < d_max_items) {
+        recent.ring.push_back(allocation);
+    } else {
+        Allocation& oldest = recent.ring[position % d_max_items];
+        // The evicted allocation is only in the index if no later one was
+        // made at its address.
+        const uint64_t* latest = recent.latest_by_address.find(oldest.address);
+        if (latest != nullptr && *latest == position - d_max_items) {
+            recent.latest_by_address.erase(oldest.address);
+        }
+        oldest = allocation;
+    }
+    recent.latest_by_address[allocation.address] = position;
+}
+
 void
 TemporaryAllocationsAggregator::addAllocation(const Allocation& allocation)
 {
     hooks::AllocatorKind kind = hooks::allocatorKind(allocation.allocator);
-    auto it = d_current_allocations.find(allocation.tid);
     switch (kind) {
         case hooks::AllocatorKind::SIMPLE_ALLOCATOR:
         case hooks::AllocatorKind::RANGED_ALLOCATOR: {
-            if (it == d_current_allocations.end()) {
-                it = d_current_allocations.insert(
-                        it,
-                        std::pair(allocation.tid, std::deque<Allocation>()));
-            }
-
-            it->second.emplace_front(allocation);
-            if (it->second.size() > d_max_items) {
-                it->second.pop_back();
+            RecentAllocations& recent = recentAllocationsOf(allocation.tid);
+            if (allocation.n_repeats) {
+                // Every repeat is freed right away, so it's temporary, and
+                // it stays among the recent allocations like any other.
+                Allocation temporary = allocation;
+                temporary.size *= allocation.n_repeats;
+                temporary.n_allocations *= allocation.n_repeats;
+                temporary.n_repeats = 0;
+                d_temporary_allocations.push_back(temporary);
+                temporary = allocation;
+                temporary.n_repeats = 0;
+                for (size_t i = 0; i < std::min(allocation.n_repeats, d_max_items); ++i) {
+                    addRecentAllocation(recent, temporary);
+                }
+                break;
             }
+            addRecentAllocation(recent, allocation);
             break;
         }
         case hooks::AllocatorKind::SIMPLE_DEALLOCATOR:
         case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
-            if (it == d_current_allocations.end()) {
+            RecentAllocations& recent = recentAllocationsOf(allocation.tid);
+            const uint64_t* position = recent.latest_by_address.find(allocation.address);
+            if (position == nullptr) {
                 break;
             }
-
-            auto alloc_it =
-                    std::find_if(it->second.begin(), it->second.end(), [&](auto& current_allocation) {
-                        bool match = (current_allocation.address == allocation.address);
-                        if (kind == hooks::AllocatorKind::RANGED_DEALLOCATOR) {
-                            match = match && (current_allocation.size == allocation.size);
-                        }
-                        return match;
-                    });
-
-            if (alloc_it != it->second.end()) {
-                d_temporary_allocations.push_back(*alloc_it);
+            const Allocation& current_allocation = recent.ring[*position % d_max_items];
+            if (kind == hooks::AllocatorKind::RANGED_DEALLOCATOR
+                && current_allocation.size != allocation.size)
+            {
+                break;
             }
+            d_temporary_allocations.push_back(current_allocation);
             break;
         }
     }
@@ -185,13 +458,156 @@ TemporaryAllocationsAggregator::getSnapshotAllocations(bool merge_threads)
             stack_to_allocation.insert(alloc_it, std::pair(loc_key, record));
         } else {
             alloc_it->second.size += record.size;
-            alloc_it->second.n_allocations += 1;
+            alloc_it->second.n_allocations += record.n_allocations;
         }
     }
 
     return stack_to_allocation;
 }
 
+void
+LifetimeHistogram::merge(const LifetimeHistogram& other)
+{
+    for (size_t index = 0; index < N_BUCKETS; ++index) {
+        d_by_allocations[index] += other.d_by_allocations[index];
+        d_by_time[index] += other.d_by_time[index];
+    }
+    d_freed += other.d_freed;
+    d_never_freed += other.d_never_freed;
+}
+
+static std::vector<std::pair<uint64_t, uint64_t>>
+nonEmptyLifetimeBuckets(const uint64_t* counts, size_t n_buckets)
+{
+    std::vector<std::pair<uint64_t, uint64_t>> buckets;
+    for (size_t index = 0; index < n_buckets; ++index) {
+        if (counts[index]) {
+            buckets.emplace_back(LifetimeHistogram::bucketLowerBound(index), counts[index]);
+        }
+    }
+    return buckets;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>>
+LifetimeHistogram::byAllocations() const
+{
+    return nonEmptyLifetimeBuckets(d_by_allocations.data(), N_BUCKETS);
+}
+
+std::vector<std::pair<uint64_t, uint64_t>>
+LifetimeHistogram::byTime() const
+{
+    return nonEmptyLifetimeBuckets(d_by_time.data(), N_BUCKETS);
+}
+
+location_id_t
+AllocationLifetimeAggregator::locationFor(const Allocation& allocation)
+{
+    const location_id_t location = d_locations.idFor(allocation);
+    if (location == d_totals.size()) {
+        d_totals.emplace_back();
+        d_histograms.emplace_back();
+    }
+    return location;
+}
+
+void
+AllocationLifetimeAggregator::addBirth(const Allocation& allocation)
+{
+    const location_id_t location = locationFor(allocation);
+    d_totals[location].size += allocation.size;
+    d_totals[location].n_allocations += allocation.n_allocations;
+
+    auto [birth, inserted] = d_births.tryEmplace(allocation.address);
+    if (!inserted) {
+        // The deallocation of what was at this address was never seen.
+        d_histograms[birth->location].addNeverFreed(birth->n_allocations);
+    }
+    *birth = Birth{
+            d_n_allocations,
+            d_current_time,
+            allocation.size,
+            location,
+            static_cast<uint32_t>(allocation.n_allocations)};
+}
+
+void
+AllocationLifetimeAggregator::addAllocation(const Allocation& allocation)
+{
+    hooks::AllocatorKind kind = hooks::allocatorKind(allocation.allocator);
+    switch (kind) {
+        case hooks::AllocatorKind::SIMPLE_ALLOCATOR:
+        case hooks::AllocatorKind::RANGED_ALLOCATOR: {
+            if (allocation.n_repeats) {
+                // Every repeat is freed right away, before anything else is
+                // allocated, and leaves the address free again.
+                const location_id_t location = locationFor(allocation);
+                const uint64_t count = allocation.n_allocations * allocation.n_repeats;
+                d_totals[location].size += allocation.size * allocation.n_repeats;
+                d_totals[location].n_allocations += count;
+                d_histograms[location].addFreed(0, 0, count);
+                d_n_allocations += allocation.n_repeats;
+                break;
+            }
+            addBirth(allocation);
+            ++d_n_allocations;
+            break;
+        }
+        case hooks::AllocatorKind::SIMPLE_DEALLOCATOR:
+        case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
+            const Birth* birth = d_births.find(allocation.address);
+            if (birth == nullptr) {
+                break;
+            }
+            // Partially unmapped ranges are left alive, like the temporary
+            // allocations aggregator does.
+            if (kind == hooks::AllocatorKind::RANGED_DEALLOCATOR && birth->size != allocation.size) {
+                break;
+            }
+            const millis_t ms_elapsed = std::max<millis_t>(d_current_time - birth->time, 0);
+            d_histograms[birth->location].addFreed(
+                    d_n_allocations - birth->allocations_before - 1,
+                    static_cast<uint64_t>(ms_elapsed),
+                    birth->n_allocations);
+            d_births.erase(allocation.address);
+            break;
+        }
+    }
+}
+
+std::vector<LocationLifetimes>
+AllocationLifetimeAggregator::getLifetimes(bool merge_threads) const
+{
+    std::vector<LifetimeHistogram> histograms = d_histograms;
+    d_births.forEach([&](uintptr_t, const Birth& birth) {
+        histograms[birth.location].addNeverFreed(birth.n_allocations);
+    });
+
+    std::vector<LocationLifetimes> lifetimes;
+    std::unordered_map<LocationKey, size_t, index_thread_pair_hash> index_by_location;
+    for (size_t location = 0; location < d_totals.size(); ++location) {
+        if (d_totals[location].n_allocations == 0) {
+            continue;
+        }
+        const Allocation& record = d_locations.recordFor(location);
+        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : record.tid;
+        auto loc_key = LocationKey{record.frame_index, record.native_frame_id, thread_id};
+        auto [it, inserted] = index_by_location.emplace(loc_key, lifetimes.size());
+        if (inserted) {
+            Allocation new_record = record;
+            new_record.size = d_totals[location].size;
+            new_record.n_allocations = d_totals[location].n_allocations;
+            lifetimes.push_back(LocationLifetimes{new_record, histograms[location]});
+        } else {
+            LocationLifetimes& entry = lifetimes[it->second];
+            entry.record.size += d_totals[location].size;
+            entry.record.n_allocations += d_totals[location].n_allocations;
+            entry.lifetimes.merge(histograms[location]);
+        }
+    }
+    return lifetimes;
+}
+
 /**
  * Produce an aggregated snapshot from a vector of allocations and a index in that vector
  *
@@ -237,10 +653,9 @@ HighWatermarkFinder::processAllocation(const Allocation& allocation)
             break;
         }
         case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
-            auto it = d_ptr_to_allocation_size.find(allocation.address);
-            if (it != d_ptr_to_allocation_size.end()) {
-                d_current_memory -= it->second;
-                d_ptr_to_allocation_size.erase(it);
+            const auto size = d_ptr_to_allocation_size.erase(allocation.address);
+            if (size) {
+                d_current_memory -= *size;
             }
             break;
         }
@@ -284,22 +699,353 @@ HighWatermarkFinder::getCurrentWatermark() const noexcept
     return d_current_memory;
 }
 
+void
+HighWatermarkAggregator::updatePeak(size_t index)
+{
+    if (d_current_memory < d_last_high_water_mark.peak_memory) {
+        return;
+    }
+    d_last_high_water_mark.index = index;
+    d_last_high_water_mark.peak_memory = d_current_memory;
+    d_peak_totals.resize(locations().size());
+    const auto& totals = currentTotals();
+    consumeChangedLocations([&](location_id_t location) { d_peak_totals[location] = totals[location]; });
+}
+
+void
+HighWatermarkAggregator::addAllocation(const Allocation& allocation)
+{
+    // This must find the same peak as HighWatermarkFinder. In particular, an
+    // allocation replacing another one at the same address is taken out of
+    // the snapshot but still counted in the current memory.
+    size_t index = d_allocations_seen++;
+    const size_t released = updateLiveAllocations(allocation);
+    switch (hooks::allocatorKind(allocation.allocator)) {
+        case hooks::AllocatorKind::SIMPLE_ALLOCATOR:
+        case hooks::AllocatorKind::RANGED_ALLOCATOR: {
+            d_current_memory += allocation.size;
+            updatePeak(index);
+            break;
+        }
+        case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
+            d_current_memory -= released;
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
+            if (released) {
+                d_current_memory -= released;
+                updatePeak(index);
+            }
+            break;
+        }
+    }
+}
+
+reduced_snapshot_map_t
+HighWatermarkAggregator::getSnapshotAllocations(bool merge_threads)
+{
+    return locations().reduce(d_peak_totals, merge_threads);
+}
+
+HighWatermark
+HighWatermarkAggregator::getHighWatermark() const noexcept
+{
+    return d_last_high_water_mark;
+}
+
+size_t
+HighWatermarkAggregator::getCurrentWatermark() const noexcept
+{
+    return d_current_memory;
+}
+
+std::vector<std::pair<size_t, uint64_t>>
+SizeHistogram::nonEmptyBuckets() const
+{
+    std::vector<std::pair<size_t, uint64_t>> buckets;
+    for (size_t index = 0; index < N_BUCKETS; ++index) {
+        if (d_counts[index]) {
+            buckets.emplace_back(bucketLowerBound(index), d_counts[index]);
+        }
+    }
+    return buckets;
+}
+
+size_t
+SizeHistogram::bucketLowerBound(size_t index)
+{
+    if (index < 2 * SUB_BUCKETS) {
+        return index;
+    }
+    const size_t shift = index / SUB_BUCKETS - 1;
+    return (SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+}
+
+AllocationStatsAggregator::AllocationStatsAggregator()
+: d_high_water_mark_worker(std::make_unique<AllocationWorker>([this](const allocations_t& batch) {
+    for (const auto& allocation : batch) {
+        d_high_water_mark_finder.processAllocation(allocation);
+    }
+}))
+{
+}
+
 void
 AllocationStatsAggregator::addAllocation(
         const Allocation& allocation,
         std::optional<frame_id_t> python_frame_id)
 {
-    d_high_water_mark_finder.processAllocation(allocation);
+    // Repeats of an allocation that is freed right away leave the heap the
+    // way the first one left it, so they can't make a new high water mark.
+    if (!allocation.n_repeats) {
+        d_high_water_mark_worker->addAllocation(allocation);
+    }
     if (hooks::isDeallocator(allocation.allocator)) {
         return;
     }
-    d_total_allocations += 1;
-    d_total_bytes_allocated += allocation.size;
-    d_allocation_count_by_size[allocation.size] += 1;
-    d_allocation_count_by_allocator[static_cast<int>(allocation.allocator)] += 1;
+    const size_t n_times = std::max<size_t>(allocation.n_repeats, 1);
+    const size_t n_allocations = n_times * allocation.n_allocations;
+    d_total_allocations += n_allocations;
+    d_total_bytes_allocated += n_times * allocation.size;
+    d_allocation_count_by_size.add(allocation.size, n_allocations);
+    d_allocation_count_by_allocator[static_cast<int>(allocation.allocator)] += n_allocations;
     auto& size_and_count = d_size_and_count_by_location[python_frame_id];
-    size_and_count.first += allocation.size;
-    size_and_count.second += 1;
+    size_and_count.first += n_times * allocation.size;
+    size_and_count.second += n_allocations;
+}
+
+AllocationWorker::AllocationWorker(batch_consumer_t consumer)
+: d_consumer(std::move(consumer))
+{
+    d_pending.reserve(BATCH_SIZE);
+    d_thread = std::thread(&AllocationWorker::run, this);
+}
+
+AllocationWorker::~AllocationWorker()
+{
+    if (d_finished) {
+        return;
+    }
+    {
+        // Nobody is waiting for the results, so don't bother consuming them.
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_queue.clear();
+        d_done = true;
+    }
+    d_not_empty.notify_one();
+    d_thread.join();
+}
+
+void
+AllocationWorker::addAllocation(const Allocation& allocation)
+{
+    if (d_finished) {
+        d_consumer(allocations_t{allocation});
+        return;
+    }
+    d_pending.push_back(allocation);
+    if (d_pending.size() >= BATCH_SIZE) {
+        submitPending();
+    }
+}
+
+void
+AllocationWorker::submitPending()
+{
+    if (d_pending.empty()) {
+        return;
+    }
+    allocations_t batch;
+    batch.reserve(BATCH_SIZE);
+    batch.swap(d_pending);
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_not_full.wait(lock, [this] { return d_queue.size() < MAX_QUEUED_BATCHES || d_error; });
+        if (d_error) {
+            // The consumer already failed, and the error is reported by finish().
+            return;
+        }
+        d_queue.push_back(std::move(batch));
+    }
+    d_not_empty.notify_one();
+}
+
+void
+AllocationWorker::finish()
+{
+    if (d_finished) {
+        return;
+    }
+    submitPending();
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_done = true;
+    }
+    d_not_empty.notify_one();
+    d_thread.join();
+    d_finished = true;
+    if (d_error) {
+        std::rethrow_exception(d_error);
+    }
+}
+
+void
+AllocationWorker::run()
+{
+    while (true) {
+        allocations_t batch;
+        {
+            std::unique_lock<std::mutex> lock(d_mutex);
+            d_not_empty.wait(lock, [this] { return !d_queue.empty() || d_done; });
+            if (d_queue.empty()) {
+                return;
+            }
+            batch = std::move(d_queue.front());
+            d_queue.pop_front();
+        }
+        d_not_full.notify_one();
+        try {
+            d_consumer(batch);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            d_error = std::current_exception();
+            d_queue.clear();
+            d_not_full.notify_one();
+            return;
+        }
+    }
+}
+
+ParallelAggregator::ParallelAggregator(const aggregator_factory_t& factory, size_t n_workers)
+{
+    if (n_workers == 0) {
+        n_workers = defaultNumWorkers();
+    }
+    for (size_t i = 0; i < n_workers; ++i) {
+        d_partials.push_back(factory());
+        AbstractAggregator* partial = d_partials.back().get();
+        d_workers.push_back(std::make_unique<AllocationWorker>([partial](const allocations_t& batch) {
+            for (const auto& allocation : batch) {
+                partial->addAllocation(allocation);
+            }
+        }));
+    }
+}
+
+size_t
+ParallelAggregator::defaultNumWorkers()
+{
+    // Leave one core for the thread that parses the capture file. Beyond a
+    // handful of workers the parsing thread is the bottleneck anyway.
+    const size_t n_cpus = std::thread::hardware_concurrency();
+    return std::clamp<size_t>(n_cpus > 1 ? n_cpus - 1 : 1, 1, 8);
+}
+
+size_t
+ParallelAggregator::numPartitions() const
+{
+    return d_workers.size();
+}
+
+void
+ParallelAggregator::addAllocation(const Allocation& allocation)
+{
+    d_workers[partitionFor(allocation)]->addAllocation(allocation);
+}
+
+reduced_snapshot_map_t
+ParallelAggregator::getSnapshotAllocations(bool merge_threads)
+{
+    for (auto& worker : d_workers) {
+        worker->finish();
+    }
+
+    reduced_snapshot_map_t stack_to_allocation = d_partials[0]->getSnapshotAllocations(merge_threads);
+    for (size_t i = 1; i < d_partials.size(); ++i) {
+        for (const auto& [loc_key, record] : d_partials[i]->getSnapshotAllocations(merge_threads)) {
+            auto alloc_it = stack_to_allocation.find(loc_key);
+            if (alloc_it == stack_to_allocation.end()) {
+                stack_to_allocation.insert(alloc_it, std::pair(loc_key, record));
+            } else {
+                alloc_it->second.size += record.size;
+                alloc_it->second.n_allocations += record.n_allocations;
+            }
+        }
+    }
+    return stack_to_allocation;
+}
+
+ParallelSnapshotAggregator::ParallelSnapshotAggregator(size_t n_workers)
+: ParallelAggregator([] { return std::make_unique<SnapshotAllocationAggregator>(); }, n_workers)
+{
+}
+
+size_t
+ParallelSnapshotAggregator::partitionFor(const Allocation& allocation) const
+{
+    switch (hooks::allocatorKind(allocation.allocator)) {
+        case hooks::AllocatorKind::SIMPLE_ALLOCATOR:
+        case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
+            // Heap addresses are aligned, so drop the low bits before mixing.
+            const uint64_t h = (static_cast<uint64_t>(allocation.address) >> 4) * 0x9e3779b97f4a7c15ULL;
+            return (h >> 32) % numPartitions();
+        }
+        case hooks::AllocatorKind::RANGED_ALLOCATOR:
+        case hooks::AllocatorKind::RANGED_DEALLOCATOR:
+            break;
+    }
+    return 0;
+}
+
+ParallelTemporaryAllocationsAggregator::ParallelTemporaryAllocationsAggregator(
+        size_t max_items,
+        size_t n_workers)
+: ParallelAggregator(
+        [max_items] { return std::make_unique<TemporaryAllocationsAggregator>(max_items); },
+        n_workers)
+{
+}
+
+size_t
+ParallelTemporaryAllocationsAggregator::partitionFor(const Allocation& allocation) const
+{
+    return std::hash<thread_id_t>{}(allocation.tid) % numPartitions();
+}
+
+ParallelHighWatermarkAggregator::ParallelHighWatermarkAggregator()
+: ParallelAggregator([] { return std::make_unique<HighWatermarkAggregator>(); }, 1)
+{
+}
+
+size_t
+ParallelHighWatermarkAggregator::partitionFor(const Allocation&) const
+{
+    return 0;
+}
+
+void
+AggregatedCaptureReaggregator::addAllocation(const Allocation& allocation)
+{
+    d_allocations.push_back(allocation);
+}
+
+reduced_snapshot_map_t
+AggregatedCaptureReaggregator::getSnapshotAllocations(bool merge_threads)
+{
+    reduced_snapshot_map_t stack_to_allocation{};
+    for (const auto& allocation : d_allocations) {
+        if (allocation.n_allocations == 0) {
+            continue;
+        }
+        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : allocation.tid;
+        auto loc_key = LocationKey{allocation.frame_index, allocation.native_frame_id, thread_id};
+        auto [it, inserted] = stack_to_allocation.emplace(loc_key, allocation);
+        if (!inserted) {
+            it->second.size += allocation.size;
+            it->second.n_allocations += allocation.n_allocations;
+        }
+    }
+    return stack_to_allocation;
 }
 
 PyObject*
@@ -322,6 +1068,180 @@ Py_ListFromSnapshotAllocationRecords(const reduced_snapshot_map_t& stack_to_allo
     return list;
 }
 
+std::vector<std::pair<size_t, size_t>>
+getNativeStacks(const reduced_snapshot_map_t& stack_to_allocation)
+{
+    std::vector<std::pair<size_t, size_t>> native_stacks;
+    native_stacks.reserve(stack_to_allocation.size());
+    for (const auto& [loc_key, record] : stack_to_allocation) {
+        if (record.native_frame_id != 0) {
+            native_stacks.emplace_back(record.native_frame_id, record.native_segment_generation);
+        }
+    }
+    return native_stacks;
+}
+
+std::vector<Allocation>
+snapshotAllocations(const reduced_snapshot_map_t& stack_to_allocation)
+{
+    std::vector<Allocation> allocations;
+    allocations.reserve(stack_to_allocation.size());
+    for (const auto& [loc_key, record] : stack_to_allocation) {
+        allocations.push_back(record);
+    }
+    return allocations;
+}
+
+reduced_snapshot_map_t
+largestAllocations(const reduced_snapshot_map_t& stack_to_allocation, size_t max_allocations)
+{
+    if (stack_to_allocation.size() <= max_allocations) {
+        return stack_to_allocation;
+    }
+    using entry_t = reduced_snapshot_map_t::const_iterator;
+    std::vector<entry_t> entries;
+    entries.reserve(stack_to_allocation.size());
+    for (auto it = stack_to_allocation.begin(); it != stack_to_allocation.end(); ++it) {
+        entries.push_back(it);
+    }
+    auto last = entries.begin() + max_allocations;
+    std::nth_element(entries.begin(), last, entries.end(), [](entry_t lhs, entry_t rhs) {
+        return lhs->second.size > rhs->second.size;
+    });
+
+    reduced_snapshot_map_t largest;
+    largest.reserve(max_allocations);
+    for (auto it = entries.begin(); it != last; ++it) {
+        largest.insert(**it);
+    }
+    return largest;
+}
+
+ssize_t
+SnapshotDiff::Entry::sizeDelta() const noexcept
+{
+    return static_cast<ssize_t>(size[AFTER]) - static_cast<ssize_t>(size[BEFORE]);
+}
+
+size_t
+SnapshotDiff::StackHash::operator()(const std::vector<interned_id_t>& stack) const noexcept
+{
+    size_t hash = stack.size();
+    for (const auto frame : stack) {
+        hash ^= std::hash<interned_id_t>{}(frame) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+    }
+    return hash;
+}
+
+SnapshotDiff::interned_id_t
+SnapshotDiff::internFrame(const Frame& frame, const StringInterner& strings)
+{
+    Frame interned_frame = frame;
+    interned_frame.function_name = d_strings->intern(strings.get(frame.function_name));
+    interned_frame.filename = d_strings->intern(strings.get(frame.filename));
+    auto [it, inserted] = d_frame_ids.emplace(interned_frame, d_frames.size());
+    if (inserted) {
+        d_frames.push_back(&it->first);
+    }
+    return it->second;
+}
+
+SnapshotDiff::interned_id_t
+SnapshotDiff::internStack(const std::vector<interned_id_t>& frames)
+{
+    auto [it, inserted] = d_stack_ids.emplace(frames, d_stacks.size());
+    if (inserted) {
+        d_stacks.push_back(&it->first);
+        d_entries.push_back(Entry{it->second, {0, 0}, {0, 0}});
+    }
+    return it->second;
+}
+
+void
+SnapshotDiff::add(Side side, interned_id_t stack, size_t size, size_t n_allocations)
+{
+    Entry& entry = d_entries[stack];
+    entry.size[side] += size;
+    entry.n_allocations[side] += n_allocations;
+}
+
+std::vector<SnapshotDiff::Entry>
+SnapshotDiff::sortedEntries() const
+{
+    std::vector<Entry> entries(d_entries);
+    std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+        const size_t lhs_change = std::abs(lhs.sizeDelta());
+        const size_t rhs_change = std::abs(rhs.sizeDelta());
+        if (lhs_change != rhs_change) {
+            return lhs_change > rhs_change;
+        }
+        return lhs.stack < rhs.stack;
+    });
+    return entries;
+}
+
+PyObject*
+SnapshotDiff::Py_GetStack(interned_id_t stack, std::vector<PyObject*>* pyframes)
+{
+    const auto& frames = *d_stacks[stack];
+    PyObject* pystack = PyTuple_New(frames.size());
+    if (pystack == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < frames.size(); ++i) {
+        PyObject*& pyframe = (*pyframes)[frames[i]];
+        if (pyframe == nullptr) {
+            pyframe = d_frames[frames[i]]->toPythonObject(d_pystring_cache);
+            if (pyframe == nullptr) {
+                Py_DECREF(pystack);
+                return nullptr;
+            }
+        }
+        Py_INCREF(pyframe);
+        PyTuple_SET_ITEM(pystack, i, pyframe);
+    }
+    return pystack;
+}
+
+PyObject*
+SnapshotDiff::Py_GetDeltas()
+{
+    const auto entries = sortedEntries();
+    PyObject* list = PyList_New(entries.size());
+    if (list == nullptr) {
+        return nullptr;
+    }
+    // Frames are shared by many stacks, so each one is converted only once.
+    std::vector<PyObject*> pyframes(d_frames.size(), nullptr);
+    auto cleanup = [&](PyObject* result) {
+        for (PyObject* pyframe : pyframes) {
+            Py_XDECREF(pyframe);
+        }
+        return result;
+    };
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const Entry& entry = entries[i];
+        PyObject* pystack = Py_GetStack(entry.stack, &pyframes);
+        if (pystack == nullptr) {
+            Py_DECREF(list);
+            return cleanup(nullptr);
+        }
+        PyObject* delta = Py_BuildValue(
+                "(Nnnnn)",
+                pystack,
+                static_cast<Py_ssize_t>(entry.size[BEFORE]),
+                static_cast<Py_ssize_t>(entry.size[AFTER]),
+                static_cast<Py_ssize_t>(entry.n_allocations[BEFORE]),
+                static_cast<Py_ssize_t>(entry.n_allocations[AFTER]));
+        if (delta == nullptr) {
+            Py_DECREF(list);
+            return cleanup(nullptr);
+        }
+        PyList_SET_ITEM(list, i, delta);
+    }
+    return cleanup(list);
+}
+
 PyObject*
 Py_GetSnapshotAllocationRecords(
         const allocations_t& all_records,
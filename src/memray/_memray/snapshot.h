@@ -3,14 +3,23 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <algorithm>
+#include <array>
+#include <condition_variable>
 #include <deque>
+#include <exception>
 #include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include "frame_tree.h"
 #include "records.h"
+#include "string_interner.h"
 
 namespace memray::api {
 
@@ -63,69 +72,124 @@ template<typename T>
 class IntervalTree
 {
   private:
-    using intervals_t = std::vector<std::pair<Interval, T>>;
-    intervals_t d_intervals;
+    using interval_pair_t = std::pair<Interval, T>;
 
-  public:
-    using const_iterator = typename intervals_t::const_iterator;
-    using iterator = typename intervals_t::iterator;
+    // Ranges mapped over ranges that are still tracked are rare, so the
+    // intervals that overlap one already in the tree are kept in a list of
+    // their own. The others are ordered by their start address, and the only
+    // one of them that can contain an address is the last one that starts at
+    // or before it.
+    std::map<uintptr_t, interval_pair_t> d_intervals;
+    std::vector<interval_pair_t> d_overlapping_intervals;
+
+    // Return the first of the non overlapping intervals that ends after the
+    // given address.
+    auto firstEndingAfter(uintptr_t address)
+    {
+        auto it = d_intervals.upper_bound(address);
+        if (it != d_intervals.begin() && std::prev(it)->second.first.end > address) {
+            --it;
+        }
+        return it;
+    }
 
+    // Split off the part of the interval that intersects removed_interval,
+    // returning whether there was one.
+    static bool splitOff(
+            const interval_pair_t& entry,
+            const Interval& removed_interval,
+            std::vector<interval_pair_t>* new_intervals,
+            std::vector<interval_pair_t>* removed_intervals)
+    {
+        const auto& [interval, value] = entry;
+        std::optional<Interval> intersection = interval.intersection(removed_interval);
+        if (!intersection) {
+            return false;
+        }
+        // Keep whatever is left of the interval on either side of the
+        // removed range. This splits the interval in two if the removed
+        // range is in its middle.
+        if (interval.begin < intersection->begin) {
+            new_intervals->emplace_back(Interval{interval.begin, intersection->begin}, value);
+        }
+        if (intersection->end < interval.end) {
+            new_intervals->emplace_back(Interval{intersection->end, interval.end}, value);
+        }
+        removed_intervals->emplace_back(intersection.value(), value);
+        return true;
+    }
+
+  public:
     void addInterval(uintptr_t start, size_t size, const T& element)
     {
         if (size <= 0) {
             return;
         }
-        d_intervals.emplace_back(Interval(start, start + size), element);
+        const Interval interval(start, start + size);
+        auto it = firstEndingAfter(start);
+        if (it != d_intervals.end() && it->first < interval.end) {
+            d_overlapping_intervals.emplace_back(interval, element);
+        } else {
+            d_intervals.emplace_hint(it, start, interval_pair_t(interval, element));
+        }
     }
-    std::optional<std::vector<std::pair<Interval, T>>> removeInterval(uintptr_t start, size_t size)
+    // Remove the given range, returning the pieces of the intervals that were
+    // removed. If remaining_intervals is given, the pieces of those intervals
+    // that were kept are appended to it.
+    std::optional<std::vector<interval_pair_t>> removeInterval(
+            uintptr_t start,
+            size_t size,
+            std::vector<interval_pair_t>* remaining_intervals = nullptr)
     {
         if (size <= 0) {
             return std::nullopt;
         }
 
-        std::vector<std::pair<Interval, T>> new_intervals;
-        std::vector<std::pair<Interval, T>> removed_intervals;
+        std::vector<interval_pair_t> new_intervals;
+        std::vector<interval_pair_t> new_overlapping_intervals;
+        std::vector<interval_pair_t> removed_intervals;
         const auto removed_interval = Interval(start, start + size);
 
-        for (auto& [interval, value] : d_intervals) {
-            std::optional<Interval> intersection = interval.intersection(removed_interval);
-            // This interval doesn't contain the element to removed_interval, so don't removed_interval
-            // anything
-            if (!intersection) {
-                new_intervals.emplace_back(interval, value);
-                continue;
-            }
-            // The interval completely overlaps with the interval that we got, so we need to
-            // remove it entirely: add it to the list of removed intervals.
-            if ((intersection == interval)) {
-                removed_intervals.emplace_back(intersection.value(), value);
-            }
-            // Check if the interval intersects from the left and then remove a piece from the start.
-            else if (intersection->leftIntersects(interval))
-            {
-                auto new_interval = Interval{intersection->end, interval.end};
-                new_intervals.emplace_back(new_interval, value);
-                removed_intervals.emplace_back(intersection.value(), value);
-            }
-            // Check if the interval intersects from the right and then remove a piece from the start.
-            else if (intersection->rightIntersects(interval))
-            {
-                auto new_interval = Interval{interval.begin, intersection->begin};
-                new_intervals.emplace_back(new_interval, value);
-                removed_intervals.emplace_back(intersection.value(), value);
-            }
-            // The interval is contained in the chunk, so we need to remove the intersection from the
-            // middle, effectively splitting the interval in two.
-            else
-            {
-                new_intervals.emplace_back(Interval{interval.begin, intersection->begin}, value);
-                new_intervals.emplace_back(Interval{intersection->end, interval.end}, value);
-                removed_intervals.emplace_back(intersection.value(), value);
-            }
+        // Every non overlapping interval from here on that starts before the
+        // end of the removed range intersects it.
+        auto it = firstEndingAfter(start);
+        while (it != d_intervals.end() && it->first < removed_interval.end) {
+            splitOff(it->second, removed_interval, &new_intervals, &removed_intervals);
+            it = d_intervals.erase(it);
         }
+        auto& overlapping = d_overlapping_intervals;
+        overlapping.erase(
+                std::remove_if(
+                        overlapping.begin(),
+                        overlapping.end(),
+                        [&](const auto& entry) {
+                            return splitOff(
+                                    entry,
+                                    removed_interval,
+                                    &new_overlapping_intervals,
+                                    &removed_intervals);
+                        }),
+                overlapping.end());
 
-        // Re-assign intervals after the calculation.
-        d_intervals = new_intervals;
+        if (remaining_intervals) {
+            remaining_intervals->insert(
+                    remaining_intervals->end(),
+                    new_intervals.begin(),
+                    new_intervals.end());
+            remaining_intervals->insert(
+                    remaining_intervals->end(),
+                    new_overlapping_intervals.begin(),
+                    new_overlapping_intervals.end());
+        }
+        // What is left of an interval can't overlap anything it didn't
+        // overlap before.
+        for (auto& entry : new_intervals) {
+            const uintptr_t begin = entry.first.begin;
+            d_intervals.emplace(begin, std::move(entry));
+        }
+        for (auto& entry : new_overlapping_intervals) {
+            overlapping.push_back(std::move(entry));
+        }
 
         if (removed_intervals.empty()) {
             return std::nullopt;
@@ -136,31 +200,169 @@ class IntervalTree
     size_t size()
     {
         size_t result = 0;
-        std::for_each(d_intervals.begin(), d_intervals.end(), [&](const auto& pair) {
-            result += pair.first.size();
-        });
+        for (const auto& [begin, entry] : d_intervals) {
+            result += entry.first.size();
+        }
+        for (const auto& entry : d_overlapping_intervals) {
+            result += entry.first.size();
+        }
         return result;
     }
+};
 
-    iterator begin()
+// Hash map from addresses to values, using open addressing with linear
+// probing over a single array of slots. Live pointer maps hold an entry for
+// every allocation in the heap, and this needs a fraction of the memory of a
+// node based std::unordered_map. The null address marks empty slots, so its
+// value is stored separately.
+template<typename T>
+class AddressMap
+{
+  public:
+    T* find(uintptr_t address)
     {
-        return d_intervals.begin();
+        if (address == 0) {
+            return d_has_null ? &d_null_value : nullptr;
+        }
+        if (d_slots.empty()) {
+            return nullptr;
+        }
+        for (size_t i = slotFor(address);; i = (i + 1) & d_mask) {
+            Slot& slot = d_slots[i];
+            if (slot.address == address) {
+                return &slot.value;
+            }
+            if (slot.address == 0) {
+                return nullptr;
+            }
+        }
     }
 
-    iterator end()
+    // Return the value stored for the address, and whether it had to be
+    // inserted (value initialized) because there was none.
+    std::pair<T*, bool> tryEmplace(uintptr_t address)
     {
-        return d_intervals.end();
+        if (address == 0) {
+            const bool inserted = !d_has_null;
+            if (inserted) {
+                d_null_value = T{};
+                d_has_null = true;
+                ++d_size;
+            }
+            return {&d_null_value, inserted};
+        }
+        if (4 * (d_size + 1) > 3 * d_slots.size()) {
+            grow();
+        }
+        size_t i = slotFor(address);
+        for (; d_slots[i].address != 0; i = (i + 1) & d_mask) {
+            if (d_slots[i].address == address) {
+                return {&d_slots[i].value, false};
+            }
+        }
+        d_slots[i].address = address;
+        d_slots[i].value = T{};
+        ++d_size;
+        return {&d_slots[i].value, true};
+    }
+
+    T& operator[](uintptr_t address)
+    {
+        return *tryEmplace(address).first;
+    }
+
+    std::optional<T> erase(uintptr_t address)
+    {
+        if (address == 0) {
+            if (!d_has_null) {
+                return std::nullopt;
+            }
+            d_has_null = false;
+            --d_size;
+            return std::move(d_null_value);
+        }
+        if (d_slots.empty()) {
+            return std::nullopt;
+        }
+        size_t hole = slotFor(address);
+        for (; d_slots[hole].address != address; hole = (hole + 1) & d_mask) {
+            if (d_slots[hole].address == 0) {
+                return std::nullopt;
+            }
+        }
+        std::optional<T> value = std::move(d_slots[hole].value);
+        // Move back the entries that follow until an empty slot, whenever the
+        // hole is on their probe sequence, so that no tombstones are needed.
+        for (size_t i = (hole + 1) & d_mask; d_slots[i].address != 0; i = (i + 1) & d_mask) {
+            const size_t home = slotFor(d_slots[i].address);
+            if (((i - home) & d_mask) >= ((i - hole) & d_mask)) {
+                d_slots[hole] = std::move(d_slots[i]);
+                hole = i;
+            }
+        }
+        d_slots[hole].address = 0;
+        --d_size;
+        return value;
+    }
+
+    size_t size() const
+    {
+        return d_size;
+    }
+
+    template<typename F>
+    void forEach(F&& callback) const
+    {
+        if (d_has_null) {
+            callback(uintptr_t(0), d_null_value);
+        }
+        for (const auto& slot : d_slots) {
+            if (slot.address != 0) {
+                callback(slot.address, slot.value);
+            }
+        }
     }
 
-    const_iterator cbegin()
+  private:
+    struct Slot
+    {
+        uintptr_t address{0};
+        T value{};
+    };
+
+    size_t slotFor(uintptr_t address) const
     {
-        return d_intervals.cbegin();
+        uint64_t h = address;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h & d_mask;
     }
 
-    const_iterator cend()
+    void grow()
     {
-        return d_intervals.cend();
+        std::vector<Slot> old_slots(std::max<size_t>(INITIAL_CAPACITY, 2 * d_slots.size()));
+        old_slots.swap(d_slots);
+        d_mask = d_slots.size() - 1;
+        for (auto& old_slot : old_slots) {
+            if (old_slot.address == 0) {
+                continue;
+            }
+            size_t i = slotFor(old_slot.address);
+            while (d_slots[i].address != 0) {
+                i = (i + 1) & d_mask;
+            }
+            d_slots[i] = std::move(old_slot);
+        }
     }
+
+    static constexpr size_t INITIAL_CAPACITY = 1024;
+
+    std::vector<Slot> d_slots{};
+    size_t d_mask{0};
+    size_t d_size{0};
+    bool d_has_null{false};
+    T d_null_value{};
 };
 
 class AbstractAggregator
@@ -171,23 +373,208 @@ class AbstractAggregator
     virtual ~AbstractAggregator() = default;
 };
 
-class SnapshotAllocationAggregator : public AbstractAggregator
+using location_id_t = uint32_t;
+
+// Interns the locations of allocations, so that aggregators holding an entry
+// for every live allocation only need to store a small location id in it.
+class LocationTable
 {
+  public:
+    struct Totals
+    {
+        size_t size{0};
+        size_t n_allocations{0};
+    };
+
+    location_id_t idFor(const Allocation& allocation);
+    const Allocation& recordFor(location_id_t location) const;
+    size_t size() const noexcept;
+    // Build a snapshot out of the totals of each location, indexed by id.
+    // Locations without allocations are left out.
+    reduced_snapshot_map_t reduce(const std::vector<Totals>& totals, bool merge_threads) const;
+
   private:
-    size_t d_index{0};
-    IntervalTree<Allocation> d_interval_tree;
-    std::unordered_map<uintptr_t, Allocation> d_ptr_to_allocation{};
+    std::unordered_map<LocationKey, location_id_t, index_thread_pair_hash> d_ids{};
+    std::vector<Allocation> d_records{};
+};
+
+// A single record only counts for more than one allocation in sampled
+// captures, and never by more than the sampling interval, so its count fits
+// in 32 bits and the whole entry in 16 bytes.
+struct LiveAllocation
+{
+    size_t size;
+    location_id_t location;
+    uint32_t n_allocations;
+};
 
+struct LiveRange
+{
+    location_id_t location;
+    uint32_t n_allocations;
+};
+
+// Keeps the live allocations along with running totals of the memory they
+// use at each location, so that a snapshot can be taken at any point of the
+// input for the cost of going over the locations.
+class SnapshotAllocationAggregator : public AbstractAggregator
+{
   public:
     void addAllocation(const Allocation& allocation) override;
     reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads) override;
+    // Also add up what every location allocates and frees, for
+    // consumeIntervalTotals(). Nothing is counted until this is called.
+    void enableIntervalTotals();
+    // Call the callback with the record of every location that allocated or
+    // freed anything since the previous call, what it allocated and freed in
+    // that time, and its current totals.
+    template<typename F>
+    void consumeIntervalTotals(F&& callback);
+
+  protected:
+    // Apply an allocation to the live allocations and the totals of their
+    // locations, and return the number of bytes released if it deallocates.
+    size_t updateLiveAllocations(const Allocation& allocation);
+    // Call the callback with the id of each location whose totals changed
+    // since the previous call.
+    template<typename F>
+    void consumeChangedLocations(F&& callback);
+
+    const LocationTable& locations() const noexcept
+    {
+        return d_locations;
+    }
+
+    const std::vector<LocationTable::Totals>& currentTotals() const noexcept
+    {
+        return d_totals;
+    }
+
+    location_id_t locationFor(const Allocation& allocation);
+
+  private:
+    void addToLocation(location_id_t location, size_t size, size_t n_allocations);
+    void removeFromLocation(location_id_t location, size_t size, size_t n_allocations);
+    void markChanged(location_id_t location);
+    void countInterval(location_id_t location, size_t size, size_t n_allocations, bool allocated);
+
+    struct IntervalTotals
+    {
+        LocationTable::Totals allocated{};
+        LocationTable::Totals freed{};
+    };
+
+    LocationTable d_locations;
+    IntervalTree<LiveRange> d_interval_tree;
+    AddressMap<LiveAllocation> d_ptr_to_allocation{};
+    std::vector<LocationTable::Totals> d_totals{};
+    std::vector<location_id_t> d_changed_locations{};
+    std::vector<bool> d_is_changed{};
+    bool d_count_intervals{false};
+    std::vector<IntervalTotals> d_interval_totals{};
+    std::vector<location_id_t> d_interval_locations{};
+};
+
+template<typename F>
+void
+SnapshotAllocationAggregator::consumeChangedLocations(F&& callback)
+{
+    for (const auto location : d_changed_locations) {
+        d_is_changed[location] = false;
+        callback(location);
+    }
+    d_changed_locations.clear();
+}
+
+template<typename F>
+void
+SnapshotAllocationAggregator::consumeIntervalTotals(F&& callback)
+{
+    for (const auto location : d_interval_locations) {
+        auto& interval = d_interval_totals[location];
+        callback(d_locations.recordFor(location),
+                 interval.allocated,
+                 interval.freed,
+                 d_totals[location]);
+        interval = IntervalTotals{};
+    }
+    d_interval_locations.clear();
+}
+
+// Used by live mode, which asks for a snapshot on every refresh. Rather than
+// building the whole snapshot each time, it hands out only the locations that
+// changed since the previous call, so that the caller can keep its own copy
+// of the snapshot up to date.
+class LiveSnapshotAggregator : public SnapshotAllocationAggregator
+{
+  public:
+    // The record of each location that changed, with the location's current
+    // totals. Locations that no longer have live allocations have a count of
+    // 0 and should be dropped from the caller's copy.
+    std::vector<std::pair<location_id_t, Allocation>> takeChangedLocations();
+};
+
+// Records how the totals of the locations change over the capture, so that
+// the heap at any snapshot, or what was allocated between two snapshots, can
+// be rebuilt after a single pass without reading the capture again. The
+// caller decides when snapshots are taken (e.g. on every memory record). Only
+// the locations that changed since the previous snapshot are logged, in
+// columns, so a location costs nothing in the snapshots where it stays the
+// same.
+class TemporalSnapshotAggregator : public SnapshotAllocationAggregator
+{
+  public:
+    void addAllocation(const Allocation& allocation) override;
+    void takeSnapshot();
+    size_t numSnapshots() const noexcept;
+    // The live allocations of each location when the given snapshot was
+    // taken. Throws std::out_of_range if there is no such snapshot.
+    reduced_snapshot_map_t liveAt(size_t snapshot, bool merge_threads) const;
+    // The allocations made at each location after the start snapshot was
+    // taken and up to the end one, whether they are still alive or not.
+    reduced_snapshot_map_t allocatedBetween(size_t start, size_t end, bool merge_threads) const;
+
+  private:
+    // Replay the changes up to the given snapshot.
+    void totalsAt(
+            size_t snapshot,
+            std::vector<LocationTable::Totals>* live,
+            std::vector<LocationTable::Totals>* allocated) const;
+
+    // What was allocated at each location since the start of the capture.
+    std::vector<LocationTable::Totals> d_allocated{};
+    // A row per change of a location, with its totals after the change.
+    std::vector<location_id_t> d_changed_location{};
+    std::vector<size_t> d_live_size{};
+    std::vector<size_t> d_live_count{};
+    std::vector<size_t> d_allocated_size{};
+    std::vector<size_t> d_allocated_count{};
+    // The number of rows logged when each snapshot was taken.
+    std::vector<size_t> d_snapshot_ends{};
 };
 
 class TemporaryAllocationsAggregator : public AbstractAggregator
 {
   private:
+    // The most recent allocations of a thread, in a ring where every new
+    // allocation replaces the oldest one, and the position of the most recent
+    // allocation at every address, so that deallocations find it right away.
+    struct RecentAllocations
+    {
+        std::vector<Allocation> ring{};
+        uint64_t n_added{0};
+        AddressMap<uint64_t> latest_by_address{};
+    };
+
+    RecentAllocations& recentAllocationsOf(thread_id_t tid);
+    void addRecentAllocation(RecentAllocations& recent, const Allocation& allocation);
+
     size_t d_max_items;
-    std::unordered_map<thread_id_t, std::deque<Allocation>> d_current_allocations{};
+    std::unordered_map<thread_id_t, RecentAllocations> d_current_allocations{};
+    // Records come in runs of the same thread, so its allocations are kept
+    // at hand instead of being looked up for every record.
+    thread_id_t d_last_tid{0};
+    RecentAllocations* d_last_recent_allocations{nullptr};
     std::vector<Allocation> d_temporary_allocations{};
 
   public:
@@ -196,9 +583,268 @@ class TemporaryAllocationsAggregator : public AbstractAggregator
     reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads) override;
 };
 
+// How long the allocations of a location lived before being freed, both in
+// allocations made in the meantime and in milliseconds, bucketed by powers of
+// two: bucket 0 holds lifetimes of 0 and bucket i those from 2^(i-1) up to
+// 2^i - 1. The buckets are fixed, so histograms of different threads or
+// captures can be merged by adding them up.
+class LifetimeHistogram
+{
+  public:
+    void addFreed(uint64_t allocations_elapsed, uint64_t ms_elapsed, uint64_t count)
+    {
+        d_by_allocations[bucketIndex(allocations_elapsed)] += count;
+        d_by_time[bucketIndex(ms_elapsed)] += count;
+        d_freed += count;
+    }
+
+    void addNeverFreed(uint64_t count)
+    {
+        d_never_freed += count;
+    }
+
+    void merge(const LifetimeHistogram& other);
+
+    uint64_t freed() const
+    {
+        return d_freed;
+    }
+
+    uint64_t neverFreed() const
+    {
+        return d_never_freed;
+    }
+
+    // The smallest lifetime and the count of every non empty bucket, from
+    // the shortest lifetimes to the longest ones.
+    std::vector<std::pair<uint64_t, uint64_t>> byAllocations() const;
+    std::vector<std::pair<uint64_t, uint64_t>> byTime() const;
+
+    static size_t bucketIndex(uint64_t lifetime)
+    {
+        return lifetime == 0 ? 0 : 64 - __builtin_clzll(lifetime);
+    }
+
+    static uint64_t bucketLowerBound(size_t index)
+    {
+        return index == 0 ? 0 : uint64_t(1) << (index - 1);
+    }
+
+  private:
+    static constexpr size_t N_BUCKETS = 65;
+
+    std::array<uint64_t, N_BUCKETS> d_by_allocations{};
+    std::array<uint64_t, N_BUCKETS> d_by_time{};
+    uint64_t d_freed{0};
+    uint64_t d_never_freed{0};
+};
+
+struct LocationLifetimes
+{
+    Allocation record;
+    LifetimeHistogram lifetimes;
+};
+
+// Measures the lifetime of every allocation in a single pass, keeping when
+// each live allocation was made in a map by address. Lifetimes in allocations
+// count the allocation records of every thread made in between, so the
+// records must be added in the order they were written. Lifetimes in time are
+// only as precise as the interval between the memory records of the capture.
+class AllocationLifetimeAggregator
+{
+  public:
+    void addAllocation(const Allocation& allocation);
+
+    void setCurrentTime(millis_t ms_since_epoch)
+    {
+        d_current_time = ms_since_epoch;
+    }
+
+    // The record of every location, with what it allocated in total and the
+    // lifetimes of those allocations. Allocations still alive at the end of
+    // the capture are counted as never freed.
+    std::vector<LocationLifetimes> getLifetimes(bool merge_threads) const;
+
+  private:
+    struct Birth
+    {
+        uint64_t allocations_before;
+        millis_t time;
+        size_t size;
+        location_id_t location;
+        uint32_t n_allocations;
+    };
+
+    location_id_t locationFor(const Allocation& allocation);
+    void addBirth(const Allocation& allocation);
+
+    LocationTable d_locations;
+    std::vector<LocationTable::Totals> d_totals{};
+    std::vector<LifetimeHistogram> d_histograms{};
+    AddressMap<Birth> d_births{};
+    uint64_t d_n_allocations{0};
+    millis_t d_current_time{0};
+};
+
+// Runs a consumer of allocations on a background thread. Allocations are
+// handed over in batches through a bounded queue, so the thread parsing the
+// capture file only pays for a copy and never waits unless the consumer falls
+// far behind.
+class AllocationWorker
+{
+  public:
+    using batch_consumer_t = std::function<void(const allocations_t&)>;
+
+    explicit AllocationWorker(batch_consumer_t consumer);
+    ~AllocationWorker();
+
+    void addAllocation(const Allocation& allocation);
+    // Wait until every allocation added so far has been consumed and stop the
+    // thread. Rethrows any exception raised by the consumer.
+    void finish();
+
+  private:
+    AllocationWorker(const AllocationWorker&) = delete;
+    AllocationWorker& operator=(const AllocationWorker&) = delete;
+
+    void submitPending();
+    void run();
+
+    static constexpr size_t BATCH_SIZE = 4096;
+    static constexpr size_t MAX_QUEUED_BATCHES = 16;
+
+    batch_consumer_t d_consumer;
+    allocations_t d_pending{};
+    std::mutex d_mutex;
+    std::condition_variable d_not_empty;
+    std::condition_variable d_not_full;
+    std::deque<allocations_t> d_queue{};
+    bool d_done{false};
+    bool d_finished{false};
+    std::exception_ptr d_error{};
+    std::thread d_thread;
+};
+
+// Spreads allocations across several partial aggregators, each one fed from
+// its own worker thread, and merges their snapshots once the input is over.
+// Subclasses decide which partial aggregator sees each allocation, and must
+// send every event that can affect a given allocation to the same partial.
+class ParallelAggregator : public AbstractAggregator
+{
+  public:
+    void addAllocation(const Allocation& allocation) override;
+    reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads) override;
+
+  protected:
+    using aggregator_factory_t = std::function<std::unique_ptr<AbstractAggregator>()>;
+
+    ParallelAggregator(const aggregator_factory_t& factory, size_t n_workers);
+    virtual size_t partitionFor(const Allocation& allocation) const = 0;
+    size_t numPartitions() const;
+
+  private:
+    static size_t defaultNumWorkers();
+
+    std::vector<std::unique_ptr<AbstractAggregator>> d_partials;
+    std::vector<std::unique_ptr<AllocationWorker>> d_workers;
+};
+
+// Parallel version of SnapshotAllocationAggregator. Simple allocations are
+// partitioned by address, and all ranged allocations go to the first partial
+// because a ranged deallocation can cover several of them.
+class ParallelSnapshotAggregator : public ParallelAggregator
+{
+  public:
+    explicit ParallelSnapshotAggregator(size_t n_workers = 0);
+
+  protected:
+    size_t partitionFor(const Allocation& allocation) const override;
+};
+
+// Parallel version of TemporaryAllocationsAggregator. Temporary allocations
+// are tracked per thread, so allocations are partitioned by thread id.
+class ParallelTemporaryAllocationsAggregator : public ParallelAggregator
+{
+  public:
+    explicit ParallelTemporaryAllocationsAggregator(size_t max_items, size_t n_workers = 0);
+
+  protected:
+    size_t partitionFor(const Allocation& allocation) const override;
+};
+
 PyObject*
 Py_ListFromSnapshotAllocationRecords(const reduced_snapshot_map_t& stack_to_allocation);
 
+// The (native frame id, segment generation) pair of every allocation in a
+// snapshot that has a native stack.
+std::vector<std::pair<size_t, size_t>>
+getNativeStacks(const reduced_snapshot_map_t& stack_to_allocation);
+
+// The records of a snapshot's locations, in the order that
+// Py_ListFromSnapshotAllocationRecords() lists them in.
+std::vector<Allocation>
+snapshotAllocations(const reduced_snapshot_map_t& stack_to_allocation);
+
+// The max_allocations locations of a snapshot that allocated the most memory,
+// so that reporters showing only the biggest allocations don't need to turn
+// every location into a Python object to find them.
+reduced_snapshot_map_t
+largestAllocations(const reduced_snapshot_map_t& stack_to_allocation, size_t max_allocations);
+
+// Compares two snapshots location by location. Frame ids and stack indices
+// only mean something within the capture that produced them, so stacks are
+// matched by the content of their frames instead: every distinct frame and
+// every distinct sequence of frames is interned once, whichever side it
+// comes from, and the totals of both sides are kept per interned stack.
+class SnapshotDiff
+{
+  public:
+    enum Side { BEFORE = 0, AFTER = 1 };
+
+    using interned_id_t = uint32_t;
+
+    struct Entry
+    {
+        interned_id_t stack;
+        size_t size[2];
+        size_t n_allocations[2];
+
+        ssize_t sizeDelta() const noexcept;
+    };
+
+    // Frames are given with their strings in the interner of their reader.
+    interned_id_t internFrame(const Frame& frame, const StringInterner& strings);
+    // Stacks are given from the most recent frame to the oldest one.
+    interned_id_t internStack(const std::vector<interned_id_t>& frames);
+    void add(Side side, interned_id_t stack, size_t size, size_t n_allocations);
+
+    // The entries of every stack seen on either side, sorted by how much
+    // their memory changed, biggest changes first.
+    std::vector<Entry> sortedEntries() const;
+    // Build a list of (stack, size before, size after, allocations before,
+    // allocations after) tuples from the sorted entries, where each stack is
+    // a tuple of (function, file, line number) tuples.
+    PyObject* Py_GetDeltas();
+
+  private:
+    struct StackHash
+    {
+        size_t operator()(const std::vector<interned_id_t>& stack) const noexcept;
+    };
+
+    PyObject* Py_GetStack(interned_id_t stack, std::vector<PyObject*>* pyframes);
+
+    // The frames of both sides, with their strings in an interner of the
+    // diff's own, so that equal frames have equal ids.
+    std::shared_ptr<StringInterner> d_strings{std::make_shared<StringInterner>()};
+    std::unordered_map<Frame, interned_id_t, Frame::Hash> d_frame_ids{};
+    std::vector<const Frame*> d_frames{};
+    std::unordered_map<std::vector<interned_id_t>, interned_id_t, StackHash> d_stack_ids{};
+    std::vector<const std::vector<interned_id_t>*> d_stacks{};
+    std::vector<Entry> d_entries{};
+    python_helpers::PyUnicode_Cache d_pystring_cache{d_strings};
+};
+
 struct HighWatermark
 {
     size_t index{0};
@@ -222,13 +868,118 @@ class HighWatermarkFinder
     HighWatermark d_last_high_water_mark;
     size_t d_current_memory{0};
     size_t d_allocations_seen{0};
-    std::unordered_map<uintptr_t, size_t> d_ptr_to_allocation_size{};
+    AddressMap<size_t> d_ptr_to_allocation_size{};
     IntervalTree<Allocation> d_mmap_intervals;
 };
 
+// Finds the high water mark and the snapshot of the heap at it in a single
+// pass. Whenever a new peak is reached, the totals of the locations that
+// changed since the previous one are copied into a checkpoint. The checkpoint
+// is therefore the snapshot at the last peak seen so far, and the allocations
+// themselves only need to be kept for as long as they are alive.
+class HighWatermarkAggregator : public SnapshotAllocationAggregator
+{
+  public:
+    void addAllocation(const Allocation& allocation) override;
+    reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads) override;
+    HighWatermark getHighWatermark() const noexcept;
+    size_t getCurrentWatermark() const noexcept;
+    // Call the callback with the record of every location that had live
+    // allocations at the high water mark or still has some now, along with
+    // its totals at both points.
+    template<typename F>
+    void visitLocations(F&& callback) const;
+
+  private:
+    void updatePeak(size_t index);
+
+    HighWatermark d_last_high_water_mark;
+    size_t d_current_memory{0};
+    size_t d_allocations_seen{0};
+    std::vector<LocationTable::Totals> d_peak_totals{};
+};
+
+template<typename F>
+void
+HighWatermarkAggregator::visitLocations(F&& callback) const
+{
+    // Locations first seen after the peak have no checkpointed totals.
+    const LocationTable::Totals no_allocations{};
+    const auto& totals = currentTotals();
+    for (location_id_t location = 0; location < locations().size(); ++location) {
+        const auto& peak = location < d_peak_totals.size() ? d_peak_totals[location] : no_allocations;
+        if (peak.n_allocations == 0 && totals[location].n_allocations == 0) {
+            continue;
+        }
+        callback(locations().recordFor(location), peak, totals[location]);
+    }
+}
+
+// Runs a HighWatermarkAggregator on a worker thread. The peak depends on
+// every allocation, so it can't be split across several partials.
+class ParallelHighWatermarkAggregator : public ParallelAggregator
+{
+  public:
+    ParallelHighWatermarkAggregator();
+
+  protected:
+    size_t partitionFor(const Allocation& allocation) const override;
+};
+
+// Rebuilds a snapshot out of the contributions of each location read from a
+// capture in the aggregated format, which were already reduced by the
+// tracked process.
+class AggregatedCaptureReaggregator : public AbstractAggregator
+{
+  public:
+    void addAllocation(const Allocation& allocation) override;
+    reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads) override;
+
+  private:
+    std::vector<Allocation> d_allocations{};
+};
+
+// A histogram of allocation sizes with a fixed number of buckets, whose
+// width grows with the sizes they hold, like in HDR histograms: sizes below
+// 64 get a bucket each, and every power of two above that is split in 32
+// buckets, so the sizes in a bucket are within 1/32 of each other.
+class SizeHistogram
+{
+  public:
+    // Methods
+    void add(size_t size, uint64_t count)
+    {
+        d_counts[bucketIndex(size)] += count;
+    }
+
+    // The smallest size and the count of every non empty bucket, from the
+    // smallest sizes to the largest ones.
+    std::vector<std::pair<size_t, uint64_t>> nonEmptyBuckets() const;
+
+    static size_t bucketIndex(size_t size)
+    {
+        if (size < 2 * SUB_BUCKETS) {
+            return size;
+        }
+        const unsigned int shift = 8 * sizeof(size_t) - 1 - __builtin_clzl(size) - SUB_BUCKET_BITS;
+        return shift * SUB_BUCKETS + (size >> shift);
+    }
+
+    static size_t bucketLowerBound(size_t index);
+
+  private:
+    static constexpr unsigned int SUB_BUCKET_BITS = 5;
+    static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+    static constexpr size_t N_BUCKETS = (8 * sizeof(size_t) - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    std::array<uint64_t, N_BUCKETS> d_counts{};
+};
+
 class AllocationStatsAggregator
 {
   public:
+    AllocationStatsAggregator();
+
     void addAllocation(const Allocation& allocation, std::optional<frame_id_t> python_frame_id);
 
     uint64_t totalAllocations()
@@ -243,12 +994,13 @@ class AllocationStatsAggregator
 
     uint64_t peakBytesAllocated()
     {
+        d_high_water_mark_worker->finish();
         return d_high_water_mark_finder.getHighWatermark().peak_memory;
     }
 
-    const std::unordered_map<size_t, uint64_t>& allocationCountBySize()
+    std::vector<std::pair<size_t, uint64_t>> allocationCountBySize() const
     {
-        return d_allocation_count_by_size;
+        return d_allocation_count_by_size.nonEmptyBuckets();
     }
 
     const std::unordered_map<int, uint64_t>& allocationCountByAllocator()
@@ -271,9 +1023,13 @@ class AllocationStatsAggregator
     typedef std::unordered_map<std::optional<frame_id_t>, SizeAndCount> SizeAndCountByLocation;
 
     SizeAndCountByLocation d_size_and_count_by_location;
-    std::unordered_map<size_t, uint64_t> d_allocation_count_by_size;
+    SizeHistogram d_allocation_count_by_size;
     std::unordered_map<int, uint64_t> d_allocation_count_by_allocator;
     HighWatermarkFinder d_high_water_mark_finder;
+    // Finding the high water mark is the most expensive part of gathering the
+    // stats, and it has to see every allocation in order, so it gets a thread
+    // of its own. It must be declared after the finder it feeds.
+    std::unique_ptr<AllocationWorker> d_high_water_mark_worker;
     uint64_t d_total_allocations{};
     uint64_t d_total_bytes_allocated{};
 
@@ -289,18 +1045,23 @@ class AllocationStatsAggregator
             num_largest = d_size_and_count_by_location.size();
         }
 
-        std::vector<std::pair<uint64_t, std::optional<frame_id_t>>> heap;
-        heap.reserve(d_size_and_count_by_location.size());
-        for (auto it : d_size_and_count_by_location) {
-            auto location = it.first;
-            auto val = std::get<field>(it.second);
-            heap.push_back({val, location});
-        }
-        std::make_heap(heap.begin(), heap.end());
-        for (size_t i = 0; i < num_largest; ++i) {
-            std::pop_heap(heap.begin(), heap.end() - i);
+        // Only the largest locations seen so far are kept, smallest first.
+        using entry_t = std::pair<uint64_t, std::optional<frame_id_t>>;
+        std::vector<entry_t> heap;
+        heap.reserve(num_largest);
+        for (const auto& [location, size_and_count] : d_size_and_count_by_location) {
+            entry_t entry{std::get<field>(size_and_count), location};
+            if (heap.size() < num_largest) {
+                heap.push_back(entry);
+                std::push_heap(heap.begin(), heap.end(), std::greater<>{});
+            } else if (heap.front() < entry) {
+                std::pop_heap(heap.begin(), heap.end(), std::greater<>{});
+                heap.back() = entry;
+                std::push_heap(heap.begin(), heap.end(), std::greater<>{});
+            }
         }
-        return {heap.rbegin(), heap.rbegin() + num_largest};
+        std::sort_heap(heap.begin(), heap.end(), std::greater<>{});
+        return heap;
     }
 };
 
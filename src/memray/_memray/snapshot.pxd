@@ -27,9 +27,42 @@ cdef extern from "snapshot.h" namespace "memray::api":
     cdef cppclass TemporaryAllocationsAggregator(AbstractAggregator):
         TemporaryAllocationsAggregator(size_t max_items)
 
+    cdef cppclass LifetimeHistogram:
+        uint64_t freed()
+        uint64_t neverFreed()
+        vector[pair[uint64_t, uint64_t]] byAllocations() except+
+        vector[pair[uint64_t, uint64_t]] byTime() except+
+
+    cdef struct LocationLifetimes:
+        Allocation record
+        LifetimeHistogram lifetimes
+
+    cdef cppclass AllocationLifetimeAggregator:
+        void addAllocation(const Allocation&) except+
+        void setCurrentTime(long long ms_since_epoch)
+        vector[LocationLifetimes] getLifetimes(bool merge_threads) except+
+
     cdef cppclass SnapshotAllocationAggregator(AbstractAggregator):
         pass
 
+    cdef cppclass TemporalSnapshotAggregator(SnapshotAllocationAggregator):
+        void takeSnapshot() except+
+        size_t numSnapshots()
+        reduced_snapshot_map_t liveAt(size_t snapshot, bool merge_threads) except+
+        reduced_snapshot_map_t allocatedBetween(size_t start, size_t end, bool merge_threads) except+
+
+    cdef cppclass ParallelSnapshotAggregator(AbstractAggregator):
+        ParallelSnapshotAggregator() except+
+
+    cdef cppclass ParallelTemporaryAllocationsAggregator(AbstractAggregator):
+        ParallelTemporaryAllocationsAggregator(size_t max_items) except+
+
+    cdef cppclass ParallelHighWatermarkAggregator(AbstractAggregator):
+        ParallelHighWatermarkAggregator() except+
+
+    cdef cppclass AggregatedCaptureReaggregator(AbstractAggregator):
+        pass
+
     cdef cppclass LocationKey:
         size_t python_frame_id
         size_t native_frame_id
@@ -38,15 +71,27 @@ cdef extern from "snapshot.h" namespace "memray::api":
     cdef cppclass index_thread_pair_hash:
         pass
 
+    cdef enum SnapshotDiffSide 'memray::api::SnapshotDiff::Side':
+        SnapshotDiffBefore 'memray::api::SnapshotDiff::BEFORE'
+        SnapshotDiffAfter 'memray::api::SnapshotDiff::AFTER'
+
+    cdef cppclass SnapshotDiff:
+        object Py_GetDeltas() except+
+
     cdef cppclass AllocationStatsAggregator:
         void addAllocation(const Allocation&, optional_frame_id_t python_frame_id) except+
         uint64_t totalAllocations()
         uint64_t totalBytesAllocated()
-        uint64_t peakBytesAllocated()
-        const unordered_map[size_t, uint64_t]& allocationCountBySize()
+        uint64_t peakBytesAllocated() except+
+        vector[pair[size_t, uint64_t]] allocationCountBySize() except+
         const unordered_map[int, uint64_t]& allocationCountByAllocator()
         vector[pair[uint64_t, optional_frame_id_t]] topLocationsBySize(size_t num_largest) except+
         vector[pair[uint64_t, optional_frame_id_t]] topLocationsByCount(size_t num_largest) except+
 
     object Py_ListFromSnapshotAllocationRecords(const reduced_snapshot_map_t&) except+
+    vector[pair[size_t, size_t]] getNativeStacks(const reduced_snapshot_map_t&) except+
+    vector[Allocation] snapshotAllocations(const reduced_snapshot_map_t&) except+
+    reduced_snapshot_map_t largestAllocations(
+        const reduced_snapshot_map_t&, size_t max_allocations
+    ) except+
     object Py_GetSnapshotAllocationRecords(const vector[Allocation]& all_records, size_t record_index, bool merge_threads) except+
@@ -1,10 +1,14 @@
 #include "socket_reader_thread.h"
+#include "tracking_api.h"
 
 namespace memray::socket_thread {
 
 void
 BackgroundSocketReader::backgroundThreadWorker()
 {
+    // When reading from a tracker in this very process, what the reader
+    // allocates must not be tracked, or it would end up reading about itself.
+    tracking_api::RecursionGuard::isActive = true;
     while (true) {
         if (d_stop_thread) {
             break;
@@ -23,9 +27,13 @@ BackgroundSocketReader::backgroundThreadWorker()
                 break;
             }
 
-            case RecordResult::MEMORY_RECORD: {
+            case RecordResult::MEMORY_RECORD:
+            case RecordResult::FILTERED_ALLOCATION_RECORD: {
                 break;
             }
+            // Aggregated captures can't be sent over a socket.
+            case RecordResult::AGGREGATED_ALLOCATION_RECORD:
+            case RecordResult::PROFILE_INTERVAL:
             case RecordResult::END_OF_FILE:
             case RecordResult::ERROR: {
                 d_stop_thread = true;
@@ -54,17 +62,58 @@ BackgroundSocketReader::~BackgroundSocketReader()
 }
 
 PyObject*
-BackgroundSocketReader::Py_GetSnapshotAllocationRecords(bool merge_threads)
+BackgroundSocketReader::Py_GetSnapshotAllocationRecords(bool merge_threads, size_t largest)
 {
     api::reduced_snapshot_map_t stack_to_allocation;
     {
         std::lock_guard<std::mutex> lock(d_mutex);
         stack_to_allocation = d_aggregator.getSnapshotAllocations(merge_threads);
     }
+    if (largest) {
+        stack_to_allocation = api::largestAllocations(stack_to_allocation, largest);
+    }
 
     return api::Py_ListFromSnapshotAllocationRecords(stack_to_allocation);
 }
 
+PyObject*
+BackgroundSocketReader::Py_GetSnapshotDelta()
+{
+    // Only the changed locations are copied while the reader thread is kept
+    // waiting, and the Python objects are built after releasing the lock.
+    std::vector<std::pair<api::location_id_t, api::Allocation>> changes;
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        changes = d_aggregator.takeChangedLocations();
+    }
+
+    PyObject* list = PyList_New(changes.size());
+    if (list == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < changes.size(); ++i) {
+        const auto& [location, record] = changes[i];
+        PyObject* pyrecord;
+        if (record.n_allocations == 0) {
+            pyrecord = Py_None;
+            Py_INCREF(pyrecord);
+        } else {
+            pyrecord = record.toPythonObject();
+        }
+        if (pyrecord == nullptr) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+        PyObject* change = Py_BuildValue("(kN)", static_cast<unsigned long>(location), pyrecord);
+        if (change == nullptr) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+        PyList_SET_ITEM(list, i, change);
+    }
+    return list;
+}
+
 bool
 BackgroundSocketReader::is_active() const
 {
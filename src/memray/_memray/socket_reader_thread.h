@@ -22,7 +22,7 @@ class BackgroundSocketReader
     std::mutex d_mutex;
     std::shared_ptr<api::RecordReader> d_record_reader;
 
-    api::SnapshotAllocationAggregator d_aggregator;
+    api::LiveSnapshotAggregator d_aggregator;
     std::thread d_thread;
 
     void backgroundThreadWorker();
@@ -38,7 +38,14 @@ class BackgroundSocketReader
 
     void start();
     bool is_active() const;
-    PyObject* Py_GetSnapshotAllocationRecords(bool merge_threads);
+    // With largest, only the records of that many locations holding the
+    // most memory are returned.
+    PyObject* Py_GetSnapshotAllocationRecords(bool merge_threads, size_t largest = 0);
+    // Return a list of (location id, record) tuples for the locations that
+    // changed since the previous call, where the record is None if the
+    // location no longer has any live allocations. There must only be one
+    // caller, since each change is only reported once.
+    PyObject* Py_GetSnapshotDelta();
 };
 
 }  // namespace memray::socket_thread
@@ -11,3 +11,5 @@ cdef extern from "socket_reader_thread.h" namespace "memray::socket_thread":
         void start() except+
         bool is_active()
         object Py_GetSnapshotAllocationRecords(bool merge_threads)
+        object Py_GetSnapshotAllocationRecords(bool merge_threads, size_t largest)
+        object Py_GetSnapshotDelta()
@@ -1,12 +1,17 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <algorithm>
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
 #include <netdb.h>
 #include <stdexcept>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <chrono>
@@ -23,39 +28,105 @@ namespace memray::io {
 FileSource::FileSource(const std::string& file_name)
 : d_file_name(file_name)
 {
-    d_raw_stream = std::make_shared<std::ifstream>(d_file_name, std::ios::binary | std::ios::in);
-    if (!(*d_raw_stream)) {
+    int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
         throw IoError{"Could not open file " + file_name + ": " + std::string(strerror(errno))};
     }
     char lz4_magic[] = {0x04, 0x22, 0x4D, 0x18};
     char file_magic[sizeof(lz4_magic)] = {};
-    d_raw_stream->read(file_magic, sizeof(file_magic));
-    d_raw_stream->seekg(0, std::ios::beg);
+    ssize_t magic_size = ::pread(fd, file_magic, sizeof(file_magic), 0);
+    bool compressed = magic_size == sizeof(file_magic)
+                      && 0 == memcmp(lz4_magic, file_magic, sizeof(lz4_magic));
+    if (!compressed && mapFile(fd)) {
+        ::close(fd);
+        return;
+    }
+    DecompressingBuf::frame_index_t frame_index;
+    if (compressed) {
+        frame_index = DecompressingBuf::readIndex(fd);
+    }
+    if (frame_index.empty()) {
+        ::close(fd);
+    } else {
+        d_fd = fd;
+    }
 
-    if (0 == memcmp(lz4_magic, file_magic, sizeof(lz4_magic))) {
-        d_stream = std::make_shared<lz4_stream::istream>(*d_raw_stream);
+    d_raw_stream = std::make_shared<std::ifstream>(d_file_name, std::ios::binary | std::ios::in);
+    if (!(*d_raw_stream)) {
+        throw IoError{"Could not open file " + file_name + ": " + std::string(strerror(errno))};
+    }
+
+    if (compressed) {
+        // Captures that are still being written, or whose tracker was killed,
+        // have no index yet and can only be decompressed from the start.
+        if (d_fd != -1) {
+            d_decompressing_buf = std::make_unique<DecompressingBuf>(d_fd, std::move(frame_index));
+        } else {
+            d_decompressing_buf = std::make_unique<DecompressingBuf>(*d_raw_stream);
+        }
+        d_stream = std::make_shared<std::istream>(d_decompressing_buf.get());
     } else {
         d_stream = d_raw_stream;
         findReadableSize();
     }
 }
 
+bool
+FileSource::mapFile(int fd)
+{
+    struct stat info;
+    if (::fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+    d_map_size = info.st_size;
+    if (d_map_size != 0) {
+        void* map = ::mmap(nullptr, d_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            LOG(DEBUG) << "Could not map file " << d_file_name << ": " << strerror(errno);
+            return false;
+        }
+        d_map = static_cast<char*>(map);
+        ::madvise(d_map, d_map_size, MADV_SEQUENTIAL);
+    }
+    d_mapped = true;
+    d_map_open = true;
+    findMappedReadableSize();
+    return true;
+}
+
 bool
 FileSource::read(char* stream, ssize_t length)
 {
-    if (d_stream->read(stream, length).fail()) {
+    if (d_mapped) {
+        if (d_unread.size() < static_cast<size_t>(length)) {
+            return false;
+        }
+        ::memcpy(stream, d_unread.data(), length);
+        d_unread.remove_prefix(length);
+        return true;
+    }
+    if (d_readable_size && d_bytes_read + length > d_readable_size) {
         return false;
     }
-    d_bytes_read += length;
-    if (d_readable_size && d_bytes_read > d_readable_size) {
+    if (d_stream->read(stream, length).fail()) {
         return false;
     }
+    d_bytes_read += length;
     return true;
 }
 
 bool
 FileSource::getline(std::string& result, char delimiter)
 {
+    if (d_mapped) {
+        size_t length = d_unread.find(delimiter);
+        if (length == std::string_view::npos) {
+            return false;
+        }
+        result.assign(d_unread.data(), length);
+        d_unread.remove_prefix(length + 1);
+        return true;
+    }
     std::getline(*d_stream, result, delimiter);
     if (!d_stream) {
         return false;
@@ -67,6 +138,77 @@ FileSource::getline(std::string& result, char delimiter)
     return true;
 }
 
+std::string_view*
+FileSource::mappedData()
+{
+    return d_mapped ? &d_unread : nullptr;
+}
+
+bool
+FileSource::skipTo(size_t offset)
+{
+    if (d_mapped) {
+        const size_t position = d_unread.data() - d_map;
+        if (offset < position || offset - position > d_unread.size()) {
+            return false;
+        }
+        d_unread.remove_prefix(offset - position);
+        return true;
+    }
+    if (offset < static_cast<size_t>(d_bytes_read)
+        || (d_readable_size && static_cast<std::streamoff>(offset) > d_readable_size))
+    {
+        return false;
+    }
+    if (d_decompressing_buf && d_decompressing_buf->skipTo(offset)) {
+        d_bytes_read = offset;
+        return true;
+    }
+    const std::streamsize length = offset - d_bytes_read;
+    if (d_stream->ignore(length).gcount() != length) {
+        return false;
+    }
+    d_bytes_read = offset;
+    return true;
+}
+
+bool
+FileSource::endAt(size_t offset)
+{
+    if (d_mapped) {
+        const size_t position = d_unread.data() - d_map;
+        if (offset < position) {
+            return false;
+        }
+        d_unread = d_unread.substr(0, offset - position);
+        return true;
+    }
+    if (offset < static_cast<size_t>(d_bytes_read)) {
+        return false;
+    }
+    if (!d_readable_size || static_cast<std::streamoff>(offset) < d_readable_size) {
+        d_readable_size = offset;
+    }
+    return true;
+}
+
+std::unique_ptr<Source>
+FileSource::openSibling(const std::string& file_name)
+{
+    // This may have been opened through a link to it, like the ones in
+    // /proc/self/fd, so look for the other one next to what it points to.
+    std::string path = d_file_name;
+    if (char* real_path = ::realpath(d_file_name.c_str(), nullptr)) {
+        path = real_path;
+        ::free(real_path);
+    }
+    const size_t slash = path.rfind('/');
+    if (slash == std::string::npos) {
+        return std::make_unique<FileSource>(file_name);
+    }
+    return std::make_unique<FileSource>(path.substr(0, slash + 1) + file_name);
+}
+
 void
 FileSource::close()
 {
@@ -100,15 +242,48 @@ FileSource::findReadableSize()
     d_raw_stream->seekg(0, d_raw_stream->beg);
 }
 
+void
+FileSource::findMappedReadableSize()
+{
+    // See findReadableSize() for why the zeroed bytes at the end are ignored.
+    size_t readable_size = d_map_size;
+    while (readable_size > 0 && d_map[readable_size - 1] == 0x00) {
+        --readable_size;
+    }
+    if (readable_size == 0) {
+        readable_size = d_map_size;
+    }
+    d_unread = std::string_view(d_map, readable_size);
+}
+
 void
 FileSource::_close()
 {
-    d_raw_stream->close();
+    if (!d_mapped) {
+        if (d_decompressing_buf) {
+            d_decompressing_buf->close();
+        }
+        if (d_fd != -1) {
+            ::close(d_fd);
+            d_fd = -1;
+        }
+        d_raw_stream->close();
+        return;
+    }
+    d_unread = {};
+    d_map_open = false;
+    if (d_map != nullptr) {
+        ::munmap(d_map, d_map_size);
+        d_map = nullptr;
+    }
 }
 
 bool
 FileSource::is_open()
 {
+    if (d_mapped) {
+        return d_map_open;
+    }
     return d_raw_stream->is_open();
 }
 
@@ -117,10 +292,394 @@ FileSource::~FileSource()
     _close();
 }
 
+DecompressingBuf::DecompressingBuf(std::istream& source)
+: d_source(&source)
+{
+    setg(nullptr, nullptr, nullptr);
+    d_threads.emplace_back(&DecompressingBuf::runSequential, this);
+}
+
+DecompressingBuf::DecompressingBuf(int fd, frame_index_t index)
+: d_fd(fd)
+, d_index(std::move(index))
+{
+    // The last entry only marks where the last frame ends.
+    const size_t n_frames = d_index.size() - 1;
+    const size_t n_cpus = std::thread::hardware_concurrency();
+    const size_t n_workers = std::clamp<size_t>(n_cpus > 1 ? n_cpus - 1 : 1, 1, MAX_WORKERS);
+    d_max_queued = 2 * n_workers;
+    d_end = n_frames;
+    setg(nullptr, nullptr, nullptr);
+    for (size_t i = 0; i < std::min(n_workers, n_frames); ++i) {
+        d_threads.emplace_back(&DecompressingBuf::runIndexed, this);
+    }
+}
+
+DecompressingBuf::~DecompressingBuf()
+{
+    close();
+}
+
+DecompressingBuf::frame_index_t
+DecompressingBuf::readIndex(int fd)
+{
+    using tracking_api::COMPRESSED_FRAME_INDEX_MAGIC;
+    using tracking_api::COMPRESSED_FRAME_INDEX_TAG;
+    auto readLittleEndian = [](const unsigned char* data, size_t size) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; ++i) {
+            value |= static_cast<uint64_t>(data[i]) << (8 * i);
+        }
+        return value;
+    };
+
+    struct stat info;
+    if (::fstat(fd, &info) == -1) {
+        return {};
+    }
+    const uint64_t file_size = info.st_size;
+    const size_t tag_size = sizeof(COMPRESSED_FRAME_INDEX_TAG);
+    unsigned char footer[sizeof(uint64_t) + tag_size];
+    if (file_size < sizeof(footer)
+        || ::pread(fd, footer, sizeof(footer), file_size - sizeof(footer)) != sizeof(footer)
+        || 0 != ::memcmp(footer + sizeof(uint64_t), COMPRESSED_FRAME_INDEX_TAG, tag_size))
+    {
+        return {};
+    }
+
+    const uint64_t n_entries = readLittleEndian(footer, sizeof(uint64_t));
+    const size_t entry_size = 2 * sizeof(uint64_t);
+    if (n_entries < 2 || n_entries > file_size / entry_size) {
+        return {};
+    }
+    const uint64_t frame_size = 2 * sizeof(uint32_t) + n_entries * entry_size + sizeof(footer);
+    if (frame_size > file_size) {
+        return {};
+    }
+    std::vector<unsigned char> frame(frame_size - sizeof(footer));
+    const uint64_t frame_start = file_size - frame_size;
+    if (::pread(fd, frame.data(), frame.size(), frame_start) != static_cast<ssize_t>(frame.size())
+        || readLittleEndian(frame.data(), sizeof(uint32_t)) != COMPRESSED_FRAME_INDEX_MAGIC
+        || readLittleEndian(frame.data() + sizeof(uint32_t), sizeof(uint32_t))
+                   != frame_size - 2 * sizeof(uint32_t))
+    {
+        return {};
+    }
+
+    frame_index_t index;
+    index.reserve(n_entries);
+    const unsigned char* entry = frame.data() + 2 * sizeof(uint32_t);
+    for (uint64_t i = 0; i < n_entries; ++i, entry += entry_size) {
+        index.push_back(
+                {readLittleEndian(entry, sizeof(uint64_t)),
+                 readLittleEndian(entry + sizeof(uint64_t), sizeof(uint64_t))});
+        if (i && (index[i].compressed_offset < index[i - 1].compressed_offset
+                  || index[i].uncompressed_offset < index[i - 1].uncompressed_offset))
+        {
+            return {};
+        }
+    }
+    if (index.front().compressed_offset != 0 || index.back().compressed_offset != frame_start) {
+        return {};
+    }
+    return index;
+}
+
+void
+DecompressingBuf::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_closed = true;
+    }
+    d_not_full.notify_all();
+    d_not_empty.notify_one();
+    for (auto& thread : d_threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+bool
+DecompressingBuf::skipTo(size_t offset)
+{
+    if (d_index.empty()) {
+        return false;
+    }
+    const size_t position = d_current_offset + (gptr() - eback());
+    if (offset < position || offset > d_index.back().uncompressed_offset) {
+        return false;
+    }
+    if (offset <= d_current_offset + (egptr() - eback())) {
+        setg(eback(), eback() + (offset - d_current_offset), egptr());
+        return true;
+    }
+
+    // The frame that the offset is in, which is after the current one.
+    auto it = std::upper_bound(
+            d_index.begin(),
+            d_index.end() - 1,
+            offset,
+            [](size_t value, const tracking_api::CompressedFrameIndexEntry& entry) {
+                return value < entry.uncompressed_offset;
+            });
+    const size_t frame = (it - d_index.begin()) - 1;
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_ready.erase(d_ready.begin(), d_ready.lower_bound(frame));
+        d_next_read = frame;
+        d_next_claim = std::max(d_next_claim, frame);
+        d_pending_skip = offset - d_index[frame].uncompressed_offset;
+    }
+    d_current_offset = offset;
+    setg(nullptr, nullptr, nullptr);
+    d_not_full.notify_all();
+    return true;
+}
+
+DecompressingBuf::Chunk
+DecompressingBuf::freeChunk()
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    if (d_free_chunks.empty()) {
+        return Chunk{std::vector<char>(CHUNK_SIZE), 0};
+    }
+    Chunk chunk = std::move(d_free_chunks.back());
+    d_free_chunks.pop_back();
+    chunk.size = 0;
+    return chunk;
+}
+
+bool
+DecompressingBuf::publish(size_t sequence, Chunk& chunk)
+{
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_not_full.wait(lock, [&] { return sequence < d_next_read + d_max_queued || d_closed; });
+        if (d_closed) {
+            return false;
+        }
+        if (sequence >= d_next_read) {
+            d_ready.emplace(sequence, std::move(chunk));
+        } else {
+            // Skipped over while it was being decompressed.
+            d_free_chunks.push_back(std::move(chunk));
+        }
+    }
+    d_not_empty.notify_one();
+    return true;
+}
+
+void
+DecompressingBuf::endAt(size_t sequence)
+{
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_end = std::min(d_end, sequence);
+    }
+    d_not_empty.notify_one();
+    d_not_full.notify_all();
+}
+
+void
+DecompressingBuf::runSequential()
+{
+    LZ4F_dctx* dctx = nullptr;
+    size_t ret = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    bool ok = !LZ4F_isError(ret);
+    if (!ok) {
+        dctx = nullptr;
+        LOG(ERROR) << "Failed to create LZ4 decompression context: " << LZ4F_getErrorName(ret);
+    }
+
+    std::vector<char> input(INPUT_SIZE);
+    Chunk chunk = freeChunk();
+    size_t sequence = 0;
+    while (ok) {
+        d_source->read(input.data(), input.size());
+        const size_t input_end = d_source->gcount();
+        if (input_end == 0) {
+            break;
+        }
+        size_t input_begin = 0;
+        while (ok && input_begin < input_end) {
+            size_t output_size = CHUNK_SIZE - chunk.size;
+            size_t input_size = input_end - input_begin;
+            ret = LZ4F_decompress(
+                    dctx,
+                    chunk.data.data() + chunk.size,
+                    &output_size,
+                    input.data() + input_begin,
+                    &input_size,
+                    nullptr);
+            if (LZ4F_isError(ret)) {
+                LOG(ERROR) << "LZ4 decompression failed: " << LZ4F_getErrorName(ret);
+                ok = false;
+                break;
+            }
+            input_begin += input_size;
+            chunk.size += output_size;
+            if (chunk.size == CHUNK_SIZE) {
+                ok = publish(sequence++, chunk);
+                chunk = freeChunk();
+            }
+        }
+    }
+    // Whatever was decompressed before an error is still handed over, like
+    // a truncated uncompressed file would be.
+    if (chunk.size != 0 && publish(sequence, chunk)) {
+        ++sequence;
+    }
+    if (dctx) {
+        LZ4F_freeDecompressionContext(dctx);
+    }
+    endAt(sequence);
+}
+
+bool
+DecompressingBuf::decompressFrame(LZ4F_dctx* dctx, size_t frame, std::vector<char>& input, Chunk& chunk)
+{
+    const auto& entry = d_index[frame];
+    const auto& next = d_index[frame + 1];
+    const size_t input_size = next.compressed_offset - entry.compressed_offset;
+    const size_t output_size = next.uncompressed_offset - entry.uncompressed_offset;
+    input.resize(input_size);
+    if (chunk.data.size() < output_size) {
+        chunk.data.resize(output_size);
+    }
+
+    size_t bytes_read = 0;
+    while (bytes_read < input_size) {
+        ssize_t ret = ::pread(
+                d_fd,
+                input.data() + bytes_read,
+                input_size - bytes_read,
+                entry.compressed_offset + bytes_read);
+        if (ret <= 0 && !(ret < 0 && errno == EINTR)) {
+            LOG(ERROR) << "Failed to read compressed frame: " << (ret ? strerror(errno) : "end of file");
+            return false;
+        }
+        bytes_read += std::max<ssize_t>(ret, 0);
+    }
+
+    size_t input_begin = 0;
+    size_t ret = 0;
+    while (input_begin < input_size) {
+        size_t output_left = output_size - chunk.size;
+        size_t input_left = input_size - input_begin;
+        ret = LZ4F_decompress(
+                dctx,
+                chunk.data.data() + chunk.size,
+                &output_left,
+                input.data() + input_begin,
+                &input_left,
+                nullptr);
+        if (LZ4F_isError(ret)) {
+            LOG(ERROR) << "LZ4 decompression failed: " << LZ4F_getErrorName(ret);
+            return false;
+        }
+        if (input_left == 0 && output_left == 0) {
+            break;
+        }
+        input_begin += input_left;
+        chunk.size += output_left;
+    }
+    if (ret != 0 || chunk.size != output_size) {
+        LOG(ERROR) << "Compressed frame " << frame << " doesn't match the index of the file";
+        return false;
+    }
+    return true;
+}
+
+void
+DecompressingBuf::runIndexed()
+{
+    LZ4F_dctx* dctx = nullptr;
+    size_t ret = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    if (LZ4F_isError(ret)) {
+        LOG(ERROR) << "Failed to create LZ4 decompression context: " << LZ4F_getErrorName(ret);
+        endAt(0);
+        return;
+    }
+
+    std::vector<char> input;
+    while (true) {
+        size_t frame;
+        {
+            std::unique_lock<std::mutex> lock(d_mutex);
+            d_not_full.wait(lock, [this] {
+                return d_next_claim < d_next_read + d_max_queued || d_next_claim >= d_end || d_closed;
+            });
+            if (d_next_claim >= d_end || d_closed) {
+                break;
+            }
+            frame = d_next_claim++;
+        }
+        Chunk chunk = freeChunk();
+        if (!decompressFrame(dctx, frame, input, chunk)) {
+            endAt(frame);
+            break;
+        }
+        if (!publish(frame, chunk)) {
+            break;
+        }
+    }
+    LZ4F_freeDecompressionContext(dctx);
+}
+
+int
+DecompressingBuf::underflow()
+{
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    size_t skip;
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        if (!d_current.data.empty()) {
+            d_free_chunks.push_back(std::move(d_current));
+            d_current = Chunk{};
+        }
+        setg(nullptr, nullptr, nullptr);
+        d_not_empty.wait(lock, [this] {
+            return d_ready.count(d_next_read) || d_next_read >= d_end || d_closed;
+        });
+        auto it = d_ready.find(d_next_read);
+        if (it == d_ready.end()) {
+            return traits_type::eof();
+        }
+        d_current = std::move(it->second);
+        d_ready.erase(it);
+        if (!d_index.empty()) {
+            d_current_offset = d_index[d_next_read].uncompressed_offset;
+        }
+        ++d_next_read;
+        skip = std::exchange(d_pending_skip, 0);
+    }
+    d_not_full.notify_all();
+
+    char* begin = d_current.data.data();
+    setg(begin, begin + skip, begin + d_current.size);
+    if (gptr() == egptr()) {
+        return underflow();
+    }
+    return traits_type::to_int_type(*gptr());
+}
+
 SocketBuf::SocketBuf(int socket_fd)
 : d_sockfd(socket_fd)
+, d_input(MIN_BUFFER_SIZE)
+{
+    setg(d_input.data(), d_input.data(), d_input.data());
+}
+
+SocketBuf::~SocketBuf()
 {
-    setg(d_buf, d_buf, d_buf);
+    if (d_dctx) {
+        LZ4F_freeDecompressionContext(d_dctx);
+    }
 }
 
 void
@@ -129,31 +688,96 @@ SocketBuf::close()
     d_open = false;
 }
 
-int
-SocketBuf::underflow()
+bool
+SocketBuf::receive()
 {
-    if (gptr() < egptr()) {
-        return traits_type::to_int_type(*gptr());
+    // Nothing received before is still referenced, so the buffer can grow.
+    if (d_input_filled && d_input.size() < MAX_BUFFER_SIZE) {
+        d_input.resize(d_input.size() * 2);
     }
 
     ssize_t bytes_read;
     do {
-        bytes_read = ::recv(d_sockfd, d_buf, MAX_BUF_SIZE, 0);
+        bytes_read = ::recv(d_sockfd, d_input.data(), d_input.size(), 0);
     } while (bytes_read < 0 && errno == EINTR);
 
     if (bytes_read < 0) {
         if (d_open) {
             LOG(ERROR) << "Encountered error in 'recv' call: " << strerror(errno);
         }
-        return traits_type::eof();
+        return false;
     }
 
-    if (bytes_read == 0) {
-        return traits_type::eof();
+    d_input_begin = 0;
+    d_input_end = bytes_read;
+    d_input_filled = static_cast<size_t>(bytes_read) == d_input.size();
+    return bytes_read > 0;
+}
+
+bool
+SocketBuf::startDecompressing()
+{
+    size_t ret = LZ4F_createDecompressionContext(&d_dctx, LZ4F_VERSION);
+    if (LZ4F_isError(ret)) {
+        d_dctx = nullptr;
+        LOG(ERROR) << "Failed to create LZ4 decompression context: " << LZ4F_getErrorName(ret);
+        return false;
     }
+    d_output.resize(OUTPUT_SIZE);
+    return true;
+}
 
-    setg(d_buf, d_buf, d_buf + bytes_read);
-    return traits_type::to_int_type(*gptr());
+int
+SocketBuf::underflow()
+{
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    while (true) {
+        if (d_input_begin == d_input_end && !receive()) {
+            return traits_type::eof();
+        }
+
+        if (d_encoding == Encoding::UNKNOWN) {
+            // An uncompressed stream starts with the magic of the header,
+            // which can't be mistaken for the first byte of an LZ4 frame.
+            bool compressed = d_input[0] == 0x04;
+            if (compressed && !startDecompressing()) {
+                return traits_type::eof();
+            }
+            d_encoding = compressed ? Encoding::LZ4 : Encoding::RAW;
+        }
+
+        if (d_encoding == Encoding::RAW) {
+            char* begin = d_input.data() + d_input_begin;
+            char* end = d_input.data() + d_input_end;
+            d_input_begin = d_input_end;
+            setg(begin, begin, end);
+            return traits_type::to_int_type(*gptr());
+        }
+
+        // The decompressor keeps whatever it can't decode yet, so it consumes
+        // all of its input unless it fills the output buffer first.
+        size_t output_size = d_output.size();
+        size_t input_size = d_input_end - d_input_begin;
+        size_t ret = LZ4F_decompress(
+                d_dctx,
+                d_output.data(),
+                &output_size,
+                d_input.data() + d_input_begin,
+                &input_size,
+                nullptr);
+        if (LZ4F_isError(ret)) {
+            LOG(ERROR) << "Failed to decompress the records received: " << LZ4F_getErrorName(ret);
+            return traits_type::eof();
+        }
+        d_input_begin += input_size;
+        if (output_size) {
+            setg(d_output.data(), d_output.data(), d_output.data() + output_size);
+            return traits_type::to_int_type(*gptr());
+        }
+    }
 }
 
 std::streamsize
@@ -291,4 +915,76 @@ SocketSource::~SocketSource()
     _close();
 }
 
+PipeSource::PipeSource(std::shared_ptr<Pipe> pipe)
+: d_pipe(std::move(pipe))
+{
+}
+
+PipeSource::~PipeSource()
+{
+    close();
+}
+
+void
+PipeSource::close()
+{
+    d_is_open = false;
+    d_pipe->close(true);
+}
+
+bool
+PipeSource::is_open()
+{
+    return d_is_open;
+}
+
+bool
+PipeSource::fill()
+{
+    while (d_chunk_offset == d_chunk.size()) {
+        d_chunk_offset = 0;
+        if (!d_is_open || !d_pipe->read(&d_chunk)) {
+            d_chunk.clear();
+            d_is_open = false;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+PipeSource::read(char* result, ssize_t length)
+{
+    while (length > 0) {
+        if (!fill()) {
+            return false;
+        }
+        const size_t n = std::min(static_cast<size_t>(length), d_chunk.size() - d_chunk_offset);
+        memcpy(result, d_chunk.data() + d_chunk_offset, n);
+        d_chunk_offset += n;
+        result += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool
+PipeSource::getline(std::string& result, char delimiter)
+{
+    while (fill()) {
+        const char* begin = d_chunk.data() + d_chunk_offset;
+        const size_t available = d_chunk.size() - d_chunk_offset;
+        const void* found = memchr(begin, delimiter, available);
+        if (found) {
+            const size_t n = static_cast<const char*>(found) - begin;
+            result.append(begin, n);
+            d_chunk_offset += n + 1;
+            return true;
+        }
+        result.append(begin, available);
+        d_chunk_offset += available;
+    }
+    return false;
+}
+
 }  // namespace memray::io
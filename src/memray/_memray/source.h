@@ -1,17 +1,24 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <fstream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
 #include "lz4_stream.h"
+#include "pipe.h"
+#include "records.h"
 
 namespace memray::io {
 
-const int MAX_BUF_SIZE = 4096;
-
 class Source
 {
   public:
@@ -20,6 +27,104 @@ class Source
     virtual bool is_open() = 0;
     virtual bool read(char* result, ssize_t length) = 0;
     virtual bool getline(std::string& result, char delimiter) = 0;
+
+    // Sources that hold all of their input in memory return a view of the
+    // bytes that haven't been read yet, so that callers can decode them in
+    // place. Callers doing so must remove the bytes they consume from the
+    // front of the view. Other sources return nullptr.
+    virtual std::string_view* mappedData()
+    {
+        return nullptr;
+    }
+    // Move forward to the given offset from the start of the input. Sources
+    // that can't seek read up to it instead, and none of them go backwards.
+    virtual bool skipTo(size_t)
+    {
+        return false;
+    }
+    // Make every read that would go past the given offset from the start of
+    // the input fail, as if the input ended there.
+    virtual bool endAt(size_t)
+    {
+        return false;
+    }
+    // Open another input found next to this one, or return nullptr if this
+    // kind of source has nothing next to it.
+    virtual std::unique_ptr<Source> openSibling(const std::string&)
+    {
+        return nullptr;
+    }
+};
+
+// Decompresses an LZ4 compressed stream on threads of its own, so that
+// decompressing the capture file overlaps with parsing the records in it.
+// Without an index the frames are decompressed one after another by a single
+// thread. With the index of a complete compressed capture, several frames are
+// decompressed at once, and the stream can skip over frames. Decompressed
+// chunks are handed over in order through a small bounded queue, and the
+// buffers of the ones already read are given back to be filled again.
+class DecompressingBuf : public std::streambuf
+{
+  public:
+    using frame_index_t = std::vector<tracking_api::CompressedFrameIndexEntry>;
+
+    explicit DecompressingBuf(std::istream& source);
+    // The file descriptor must stay open until this is closed.
+    DecompressingBuf(int fd, frame_index_t index);
+    ~DecompressingBuf() override;
+
+    DecompressingBuf(DecompressingBuf& other) = delete;
+    DecompressingBuf(DecompressingBuf&& other) = delete;
+    void operator=(const DecompressingBuf&) = delete;
+    void operator=(DecompressingBuf&&) = delete;
+
+    // Stop decompressing and wait for the threads to finish. The source
+    // isn't touched anymore once this returns.
+    void close();
+    // Move forward to the given offset of the decompressed stream without
+    // decompressing the frames before it. Only possible with an index.
+    bool skipTo(size_t offset);
+
+    // Read the index at the end of a compressed capture, if it has one.
+    static frame_index_t readIndex(int fd);
+
+  private:
+    static constexpr size_t INPUT_SIZE{256 * 1024};  // 256 KiB
+    static constexpr size_t CHUNK_SIZE{1024 * 1024};  // 1 MiB
+    static constexpr size_t MAX_QUEUED_CHUNKS{4};
+    static constexpr size_t MAX_WORKERS{4};
+
+    struct Chunk
+    {
+        std::vector<char> data;
+        size_t size;
+    };
+
+    int underflow() override;
+    void runSequential();
+    void runIndexed();
+    bool decompressFrame(LZ4F_dctx* dctx, size_t frame, std::vector<char>& input, Chunk& chunk);
+    bool publish(size_t sequence, Chunk& chunk);
+    void endAt(size_t sequence);
+    Chunk freeChunk();
+
+    std::istream* d_source{nullptr};
+    int d_fd{-1};
+    frame_index_t d_index{};
+    size_t d_max_queued{MAX_QUEUED_CHUNKS};
+    size_t d_current_offset{0};
+    std::mutex d_mutex;
+    std::condition_variable d_not_empty;
+    std::condition_variable d_not_full;
+    std::map<size_t, Chunk> d_ready{};
+    std::vector<Chunk> d_free_chunks{};
+    Chunk d_current{};
+    size_t d_next_read{0};
+    size_t d_next_claim{0};
+    size_t d_end{SIZE_MAX};
+    size_t d_pending_skip{0};
+    bool d_closed{false};
+    std::vector<std::thread> d_threads;
 };
 
 class FileSource : public Source
@@ -36,28 +141,72 @@ class FileSource : public Source
     bool is_open() override;
     bool read(char* result, ssize_t length) override;
     bool getline(std::string& result, char delimiter) override;
+    std::string_view* mappedData() override;
+    bool skipTo(size_t offset) override;
+    bool endAt(size_t offset) override;
+    std::unique_ptr<Source> openSibling(const std::string& file_name) override;
 
   private:
     void _close();
+    bool mapFile(int fd);
     void findReadableSize();
-    const std::string& d_file_name;
+    void findMappedReadableSize();
+    const std::string d_file_name;
     std::shared_ptr<std::ifstream> d_raw_stream;
+    std::unique_ptr<DecompressingBuf> d_decompressing_buf;
+    // Kept open for a DecompressingBuf that reads frames from an index.
+    int d_fd{-1};
     std::shared_ptr<std::istream> d_stream;
     std::streamoff d_readable_size{};
     std::streamoff d_bytes_read{};
+
+    // Uncompressed files are mapped into memory instead of being read
+    // through the streams above.
+    char* d_map{nullptr};
+    size_t d_map_size{0};
+    bool d_mapped{false};
+    bool d_map_open{false};
+    std::string_view d_unread{};
 };
 
+// Reads the stream of records sent by a SocketSink, decompressing it if the
+// sink compressed it. The buffer that it receives into starts small and is
+// doubled, up to a limit, whenever a read fills it, so that a reader that
+// falls behind catches up with fewer system calls.
 class SocketBuf : public std::streambuf
 {
   public:
     explicit SocketBuf(int socket_fd);
+    ~SocketBuf() override;
+
+    SocketBuf(SocketBuf& other) = delete;
+    SocketBuf(SocketBuf&& other) = delete;
+    void operator=(const SocketBuf&) = delete;
+    void operator=(SocketBuf&&) = delete;
+
     void close();
 
   private:
+    static constexpr size_t MIN_BUFFER_SIZE{64 * 1024};  // 64 KiB
+    static constexpr size_t MAX_BUFFER_SIZE{4 * 1024 * 1024};  // 4 MiB
+    static constexpr size_t OUTPUT_SIZE{1024 * 1024};  // 1 MiB
+
+    enum class Encoding { UNKNOWN, RAW, LZ4 };
+
     int underflow() override;
     std::streamsize xsgetn(char_type* s, std::streamsize n) override;
+    bool receive();
+    bool startDecompressing();
+
     int d_sockfd{-1};
-    char d_buf[MAX_BUF_SIZE];
+    Encoding d_encoding{Encoding::UNKNOWN};
+    std::vector<char> d_input;
+    size_t d_input_begin{0};
+    size_t d_input_end{0};
+    bool d_input_filled{false};
+    // Only used when the stream is compressed.
+    LZ4F_dctx* d_dctx{nullptr};
+    std::vector<char> d_output{};
     std::atomic<bool> d_open{true};
 };
 
@@ -83,4 +232,30 @@ class SocketSource : public Source
     std::unique_ptr<SocketBuf> d_socket_buf;
 };
 
+// Reads what a PipeSink in the same process writes, waiting for more until
+// the sink is destroyed.
+class PipeSource : public Source
+{
+  public:
+    PipeSource(PipeSource& other) = delete;
+    PipeSource(PipeSource&& other) = delete;
+    void operator=(const PipeSource&) = delete;
+    void operator=(PipeSource&&) = delete;
+
+    explicit PipeSource(std::shared_ptr<Pipe> pipe);
+    ~PipeSource() override;
+    void close() override;
+    bool is_open() override;
+    bool read(char* result, ssize_t length) override;
+    bool getline(std::string& result, char delimiter) override;
+
+  private:
+    bool fill();
+
+    std::shared_ptr<Pipe> d_pipe;
+    std::atomic<bool> d_is_open{true};
+    std::string d_chunk{};
+    size_t d_chunk_offset{0};
+};
+
 }  // namespace memray::io
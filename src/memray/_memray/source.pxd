@@ -1,4 +1,6 @@
+from _memray.pipe cimport Pipe
 from libcpp cimport bool
+from libcpp.memory cimport shared_ptr
 from libcpp.string cimport string
 
 
@@ -11,3 +13,6 @@ cdef extern from "source.h" namespace "memray::io":
 
     cdef cppclass SocketSource(Source):
         SocketSource(int port) except+ IOError
+
+    cdef cppclass PipeSource(Source):
+        PipeSource(shared_ptr[Pipe] pipe) except +
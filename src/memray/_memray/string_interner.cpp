@@ -0,0 +1,85 @@
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include "string_interner.h"
+
+namespace memray::api {
+
+namespace {  // unnamed
+
+// Most strings are a few dozens of bytes, so an arena holds thousands of
+// them. Strings longer than a quarter of it get an arena of their own.
+constexpr size_t ARENA_SIZE = 64 * 1024;
+
+}  // namespace
+
+StringInterner::StringInterner()
+{
+    d_strings.reserve(4096);
+    d_ids.reserve(4096);
+    intern("");
+}
+
+StringInterner::id_t
+StringInterner::intern(std::string_view string)
+{
+    auto it = d_ids.find(string);
+    if (it != d_ids.end()) {
+        return it->second;
+    }
+    if (d_strings.size() > std::numeric_limits<id_t>::max()) {
+        throw std::overflow_error("Too many distinct strings in the capture");
+    }
+    const auto id = static_cast<id_t>(d_strings.size());
+    const std::string_view interned(copy(string), string.size());
+    d_strings.push_back(interned);
+    d_ids.emplace(interned, id);
+    return id;
+}
+
+std::string_view
+StringInterner::get(id_t id) const
+{
+    return d_strings[id];
+}
+
+const char*
+StringInterner::c_str(id_t id) const
+{
+    return d_strings[id].data();
+}
+
+size_t
+StringInterner::size() const
+{
+    return d_strings.size();
+}
+
+const char*
+StringInterner::copy(std::string_view string)
+{
+    const size_t needed = string.size() + 1;
+    char* destination;
+    if (needed > ARENA_SIZE / 4) {
+        // Don't waste what's left of the current arena on a long string.
+        d_arenas.emplace_back(new char[needed]);
+        destination = d_arenas.back().get();
+    } else {
+        if (needed > d_arena_left) {
+            d_arenas.emplace_back(new char[ARENA_SIZE]);
+            d_arena_cursor = d_arenas.back().get();
+            d_arena_left = ARENA_SIZE;
+        }
+        destination = d_arena_cursor;
+        d_arena_cursor += needed;
+        d_arena_left -= needed;
+    }
+    if (!string.empty()) {
+        std::memcpy(destination, string.data(), string.size());
+    }
+    destination[string.size()] = '\0';
+    return destination;
+}
+
+}  // namespace memray::api
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace memray::api {
+
+// Stores every distinct string that a reader sees (function names, file
+// names, names of memory maps) once, and names it by a small id. The strings
+// are copied into arenas that are never freed or moved while the interner
+// lives, so the views and pointers handed out stay valid, and every string
+// is NUL terminated, so it can be given to C APIs too. The empty string is
+// always id 0.
+class StringInterner
+{
+  public:
+    using id_t = uint32_t;
+
+    // Constructors
+    StringInterner();
+    StringInterner(StringInterner& other) = delete;
+    StringInterner(StringInterner&& other) = delete;
+    void operator=(const StringInterner&) = delete;
+    void operator=(StringInterner&&) = delete;
+
+    // Methods
+    id_t intern(std::string_view string);
+    std::string_view get(id_t id) const;
+    const char* c_str(id_t id) const;
+
+    // Getters
+    size_t size() const;
+
+  private:
+    // Methods
+    const char* copy(std::string_view string);
+
+    // Data members
+    std::vector<std::unique_ptr<char[]>> d_arenas{};
+    char* d_arena_cursor{nullptr};
+    size_t d_arena_left{0};
+    std::vector<std::string_view> d_strings{};
+    std::unordered_map<std::string_view, id_t> d_ids{};
+};
+
+}  // namespace memray::api
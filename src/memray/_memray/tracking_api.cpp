@@ -5,15 +5,26 @@
 
 #ifdef __linux__
 #    include <link.h>
+#    include <pthread.h>
 #elif defined(__APPLE__)
 #    include "macho_utils.h"
 #    include <mach/mach.h>
 #    include <mach/task.h>
+#    include <pthread.h>
 #endif
 
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <mutex>
 #include <type_traits>
+#include <fcntl.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include "compat.h"
@@ -54,6 +65,7 @@ starts_with(const std::string& haystack, const std::string_view& needle)
 namespace memray::tracking_api {
 
 MEMRAY_FAST_TLS thread_local bool RecursionGuard::isActive = false;
+MEMRAY_FAST_TLS thread_local unsigned int TrackedRegion::depth = 0;
 
 static inline thread_id_t
 generate_next_tid()
@@ -70,6 +82,99 @@ thread_id()
     return t_tid;
 }
 
+// Per-thread state of the allocation sampler. Like the PythonStackTracker,
+// this must be trivially destructible.
+struct SamplerState
+{
+    uint64_t rng_state;
+    ssize_t bytes_until_next_sample;
+    bool initialized;
+};
+
+MEMRAY_FAST_TLS thread_local SamplerState t_sampler_state{};
+
+// The index of the native trace of the last allocation this thread tracked.
+// Every new tracker forgets the previous unwinds, so this is never reused
+// with the tree of another tracker.
+MEMRAY_FAST_TLS thread_local frame_id_t t_last_native_index{0};
+
+static uint64_t
+nextRandom(uint64_t* state)
+{
+    // splitmix64: fast, allocation free and good enough for sampling.
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static ssize_t
+nextSampleInterval(uint64_t* state, size_t mean)
+{
+    // The distance between two sampled bytes follows an exponential
+    // distribution, exactly like the times between events in a Poisson
+    // process. Because it is memoryless, the countdown does not need to be
+    // adjusted for the bytes that overflow the sampled allocation.
+    double uniform = static_cast<double>((nextRandom(state) >> 11) + 1) * 0x1.0p-53;
+    double interval = -std::log(uniform) * static_cast<double>(mean);
+    if (interval >= static_cast<double>(std::numeric_limits<ssize_t>::max())) {
+        return std::numeric_limits<ssize_t>::max();
+    }
+    return std::max(static_cast<ssize_t>(interval), ssize_t(1));
+}
+
+// Line numbers of the (code object, instruction offset) pairs seen most
+// recently by a thread. Every allocation needs the line number of its most
+// recent Python frame, and PyFrame_GetLineNumber decodes the code object's
+// line table from its start to find it, which adds up in allocation heavy
+// loops that allocate from the same few instructions over and over.
+class LineNumberCache
+{
+  public:
+    int lineNumber(PyFrameObject* frame, PyCodeObject* code)
+    {
+        int lasti = compat::frameGetLasti(frame);
+        if (lasti < 0) {
+            return PyFrame_GetLineNumber(frame);
+        }
+
+        // The first line number is checked too, to make it unlikely that
+        // a new code object that reuses the address of a destroyed one
+        // is confused with it.
+        Entry& entry = d_entries[slot(code, lasti)];
+        if (entry.code != code || entry.lasti != lasti
+            || entry.firstlineno != code->co_firstlineno)
+        {
+            entry = {code, lasti, code->co_firstlineno, PyFrame_GetLineNumber(frame)};
+        }
+        return entry.lineno;
+    }
+
+    void clear()
+    {
+        d_entries.fill({});
+    }
+
+  private:
+    struct Entry
+    {
+        PyCodeObject* code;
+        int lasti;
+        int firstlineno;
+        int lineno;
+    };
+
+    static constexpr size_t NUM_ENTRIES = 128;
+
+    static size_t slot(PyCodeObject* code, int lasti)
+    {
+        auto hash = (reinterpret_cast<uintptr_t>(code) >> 4) * 31 + static_cast<unsigned>(lasti);
+        return hash % NUM_ENTRIES;
+    }
+
+    std::array<Entry, NUM_ENTRIES> d_entries{};
+};
+
 // Tracker interface
 
 // This class must have a trivial destructor (and therefore all its instance
@@ -95,27 +200,46 @@ class PythonStackTracker
     struct LazilyEmittedFrame
     {
         PyFrameObject* frame;
+        // Borrowed, kept alive by the frame. It is fetched while the GIL is
+        // held, since getting it from the frame may touch its refcount.
+        PyCodeObject* code;
         RawFrame raw_frame_record;
         FrameState state;
+        // When the tracker interns Python stacks, the node of the stack that
+        // ends with this frame. Only meaningful once the frame is emitted.
+        FrameTree::index_t stack_index{0};
     };
 
   public:
     static bool s_greenlet_tracking_enabled;
     static bool s_native_tracking_enabled;
+    // The number of innermost frames kept in each interned stack, or 0 to
+    // keep them all.
+    static size_t s_max_depth;
+    // The code of the event loop's create_task method while asyncio tasks
+    // are being tracked, and null otherwise.
+    static PyObject* s_create_task_code;
 
     static void installProfileHooks();
     static void removeProfileHooks();
+    static bool usesSysMonitoring();
 
     void clear();
 
     static PythonStackTracker& get();
     void emitPendingPushesAndPops();
+    FrameTree::index_t currentStackIndex() const;
     void invalidateMostRecentFrameLineNumber();
     int pushPythonFrame(PyFrameObject* frame);
     void popPythonFrame();
 
     void installGreenletTraceFunctionIfNeeded();
     void handleGreenletSwitch(PyObject* from, PyObject* to);
+    void registerThreadCleanup();
+
+    static void beginTrackingAsyncioTasks();
+    static void endTrackingAsyncioTasks();
+    void recordTaskCreation(PyCodeObject* code, PyObject* return_value);
 
   private:
     // Fetch the thread-local stack tracker without checking if its stack needs to be reloaded.
@@ -126,6 +250,39 @@ class PythonStackTracker
     void reloadStackIfTrackerChanged();
 
     void pushLazilyEmittedFrame(const LazilyEmittedFrame& frame);
+    int lineNumber(const LazilyEmittedFrame& frame);
+
+    // The stack of a greenlet that isn't running, and the pops that are
+    // still owed to the stack recorded for its thread ID.
+    struct ParkedStack
+    {
+        std::vector<LazilyEmittedFrame> stack;
+        uint32_t num_pending_pops;
+        uint32_t tracker_generation;
+        // For a task, whether its stack starts with the frames of whatever
+        // created it, and the code objects of those frames.
+        bool initialized;
+        std::vector<PyObject*> owned_code;
+    };
+
+    static void destroyParkedStack(PyObject* capsule);
+    static ParkedStack* parkedStackFor(PyObject* obj, bool create);
+    void parkStack(PyObject* greenlet);
+    bool unparkStack(PyObject* greenlet);
+    static bool isTaskStepStart(PyFrameObject* frame, PyCodeObject* code);
+    void copyStackInto(size_t num_frames, ParkedStack* parked);
+    void enterTaskStep(PyFrameObject* frame);
+    void exitTaskStep();
+
+
+#if PY_VERSION_HEX >= 0x030C0000
+    static bool installMonitoringCallbacks();
+    static void removeMonitoringCallbacks();
+
+    // The sys.monitoring tool ID our callbacks are registered with, or -1 if
+    // the stack is followed with a profile function instead.
+    static int s_monitoring_tool_id;
+#endif
 
     static std::mutex s_mutex;
     static std::unordered_map<PyThreadState*, std::vector<LazilyEmittedFrame>> s_initial_stack_by_thread;
@@ -134,17 +291,37 @@ class PythonStackTracker
     uint32_t d_num_pending_pops{};
     uint32_t d_tracker_generation{};
     std::vector<LazilyEmittedFrame>* d_stack{};
+    LineNumberCache* d_line_number_cache{};
+    // While a task's step is running: the task, the frame its step started
+    // with, and the thread ID and stack of the event loop running it.
+    PyObject* d_task{};
+    PyFrameObject* d_task_step_frame{};
+    thread_id_t d_loop_tid{};
+    uint32_t d_loop_num_pending_pops{};
+    std::vector<LazilyEmittedFrame>* d_loop_stack{};
     bool d_greenlet_hooks_installed{};
+    bool d_thread_cleanup_registered{};
 };
 
 bool PythonStackTracker::s_greenlet_tracking_enabled{false};
 bool PythonStackTracker::s_native_tracking_enabled{false};
+size_t PythonStackTracker::s_max_depth{0};
+PyObject* PythonStackTracker::s_create_task_code{nullptr};
+#if PY_VERSION_HEX >= 0x030C0000
+int PythonStackTracker::s_monitoring_tool_id{-1};
+#endif
 
 std::mutex PythonStackTracker::s_mutex;
 std::unordered_map<PyThreadState*, std::vector<PythonStackTracker::LazilyEmittedFrame>>
         PythonStackTracker::s_initial_stack_by_thread;
 std::atomic<unsigned int> PythonStackTracker::s_tracker_generation;
 
+namespace {
+
+const RawFrame TRUNCATED_PYTHON_FRAME{TRUNCATED_FRAME_NAME, "", 0, false};
+
+}  // namespace
+
 PythonStackTracker&
 PythonStackTracker::get()
 {
@@ -177,9 +354,9 @@ PythonStackTracker::emitPendingPushesAndPops()
     auto it = d_stack->rbegin();
     for (; it != d_stack->rend(); ++it) {
         if (it->state == FrameState::NOT_EMITTED) {
-            it->raw_frame_record.lineno = PyFrame_GetLineNumber(it->frame);
+            it->raw_frame_record.lineno = lineNumber(*it);
         } else if (it->state == FrameState::EMITTED_BUT_LINE_NUMBER_MAY_HAVE_CHANGED) {
-            int lineno = PyFrame_GetLineNumber(it->frame);
+            int lineno = lineNumber(*it);
             if (lineno != it->raw_frame_record.lineno) {
                 // Line number was wrong; emit an artificial pop so we can push
                 // back in with the right line number.
@@ -197,13 +374,45 @@ PythonStackTracker::emitPendingPushesAndPops()
     }
     auto first_to_emit = it.base();
 
+    Tracker* tracker = Tracker::getTracker();
+    if (tracker->internsPythonStacks()) {
+        // Nothing needs to be written for the pops: every frame that is
+        // still emitted remembers the stack that ends with it, and new
+        // frames are interned on top of it.
+        d_num_pending_pops = 0;
+        for (auto to_emit = first_to_emit; to_emit != d_stack->end(); ++to_emit) {
+            FrameTree::index_t parent_index =
+                    to_emit == d_stack->begin() ? 0 : std::prev(to_emit)->stack_index;
+            if (s_max_depth && static_cast<size_t>(to_emit - d_stack->begin()) >= s_max_depth) {
+                // Too deep: the stack ending with this frame only keeps its
+                // innermost frames, on top of a marker for all of the others.
+                parent_index = tracker->internFrame(0, TRUNCATED_PYTHON_FRAME);
+                auto frame = to_emit - (s_max_depth - 1);
+                for (; parent_index && frame != to_emit; ++frame) {
+                    parent_index = tracker->internFrame(parent_index, frame->raw_frame_record);
+                }
+                if (!parent_index) {
+                    break;
+                }
+            }
+            to_emit->stack_index = tracker->internFrame(parent_index, to_emit->raw_frame_record);
+            if (!to_emit->stack_index) {
+                break;
+            }
+            to_emit->state = FrameState::EMITTED_AND_LINE_NUMBER_HAS_NOT_CHANGED;
+        }
+
+        invalidateMostRecentFrameLineNumber();
+        return;
+    }
+
     // Emit pending pops
-    Tracker::getTracker()->popFrames(d_num_pending_pops);
+    tracker->popFrames(d_num_pending_pops);
     d_num_pending_pops = 0;
 
     // Emit pending pushes
     for (auto to_emit = first_to_emit; to_emit != d_stack->end(); ++to_emit) {
-        if (!Tracker::getTracker()->pushFrame(to_emit->raw_frame_record)) {
+        if (!tracker->pushFrame(to_emit->raw_frame_record)) {
             break;
         }
         to_emit->state = FrameState::EMITTED_AND_LINE_NUMBER_HAS_NOT_CHANGED;
@@ -212,6 +421,15 @@ PythonStackTracker::emitPendingPushesAndPops()
     invalidateMostRecentFrameLineNumber();
 }
 
+FrameTree::index_t
+PythonStackTracker::currentStackIndex() const
+{
+    if (!d_stack || d_stack->empty() || d_stack->back().state == FrameState::NOT_EMITTED) {
+        return 0;
+    }
+    return d_stack->back().stack_index;
+}
+
 void
 PythonStackTracker::invalidateMostRecentFrameLineNumber()
 {
@@ -228,7 +446,8 @@ PythonStackTracker::invalidateMostRecentFrameLineNumber()
 void
 PythonStackTracker::reloadStackIfTrackerChanged()
 {
-    // Note: this function does not require the GIL.
+    // Note: this function does not require the GIL, and it's called from the
+    // allocation hooks, so it must not call into the interpreter either.
     if (d_tracker_generation == s_tracker_generation) {
         return;
     }
@@ -243,6 +462,20 @@ PythonStackTracker::reloadStackIfTrackerChanged()
     }
     d_num_pending_pops = 0;
 
+    // Any task step that was running is forgotten: the captured stack has
+    // the real frames of the thread, ending with the task's.
+    if (d_task_step_frame) {
+        t_tid = d_loop_tid;
+        d_task = nullptr;
+        d_task_step_frame = nullptr;
+    }
+
+    // Code objects may have been destroyed and their addresses reused since
+    // the cached line numbers were looked up.
+    if (d_line_number_cache) {
+        d_line_number_cache->clear();
+    }
+
     std::vector<LazilyEmittedFrame> correct_stack;
 
     {
@@ -278,10 +511,15 @@ PythonStackTracker::pushPythonFrame(PyFrameObject* frame)
         return -1;
     }
 
+    if (s_create_task_code && !d_task_step_frame && isTaskStepStart(frame, code)) {
+        enterTaskStep(frame);
+    }
+
     // If native tracking is not enabled, treat every frame as an entry frame.
     // It doesn't matter to the reader, and is more efficient.
     bool is_entry_frame = !s_native_tracking_enabled || compat::isEntryFrame(frame);
-    pushLazilyEmittedFrame({frame, {function, filename, 0, is_entry_frame}, FrameState::NOT_EMITTED});
+    pushLazilyEmittedFrame(
+            {frame, code, {function, filename, 0, is_entry_frame}, FrameState::NOT_EMITTED});
     return 0;
 }
 
@@ -296,6 +534,21 @@ PythonStackTracker::pushLazilyEmittedFrame(const LazilyEmittedFrame& frame)
     d_stack->push_back(frame);
 }
 
+int
+PythonStackTracker::lineNumber(const LazilyEmittedFrame& frame)
+{
+    // Note: this function does not require the GIL.
+    if (!frame.frame) {
+        // The frame is one a task's stack was created with, and its line
+        // number was found when it was copied.
+        return frame.raw_frame_record.lineno;
+    }
+    if (!d_line_number_cache) {
+        d_line_number_cache = new LineNumberCache;
+    }
+    return d_line_number_cache->lineNumber(frame.frame, frame.code);
+}
+
 void
 PythonStackTracker::popPythonFrame()
 {
@@ -305,12 +558,17 @@ PythonStackTracker::popPythonFrame()
         return;
     }
 
+    bool ends_task_step = d_task_step_frame && d_stack->back().frame == d_task_step_frame;
     if (d_stack->back().state != FrameState::NOT_EMITTED) {
         d_num_pending_pops += 1;
         assert(d_num_pending_pops != 0);  // Ensure we didn't overflow.
     }
     d_stack->pop_back();
     invalidateMostRecentFrameLineNumber();
+
+    if (ends_task_step) {
+        exitTaskStep();
+    }
 }
 
 void
@@ -379,14 +637,9 @@ PythonStackTracker::handleGreenletSwitch(PyObject* from, PyObject* to)
 {
     RecursionGuard guard;
 
-    // Clear any old TLS stack, emitting pops for frames that had been pushed.
-    if (d_stack) {
-        d_num_pending_pops += std::count_if(d_stack->begin(), d_stack->end(), [](const auto& f) {
-            return f.state != FrameState::NOT_EMITTED;
-        });
-        d_stack->clear();
-        emitPendingPushesAndPops();
-    }
+    // Keep our TLS stack with the greenlet we're switching away from. The
+    // stack recorded for its thread ID stays as it is until it runs again.
+    parkStack(from);
 
     // Save current TID on old greenlet. Print errors but otherwise ignore them.
     PyObject* tid = PyLong_FromUnsignedLong(t_tid);
@@ -399,7 +652,8 @@ PythonStackTracker::handleGreenletSwitch(PyObject* from, PyObject* to)
     // maybe we haven't seen this TID before, or maybe someone overwrote our
     // attribute, but either way we can recover by generating a new one.
     tid = PyObject_GetAttrString(to, "_memray_tid");
-    if (!tid || !PyLong_CheckExact(tid)) {
+    bool restored_tid = tid && PyLong_CheckExact(tid);
+    if (!restored_tid) {
         PyErr_Clear();
         t_tid = generate_next_tid();
     } else {
@@ -407,7 +661,7 @@ PythonStackTracker::handleGreenletSwitch(PyObject* from, PyObject* to)
     }
     Py_XDECREF(tid);
 
-    // Re-create our TLS stack from our Python frames, most recent last.
+    // Collect our Python frames, most recent last.
     // Note: `frame` may be null; the new greenlet may not have a Python stack.
     PyFrameObject* frame = PyEval_GetFrame();
 
@@ -416,8 +670,477 @@ PythonStackTracker::handleGreenletSwitch(PyObject* from, PyObject* to)
         stack.push_back(frame);
         frame = compat::frameGetBack(frame);
     }
+    std::reverse(stack.begin(), stack.end());
+
+    // A suspended greenlet's frames don't change, so the stack it had when it
+    // was switched away from normally still matches them and nothing needs to
+    // be written. Otherwise keep the frames they have in common, and only pop
+    // and push the ones after them.
+    if (!restored_tid || !unparkStack(to)) {
+        d_stack->clear();
+    }
+
+    size_t common = 0;
+    while (common < d_stack->size() && common < stack.size()
+           && (*d_stack)[common].frame == stack[common])
+    {
+        ++common;
+    }
+    while (d_stack->size() > common) {
+        d_num_pending_pops += (d_stack->back().state != FrameState::NOT_EMITTED);
+        d_stack->pop_back();
+    }
+    invalidateMostRecentFrameLineNumber();
+
+    std::for_each(stack.begin() + common, stack.end(), [this](auto& frame) {
+        pushPythonFrame(frame);
+    });
+}
+
+static const char* const PARKED_STACK_CAPSULE_NAME = "memray._memray.ParkedStack";
+
+void
+PythonStackTracker::destroyParkedStack(PyObject* capsule)
+{
+    auto parked = static_cast<ParkedStack*>(PyCapsule_GetPointer(capsule, PARKED_STACK_CAPSULE_NAME));
+    for (PyObject* code : parked->owned_code) {
+        Py_DECREF(code);
+    }
+    delete parked;
+}
+
+PythonStackTracker::ParkedStack*
+PythonStackTracker::parkedStackFor(PyObject* obj, bool create)
+{
+    // The capsule is kept alive by the object, so the stack it owns can be
+    // used for as long as the object is. Errors are ignored: without a parked
+    // stack the object's stack is simply built again.
+    PyObject* capsule = PyObject_GetAttrString(obj, "_memray_stack");
+    if (!capsule || !PyCapsule_IsValid(capsule, PARKED_STACK_CAPSULE_NAME)) {
+        PyErr_Clear();
+        Py_XDECREF(capsule);
+        if (!create) {
+            return nullptr;
+        }
+        auto parked = std::make_unique<ParkedStack>();
+        capsule = PyCapsule_New(parked.get(), PARKED_STACK_CAPSULE_NAME, destroyParkedStack);
+        if (capsule) {
+            (void)parked.release();
+        }
+        if (!capsule || 0 != PyObject_SetAttrString(obj, "_memray_stack", capsule)) {
+            PyErr_Clear();
+            Py_XDECREF(capsule);
+            return nullptr;
+        }
+    }
+
+    auto parked = static_cast<ParkedStack*>(PyCapsule_GetPointer(capsule, PARKED_STACK_CAPSULE_NAME));
+    Py_DECREF(capsule);
+    return parked;
+}
+
+void
+PythonStackTracker::parkStack(PyObject* greenlet)
+{
+    if (!d_stack) {
+        d_stack = new std::vector<LazilyEmittedFrame>;
+    }
+
+    ParkedStack* parked = parkedStackFor(greenlet, true);
+    if (!parked) {
+        // Emit pops for the frames that had been pushed instead.
+        d_num_pending_pops += std::count_if(d_stack->begin(), d_stack->end(), [](const auto& f) {
+            return f.state != FrameState::NOT_EMITTED;
+        });
+        d_stack->clear();
+        emitPendingPushesAndPops();
+        return;
+    }
+
+    parked->stack.swap(*d_stack);
+    parked->num_pending_pops = d_num_pending_pops;
+    parked->tracker_generation = d_tracker_generation;
+    d_stack->clear();
+    d_num_pending_pops = 0;
+}
+
+bool
+PythonStackTracker::unparkStack(PyObject* greenlet)
+{
+    ParkedStack* parked = parkedStackFor(greenlet, false);
+    if (!parked) {
+        return false;
+    }
+
+    // A stack parked while an earlier tracker was running may not match what
+    // the current tracker has recorded for the greenlet.
+    bool usable = parked->tracker_generation == d_tracker_generation;
+    if (usable) {
+        d_stack->swap(parked->stack);
+        d_num_pending_pops = parked->num_pending_pops;
+    }
+    parked->stack.clear();
+    parked->num_pending_pops = 0;
+    return usable;
+}
+
+void
+PythonStackTracker::beginTrackingAsyncioTasks()
+{
+    assert(PyGILState_Check());
+
+    // Every way of creating a task ends up calling the event loop's
+    // create_task method, and its return value is the new task.
+    PyObject* base_events = PyImport_ImportModule("asyncio.base_events");
+    PyObject* loop_class = base_events ? PyObject_GetAttrString(base_events, "BaseEventLoop") : nullptr;
+    PyObject* method = loop_class ? PyObject_GetAttrString(loop_class, "create_task") : nullptr;
+    PyObject* code = method ? PyObject_GetAttrString(method, "__code__") : nullptr;
+    Py_XDECREF(method);
+    Py_XDECREF(loop_class);
+    Py_XDECREF(base_events);
+    if (!code || !PyCode_Check(code)) {
+        PyErr_Clear();
+        Py_XDECREF(code);
+        throw std::runtime_error("Failed to find asyncio's create_task method");
+    }
+    Py_XSETREF(s_create_task_code, code);
+}
+
+void
+PythonStackTracker::endTrackingAsyncioTasks()
+{
+    assert(PyGILState_Check());
+    Py_CLEAR(s_create_task_code);
+}
+
+bool
+PythonStackTracker::isTaskStepStart(PyFrameObject* frame, PyCodeObject* code)
+{
+    // A task runs a step by resuming its coroutine, which resumes everything
+    // it's awaiting in turn, so the step starts with the first coroutine that
+    // isn't resumed by another one.
+    const int coroutine_flags = CO_COROUTINE | CO_ITERABLE_COROUTINE | CO_ASYNC_GENERATOR;
+    if (!(code->co_flags & coroutine_flags)) {
+        return false;
+    }
+    PyFrameObject* back = compat::frameGetBack(frame);
+    return !back || !(compat::frameGetCode(back)->co_flags & coroutine_flags);
+}
+
+void
+PythonStackTracker::copyStackInto(size_t num_frames, ParkedStack* parked)
+{
+    // The frames may be gone by the time the copy is used, so only the
+    // strings and line numbers of their records are kept, along with a
+    // reference to their code objects to keep the strings alive.
+    for (size_t i = 0; i < num_frames; ++i) {
+        const LazilyEmittedFrame& frame = (*d_stack)[i];
+        Py_INCREF(frame.code);
+        parked->owned_code.push_back(reinterpret_cast<PyObject*>(frame.code));
+        RawFrame raw_frame_record = frame.raw_frame_record;
+        raw_frame_record.lineno = lineNumber(frame);
+        parked->stack.push_back({nullptr, frame.code, raw_frame_record, FrameState::NOT_EMITTED});
+    }
+    parked->initialized = true;
+}
+
+void
+PythonStackTracker::recordTaskCreation(PyCodeObject* code, PyObject* return_value)
+{
+    if (reinterpret_cast<PyObject*>(code) != s_create_task_code || !return_value || !d_stack
+        || d_stack->empty())
+    {
+        return;
+    }
+
+    // An eagerly started task has already run its first step.
+    ParkedStack* parked = parkedStackFor(return_value, true);
+    if (!parked || parked->initialized) {
+        return;
+    }
+
+    // Leave out the frame of create_task itself, which is still on the stack.
+    copyStackInto(d_stack->size() - 1, parked);
+}
+
+void
+PythonStackTracker::enterTaskStep(PyFrameObject* frame)
+{
+    // Borrowed reference
+    PyObject* modules = PySys_GetObject("modules");
+    // Borrowed reference
+    PyObject* asyncio = modules ? PyDict_GetItemString(modules, "asyncio") : nullptr;
+    if (!asyncio) {
+        return;
+    }
+
+    // This raises if there is no running event loop, and returns None if the
+    // coroutine is being run by something other than a task.
+    PyObject* task = PyObject_CallMethod(asyncio, "current_task", nullptr);
+    if (!task || task == Py_None) {
+        PyErr_Clear();
+        Py_XDECREF(task);
+        return;
+    }
+    // The running task is kept alive by its event loop until its step ends.
+    Py_DECREF(task);
+
+    ParkedStack* parked = parkedStackFor(task, true);
+    if (!parked) {
+        return;
+    }
+
+    // Nothing has been written for a stack parked while an earlier tracker
+    // was running. If the task's creation wasn't seen, it is shown as having
+    // been created by whatever is running it.
+    if (parked->tracker_generation != d_tracker_generation) {
+        for (auto& parked_frame : parked->stack) {
+            parked_frame.state = FrameState::NOT_EMITTED;
+        }
+        parked->num_pending_pops = 0;
+        parked->tracker_generation = d_tracker_generation;
+    }
+    if (!d_stack) {
+        d_stack = new std::vector<LazilyEmittedFrame>;
+    }
+    if (!parked->initialized) {
+        copyStackInto(d_stack->size(), parked);
+    }
+
+    // Each task gets its own thread ID, like greenlets do, so the stack that
+    // is recorded for it can be left as it is while other tasks run.
+    d_loop_tid = t_tid;
+    bool new_tid = false;
+    PyObject* tid = PyObject_GetAttrString(task, "_memray_tid");
+    if (tid && PyLong_CheckExact(tid)) {
+        t_tid = PyLong_AsUnsignedLong(tid);
+    } else {
+        PyErr_Clear();
+        Py_XDECREF(tid);
+        t_tid = generate_next_tid();
+        new_tid = true;
+        tid = PyLong_FromUnsignedLong(t_tid);
+        if (!tid || 0 != PyObject_SetAttrString(task, "_memray_tid", tid)) {
+            PyErr_Clear();
+        }
+    }
+    Py_XDECREF(tid);
+
+    if (!d_loop_stack) {
+        d_loop_stack = new std::vector<LazilyEmittedFrame>;
+    }
+    d_loop_stack->clear();
+    std::swap(d_stack, d_loop_stack);
+    d_stack->swap(parked->stack);
+    d_loop_num_pending_pops = d_num_pending_pops;
+    d_num_pending_pops = parked->num_pending_pops;
+    parked->num_pending_pops = 0;
+    d_task = task;
+    d_task_step_frame = frame;
+
+    if (new_tid) {
+        PyObject* name = PyObject_CallMethod(task, "get_name", nullptr);
+        const char* name_str = name ? PyUnicode_AsUTF8(name) : nullptr;
+        if (name_str) {
+            Tracker::registerThreadName(name_str);
+        }
+        PyErr_Clear();
+        Py_XDECREF(name);
+    }
+}
+
+void
+PythonStackTracker::exitTaskStep()
+{
+    ParkedStack* parked = parkedStackFor(d_task, false);
+    if (parked) {
+        parked->stack.swap(*d_stack);
+        parked->num_pending_pops = d_num_pending_pops;
+    } else {
+        // Emit pops for the frames that had been pushed instead.
+        d_num_pending_pops += std::count_if(d_stack->begin(), d_stack->end(), [](const auto& f) {
+            return f.state != FrameState::NOT_EMITTED;
+        });
+        d_stack->clear();
+        emitPendingPushesAndPops();
+    }
+
+    d_stack->clear();
+    std::swap(d_stack, d_loop_stack);
+    d_num_pending_pops = d_loop_num_pending_pops;
+    t_tid = d_loop_tid;
+    d_task = nullptr;
+    d_task_step_frame = nullptr;
+}
+
+size_t
+RecordedAddressSet::bucketFor(uintptr_t address)
+{
+    // Fibonacci hashing. Allocations are at least 8 bytes aligned, so the
+    // lowest bits don't carry any information.
+    return static_cast<size_t>(((address >> 3) * 0x9E3779B97F4A7C15ULL) >> (64 - 16));
+}
 
-    std::for_each(stack.rbegin(), stack.rend(), [this](auto& frame) { pushPythonFrame(frame); });
+void
+RecordedAddressSet::add(uintptr_t address)
+{
+    size_t bucket = bucketFor(address);
+    Shard& shard = d_shards[bucket % NUM_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.addresses.insert(address).second) {
+        d_bucket_sizes[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool
+RecordedAddressSet::remove(uintptr_t address)
+{
+    // An address can't be freed before its allocation has been recorded, so
+    // a relaxed load is enough to never miss a sampled address.
+    size_t bucket = bucketFor(address);
+    if (d_bucket_sizes[bucket].load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    Shard& shard = d_shards[bucket % NUM_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.addresses.erase(address) == 0) {
+        return false;
+    }
+    d_bucket_sizes[bucket].fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+static std::atomic<uint64_t> s_next_filtered_allocation_counters_id{1};
+
+MEMRAY_FAST_TLS thread_local FilteredAllocationCounters::CounterSlot
+        FilteredAllocationCounters::t_counter_slot{};
+
+FilteredAllocationCounters::FilteredAllocationCounters()
+: d_id(s_next_filtered_allocation_counters_id++)
+{
+}
+
+FilteredAllocationCounters::~FilteredAllocationCounters()
+{
+    Counter* counter = d_counters.exchange(nullptr);
+    while (counter) {
+        delete std::exchange(counter, counter->next);
+    }
+}
+
+void
+FilteredAllocationCounters::add(size_t size)
+{
+    // Only the owning thread writes to its counter, so it doesn't need an
+    // atomic read-modify-write: the background thread only loads from it.
+    Counter* counter = counterForThisThread();
+    counter->n_allocations.store(
+            counter->n_allocations.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+    counter->bytes.store(
+            counter->bytes.load(std::memory_order_relaxed) + size,
+            std::memory_order_relaxed);
+}
+
+FilteredAllocationTotals
+FilteredAllocationCounters::totals() const
+{
+    FilteredAllocationTotals totals;
+    for (Counter* counter = d_counters.load(); counter; counter = counter->next) {
+        totals.n_allocations += counter->n_allocations.load(std::memory_order_relaxed);
+        totals.bytes += counter->bytes.load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+FilteredAllocationCounters::Counter*
+FilteredAllocationCounters::counterForThisThread()
+{
+    // The slot may be left over from a previous tracker, in which case its
+    // counter must not be touched: it may have been freed already.
+    CounterSlot& slot = t_counter_slot;
+    if (slot.owner_id != d_id) {
+        Counter* counter;
+        {
+            RecursionGuard guard;
+            counter = new Counter();
+        }
+        counter->next = d_counters.load();
+        while (!d_counters.compare_exchange_weak(counter->next, counter)) {
+        }
+        slot = CounterSlot{d_id, counter};
+    }
+    return slot.counter;
+}
+
+static std::atomic<uint64_t> s_next_overhead_counters_id{1};
+
+MEMRAY_FAST_TLS thread_local OverheadCounters::CounterSlot OverheadCounters::t_counter_slot{};
+
+OverheadCounters::OverheadCounters()
+: d_id(s_next_overhead_counters_id++)
+{
+}
+
+OverheadCounters::~OverheadCounters()
+{
+    Counter* counter = d_counters.exchange(nullptr);
+    while (counter) {
+        delete std::exchange(counter, counter->next);
+    }
+}
+
+void
+OverheadCounters::add(Kind kind, std::chrono::steady_clock::duration elapsed)
+{
+    const size_t elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    Counter* counter = counterForThisThread();
+    counter->counts[kind].store(
+            counter->counts[kind].load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+    counter->ns[kind].store(
+            counter->ns[kind].load(std::memory_order_relaxed) + elapsed_ns,
+            std::memory_order_relaxed);
+}
+
+TrackerMetrics
+OverheadCounters::totals() const
+{
+    std::array<size_t, NUM_KINDS> counts{};
+    std::array<size_t, NUM_KINDS> ns{};
+    for (Counter* counter = d_counters.load(); counter; counter = counter->next) {
+        for (size_t kind = 0; kind < NUM_KINDS; ++kind) {
+            counts[kind] += counter->counts[kind].load(std::memory_order_relaxed);
+            ns[kind] += counter->ns[kind].load(std::memory_order_relaxed);
+        }
+    }
+    TrackerMetrics metrics;
+    metrics.n_tracked_allocations = counts[ALLOCATION];
+    metrics.allocation_ns = ns[ALLOCATION];
+    metrics.n_tracked_deallocations = counts[DEALLOCATION];
+    metrics.deallocation_ns = ns[DEALLOCATION];
+    metrics.n_unwinds = counts[UNWIND];
+    metrics.unwind_ns = ns[UNWIND];
+    return metrics;
+}
+
+OverheadCounters::Counter*
+OverheadCounters::counterForThisThread()
+{
+    // See FilteredAllocationCounters::counterForThisThread.
+    CounterSlot& slot = t_counter_slot;
+    if (slot.owner_id != d_id) {
+        Counter* counter;
+        {
+            RecursionGuard guard;
+            counter = new Counter();
+        }
+        counter->next = d_counters.load();
+        while (!d_counters.compare_exchange_weak(counter->next, counter)) {
+        }
+        slot = CounterSlot{d_id, counter};
+    }
+    return slot.counter;
 }
 
 std::atomic<bool> Tracker::d_active = false;
@@ -425,6 +1148,326 @@ std::unique_ptr<Tracker> Tracker::d_instance_owner;
 std::atomic<Tracker*> Tracker::d_instance = nullptr;
 
 MEMRAY_FAST_TLS thread_local size_t NativeTrace::MAX_SIZE{128};
+size_t NativeTrace::s_max_depth{0};
+
+#ifdef __linux__
+std::atomic<unsigned int> NativeTrace::s_unwind_cache_generation{0};
+#endif
+#ifdef MEMRAY_HAS_FRAME_POINTER_UNWINDER
+bool NativeTrace::s_use_frame_pointers{false};
+#endif
+
+#if defined(__linux__) && defined(__x86_64__)
+namespace {
+
+// The frames found by the previous unwind of a thread, innermost first (and
+// therefore sorted by stack pointer). Allocations made in a loop tend to share
+// almost all of their stack, so as soon as the unwinder reaches a frame that is
+// still live from the last unwind the rest of the trace can be copied instead
+// of unwound again.
+//
+// This lives on the heap and is owned through a pthread key, because thread
+// local variables used by our hooks must be trivially destructible (see the
+// comment on PythonStackTracker).
+struct UnwindCache
+{
+    struct Frame
+    {
+        unw_word_t ip;
+        unw_word_t sp;
+    };
+
+    Frame* previous;
+    size_t previous_size;
+    Frame* current;
+    size_t capacity;
+    unsigned int generation;
+    // Whether the previous unwind stopped at the depth limit, in which case
+    // the stack goes on above the last of the previous frames.
+    bool previous_truncated;
+
+    static UnwindCache* get();
+    static void destroy(void* cache);
+
+    bool reserve(size_t size)
+    {
+        if (size <= capacity) {
+            return true;
+        }
+        size_t new_capacity = std::max(size, 2 * capacity);
+        auto new_previous = static_cast<Frame*>(::realloc(previous, new_capacity * sizeof(Frame)));
+        if (new_previous) {
+            previous = new_previous;
+        }
+        auto new_current = static_cast<Frame*>(::realloc(current, new_capacity * sizeof(Frame)));
+        if (new_current) {
+            current = new_current;
+        }
+        if (!new_previous || !new_current) {
+            return false;
+        }
+        capacity = new_capacity;
+        return true;
+    }
+
+    // Whether the first frames of the current unwind are at the same
+    // instructions as those of the previous one.
+    bool hasSameInnermostFrames(size_t size) const
+    {
+        return std::equal(current, current + size, previous, [](const Frame& lhs, const Frame& rhs) {
+            return lhs.ip == rhs.ip;
+        });
+    }
+
+    // Find the frame of the previous unwind that is identical to the given one,
+    // provided that all of the frames above it are still on the stack. Returns
+    // previous_size if there is no such frame.
+    size_t findLiveSuffix(unw_word_t ip, unw_word_t sp) const
+    {
+        const Frame* begin = previous;
+        const Frame* end = previous + previous_size;
+        const Frame* it = std::lower_bound(begin, end, sp, [](const Frame& frame, unw_word_t value) {
+            return frame.sp < value;
+        });
+        if (it == end || it->sp != sp || it->ip != ip) {
+            return previous_size;
+        }
+
+        // A frame with the same instruction and stack pointers could still
+        // belong to a different call chain if one of its callers returned in
+        // the meantime. On x86-64 each return address is stored just below the
+        // caller's stack pointer, so checking that they are all unchanged is
+        // enough to know the callers are the same, and it is much cheaper than
+        // unwinding them.
+        for (const Frame* frame = it + 1; frame != end; ++frame) {
+            if (*reinterpret_cast<const unw_word_t*>(frame->sp - sizeof(unw_word_t)) != frame->ip) {
+                return previous_size;
+            }
+        }
+        return it - begin;
+    }
+};
+
+pthread_key_t s_unwind_cache_key;
+pthread_once_t s_unwind_cache_key_once = PTHREAD_ONCE_INIT;
+MEMRAY_FAST_TLS thread_local UnwindCache* t_unwind_cache{};
+
+UnwindCache*
+UnwindCache::get()
+{
+    if (t_unwind_cache) {
+        return t_unwind_cache;
+    }
+    pthread_once(&s_unwind_cache_key_once, [] {
+        pthread_key_create(&s_unwind_cache_key, &UnwindCache::destroy);
+    });
+    auto cache = static_cast<UnwindCache*>(::calloc(1, sizeof(UnwindCache)));
+    if (!cache) {
+        return nullptr;
+    }
+    if (pthread_setspecific(s_unwind_cache_key, cache) != 0) {
+        ::free(cache);
+        return nullptr;
+    }
+    t_unwind_cache = cache;
+    return cache;
+}
+
+void
+UnwindCache::destroy(void* ptr)
+{
+    auto cache = static_cast<UnwindCache*>(ptr);
+    if (t_unwind_cache == cache) {
+        t_unwind_cache = nullptr;
+    }
+    ::free(cache->previous);
+    ::free(cache->current);
+    ::free(cache);
+}
+
+}  // namespace
+
+bool
+NativeTrace::fillIncremental(size_t skip)
+{
+    d_size = 0;
+    d_skip = skip;
+    d_same_as_previous = false;
+
+    UnwindCache* cache = UnwindCache::get();
+    if (!cache) {
+        return false;
+    }
+
+    unw_context_t context;
+    unw_cursor_t cursor;
+    if (unw_getcontext(&context) != 0 || unw_init_local(&cursor, &context) != 0) {
+        return false;
+    }
+
+    const unsigned int generation = s_unwind_cache_generation.load(std::memory_order_relaxed);
+    if (cache->generation != generation) {
+        // The loaded modules changed, so cached instruction pointers may now
+        // belong to different code.
+        cache->previous_size = 0;
+        cache->generation = generation;
+    }
+
+    const size_t limit = s_max_depth ? skip + s_max_depth : std::numeric_limits<size_t>::max();
+    bool truncated = false;
+    size_t size = 0;
+    do {
+        unw_word_t ip;
+        unw_word_t sp;
+        if (unw_get_reg(&cursor, UNW_REG_IP, &ip) < 0 || unw_get_reg(&cursor, UNW_REG_SP, &sp) < 0
+            || ip == 0)
+        {
+            break;
+        }
+        if (size == limit) {
+            truncated = true;
+            break;
+        }
+
+        // The innermost frame is this function, which is never live from a
+        // previous call.
+        size_t suffix = size ? cache->findLiveSuffix(ip, sp) : cache->previous_size;
+        size_t suffix_size = cache->previous_size - suffix;
+        // A truncated previous unwind can only complete this one if it holds
+        // enough of the frames above the live one.
+        bool suffix_is_complete = !cache->previous_truncated || size + suffix_size >= limit;
+        if (suffix != cache->previous_size && suffix_is_complete) {
+            truncated = cache->previous_truncated || size + suffix_size > limit;
+            suffix_size = std::min(suffix_size, limit - size);
+            // If the live frame is where it was, only the frames below it can
+            // be different.
+            d_same_as_previous = suffix == size && cache->hasSameInnermostFrames(size);
+            if (!cache->reserve(size + suffix_size)) {
+                return false;
+            }
+            std::copy_n(cache->previous + suffix, suffix_size, cache->current + size);
+            size += suffix_size;
+            break;
+        }
+
+        if (!cache->reserve(size + 1)) {
+            return false;
+        }
+        cache->current[size++] = {ip, sp};
+    } while (unw_step(&cursor) > 0);
+
+    std::swap(cache->previous, cache->current);
+    cache->previous_size = size;
+    cache->previous_truncated = truncated;
+
+    if (size > d_data.size()) {
+        MAX_SIZE = std::max(2 * MAX_SIZE, size);
+        d_data.resize(MAX_SIZE);
+    }
+    for (size_t i = 0; i < size; ++i) {
+        d_data[i] = cache->previous[i].ip;
+    }
+    if (truncated) {
+        markTruncated(size++);
+    }
+    d_size = size > skip ? size - skip : 0;
+    return d_size > 0;
+}
+#endif
+
+#ifdef MEMRAY_HAS_FRAME_POINTER_UNWINDER
+namespace {
+
+// The addresses of the stack of the current thread. Frame pointers are only
+// followed while they point into it, so that a function that was compiled
+// without frame pointers (and uses that register for something else) can
+// only cut the trace short rather than make us read arbitrary memory.
+struct StackBounds
+{
+    uintptr_t low;
+    uintptr_t high;
+    bool initialized;
+
+    // If the bounds can't be found they are left empty, and no frame
+    // pointers are followed at all.
+    void init()
+    {
+        initialized = true;
+#    ifdef __linux__
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+            return;
+        }
+        void* addr;
+        size_t size;
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+            low = reinterpret_cast<uintptr_t>(addr);
+            high = low + size;
+        }
+        pthread_attr_destroy(&attr);
+#    else
+        high = reinterpret_cast<uintptr_t>(pthread_get_stackaddr_np(pthread_self()));
+        low = high - pthread_get_stacksize_np(pthread_self());
+#    endif
+    }
+
+    bool containsFrameRecord(uintptr_t frame) const
+    {
+        return frame % alignof(uintptr_t) == 0 && low <= frame && frame + 2 * sizeof(uintptr_t) <= high;
+    }
+};
+
+MEMRAY_FAST_TLS thread_local StackBounds t_stack_bounds{};
+
+}  // namespace
+
+bool
+NativeTrace::fillFromFramePointers(size_t skip)
+{
+    d_size = 0;
+    // Unlike unw_backtrace, this doesn't report its own frame.
+    d_skip = skip ? skip - 1 : 0;
+
+    StackBounds& bounds = t_stack_bounds;
+    if (!bounds.initialized) {
+        bounds.init();
+    }
+
+    // Every frame record holds the frame pointer of the caller, followed by
+    // the address the function returns to. Since the stack grows down, the
+    // caller's record must be above the current one.
+    auto frame = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    const size_t limit = s_max_depth ? d_skip + s_max_depth : std::numeric_limits<size_t>::max();
+    bool truncated = false;
+    size_t size = 0;
+    while (bounds.containsFrameRecord(frame)) {
+        const auto record = reinterpret_cast<const uintptr_t*>(frame);
+        const uintptr_t ip = record[1];
+        if (ip == 0) {
+            break;
+        }
+        if (size == limit) {
+            truncated = true;
+            break;
+        }
+        if (size == d_data.size()) {
+            MAX_SIZE = 2 * MAX_SIZE;
+            d_data.resize(MAX_SIZE);
+        }
+        d_data[size++] = ip;
+        if (record[0] <= frame) {
+            break;
+        }
+        frame = record[0];
+    }
+    if (truncated) {
+        markTruncated(size++);
+    }
+
+    d_size = size > d_skip ? size - d_skip : 0;
+    return d_size > 0;
+}
+#endif
 
 std::vector<PythonStackTracker::LazilyEmittedFrame>
 PythonStackTracker::pythonFrameToStack(PyFrameObject* current_frame)
@@ -447,7 +1490,8 @@ PythonStackTracker::pythonFrameToStack(PyFrameObject* current_frame)
         // If native tracking is not enabled, treat every frame as an entry frame.
         // It doesn't matter to the reader, and is more efficient.
         bool entry = !s_native_tracking_enabled || compat::isEntryFrame(current_frame);
-        stack.push_back({current_frame, {function, filename, 0, entry}, FrameState::NOT_EMITTED});
+        stack.push_back(
+                {current_frame, code, {function, filename, 0, entry}, FrameState::NOT_EMITTED});
         current_frame = compat::frameGetBack(current_frame);
     }
 
@@ -459,7 +1503,10 @@ PythonStackTracker::recordAllStacks()
 {
     assert(PyGILState_Check());
 
-    // Record the current Python stack of every thread
+    // Record the current Python stack of every thread. This is done while
+    // tracking starts, rather than by each thread the first time it needs its
+    // stack, because reading a stack creates frame objects, which can't be
+    // done from inside an allocator, and a thread may allocate without the GIL.
     std::unordered_map<PyThreadState*, std::vector<LazilyEmittedFrame>> stack_by_thread;
     for (PyThreadState* tstate =
                  PyInterpreterState_ThreadHead(compat::threadStateGetInterpreter(PyThreadState_Get()));
@@ -492,6 +1539,17 @@ PythonStackTracker::installProfileHooks()
 {
     assert(PyGILState_Check());
 
+#if PY_VERSION_HEX >= 0x030C0000
+    // On 3.12+ prefer sys.monitoring: it only reports the events we ask for,
+    // applies to every thread at once, and leaves any profile function alone.
+    // Calling the sys.monitoring functions can't release the GIL, so no stack
+    // can change between capturing it and enabling the events.
+    recordAllStacks();
+    if (installMonitoringCallbacks()) {
+        return;
+    }
+#endif
+
     // Uninstall any existing profile function in all threads. Do this before
     // installing ours, since we could lose the GIL if the existing profile arg
     // has a __del__ that gets called. We must hold the GIL for the entire time
@@ -512,7 +1570,15 @@ void
 PythonStackTracker::removeProfileHooks()
 {
     assert(PyGILState_Check());
+#if PY_VERSION_HEX >= 0x030C0000
+    if (usesSysMonitoring()) {
+        removeMonitoringCallbacks();
+    } else {
+        compat::setprofileAllThreads(nullptr, nullptr);
+    }
+#else
     compat::setprofileAllThreads(nullptr, nullptr);
+#endif
     std::unique_lock<std::mutex> lock(s_mutex);
     s_initial_stack_by_thread.clear();
 }
@@ -531,23 +1597,66 @@ PythonStackTracker::clear()
     emitPendingPushesAndPops();
     delete d_stack;
     d_stack = nullptr;
+    delete d_line_number_cache;
+    d_line_number_cache = nullptr;
+    delete d_loop_stack;
+    d_loop_stack = nullptr;
+}
+
+// Set by the signal handler of a flight recorder and acted upon by the
+// background thread, because a dump can't be written from a signal handler.
+static std::atomic<bool> s_flight_recorder_dump_requested{false};
+
+static void
+requestFlightRecorderDump(int)
+{
+    s_flight_recorder_dump_requested.store(true, std::memory_order_relaxed);
+}
+
+static TrackerOptions
+withImpliedOptions(TrackerOptions options)
+{
+    // The records in a flight recorder's ring can't depend on the frame pushes
+    // and pops that came before them, since those may have been dropped. Stacks
+    // cut to their innermost frames can't be built from pushes and pops either.
+    if (options.flight_recorder_size != 0 || options.max_python_depth != 0) {
+        options.intern_python_stacks = true;
+    }
+    // The governor needs to know what tracking costs.
+    if (options.overhead_budget > 0) {
+        options.measure_overhead = true;
+    }
+    return options;
 }
 
 Tracker::Tracker(
         std::unique_ptr<RecordWriter> record_writer,
-        bool native_traces,
-        unsigned int memory_interval,
-        bool follow_fork,
-        bool trace_python_allocators)
+        const TrackerOptions& options,
+        Tracker* forked_from)
 : d_writer(std::move(record_writer))
-, d_unwind_native_frames(native_traces)
-, d_memory_interval(memory_interval)
-, d_follow_fork(follow_fork)
-, d_trace_python_allocators(trace_python_allocators)
+, d_options(withImpliedOptions(options))
+, d_current_sampling_interval(d_options.sampling_interval)
+, d_track_allocation_impl(selectTrackAllocationImpl(
+          d_options.native_traces,
+          d_options.intern_python_stacks,
+          // The governor needs to be able to start sampling at any time, and
+          // to know what tracking costs.
+          d_options.sampling_interval || d_options.min_allocation_size || d_options.regions_only
+                  || d_options.overhead_budget > 0,
+          d_options.measure_overhead))
 {
     // Note: this must be set before the hooks are installed.
     d_instance = this;
 
+    if (forked_from && d_writer->continuesParentCapture()) {
+        // Whatever is in these was written to the parent's capture before it
+        // forked, so only what's new to the child must be written to its own.
+        d_frames.swap(forked_from->d_frames);
+        d_native_trace_tree.swap(forked_from->d_native_trace_tree);
+        d_python_stack_tree.swap(forked_from->d_python_stack_tree);
+        d_mapped_modules.swap(forked_from->d_mapped_modules);
+    }
+
     static std::once_flag once;
     call_once(once, [] {
         hooks::ensureAllHooksAreValid();
@@ -558,19 +1667,80 @@ Tracker::Tracker(
         pthread_atfork(&prepareFork, &parentFork, &childFork);
     });
 
-    d_writer->setMainTidAndSkippedFrames(thread_id(), computeMainTidSkip());
+    // The outermost frames of a truncated stack are gone, so the ones above
+    // the tracker's creation can't be told apart from the others.
+    d_writer->setMainTidAndSkippedFrames(
+            thread_id(),
+            d_options.max_python_depth ? 0 : computeMainTidSkip());
+    d_writer->setSamplingInterval(d_options.sampling_interval);
+    d_writer->setMinAllocationSize(d_options.min_allocation_size);
+    if (d_options.sampling_interval || d_options.min_allocation_size || d_options.regions_only
+        || d_options.overhead_budget > 0)
+    {
+        d_recorded_addresses = std::make_unique<RecordedAddressSet>();
+    }
+    if (d_options.min_allocation_size) {
+        d_filtered_allocations = std::make_unique<FilteredAllocationCounters>();
+    }
+    if (d_options.measure_overhead) {
+        d_overhead_counters = std::make_unique<OverheadCounters>();
+    }
+    if (d_options.flight_recorder_size) {
+        d_writer->enableFlightRecorder(d_options.flight_recorder_size);
+    }
+    if (d_options.trace_asyncio_tasks) {
+        PythonStackTracker::beginTrackingAsyncioTasks();
+    }
     if (!d_writer->writeHeader(false)) {
         throw IoError{"Failed to write output header"};
     }
+    if (d_options.flight_recorder_signal) {
+        struct sigaction action = {};
+        action.sa_handler = &requestFlightRecorderDump;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        s_flight_recorder_dump_requested = false;
+        if (sigaction(d_options.flight_recorder_signal, &action, &d_previous_signal_action) != 0) {
+            throw IoError{
+                    "Failed to install the flight recorder signal handler: "
+                    + std::string(strerror(errno))};
+        }
+    }
     updateModuleCache();
 
     RecursionGuard guard;
-    PythonStackTracker::s_native_tracking_enabled = native_traces;
+    PythonStackTracker::s_native_tracking_enabled = d_options.native_traces;
+    PythonStackTracker::s_max_depth = d_options.max_python_depth;
+    NativeTrace::useFramePointers(d_options.frame_pointer_unwinding);
+    NativeTrace::setMaxDepth(d_options.max_native_depth);
+    NativeTrace::forgetPreviousUnwinds();
     PythonStackTracker::installProfileHooks();
-    if (d_trace_python_allocators) {
+    if (d_options.trace_python_allocators) {
         registerPymallocHooks();
     }
-    d_background_thread = std::make_unique<BackgroundThread>(d_writer, memory_interval);
+    if (d_options.trace_pymalloc_arenas) {
+        // pymalloc only asks for arenas when it is the object allocator,
+        // which is what the header records.
+        const PythonAllocatorType python_allocator = d_writer->pythonAllocator();
+        if (python_allocator == PythonAllocatorType::PYTHONALLOCATOR_PYMALLOC
+            || python_allocator == PythonAllocatorType::PYTHONALLOCATOR_PYMALLOC_DEBUG)
+        {
+            registerPymallocArenaHooks();
+        } else {
+            LOG(WARNING) << "Not tracking pymalloc arenas, as pymalloc is not the Python allocator";
+            d_options.trace_pymalloc_arenas = false;
+        }
+    }
+    d_background_thread = std::make_unique<BackgroundThread>(
+            d_writer,
+            d_options.memory_interval,
+            d_options.detailed_memory_counters,
+            d_filtered_allocations.get(),
+            d_overhead_counters.get(),
+            d_options.flight_recorder_rss_threshold,
+            d_options.overhead_budget,
+            &d_current_sampling_interval,
+            d_options.sampling_interval);
     d_background_thread->start();
 
     d_patcher.overwrite_symbols();
@@ -583,19 +1753,32 @@ Tracker::~Tracker()
     RecursionGuard guard;
     tracking_api::Tracker::deactivate();
     PythonStackTracker::s_native_tracking_enabled = false;
+    NativeTrace::useFramePointers(false);
     d_background_thread->stop();
+    if (d_options.flight_recorder_signal) {
+        sigaction(d_options.flight_recorder_signal, &d_previous_signal_action, nullptr);
+    }
     d_patcher.restore_symbols();
     if (Py_IsInitialized() && !_Py_IsFinalizing()) {
         PyGILState_STATE gstate;
         gstate = PyGILState_Ensure();
 
-        if (d_trace_python_allocators) {
+        if (d_options.trace_python_allocators) {
             unregisterPymallocHooks();
         }
+        if (d_options.trace_pymalloc_arenas) {
+            unregisterPymallocArenaHooks();
+        }
         PythonStackTracker::removeProfileHooks();
+        if (d_options.trace_asyncio_tasks) {
+            PythonStackTracker::endTrackingAsyncioTasks();
+        }
 
         PyGILState_Release(gstate);
     }
+    if (d_overhead_counters) {
+        d_writer->setTrackingOverhead(d_overhead_counters->totals());
+    }
     d_writer->writeTrailer();
     d_writer->writeHeader(true);
     d_writer.reset();
@@ -604,26 +1787,127 @@ Tracker::~Tracker()
     d_instance = nullptr;
 }
 
+namespace {  // unnamed
+
+// Read what a file that was opened ahead of time currently contains, as
+// a NUL-terminated string.
+bool
+readOpenFile(int fd, char* buffer, size_t size)
+{
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t length;
+    do {
+        length = ::pread(fd, buffer, size - 1, 0);
+    } while (length < 0 && errno == EINTR);
+    if (length < 0) {
+        return false;
+    }
+    buffer[length] = '\0';
+    return true;
+}
+
+#ifdef __linux__
+int
+openCgroupMemoryUsage()
+{
+    // Each line is "hierarchy-ID:controller-list:cgroup-path". The memory
+    // usage is in memory.current under cgroup v2, and memory.usage_in_bytes
+    // under the memory controller's hierarchy in cgroup v1.
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::vector<std::string> candidates;
+    std::string line;
+    while (std::getline(cgroups, line)) {
+        const size_t first_colon = line.find(':');
+        const size_t second_colon = line.find(':', first_colon + 1);
+        if (first_colon == std::string::npos || second_colon == std::string::npos) {
+            continue;
+        }
+        const std::string controllers = line.substr(first_colon + 1, second_colon - first_colon - 1);
+        const std::string path = line.substr(second_colon + 1);
+        if (line.compare(0, first_colon, "0") == 0 && controllers.empty()) {
+            candidates.insert(candidates.begin(), "/sys/fs/cgroup" + path + "/memory.current");
+        } else if (("," + controllers + ",").find(",memory,") != std::string::npos) {
+            candidates.push_back("/sys/fs/cgroup/memory" + path + "/memory.usage_in_bytes");
+        }
+    }
+    for (const auto& candidate : candidates) {
+        int fd = ::open(candidate.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            return fd;
+        }
+    }
+    return -1;
+}
+#endif
+
+// How often the overhead governor compares what tracking costs against its
+// budget, and the range of sampling intervals it picks from. Sampling every
+// 64 bytes still records most small allocations, and beyond 64 MiB what
+// remains is the cost of the hooks themselves.
+const auto GOVERNOR_PERIOD = 1s;
+const size_t GOVERNOR_MIN_SAMPLING_INTERVAL = 64;
+const size_t GOVERNOR_MAX_SAMPLING_INTERVAL = 64 * 1024 * 1024;
+
+}  // namespace
+
 Tracker::BackgroundThread::BackgroundThread(
         std::shared_ptr<RecordWriter> record_writer,
-        unsigned int memory_interval)
+        unsigned int memory_interval,
+        bool detailed_memory_counters,
+        const FilteredAllocationCounters* filtered_allocations,
+        const OverheadCounters* overhead_counters,
+        size_t flight_recorder_rss_threshold,
+        double overhead_budget,
+        std::atomic<size_t>* sampling_interval,
+        size_t min_sampling_interval)
 : d_writer(std::move(record_writer))
 , d_memory_interval(memory_interval)
+, d_start_ms_since_epoch(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                 std::chrono::system_clock::now().time_since_epoch())
+                                 .count())
+, d_start_time(std::chrono::steady_clock::now())
+, d_detailed_memory_counters(detailed_memory_counters)
+, d_filtered_allocations(filtered_allocations)
+, d_overhead_counters(overhead_counters)
+, d_flight_recorder_rss_threshold(flight_recorder_rss_threshold)
+, d_overhead_budget(overhead_budget)
+, d_sampling_interval(sampling_interval)
+, d_min_sampling_interval(min_sampling_interval)
+, d_last_governor_time(d_start_time)
 {
 #ifdef __linux__
-    d_procs_statm.open("/proc/self/statm");
-    if (!d_procs_statm) {
+    d_procs_statm_fd = ::open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (d_procs_statm_fd == -1) {
         throw IoError{"Failed to open /proc/self/statm"};
     }
+    if (d_detailed_memory_counters) {
+        // Either of these may be missing (smaps_rollup is new in Linux 4.14),
+        // in which case the counters read from it are always 0.
+        d_smaps_rollup_fd = ::open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+        d_cgroup_memory_fd = openCgroupMemoryUsage();
+    }
 #endif
 }
 
+Tracker::BackgroundThread::~BackgroundThread()
+{
+    for (int fd : {d_procs_statm_fd, d_smaps_rollup_fd, d_cgroup_memory_fd}) {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+}
+
 unsigned long int
-Tracker::BackgroundThread::timeElapsed()
+Tracker::BackgroundThread::timeElapsed(std::chrono::steady_clock::time_point when) const
 {
-    std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch());
-    return ms.count();
+    // Changes to the wall clock while tracking can't make the samples go
+    // backwards in time, or bunch them up.
+    const auto elapsed = when - d_start_time;
+    return d_start_ms_since_epoch
+           + std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
 }
 
 size_t
@@ -634,15 +1918,12 @@ Tracker::BackgroundThread::getRSS() const
     constexpr int max_unsigned_long_chars = std::numeric_limits<unsigned long>::digits10 + 1;
     constexpr int bufsize = (max_unsigned_long_chars + sizeof(' ')) * 2;
     char buffer[bufsize];
-    d_procs_statm.read(buffer, sizeof(buffer) - 1);
-    buffer[d_procs_statm.gcount()] = '\0';
-    d_procs_statm.clear();
-    d_procs_statm.seekg(0);
 
     size_t rss;
-    if (sscanf(buffer, "%*u %zu", &rss) != 1) {
+    if (!readOpenFile(d_procs_statm_fd, buffer, sizeof(buffer))
+        || sscanf(buffer, "%*u %zu", &rss) != 1)
+    {
         std::cerr << "WARNING: Failed to read RSS value from /proc/self/statm" << std::endl;
-        d_procs_statm.close();
         return 0;
     }
 
@@ -659,34 +1940,169 @@ Tracker::BackgroundThread::getRSS() const
 #endif
 }
 
+MemoryCounters
+Tracker::BackgroundThread::getMemoryCounters() const
+{
+    MemoryCounters counters;
+
+    char buffer[4096];
+    if (readOpenFile(d_smaps_rollup_fd, buffer, sizeof(buffer))) {
+        // The header line is followed by one "Name:   <value> kB" line per
+        // field. The unique set size is everything that's private.
+        for (const char* line = buffer; line; line = strchr(line, '\n')) {
+            line += (*line == '\n');
+            char field[32];
+            size_t kib;
+            if (sscanf(line, "%31[^:]: %zu kB", field, &kib) != 2) {
+                continue;
+            }
+            if (strcmp(field, "Pss") == 0) {
+                counters.pss = kib * 1024;
+            } else if (strncmp(field, "Private_", 8) == 0) {
+                counters.uss += kib * 1024;
+            } else if (strcmp(field, "Swap") == 0) {
+                counters.swap = kib * 1024;
+            }
+        }
+    }
+
+    if (readOpenFile(d_cgroup_memory_fd, buffer, sizeof(buffer))) {
+        sscanf(buffer, "%zu", &counters.cgroup_usage);
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        counters.minor_faults = usage.ru_minflt;
+        counters.major_faults = usage.ru_majflt;
+    }
+    return counters;
+}
+
 void
 Tracker::BackgroundThread::start()
 {
     assert(d_thread.get_id() == std::thread::id());
     d_thread = std::thread([&]() {
         RecursionGuard::isActive = true;
+        // Samples are taken at fixed times, so the time it takes to write
+        // them doesn't add up to drift at short intervals.
+        auto next_sample_time = std::chrono::steady_clock::now();
         while (true) {
+            next_sample_time += d_memory_interval * 1ms;
             {
                 std::unique_lock<std::mutex> lock(d_mutex);
-                d_cv.wait_for(lock, d_memory_interval * 1ms, [this]() { return d_stop; });
+                d_cv.wait_until(lock, next_sample_time, [this]() { return d_stop; });
                 if (d_stop) {
                     break;
                 }
             }
-            size_t rss = getRSS();
-            if (rss == 0) {
+            // Don't try to make up for samples missed while the process was
+            // suspended or too busy to run us. This also keeps the recorded
+            // times of consecutive samples at least an interval apart.
+            next_sample_time = std::max(next_sample_time, std::chrono::steady_clock::now());
+
+            MemoryRecord record{timeElapsed(next_sample_time), getRSS()};
+            if (record.rss == 0) {
+                Tracker::deactivate();
+                break;
+            }
+            if (d_detailed_memory_counters) {
+                record.has_counters = true;
+                record.counters = getMemoryCounters();
+            }
+            if (!d_writer->writeRecord(record)) {
+                std::cerr << "Failed to write output, deactivating tracking" << std::endl;
                 Tracker::deactivate();
                 break;
             }
-            if (!d_writer->writeRecord(MemoryRecord{timeElapsed(), rss})) {
+            if (d_overhead_counters) {
+                d_writer->setTrackingOverhead(d_overhead_counters->totals());
+            }
+            if (!d_writer->flushThreadBuffers() || !writeFilteredAllocationTotals()
+                || !maybeAdjustSamplingInterval() || !d_writer->maybeRotate()
+                || !d_writer->maybeWriteProfileInterval())
+            {
                 std::cerr << "Failed to write output, deactivating tracking" << std::endl;
                 Tracker::deactivate();
                 break;
             }
+            if (!maybeDumpFlightRecorder(record.rss)) {
+                std::cerr << "WARNING: Failed to dump the flight recorder" << std::endl;
+            }
         }
     });
 }
 
+bool
+Tracker::BackgroundThread::maybeDumpFlightRecorder(size_t rss)
+{
+    bool dump = s_flight_recorder_dump_requested.exchange(false, std::memory_order_relaxed);
+    if (d_flight_recorder_rss_threshold) {
+        // Dump when the threshold is crossed, not for every sample above it.
+        bool above_rss_threshold = rss >= d_flight_recorder_rss_threshold;
+        dump = dump || (above_rss_threshold && !d_above_rss_threshold);
+        d_above_rss_threshold = above_rss_threshold;
+    }
+    return !dump || d_writer->dumpFlightRecorder();
+}
+
+bool
+Tracker::BackgroundThread::maybeAdjustSamplingInterval()
+{
+    if (!d_overhead_budget) {
+        return true;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    const auto elapsed = now - d_last_governor_time;
+    if (elapsed < GOVERNOR_PERIOD) {
+        return true;
+    }
+
+    // What the tracked threads spent in our hooks and what writing out the
+    // records took, as a share of the time that went by.
+    const TrackerMetrics metrics = d_writer->metrics();
+    const size_t overhead_ns = metrics.allocation_ns + metrics.deallocation_ns + metrics.flush_ns;
+    const double overhead = static_cast<double>(overhead_ns - d_last_overhead_ns)
+                            / std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    d_last_governor_time = now;
+    d_last_overhead_ns = overhead_ns;
+
+    // Doubling the interval roughly halves how many small allocations are
+    // recorded, so it's only halved again once that leaves room to spare.
+    // It never goes below the interval the tracker was created with.
+    const size_t interval = d_sampling_interval->load(std::memory_order_relaxed);
+    size_t new_interval = interval;
+    if (overhead > d_overhead_budget && !interval) {
+        new_interval = GOVERNOR_MIN_SAMPLING_INTERVAL;
+    } else if (overhead > d_overhead_budget && interval < GOVERNOR_MAX_SAMPLING_INTERVAL) {
+        new_interval = std::min(2 * interval, GOVERNOR_MAX_SAMPLING_INTERVAL);
+    } else if (overhead < d_overhead_budget / 4 && interval > d_min_sampling_interval) {
+        new_interval = interval / 2;
+        if (new_interval < std::max(d_min_sampling_interval, GOVERNOR_MIN_SAMPLING_INTERVAL)) {
+            new_interval = d_min_sampling_interval;
+        }
+    }
+    if (new_interval == interval) {
+        return true;
+    }
+    d_sampling_interval->store(new_interval, std::memory_order_relaxed);
+    return d_writer->changeSamplingInterval(new_interval);
+}
+
+bool
+Tracker::BackgroundThread::writeFilteredAllocationTotals()
+{
+    if (!d_filtered_allocations) {
+        return true;
+    }
+    FilteredAllocationTotals totals = d_filtered_allocations->totals();
+    if (totals.n_allocations == d_last_filtered_allocation_totals.n_allocations) {
+        return true;
+    }
+    d_last_filtered_allocation_totals = totals;
+    return d_writer->writeRecord(totals);
+}
+
 void
 Tracker::BackgroundThread::stop()
 {
@@ -701,6 +2117,10 @@ Tracker::BackgroundThread::stop()
         } catch (const std::system_error&) {
         }
     }
+    // Tracking is stopped by now, so these are the final totals.
+    if (!writeFilteredAllocationTotals()) {
+        std::cerr << "Failed to write output" << std::endl;
+    }
 }
 
 void
@@ -708,15 +2128,49 @@ Tracker::prepareFork()
 {
     // Don't do any custom track_allocation handling while inside fork
     RecursionGuard::isActive = true;
+
+    Tracker* tracker = d_instance;
+    if (tracker && Tracker::isActive() && tracker->d_options.follow_fork) {
+        tracker->lockForFork();
+    }
 }
 
 void
 Tracker::parentFork()
 {
+    Tracker* tracker = d_instance;
+    if (tracker && tracker->d_locked_for_fork) {
+        tracker->unlockAfterFork();
+    }
+
     // We can continue tracking
     RecursionGuard::isActive = false;
 }
 
+void
+Tracker::lockForFork()
+{
+    // A child can only take over the frames and the nodes of the trees whose
+    // records were written before it forked. New ones are written while
+    // their collection's lock is held, and the writer's lock is taken last,
+    // like it is when they are added.
+    d_frames.lock();
+    d_python_stack_tree.lock();
+    d_native_trace_tree.lock();
+    d_writer->prepareFork();
+    d_locked_for_fork = true;
+}
+
+void
+Tracker::unlockAfterFork()
+{
+    d_locked_for_fork = false;
+    d_writer->finishFork();
+    d_native_trace_tree.unlock();
+    d_python_stack_tree.unlock();
+    d_frames.unlock();
+}
+
 void
 Tracker::childFork()
 {
@@ -732,9 +2186,13 @@ Tracker::childFork()
 
     // If we inherited an active tracker, try to clone its record writer.
     std::unique_ptr<RecordWriter> new_writer;
-    if (old_tracker && memray::tracking_api::Tracker::isActive() && old_tracker->d_follow_fork) {
+    if (old_tracker && memray::tracking_api::Tracker::isActive() && old_tracker->d_options.follow_fork) {
         new_writer = old_tracker->d_writer->cloneInChildProcess();
     }
+    if (old_tracker && old_tracker->d_locked_for_fork) {
+        // This thread is the one that took the locks, so it can release them.
+        old_tracker->unlockAfterFork();
+    }
 
     if (!new_writer) {
         // We either have no tracker, or a deactivated tracker, or a tracker
@@ -751,12 +2209,7 @@ Tracker::childFork()
     // Re-enable tracking with a brand new tracker.
     // Disable tracking until the new tracker is fully installed.
     Tracker::deactivate();
-    d_instance_owner.reset(new Tracker(
-            std::move(new_writer),
-            old_tracker->d_unwind_native_frames,
-            old_tracker->d_memory_interval,
-            old_tracker->d_follow_fork,
-            old_tracker->d_trace_python_allocators));
+    d_instance_owner.reset(new Tracker(std::move(new_writer), old_tracker->d_options, old_tracker));
     RecursionGuard::isActive = false;
 }
 
@@ -780,47 +2233,156 @@ Tracker::computeMainTidSkip()
     return num_frames - 1;
 }
 
+bool
+Tracker::shouldSampleAllocation(size_t size, size_t sampling_interval) const
+{
+    SamplerState& state = t_sampler_state;
+    if (static_cast<ssize_t>(size) < state.bytes_until_next_sample) {
+        state.bytes_until_next_sample -= size;
+        return false;
+    }
+
+    if (!state.initialized) {
+        state.initialized = true;
+        state.rng_state = thread_id() ^ reinterpret_cast<uintptr_t>(&state)
+                          ^ std::chrono::steady_clock::now().time_since_epoch().count();
+        state.bytes_until_next_sample = nextSampleInterval(&state.rng_state, sampling_interval);
+        return shouldSampleAllocation(size, sampling_interval);
+    }
+
+    state.bytes_until_next_sample = nextSampleInterval(&state.rng_state, sampling_interval);
+    return true;
+}
+
+template<bool NATIVE_TRACES, bool INTERN_PYTHON_STACKS, bool FILTER_ALLOCATIONS, bool MEASURE_OVERHEAD>
 void
 Tracker::trackAllocationImpl(void* ptr, size_t size, hooks::Allocator func)
 {
     if (RecursionGuard::isActive || !Tracker::isActive()) {
         return;
     }
+    if constexpr (FILTER_ALLOCATIONS) {
+        // Outside of the tracked regions this is all that an allocation costs.
+        if (d_options.regions_only && !TrackedRegion::depth) {
+            return;
+        }
+    }
+    OverheadCounters* overhead_counters = MEASURE_OVERHEAD ? d_overhead_counters.get() : nullptr;
+    OverheadCounters::Timer timer(overhead_counters, OverheadCounters::ALLOCATION);
+
+    // Ranged allocations are rare and can be partially deallocated, so they
+    // are always recorded, even when sampling or skipping small allocations.
+    bool simple_allocation = false;
+    if constexpr (FILTER_ALLOCATIONS) {
+        simple_allocation = hooks::allocatorKind(func) == hooks::AllocatorKind::SIMPLE_ALLOCATOR;
+        if (simple_allocation && size < d_options.min_allocation_size) {
+            d_filtered_allocations->add(size);
+            return;
+        }
+        const size_t sampling_interval = d_current_sampling_interval.load(std::memory_order_relaxed);
+        if (simple_allocation && sampling_interval && !shouldSampleAllocation(size, sampling_interval)) {
+            return;
+        }
+    }
     RecursionGuard guard;
 
-    PythonStackTracker::get().emitPendingPushesAndPops();
+    if constexpr (FILTER_ALLOCATIONS) {
+        if (simple_allocation) {
+            d_recorded_addresses->add(reinterpret_cast<uintptr_t>(ptr));
+        }
+    }
+
+    PythonStackTracker& python_stack_tracker = PythonStackTracker::get();
+    python_stack_tracker.emitPendingPushesAndPops();
 
-    if (d_unwind_native_frames) {
+    frame_id_t native_index = 0;
+    if constexpr (NATIVE_TRACES) {
         NativeTrace trace;
-        frame_id_t native_index = 0;
-        // Skip the internal frames so we don't need to filter them later.
-        if (trace.fill(2)) {
+        bool filled;
+        {
+            OverheadCounters::Timer unwind_timer(overhead_counters, OverheadCounters::UNWIND);
+            // Skip the internal frames so we don't need to filter them later.
+            filled = trace.fill(2);
+        }
+        if (filled && trace.sameAsPrevious() && t_last_native_index) {
+            // Allocations made in a loop usually have the very same stack,
+            // and then there's no need to look up its frames in the tree.
+            native_index = t_last_native_index;
+        } else if (filled) {
             native_index = d_native_trace_tree.getTraceIndex(trace, [&](frame_id_t ip, uint32_t index) {
                 return d_writer->writeRecord(UnresolvedNativeFrame{ip, index});
             });
         }
+        t_last_native_index = native_index;
+    }
+
+    bool written;
+    if constexpr (INTERN_PYTHON_STACKS) {
+        PythonStackAllocationRecord record{
+                reinterpret_cast<uintptr_t>(ptr),
+                size,
+                func,
+                python_stack_tracker.currentStackIndex(),
+                native_index};
+        written = d_writer->writeThreadSpecificRecord(thread_id(), record);
+    } else if constexpr (NATIVE_TRACES) {
         NativeAllocationRecord record{reinterpret_cast<uintptr_t>(ptr), size, func, native_index};
-        if (!d_writer->writeThreadSpecificRecord(thread_id(), record)) {
-            std::cerr << "Failed to write output, deactivating tracking" << std::endl;
-            deactivate();
-        }
+        written = d_writer->writeThreadSpecificRecord(thread_id(), record);
     } else {
         AllocationRecord record{reinterpret_cast<uintptr_t>(ptr), size, func};
-        if (!d_writer->writeThreadSpecificRecord(thread_id(), record)) {
-            std::cerr << "Failed to write output, deactivating tracking" << std::endl;
-            deactivate();
-        }
+        written = d_writer->writeThreadSpecificRecord(thread_id(), record);
+    }
+    if (!written) {
+        std::cerr << "Failed to write output, deactivating tracking" << std::endl;
+        deactivate();
     }
 }
 
+Tracker::track_allocation_impl_t
+Tracker::selectTrackAllocationImpl(
+        bool native_traces,
+        bool intern_python_stacks,
+        bool filter_allocations,
+        bool measure_overhead)
+{
+    static const track_allocation_impl_t impls[] = {
+            &Tracker::trackAllocationImpl<false, false, false, false>,
+            &Tracker::trackAllocationImpl<false, false, false, true>,
+            &Tracker::trackAllocationImpl<false, false, true, false>,
+            &Tracker::trackAllocationImpl<false, false, true, true>,
+            &Tracker::trackAllocationImpl<false, true, false, false>,
+            &Tracker::trackAllocationImpl<false, true, false, true>,
+            &Tracker::trackAllocationImpl<false, true, true, false>,
+            &Tracker::trackAllocationImpl<false, true, true, true>,
+            &Tracker::trackAllocationImpl<true, false, false, false>,
+            &Tracker::trackAllocationImpl<true, false, false, true>,
+            &Tracker::trackAllocationImpl<true, false, true, false>,
+            &Tracker::trackAllocationImpl<true, false, true, true>,
+            &Tracker::trackAllocationImpl<true, true, false, false>,
+            &Tracker::trackAllocationImpl<true, true, false, true>,
+            &Tracker::trackAllocationImpl<true, true, true, false>,
+            &Tracker::trackAllocationImpl<true, true, true, true>,
+    };
+    const size_t index = native_traces << 3 | intern_python_stacks << 2 | filter_allocations << 1
+                         | measure_overhead;
+    return impls[index];
+}
+
 void
 Tracker::trackDeallocationImpl(void* ptr, size_t size, hooks::Allocator func)
 {
     if (RecursionGuard::isActive || !Tracker::isActive()) {
         return;
     }
+    OverheadCounters::Timer timer(d_overhead_counters.get(), OverheadCounters::DEALLOCATION);
     RecursionGuard guard;
 
+    if (d_recorded_addresses && hooks::allocatorKind(func) == hooks::AllocatorKind::SIMPLE_DEALLOCATOR
+        && !d_recorded_addresses->remove(reinterpret_cast<uintptr_t>(ptr)))
+    {
+        return;
+    }
+
     AllocationRecord record{reinterpret_cast<uintptr_t>(ptr), size, func};
     if (!d_writer->writeThreadSpecificRecord(thread_id(), record)) {
         std::cerr << "Failed to write output, deactivating tracking" << std::endl;
@@ -836,11 +2398,16 @@ Tracker::invalidate_module_cache_impl()
     updateModuleCache();
 }
 
+namespace {
+// The segments of every loaded module, by name and load address.
+using loaded_modules_t = std::map<std::pair<std::string, uintptr_t>, std::vector<Segment>>;
+}  // namespace
+
 #ifdef __linux__
 static int
 dl_iterate_phdr_callback(struct dl_phdr_info* info, [[maybe_unused]] size_t size, void* data)
 {
-    auto writer = reinterpret_cast<RecordWriter*>(data);
+    auto modules = reinterpret_cast<loaded_modules_t*>(data);
     const char* filename = info->dlpi_name;
     std::string executable;
     assert(filename != nullptr);
@@ -853,28 +2420,13 @@ dl_iterate_phdr_callback(struct dl_phdr_info* info, [[maybe_unused]] size_t size
         return 0;
     }
 
-    std::vector<Segment> segments;
+    std::vector<Segment>& segments = (*modules)[{filename, info->dlpi_addr}];
     for (int i = 0; i < info->dlpi_phnum; i++) {
         const auto& phdr = info->dlpi_phdr[i];
         if (phdr.p_type == PT_LOAD) {
             segments.emplace_back(Segment{phdr.p_vaddr, phdr.p_memsz});
         }
     }
-
-    if (!writer->writeRecordUnsafe(SegmentHeader{filename, segments.size(), info->dlpi_addr})) {
-        std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
-        Tracker::deactivate();
-        return 1;
-    }
-
-    for (const auto& segment : segments) {
-        if (!writer->writeRecordUnsafe(segment)) {
-            std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
-            Tracker::deactivate();
-            return 1;
-        }
-    }
-
     return 0;
 }
 #endif
@@ -882,24 +2434,21 @@ dl_iterate_phdr_callback(struct dl_phdr_info* info, [[maybe_unused]] size_t size
 void
 Tracker::updateModuleCacheImpl()
 {
-    if (!d_unwind_native_frames) {
+    if (!d_options.native_traces) {
         return;
     }
     auto writer_lock = d_writer->acquireLock();
-    if (!d_writer->writeRecordUnsafe(MemoryMapStart{})) {
-        std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
-        deactivate();
-    }
 
+    loaded_modules_t modules;
 #ifdef __linux__
-    dl_iterate_phdr(&dl_iterate_phdr_callback, d_writer.get());
+    dl_iterate_phdr(&dl_iterate_phdr_callback, &modules);
 #elif defined(__APPLE__)
     uint32_t c = _dyld_image_count();
     for (uint32_t i = 0; i < c; i++) {
         const struct mach_header* header = _dyld_get_image_header(i);
         auto slide = static_cast<uintptr_t>(_dyld_get_image_vmaddr_slide(i));
         const char* image_name = _dyld_get_image_name(i);
-        std::vector<Segment> segments;
+        std::vector<Segment>& segments = modules[{image_name, slide}];
 
         const segment_command_t* current_segment_cmd;
         uintptr_t current_cmd = reinterpret_cast<uintptr_t>(header) + sizeof(mach_header_t);
@@ -909,22 +2458,51 @@ Tracker::updateModuleCacheImpl()
                 segments.emplace_back(Segment{current_segment_cmd->vmaddr, current_segment_cmd->vmsize});
             }
         }
+    }
+#endif
 
-        if (!d_writer->writeRecordUnsafe(SegmentHeader{image_name, segments.size(), slide})) {
-            std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
-            Tracker::deactivate();
-            return;
+    // Only the first memory map lists every module. The later ones list the
+    // modules that were unloaded or loaded since the previous one, and they
+    // are not written at all if nothing changed.
+    std::vector<UnloadedModule> unloaded;
+    for (const auto& module : d_mapped_modules) {
+        if (!modules.count(module)) {
+            unloaded.push_back({module.first.c_str(), module.second});
+        }
+    }
+    std::vector<loaded_modules_t::const_iterator> loaded;
+    for (auto it = modules.cbegin(); it != modules.cend(); ++it) {
+        if (!d_mapped_modules.count(it->first)) {
+            loaded.push_back(it);
         }
+    }
+    const bool incremental = !d_mapped_modules.empty();
+    if (incremental && unloaded.empty() && loaded.empty()) {
+        return;
+    }
 
+    bool ok = d_writer->writeRecordUnsafe(MemoryMapStart{incremental});
+    for (const auto& module : unloaded) {
+        ok = ok && d_writer->writeRecordUnsafe(module);
+    }
+    for (const auto& it : loaded) {
+        const auto& [filename, addr] = it->first;
+        const auto& segments = it->second;
+        ok = ok && d_writer->writeRecordUnsafe(SegmentHeader{filename.c_str(), segments.size(), addr});
         for (const auto& segment : segments) {
-            if (!d_writer->writeRecordUnsafe(segment)) {
-                std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
-                Tracker::deactivate();
-                return;
-            }
+            ok = ok && d_writer->writeRecordUnsafe(segment);
         }
     }
-#endif
+    if (!ok) {
+        std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
+        deactivate();
+        return;
+    }
+
+    d_mapped_modules.clear();
+    for (const auto& [module, segments] : modules) {
+        d_mapped_modules.insert(module);
+    }
 }
 
 void
@@ -939,13 +2517,16 @@ Tracker::registerThreadNameImpl(const char* name)
 frame_id_t
 Tracker::registerFrame(const RawFrame& frame)
 {
-    const auto [frame_id, is_new_frame] = d_frames.getIndex(frame);
-    if (is_new_frame) {
-        pyrawframe_map_val_t frame_index{frame_id, frame};
-        if (!d_writer->writeRecord(frame_index)) {
-            std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
-            deactivate();
-        }
+    // The record is written before the lock is released, so that a fork
+    // can't copy a frame whose record isn't written yet (see lockForFork).
+    bool written = true;
+    const auto [frame_id, is_new_frame] =
+            d_frames.getIndex(frame, [&](frame_id_t new_frame_id, const RawFrame& new_frame) {
+                written = d_writer->writeRecord(pyrawframe_map_val_t{new_frame_id, new_frame});
+            });
+    if (is_new_frame && !written) {
+        std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
+        deactivate();
     }
     return frame_id;
 }
@@ -962,6 +2543,29 @@ Tracker::popFrames(uint32_t count)
     return true;
 }
 
+FrameTree::index_t
+Tracker::internFrame(FrameTree::index_t parent_index, const RawFrame& frame)
+{
+    const frame_id_t frame_id = registerFrame(frame);
+    FrameTree::index_t index = d_python_stack_tree.getTraceIndex(
+            parent_index,
+            frame_id,
+            [&](frame_id_t new_frame_id, FrameTree::index_t new_parent_index) {
+                return d_writer->writeRecord(PythonStackTreeNode{new_frame_id, new_parent_index});
+            });
+    if (!index) {
+        std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
+        deactivate();
+    }
+    return index;
+}
+
+bool
+Tracker::internsPythonStacks() const
+{
+    return d_options.intern_python_stacks;
+}
+
 bool
 Tracker::pushFrame(const RawFrame& frame)
 {
@@ -996,20 +2600,10 @@ Tracker::isActive()
 // Static methods managing the singleton
 
 PyObject*
-Tracker::createTracker(
-        std::unique_ptr<RecordWriter> record_writer,
-        bool native_traces,
-        unsigned int memory_interval,
-        bool follow_fork,
-        bool trace_python_allocators)
+Tracker::createTracker(std::unique_ptr<RecordWriter> record_writer, const TrackerOptions& options)
 {
     // Note: the GIL is used for synchronization of the singleton
-    d_instance_owner.reset(new Tracker(
-            std::move(record_writer),
-            native_traces,
-            memory_interval,
-            follow_fork,
-            trace_python_allocators));
+    d_instance_owner.reset(new Tracker(std::move(record_writer), options));
     Py_RETURN_NONE;
 }
 
@@ -1027,6 +2621,29 @@ Tracker::getTracker()
     return d_instance;
 }
 
+bool
+Tracker::dumpFlightRecorder()
+{
+    RecursionGuard guard;
+    Tracker* tracker = getTracker();
+    return tracker && tracker->d_writer->dumpFlightRecorder();
+}
+
+bool
+Tracker::getMetrics(TrackerMetrics* metrics)
+{
+    RecursionGuard guard;
+    Tracker* tracker = getTracker();
+    if (!tracker) {
+        return false;
+    }
+    if (tracker->d_overhead_counters) {
+        tracker->d_writer->setTrackingOverhead(tracker->d_overhead_counters->totals());
+    }
+    *metrics = tracker->d_writer->metrics();
+    return true;
+}
+
 static struct
 {
     PyMemAllocatorEx raw;
@@ -1037,7 +2654,7 @@ static struct
 void
 Tracker::registerPymallocHooks() const noexcept
 {
-    assert(d_trace_python_allocators);
+    assert(d_options.trace_python_allocators);
     PyMemAllocatorEx alloc;
 
     PyMem_GetAllocator(PYMEM_DOMAIN_RAW, &alloc);
@@ -1064,12 +2681,40 @@ Tracker::registerPymallocHooks() const noexcept
 void
 Tracker::unregisterPymallocHooks() const noexcept
 {
-    assert(d_trace_python_allocators);
+    assert(d_options.trace_python_allocators);
     PyMem_SetAllocator(PYMEM_DOMAIN_RAW, &s_orig_pymalloc_allocators.raw);
     PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &s_orig_pymalloc_allocators.mem);
     PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &s_orig_pymalloc_allocators.obj);
 }
 
+static PyObjectArenaAllocator s_orig_arena_allocator;
+
+void
+Tracker::registerPymallocArenaHooks() const noexcept
+{
+    assert(d_options.trace_pymalloc_arenas);
+    PyObjectArenaAllocator arena_allocator;
+
+    PyObject_GetArenaAllocator(&arena_allocator);
+    if (arena_allocator.free == &intercept::pymalloc_arena_free) {
+        // Nothing to do; our hooks are already installed.
+        return;
+    }
+
+    s_orig_arena_allocator = arena_allocator;
+    arena_allocator.ctx = &s_orig_arena_allocator;
+    arena_allocator.alloc = intercept::pymalloc_arena_alloc;
+    arena_allocator.free = intercept::pymalloc_arena_free;
+    PyObject_SetArenaAllocator(&arena_allocator);
+}
+
+void
+Tracker::unregisterPymallocArenaHooks() const noexcept
+{
+    assert(d_options.trace_pymalloc_arenas);
+    PyObject_SetArenaAllocator(&s_orig_arena_allocator);
+}
+
 // Trace Function interface
 
 PyObject*
@@ -1122,7 +2767,11 @@ PyTraceFunction(
             return PythonStackTracker::get().pushPythonFrame(frame);
         }
         case PyTrace_RETURN: {
-            PythonStackTracker::get().popPythonFrame();
+            PythonStackTracker& python_stack_tracker = PythonStackTracker::get();
+            if (PythonStackTracker::s_create_task_code) {
+                python_stack_tracker.recordTaskCreation(compat::frameGetCode(frame), arg);
+            }
+            python_stack_tracker.popPythonFrame();
             break;
         }
         default:
@@ -1131,6 +2780,243 @@ PyTraceFunction(
     return 0;
 }
 
+#if PY_VERSION_HEX >= 0x030C0000
+namespace {
+
+// The sys.monitoring callbacks. They are passed the code object and the
+// instruction offset, but just like PyTraceFunction they only need the frame
+// that is currently executing.
+PyObject*
+monitoringFrameEntered(
+        [[maybe_unused]] PyObject* self,
+        [[maybe_unused]] PyObject* const* args,
+        [[maybe_unused]] Py_ssize_t nargs)
+{
+    RecursionGuard guard;
+    if (!Tracker::isActive()) {
+        Py_RETURN_NONE;
+    }
+
+    PyFrameObject* frame = PyEval_GetFrame();
+    if (frame) {
+        PythonStackTracker& python_stack_tracker = PythonStackTracker::get();
+        python_stack_tracker.registerThreadCleanup();
+        if (python_stack_tracker.pushPythonFrame(frame) < 0) {
+            return nullptr;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+monitoringFrameExited(
+        [[maybe_unused]] PyObject* self,
+        [[maybe_unused]] PyObject* const* args,
+        [[maybe_unused]] Py_ssize_t nargs)
+{
+    RecursionGuard guard;
+    if (Tracker::isActive()) {
+        PythonStackTracker::get().popPythonFrame();
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+monitoringFrameReturned(
+        [[maybe_unused]] PyObject* self,
+        PyObject* const* args,
+        Py_ssize_t nargs)
+{
+    RecursionGuard guard;
+    if (Tracker::isActive()) {
+        PythonStackTracker& python_stack_tracker = PythonStackTracker::get();
+        // The arguments are the code object, the offset and the return value.
+        if (PythonStackTracker::s_create_task_code && nargs == 3) {
+            python_stack_tracker.recordTaskCreation(reinterpret_cast<PyCodeObject*>(args[0]), args[2]);
+        }
+        python_stack_tracker.popPythonFrame();
+    }
+    Py_RETURN_NONE;
+}
+
+PyMethodDef s_frame_entered_def = {
+        "memray_frame_entered",
+        reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(monitoringFrameEntered)),
+        METH_FASTCALL,
+        nullptr};
+
+PyMethodDef s_frame_returned_def = {
+        "memray_frame_returned",
+        reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(monitoringFrameReturned)),
+        METH_FASTCALL,
+        nullptr};
+
+PyMethodDef s_frame_exited_def = {
+        "memray_frame_exited",
+        reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(monitoringFrameExited)),
+        METH_FASTCALL,
+        nullptr};
+
+// The events that correspond to the PyTrace_CALL and PyTrace_RETURN events a
+// profile function gets for Python functions. Calls to C functions, which a
+// profile function is also told about, are never reported.
+const std::pair<const char*, PyMethodDef*> s_monitored_events[] = {
+        {"PY_START", &s_frame_entered_def},
+        {"PY_RESUME", &s_frame_entered_def},
+        {"PY_THROW", &s_frame_entered_def},
+        {"PY_RETURN", &s_frame_returned_def},
+        {"PY_YIELD", &s_frame_exited_def},
+        {"PY_UNWIND", &s_frame_exited_def},
+};
+
+// Tool IDs that PEP 669 doesn't set aside for debuggers, coverage tools,
+// profilers or optimizers, in the order we try to claim them.
+const int s_candidate_tool_ids[] = {4, 3};
+
+}  // namespace
+
+bool
+PythonStackTracker::installMonitoringCallbacks()
+{
+    assert(PyGILState_Check());
+
+    PyObject* monitoring = PySys_GetObject("monitoring");  // Borrowed reference
+    if (!monitoring) {
+        return false;
+    }
+
+    // After a fork the child still owns the tool ID its parent claimed.
+    if (s_monitoring_tool_id < 0) {
+        for (int tool_id : s_candidate_tool_ids) {
+            PyObject* ret = PyObject_CallMethod(monitoring, "use_tool_id", "is", tool_id, "memray");
+            if (ret) {
+                Py_DECREF(ret);
+                s_monitoring_tool_id = tool_id;
+                break;
+            }
+            // The ID is being used by another tool.
+            PyErr_Clear();
+        }
+        if (s_monitoring_tool_id < 0) {
+            return false;
+        }
+    }
+
+    PyObject* events = PyObject_GetAttrString(monitoring, "events");
+    bool ok = events != nullptr;
+    long event_set = 0;
+    for (size_t i = 0; ok && i < std::size(s_monitored_events); ++i) {
+        const auto& [name, callback_def] = s_monitored_events[i];
+        PyObject* event = PyObject_GetAttrString(events, name);
+        PyObject* callback = event ? PyCFunction_New(callback_def, nullptr) : nullptr;
+        PyObject* ret = nullptr;
+        if (callback) {
+            ret = PyObject_CallMethod(
+                    monitoring,
+                    "register_callback",
+                    "iOO",
+                    s_monitoring_tool_id,
+                    event,
+                    callback);
+        }
+        ok = ret != nullptr;
+        if (ok) {
+            event_set |= PyLong_AsLong(event);
+        }
+        Py_XDECREF(ret);
+        Py_XDECREF(callback);
+        Py_XDECREF(event);
+    }
+    Py_XDECREF(events);
+
+    if (ok) {
+        PyObject* ret =
+                PyObject_CallMethod(monitoring, "set_events", "il", s_monitoring_tool_id, event_set);
+        ok = ret != nullptr;
+        Py_XDECREF(ret);
+    }
+
+    if (!ok) {
+        // Fall back to a profile function rather than failing to track.
+        PyErr_Clear();
+        removeMonitoringCallbacks();
+    }
+    return ok;
+}
+
+void
+PythonStackTracker::removeMonitoringCallbacks()
+{
+    assert(PyGILState_Check());
+    assert(s_monitoring_tool_id >= 0);
+
+    // Errors are ignored: there's nothing better to do than to carry on.
+    PyObject* monitoring = PySys_GetObject("monitoring");  // Borrowed reference
+    PyObject* events = monitoring ? PyObject_GetAttrString(monitoring, "events") : nullptr;
+    if (events) {
+        Py_XDECREF(PyObject_CallMethod(monitoring, "set_events", "ii", s_monitoring_tool_id, 0));
+        PyErr_Clear();
+        for (const auto& monitored_event : s_monitored_events) {
+            PyObject* event = PyObject_GetAttrString(events, monitored_event.first);
+            if (event) {
+                Py_XDECREF(PyObject_CallMethod(
+                        monitoring,
+                        "register_callback",
+                        "iOO",
+                        s_monitoring_tool_id,
+                        event,
+                        Py_None));
+                Py_DECREF(event);
+            }
+            PyErr_Clear();
+        }
+        Py_XDECREF(PyObject_CallMethod(monitoring, "free_tool_id", "i", s_monitoring_tool_id));
+        Py_DECREF(events);
+    }
+    PyErr_Clear();
+    s_monitoring_tool_id = -1;
+}
+#endif
+
+bool
+PythonStackTracker::usesSysMonitoring()
+{
+#if PY_VERSION_HEX >= 0x030C0000
+    return s_monitoring_tool_id >= 0;
+#else
+    return false;
+#endif
+}
+
+void
+PythonStackTracker::registerThreadCleanup()
+{
+    // A thread followed with sys.monitoring has no profile function argument
+    // to let us know when it dies, so keep one in its thread state dict
+    // instead, which is cleared at the same point.
+    if (d_thread_cleanup_registered) {
+        return;
+    }
+    d_thread_cleanup_registered = true;
+
+    static const char* key = "memray.ProfileFunctionGuard";
+    PyObject* dict = PyThreadState_GetDict();  // Borrowed reference
+    if (!dict || PyDict_GetItemString(dict, key)) {
+        return;
+    }
+    PyObject* profileobj = create_profile_arg();
+    if (!profileobj || PyDict_SetItemString(dict, key, profileobj) < 0) {
+        PyErr_Clear();
+    }
+    Py_XDECREF(profileobj);
+}
+
+bool
+uses_sys_monitoring()
+{
+    return PythonStackTracker::usesSysMonitoring();
+}
+
 void
 forget_python_stack()
 {
@@ -1142,6 +3028,50 @@ forget_python_stack()
     PythonStackTracker::get().clear();
 }
 
+namespace {
+
+void
+trackCustomAllocation(void* ptr, size_t size)
+{
+    Tracker::trackAllocation(ptr, size, hooks::Allocator::CUSTOM_MALLOC);
+}
+
+void
+trackCustomDeallocation(void* ptr)
+{
+    Tracker::trackDeallocation(ptr, 0, hooks::Allocator::CUSTOM_FREE);
+}
+
+int
+suspendTracking()
+{
+    const bool was_suspended = RecursionGuard::isActive;
+    RecursionGuard::isActive = true;
+    return was_suspended;
+}
+
+void
+resumeTracking(int previous)
+{
+    RecursionGuard::isActive = previous;
+}
+
+const MemrayAllocatorApi s_allocator_api{
+        MEMRAY_ALLOCATOR_API_VERSION,
+        &trackCustomAllocation,
+        &trackCustomDeallocation,
+        &suspendTracking,
+        &resumeTracking,
+};
+
+}  // namespace
+
+const MemrayAllocatorApi*
+allocator_api()
+{
+    return &s_allocator_api;
+}
+
 void
 begin_tracking_greenlets()
 {
@@ -1160,6 +3090,11 @@ install_trace_function()
 {
     assert(PyGILState_Check());
     RecursionGuard guard;
+    // With sys.monitoring every thread is already being followed.
+    if (PythonStackTracker::usesSysMonitoring()) {
+        return;
+    }
+
     // Don't clear the python stack if we have already registered the tracking
     // function with the current thread. This happens when PyGILState_Ensure is
     // called and a thread state with our hooks installed already exists.
@@ -1185,7 +3120,10 @@ install_trace_function()
         frame = compat::frameGetBack(frame);
     }
 
+    // Whatever stack we captured before our profile function was installed in
+    // this thread may not hold anymore, so replace it.
     auto& python_stack_tracker = PythonStackTracker::get();
+    python_stack_tracker.clear();
     for (auto frame_it = stack.rbegin(); frame_it != stack.rend(); ++frame_it) {
         python_stack_tracker.pushPythonFrame(*frame_it);
     }
@@ -3,16 +3,22 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <fstream>
 #include <iterator>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 #include <unordered_set>
 
+#include <signal.h>
 #include <unwind.h>
 
 #include "frameobject.h"
@@ -24,22 +30,13 @@
 #    include <execinfo.h>
 #endif
 
+#include "../include/memray.h"
 #include "frame_tree.h"
 #include "hooks.h"
 #include "linker_shenanigans.h"
 #include "record_writer.h"
 #include "records.h"
 
-#if defined(USE_MEMRAY_TLS_MODEL)
-#    if defined(__GLIBC__)
-#        define MEMRAY_FAST_TLS __attribute__((tls_model("initial-exec")))
-#    else
-#        define MEMRAY_FAST_TLS __attribute__((tls_model("local-dynamic")))
-#    endif
-#else
-#    define MEMRAY_FAST_TLS
-#endif
-
 namespace memray::tracking_api {
 
 struct RecursionGuard
@@ -59,6 +56,27 @@ struct RecursionGuard
     MEMRAY_FAST_TLS static thread_local bool isActive;
 };
 
+/**
+ * Marks the current thread as being inside a tracked region.
+ *
+ * When the tracker only tracks regions, allocations are only recorded on
+ * threads that are inside at least one of them. Regions can be nested.
+ */
+struct TrackedRegion
+{
+    static void enter()
+    {
+        ++depth;
+    }
+
+    static void exit()
+    {
+        --depth;
+    }
+
+    MEMRAY_FAST_TLS static thread_local unsigned int depth;
+};
+
 // Trace function interface
 
 /**
@@ -93,6 +111,14 @@ PyTraceTrampoline(PyObject* obj, PyFrameObject* frame, int what, PyObject* arg);
 void
 install_trace_function();
 
+/**
+ * Whether the active tracker follows the Python stack with sys.monitoring.
+ *
+ * When it does, no profile function needs to be installed in new threads.
+ */
+bool
+uses_sys_monitoring();
+
 /**
  * Drop any references to frames on this thread's stack.
  *
@@ -102,6 +128,14 @@ install_trace_function();
 void
 forget_python_stack();
 
+/**
+ * The functions that extension modules report custom allocations with.
+ *
+ * These are exported in a capsule, and looked up through memray.h.
+ */
+const MemrayAllocatorApi*
+allocator_api();
+
 /**
  * Sets a flag to enable integration with the `greenlet` module.
  */
@@ -114,6 +148,12 @@ begin_tracking_greenlets();
 void
 handle_greenlet_switch(PyObject* from, PyObject* to);
 
+// Both of these keep a frame record with the caller's frame pointer followed
+// by the return address at the address the frame pointer points to.
+#if (defined(__linux__) || defined(__APPLE__)) && (defined(__x86_64__) || defined(__aarch64__))
+#    define MEMRAY_HAS_FRAME_POINTER_UNWINDER 1
+#endif
+
 class NativeTrace
 {
   public:
@@ -140,27 +180,67 @@ class NativeTrace
     {
         return d_size;
     }
+    // Whether the last fill found exactly the frames of the previous unwind
+    // done by this thread. Only the incremental unwinder can tell.
+    bool sameAsPrevious() const
+    {
+        return d_same_as_previous;
+    }
     __attribute__((always_inline)) inline bool fill(size_t skip)
     {
+#ifdef MEMRAY_HAS_FRAME_POINTER_UNWINDER
+        if (s_use_frame_pointers) {
+            return fillFromFramePointers(skip);
+        }
+#endif
+#if defined(__linux__) && defined(__x86_64__)
+        return fillIncremental(skip);
+#else
+        // One frame past the limit is enough to know that the trace is cut.
+        const size_t limit = s_max_depth ? skip + s_max_depth : 0;
         size_t size;
         while (true) {
-#ifdef __linux__
-            size = unw_backtrace((void**)d_data.data(), MAX_SIZE);
-#elif defined(__APPLE__)
-            size = ::backtrace((void**)d_data.data(), MAX_SIZE);
-#else
+            const size_t wanted = limit ? std::min(MAX_SIZE, limit + 1) : MAX_SIZE;
+#    ifdef __linux__
+            size = unw_backtrace((void**)d_data.data(), wanted);
+#    elif defined(__APPLE__)
+            size = ::backtrace((void**)d_data.data(), wanted);
+#    else
             return 0;
-#endif
-            if (size < MAX_SIZE) {
+#    endif
+            if (size < wanted || (limit && size > limit)) {
                 break;
             }
 
             MAX_SIZE = MAX_SIZE * 2;
             d_data.resize(MAX_SIZE);
         }
+        if (limit && size > limit) {
+            markTruncated(limit);
+            size = limit + 1;
+        }
         d_size = size > skip ? size - skip : 0;
         d_skip = skip;
         return d_size > 0;
+#endif
+    }
+
+    // Whether to unwind by following the chain of frame pointers instead of
+    // with libunwind. This is much faster, but it only finds the callers of
+    // functions that were compiled with frame pointers.
+    static void useFramePointers(bool use_frame_pointers)
+    {
+#ifdef MEMRAY_HAS_FRAME_POINTER_UNWINDER
+        s_use_frame_pointers = use_frame_pointers;
+#endif
+    }
+
+    // Keep only the innermost frames of each trace, in place of the rest of
+    // which a single TRUNCATED_NATIVE_FRAME_IP frame is reported. Unwinding
+    // stops as soon as the limit is reached. 0 means no limit.
+    static void setMaxDepth(size_t max_depth)
+    {
+        s_max_depth = max_depth;
     }
 
     static void setup()
@@ -184,20 +264,244 @@ class NativeTrace
     {
 #ifdef __linux__
         unw_flush_cache(unw_local_addr_space, 0, 0);
-#else
-        return;
+#endif
+        forgetPreviousUnwinds();
+    }
+
+    // Make every thread unwind its next trace from scratch, so that none is
+    // reported as the same as one from before this call.
+    static inline void forgetPreviousUnwinds()
+    {
+#ifdef __linux__
+        s_unwind_cache_generation.fetch_add(1, std::memory_order_relaxed);
 #endif
     }
 
   private:
+#if defined(__linux__) && defined(__x86_64__)
+    // Unwind the stack, reusing the outermost frames of this thread's
+    // previous unwind when they are still live. This must not be inlined, as
+    // it takes the place of unw_backtrace's own frame at the top of the trace.
+    __attribute__((noinline)) bool fillIncremental(size_t skip);
+#endif
+#ifdef MEMRAY_HAS_FRAME_POINTER_UNWINDER
+    // This must not be inlined either, because the walk starts from its own
+    // frame, which is left out of the trace.
+    __attribute__((noinline)) bool fillFromFramePointers(size_t skip);
+    static bool s_use_frame_pointers;
+#endif
+
+    // Put the truncation marker right after the innermost `size` frames.
+    void markTruncated(size_t size)
+    {
+        if (size >= d_data.size()) {
+            MAX_SIZE = std::max(2 * MAX_SIZE, size + 1);
+            d_data.resize(MAX_SIZE);
+        }
+        d_data[size] = TRUNCATED_NATIVE_FRAME_IP;
+    }
+
+    static size_t s_max_depth;
     MEMRAY_FAST_TLS static thread_local size_t MAX_SIZE;
+#ifdef __linux__
+    static std::atomic<unsigned int> s_unwind_cache_generation;
+#endif
 
   private:
     size_t d_size = 0;
     size_t d_skip = 0;
+    bool d_same_as_previous = false;
     std::vector<ip_t> d_data;
 };
 
+/**
+ * Set of the addresses of the allocations recorded while sampling or while
+ * skipping small allocations.
+ *
+ * In both cases, deallocations must only be recorded for addresses whose
+ * allocation was recorded. Checking an address that was never recorded (by
+ * far the most common case) only reads one atomic counter: the exact set is
+ * sharded by the same hash and only consulted when that counter says the
+ * address may be in it.
+ */
+class RecordedAddressSet
+{
+  public:
+    void add(uintptr_t address);
+    bool remove(uintptr_t address);
+
+  private:
+    static const size_t NUM_BUCKETS = 1 << 16;
+    static const size_t NUM_SHARDS = 64;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_set<uintptr_t> addresses;
+    };
+
+    static size_t bucketFor(uintptr_t address);
+
+    std::array<std::atomic<uint32_t>, NUM_BUCKETS> d_bucket_sizes{};
+    std::array<Shard, NUM_SHARDS> d_shards{};
+};
+
+/**
+ * Running totals of the allocations that were too small to be recorded.
+ *
+ * Every thread counts its own allocations in a counter that no other thread
+ * writes to, so counting one is only a couple of uncontended relaxed stores.
+ * The background thread periodically sums all the counters and writes the
+ * totals out.
+ */
+class FilteredAllocationCounters
+{
+  public:
+    FilteredAllocationCounters();
+    ~FilteredAllocationCounters();
+
+    FilteredAllocationCounters(FilteredAllocationCounters& other) = delete;
+    FilteredAllocationCounters(FilteredAllocationCounters&& other) = delete;
+    void operator=(const FilteredAllocationCounters&) = delete;
+    void operator=(FilteredAllocationCounters&&) = delete;
+
+    void add(size_t size);
+    FilteredAllocationTotals totals() const;
+
+  private:
+    struct alignas(64) Counter
+    {
+        Counter* next{nullptr};
+        std::atomic<size_t> n_allocations{0};
+        std::atomic<size_t> bytes{0};
+    };
+
+    // This must be trivially destructible, for the same reasons as the
+    // PythonStackTracker (see tracking_api.cpp).
+    struct CounterSlot
+    {
+        uint64_t owner_id;
+        Counter* counter;
+    };
+
+    Counter* counterForThisThread();
+
+    const uint64_t d_id;
+    std::atomic<Counter*> d_counters{nullptr};
+    MEMRAY_FAST_TLS static thread_local CounterSlot t_counter_slot;
+};
+
+/**
+ * How much time the tracker spends tracking allocations and deallocations and
+ * unwinding native stacks, when it's asked to measure it.
+ *
+ * Like the FilteredAllocationCounters, every thread adds to a counter that no
+ * other thread writes to, and the totals are summed up when they're needed.
+ */
+class OverheadCounters
+{
+  public:
+    enum Kind {
+        ALLOCATION = 0,
+        DEALLOCATION = 1,
+        UNWIND = 2,
+    };
+
+    OverheadCounters();
+    ~OverheadCounters();
+
+    OverheadCounters(OverheadCounters& other) = delete;
+    OverheadCounters(OverheadCounters&& other) = delete;
+    void operator=(const OverheadCounters&) = delete;
+    void operator=(OverheadCounters&&) = delete;
+
+    void add(Kind kind, std::chrono::steady_clock::duration elapsed);
+    // Only fills in the fields of the metrics that are measured here.
+    TrackerMetrics totals() const;
+
+    // Adds the time between its creation and its destruction to the
+    // counters passed to it, if any.
+    class Timer
+    {
+      public:
+        Timer(OverheadCounters* counters, Kind kind)
+        : d_counters(counters)
+        , d_kind(kind)
+        {
+            if (d_counters) {
+                d_start = std::chrono::steady_clock::now();
+            }
+        }
+
+        ~Timer()
+        {
+            if (d_counters) {
+                d_counters->add(d_kind, std::chrono::steady_clock::now() - d_start);
+            }
+        }
+
+        Timer(Timer& other) = delete;
+        Timer(Timer&& other) = delete;
+        void operator=(const Timer&) = delete;
+        void operator=(Timer&&) = delete;
+
+      private:
+        OverheadCounters* d_counters;
+        Kind d_kind;
+        std::chrono::steady_clock::time_point d_start{};
+    };
+
+  private:
+    static const size_t NUM_KINDS = 3;
+
+    struct alignas(64) Counter
+    {
+        Counter* next{nullptr};
+        std::array<std::atomic<size_t>, NUM_KINDS> counts{};
+        std::array<std::atomic<size_t>, NUM_KINDS> ns{};
+    };
+
+    // This must be trivially destructible, for the same reasons as the
+    // PythonStackTracker (see tracking_api.cpp).
+    struct CounterSlot
+    {
+        uint64_t owner_id;
+        Counter* counter;
+    };
+
+    Counter* counterForThisThread();
+
+    const uint64_t d_id;
+    std::atomic<Counter*> d_counters{nullptr};
+    MEMRAY_FAST_TLS static thread_local CounterSlot t_counter_slot;
+};
+
+// How a Tracker was asked to capture. The options are kept by the tracker
+// so that a forked child can be given the same ones as its parent.
+struct TrackerOptions
+{
+    bool native_traces{false};
+    unsigned int memory_interval{10};
+    bool follow_fork{false};
+    bool trace_python_allocators{false};
+    size_t sampling_interval{0};
+    bool intern_python_stacks{false};
+    size_t min_allocation_size{0};
+    size_t flight_recorder_size{0};
+    size_t flight_recorder_rss_threshold{0};
+    int flight_recorder_signal{0};
+    bool frame_pointer_unwinding{false};
+    bool trace_asyncio_tasks{false};
+    bool detailed_memory_counters{false};
+    bool measure_overhead{false};
+    bool regions_only{false};
+    size_t max_python_depth{0};
+    size_t max_native_depth{0};
+    bool trace_pymalloc_arenas{false};
+    // The fraction of one CPU's time that tracking may take, or 0.
+    double overhead_budget{0};
+};
+
 /**
  * Singleton managing all the global state and functionality of the tracing mechanism
  *
@@ -221,12 +525,11 @@ class Tracker
     // Interface to get the tracker instance
     static PyObject* createTracker(
             std::unique_ptr<RecordWriter> record_writer,
-            bool native_traces,
-            unsigned int memory_interval,
-            bool follow_fork,
-            bool trace_python_allocators);
+            const TrackerOptions& options);
     static PyObject* destroyTracker();
     static Tracker* getTracker();
+    static bool dumpFlightRecorder();
+    static bool getMetrics(TrackerMetrics* metrics);
 
     // Allocation tracking interface
     __attribute__((always_inline)) inline static void
@@ -234,7 +537,7 @@ class Tracker
     {
         Tracker* tracker = getTracker();
         if (tracker) {
-            tracker->trackAllocationImpl(ptr, size, func);
+            (tracker->*(tracker->d_track_allocation_impl))(ptr, size, func);
         }
     }
 
@@ -274,6 +577,8 @@ class Tracker
     // RawFrame stack interface
     bool pushFrame(const RawFrame& frame);
     bool popFrames(uint32_t count);
+    FrameTree::index_t internFrame(FrameTree::index_t parent_index, const RawFrame& frame);
+    bool internsPythonStacks() const;
 
     // Interface to activate/deactivate the tracking
     static const std::atomic<bool>& isActive();
@@ -285,7 +590,17 @@ class Tracker
     {
       public:
         // Constructors
-        BackgroundThread(std::shared_ptr<RecordWriter> record_writer, unsigned int memory_interval);
+        BackgroundThread(
+                std::shared_ptr<RecordWriter> record_writer,
+                unsigned int memory_interval,
+                bool detailed_memory_counters,
+                const FilteredAllocationCounters* filtered_allocations,
+                const OverheadCounters* overhead_counters,
+                size_t flight_recorder_rss_threshold,
+                double overhead_budget,
+                std::atomic<size_t>* sampling_interval,
+                size_t min_sampling_interval);
+        ~BackgroundThread();
 
         // Methods
         void start();
@@ -299,11 +614,36 @@ class Tracker
         std::mutex d_mutex;
         std::condition_variable d_cv;
         std::thread d_thread;
-        mutable std::ifstream d_procs_statm;
+        // Samples are timed with a monotonic clock, anchored to the wall
+        // clock time at which the thread was created.
+        unsigned long int d_start_ms_since_epoch;
+        std::chrono::steady_clock::time_point d_start_time;
+        // The files the samples are read from, kept open and read with pread
+        // so that each sample costs a single system call per file.
+        int d_procs_statm_fd{-1};
+        const bool d_detailed_memory_counters;
+        int d_smaps_rollup_fd{-1};
+        int d_cgroup_memory_fd{-1};
+        const FilteredAllocationCounters* d_filtered_allocations;
+        FilteredAllocationTotals d_last_filtered_allocation_totals{};
+        const OverheadCounters* d_overhead_counters;
+        const size_t d_flight_recorder_rss_threshold;
+        bool d_above_rss_threshold{false};
+        // The share of the time that tracking may take, if it's governed,
+        // and the sampling interval the governor adjusts to stay within it.
+        const double d_overhead_budget;
+        std::atomic<size_t>* d_sampling_interval;
+        const size_t d_min_sampling_interval;
+        std::chrono::steady_clock::time_point d_last_governor_time;
+        size_t d_last_overhead_ns{0};
 
         // Methods
         size_t getRSS() const;
-        static unsigned long int timeElapsed();
+        MemoryCounters getMemoryCounters() const;
+        unsigned long int timeElapsed(std::chrono::steady_clock::time_point when) const;
+        bool writeFilteredAllocationTotals();
+        bool maybeDumpFlightRecorder(size_t rss);
+        bool maybeAdjustSamplingInterval();
     };
 
     // Data members
@@ -314,31 +654,63 @@ class Tracker
 
     std::shared_ptr<RecordWriter> d_writer;
     FrameTree d_native_trace_tree;
-    bool d_unwind_native_frames;
-    unsigned int d_memory_interval;
-    bool d_follow_fork;
-    bool d_trace_python_allocators;
+    FrameTree d_python_stack_tree;
+    TrackerOptions d_options;
+    // What allocations are sampled with right now. It only differs from the
+    // interval the tracker was created with when an overhead budget is set.
+    std::atomic<size_t> d_current_sampling_interval;
+    // The instantiation of trackAllocationImpl for the settings above.
+    using track_allocation_impl_t = void (Tracker::*)(void* ptr, size_t size, hooks::Allocator func);
+    const track_allocation_impl_t d_track_allocation_impl;
+    std::unique_ptr<RecordedAddressSet> d_recorded_addresses;
+    std::unique_ptr<FilteredAllocationCounters> d_filtered_allocations;
+    std::unique_ptr<OverheadCounters> d_overhead_counters;
+    struct sigaction d_previous_signal_action = {};
     linker::SymbolPatcher d_patcher;
+    // The modules in the last memory map that was written, by name and load
+    // address, so that the next one only needs to list what changed.
+    std::set<std::pair<std::string, uintptr_t>> d_mapped_modules;
     std::unique_ptr<BackgroundThread> d_background_thread;
+    // Set from the time the process starts to fork until it's done forking,
+    // if the locks of the frames, the stack trees and the writer are held.
+    bool d_locked_for_fork{false};
 
     // Methods
     static size_t computeMainTidSkip();
     frame_id_t registerFrame(const RawFrame& frame);
-
+    bool shouldSampleAllocation(size_t size, size_t sampling_interval) const;
+
+    // The allocation hot path is instantiated for every combination of the
+    // settings it depends on, so that it doesn't need to check them.
+    template<
+            bool NATIVE_TRACES,
+            bool INTERN_PYTHON_STACKS,
+            bool FILTER_ALLOCATIONS,
+            bool MEASURE_OVERHEAD>
     void trackAllocationImpl(void* ptr, size_t size, hooks::Allocator func);
+    static track_allocation_impl_t selectTrackAllocationImpl(
+            bool native_traces,
+            bool intern_python_stacks,
+            bool filter_allocations,
+            bool measure_overhead);
     void trackDeallocationImpl(void* ptr, size_t size, hooks::Allocator func);
     void invalidate_module_cache_impl();
     void updateModuleCacheImpl();
     void registerThreadNameImpl(const char* name);
     void registerPymallocHooks() const noexcept;
     void unregisterPymallocHooks() const noexcept;
-
+    void registerPymallocArenaHooks() const noexcept;
+    void unregisterPymallocArenaHooks() const noexcept;
+    void lockForFork();
+    void unlockAfterFork();
+
+    // A tracker created in a forked child is given the one that was active
+    // when the parent forked, whose frames, stack trees and memory maps it
+    // takes over if its capture continues from the parent's one.
     explicit Tracker(
             std::unique_ptr<RecordWriter> record_writer,
-            bool native_traces,
-            unsigned int memory_interval,
-            bool follow_fork,
-            bool trace_python_allocators);
+            const TrackerOptions& options,
+            Tracker* forked_from = nullptr);
 
     static void prepareFork();
     static void parentFork();
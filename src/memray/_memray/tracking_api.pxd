@@ -1,23 +1,56 @@
 from _memray.record_writer cimport RecordWriter
+from _memray.records cimport TrackerMetrics
 from libcpp cimport bool
 from libcpp.memory cimport unique_ptr
 from libcpp.string cimport string
 
 
+cdef extern from "tracking_api.h":
+    const char* MEMRAY_ALLOCATOR_API_CAPSULE
+    ctypedef struct MemrayAllocatorApi:
+        pass
+
 cdef extern from "tracking_api.h" namespace "memray::tracking_api":
+    const MemrayAllocatorApi* allocator_api()
     void forget_python_stack() except*
     void install_trace_function() except*
+    bool uses_sys_monitoring()
     void begin_tracking_greenlets() except+
     void handle_greenlet_switch(object, object) except+
 
+    struct TrackerOptions:
+        bool native_traces
+        unsigned int memory_interval
+        bool follow_fork
+        bool trace_python_allocators
+        size_t sampling_interval
+        bool intern_python_stacks
+        size_t min_allocation_size
+        size_t flight_recorder_size
+        size_t flight_recorder_rss_threshold
+        int flight_recorder_signal
+        bool frame_pointer_unwinding
+        bool trace_asyncio_tasks
+        bool detailed_memory_counters
+        bool measure_overhead
+        bool regions_only
+        size_t max_python_depth
+        size_t max_native_depth
+        bool trace_pymalloc_arenas
+        double overhead_budget
+
+    cdef cppclass TrackedRegion:
+        @staticmethod
+        void enter()
+
+        @staticmethod
+        void exit()
+
     cdef cppclass Tracker:
         @staticmethod
         object createTracker(
             unique_ptr[RecordWriter] record_writer,
-            bool native_traces,
-            unsigned int memory_interval,
-            bool follow_fork,
-            bool trace_pymalloc,
+            const TrackerOptions& options,
         ) except+
 
         @staticmethod
@@ -25,3 +58,9 @@ cdef extern from "tracking_api.h" namespace "memray::tracking_api":
 
         @staticmethod
         Tracker* getTracker()
+
+        @staticmethod
+        bool dumpFlightRecorder()
+
+        @staticmethod
+        bool getMetrics(TrackerMetrics* metrics)
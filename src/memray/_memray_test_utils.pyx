@@ -286,4 +286,88 @@ def exit(bint py_finalize=False):
         _exit(0)
     else:
         with nogil:
-            _exit(0)
\ No newline at end of file
+            _exit(0)
+
+
+cdef extern from "include/memray.h":
+    int memray_import_allocator_api() except -1
+    void memray_track_allocation(void* ptr, size_t size) nogil
+    void memray_track_deallocation(void* ptr) nogil
+    int memray_suspend_tracking() nogil
+    void memray_resume_tracking(int previous) nogil
+
+
+cdef class PoolAllocator:
+    """Carves allocations out of a region, reporting them through the C API."""
+    cdef char* _region
+    cdef size_t _size
+    cdef size_t _used
+
+    def __cinit__(self, size_t size):
+        memray_import_allocator_api()
+        cdef int previous = memray_suspend_tracking()
+        self._region = <char*>malloc(size)
+        memray_resume_tracking(previous)
+        if self._region == NULL:
+            raise MemoryError
+        self._size = size
+        self._used = 0
+
+    def __dealloc__(self):
+        cdef int previous = memray_suspend_tracking()
+        free(self._region)
+        memray_resume_tracking(previous)
+
+    @cython.profile(True)
+    def allocate(self, size_t size):
+        if self._used + size > self._size:
+            raise MemoryError
+        cdef void* ptr = self._region + self._used
+        self._used += size
+        memray_track_allocation(ptr, size)
+        return <uintptr_t>ptr
+
+    @cython.profile(True)
+    def deallocate(self, uintptr_t address):
+        memray_track_deallocation(<void*>address)
+
+
+@cython.profile(False)
+def churn(size_t n_allocations, size_t n_live=1024, size_t mmap_every=0):
+    """Make allocations of assorted sizes without the GIL held, freeing each
+    one once n_live more were made, to generate big captures quickly.
+
+    If mmap_every is non-zero, every mmap_every-th allocation is an anonymous
+    mapping instead of a malloc.
+    """
+    if n_live == 0:
+        raise ValueError("n_live must be positive")
+    cdef vector[void*] live
+    cdef vector[size_t] lengths
+    live.resize(n_live, NULL)
+    lengths.resize(n_live, 0)
+    cdef size_t i
+    cdef size_t slot
+    cdef size_t size
+    cdef void* ptr
+    with nogil:
+        for i in range(n_allocations + n_live):
+            slot = i % n_live
+            if live[slot] != NULL:
+                if lengths[slot]:
+                    munmap(live[slot], lengths[slot])
+                else:
+                    free(live[slot])
+                live[slot] = NULL
+            if i >= n_allocations:
+                continue
+            size = 16 + (i * 7919) % 4096
+            if mmap_every and i % mmap_every == 0:
+                ptr = mmap(NULL, size, PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)
+                if ptr == MAP_FAILED:
+                    continue
+                lengths[slot] = size
+            else:
+                ptr = malloc(size)
+                lengths[slot] = 0
+            live[slot] = ptr
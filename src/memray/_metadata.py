@@ -13,3 +13,5 @@ class Metadata:
     pid: int
     python_allocator: str
     has_native_traces: bool
+    sampling_interval_bytes: int = 0
+    min_allocation_size: int = 0
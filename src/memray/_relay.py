@@ -0,0 +1,317 @@
+"""Share the live view of a tracked process with several viewers.
+
+A tracked process started with ``memray run --live-remote`` serves its records
+to a single client. The relay is that client: it reads the records once, keeps
+the current snapshot of the process, and serves it to any number of viewers,
+which the tracked process never hears about.
+
+Viewers get newline delimited JSON messages. The first one describes the
+tracked process, and every other one is a delta of the snapshot::
+
+    {"pid": ..., "command_line": ..., "native_traces": ...}
+    {"frames": [...], "add": [...], "remove": [...]}
+
+``frames`` extends the table of frames that the stacks of the records refer
+to, ``add`` has the records that appeared since the previous message, as
+``[id, tid, thread name, size, allocations, allocator, stack, hybrid stack]``
+lists, and ``remove`` has the ids of the records that went away. A record that
+changes is removed and added again with a new id. The first delta a viewer gets
+holds the whole snapshot.
+"""
+import contextlib
+import itertools
+import json
+import socket
+import threading
+import time
+from typing import Any
+from typing import Dict
+from typing import Iterator
+from typing import List
+from typing import Optional
+from typing import Tuple
+
+from ._analysis_cache import CachedAllocationRecord
+from ._memray import AllocationRecord
+from ._memray import AllocatorType
+from ._memray import SocketReader
+
+Frame = Tuple[str, str, int]
+
+# Viewers that can't take a message in this many seconds are disconnected, so
+# that they can't hold back the other ones.
+SEND_TIMEOUT = 5
+
+
+class LiveRelay:
+    def __init__(
+        self,
+        upstream_port: int,
+        port: int,
+        *,
+        address: str = "127.0.0.1",
+        interval: float = 0.1,
+    ) -> None:
+        self._upstream_port = upstream_port
+        self._port = port
+        self._address = address
+        self._interval = interval
+        self._lock = threading.Lock()
+        self._viewers: List[socket.socket] = []
+        self._header = b""
+        self._frames: List[Frame] = []
+        self._frame_ids: Dict[Frame, int] = {}
+        # Frames are added while the snapshot is read, but viewers only get
+        # the ones that the records sent so far refer to.
+        self._n_frames_sent = 0
+        self._record_ids = itertools.count()
+        # The reader reuses the records of the locations that didn't change,
+        # so they are told apart by identity. Keeping them alive keeps their
+        # ids from being reused.
+        self._known: Dict[int, Tuple[AllocationRecord, int]] = {}
+        self._entries: Dict[int, List[Any]] = {}
+
+    def serve(self) -> None:
+        """Relay the records of the tracked process until it disconnects."""
+        with SocketReader(port=self._upstream_port) as reader:
+            self._header = _encode(
+                {
+                    "pid": reader.pid,
+                    "command_line": reader.command_line,
+                    "native_traces": reader.has_native_traces,
+                }
+            )
+            listener = socket.create_server((self._address, self._port))
+            acceptor = threading.Thread(
+                target=self._accept_viewers, args=(listener,), daemon=True
+            )
+            acceptor.start()
+            try:
+                while reader.is_active:
+                    self._update(reader)
+                    time.sleep(self._interval)
+                self._update(reader)
+            finally:
+                listener.close()
+                with self._lock:
+                    for viewer in self._viewers:
+                        viewer.close()
+                    self._viewers.clear()
+
+    def _accept_viewers(self, listener: socket.socket) -> None:
+        while True:
+            try:
+                viewer, _ = listener.accept()
+            except OSError:
+                return
+            viewer.settimeout(SEND_TIMEOUT)
+            with self._lock:
+                snapshot = {
+                    "frames": self._frames[: self._n_frames_sent],
+                    "add": list(self._entries.values()),
+                    "remove": [],
+                }
+                if self._send(viewer, self._header + _encode(snapshot)):
+                    self._viewers.append(viewer)
+
+    def _update(self, reader: SocketReader) -> None:
+        native = reader.has_native_traces
+        known: Dict[int, Tuple[AllocationRecord, int]] = {}
+        added = []
+        for record in reader.get_current_snapshot(merge_threads=False):
+            previous = self._known.get(id(record))
+            if previous is not None and previous[0] is record:
+                known[id(record)] = previous
+                continue
+            record_id = next(self._record_ids)
+            entry = [
+                record_id,
+                record.tid,
+                record.thread_name,
+                record.size,
+                record.n_allocations,
+                int(record.allocator),
+                self._stack(record.stack_trace()),
+                self._stack(record.hybrid_stack_trace()) if native else None,
+            ]
+            known[id(record)] = (record, record_id)
+            added.append(entry)
+        removed = [
+            record_id
+            for key, (_, record_id) in self._known.items()
+            if key not in known
+        ]
+        if not added and not removed:
+            return
+
+        n_frames = len(self._frames)
+        message = _encode(
+            {
+                "frames": self._frames[self._n_frames_sent : n_frames],
+                "add": added,
+                "remove": removed,
+            }
+        )
+        with self._lock:
+            self._n_frames_sent = n_frames
+            self._known = known
+            for record_id in removed:
+                del self._entries[record_id]
+            for entry in added:
+                self._entries[entry[0]] = entry
+            self._viewers = [
+                viewer for viewer in self._viewers if self._send(viewer, message)
+            ]
+
+    def _stack(self, stack: List[Frame]) -> List[int]:
+        frame_ids = []
+        for frame in stack:
+            frame_id = self._frame_ids.get(frame)
+            if frame_id is None:
+                frame_id = self._frame_ids[frame] = len(self._frames)
+                self._frames.append(frame)
+            frame_ids.append(frame_id)
+        return frame_ids
+
+    @staticmethod
+    def _send(viewer: socket.socket, message: bytes) -> bool:
+        try:
+            viewer.sendall(message)
+        except OSError:
+            viewer.close()
+            return False
+        return True
+
+
+class RelayReader:
+    """Read the live view of a tracked process from a `LiveRelay`.
+
+    It can be used in place of a `SocketReader` to show the view.
+    """
+
+    def __init__(self, port: int) -> None:
+        self._port = port
+        self._socket: Optional[socket.socket] = None
+        self._thread: Optional[threading.Thread] = None
+        self._lock = threading.Lock()
+        self._header: Dict[str, Any] = {}
+        self._frames: List[Frame] = []
+        self._records: Dict[int, CachedAllocationRecord] = {}
+
+    def __enter__(self) -> "RelayReader":
+        if self._socket is not None:
+            raise ValueError(
+                "Can not enter the context of a RelayReader object more than "
+                "once, at the same time."
+            )
+        while True:
+            try:
+                self._socket = socket.create_connection(("127.0.0.1", self._port))
+                break
+            except ConnectionRefusedError:
+                time.sleep(0.5)
+        stream = self._socket.makefile("rb")
+        self._header = json.loads(stream.readline() or b"{}")
+        self._frames = []
+        self._records = {}
+        self._thread = threading.Thread(
+            target=self._read_deltas, args=(stream,), daemon=True
+        )
+        self._thread.start()
+        return self
+
+    def __exit__(self, *exc_info: object) -> None:
+        assert self._socket is not None and self._thread is not None
+        with contextlib.suppress(OSError):
+            self._socket.shutdown(socket.SHUT_RDWR)
+        self._socket.close()
+        self._thread.join()
+        self._socket = None
+
+    def _read_deltas(self, stream: Any) -> None:
+        with stream:
+            try:
+                for line in stream:
+                    self._apply(json.loads(line))
+            except (OSError, ValueError):
+                pass
+
+    def _apply(self, delta: Dict[str, Any]) -> None:
+        self._frames.extend(tuple(frame) for frame in delta["frames"])
+        frames = self._frames
+        with self._lock:
+            for record_id in delta["remove"]:
+                self._records.pop(record_id, None)
+            for entry in delta["add"]:
+                record_id, tid, thread_name, size, n_allocations, allocator = entry[:6]
+                stack, hybrid = entry[6:]
+                self._records[record_id] = CachedAllocationRecord(
+                    tid=tid,
+                    address=0,
+                    size=size,
+                    allocator=AllocatorType(allocator),
+                    stack_id=0,
+                    n_allocations=n_allocations,
+                    thread_name=thread_name,
+                    stack=[frames[i] for i in stack],
+                    native_stack=[],
+                    hybrid_stack=(
+                        None if hybrid is None else [frames[i] for i in hybrid]
+                    ),
+                )
+
+    @property
+    def command_line(self) -> Optional[str]:
+        return self._header.get("command_line")
+
+    @property
+    def is_active(self) -> bool:
+        return self._thread is not None and self._thread.is_alive()
+
+    @property
+    def pid(self) -> Optional[int]:
+        return self._header.get("pid")
+
+    @property
+    def has_native_traces(self) -> bool:
+        return bool(self._header.get("native_traces"))
+
+    def get_current_snapshot(
+        self, *, merge_threads: bool
+    ) -> Iterator[CachedAllocationRecord]:
+        with self._lock:
+            records = tuple(self._records.values())
+        if not merge_threads:
+            yield from records
+            return
+
+        merged: Dict[Tuple[Any, ...], CachedAllocationRecord] = {}
+        for record in records:
+            hybrid = record.hybrid_stack_trace() if self.has_native_traces else None
+            key = (
+                record.allocator,
+                tuple(record.stack_trace()),
+                None if hybrid is None else tuple(hybrid),
+            )
+            entry = merged.get(key)
+            if entry is None:
+                merged[key] = CachedAllocationRecord(
+                    tid=-1,
+                    address=0,
+                    size=record.size,
+                    allocator=record.allocator,
+                    stack_id=0,
+                    n_allocations=record.n_allocations,
+                    thread_name="merged thread",
+                    stack=record.stack_trace(),
+                    native_stack=[],
+                    hybrid_stack=hybrid,
+                )
+            else:
+                entry.size += record.size
+                entry.n_allocations += record.n_allocations
+        yield from merged.values()
+
+
+def _encode(message: Dict[str, Any]) -> bytes:
+    return json.dumps(message, separators=(",", ":")).encode() + b"\n"
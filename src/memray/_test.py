@@ -2,12 +2,14 @@ from typing import Callable
 
 from ._test_utils import MemoryAllocator as _MemoryAllocator
 from ._test_utils import MmapAllocator
+from ._test_utils import PoolAllocator
 from ._test_utils import PymallocDomain
 from ._test_utils import PymallocMemoryAllocator
 from ._test_utils import _cython_allocate_in_two_places
 from ._test_utils import _cython_nested_allocation
 from ._test_utils import allocate_cpp_vector
 from ._test_utils import allocate_without_gil_held
+from ._test_utils import churn
 from ._test_utils import exit
 from ._test_utils import fill_cpp_vector
 from ._test_utils import function_caller
@@ -53,11 +55,13 @@ __all__ = [
     "allocate_cpp_vector",
     "MemoryAllocator",
     "MmapAllocator",
+    "PoolAllocator",
     "PymallocDomain",
     "PymallocMemoryAllocator",
     "_cython_allocate_in_two_places",
     "_cython_nested_allocation",
     "allocate_without_gil_held",
+    "churn",
     "function_caller",
     "set_thread_name",
     "fill_cpp_vector",
@@ -38,3 +38,4 @@ def allocate_without_gil_held(wake_up_main_fd: int, wake_up_thread_fd: int) -> N
 def allocate_cpp_vector(size: int) -> int: ...
 def fill_cpp_vector(size: int) -> int: ...
 def exit(py_finalize: bool = False) -> None: ...
+def churn(n_allocations: int, n_live: int = 1024, mmap_every: int = 0) -> None: ...
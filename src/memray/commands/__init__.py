@@ -15,9 +15,12 @@ from memray._errors import MemrayError
 from memray._memray import set_log_level
 
 from . import attach
+from . import diff
 from . import flamegraph
+from . import lifetimes
 from . import live
 from . import parse
+from . import relay
 from . import run
 from . import stats
 from . import summary
@@ -60,10 +63,13 @@ _COMMANDS: List[Command] = [
     flamegraph.FlamegraphCommand(),
     table.TableCommand(),
     live.LiveCommand(),
+    relay.RelayCommand(),
     tree.TreeCommand(),
     parse.ParseCommand(),
     summary.SummaryCommand(),
     stats.StatsCommand(),
+    diff.DiffCommand(),
+    lifetimes.LifetimesCommand(),
     transform.TransformCommand(),
     attach.AttachCommand(),
 ]
@@ -22,6 +22,7 @@ GDB_SCRIPT = pathlib.Path(__file__).parent / "_attach.gdb"
 LLDB_SCRIPT = pathlib.Path(__file__).parent / "_attach.lldb"
 RTLD_DEFAULT = memray._memray.RTLD_DEFAULT
 RTLD_NOW = memray._memray.RTLD_NOW
+PTRACE_TIMEOUT_MS = 10_000
 PAYLOAD = """
 import atexit
 
@@ -61,6 +62,9 @@ def inject(debugger: str, pid: int, port: int, verbose: bool) -> str | None:
     injecter = pathlib.Path(memray.__file__).parent / "_inject.abi3.so"
     assert injecter.exists()
 
+    if debugger == "ptrace":
+        return _inject_with_ptrace(injecter, pid, port, verbose)
+
     gdb_cmd = [
         "gdb",
         "-batch",
@@ -147,6 +151,26 @@ def inject(debugger: str, pid: int, port: int, verbose: bool) -> str | None:
     return "An unexpected error occurred. Run with --verbose to debug the failure."
 
 
+def _inject_with_ptrace(
+    injecter: pathlib.Path, pid: int, port: int, verbose: bool
+) -> str | None:
+    if verbose:
+        print(f"Injecting {injecter} into process {pid} with ptrace")
+    try:
+        memray._memray.ptrace_attach(pid, injecter, port, PTRACE_TIMEOUT_MS)
+    except RuntimeError as exc:
+        return str(exc)
+    return None
+
+
+def _ptrace_available(verbose: bool) -> bool:
+    if not memray._memray.ptrace_attach_supported():
+        if verbose:
+            print("Attaching with ptrace is not supported on this platform")
+        return False
+    return True
+
+
 def _gdb_available(verbose: bool) -> bool:
     if not shutil.which("gdb"):
         if verbose:
@@ -184,7 +208,11 @@ def _lldb_available(verbose: int) -> bool:
 
 
 def debugger_available(debugger: str, verbose: bool = False) -> bool:
-    return {"gdb": _gdb_available, "lldb": _lldb_available}[debugger](verbose=verbose)
+    return {
+        "gdb": _gdb_available,
+        "lldb": _lldb_available,
+        "ptrace": _ptrace_available,
+    }[debugger](verbose=verbose)
 
 
 def recvall(sock: socket.socket) -> str:
@@ -253,7 +281,7 @@ class AttachCommand:
         compression = parser.add_mutually_exclusive_group()
         compression.add_argument(
             "--compress-on-exit",
-            help="Compress the resulting file using lz4 after tracking completes",
+            help="Compress the resulting file using lz4 while tracking",
             default=True,
             action="store_true",
         )
@@ -266,10 +294,14 @@ class AttachCommand:
 
         parser.add_argument(
             "--method",
-            help="Method to use for injecting code into the process to track",
+            help=(
+                "Method to use for injecting code into the process to track."
+                " By default ptrace is used where it is supported, and"
+                " lldb or gdb otherwise"
+            ),
             type=str,
             default="auto",
-            choices=["auto", "gdb", "lldb"],
+            choices=["auto", "ptrace", "gdb", "lldb"],
         )
 
         parser.add_argument(
@@ -289,7 +321,9 @@ class AttachCommand:
         verbose = args.verbose
 
         if args.method == "auto":
-            if debugger_available("lldb", verbose=verbose):
+            if debugger_available("ptrace", verbose=verbose):
+                args.method = "ptrace"
+            elif debugger_available("lldb", verbose=verbose):
                 args.method = "lldb"
             elif debugger_available("gdb", verbose=verbose):
                 args.method = "gdb"
@@ -298,6 +332,12 @@ class AttachCommand:
                     "Cannot find a supported lldb or gdb executable.",
                     exit_code=1,
                 )
+        elif args.method == "ptrace":
+            if not debugger_available("ptrace", verbose=verbose):
+                raise MemrayCommandError(
+                    "Attaching with ptrace is only supported on Linux.",
+                    exit_code=1,
+                )
         elif not debugger_available(args.method, verbose=verbose):
             raise MemrayCommandError(
                 f"Cannot find a supported {args.method} executable.",
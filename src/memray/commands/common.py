@@ -1,11 +1,21 @@
 import argparse
+import concurrent.futures
+import dataclasses
+import functools
+import heapq
+import multiprocessing
 import os
 import pathlib
 from pathlib import Path
 from typing import Any
+from typing import Callable
+from typing import Dict
 from typing import Iterable
+from typing import List
 from typing import Optional
+from typing import Sequence
 from typing import Tuple
+from typing import TypeVar
 
 try:
     from typing import Protocol
@@ -20,8 +30,11 @@ from memray import MemorySnapshot
 from memray._errors import MemrayCommandError
 from memray._memray import SymbolicSupport
 from memray._memray import get_symbolic_support
+from memray._metadata import Metadata
 from memray.reporters import BaseReporter
 
+T = TypeVar("T")
+
 
 class ReporterFactory(Protocol):
     def __call__(
@@ -60,6 +73,270 @@ def warn_if_not_enough_symbols() -> None:
         return
 
 
+def add_cache_argument(parser: argparse.ArgumentParser) -> None:
+    parser.add_argument(
+        "--cache",
+        help=(
+            "Keep the results of analyzing the capture file in a sidecar file "
+            "next to it, so that later reports on the same file are faster"
+        ),
+        action="store_true",
+        dest="cache_analysis",
+        default=False,
+    )
+
+
+def add_native_symbols_only_argument(parser: argparse.ArgumentParser) -> None:
+    parser.add_argument(
+        "--native-symbols-only",
+        help=(
+            "Only resolve the function names of native frames, from the symbol "
+            "tables of the files they are in, without loading debug information"
+        ),
+        action="store_true",
+        default=False,
+    )
+
+
+def add_merge_processes_argument(parser: argparse.ArgumentParser) -> None:
+    parser.add_argument(
+        "--merge-processes",
+        help=(
+            "Also report the allocations of the child processes that were "
+            "tracked with --follow-fork, as if they were made by one process"
+        ),
+        action="store_true",
+        default=False,
+    )
+
+
+def add_results_arguments(parser: argparse.ArgumentParser) -> None:
+    parser.add_argument("results", help="Results of the tracker run")
+    parser.add_argument(
+        "other_results",
+        nargs="*",
+        metavar="more_results",
+        help=(
+            "Results of other tracker runs, to report on together with the "
+            "first one, as if they were made by one process"
+        ),
+    )
+
+
+def validate_results(results: Iterable[str]) -> List[Path]:
+    result_paths = [Path(result) for result in results]
+    for result_path in result_paths:
+        if not result_path.exists() or not result_path.is_file():
+            raise MemrayCommandError(f"No such file: {result_path}", exit_code=1)
+    return result_paths
+
+
+def find_process_captures(result_path: Path) -> List[Path]:
+    """Find the captures of a process and of the children it forked.
+
+    With ``--follow-fork``, every child writes its own capture file, named
+    after its parent's one with the child's pid appended to it. The parent's
+    capture comes first, and the children's ones in the order of their pids.
+    """
+    prefix = result_path.name + "."
+    children = []
+    for path in result_path.parent.iterdir():
+        pid = path.name[len(prefix) :]
+        if path.name.startswith(prefix) and pid.isdigit() and path.is_file():
+            children.append((int(pid), path))
+    return [result_path] + [path for _, path in sorted(children)]
+
+
+def merge_memory_records(
+    memory_records: Sequence[Sequence[MemorySnapshot]],
+) -> List[MemorySnapshot]:
+    """Add up the memory used by several processes over time.
+
+    Every process counts with its latest memory snapshot, from its first one
+    and up to its last one.
+    """
+    merged = []
+    latest: Dict[int, MemorySnapshot] = {}
+    rss = heap = 0
+    streams = (
+        [(process, record, record is records[-1]) for record in records]
+        for process, records in enumerate(memory_records)
+    )
+    for process, record, is_last in heapq.merge(*streams, key=lambda e: e[1].time):
+        previous = latest.get(process)
+        if previous is not None:
+            rss -= previous.rss
+            heap -= previous.heap
+        rss += record.rss
+        heap += record.heap
+        merged.append(MemorySnapshot(record.time, rss, heap))
+        if is_last:
+            rss -= record.rss
+            heap -= record.heap
+            latest.pop(process, None)
+        else:
+            latest[process] = record
+    return merged
+
+
+def merge_metadata(metadata: Sequence[Metadata]) -> Metadata:
+    """Describe the captures of several processes as a single one.
+
+    The peak memory is the sum of the peaks of the processes, which is what
+    the snapshots of the processes at their high water marks add up to.
+    """
+    return dataclasses.replace(
+        metadata[0],
+        start_time=min(m.start_time for m in metadata),
+        end_time=max(m.end_time for m in metadata),
+        total_allocations=sum(m.total_allocations for m in metadata),
+        total_frames=sum(m.total_frames for m in metadata),
+        peak_memory=sum(m.peak_memory for m in metadata),
+    )
+
+
+def _snapshot_records(
+    reader: FileReader,
+    show_memory_leaks: bool,
+    temporary_allocation_threshold: int,
+    merge_threads: bool,
+) -> Iterable[AllocationRecord]:
+    if show_memory_leaks:
+        return reader.get_snapshot(merge_threads, leaks=True)
+    return reader.get_snapshot(
+        merge_threads, temporary_allocation_threshold=temporary_allocation_threshold
+    )
+
+
+@dataclasses.dataclass(frozen=True)
+class MergedAllocationRecord:
+    """The allocations with the same stack in one or more capture files.
+
+    Stacks are told apart by the content of their frames, since frame ids
+    only mean something in the capture that they come from. The stack is the
+    hybrid one if the captures have native traces.
+    """
+
+    stack: Tuple[Tuple[str, str, int], ...]
+    tid: int
+    thread_name: str
+    allocator: int
+    size: int
+    n_allocations: int
+
+    def stack_trace(
+        self, max_stacks: Optional[int] = None
+    ) -> List[Tuple[str, str, int]]:
+        return list(self.stack[:max_stacks])
+
+    hybrid_stack_trace = stack_trace
+
+
+_CaptureSummary = Tuple[
+    Metadata, Tuple[MemorySnapshot, ...], Dict[Tuple[Any, ...], List[int]]
+]
+
+
+def _summarize_capture(
+    result_path: Path,
+    show_memory_leaks: bool,
+    temporary_allocation_threshold: int,
+    merge_threads: bool,
+    cache_analysis: bool,
+    native_symbols_only: bool = False,
+) -> _CaptureSummary:
+    reader = FileReader(
+        os.fspath(result_path),
+        cache_analysis=cache_analysis,
+        native_symbols_only=native_symbols_only,
+    )
+    metadata = reader.metadata
+    totals: Dict[Tuple[Any, ...], List[int]] = {}
+    for record in _snapshot_records(
+        reader, show_memory_leaks, temporary_allocation_threshold, merge_threads
+    ):
+        stack = tuple(
+            record.hybrid_stack_trace()
+            if metadata.has_native_traces
+            else record.stack_trace()
+        )
+        thread_name = record.thread_name
+        if not merge_threads:
+            # Threads of different processes are told apart by their names.
+            thread_name = f"{thread_name} (pid {metadata.pid})"
+        key = (stack, record.tid, thread_name, record.allocator)
+        total = totals.setdefault(key, [0, 0])
+        total[0] += record.size
+        total[1] += record.n_allocations
+    return metadata, tuple(reader.get_memory_snapshots()), totals
+
+
+def map_captures(
+    function: Callable[[Path], T], result_paths: Sequence[Path]
+) -> List[T]:
+    """Call a function with each capture file, in a process of its own.
+
+    Reading a capture is bound by the CPU, so several captures are read in
+    parallel, up to one per core. The results are in the order of the files.
+    Exceptions are raised as a `MemrayCommandError` naming the file.
+    """
+    n_workers = min(len(result_paths), os.cpu_count() or 1)
+    # Worker processes are started from scratch, rather than forked from a
+    # process that may already have threads of its own.
+    context = multiprocessing.get_context("spawn")
+    with concurrent.futures.ProcessPoolExecutor(n_workers, context) as executor:
+        futures = [executor.submit(function, path) for path in result_paths]
+        results = []
+        for path, future in zip(result_paths, futures):
+            try:
+                results.append(future.result())
+            except (OSError, NotImplementedError) as e:
+                raise MemrayCommandError(
+                    f"Failed to parse allocation records in {path}\nReason: {e}",
+                    exit_code=1,
+                )
+        return results
+
+
+def merge_captures(
+    result_paths: Sequence[Path],
+    show_memory_leaks: bool,
+    temporary_allocation_threshold: int,
+    merge_threads: bool,
+    cache_analysis: bool = False,
+    native_symbols_only: bool = False,
+) -> Tuple[List[MergedAllocationRecord], List[MemorySnapshot], Metadata]:
+    """Read the snapshots of several captures and add them up.
+
+    Every capture is read in a worker process, which sums up the allocations
+    of its snapshot by stack, and the sums of all the captures are merged.
+    """
+    summaries = map_captures(
+        functools.partial(
+            _summarize_capture,
+            show_memory_leaks=show_memory_leaks,
+            temporary_allocation_threshold=temporary_allocation_threshold,
+            merge_threads=merge_threads,
+            cache_analysis=cache_analysis,
+            native_symbols_only=native_symbols_only,
+        ),
+        result_paths,
+    )
+    totals: Dict[Tuple[Any, ...], List[int]] = {}
+    for _, _, capture_totals in summaries:
+        for key, (size, n_allocations) in capture_totals.items():
+            total = totals.setdefault(key, [0, 0])
+            total[0] += size
+            total[1] += n_allocations
+    records = [
+        MergedAllocationRecord(*key, size, n_allocations)
+        for key, (size, n_allocations) in totals.items()
+    ]
+    memory_records = merge_memory_records([summary[1] for summary in summaries])
+    metadata = merge_metadata([summary[0] for summary in summaries])
+    return records, memory_records, metadata
+
+
 class HighWatermarkCommand:
     def __init__(
         self,
@@ -70,6 +347,7 @@ class HighWatermarkCommand:
         self.reporter_factory = reporter_factory
         self.reporter_name = reporter_name
         self.suffix = suffix
+        self.binary_output = False
         self.output_file: Optional[Path] = None
 
     def determine_output_filename(self, results_file: pathlib.Path) -> pathlib.Path:
@@ -106,46 +384,74 @@ class HighWatermarkCommand:
         show_memory_leaks: bool,
         temporary_allocation_threshold: int,
         merge_threads: Optional[bool] = None,
+        cache_analysis: bool = False,
+        native_symbols_only: bool = False,
+        merge_processes: bool = False,
+        other_result_paths: Sequence[Path] = (),
         **kwargs: Any,
     ) -> None:
-        try:
-            reader = FileReader(os.fspath(result_path), report_progress=True)
-            if reader.metadata.has_native_traces:
+        result_paths = [
+            *(find_process_captures(result_path) if merge_processes else [result_path]),
+            *other_result_paths,
+        ]
+        memory_records: Sequence[MemorySnapshot]
+        if len(result_paths) > 1:
+            records, memory_records, metadata = merge_captures(
+                result_paths,
+                show_memory_leaks,
+                temporary_allocation_threshold,
+                merge_threads if merge_threads is not None else True,
+                cache_analysis,
+                native_symbols_only,
+            )
+            if metadata.has_native_traces:
                 warn_if_not_enough_symbols()
-
-            if show_memory_leaks:
-                snapshot = reader.get_leaked_allocation_records(
-                    merge_threads=merge_threads if merge_threads is not None else True
-                )
-            elif temporary_allocation_threshold >= 0:
-                snapshot = reader.get_temporary_allocation_records(
-                    threshold=temporary_allocation_threshold,
-                    merge_threads=merge_threads if merge_threads is not None else True,
-                )
-            else:
-                snapshot = reader.get_high_watermark_allocation_records(
-                    merge_threads=merge_threads if merge_threads is not None else True
-                )
-            memory_records = tuple(reader.get_memory_snapshots())
             reporter = self.reporter_factory(
-                snapshot,
+                records,
                 memory_records=memory_records,
-                native_traces=reader.metadata.has_native_traces,
+                native_traces=metadata.has_native_traces,
                 **kwargs,
             )
-        except OSError as e:
-            raise MemrayCommandError(
-                f"Failed to parse allocation records in {result_path}\nReason: {e}",
-                exit_code=1,
-            )
+        else:
+            try:
+                reader = FileReader(
+                    os.fspath(result_path),
+                    report_progress=True,
+                    cache_analysis=cache_analysis,
+                    native_symbols_only=native_symbols_only,
+                )
+                if reader.metadata.has_native_traces:
+                    warn_if_not_enough_symbols()
+
+                snapshot = _snapshot_records(
+                    reader,
+                    show_memory_leaks,
+                    temporary_allocation_threshold,
+                    merge_threads if merge_threads is not None else True,
+                )
+                memory_records = tuple(reader.get_memory_snapshots())
+                metadata = reader.metadata
+                reporter = self.reporter_factory(
+                    snapshot,
+                    memory_records=memory_records,
+                    native_traces=metadata.has_native_traces,
+                    **kwargs,
+                )
+            except (OSError, NotImplementedError) as e:
+                raise MemrayCommandError(
+                    f"Failed to parse allocation records in {result_path}\n"
+                    f"Reason: {e}",
+                    exit_code=1,
+                )
 
-        with open(os.fspath(output_file.expanduser()), "w") as f:
+        mode = "wb" if self.binary_output else "w"
+        with open(os.fspath(output_file.expanduser()), mode) as f:
             kwargs = {}
             if merge_threads is not None:
                 kwargs["merge_threads"] = merge_threads
             reporter.render(
                 outfile=f,
-                metadata=reader.metadata,
+                metadata=metadata,
                 show_memory_leaks=show_memory_leaks,
                 **kwargs,
             )
@@ -161,6 +467,14 @@ class HighWatermarkCommand:
         self.output_file = output_file
         if hasattr(args, "split_threads"):
             kwargs["merge_threads"] = not args.split_threads
+        if hasattr(args, "cache_analysis"):
+            kwargs["cache_analysis"] = args.cache_analysis
+        if hasattr(args, "native_symbols_only"):
+            kwargs["native_symbols_only"] = args.native_symbols_only
+        if hasattr(args, "merge_processes"):
+            kwargs["merge_processes"] = args.merge_processes
+        if hasattr(args, "other_results"):
+            kwargs["other_result_paths"] = validate_results(args.other_results)
 
         self.write_report(
             result_path,
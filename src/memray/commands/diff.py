@@ -0,0 +1,63 @@
+import argparse
+import os
+from pathlib import Path
+from typing import List
+
+from memray import AllocationRecord
+from memray import FileReader
+from memray._errors import MemrayCommandError
+from memray.reporters.diff import DiffReporter
+
+
+class DiffCommand:
+    """Compare the memory usage of two capture files location by location"""
+
+    def prepare_parser(self, parser: argparse.ArgumentParser) -> None:
+        parser.add_argument("before", help="Results of the baseline tracker run")
+        parser.add_argument("after", help="Results of the tracker run to compare")
+        parser.add_argument(
+            "--leaks",
+            help=(
+                "Compare the memory that was leaked at the end of each run instead"
+                " of the memory in use when each run reached its peak"
+            ),
+            action="store_true",
+            default=False,
+        )
+        parser.add_argument(
+            "-r",
+            "--max-rows",
+            help="Maximum number of rows to display",
+            type=int,
+            default=None,
+        )
+        parser.add_argument(
+            "--include-unchanged",
+            help="Also show the stacks whose memory usage didn't change",
+            action="store_true",
+            default=False,
+        )
+
+    def _read_snapshot(self, results: str, leaks: bool) -> List[AllocationRecord]:
+        result_path = Path(results)
+        if not result_path.exists() or not result_path.is_file():
+            raise MemrayCommandError(f"No such file: {results}", exit_code=1)
+
+        reader = FileReader(os.fspath(result_path), report_progress=True)
+        try:
+            if leaks:
+                return list(reader.get_leaked_allocation_records(merge_threads=True))
+            return list(reader.get_high_watermark_allocation_records(merge_threads=True))
+        except OSError as e:
+            raise MemrayCommandError(
+                f"Failed to parse allocation records in {result_path}\nReason: {e}",
+                exit_code=1,
+            )
+
+    def run(self, args: argparse.Namespace, parser: argparse.ArgumentParser) -> None:
+        before = self._read_snapshot(args.before, args.leaks)
+        after = self._read_snapshot(args.after, args.leaks)
+        reporter = DiffReporter.from_snapshots(before, after)
+        reporter.render(
+            max_rows=args.max_rows, include_unchanged=args.include_unchanged
+        )
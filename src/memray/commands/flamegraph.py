@@ -5,6 +5,10 @@ from typing import cast
 from ..reporters.flamegraph import FlameGraphReporter
 from .common import HighWatermarkCommand
 from .common import ReporterFactory
+from .common import add_cache_argument
+from .common import add_merge_processes_argument
+from .common import add_native_symbols_only_argument
+from .common import add_results_arguments
 
 
 class FlamegraphCommand(HighWatermarkCommand):
@@ -69,4 +73,7 @@ class FlamegraphCommand(HighWatermarkCommand):
             action="store_true",
             default=False,
         )
-        parser.add_argument("results", help="Results of the tracker run")
+        add_cache_argument(parser)
+        add_native_symbols_only_argument(parser)
+        add_merge_processes_argument(parser)
+        add_results_arguments(parser)
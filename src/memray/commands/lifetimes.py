@@ -0,0 +1,50 @@
+import argparse
+import os
+from pathlib import Path
+
+from memray import FileReader
+from memray._errors import MemrayCommandError
+from memray.reporters.lifetimes import LifetimesReporter
+
+
+class LifetimesCommand:
+    """Show how long the allocations made at each location live"""
+
+    def prepare_parser(self, parser: argparse.ArgumentParser) -> None:
+        parser.add_argument("results", help="Results of the tracker run")
+        parser.add_argument(
+            "--threshold",
+            help=(
+                "Count allocations freed before this many other allocations were"
+                " made as short-lived, rounded up to a power of two"
+            ),
+            type=int,
+            default=16,
+        )
+        parser.add_argument(
+            "-r",
+            "--max-rows",
+            help="Maximum number of rows to display",
+            type=int,
+            default=None,
+        )
+
+    def run(self, args: argparse.Namespace, parser: argparse.ArgumentParser) -> None:
+        if args.threshold < 1:
+            parser.error("The threshold must be a positive number of allocations")
+        result_path = Path(args.results)
+        if not result_path.exists() or not result_path.is_file():
+            raise MemrayCommandError(f"No such file: {args.results}", exit_code=1)
+
+        reader = FileReader(os.fspath(result_path), report_progress=True)
+        try:
+            lifetimes = list(reader.get_allocation_lifetimes(merge_threads=True))
+        except NotImplementedError as e:
+            raise MemrayCommandError(str(e), exit_code=1)
+        except OSError as e:
+            raise MemrayCommandError(
+                f"Failed to parse allocation records in {result_path}\nReason: {e}",
+                exit_code=1,
+            )
+        reporter = LifetimesReporter.from_lifetimes(lifetimes, args.threshold)
+        reporter.render(max_rows=args.max_rows)
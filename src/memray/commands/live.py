@@ -2,12 +2,14 @@ import argparse
 import sys
 import termios
 from contextlib import suppress
+from typing import Union
 
 from rich.layout import Layout
 from rich.live import Live
 
 from memray import SocketReader
 from memray._errors import MemrayCommandError
+from memray._relay import RelayReader
 from memray.reporters.tui import TUI
 
 KEYS = {
@@ -81,15 +83,23 @@ class LiveCommand:
             default=None,
             type=int,
         )
+        parser.add_argument(
+            "--relay",
+            help="Connect to a `memray relay` instead of the tracked process",
+            action="store_true",
+            default=False,
+        )
 
     def run(self, args: argparse.Namespace, parser: argparse.ArgumentParser) -> None:
         with suppress(KeyboardInterrupt):
-            self.start_live_interface(args.port)
+            self.start_live_interface(args.port, relay=args.relay)
 
-    def start_live_interface(self, port: int) -> None:
+    def start_live_interface(self, port: int, *, relay: bool = False) -> None:
         if port >= 2**16 or port <= 0:
             raise MemrayCommandError(f"Invalid port: {port}", exit_code=1)
-        with SocketReader(port=port) as reader:
+        reader: Union[SocketReader, RelayReader]
+        reader = RelayReader(port) if relay else SocketReader(port=port)
+        with reader:
             tui = TUI(reader.pid, reader.command_line, reader.has_native_traces)
 
             def _get_renderable() -> Layout:
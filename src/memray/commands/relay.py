@@ -0,0 +1,34 @@
+import argparse
+from contextlib import suppress
+
+from memray._errors import MemrayCommandError
+from memray._relay import LiveRelay
+
+
+class RelayCommand:
+    """Share the live view of a process with several viewers"""
+
+    def prepare_parser(self, parser: argparse.ArgumentParser) -> None:
+        parser.add_argument(
+            "port",
+            help="Port of the process started with `memray run --live-remote`",
+            type=int,
+        )
+        parser.add_argument(
+            "--serve-port",
+            "-p",
+            help="Port that viewers connect to with `memray live --relay`",
+            required=True,
+            type=int,
+        )
+
+    def run(self, args: argparse.Namespace, parser: argparse.ArgumentParser) -> None:
+        for port in (args.port, args.serve_port):
+            if port >= 2**16 or port <= 0:
+                raise MemrayCommandError(f"Invalid port: {port}", exit_code=1)
+        print(
+            f"Run 'memray live --relay {args.serve_port}' in other shells to see"
+            " live results"
+        )
+        with suppress(KeyboardInterrupt):
+            LiveRelay(args.port, args.serve_port).serve()
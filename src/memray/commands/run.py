@@ -4,17 +4,21 @@ import contextlib
 import os
 import pathlib
 import runpy
+import signal
 import socket
 import subprocess
 import sys
 import textwrap
 from contextlib import closing
 from contextlib import suppress
+from typing import Any
+from typing import Dict
 from typing import List
 from typing import Optional
 
 from memray import Destination
 from memray import FileDestination
+from memray import FileFormat
 from memray import SocketDestination
 from memray import Tracker
 from memray._errors import MemrayCommandError
@@ -28,19 +32,91 @@ def _get_free_port() -> int:
         return int(sock.getsockname()[1])
 
 
+def _parse_signal(value: str) -> int:
+    if value.isdigit():
+        return int(value)
+    name = value.upper()
+    if not name.startswith("SIG"):
+        name = "SIG" + name
+    try:
+        return int(signal.Signals[name])
+    except KeyError:
+        raise argparse.ArgumentTypeError(f"unknown signal: {value}")
+
+
 def _run_tracker(
     destination: Destination,
     args: argparse.Namespace,
     post_run_message: Optional[str] = None,
     follow_fork: bool = False,
     trace_python_allocators: bool = False,
+    sampling_interval_bytes: int = 0,
+    min_allocation_size: int = 0,
+    aggregate: bool = False,
+    flight_recorder_size: int = 0,
+    flight_recorder_rss_threshold: int = 0,
+    flight_recorder_signal: int = 0,
+    frame_pointer_unwinding: bool = False,
+    trace_asyncio_tasks: bool = False,
+    memory_interval_ms: Optional[int] = None,
+    detailed_memory_counters: bool = False,
+    measure_overhead: bool = False,
+    rotation_size: int = 0,
+    rotation_interval_s: int = 0,
+    rotation_max_files: int = 0,
+    profile_interval_ms: int = 0,
+    regions_only: bool = False,
+    max_python_depth: int = 0,
+    max_native_depth: int = 0,
+    trace_pymalloc_arenas: bool = False,
+    overhead_budget: float = 0,
 ) -> None:
     try:
-        kwargs = {}
+        kwargs: Dict[str, Any] = {}
         if follow_fork:
             kwargs["follow_fork"] = True
         if trace_python_allocators:
             kwargs["trace_python_allocators"] = True
+        if sampling_interval_bytes:
+            kwargs["sampling_interval_bytes"] = sampling_interval_bytes
+        if min_allocation_size:
+            kwargs["min_allocation_size"] = min_allocation_size
+        if aggregate:
+            kwargs["file_format"] = FileFormat.AGGREGATED_ALLOCATIONS
+        if flight_recorder_size:
+            kwargs["flight_recorder_size"] = flight_recorder_size
+        if flight_recorder_rss_threshold:
+            kwargs["flight_recorder_rss_threshold"] = flight_recorder_rss_threshold
+        if flight_recorder_signal:
+            kwargs["flight_recorder_signal"] = flight_recorder_signal
+        if frame_pointer_unwinding:
+            kwargs["frame_pointer_unwinding"] = True
+        if trace_asyncio_tasks:
+            kwargs["trace_asyncio_tasks"] = True
+        if memory_interval_ms is not None:
+            kwargs["memory_interval_ms"] = memory_interval_ms
+        if detailed_memory_counters:
+            kwargs["detailed_memory_counters"] = True
+        if measure_overhead:
+            kwargs["measure_overhead"] = True
+        if rotation_size:
+            kwargs["rotation_size"] = rotation_size
+        if rotation_interval_s:
+            kwargs["rotation_interval_s"] = rotation_interval_s
+        if rotation_max_files:
+            kwargs["rotation_max_files"] = rotation_max_files
+        if profile_interval_ms:
+            kwargs["profile_interval_ms"] = profile_interval_ms
+        if regions_only:
+            kwargs["regions_only"] = True
+        if max_python_depth:
+            kwargs["max_python_depth"] = max_python_depth
+        if max_native_depth:
+            kwargs["max_native_depth"] = max_native_depth
+        if trace_pymalloc_arenas:
+            kwargs["trace_pymalloc_arenas"] = True
+        if overhead_budget:
+            kwargs["overhead_budget"] = overhead_budget
         tracker = Tracker(destination=destination, native_traces=args.native, **kwargs)
     except OSError as error:
         raise MemrayCommandError(str(error), exit_code=1)
@@ -131,8 +207,9 @@ def _run_with_socket_output(args: argparse.Namespace) -> None:
     if not args.quiet:
         memray_cli = f"memray{sys.version_info.major}.{sys.version_info.minor}"
         print(f"Run '{memray_cli} live {port}' in another shell to see live results")
+    destination = SocketDestination(server_port=port, compress=args.live_compress)
     with suppress(KeyboardInterrupt):
-        _run_tracker(destination=SocketDestination(server_port=port), args=args)
+        _run_tracker(destination=destination, args=args)
 
 
 def _run_with_file_output(args: argparse.Namespace) -> None:
@@ -170,6 +247,26 @@ def _run_with_file_output(args: argparse.Namespace) -> None:
             post_run_message=example_report_generation_message,
             follow_fork=args.follow_fork,
             trace_python_allocators=args.trace_python_allocators,
+            sampling_interval_bytes=args.sampling_interval_bytes,
+            min_allocation_size=args.min_allocation_size,
+            aggregate=args.aggregate,
+            flight_recorder_size=args.flight_recorder_size,
+            flight_recorder_rss_threshold=args.flight_recorder_rss_threshold,
+            flight_recorder_signal=args.flight_recorder_signal,
+            frame_pointer_unwinding=args.frame_pointer_unwinding,
+            trace_asyncio_tasks=args.trace_asyncio_tasks,
+            memory_interval_ms=args.memory_interval_ms,
+            detailed_memory_counters=args.detailed_memory_counters,
+            measure_overhead=args.measure_overhead,
+            rotation_size=args.rotation_size,
+            rotation_interval_s=args.rotation_interval,
+            rotation_max_files=args.rotation_max_files,
+            profile_interval_ms=args.profile_interval_ms,
+            regions_only=args.regions_only,
+            max_python_depth=args.max_python_depth,
+            max_native_depth=args.max_native_depth,
+            trace_pymalloc_arenas=args.trace_pymalloc_arenas,
+            overhead_budget=args.overhead_budget,
         )
     except OSError as error:
         raise MemrayCommandError(str(error), exit_code=1)
@@ -207,6 +304,12 @@ class RunCommand:
             default=None,
             type=int,
         )
+        parser.add_argument(
+            "--live-compress",
+            help="Compress the records sent to the live client using lz4",
+            action="store_true",
+            default=False,
+        )
 
         parser.add_argument(
             "--native",
@@ -215,6 +318,70 @@ class RunCommand:
             dest="native",
             default=False,
         )
+        parser.add_argument(
+            "--frame-pointer-unwinding",
+            help=(
+                "Unwind native stacks by following frame pointers, which is much"
+                " faster but stops at the first function compiled without them"
+            ),
+            action="store_true",
+            default=False,
+        )
+        parser.add_argument(
+            "--max-python-depth",
+            help=(
+                "Only keep the innermost this many Python frames of each stack,"
+                " below a single <truncated> frame"
+            ),
+            type=int,
+            default=0,
+        )
+        parser.add_argument(
+            "--max-native-depth",
+            help=(
+                "Only unwind the innermost this many native frames of each stack,"
+                " below a single <truncated> frame"
+            ),
+            type=int,
+            default=0,
+        )
+        parser.add_argument(
+            "--trace-asyncio-tasks",
+            help=(
+                "Give each asyncio task a stack of its own, which continues with"
+                " the stack that created the task"
+            ),
+            action="store_true",
+            default=False,
+        )
+        parser.add_argument(
+            "--memory-interval-ms",
+            help=(
+                "How often to sample the memory usage of the process, in"
+                " milliseconds (default: 10)"
+            ),
+            type=int,
+            default=None,
+        )
+        parser.add_argument(
+            "--detailed-memory-counters",
+            help=(
+                "Sample the proportional and unique set sizes, swap usage,"
+                " cgroup memory usage and page faults along with the resident"
+                " set size"
+            ),
+            action="store_true",
+            default=False,
+        )
+        parser.add_argument(
+            "--measure-overhead",
+            help=(
+                "Measure the time spent tracking allocations, deallocations and"
+                " native stacks, and record it in the capture file"
+            ),
+            action="store_true",
+            default=False,
+        )
         parser.add_argument(
             "--follow-fork",
             action="store_true",
@@ -227,6 +394,109 @@ class RunCommand:
             help="Record allocations made by the Pymalloc allocator",
             default=False,
         )
+        parser.add_argument(
+            "--trace-pymalloc-arenas",
+            action="store_true",
+            help=(
+                "Record the arenas the Pymalloc allocator gets its memory from,"
+                " instead of every allocation it makes"
+            ),
+            default=False,
+        )
+        parser.add_argument(
+            "--sampling-interval-bytes",
+            help="Record a sample of the allocations, one per this many bytes allocated",
+            type=int,
+            default=0,
+        )
+        parser.add_argument(
+            "--overhead-budget",
+            help=(
+                "Sample the allocations as sparsely as needed to keep tracking"
+                " within this percentage of one CPU's time"
+            ),
+            type=float,
+            default=0,
+        )
+        parser.add_argument(
+            "--min-allocation-size",
+            help=(
+                "Only count, rather than record, the allocations requesting fewer"
+                " than this many bytes"
+            ),
+            type=int,
+            default=0,
+        )
+        parser.add_argument(
+            "--regions-only",
+            help=(
+                "Only record the allocations made inside of the regions the"
+                " script marks with memray.TrackedRegion"
+            ),
+            action="store_true",
+            default=False,
+        )
+        parser.add_argument(
+            "--aggregate",
+            action="store_true",
+            help=(
+                "Only write the memory in use by each stack at the high water mark"
+                " and at exit, which only supports the high water mark and leaks"
+                " reports but produces much smaller files"
+            ),
+            default=False,
+        )
+        parser.add_argument(
+            "--profile-interval-ms",
+            help=(
+                "With --aggregate, also write what each stack allocated and freed"
+                " every this many milliseconds"
+            ),
+            type=int,
+            default=0,
+        )
+        parser.add_argument(
+            "--flight-recorder-size",
+            help=(
+                "Keep about this many bytes of the most recent records in memory,"
+                " and only write them to the output file when a dump is triggered"
+            ),
+            type=int,
+            default=0,
+        )
+        parser.add_argument(
+            "--flight-recorder-rss-threshold",
+            help="Dump the flight recorder when the RSS reaches this many bytes",
+            type=int,
+            default=0,
+        )
+        parser.add_argument(
+            "--flight-recorder-signal",
+            help="Dump the flight recorder when this signal is received (e.g. USR2)",
+            type=_parse_signal,
+            default=0,
+        )
+        parser.add_argument(
+            "--rotation-size",
+            help=(
+                "Start a new output file whenever the current one holds this many"
+                " bytes of records"
+            ),
+            type=int,
+            default=0,
+        )
+        parser.add_argument(
+            "--rotation-interval",
+            help="Start a new output file every this many seconds",
+            type=int,
+            default=0,
+        )
+        parser.add_argument(
+            "--rotation-max-files",
+            help="Remove the oldest output files so that only this many are kept",
+            type=int,
+            default=0,
+        )
         parser.add_argument(
             "-q",
             "--quiet",
@@ -243,7 +513,7 @@ class RunCommand:
         compression = parser.add_mutually_exclusive_group()
         compression.add_argument(
             "--compress-on-exit",
-            help="Compress the resulting file using lz4 after tracking completes",
+            help="Compress the resulting file using lz4 while tracking",
             default=True,
             action="store_true",
         )
@@ -296,8 +566,96 @@ class RunCommand:
 
         if args.live_port is not None and not args.live_remote_mode:
             parser.error("The --live-port argument requires --live-remote")
+        if args.live_compress and not args.live_remote_mode:
+            parser.error("The --live-compress argument requires --live-remote")
+        if args.frame_pointer_unwinding and not args.native:
+            parser.error("--frame-pointer-unwinding requires --native")
+        if args.frame_pointer_unwinding and (args.live_mode or args.live_remote_mode):
+            parser.error("--frame-pointer-unwinding cannot be used with the live TUI")
+        if args.max_python_depth < 0:
+            parser.error("--max-python-depth must be a non-negative integer")
+        if args.max_python_depth and (args.live_mode or args.live_remote_mode):
+            parser.error("--max-python-depth cannot be used with the live TUI")
+        if args.max_native_depth < 0:
+            parser.error("--max-native-depth must be a non-negative integer")
+        if args.max_native_depth and not args.native:
+            parser.error("--max-native-depth requires --native")
+        if args.max_native_depth and (args.live_mode or args.live_remote_mode):
+            parser.error("--max-native-depth cannot be used with the live TUI")
+        if args.trace_pymalloc_arenas and args.trace_python_allocators:
+            parser.error(
+                "--trace-pymalloc-arenas cannot be used with --trace-python-allocators"
+            )
+        if args.trace_pymalloc_arenas and (args.live_mode or args.live_remote_mode):
+            parser.error("--trace-pymalloc-arenas cannot be used with the live TUI")
+        if args.trace_asyncio_tasks and (args.live_mode or args.live_remote_mode):
+            parser.error("--trace-asyncio-tasks cannot be used with the live TUI")
+        if args.memory_interval_ms is not None and args.memory_interval_ms < 1:
+            parser.error("--memory-interval-ms must be a positive integer")
+        if args.memory_interval_ms is not None and (
+            args.live_mode or args.live_remote_mode
+        ):
+            parser.error("--memory-interval-ms cannot be used with the live TUI")
+        if args.detailed_memory_counters and (args.live_mode or args.live_remote_mode):
+            parser.error("--detailed-memory-counters cannot be used with the live TUI")
+        if args.measure_overhead and (args.live_mode or args.live_remote_mode):
+            parser.error("--measure-overhead cannot be used with the live TUI")
         if args.follow_fork is True and (args.live_mode or args.live_remote_mode):
             parser.error("--follow-fork cannot be used with the live TUI")
+        if args.sampling_interval_bytes < 0:
+            parser.error("--sampling-interval-bytes must be a non-negative integer")
+        if args.sampling_interval_bytes and (args.live_mode or args.live_remote_mode):
+            parser.error("--sampling-interval-bytes cannot be used with the live TUI")
+        if not 0 <= args.overhead_budget < 100:
+            parser.error("--overhead-budget must be a percentage below 100")
+        if args.overhead_budget and (args.live_mode or args.live_remote_mode):
+            parser.error("--overhead-budget cannot be used with the live TUI")
+        if args.min_allocation_size < 0:
+            parser.error("--min-allocation-size must be a non-negative integer")
+        if args.min_allocation_size and (args.live_mode or args.live_remote_mode):
+            parser.error("--min-allocation-size cannot be used with the live TUI")
+        if args.regions_only and (args.live_mode or args.live_remote_mode):
+            parser.error("--regions-only cannot be used with the live TUI")
+        if args.aggregate and (args.live_mode or args.live_remote_mode):
+            parser.error("--aggregate cannot be used with the live TUI")
+        if args.profile_interval_ms < 0:
+            parser.error("--profile-interval-ms must be a non-negative integer")
+        if args.profile_interval_ms and not args.aggregate:
+            parser.error("--profile-interval-ms requires --aggregate")
+        if args.flight_recorder_size < 0:
+            parser.error("--flight-recorder-size must be a non-negative integer")
+        if args.flight_recorder_rss_threshold < 0:
+            parser.error(
+                "--flight-recorder-rss-threshold must be a non-negative integer"
+            )
+        if (
+            args.flight_recorder_rss_threshold or args.flight_recorder_signal
+        ) and not args.flight_recorder_size:
+            parser.error(
+                "--flight-recorder-rss-threshold and --flight-recorder-signal"
+                " require --flight-recorder-size"
+            )
+        if args.flight_recorder_size and (args.live_mode or args.live_remote_mode):
+            parser.error("--flight-recorder-size cannot be used with the live TUI")
+        if args.flight_recorder_size and args.aggregate:
+            parser.error("--flight-recorder-size cannot be used with --aggregate")
+        for option in ("rotation_size", "rotation_interval", "rotation_max_files"):
+            if getattr(args, option) < 0:
+                flag = "--" + option.replace("_", "-")
+                parser.error(f"{flag} must be a non-negative integer")
+        rotating = args.rotation_size or args.rotation_interval
+        if args.rotation_max_files and not rotating:
+            parser.error(
+                "--rotation-max-files requires --rotation-size or --rotation-interval"
+            )
+        if rotating and (args.live_mode or args.live_remote_mode):
+            parser.error("rotating the output file cannot be used with the live TUI")
+        if rotating and args.aggregate:
+            parser.error("rotating the output file cannot be used with --aggregate")
+        if rotating and args.flight_recorder_size:
+            parser.error(
+                "rotating the output file cannot be used with --flight-recorder-size"
+            )
         with contextlib.suppress(OSError):
             if args.run_as_cmd and pathlib.Path(args.script).exists():
                 parser.error("remove the option -c to run a file")
@@ -1,17 +1,86 @@
 import argparse
+import collections
+import functools
 import os
 from pathlib import Path
+from typing import Counter
+from typing import Sequence
+from typing import Tuple
 
 from memray._errors import MemrayCommandError
 from memray._memray import compute_statistics
+from memray._stats import Stats
+from memray.commands.common import add_cache_argument
+from memray.commands.common import add_merge_processes_argument
+from memray.commands.common import add_results_arguments
+from memray.commands.common import find_process_captures
+from memray.commands.common import map_captures
+from memray.commands.common import merge_metadata
+from memray.commands.common import validate_results
 from memray.reporters.stats import StatsReporter
 
+# Enough to keep every location of a capture, so that the top locations of
+# several captures can be merged. It must fit in a C int.
+ALL_LOCATIONS = 2**31 - 1
+
+
+def _compute_statistics(
+    result_path: Path, num_largest: int, cache_analysis: bool
+) -> Stats:
+    return compute_statistics(
+        os.fspath(result_path),
+        num_largest=num_largest,
+        cache_analysis=cache_analysis,
+    )
+
+
+def _merge_top_locations(
+    top_locations: Sequence[Sequence[Tuple[Tuple[str, str, int], int]]],
+    num_largest: int,
+) -> Sequence[Tuple[Tuple[str, str, int], int]]:
+    totals: Counter[Tuple[str, str, int]] = collections.Counter()
+    for locations in top_locations:
+        for location, value in locations:
+            totals[location] += value
+    return totals.most_common(num_largest)
+
+
+def merge_statistics(stats: Sequence[Stats], num_largest: int) -> Stats:
+    """Add up the statistics of several captures.
+
+    Locations are matched by their function, file and line, and the top
+    locations are only exact if every location of each capture is given.
+    """
+    count_by_size: Counter[int] = collections.Counter()
+    count_by_allocator: Counter[str] = collections.Counter()
+    for stat in stats:
+        count_by_size.update(stat.allocation_count_by_size)
+        count_by_allocator.update(stat.allocation_count_by_allocator)
+    return Stats(
+        metadata=merge_metadata([stat.metadata for stat in stats]),
+        total_num_allocations=sum(stat.total_num_allocations for stat in stats),
+        total_memory_allocated=sum(stat.total_memory_allocated for stat in stats),
+        peak_memory_allocated=sum(stat.peak_memory_allocated for stat in stats),
+        allocation_count_by_size=dict(sorted(count_by_size.items())),
+        allocation_count_by_allocator=dict(count_by_allocator),
+        top_locations_by_size=list(
+            _merge_top_locations(
+                [stat.top_locations_by_size for stat in stats], num_largest
+            )
+        ),
+        top_locations_by_count=list(
+            _merge_top_locations(
+                [stat.top_locations_by_count for stat in stats], num_largest
+            )
+        ),
+    )
+
 
 class StatsCommand:
     """Generate high level stats of the memory usage in the terminal"""
 
     def prepare_parser(self, parser: argparse.ArgumentParser) -> None:
-        parser.add_argument("results", help="Results of the tracker run")
+        add_results_arguments(parser)
 
         def valid_positive_int(value: str) -> int:
             try:
@@ -32,22 +101,46 @@ class StatsCommand:
             type=valid_positive_int,
             default=5,
         )
+        add_cache_argument(parser)
+        add_merge_processes_argument(parser)
 
     def run(self, args: argparse.Namespace, parser: argparse.ArgumentParser) -> None:
         result_path = Path(args.results)
         if not result_path.exists() or not result_path.is_file():
             raise MemrayCommandError(f"No such file: {args.results}", exit_code=1)
-        try:
-            stats = compute_statistics(
-                os.fspath(args.results),
-                report_progress=True,
-                num_largest=args.num_largest,
-            )
-        except OSError as e:
-            raise MemrayCommandError(
-                f"Failed to compute statistics for {result_path}\nReason: {e}",
-                exit_code=1,
+        result_paths = [
+            *(
+                find_process_captures(result_path)
+                if args.merge_processes
+                else [result_path]
+            ),
+            *validate_results(args.other_results),
+        ]
+        if len(result_paths) > 1:
+            stats = merge_statistics(
+                map_captures(
+                    functools.partial(
+                        _compute_statistics,
+                        num_largest=ALL_LOCATIONS,
+                        cache_analysis=args.cache_analysis,
+                    ),
+                    result_paths,
+                ),
+                args.num_largest,
             )
+        else:
+            try:
+                stats = compute_statistics(
+                    os.fspath(args.results),
+                    report_progress=True,
+                    num_largest=args.num_largest,
+                    cache_analysis=args.cache_analysis,
+                )
+            except (OSError, NotImplementedError) as e:
+                raise MemrayCommandError(
+                    f"Failed to compute statistics for {result_path}\nReason: {e}",
+                    exit_code=1,
+                )
 
         reporter = StatsReporter(stats, args.num_largest)
         reporter.render()
@@ -69,16 +69,12 @@ class SummaryCommand:
 
         try:
             if args.temporary_allocation_threshold >= 0:
-                snapshot = iter(
-                    reader.get_temporary_allocation_records(
-                        threshold=args.temporary_allocation_threshold,
-                        merge_threads=False,
-                    )
+                snapshot = reader.get_snapshot(
+                    merge_threads=False,
+                    temporary_allocation_threshold=args.temporary_allocation_threshold,
                 )
             else:
-                snapshot = iter(
-                    reader.get_high_watermark_allocation_records(merge_threads=True)
-                )
+                snapshot = reader.get_snapshot(merge_threads=True)
         except OSError as e:
             raise MemrayCommandError(
                 f"Failed to parse allocation records in {result_path}\nReason: {e}",
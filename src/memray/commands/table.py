@@ -5,6 +5,10 @@ from typing import cast
 from ..reporters.table import TableReporter
 from .common import HighWatermarkCommand
 from .common import ReporterFactory
+from .common import add_cache_argument
+from .common import add_merge_processes_argument
+from .common import add_native_symbols_only_argument
+from .common import add_results_arguments
 
 
 class TableCommand(HighWatermarkCommand):
@@ -63,4 +67,7 @@ class TableCommand(HighWatermarkCommand):
             const=1,
         )
 
-        parser.add_argument("results", help="Results of the tracker run")
+        add_cache_argument(parser)
+        add_native_symbols_only_argument(parser)
+        add_merge_processes_argument(parser)
+        add_results_arguments(parser)
@@ -13,6 +13,10 @@ from memray._errors import MemrayCommandError
 from ..reporters.transform import TransformReporter
 from .common import HighWatermarkCommand
 from .common import ReporterFactory
+from .common import add_cache_argument
+from .common import add_merge_processes_argument
+from .common import add_native_symbols_only_argument
+from .common import add_results_arguments
 
 
 class TransformCommand(HighWatermarkCommand):
@@ -75,7 +79,10 @@ class TransformCommand(HighWatermarkCommand):
             dest="temporary_allocation_threshold",
             const=1,
         )
-        parser.add_argument("results", help="Results of the tracker run")
+        add_cache_argument(parser)
+        add_native_symbols_only_argument(parser)
+        add_merge_processes_argument(parser)
+        add_results_arguments(parser)
 
     def run(
         self, args: argparse.Namespace, parser: argparse.ArgumentParser, **kwargs: Any
@@ -89,7 +96,13 @@ class TransformCommand(HighWatermarkCommand):
 
         self.suffix = suffix
         self.reporter_name = the_format
-        super().run(args, parser, format=the_format)
+        self.binary_output = the_format in TransformReporter.BINARY_FORMATS
+        super().run(
+            args,
+            parser,
+            format=the_format,
+            temporary_allocations=args.temporary_allocation_threshold >= 0,
+        )
 
         post_run_callable = getattr(self, f"post_run_{the_format}", None)
         if post_run_callable:
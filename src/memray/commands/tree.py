@@ -8,6 +8,8 @@ from rich import print as rprint
 from memray import FileReader
 from memray._errors import MemrayCommandError
 from memray._memray import size_fmt
+from memray.commands.common import add_cache_argument
+from memray.commands.common import add_native_symbols_only_argument
 from memray.commands.common import warn_if_not_enough_symbols
 from memray.reporters.tree import TreeReporter
 
@@ -49,28 +51,35 @@ class TreeCommand:
             dest="temporary_allocation_threshold",
             const=1,
         )
+        add_cache_argument(parser)
+        add_native_symbols_only_argument(parser)
 
     def run(self, args: argparse.Namespace, parser: argparse.ArgumentParser) -> None:
         result_path = Path(args.results)
         if not result_path.exists() or not result_path.is_file():
             raise MemrayCommandError(f"No such file: {args.results}", exit_code=1)
 
-        reader = FileReader(os.fspath(args.results), report_progress=True)
+        reader = FileReader(
+            os.fspath(args.results),
+            report_progress=True,
+            cache_analysis=args.cache_analysis,
+            native_symbols_only=args.native_symbols_only,
+        )
         if reader.metadata.has_native_traces:
             warn_if_not_enough_symbols()
 
+        # Only the biggest allocations are shown, so only those are read out
+        # of the snapshot instead of making a record for every location.
+        largest = max(args.biggest_allocs, 1)
         try:
             if args.temporary_allocation_threshold >= 0:
-                snapshot = iter(
-                    reader.get_temporary_allocation_records(
-                        threshold=args.temporary_allocation_threshold,
-                        merge_threads=False,
-                    )
+                snapshot = reader.get_snapshot(
+                    merge_threads=False,
+                    temporary_allocation_threshold=args.temporary_allocation_threshold,
+                    largest=largest,
                 )
             else:
-                snapshot = iter(
-                    reader.get_high_watermark_allocation_records(merge_threads=False)
-                )
+                snapshot = reader.get_snapshot(merge_threads=False, largest=largest)
             reporter = TreeReporter.from_snapshot(
                 snapshot,
                 biggest_allocs=args.biggest_allocs,
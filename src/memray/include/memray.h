@@ -0,0 +1,102 @@
+/*
+ * The C API through which extension modules report the allocations made by
+ * allocators of their own, such as memory pools that carve many small
+ * allocations out of large regions, to memray.
+ *
+ * Call memray_import_allocator_api() once, with the GIL held, for instance
+ * when the extension module is initialized. If it fails, memray isn't
+ * installed and the Python exception it raised should be cleared. All the
+ * other functions do nothing until it succeeds, so they can always be called.
+ * They can be called from any thread, with or without the GIL held, and cost
+ * little more than a function call while no tracker is active.
+ *
+ * The directory holding this header is returned by memray.get_include().
+ */
+
+#pragma once
+
+#include <Python.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MEMRAY_ALLOCATOR_API_CAPSULE "memray._memray._allocator_api"
+
+/* Later versions only ever add fields to the end of MemrayAllocatorApi. */
+#define MEMRAY_ALLOCATOR_API_VERSION 1
+
+typedef struct
+{
+    unsigned int version;
+    void (*track_allocation)(void* ptr, size_t size);
+    void (*track_deallocation)(void* ptr);
+    int (*suspend_tracking)(void);
+    void (*resume_tracking)(int previous);
+} MemrayAllocatorApi;
+
+static const MemrayAllocatorApi* memray_allocator_api = NULL;
+
+/* Look up the API in memray._memray. Returns 0 on success, and -1 with a
+ * Python exception set on failure. */
+static inline int
+memray_import_allocator_api(void)
+{
+    const MemrayAllocatorApi* api =
+            (const MemrayAllocatorApi*)PyCapsule_Import(MEMRAY_ALLOCATOR_API_CAPSULE, 0);
+    if (api == NULL) {
+        return -1;
+    }
+    if (api->version < MEMRAY_ALLOCATOR_API_VERSION) {
+        PyErr_Format(
+                PyExc_ImportError,
+                "memray provides version %u of its allocator API, but version %u is needed",
+                api->version,
+                (unsigned int)MEMRAY_ALLOCATOR_API_VERSION);
+        return -1;
+    }
+    memray_allocator_api = api;
+    return 0;
+}
+
+/* Report that *size* bytes were handed out at *ptr*. */
+static inline void
+memray_track_allocation(void* ptr, size_t size)
+{
+    if (memray_allocator_api) {
+        memray_allocator_api->track_allocation(ptr, size);
+    }
+}
+
+/* Report that the allocation at *ptr* was given back. */
+static inline void
+memray_track_deallocation(void* ptr)
+{
+    if (memray_allocator_api) {
+        memray_allocator_api->track_deallocation(ptr);
+    }
+}
+
+/* Stop recording the allocations made by the current thread, and return
+ * whether they were already not being recorded. This is meant to surround
+ * the allocations of the regions that an allocator hands its memory out
+ * from, so that the same memory isn't counted twice. */
+static inline int
+memray_suspend_tracking(void)
+{
+    return memray_allocator_api ? memray_allocator_api->suspend_tracking() : 0;
+}
+
+/* Undo memray_suspend_tracking(), given what it returned. */
+static inline void
+memray_resume_tracking(int previous)
+{
+    if (memray_allocator_api) {
+        memray_allocator_api->resume_tracking(previous);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,123 @@
+from collections import defaultdict
+from dataclasses import dataclass
+from typing import IO
+from typing import Dict
+from typing import Iterable
+from typing import List
+from typing import Optional
+from typing import Tuple
+
+import rich
+import rich.table
+
+from memray import AllocationRecord
+from memray._memray import diff_snapshots
+from memray._memray import size_fmt
+
+PythonStack = Tuple[Tuple[str, str, int], ...]
+
+
+@dataclass(frozen=True)
+class StackDelta:
+    stack: PythonStack
+    size_before: int
+    size_after: int
+    n_allocations_before: int
+    n_allocations_after: int
+
+    @property
+    def size_delta(self) -> int:
+        return self.size_after - self.size_before
+
+    @property
+    def status(self) -> str:
+        if not self.n_allocations_before:
+            return "new"
+        if not self.n_allocations_after:
+            return "vanished"
+        if self.size_delta > 0:
+            return "grown"
+        if self.size_delta < 0:
+            return "shrunk"
+        return "unchanged"
+
+
+def _diff_snapshots_in_python(
+    before: Iterable[AllocationRecord], after: Iterable[AllocationRecord]
+) -> List[Tuple[PythonStack, int, int, int, int]]:
+    totals: Dict[PythonStack, List[int]] = defaultdict(lambda: [0, 0, 0, 0])
+    for side, allocations in enumerate((before, after)):
+        for allocation in allocations:
+            entry = totals[tuple(allocation.stack_trace())]
+            entry[side] += allocation.size
+            entry[side + 2] += allocation.n_allocations
+    deltas = [(stack, *entry) for stack, entry in totals.items()]
+    deltas.sort(key=lambda delta: abs(delta[2] - delta[1]), reverse=True)
+    return deltas  # type: ignore[return-value]
+
+
+class DiffReporter:
+    STATUS_STYLES = {
+        "new": "bold red",
+        "grown": "red",
+        "shrunk": "green",
+        "vanished": "bold green",
+        "unchanged": "",
+    }
+
+    def __init__(self, deltas: List[StackDelta]):
+        super().__init__()
+        self.deltas = deltas
+
+    @classmethod
+    def from_snapshots(
+        cls,
+        before: Iterable[AllocationRecord],
+        after: Iterable[AllocationRecord],
+    ) -> "DiffReporter":
+        before = list(before)
+        after = list(after)
+        deltas = diff_snapshots(before, after)
+        if deltas is None:
+            deltas = _diff_snapshots_in_python(before, after)
+        return cls([StackDelta(*delta) for delta in deltas])
+
+    @staticmethod
+    def _format_location(stack: PythonStack) -> str:
+        if not stack:
+            return "???"
+        function, file, line = stack[0]
+        return f"{function} at {file}:{line}"
+
+    def render(
+        self,
+        *,
+        max_rows: Optional[int] = None,
+        include_unchanged: bool = False,
+        file: Optional[IO[str]] = None,
+    ) -> None:
+        table = rich.table.Table(expand=True)
+        table.add_column("Status")
+        table.add_column("Location", ratio=1, overflow="fold")
+        table.add_column("Before", justify="right")
+        table.add_column("After", justify="right")
+        table.add_column("Change", justify="right")
+        table.add_column("Allocations", justify="right")
+
+        deltas = [
+            delta
+            for delta in self.deltas
+            if include_unchanged or delta.status != "unchanged"
+        ]
+        for delta in deltas[:max_rows]:
+            sign = "+" if delta.size_delta >= 0 else "-"
+            table.add_row(
+                delta.status,
+                self._format_location(delta.stack),
+                size_fmt(delta.size_before),
+                size_fmt(delta.size_after),
+                f"{sign}{size_fmt(abs(delta.size_delta))}",
+                f"{delta.n_allocations_before} -> {delta.n_allocations_after}",
+                style=self.STATUS_STYLES[delta.status],
+            )
+        rich.print(table, file=file)
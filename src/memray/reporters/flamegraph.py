@@ -7,13 +7,17 @@ from typing import Any
 from typing import Dict
 from typing import Iterable
 from typing import Iterator
+from typing import List
 from typing import TextIO
 from typing import Tuple
 from typing import TypeVar
+from typing import Union
 
 from memray import AllocationRecord
 from memray import MemorySnapshot
 from memray import Metadata
+from memray._memray import AllocationSnapshot
+from memray._memray import build_flame_graph
 from memray.reporters.frame_tools import StackFrame
 from memray.reporters.frame_tools import is_cpython_internal
 from memray.reporters.frame_tools import is_frame_from_import_system
@@ -66,6 +70,63 @@ def create_framegraph_node_from_stack_frame(
     }
 
 
+def frame_flags(stack_frame: StackFrame) -> Tuple[bool, bool]:
+    return is_cpython_internal(stack_frame), is_frame_from_import_system(stack_frame)
+
+
+def create_root_node() -> Dict[str, Any]:
+    return {
+        "name": "<root>",
+        "location": [html.escape("<tracker>"), "<b>memray</b>", 0],
+        "value": 0,
+        "children": {},
+        "n_allocations": 0,
+        "thread_id": "0x0",
+        "interesting": True,
+        "import_system": False,
+    }
+
+
+def flame_graph_data_from_nodes(
+    frames: List[StackFrame],
+    nodes: List[Tuple[int, int, int, int, int, bool, bool]],
+    thread_names: Dict[int, str],
+) -> Dict[str, Any]:
+    # Nodes sharing a frame only differ in their position in the graph, so
+    # the source lines and the rest of the frame information are looked up
+    # once per frame.
+    frame_nodes = [create_framegraph_node_from_stack_frame(frame) for frame in frames]
+
+    _, _, _, root_size, root_n_allocations, _, _ = nodes[0]
+    data = create_root_node()
+    data["value"] = root_size
+    data["n_allocations"] = root_n_allocations
+    data["children"] = []
+
+    graph_nodes = [data]
+    unique_threads = set()
+    for frame_index, tid, parent, size, n_allocations, *flags in nodes[1:]:
+        import_system, too_deep = flags
+        thread_id = thread_names[tid]
+        node = {
+            **frame_nodes[frame_index],
+            "value": size,
+            "children": [],
+            "n_allocations": n_allocations,
+            "thread_id": thread_id,
+            "import_system": import_system,
+        }
+        if too_deep:
+            node["name"] = "<STACK TOO DEEP>"
+            node["location"] = ["...", "...", 0]
+        graph_nodes[parent]["children"].append(node)
+        graph_nodes.append(node)
+        unique_threads.add(thread_id)
+
+    data["unique_threads"] = sorted(unique_threads)
+    return data
+
+
 class FlameGraphReporter:
     def __init__(
         self,
@@ -80,21 +141,23 @@ class FlameGraphReporter:
     @classmethod
     def from_snapshot(
         cls,
-        allocations: Iterator[AllocationRecord],
+        allocations: Union[AllocationSnapshot, Iterator[AllocationRecord]],
         *,
         memory_records: Iterable[MemorySnapshot],
         native_traces: bool,
     ) -> "FlameGraphReporter":
-        data: Dict[str, Any] = {
-            "name": "<root>",
-            "location": [html.escape("<tracker>"), "<b>memray</b>", 0],
-            "value": 0,
-            "children": {},
-            "n_allocations": 0,
-            "thread_id": "0x0",
-            "interesting": True,
-            "import_system": False,
-        }
+        if not native_traces:
+            if isinstance(allocations, AllocationSnapshot):
+                graph = allocations.build_flame_graph(frame_flags, MAX_STACKS)
+            else:
+                records = list(allocations)
+                graph = build_flame_graph(records, frame_flags, MAX_STACKS)
+                allocations = iter(records)
+            if graph is not None:
+                data = flame_graph_data_from_nodes(*graph)
+                return cls(data, memory_records=memory_records)
+
+        data = create_root_node()
 
         unique_threads = set()
         for record in allocations:
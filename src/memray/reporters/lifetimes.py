@@ -0,0 +1,145 @@
+from collections import defaultdict
+from dataclasses import dataclass
+from typing import IO
+from typing import Dict
+from typing import Iterable
+from typing import List
+from typing import Optional
+from typing import Tuple
+
+import rich
+import rich.table
+
+from memray._memray import AllocationLifetimes
+from memray._memray import size_fmt
+
+PythonStack = Tuple[Tuple[str, str, int], ...]
+Histogram = List[Tuple[int, int]]
+
+
+def _merge_histograms(histograms: Iterable[Histogram]) -> Histogram:
+    counts: Dict[int, int] = defaultdict(int)
+    for histogram in histograms:
+        for lower_bound, count in histogram:
+            counts[lower_bound] += count
+    return sorted(counts.items())
+
+
+def _median_bucket(histogram: Histogram) -> Optional[int]:
+    total = sum(count for _, count in histogram)
+    seen = 0
+    for lower_bound, count in histogram:
+        seen += count
+        if 2 * seen >= total:
+            return lower_bound
+    return None
+
+
+def _format_bucket(lower_bound: Optional[int], unit: str = "") -> str:
+    if lower_bound is None:
+        return "-"
+    if lower_bound <= 1:
+        return f"{lower_bound}{unit}"
+    return f"{lower_bound}-{2 * lower_bound - 1}{unit}"
+
+
+@dataclass(frozen=True)
+class StackLifetimes:
+    stack: PythonStack
+    size: int
+    n_allocations: int
+    freed: int
+    never_freed: int
+    by_allocations: Histogram
+    by_time: Histogram
+
+    def freed_within(self, n_allocations: int) -> int:
+        """How many allocations were freed before n_allocations more were made.
+
+        The histogram buckets go by powers of two, so n_allocations is
+        effectively rounded up to the next one.
+        """
+        return sum(
+            count
+            for lower_bound, count in self.by_allocations
+            if lower_bound < n_allocations
+        )
+
+
+class LifetimesReporter:
+    def __init__(self, stacks: List[StackLifetimes], short_lived_threshold: int):
+        super().__init__()
+        self.stacks = stacks
+        self.short_lived_threshold = short_lived_threshold
+
+    @classmethod
+    def from_lifetimes(
+        cls,
+        lifetimes: Iterable[AllocationLifetimes],
+        short_lived_threshold: int,
+    ) -> "LifetimesReporter":
+        by_stack: Dict[PythonStack, List[AllocationLifetimes]] = defaultdict(list)
+        for entry in lifetimes:
+            by_stack[tuple(entry.record.stack_trace())].append(entry)
+
+        stacks = [
+            StackLifetimes(
+                stack,
+                sum(entry.record.size for entry in entries),
+                sum(entry.record.n_allocations for entry in entries),
+                sum(entry.freed for entry in entries),
+                sum(entry.never_freed for entry in entries),
+                _merge_histograms(entry.by_allocations for entry in entries),
+                _merge_histograms(entry.by_time for entry in entries),
+            )
+            for stack, entries in by_stack.items()
+        ]
+        # The locations allocating the most short-lived blocks are the ones
+        # whose churn a pool or a reused buffer would save.
+        stacks.sort(
+            key=lambda stack: (stack.freed_within(short_lived_threshold), stack.size),
+            reverse=True,
+        )
+        return cls(stacks, short_lived_threshold)
+
+    @staticmethod
+    def _format_location(stack: PythonStack) -> str:
+        if not stack:
+            return "???"
+        function, file, line = stack[0]
+        return f"{function} at {file}:{line}"
+
+    def render(
+        self,
+        *,
+        max_rows: Optional[int] = None,
+        file: Optional[IO[str]] = None,
+    ) -> None:
+        table = rich.table.Table(
+            expand=True,
+            caption=(
+                "Short-lived allocations were freed before"
+                f" {self.short_lived_threshold} other allocations were made"
+            ),
+        )
+        table.add_column("Location", ratio=1, overflow="fold")
+        table.add_column("Allocations", justify="right")
+        table.add_column("Total size", justify="right")
+        table.add_column("Short-lived", justify="right")
+        table.add_column("Median lifetime", justify="right")
+        table.add_column("Median time", justify="right")
+        table.add_column("Never freed", justify="right")
+
+        for stack in self.stacks[:max_rows]:
+            short_lived = stack.freed_within(self.short_lived_threshold)
+            share = short_lived / stack.n_allocations if stack.n_allocations else 0
+            table.add_row(
+                self._format_location(stack.stack),
+                str(stack.n_allocations),
+                size_fmt(stack.size),
+                f"{short_lived} ({share:.0%})",
+                _format_bucket(_median_bucket(stack.by_allocations)),
+                _format_bucket(_median_bucket(stack.by_time), "ms"),
+                str(stack.never_freed),
+            )
+        rich.print(table, file=file)
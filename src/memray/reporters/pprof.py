@@ -0,0 +1,147 @@
+"""Encoding of heap profiles in the protocol buffer format that pprof reads.
+
+This mirrors the native encoder used for records read from a capture file
+(see ``pprof.h``), for records that it can't handle, and produces the same
+profile for the same Python stacks.
+"""
+from typing import Dict
+from typing import List
+from typing import Sequence
+from typing import Tuple
+
+# Field numbers of the messages in pprof's profile.proto.
+_PROFILE_SAMPLE_TYPE = 1
+_PROFILE_SAMPLE = 2
+_PROFILE_LOCATION = 4
+_PROFILE_FUNCTION = 5
+_PROFILE_STRING_TABLE = 6
+_PROFILE_TIME_NANOS = 9
+_PROFILE_DURATION_NANOS = 10
+_PROFILE_DEFAULT_SAMPLE_TYPE = 14
+
+_VARINT = 0
+_LENGTH_DELIMITED = 2
+
+Line = Tuple[int, int]
+
+
+def _varint(value: int) -> bytes:
+    value &= (1 << 64) - 1
+    result = bytearray()
+    while value >= 0x80:
+        result.append((value & 0x7F) | 0x80)
+        value >>= 7
+    result.append(value)
+    return bytes(result)
+
+
+def _varint_field(field: int, value: int) -> bytes:
+    return _varint(field << 3 | _VARINT) + _varint(value)
+
+
+def _bytes_field(field: int, value: bytes) -> bytes:
+    return _varint(field << 3 | _LENGTH_DELIMITED) + _varint(len(value)) + value
+
+
+class PprofProfile:
+    """A heap profile, built one sample at a time.
+
+    Every sample has two values, the number of allocations and their size in
+    bytes.  Strings, functions and locations are deduplicated as they are
+    added.
+    """
+
+    def __init__(self, sample_kind: str) -> None:
+        self._string_ids: Dict[str, int] = {}
+        self._function_ids: Dict[Tuple[int, int], int] = {}
+        self._location_ids: Dict[bytes, int] = {}
+        self._functions: List[bytes] = []
+        self._locations: List[bytes] = []
+        self._samples: List[bytes] = []
+
+        # The first string of the table must be the empty one.
+        self.string_id("")
+        self._sample_types = [
+            _bytes_field(
+                _PROFILE_SAMPLE_TYPE,
+                _varint_field(1, self.string_id(f"{sample_kind}_objects"))
+                + _varint_field(2, self.string_id("count")),
+            ),
+        ]
+        self._default_sample_type = self.string_id(f"{sample_kind}_space")
+        self._sample_types.append(
+            _bytes_field(
+                _PROFILE_SAMPLE_TYPE,
+                _varint_field(1, self._default_sample_type)
+                + _varint_field(2, self.string_id("bytes")),
+            )
+        )
+        self._thread_label = self.string_id("thread")
+
+    def string_id(self, string: str) -> int:
+        return self._string_ids.setdefault(string, len(self._string_ids))
+
+    def function_id(self, name: str, filename: str) -> int:
+        key = (self.string_id(name), self.string_id(filename))
+        function_id = self._function_ids.get(key)
+        if function_id is None:
+            # Ids start at 1, since 0 means that there is none.
+            function_id = self._function_ids[key] = len(self._function_ids) + 1
+            self._functions.append(
+                _bytes_field(
+                    _PROFILE_FUNCTION,
+                    _varint_field(1, function_id)
+                    + _varint_field(2, key[0])
+                    + _varint_field(3, key[0])
+                    + _varint_field(4, key[1]),
+                )
+            )
+        return function_id
+
+    def location_id(self, lines: Sequence[Line]) -> int:
+        """Get the location of the given lines, innermost first."""
+        contents = b"".join(
+            _bytes_field(4, _varint_field(1, function_id) + _varint_field(2, lineno))
+            for function_id, lineno in lines
+        )
+        location_id = self._location_ids.get(contents)
+        if location_id is None:
+            location_id = self._location_ids[contents] = len(self._location_ids) + 1
+            self._locations.append(
+                _bytes_field(_PROFILE_LOCATION, _varint_field(1, location_id) + contents)
+            )
+        return location_id
+
+    def add_sample(
+        self,
+        location_ids: Sequence[int],
+        n_allocations: int,
+        size: int,
+        thread_name: str,
+    ) -> None:
+        """Add a sample whose stack has the given locations, innermost first."""
+        sample = (
+            _bytes_field(1, b"".join(_varint(location) for location in location_ids))
+            + _bytes_field(2, _varint(n_allocations) + _varint(size))
+            + _bytes_field(
+                3,
+                _varint_field(1, self._thread_label)
+                + _varint_field(2, self.string_id(thread_name)),
+            )
+        )
+        self._samples.append(_bytes_field(_PROFILE_SAMPLE, sample))
+
+    def serialize(self, time_nanos: int, duration_nanos: int) -> bytes:
+        strings = sorted(self._string_ids, key=self._string_ids.__getitem__)
+        return b"".join(
+            [
+                *self._sample_types,
+                *self._samples,
+                *self._locations,
+                *self._functions,
+                *(_bytes_field(_PROFILE_STRING_TABLE, s.encode()) for s in strings),
+                _varint_field(_PROFILE_TIME_NANOS, time_nanos),
+                _varint_field(_PROFILE_DURATION_NANOS, duration_nanos),
+                _varint_field(_PROFILE_DEFAULT_SAMPLE_TYPE, self._default_sample_type),
+            ]
+        )
@@ -4,15 +4,39 @@ from typing import Dict
 from typing import Iterable
 from typing import Iterator
 from typing import List
+from typing import Optional
 from typing import TextIO
+from typing import Tuple
+from typing import Union
 
 from memray import AllocationRecord
 from memray import AllocatorType
 from memray import MemorySnapshot
 from memray import Metadata
+from memray._memray import AllocationSnapshot
 from memray.reporters.templates import render_report
 
 
+def _row_data(
+    thread_name: str,
+    size: int,
+    allocator: int,
+    n_allocations: int,
+    frame: Optional[Tuple[str, str, int]],
+) -> Dict[str, Any]:
+    stack = "???"
+    if frame is not None:
+        function, file, line = frame
+        stack = f"{function} at {file}:{line}"
+    return dict(
+        tid=thread_name,
+        size=size,
+        allocator=AllocatorType(allocator).name.lower(),
+        n_allocations=n_allocations,
+        stack_trace=html.escape(stack),
+    )
+
+
 class TableReporter:
     def __init__(
         self,
@@ -27,11 +51,18 @@ class TableReporter:
     @classmethod
     def from_snapshot(
         cls,
-        allocations: Iterator[AllocationRecord],
+        allocations: Union[AllocationSnapshot, Iterator[AllocationRecord]],
         *,
         memory_records: Iterable[MemorySnapshot],
         native_traces: bool,
     ) -> "TableReporter":
+        rows = None
+        if isinstance(allocations, AllocationSnapshot):
+            rows = allocations.table_rows()
+        if rows is not None:
+            return cls(
+                [_row_data(*row) for row in rows], memory_records=memory_records
+            )
 
         result = []
         for record in allocations:
@@ -40,19 +71,13 @@ class TableReporter:
                 if native_traces
                 else record.stack_trace(max_stacks=1)
             )
-            stack = "???"
-            if stack_trace:
-                function, file, line = stack_trace[0]
-                stack = f"{function} at {file}:{line}"
-
-            allocator = AllocatorType(record.allocator)
             result.append(
-                dict(
-                    tid=record.thread_name,
-                    size=record.size,
-                    allocator=allocator.name.lower(),
-                    n_allocations=record.n_allocations,
-                    stack_trace=html.escape(stack),
+                _row_data(
+                    record.thread_name,
+                    record.size,
+                    record.allocator,
+                    record.n_allocations,
+                    stack_trace[0] if stack_trace else None,
                 )
             )
 
@@ -1,8 +1,13 @@
 """Templates to render reports in HTML."""
+import base64
+import sys
+from array import array
 from functools import lru_cache
 from typing import Any
 from typing import Dict
 from typing import Iterable
+from typing import List
+from typing import Tuple
 from typing import Union
 
 import jinja2
@@ -24,6 +29,110 @@ def get_report_title(*, kind: str, show_memory_leaks: bool) -> str:
     return f"{kind} report"
 
 
+class ReportDataEncoder:
+    """Encodes the data of a report for ``decodeReportData`` in ``base.html``.
+
+    Every distinct string is stored once, in a table, and records are stored
+    as columns with one element per record.  Columns of numbers, booleans and
+    strings are typed arrays in base64, the strings being ids in the table.
+    Columns of anything else are plain lists.
+    """
+
+    def __init__(self) -> None:
+        self._string_ids: Dict[str, int] = {}
+
+    def string_id(self, string: str) -> int:
+        return self._string_ids.setdefault(string, len(self._string_ids))
+
+    def column(self, values: List[Any]) -> Tuple[str, Any]:
+        if all(isinstance(value, bool) for value in values):
+            return "bool", _typed_array("B", values)
+        if all(isinstance(value, (int, float)) for value in values):
+            if all(isinstance(value, int) and 0 <= value < 2**32 for value in values):
+                return "uint32", _typed_array("I", values)
+            return "float64", _typed_array("d", values)
+        if all(isinstance(value, str) for value in values):
+            return "string", _typed_array("I", map(self.string_id, values))
+        return "json", values
+
+    def records(self, records: List[Dict[str, Any]]) -> Dict[str, Any]:
+        """Encode records that all have the same fields."""
+        fields = records[0].keys() if records else ()
+        return {
+            "length": len(records),
+            "fields": {
+                field: self.column([record[field] for record in records])
+                for field in fields
+            },
+        }
+
+    def strings(self) -> List[str]:
+        return list(self._string_ids)
+
+
+def _typed_array(typecode: str, values: Iterable[Any]) -> str:
+    packed = array(typecode, values)
+    if sys.byteorder == "big":
+        # Typed arrays use the byte order of the browser, which is little.
+        packed.byteswap()
+    return base64.b64encode(packed.tobytes()).decode("ascii")
+
+
+def encode_flame_graph(root: Dict[str, Any]) -> Dict[str, Any]:
+    """Encode a flame graph as a table of frames and a table of nodes.
+
+    Nodes only point to their frame, which holds what nodes sharing it have
+    in common, and to their parent, which comes before them.  The root is the
+    first node, and the children of every node are in their original order.
+    """
+    encoder = ReportDataEncoder()
+    frame_ids: Dict[Tuple[Any, ...], int] = {}
+    frames: List[Dict[str, Any]] = []
+    nodes: List[Dict[str, Any]] = []
+    stack = [(root, 0)]
+    while stack:
+        node, parent = stack.pop()
+        function, filename, lineno = node["location"]
+        key = (node["name"], function, filename, lineno, node["interesting"])
+        frame_id = frame_ids.get(key)
+        if frame_id is None:
+            frame_id = frame_ids[key] = len(frames)
+            frames.append(
+                {
+                    "name": node["name"],
+                    "function": function,
+                    "filename": filename,
+                    "lineno": lineno,
+                    "interesting": node["interesting"],
+                }
+            )
+        stack.extend((child, len(nodes)) for child in reversed(node["children"]))
+        nodes.append(
+            {
+                "frame": frame_id,
+                "parent": parent,
+                "value": node["value"],
+                "n_allocations": node["n_allocations"],
+                "thread_id": node["thread_id"],
+                "import_system": node["import_system"],
+            }
+        )
+    encoded_frames = encoder.records(frames)
+    encoded_nodes = encoder.records(nodes)
+    return {
+        "strings": encoder.strings(),
+        "frames": encoded_frames,
+        "nodes": encoded_nodes,
+        "unique_threads": root["unique_threads"],
+    }
+
+
+def encode_records(records: Iterable[Dict[str, Any]]) -> Dict[str, Any]:
+    encoder = ReportDataEncoder()
+    encoded_records = encoder.records(list(records))
+    return {"strings": encoder.strings(), "records": encoded_records}
+
+
 def render_report(
     *,
     kind: str,
@@ -40,7 +149,11 @@ def render_report(
     return template.render(
         kind=kind,
         title=title,
-        data=data,
+        data=(
+            encode_flame_graph(data)
+            if isinstance(data, dict)
+            else encode_records(data)
+        ),
         metadata=metadata,
         memory_records=memory_records,
         show_memory_leaks=show_memory_leaks,
@@ -1,6 +1,10 @@
 import csv
+import gzip
 import json
+from datetime import timedelta
+from typing import IO
 from typing import Any
+from typing import BinaryIO
 from typing import Dict
 from typing import Iterable
 from typing import Iterator
@@ -12,6 +16,8 @@ from memray import AllocationRecord
 from memray import AllocatorType
 from memray import MemorySnapshot
 from memray import Metadata
+from memray._memray import encode_pprof_profile
+from memray.reporters.pprof import PprofProfile
 
 Location = Tuple[str, str]
 
@@ -20,7 +26,9 @@ class TransformReporter:
     SUFFIX_MAP = {
         "gprof2dot": ".json",
         "csv": ".csv",
+        "pprof": ".pb.gz",
     }
+    BINARY_FORMATS = {"pprof"}
 
     def __init__(
         self,
@@ -29,12 +37,14 @@ class TransformReporter:
         format: str,
         native_traces: bool,
         memory_records: Iterable[MemorySnapshot],
+        temporary_allocations: bool = False,
     ) -> None:
         super().__init__()
         self.allocations = allocations
         self.format = format
         self.native_traces = native_traces
         self.memory_records = memory_records
+        self.temporary_allocations = temporary_allocations
 
     def render_as_gprof2dot(
         self,
@@ -73,9 +83,44 @@ class TransformReporter:
         }
         json.dump(result, outfile)
 
+    def render_as_pprof(
+        self,
+        outfile: BinaryIO,
+        metadata: Metadata,
+        **kwargs: Any,
+    ) -> None:
+        # Temporary allocations are gone by the end of the capture, while the
+        # allocations at the peak and the leaked ones are still in use.
+        sample_kind = "alloc" if self.temporary_allocations else "inuse"
+        time_nanos = int(metadata.start_time.timestamp() * 1_000_000) * 1000
+        duration = metadata.end_time - metadata.start_time
+        duration_nanos = duration // timedelta(microseconds=1) * 1000
+
+        records = list(self.allocations)
+        profile_data = encode_pprof_profile(
+            records, self.native_traces, sample_kind, time_nanos, duration_nanos
+        )
+        if profile_data is None:
+            profile = PprofProfile(sample_kind)
+            for record in records:
+                stack_trace = (
+                    record.hybrid_stack_trace()
+                    if self.native_traces
+                    else record.stack_trace()
+                )
+                locations = [
+                    profile.location_id([(profile.function_id(func, mod), line)])
+                    for func, mod, line in stack_trace
+                ]
+                profile.add_sample(
+                    locations, record.n_allocations, record.size, record.thread_name
+                )
+            profile_data = profile.serialize(time_nanos, duration_nanos)
+        outfile.write(gzip.compress(profile_data))
+
     def render(
         self,
-        outfile: TextIO,
+        outfile: IO[Any],
         metadata: Metadata,
         show_memory_leaks: bool,
     ) -> None:
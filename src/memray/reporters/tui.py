@@ -12,6 +12,7 @@ from typing import List
 from typing import Optional
 from typing import Set
 from typing import Tuple
+from typing import Union
 
 from rich.layout import Layout
 from rich.markup import escape
@@ -21,6 +22,8 @@ from rich.table import Column
 from rich.table import Table
 
 from memray import AllocationRecord
+from memray._memray import AllocationSnapshot
+from memray._memray import aggregate_allocations_by_location
 from memray._memray import size_fmt
 
 MAX_MEMORY_RATIO = 0.95
@@ -128,7 +131,7 @@ class AllocationEntry:
 
 
 def aggregate_allocations(
-    allocations: Iterable[AllocationRecord],
+    allocations: Union[AllocationSnapshot, Iterable[AllocationRecord]],
     memory_threshold: float = float("inf"),
     native_traces: Optional[bool] = False,
 ) -> Dict[Location, AllocationEntry]:
@@ -142,6 +145,20 @@ def aggregate_allocations(
         )
     )
 
+    if not native_traces:
+        if isinstance(allocations, AllocationSnapshot):
+            aggregated = allocations.aggregate_by_location(memory_threshold)
+        else:
+            allocations = list(allocations)
+            aggregated = aggregate_allocations_by_location(
+                allocations, memory_threshold
+            )
+        if aggregated is not None:
+            for (function, file_name), entry in aggregated.items():
+                location = Location(function=function, file=file_name)
+                processed_allocations[location] = AllocationEntry(*entry)
+            return processed_allocations
+
     current_total = 0
     for allocation in allocations:
         if current_total >= memory_threshold:
@@ -216,8 +233,9 @@ class TUI:
         self.n_samples = 0
         self.start = datetime.now()
         self._last_update = datetime.now()
-        self._snapshot: Tuple[AllocationRecord, ...] = tuple()
+        self._snapshot: Union[AllocationSnapshot, Tuple[AllocationRecord, ...]] = ()
         self._current_memory_size = 0
+        self._total_allocations = 0
         self._max_memory_seen = 0
         self._message = ""
         self.active = True
@@ -319,7 +337,7 @@ class TUI:
         sort_column = table.columns[self._sort_column_id]
         sort_column.header = f"<{sort_column.header}>"
 
-        total_allocations = sum(record.n_allocations for record in self._snapshot)
+        total_allocations = self._total_allocations
         allocation_entries = aggregate_allocations(
             self._snapshot, MAX_MEMORY_RATIO * self._current_memory_size, self._native
         )
@@ -380,18 +398,32 @@ class TUI:
         self.layout["message"].update(self.message)
         return self.layout
 
-    def update_snapshot(self, snapshot: Iterable[AllocationRecord]) -> None:
-        self._snapshot = tuple(snapshot)
-        for record in self._snapshot:
-            if record.tid in self._seen_threads:
+    def update_snapshot(
+        self, snapshot: Union[AllocationSnapshot, Iterable[AllocationRecord]]
+    ) -> None:
+        # A snapshot from the reader is aggregated where it is, without
+        # creating a record for every location.
+        if isinstance(snapshot, AllocationSnapshot):
+            self._snapshot = snapshot
+            thread_ids = snapshot.thread_ids()
+            self._current_memory_size = snapshot.total_size
+            self._total_allocations = snapshot.total_allocations
+        else:
+            self._snapshot = tuple(snapshot)
+            thread_ids = [record.tid for record in self._snapshot]
+            self._current_memory_size = sum(record.size for record in self._snapshot)
+            self._total_allocations = sum(
+                record.n_allocations for record in self._snapshot
+            )
+        for tid in thread_ids:
+            if tid in self._seen_threads:
                 continue
             if self._threads is self._DUMMY_THREAD_LIST:
                 self._threads = []
-            self._threads.append(record.tid)
-            self._seen_threads.add(record.tid)
+            self._threads.append(tid)
+            self._seen_threads.add(tid)
         self.n_samples += 1
         self._last_update = datetime.now()
-        self._current_memory_size = sum(record.size for record in self._snapshot)
         if self._current_memory_size > self._max_memory_seen:
             self._max_memory_seen = self._current_memory_size
             self.stream.reset_max(self._max_memory_seen)
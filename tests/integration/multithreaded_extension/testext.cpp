@@ -34,25 +34,28 @@ allocate_memory()
 }
 
 extern "C" void*
-worker(void*)
+worker(void* arg)
 {
-    allocate_memory();
+    long rounds = (long)arg;
+    for (long i=0; i < rounds; ++i) {
+        allocate_memory();
+    }
     return NULL;
 }
 
-void start_threads()
+void start_threads(int num_threads, long rounds)
 {
-    for (int i=0; i<NUM_THREADS; ++i) {
+    for (int i=0; i<num_threads; ++i) {
         pthread_t thread;
-        int ret = pthread_create(&thread, NULL, &worker, NULL);
+        int ret = pthread_create(&thread, NULL, &worker, (void*)rounds);
         assert(0 == ret);
         threads[i] = thread;
     }
 }
 
-void join_threads()
+void join_threads(int num_threads)
 {
-    for (int i=0; i<NUM_THREADS; ++i) {
+    for (int i=0; i<num_threads; ++i) {
         pthread_join(threads[i], NULL);
     }
 }
@@ -78,10 +81,19 @@ void valloc_on_thread_exit() {
 }
 
 PyObject*
-run(PyObject*, PyObject*)
+run(PyObject*, PyObject* args)
 {
-    start_threads();
-    join_threads();
+    int num_threads = NUM_THREADS;
+    long rounds = 1;
+    if (!PyArg_ParseTuple(args, "|il", &num_threads, &rounds)) {
+        return NULL;
+    }
+    if (num_threads < 0 || num_threads > NUM_THREADS) {
+        PyErr_Format(PyExc_ValueError, "num_threads must be between 0 and %d", NUM_THREADS);
+        return NULL;
+    }
+    start_threads(num_threads, rounds);
+    join_threads(num_threads);
     Py_RETURN_NONE;
 }
 
@@ -97,7 +109,7 @@ run_valloc_at_exit(PyObject*, PyObject*)
 }  // unnamed namespace
 
 static PyMethodDef methods[] = {
-        {"run", run, METH_NOARGS, "Run a bunch of threads"},
+        {"run", run, METH_VARARGS, "Run a bunch of threads, each allocating memory some rounds"},
         {"run_valloc_at_exit", run_valloc_at_exit, METH_NOARGS, "Run valloc while exiting a thread"},
         {NULL, NULL, 0, NULL},
 };
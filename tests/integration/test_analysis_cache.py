@@ -0,0 +1,140 @@
+import os
+
+import pytest
+
+from memray import AllocatorType
+from memray import FileReader
+from memray import Tracker
+from memray._analysis_cache import SIDECAR_SUFFIX
+from memray._analysis_cache import CachedAllocationRecord
+from memray._memray import compute_statistics
+from memray._test import MemoryAllocator
+
+
+def _capture(output, **kwargs):
+    allocators = [MemoryAllocator() for _ in range(3)]
+
+    def allocate(allocator, size):
+        allocator.valloc(size)
+
+    with Tracker(output, **kwargs):
+        for i, allocator in enumerate(allocators):
+            allocate(allocator, 1024 * (i + 1))
+        allocators[0].free()
+
+
+def _snapshot(records):
+    return sorted(
+        (
+            record.tid,
+            record.size,
+            record.allocator,
+            record.n_allocations,
+            record.thread_name,
+            tuple(record.stack_trace()),
+            tuple(record.stack_trace(max_stacks=1)),
+        )
+        for record in records
+        if record.allocator == AllocatorType.VALLOC
+    )
+
+
+@pytest.mark.parametrize("merge_threads", [True, False])
+@pytest.mark.parametrize("leaks", [True, False])
+def test_records_are_read_back_from_the_sidecar(tmp_path, merge_threads, leaks):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    _capture(output)
+
+    def get_records(reader):
+        if leaks:
+            return reader.get_leaked_allocation_records(merge_threads=merge_threads)
+        return reader.get_high_watermark_allocation_records(
+            merge_threads=merge_threads
+        )
+
+    # WHEN
+    expected = _snapshot(get_records(FileReader(output)))
+    first = _snapshot(get_records(FileReader(output, cache_analysis=True)))
+    cached = list(get_records(FileReader(output, cache_analysis=True)))
+
+    # THEN
+    assert (tmp_path / f"test.bin{SIDECAR_SUFFIX}").exists()
+    assert first == expected
+    assert all(type(record) is CachedAllocationRecord for record in cached)
+    assert _snapshot(cached) == expected
+    assert len(expected) == (2 if leaks else 3)
+
+
+def test_snapshot_is_read_back_from_the_sidecar(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    _capture(output)
+    expected = FileReader(output).get_snapshot()
+
+    # WHEN
+    FileReader(output, cache_analysis=True).get_snapshot()
+    cached = FileReader(output, cache_analysis=True).get_snapshot()
+
+    # THEN
+    assert all(type(record) is CachedAllocationRecord for record in cached)
+    assert _snapshot(cached) == _snapshot(expected)
+    assert cached.total_size == expected.total_size
+    assert cached.aggregate_by_location() is None
+    assert expected.aggregate_by_location() is not None
+
+
+def test_reader_state_is_read_back_from_the_sidecar(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    # Per-thread buffers keep the tracker from writing a capture summary.
+    _capture(output, per_thread_buffers=True)
+    expected = FileReader(output)
+
+    # WHEN
+    FileReader(output, cache_analysis=True)
+    cached = FileReader(output, cache_analysis=True)
+
+    # THEN
+    assert cached.metadata == expected.metadata
+    assert list(cached.get_memory_snapshots()) == list(
+        expected.get_memory_snapshots()
+    )
+    assert _snapshot(cached.get_high_watermark_allocation_records()) == _snapshot(
+        expected.get_high_watermark_allocation_records()
+    )
+
+
+def test_sidecar_is_ignored_when_the_capture_file_changes(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    _capture(output)
+    list(FileReader(output, cache_analysis=True).get_leaked_allocation_records())
+
+    # WHEN
+    stat = output.stat()
+    os.utime(output, ns=(stat.st_atime_ns, stat.st_mtime_ns + 1_000_000_000))
+    records = list(
+        FileReader(output, cache_analysis=True).get_leaked_allocation_records()
+    )
+
+    # THEN
+    assert records
+    assert not any(type(record) is CachedAllocationRecord for record in records)
+
+
+def test_statistics_are_read_back_from_the_sidecar(tmp_path):
+    # GIVEN
+    output = os.fspath(tmp_path / "test.bin")
+    _capture(output)
+
+    # WHEN
+    expected = compute_statistics(output, num_largest=3)
+    first = compute_statistics(output, num_largest=3, cache_analysis=True)
+    cached = compute_statistics(output, num_largest=3, cache_analysis=True)
+    other = compute_statistics(output, num_largest=1, cache_analysis=True)
+
+    # THEN
+    assert first == expected
+    assert cached == expected
+    assert len(other.top_locations_by_size) == 1
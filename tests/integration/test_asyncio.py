@@ -0,0 +1,79 @@
+import asyncio
+
+import pytest
+
+from memray import AllocatorType
+from memray import FileReader
+from memray import Tracker
+from memray._test import MemoryAllocator
+
+
+def run_tasks(allocator):
+    async def child():
+        await asyncio.sleep(0)
+        allocator.valloc(1234)
+        allocator.free()
+
+    async def parent():
+        await asyncio.gather(child(), child())
+
+    asyncio.run(parent())
+
+
+def get_vallocs(output):
+    return [
+        record
+        for record in FileReader(output).get_allocation_records()
+        if record.allocator == AllocatorType.VALLOC and record.size == 1234
+    ]
+
+
+def test_task_stacks_continue_with_the_stack_that_created_the_task(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output, trace_asyncio_tasks=True):
+        run_tasks(allocator)
+
+    # THEN
+    vallocs = get_vallocs(output)
+    assert len(vallocs) == 2
+    for valloc in vallocs:
+        funcs = [frame[0] for frame in valloc.stack_trace()]
+        assert funcs[:2] == ["valloc", "child"]
+        assert funcs.index("parent") > funcs.index("gather") > 1
+        assert funcs.index("run_tasks") > funcs.index("parent")
+
+
+def test_each_task_is_reported_as_a_thread_named_after_it(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output, trace_asyncio_tasks=True):
+        run_tasks(allocator)
+
+    # THEN
+    vallocs = get_vallocs(output)
+    assert len({valloc.tid for valloc in vallocs}) == 2
+    assert all("(Task-" in valloc.thread_name for valloc in vallocs)
+
+
+@pytest.mark.parametrize("trace_asyncio_tasks", [True, False])
+def test_task_stacks_are_not_stitched_unless_requested(tmp_path, trace_asyncio_tasks):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output, trace_asyncio_tasks=trace_asyncio_tasks):
+        run_tasks(allocator)
+
+    # THEN
+    for valloc in get_vallocs(output):
+        funcs = [frame[0] for frame in valloc.stack_trace()]
+        assert funcs[:2] == ["valloc", "child"]
+        assert ("parent" in funcs) is trace_asyncio_tasks
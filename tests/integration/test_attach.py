@@ -52,7 +52,7 @@ for line in sys.stdin:
 """
 
 
-@pytest.mark.parametrize("method", ["lldb", "gdb"])
+@pytest.mark.parametrize("method", ["ptrace", "lldb", "gdb"])
 def test_basic_attach(tmp_path, method):
     if not debugger_available(method):
         pytest.skip(f"a supported {method} debugger isn't installed")
@@ -114,3 +114,31 @@ def test_basic_attach(tmp_path, method):
     (valloc,) = vallocs
     functions = [f[0] for f in valloc.stack_trace()]
     assert functions == ["valloc", "baz", "bar", "foo", "<module>"]
+
+
+def test_ptrace_attach_to_a_process_that_does_not_exist():
+    if not debugger_available("ptrace"):
+        pytest.skip("attaching with ptrace isn't supported on this platform")
+
+    # GIVEN
+    exited_process = subprocess.Popen([sys.executable, "-c", "pass"])
+    exited_process.wait()
+
+    # WHEN
+    proc = subprocess.run(
+        [
+            sys.executable,
+            "-m",
+            "memray",
+            "attach",
+            "--method",
+            "ptrace",
+            str(exited_process.pid),
+        ],
+        capture_output=True,
+        text=True,
+    )
+
+    # THEN
+    assert proc.returncode == 1
+    assert "The given process ID does not exist." in proc.stderr
@@ -201,3 +201,60 @@ def test_importing_greenlet_after_tracking_starts(tmpdir):
     assert vallocs[0].tid != vallocs[1].tid != vallocs[6].tid
     assert vallocs[0].tid == vallocs[2].tid
     assert vallocs[1].tid == vallocs[3].tid == vallocs[4].tid == vallocs[5].tid
+
+
+def test_switching_back_to_a_greenlet_does_not_push_its_frames_again(tmpdir):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    subprocess_code = textwrap.dedent(
+        f"""
+        import greenlet
+
+        from memray import Tracker
+        from memray._test import MemoryAllocator
+
+
+        def nested(depth, other):
+            if depth:
+                return nested(depth - 1, other)
+            for _ in range(20):
+                allocator.valloc(1024)
+                allocator.free()
+                other().switch()
+
+
+        allocator = MemoryAllocator()
+        output = "{output}"
+
+        with Tracker(output):
+            first = greenlet.greenlet(lambda: nested(5, lambda: second))
+            second = greenlet.greenlet(lambda: nested(5, lambda: first))
+            first.switch()
+        """
+    )
+    subprocess.run([sys.executable, "-Xdev", "-c", subprocess_code], timeout=5)
+
+    # WHEN
+    proc = subprocess.run(
+        [sys.executable, "-m", "memray", "parse", str(output)],
+        check=True,
+        capture_output=True,
+        text=True,
+    )
+
+    # THEN
+    vallocs = [
+        record
+        for record in FileReader(output).get_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert len(vallocs) == 40
+    for valloc in vallocs:
+        assert [frame[0] for frame in valloc.stack_trace()][:7] == [
+            "valloc",
+            *["nested"] * 6,
+        ]
+
+    # Each greenlet's frames are pushed once, rather than after every switch.
+    pushes = [r for r in proc.stdout.splitlines() if r.startswith("FRAME_PUSH")]
+    assert len(pushes) < 40
@@ -1,9 +1,11 @@
 import contextlib
+import gzip
 import os
 import platform
 import pty
 import re
 import signal
+import socket
 import subprocess
 import sys
 import textwrap
@@ -13,6 +15,8 @@ from unittest.mock import patch
 
 import pytest
 
+from memray import AllocatorType
+from memray import FileReader
 from memray.commands import main
 
 TIMEOUT = 10
@@ -466,6 +470,10 @@ class TestParseSubcommand:
             "FRAME_ID",
             "MEMORY_RECORD",
             "CONTEXT_SWITCH",
+            "ALLOCATION_BLOCK",
+            "REPEATED_ALLOCATIONS",
+            "CAPTURE_SUMMARY",
+            "TRACKER_METRICS",
             "TRAILER",
         ]
 
@@ -476,8 +484,9 @@ class TestParseSubcommand:
             from memray._test import MemoryAllocator
             print("Allocating some memory!")
             allocator = MemoryAllocator()
-            allocator.valloc(1024)
-            allocator.free()
+            for _ in range(10):
+                allocator.valloc(1024)
+                allocator.free()
             # Give it time to generate some memory records
             time.sleep(0.1)
             """
@@ -505,11 +514,61 @@ class TestParseSubcommand:
         _, *records = proc.stdout.splitlines()
 
         for record in records:
-            record_count_by_type[record.partition(" ")[0]] += 1
+            # The records of a block are listed below it and counted too, but
+            # the key=value entries of the other records (like the nodes of
+            # a Python stack tree) don't start with a record type.
+            kind = record.split(maxsplit=1)[0]
+            if "=" not in kind:
+                record_count_by_type[kind] += 1
 
         for _, count in record_count_by_type.items():
             assert count > 0
 
+    def test_memory_maps_only_list_changed_modules(self, tmp_path):
+        # GIVEN
+        code_file = tmp_path / "code.py"
+        program = textwrap.dedent(
+            """\
+            import _ctypes
+            import _decimal
+            from memray._test import MemoryAllocator
+            allocator = MemoryAllocator()
+            allocator.valloc(1024)
+            allocator.free()
+            """
+        )
+        code_file.write_text(program)
+        results_file, _ = generate_sample_results(tmp_path, code_file, native=True)
+
+        # WHEN
+        proc = subprocess.run(
+            [
+                sys.executable,
+                "-m",
+                "memray",
+                "parse",
+                str(results_file),
+            ],
+            check=True,
+            capture_output=True,
+            text=True,
+            cwd=str(tmp_path),
+        )
+
+        # THEN
+        records = proc.stdout.splitlines()
+        memory_maps = [r for r in records if r.startswith("MEMORY_MAP_START")]
+        assert memory_maps[0] == "MEMORY_MAP_START incremental=false"
+        assert len(memory_maps) > 1
+        assert all(r == "MEMORY_MAP_START incremental=true" for r in memory_maps[1:])
+
+        loaded = [
+            r.split()[1]
+            for r in records
+            if r.startswith("SEGMENT_HEADER") and "unloaded" not in r
+        ]
+        assert len(loaded) == len(set(loaded))
+
     def test_error_when_stdout_is_a_tty(self, tmp_path, simple_test_file):
         # GIVEN
         results_file, source_file = generate_sample_results(
@@ -778,6 +837,95 @@ class TestReporterSubCommands:
             r"Failed to parse allocation records in .*badfile\.bin", proc.stderr
         )
 
+    def test_stats_merges_several_captures(self, tmp_path, simple_test_file):
+        # GIVEN
+        results_file, _ = generate_sample_results(tmp_path, simple_test_file)
+        other_results_file = tmp_path / "other.bin"
+        results_file.rename(other_results_file)
+        results_file, _ = generate_sample_results(tmp_path, simple_test_file)
+
+        # WHEN
+        proc = subprocess.run(
+            [
+                sys.executable,
+                "-m",
+                "memray",
+                "stats",
+                str(results_file),
+                str(other_results_file),
+            ],
+            check=True,
+            capture_output=True,
+            text=True,
+        )
+
+        # THEN
+        assert "Total allocations" in proc.stdout
+
+    @pytest.mark.parametrize("report", ["flamegraph", "table"])
+    def test_report_merges_several_captures(self, tmp_path, simple_test_file, report):
+        # GIVEN
+        results_file, source_file = generate_sample_results(
+            tmp_path, simple_test_file, native=True
+        )
+        other_results_file = tmp_path / "other.bin"
+        results_file.rename(other_results_file)
+        results_file, _ = generate_sample_results(
+            tmp_path, simple_test_file, native=True
+        )
+        output_file = tmp_path / "output.html"
+
+        # WHEN
+        subprocess.run(
+            [
+                sys.executable,
+                "-m",
+                "memray",
+                report,
+                str(results_file),
+                str(other_results_file),
+                "--output",
+                str(output_file),
+            ],
+            check=True,
+            capture_output=True,
+            text=True,
+        )
+
+        # THEN
+        assert str(source_file) in output_file.read_text()
+
+    @pytest.mark.parametrize("report", ["flamegraph", "table"])
+    def test_report_detects_corrupt_input_among_several(
+        self, tmp_path, simple_test_file, report
+    ):
+        # GIVEN
+        results_file, _ = generate_sample_results(tmp_path, simple_test_file)
+        bad_file = Path(tmp_path) / "badfile.bin"
+        bad_file.write_text("This is some garbage")
+
+        # WHEN
+        proc = subprocess.run(
+            [
+                sys.executable,
+                "-m",
+                "memray",
+                report,
+                str(results_file),
+                str(bad_file),
+                "--output",
+                str(tmp_path / "output.html"),
+            ],
+            capture_output=True,
+            text=True,
+        )
+
+        # THEN
+        assert proc.returncode == 1
+        assert re.match(
+            r"Failed to parse allocation records in .*badfile\.bin", proc.stderr
+        )
+
     @pytest.mark.parametrize("report", ["flamegraph", "table"])
     def test_report_leaks_argument(self, tmp_path, simple_test_file, report):
         results_file, source_file = generate_sample_results(
@@ -942,6 +1090,67 @@ class TestLiveRemoteSubcommand:
         assert server.returncode == 0
         assert client.returncode == 0
 
+    def test_slow_client_receives_every_record_in_order(self, free_port, tmp_path):
+        # GIVEN
+        n_allocations = 200_000
+        test_file = tmp_path / "test.py"
+        test_file.write_text(
+            textwrap.dedent(
+                f"""\
+                from memray._test import MemoryAllocator
+                allocator = MemoryAllocator()
+                for size in range(1, {n_allocations + 1}):
+                    allocator.valloc(size)
+                    allocator.free()
+                """
+            )
+        )
+        received = tmp_path / "received.bin"
+
+        server = subprocess.Popen(
+            [
+                sys.executable,
+                "-m",
+                "memray",
+                "run",
+                "--live-remote",
+                "--live-port",
+                str(free_port),
+                str(test_file),
+            ],
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        _wait_until_process_blocks(server.pid)
+
+        # WHEN
+        # Read much slower than the records are written, so that the tracker
+        # fills its buffers and has to wait for them to be sent.
+        try:
+            with socket.create_connection(("127.0.0.1", free_port)) as client:
+                client.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+                with received.open("wb") as output:
+                    while True:
+                        data = client.recv(4096)
+                        if not data:
+                            break
+                        output.write(data)
+                        time.sleep(0.0005)
+            server.communicate(timeout=TIMEOUT)
+        except BaseException:
+            server.kill()
+            server.wait(timeout=TIMEOUT)
+            raise
+
+        # THEN
+        assert server.returncode == 0
+        sizes = [
+            record.size
+            for record in FileReader(received).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert sizes == list(range(1, n_allocations + 1))
+
     def test_live_tracking_waits_for_client(self, simple_test_file):
         # GIVEN/WHEN
         server = subprocess.Popen(
@@ -1273,3 +1482,32 @@ class TestTransformSubCommands:
         if "<unknown stack>" in output_text:
             pytest.xfail("Hybrid stack generation is not fully working")
         assert str(source_file) in output_text
+
+    def test_pprof_format(self, tmp_path, simple_test_file):
+        results_file, source_file = generate_sample_results(
+            tmp_path, simple_test_file, native=True
+        )
+
+        # WHEN
+        subprocess.run(
+            [
+                sys.executable,
+                "-m",
+                "memray",
+                "transform",
+                "pprof",
+                str(results_file),
+            ],
+            check=True,
+            capture_output=True,
+            text=True,
+        )
+
+        # THEN
+        output_file = tmp_path / "memray-pprof-result.pb.gz"
+        assert output_file.exists()
+        profile_data = gzip.decompress(output_file.read_bytes())
+        assert b"inuse_space" in profile_data
+        if b"<unknown stack>" in profile_data:
+            pytest.xfail("Hybrid stack generation is not fully working")
+        assert str(source_file).encode() in profile_data
@@ -1,4 +1,5 @@
 import functools
+import gc
 import os
 import shutil
 import subprocess
@@ -116,6 +117,98 @@ def test_simple_call_chain_with_native_tracking(tmpdir, monkeypatch):
     assert expected_symbols == [stack[0] for stack in valloc.native_stack_trace()[:3]]
 
 
+def test_simple_call_chain_with_frame_pointer_unwinding(tmpdir, monkeypatch):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+
+    # WHEN
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_simple  # type: ignore
+
+        with Tracker(output, native_traces=True, frame_pointer_unwinding=True):
+            run_simple()
+
+    # THEN
+    records = list(FileReader(output).get_allocation_records())
+    vallocs = [
+        record
+        for record in filter_relevant_allocations(records)
+        if record.allocator == AllocatorType.VALLOC
+    ]
+
+    assert len(vallocs) == 1
+    (valloc,) = vallocs
+
+    # The extension is built without optimizations, so it has frame pointers.
+    expected_symbols = ["baz", "bar", "foo"]
+    assert expected_symbols == [stack[0] for stack in valloc.native_stack_trace()[:3]]
+
+
+def test_frame_pointer_unwinding_requires_native_traces(tmp_path):
+    with pytest.raises(ValueError, match="requires native_traces"):
+        Tracker(tmp_path / "test.bin", frame_pointer_unwinding=True)
+
+
+@pytest.mark.parametrize("frame_pointer_unwinding", [False, True])
+def test_native_stacks_are_cut_to_max_native_depth(
+    tmpdir, monkeypatch, frame_pointer_unwinding
+):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+
+    # WHEN
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_simple  # type: ignore
+
+        with Tracker(
+            output,
+            native_traces=True,
+            frame_pointer_unwinding=frame_pointer_unwinding,
+            max_native_depth=3,
+        ):
+            for _ in range(2):
+                run_simple()
+
+    # THEN
+    records = list(FileReader(output).get_allocation_records())
+    vallocs = [
+        record
+        for record in filter_relevant_allocations(records)
+        if record.allocator == AllocatorType.VALLOC
+    ]
+
+    # The second stack can be unwound from the frames cached for the first.
+    assert len(vallocs) == 2
+    for valloc in vallocs:
+        symbols = [frame[0] for frame in valloc.native_stack_trace()]
+        assert symbols == ["baz", "bar", "foo", "<truncated>"]
+
+
+def test_max_native_depth_requires_native_traces(tmp_path):
+    with pytest.raises(ValueError, match="requires native_traces"):
+        Tracker(tmp_path / "test.bin", max_native_depth=10)
+
+
 @pytest.mark.skipif(
     sys.platform == "darwin",
     reason="we cannot use debug information to resolve inline functions on macOS",
@@ -518,3 +611,218 @@ def test_native_tracing_header(native_traces, tmpdir):
 
     # THEN
     assert FileReader(output).metadata.has_native_traces is native_traces
+
+
+@pytest.mark.skipif(
+    sys.platform == "darwin",
+    reason="the symbol cache relies on ELF build ids",
+)
+def test_native_symbols_are_cached_across_readers(tmp_path, monkeypatch):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+    cache_dir = tmp_path / "cache"
+    monkeypatch.setenv("MEMRAY_SYMBOL_CACHE_DIR", str(cache_dir))
+
+    with Tracker(output, native_traces=True):
+        allocator.valloc(1234)
+
+    def native_stack():
+        (valloc,) = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        return valloc.native_stack_trace()
+
+    # WHEN
+    first_stack = native_stack()
+    gc.collect()
+    second_stack = native_stack()
+
+    # THEN
+    assert list(cache_dir.glob("*.symbols"))
+    assert first_stack == second_stack
+
+
+def test_native_symbols_only_resolves_function_names(tmp_path, monkeypatch):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    extension_path = tmp_path / "multithreaded_extension"
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+    monkeypatch.setenv("MEMRAY_SYMBOL_CACHE_DIR", "")
+
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_simple  # type: ignore
+
+        with Tracker(output, native_traces=True):
+            run_simple()
+
+    # WHEN
+    reader = FileReader(output, native_symbols_only=True)
+    (valloc,) = [
+        record
+        for record in filter_relevant_allocations(reader.get_allocation_records())
+        if record.allocator == AllocatorType.VALLOC
+    ]
+
+    # THEN
+    native_stack = valloc.native_stack_trace()[:3]
+    assert [func for func, _, _ in native_stack] == ["baz", "bar", "foo"]
+    assert all(filename == "<unknown>" for _, filename, _ in native_stack)
+    assert all(line == 0 for _, _, line in native_stack)
+
+
+def test_batch_resolved_native_stacks_match_resolving_each_frame(
+    tmp_path, monkeypatch
+):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    extension_path = tmp_path / "multithreaded_extension"
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+    # Keep the second reader from reusing what the first one resolved.
+    monkeypatch.setenv("MEMRAY_SYMBOL_CACHE_DIR", "")
+    allocator = MemoryAllocator()
+
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        with Tracker(output, native_traces=True):
+            allocator.valloc(4321)
+            allocator.free()
+            # Loading the extension while tracking adds a memory map generation.
+            from native_ext import run_deep  # type: ignore
+            from native_ext import run_in_thread  # type: ignore
+            from native_ext import run_inline  # type: ignore
+            from native_ext import run_simple  # type: ignore
+
+            run_simple()
+            run_inline()
+            run_in_thread()
+            run_deep(50)
+            allocator.valloc(4321)
+            allocator.free()
+
+    # WHEN
+    # Temporary allocations are resolved in one batch per snapshot, and
+    # allocation records resolve their frames one by one.
+    batch_resolved = {
+        tuple(record.native_stack_trace())
+        for record in FileReader(output).get_temporary_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    }
+    resolved_one_by_one = {
+        tuple(record.native_stack_trace())
+        for record in filter_relevant_allocations(
+            FileReader(output).get_allocation_records()
+        )
+        if record.allocator == AllocatorType.VALLOC
+    }
+
+    # THEN
+    assert batch_resolved == resolved_one_by_one
+    assert len(batch_resolved) >= 5
+    filenames = {filename for stack in batch_resolved for _, filename, _ in stack}
+    assert len(filenames) > 1
+    assert any(filename.endswith("native_ext.c") for filename in filenames)
+
+
+def test_incremental_unwinds_match_unwinding_from_scratch(tmp_path, monkeypatch):
+    """Each thread reuses what its previous unwind found for the frames that
+    are still live, which must give the same stacks as a full unwind no matter
+    how the stack changed between allocations."""
+    # GIVEN
+    extension_path = tmp_path / "multithreaded_extension"
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_deep  # type: ignore
+        from native_ext import run_recursive  # type: ignore
+        from native_ext import run_simple  # type: ignore
+
+    def callback(n):
+        return run_recursive(n, callback)
+
+    scenarios = {
+        "simple": run_simple,
+        "shallow": functools.partial(run_deep, 10),
+        "deep": functools.partial(run_deep, 200),
+        "deeper": functools.partial(run_deep, 1000),
+        "recursive": functools.partial(run_recursive, 1, callback),
+        "more recursive": functools.partial(run_recursive, 5, callback),
+    }
+    # Deeper and shallower stacks alternate, and so do native recursion
+    # and recursion through Python.
+    sequence = [
+        "deep",
+        "simple",
+        "deeper",
+        "shallow",
+        "more recursive",
+        "deep",
+        "recursive",
+        "deeper",
+        "deeper",
+        "simple",
+        "more recursive",
+        "shallow",
+        "recursive",
+    ]
+
+    def run_scenarios(names):
+        for name in names:
+            scenarios[name]()
+
+    def valloc_stacks(output):
+        return [
+            tuple(record.native_stack_trace())
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+
+    # WHEN
+    # A new tracker forgets the unwinds done before it started, so nothing
+    # cached while running the other scenarios can end up in these stacks.
+    expected = {}
+    for i, name in enumerate(scenarios):
+        output = tmp_path / f"expected_{i}.bin"
+        with Tracker(output, native_traces=True):
+            run_scenarios([name])
+        (expected[name],) = valloc_stacks(output)
+
+    output = tmp_path / "test.bin"
+    with Tracker(output, native_traces=True):
+        run_scenarios(sequence)
+
+    # THEN
+    stacks = valloc_stacks(output)
+    assert len(stacks) == len(sequence)
+    for name, stack in zip(sequence, stacks):
+        assert stack == expected[name], name
+
+    def count(name, function):
+        return sum(function in frame[0] for frame in expected[name])
+
+    assert [frame[0] for frame in expected["simple"][:3]] == ["baz", "bar", "foo"]
+    assert count("deeper", "deep_call") == 1001
+    assert count("shallow", "deep_call") == 11
+    assert count("more recursive", "run_recursive") == 6
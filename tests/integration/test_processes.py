@@ -183,3 +183,47 @@ def test_stack_cleanup_after_fork(tmpdir):
     # THEN
 
     assert result == [None]
+
+
+@pytest.mark.no_cover
+def test_child_capture_continues_from_parent_capture(tmpdir):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+
+    # WHEN
+    with Tracker(output, follow_fork=True):
+        # The frames of this call are written to the parent's capture, and
+        # the child's one refers to them instead of writing them again.
+        multiproc_func(1)
+        with Pool(1) as p:
+            p.map(multiproc_func, [1])
+
+    # THEN
+    (child_file,) = Path(tmpdir).glob("test.bin.*")
+    child_vallocs = [
+        record
+        for record in filter_relevant_allocations(
+            FileReader(child_file).get_allocation_records()
+        )
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert len(child_vallocs) == 1
+    (valloc,) = child_vallocs
+    assert "multiproc_func" in [frame[0] for frame in valloc.stack_trace()]
+
+
+@pytest.mark.no_cover
+def test_child_capture_can_not_be_read_without_parent_capture(tmpdir):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    with Tracker(output, follow_fork=True):
+        with Pool(1) as p:
+            p.map(multiproc_func, [1])
+    (child_file,) = Path(tmpdir).glob("test.bin.*")
+
+    # WHEN
+    output.unlink()
+
+    # THEN
+    with pytest.raises(OSError, match="parent process"):
+        FileReader(child_file)
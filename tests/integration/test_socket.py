@@ -1,9 +1,11 @@
 """Tests to exercise socket-based read and write operations in the Tracker."""
 
 import os
+import socket
 import subprocess
 import sys
 import textwrap
+import threading
 import time
 from contextlib import contextmanager
 from pathlib import Path
@@ -15,6 +17,8 @@ import pytest
 
 from memray import AllocatorType
 from memray import SocketReader
+from memray._relay import LiveRelay
+from memray._relay import RelayReader
 from tests.utils import filter_relevant_allocations
 
 TIMEOUT = 5
@@ -84,6 +88,23 @@ ALLOCATE_MANY_THEN_SNAPSHOT_THEN_FREE_MANY = textwrap.dedent(
     """
 )
 
+COMPRESSED_ALLOCATE_MANY_THEN_SNAPSHOT_THEN_FREE_MANY = textwrap.dedent(
+    f"""
+        def get_tracker():
+            return Tracker(
+                destination=SocketDestination(server_port=port, compress=True)
+            )
+
+        allocators = [MemoryAllocator() for _ in range({MULTI_ALLOCATION_COUNT})]
+        with get_tracker():
+            for allocator in allocators:
+                allocator.valloc({ALLOCATION_SIZE})
+            snapshot_point()
+            for allocator in allocators:
+                allocator.free()
+    """
+)
+
 
 @contextmanager
 def run_till_snapshot_point(
@@ -280,6 +301,53 @@ class TestSocketReaderAccess:
         assert filename.endswith("/_test.py")
         assert 0 < lineno < 200
 
+    def test_compressed_stream(self, free_port: int, tmp_path: Path) -> None:
+        # GIVEN
+        reader = SocketReader(port=free_port)
+        program = COMPRESSED_ALLOCATE_MANY_THEN_SNAPSHOT_THEN_FREE_MANY
+
+        # WHEN
+        with run_till_snapshot_point(
+            program,
+            reader=reader,
+            tmp_path=tmp_path,
+            free_port=free_port,
+        ):
+            unfiltered_snapshot = list(reader.get_current_snapshot(merge_threads=False))
+
+        # THEN
+        snapshot = list(filter_relevant_allocations(unfiltered_snapshot))
+        assert len(snapshot) == 1
+
+        allocation = snapshot[0]
+        assert allocation.size == ALLOCATION_SIZE * MULTI_ALLOCATION_COUNT
+        assert allocation.n_allocations == MULTI_ALLOCATION_COUNT
+        assert allocation.allocator == AllocatorType.VALLOC
+
+    @pytest.mark.valgrind
+    def test_repeated_snapshots_reuse_unchanged_records(
+        self, free_port: int, tmp_path: Path
+    ) -> None:
+        # GIVEN
+        reader = SocketReader(port=free_port)
+        program = ALLOCATE_THEN_SNAPSHOT_THEN_FREE
+
+        # WHEN
+        with run_till_snapshot_point(
+            program,
+            reader=reader,
+            tmp_path=tmp_path,
+            free_port=free_port,
+        ):
+            first = list(reader.get_current_snapshot(merge_threads=False))
+            second = list(reader.get_current_snapshot(merge_threads=False))
+
+        # THEN
+        (first_allocation,) = filter_relevant_allocations(first)
+        (second_allocation,) = filter_relevant_allocations(second)
+        assert second_allocation is first_allocation
+        assert second_allocation.size == ALLOCATION_SIZE
+
     @pytest.mark.valgrind
     def test_multi_allocation_snapshot(self, free_port: int, tmp_path: Path) -> None:
         # GIVEN
@@ -420,3 +488,57 @@ class TestSocketReaderAccess:
         # THEN
         assert len(traces) >= MAX_TRACES
         proc.returncode == 0
+
+
+class TestRelay:
+    @staticmethod
+    def wait_for_allocations(viewer: RelayReader) -> list:
+        deadline = time.monotonic() + TIMEOUT
+        while time.monotonic() < deadline:
+            snapshot = list(
+                filter_relevant_allocations(
+                    viewer.get_current_snapshot(merge_threads=False)
+                )
+            )
+            if snapshot:
+                return snapshot
+            time.sleep(0.05)
+        return []
+
+    def test_viewers_share_the_snapshot(self, free_port: int, tmp_path: Path) -> None:
+        # GIVEN
+        with socket.socket() as s:
+            s.bind(("", 0))
+            relay_port = s.getsockname()[1]
+        relay = LiveRelay(free_port, relay_port)
+        relay_thread = threading.Thread(target=relay.serve)
+        relay_thread.start()
+        first_viewer = RelayReader(relay_port)
+        second_viewer = RelayReader(relay_port)
+        program = ALLOCATE_MANY_THEN_SNAPSHOT_THEN_FREE_MANY
+
+        # WHEN
+        with run_till_snapshot_point(
+            program,
+            reader=first_viewer,
+            tmp_path=tmp_path,
+            free_port=free_port,
+        ):
+            with second_viewer:
+                snapshots = [
+                    self.wait_for_allocations(viewer)
+                    for viewer in (first_viewer, second_viewer)
+                ]
+                assert first_viewer.pid == second_viewer.pid
+        relay_thread.join(timeout=TIMEOUT)
+
+        # THEN
+        assert not relay_thread.is_alive()
+        for snapshot in snapshots:
+            assert len(snapshot) == 1
+            allocation = snapshot[0]
+            assert allocation.size == ALLOCATION_SIZE * MULTI_ALLOCATION_COUNT
+            assert allocation.n_allocations == MULTI_ALLOCATION_COUNT
+            symbol, filename, lineno = allocation.stack_trace()[0]
+            assert symbol == "valloc"
+            assert filename.endswith("/_test.py")
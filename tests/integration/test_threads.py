@@ -1,10 +1,15 @@
+import collections
+import mmap
 import threading
 from pathlib import Path
 
+import pytest
+
 from memray import AllocatorType
 from memray import FileReader
 from memray import Tracker
 from memray._test import MemoryAllocator
+from memray._test import MmapAllocator
 from memray._test import set_thread_name
 from tests.utils import filter_relevant_allocations
 from tests.utils import skip_if_macos
@@ -94,3 +99,295 @@ def test_thread_name(tmpdir):
     (valloc,) = vallocs
     assert valloc.size == 1234
     assert "my thread name" in valloc.thread_name
+
+
+def test_per_thread_buffers_keep_records_in_order(tmpdir):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    allocators = [MemoryAllocator() for _ in range(4)]
+
+    def allocating_function(allocator):
+        for _ in range(100):
+            allocator.valloc(1234)
+            allocator.free()
+        allocator.valloc(4321)
+
+    # WHEN
+    with Tracker(output, per_thread_buffers=True):
+        threads = [
+            threading.Thread(target=allocating_function, args=(allocator,))
+            for allocator in allocators
+        ]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        # Free the last allocation of each thread from the main thread
+        for allocator in allocators:
+            allocator.free()
+
+    # THEN
+    reader = FileReader(output)
+    relevant_records = list(
+        filter_relevant_allocations(reader.get_allocation_records())
+    )
+    vallocs = [
+        record
+        for record in relevant_records
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    frees = [
+        record for record in relevant_records if record.allocator == AllocatorType.FREE
+    ]
+    assert len(vallocs) == 4 * 101
+    assert len(frees) == 4 * 101
+    thread_tids = {record.tid for record in vallocs}
+    assert len(thread_tids) == 4
+    main_thread_tids = {record.tid for record in frees[-4:]}
+    assert len(main_thread_tids) == 1
+    assert main_thread_tids.isdisjoint(thread_tids)
+
+    leaked = list(filter_relevant_allocations(reader.get_leaked_allocation_records()))
+    assert leaked == []
+
+
+def test_records_of_threads_taking_turns_keep_their_addresses(tmpdir):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    n_threads = 4
+    allocators = [MemoryAllocator() for _ in range(n_threads)]
+    barrier = threading.Barrier(n_threads)
+
+    def allocating_function(allocator, size):
+        for _ in range(50):
+            barrier.wait()
+            allocator.valloc(size)
+            barrier.wait()
+            allocator.free()
+
+    # WHEN
+    with Tracker(output):
+        threads = [
+            threading.Thread(target=allocating_function, args=(allocator, 1000 + i))
+            for i, allocator in enumerate(allocators)
+        ]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+    # THEN
+    reader = FileReader(output)
+    relevant_records = list(
+        filter_relevant_allocations(reader.get_allocation_records())
+    )
+    records_by_tid = {}
+    for record in relevant_records:
+        records_by_tid.setdefault(record.tid, []).append(record)
+    assert len(records_by_tid) == n_threads
+    for records in records_by_tid.values():
+        assert len(records) == 2 * 50
+        vallocs = records[::2]
+        frees = records[1::2]
+        assert all(record.allocator == AllocatorType.VALLOC for record in vallocs)
+        assert all(record.allocator == AllocatorType.FREE for record in frees)
+        assert len({record.size for record in vallocs}) == 1
+        assert [record.address for record in frees] == [
+            record.address for record in vallocs
+        ]
+
+    leaked = list(filter_relevant_allocations(reader.get_leaked_allocation_records()))
+    assert leaked == []
+
+
+
+def test_frames_and_stacks_first_seen_by_several_threads_at_once(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    n_threads = 8
+    n_functions = 1000
+    n_shared = 50
+    barrier = threading.Barrier(n_threads)
+
+    def define_functions(filename, template, count):
+        source = "".join(template.format(i=i) for i in range(count))
+        namespace = {}
+        exec(compile(source, filename, "exec"), namespace)
+        return [namespace[f"function_{i}"] for i in range(count)]
+
+    # Every thread interns its own frames and also races the others to
+    # intern the shared ones, growing the frame tables and stack trees.
+    shared = define_functions(
+        "shared.py",
+        "def function_{i}(function, allocate, size):\n"
+        "    return function(allocate, size)\n",
+        n_shared,
+    )
+    unique = [
+        define_functions(
+            f"thread_{thread}.py",
+            "def function_{i}(allocate, size):\n    return allocate(size)\n",
+            n_functions,
+        )
+        for thread in range(n_threads)
+    ]
+
+    def allocating_function(thread):
+        allocator = MemoryAllocator()
+        barrier.wait()
+        for i, function in enumerate(unique[thread]):
+            size = 1 + thread * n_functions + i
+            shared[i % n_shared](function, allocator.valloc, size)
+            allocator.free()
+
+    # WHEN
+    with Tracker(output):
+        threads = [
+            threading.Thread(target=allocating_function, args=(thread,))
+            for thread in range(n_threads)
+        ]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+    # THEN
+    vallocs = [
+        record
+        for record in FileReader(output).get_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert len(vallocs) == n_threads * n_functions
+    for record in vallocs:
+        thread, i = divmod(record.size - 1, n_functions)
+        (_, unique_frame, shared_frame, caller, *_) = record.stack_trace()
+        assert unique_frame == (f"function_{i}", f"thread_{thread}.py", 2 * i + 2)
+        shared_i = i % n_shared
+        assert shared_frame == (f"function_{shared_i}", "shared.py", 2 * shared_i + 2)
+        assert caller[0] == "allocating_function"
+    assert len({record.tid for record in vallocs}) == n_threads
+
+RANGED_ALLOCATORS = {AllocatorType.MMAP, AllocatorType.MUNMAP}
+DEALLOCATORS = {
+    AllocatorType.FREE,
+    AllocatorType.MUNMAP,
+    AllocatorType.PYMALLOC_FREE,
+    AllocatorType.CUSTOM_FREE,
+    AllocatorType.PYMALLOC_ARENA_FREE,
+}
+
+
+def allocate_with_malloc_and_mmap(n_iterations):
+    allocators = [MemoryAllocator() for _ in range(4)]
+    for i in range(n_iterations):
+        # Some allocations are freed right away, some later, some never.
+        allocator = allocators[i % len(allocators)]
+        allocator.valloc(1000 + i)
+        if i % 3 == 0:
+            allocator.free()
+        elif i % 3 == 1 and i >= len(allocators):
+            allocators[(i - 1) % len(allocators)].free()
+
+        mapping = MmapAllocator(4 * mmap.PAGESIZE)
+        if i % 4 == 0:
+            mapping.munmap(4 * mmap.PAGESIZE)
+        elif i % 4 == 1:
+            mapping.munmap(mmap.PAGESIZE, offset=mmap.PAGESIZE)
+        elif i % 4 == 2:
+            mapping.munmap(2 * mmap.PAGESIZE)
+
+
+def track_threads_allocating_with_malloc_and_mmap(output, n_threads=8):
+    with Tracker(output):
+        threads = [
+            threading.Thread(target=allocate_with_malloc_and_mmap, args=(200,))
+            for _ in range(n_threads)
+        ]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+
+def totals_by_location(records, merge_threads):
+    totals = collections.Counter()
+    for record in records:
+        if "allocate_with_malloc_and_mmap" not in {
+            function for function, *_ in record.stack_trace()
+        }:
+            continue
+        location = (
+            tuple(record.stack_trace()),
+            None if merge_threads else record.tid,
+        )
+        totals[location, "size"] += record.size
+        totals[location, "n_allocations"] += record.n_allocations
+    return totals
+
+
+def temporary_allocations(records, threshold):
+    # The same rules as the temporary allocations aggregator, one record at a
+    # time: a deallocation makes the latest allocation at its address
+    # temporary if it is among the last threshold + 1 of its thread.
+    recent_by_tid = collections.defaultdict(
+        lambda: collections.deque(maxlen=threshold + 1)
+    )
+    for record in records:
+        recent = recent_by_tid[record.tid]
+        if record.allocator not in DEALLOCATORS:
+            recent.append(record)
+            continue
+        for allocation in reversed(recent):
+            if allocation.address != record.address:
+                continue
+            if record.allocator not in RANGED_ALLOCATORS or (
+                allocation.size == record.size
+            ):
+                yield allocation
+            break
+
+
+@pytest.mark.parametrize("merge_threads", [True, False])
+def test_parallel_leaks_match_the_serial_aggregator(tmp_path, merge_threads):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    track_threads_allocating_with_malloc_and_mmap(output)
+
+    # WHEN
+    leaks = FileReader(output).get_leaked_allocation_records(
+        merge_threads=merge_threads
+    )
+    reader = FileReader(output)
+    ((_, snapshot),) = reader.get_snapshots(
+        [reader.metadata.total_allocations], merge_threads=merge_threads
+    )
+
+    # THEN
+    expected = totals_by_location(snapshot, merge_threads)
+    assert expected
+    assert totals_by_location(leaks, merge_threads) == expected
+
+
+@pytest.mark.parametrize("merge_threads", [True, False])
+@pytest.mark.parametrize("threshold", [1, 5])
+def test_parallel_temporary_allocations_match_a_serial_scan(
+    tmp_path, merge_threads, threshold
+):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    track_threads_allocating_with_malloc_and_mmap(output)
+
+    # WHEN
+    temporary = FileReader(output).get_temporary_allocation_records(
+        merge_threads=merge_threads, threshold=threshold
+    )
+    records = FileReader(output).get_allocation_records()
+    expected_records = list(temporary_allocations(records, threshold))
+
+    # THEN
+    expected = totals_by_location(expected_records, merge_threads)
+    assert {record.allocator for record in expected_records} >= {
+        AllocatorType.VALLOC,
+        AllocatorType.MMAP,
+    }
+    assert totals_by_location(temporary, merge_threads) == expected
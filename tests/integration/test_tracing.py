@@ -288,6 +288,9 @@ def test_traceback_for_high_watermark_records_can_be_retrieved_twice(tmpdir):
     assert traceback1 == traceback2
 
 
+@pytest.mark.skipif(
+    sys.version_info >= (3, 12), reason="Stacks are followed with sys.monitoring"
+)
 def test_profile_function_is_restored_after_tracking(tmpdir):
     # GIVEN
     def profilefunc(*args):
@@ -306,6 +309,31 @@ def test_profile_function_is_restored_after_tracking(tmpdir):
     assert sys.getprofile() == profilefunc
 
 
+@pytest.mark.skipif(
+    sys.version_info < (3, 12), reason="sys.monitoring was added in Python 3.12"
+)
+def test_profile_function_is_left_alone_with_sys_monitoring(tmpdir):
+    # GIVEN
+    def profilefunc(*args):
+        pass
+
+    output = Path(tmpdir) / "test.bin"
+
+    # WHEN
+    sys.setprofile(profilefunc)
+    try:
+        with Tracker(output):
+            profile_function = sys.getprofile()
+            tools = {sys.monitoring.get_tool(tool_id) for tool_id in range(6)}
+    finally:
+        sys.setprofile(None)
+
+    # THEN
+    assert profile_function is profilefunc
+    assert "memray" in tools
+    assert "memray" not in {sys.monitoring.get_tool(tool_id) for tool_id in range(6)}
+
+
 def test_initial_tracking_frames_are_correctly_populated(tmpdir):
     # GIVEN
     allocator = MemoryAllocator()
@@ -627,6 +655,56 @@ def test_allocation_in_thread_before_reacquiring_gil_after_tracking_starts(tmp_p
     assert funcs1 == funcs2 == expected
 
 
+def test_stacks_of_threads_running_when_tracking_starts(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    threads_waiting = threading.Barrier(5)
+    tracking_started = threading.Event()
+    output = tmp_path / "test.bin"
+
+    def wait_then_allocate():
+        threads_waiting.wait()
+        tracking_started.wait()
+        allocator.valloc(1234)
+        allocator.free()
+
+    def nested(depth):
+        if depth:
+            nested(depth - 1)
+        else:
+            wait_then_allocate()
+
+    threads = [threading.Thread(target=nested, args=(depth,)) for depth in range(4)]
+    for thread in threads:
+        thread.start()
+    threads_waiting.wait()
+
+    # WHEN
+    with Tracker(output):
+        tracking_started.set()
+        for thread in threads:
+            thread.join()
+
+    # THEN
+    allocations = list(FileReader(output).get_allocation_records())
+    vallocs = [
+        event
+        for event in allocations
+        if event.size == 1234 and event.allocator == AllocatorType.VALLOC
+    ]
+    assert len(vallocs) == 4
+
+    stacks = sorted(
+        [frame[0] for frame in valloc.stack_trace()] for valloc in vallocs
+    )
+    assert stacks == sorted(
+        ["valloc", "wait_then_allocate"]
+        + ["nested"] * (depth + 1)
+        + ["run", "_bootstrap_inner", "_bootstrap"]
+        for depth in range(4)
+    )
+
+
 def test_thread_surviving_multiple_trackers(tmp_path):
     # GIVEN
     orig_tracker_used = threading.Event()
@@ -896,6 +974,9 @@ def test_cython_frame_in_pre_existing_thread_stack_when_restarting_tracking(tmp_
     assert alloc2_funcs[:2] == ["valloc", "thread_body"]
 
 
+@pytest.mark.skipif(
+    sys.version_info >= (3, 12), reason="Stacks are followed with sys.monitoring"
+)
 def test_allocation_after_unsetting_profile_function(tmp_path):
     """After tracking starts, unset the profile function then allocate.
 
@@ -938,6 +1019,9 @@ def test_allocation_after_unsetting_profile_function(tmp_path):
     assert alloc2_funcs == []
 
 
+@pytest.mark.skipif(
+    sys.version_info >= (3, 12), reason="Stacks are followed with sys.monitoring"
+)
 def test_allocation_in_thread_after_unsetting_profile_function(tmp_path):
     """In a thread, unset the profile function then allocate.
 
@@ -978,6 +1062,45 @@ def test_allocation_in_thread_after_unsetting_profile_function(tmp_path):
     assert alloc2_funcs == []
 
 
+@pytest.mark.skipif(
+    sys.version_info < (3, 12), reason="sys.monitoring was added in Python 3.12"
+)
+def test_unsetting_profile_function_does_not_stop_following_the_stack(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    def func():
+        sys.setprofile(None)
+        allocator.valloc(1234)
+        allocator.free()
+
+    # WHEN
+    with Tracker(output):
+        thread = threading.Thread(target=func)
+        thread.start()
+        thread.join()
+        func()
+
+    # THEN
+    allocations = list(FileReader(output).get_allocation_records())
+
+    vallocs = [
+        event
+        for event in allocations
+        if event.size == 1234 and event.allocator == AllocatorType.VALLOC
+    ]
+    assert len(vallocs) == 2
+
+    in_thread, in_main_thread = vallocs
+    assert [frame[0] for frame in in_thread.stack_trace()][:2] == ["valloc", "func"]
+    assert [frame[0] for frame in in_main_thread.stack_trace()] == [
+        "valloc",
+        "func",
+        "test_unsetting_profile_function_does_not_stop_following_the_stack",
+    ]
+
+
 class TestMmap:
     @classmethod
     def allocating_function(cls):
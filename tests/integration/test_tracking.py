@@ -1,6 +1,9 @@
 import collections
 import datetime
+import gzip
+import io
 import mmap
+import random
 import signal
 import subprocess
 import sys
@@ -11,16 +14,29 @@ from pathlib import Path
 
 import pytest
 
+from memray import AllocationFilter
 from memray import AllocatorType
+from memray import FileDestination
+from memray import FileFormat
 from memray import FileReader
+from memray import LiveHeapDestination
+from memray import TrackedRegion
 from memray import Tracker
+from memray import get_live_snapshot
+from memray._memray import compute_statistics
 from memray._test import MemoryAllocator
 from memray._test import MmapAllocator
+from memray._test import PoolAllocator
 from memray._test import PymallocDomain
 from memray._test import PymallocMemoryAllocator
 from memray._test import _cython_allocate_in_two_places
 from memray._test import allocate_cpp_vector
 from memray._test import fill_cpp_vector
+from memray.reporters import diff
+from memray.reporters import flamegraph
+from memray.reporters import table
+from memray.reporters import transform
+from memray.reporters import tui
 from tests.utils import filter_relevant_allocations
 from tests.utils import run_without_tracer
 
@@ -186,6 +202,50 @@ def test_pymalloc_allocation_tracking_deactivated(
     assert not frees
 
 
+def test_pymalloc_arena_tracking(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+
+    def allocate_small_objects():
+        return [(i, i) for i in range(200_000)]
+
+    # WHEN
+    with Tracker(output, trace_pymalloc_arenas=True):
+        objects = allocate_small_objects()
+        del objects
+
+    # THEN
+    reader = FileReader(output)
+    if reader.metadata.python_allocator != "pymalloc":
+        pytest.skip("pymalloc is not the Python allocator")
+    allocations = list(reader.get_allocation_records())
+    arenas = [
+        event
+        for event in allocations
+        if event.allocator == AllocatorType.PYMALLOC_ARENA_ALLOC
+    ]
+    assert arenas
+    assert all(arena.size >= 256 * 1024 for arena in arenas)
+    assert "allocate_small_objects" in {
+        function for function, _, _ in arenas[0].stack_trace()
+    }
+    assert not [
+        event
+        for event in allocations
+        if event.allocator
+        in (AllocatorType.PYMALLOC_MALLOC, AllocatorType.PYMALLOC_FREE)
+    ]
+
+
+def test_pymalloc_arenas_can_not_be_tracked_with_python_allocators(tmp_path):
+    with pytest.raises(ValueError, match="trace_pymalloc_arenas"):
+        Tracker(
+            tmp_path / "test.bin",
+            trace_pymalloc_arenas=True,
+            trace_python_allocators=True,
+        )
+
+
 def test_mmap_tracking(tmp_path):
     # GIVEN / WHEN
     output = tmp_path / "test.bin"
@@ -209,6 +269,486 @@ def test_mmap_tracking(tmp_path):
     assert len(mmunmap_record) == 1
 
 
+def test_sampled_allocation_tracking(tmp_path):
+    # GIVEN
+    allocators = [MemoryAllocator() for _ in range(1000)]
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output, sampling_interval_bytes=65536):
+        for allocator in allocators:
+            allocator.valloc(100_000)
+        for allocator in allocators:
+            allocator.free()
+
+    # THEN
+    reader = FileReader(output)
+    assert reader.metadata.sampling_interval_bytes == 65536
+
+    peak = [
+        record
+        for record in reader.get_high_watermark_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    estimated_size = sum(record.size for record in peak)
+    assert estimated_size == pytest.approx(1000 * 100_000, rel=0.1)
+
+    leaks = [
+        record
+        for record in reader.get_leaked_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert not leaks
+
+
+def test_overhead_budget_starts_sampling_when_exceeded(tmp_path):
+    # GIVEN
+    small_allocator = MemoryAllocator()
+    allocators = [MemoryAllocator() for _ in range(1000)]
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output, overhead_budget=0.0001):
+        n_small_allocations = 0
+        deadline = time.monotonic() + 2
+        while time.monotonic() < deadline:
+            small_allocator.malloc(16)
+            small_allocator.free()
+            n_small_allocations += 1
+        for allocator in allocators:
+            allocator.valloc(100_000)
+        for allocator in allocators:
+            allocator.free()
+
+    # THEN
+    reader = FileReader(output)
+    assert reader.metadata.sampling_interval_bytes == 0
+
+    small_records = [
+        record
+        for record in reader.get_allocation_records()
+        if record.allocator == AllocatorType.MALLOC
+    ]
+    assert len(small_records) < n_small_allocations
+
+    peak = [
+        record
+        for record in reader.get_high_watermark_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    estimated_size = sum(record.size for record in peak)
+    assert estimated_size == pytest.approx(1000 * 100_000, rel=0.1)
+
+    leaks = [
+        record
+        for record in reader.get_leaked_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert not leaks
+
+
+def test_overhead_budget_must_be_a_percentage(tmp_path):
+    with pytest.raises(ValueError, match="overhead_budget"):
+        Tracker(tmp_path / "test.bin", overhead_budget=100)
+
+
+def test_allocations_below_min_allocation_size_are_only_counted(tmp_path):
+    # GIVEN
+    small_allocators = [MemoryAllocator() for _ in range(100)]
+    large_allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output, min_allocation_size=512):
+        for allocator in small_allocators:
+            allocator.malloc(100)
+        large_allocator.malloc(ALLOC_SIZE)
+        for allocator in small_allocators:
+            allocator.free()
+        large_allocator.free()
+
+    # THEN
+    reader = FileReader(output)
+    assert reader.metadata.min_allocation_size == 512
+
+    allocations = list(reader.get_allocation_records())
+    assert not [
+        event
+        for event in allocations
+        if event.allocator == AllocatorType.MALLOC and event.size < 512
+    ]
+    (large,) = [
+        event
+        for event in allocations
+        if event.allocator == AllocatorType.MALLOC and event.size == ALLOC_SIZE
+    ]
+    frees = [event for event in allocations if event.allocator == AllocatorType.FREE]
+    assert large.address in {event.address for event in frees}
+
+    assert reader.metadata.total_allocations >= len(allocations) + 100
+    stats = compute_statistics(str(output))
+    assert stats.total_num_allocations >= len(allocations) - len(frees) + 100
+    assert stats.total_memory_allocated >= ALLOC_SIZE + 100 * 100
+
+
+def test_only_allocations_in_tracked_regions_are_recorded(tmp_path):
+    # GIVEN
+    outside_allocator = MemoryAllocator()
+    inside_allocator = MemoryAllocator()
+    decorated_allocator = MemoryAllocator()
+    escaping_allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    @TrackedRegion()
+    def allocate_in_region():
+        decorated_allocator.malloc(ALLOC_SIZE + 2)
+        decorated_allocator.free()
+
+    # WHEN
+    with Tracker(output, regions_only=True):
+        outside_allocator.malloc(ALLOC_SIZE)
+        with TrackedRegion():
+            inside_allocator.malloc(ALLOC_SIZE + 1)
+            with TrackedRegion():
+                escaping_allocator.malloc(ALLOC_SIZE + 3)
+            inside_allocator.free()
+        allocate_in_region()
+        outside_allocator.free()
+        escaping_allocator.free()
+
+    # THEN
+    allocations = list(FileReader(output).get_allocation_records())
+    sizes = {
+        event.size: event.address
+        for event in allocations
+        if event.allocator == AllocatorType.MALLOC
+    }
+    frees = {
+        event.address for event in allocations if event.allocator == AllocatorType.FREE
+    }
+    assert ALLOC_SIZE not in sizes
+    assert {ALLOC_SIZE + 1, ALLOC_SIZE + 2, ALLOC_SIZE + 3} <= sizes.keys()
+    assert sizes[ALLOC_SIZE + 1] in frees
+    assert sizes[ALLOC_SIZE + 2] in frees
+    # Memory allocated in a region is followed after the region ends.
+    assert sizes[ALLOC_SIZE + 3] in frees
+
+
+def test_tracked_regions_only_apply_to_the_thread_that_entered_them(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    def allocate():
+        allocator.malloc(ALLOC_SIZE)
+        allocator.free()
+
+    # WHEN
+    with Tracker(output, regions_only=True):
+        with TrackedRegion():
+            thread = threading.Thread(target=allocate)
+            thread.start()
+            thread.join()
+
+    # THEN
+    assert not [
+        event
+        for event in FileReader(output).get_allocation_records()
+        if event.allocator == AllocatorType.MALLOC and event.size == ALLOC_SIZE
+    ]
+
+
+@pytest.mark.parametrize(
+    "tracker_kwargs",
+    [
+        {},
+        {"native_traces": True},
+        {"intern_python_stacks": True},
+        {"per_thread_buffers": True},
+    ],
+)
+def test_allocations_reported_through_the_c_api(tmp_path, tracker_kwargs):
+    # GIVEN
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output, **tracker_kwargs):
+        pool = PoolAllocator(1024 * 1024)
+        first = pool.allocate(100)
+        second = pool.allocate(200)
+        pool.deallocate(first)
+
+    # THEN
+    allocations = list(FileReader(output).get_allocation_records())
+    assert not [event for event in allocations if event.size == 1024 * 1024]
+    custom = [
+        (event.allocator, event.address, event.size)
+        for event in allocations
+        if event.allocator in (AllocatorType.CUSTOM_MALLOC, AllocatorType.CUSTOM_FREE)
+    ]
+    assert custom == [
+        (AllocatorType.CUSTOM_MALLOC, first, 100),
+        (AllocatorType.CUSTOM_MALLOC, second, 200),
+        (AllocatorType.CUSTOM_FREE, first, 0),
+    ]
+    (leak,) = [
+        event
+        for event in FileReader(output).get_leaked_allocation_records()
+        if event.allocator == AllocatorType.CUSTOM_MALLOC
+    ]
+    assert leak.address == second
+    (_, function, _), *_ = leak.stack_trace()
+    assert function == "allocate"
+
+
+def test_allocations_reported_through_the_c_api_in_aggregated_files(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+        pool = PoolAllocator(1024 * 1024)
+        pool.deallocate(pool.allocate(100))
+        pool.allocate(200)
+
+    # THEN
+    (leak,) = [
+        event
+        for event in FileReader(output).get_leaked_allocation_records()
+        if event.allocator == AllocatorType.CUSTOM_MALLOC
+    ]
+    assert leak.size == 200
+
+
+def test_statistics_count_allocation_sizes_in_buckets(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output):
+        for size in (10, 10, 1024, 1050, 1100):
+            allocator.valloc(size)
+            allocator.free()
+
+    # THEN
+    stats = compute_statistics(str(output))
+    sizes = stats.allocation_count_by_size
+    # Small sizes are counted exactly, and larger ones by the smallest size
+    # of their bucket, which for sizes from 1024 to 2047 is 32 bytes wide.
+    assert sizes[10] >= 2
+    assert sizes[1024] >= 2
+    assert sizes[1088] >= 1
+    assert 1050 not in sizes
+    assert 1100 not in sizes
+
+
+class TestFlightRecorder:
+    def test_dump_holds_only_the_most_recent_records(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        sizes = range(1024, 1024 + 20_000)
+
+        # WHEN
+        with Tracker(output, flight_recorder_size=64 * 1024) as tracker:
+            for size in sizes:
+                allocator.valloc(size)
+                allocator.free()
+            tracker.dump_flight_recorder()
+
+        # THEN
+        recorded_sizes = [
+            record.size
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert recorded_sizes
+        assert len(recorded_sizes) < len(sizes)
+        assert recorded_sizes == list(sizes[-len(recorded_sizes) :])
+
+    def test_nothing_is_written_without_a_dump(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(
+            destination=FileDestination(output, compress_on_exit=False),
+            flight_recorder_size=64 * 1024,
+        ):
+            allocator.valloc(ALLOC_SIZE)
+            allocator.free()
+
+        # THEN
+        assert output.read_bytes().strip(b"\0") == b""
+
+    def test_dump_on_signal(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(
+            destination=FileDestination(output, compress_on_exit=False),
+            flight_recorder_size=64 * 1024,
+            flight_recorder_signal=signal.SIGUSR2,
+        ):
+            allocator.valloc(ALLOC_SIZE)
+            allocator.free()
+            signal.raise_signal(signal.SIGUSR2)
+            for _ in range(500):
+                if output.read_bytes().strip(b"\0"):
+                    break
+                time.sleep(0.01)
+
+        # THEN
+        allocations = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert [record.size for record in allocations] == [ALLOC_SIZE]
+
+    def test_triggers_require_a_flight_recorder(self, tmp_path):
+        with pytest.raises(ValueError, match="flight_recorder_size"):
+            Tracker(tmp_path / "test.bin", flight_recorder_signal=signal.SIGUSR2)
+
+    def test_dump_requires_a_flight_recorder(self, tmp_path):
+        with Tracker(tmp_path / "test.bin") as tracker:
+            with pytest.raises(RuntimeError, match="not a flight recorder"):
+                tracker.dump_flight_recorder()
+
+
+class TestRotation:
+    @staticmethod
+    def _allocate_until_rotated(allocator, output, n_files):
+        for _ in range(500):
+            for _ in range(100):
+                allocator.valloc(ALLOC_SIZE)
+                allocator.free()
+            if Path(f"{output}.part{n_files - 1}").exists():
+                return
+            time.sleep(0.01)
+        pytest.fail("The output file was not rotated")
+
+    def test_every_file_can_be_read_on_its_own(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, rotation_size=16 * 1024):
+            self._allocate_until_rotated(allocator, output, 3)
+
+        # THEN
+        paths = [output, *sorted(tmp_path.glob("test.bin.part*"))]
+        assert len(paths) >= 3
+        for path in paths:
+            reader = FileReader(path)
+            allocations = [
+                record
+                for record in reader.get_allocation_records()
+                if record.allocator == AllocatorType.VALLOC
+            ]
+            assert allocations
+            stack = allocations[-1].stack_trace()
+            assert stack[0][0] == "valloc"
+            assert ("_allocate_until_rotated", __file__) in {
+                (function, filename) for function, filename, _ in stack
+            }
+
+    def test_only_the_most_recent_files_are_kept(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, rotation_size=16 * 1024, rotation_max_files=2):
+            self._allocate_until_rotated(allocator, output, 4)
+
+        # THEN
+        assert not output.exists()
+        assert len(list(tmp_path.glob("test.bin.part*"))) == 2
+
+    def test_max_files_requires_a_rotation_budget(self, tmp_path):
+        with pytest.raises(ValueError, match="rotation_max_files"):
+            Tracker(tmp_path / "test.bin", rotation_max_files=2)
+
+    def test_flight_recorder_can_not_rotate(self, tmp_path):
+        with pytest.raises(ValueError, match="flight recorder"):
+            Tracker(
+                tmp_path / "test.bin",
+                rotation_size=1024,
+                flight_recorder_size=64 * 1024,
+            )
+
+
+class TestLiveHeap:
+    @staticmethod
+    def _wait_for_live_sizes(expected):
+        for _ in range(500):
+            sizes = [
+                record.size
+                for record in get_live_snapshot()
+                if record.allocator == AllocatorType.VALLOC
+            ]
+            if sizes == expected:
+                return
+            time.sleep(0.01)
+        pytest.fail(f"The live heap never held {expected}, last held {sizes}")
+
+    def test_snapshot_follows_allocations_and_deallocations(self):
+        # GIVEN
+        allocator = MemoryAllocator()
+
+        # WHEN / THEN
+        with Tracker(destination=LiveHeapDestination(), memory_interval_ms=1):
+            allocator.valloc(ALLOC_SIZE)
+            self._wait_for_live_sizes([ALLOC_SIZE])
+            record = next(
+                record
+                for record in get_live_snapshot()
+                if record.allocator == AllocatorType.VALLOC
+            )
+            assert record.stack_trace()[0][0] == "valloc"
+            allocator.free()
+            self._wait_for_live_sizes([])
+
+    def test_only_the_largest_locations_are_returned_when_asked(self):
+        # GIVEN
+        small_allocator = MemoryAllocator()
+        big_allocator = MemoryAllocator()
+
+        # WHEN
+        with Tracker(destination=LiveHeapDestination(), memory_interval_ms=1):
+            small_allocator.valloc(ALLOC_SIZE)
+            big_allocator.valloc(ALLOC_SIZE * 10)
+            self._wait_for_live_sizes([ALLOC_SIZE * 10, ALLOC_SIZE])
+            top = get_live_snapshot(top=1)
+            small_allocator.free()
+            big_allocator.free()
+
+        # THEN
+        assert [record.size for record in top] == [ALLOC_SIZE * 10]
+
+    def test_snapshot_requires_an_active_live_heap(self, tmp_path):
+        with pytest.raises(RuntimeError, match="LiveHeapDestination"):
+            get_live_snapshot()
+        with Tracker(tmp_path / "test.bin"):
+            with pytest.raises(RuntimeError, match="LiveHeapDestination"):
+                get_live_snapshot()
+
+    def test_top_must_be_positive(self):
+        with Tracker(destination=LiveHeapDestination()):
+            with pytest.raises(ValueError, match="top"):
+                get_live_snapshot(top=0)
+
+    def test_live_heap_can_not_follow_forks(self):
+        with pytest.raises(RuntimeError, match="follow_fork"):
+            Tracker(destination=LiveHeapDestination(), follow_fork=True)
+
+
 def test_pthread_tracking(tmp_path):
     # GIVEN
     allocator = MemoryAllocator()
@@ -313,6 +853,82 @@ def test_no_allocations(tmpdir):
     assert not records
 
 
+def allocate_at_depth(depth, function, *args):
+    if depth:
+        return allocate_at_depth(depth - 1, function, *args)
+    return function(*args)
+
+
+def churn_malloc_and_mmap():
+    """Make thousands of live allocations at a few dozen locations, free them
+    in random order and punch holes in some mapped ranges."""
+    rng = random.Random(1234)
+    allocators = [MemoryAllocator() for _ in range(3000)]
+    for i, allocator in enumerate(allocators):
+        allocate_at_depth(i % 10, allocator.valloc, rng.randint(1, 4096))
+    rng.shuffle(allocators)
+    for allocator in allocators[:2000]:
+        allocator.free()
+    mappings = [MmapAllocator(64 * PAGE_SIZE) for _ in range(20)]
+    for mapping in mappings[:10]:
+        mapping.munmap(2 * PAGE_SIZE, 3 * PAGE_SIZE)
+    # The peak is reached here, with holes in half of the mapped ranges.
+    for i, allocator in enumerate(allocators[:2000]):
+        allocate_at_depth(i % 7, allocator.valloc, rng.randint(1, 4096))
+    rng.shuffle(allocators)
+    for allocator in allocators[:2500]:
+        allocator.free()
+    for mapping in mappings[5:15]:
+        mapping.munmap(2 * PAGE_SIZE)
+    for mapping in mappings[15:]:
+        mapping.munmap(64 * PAGE_SIZE)
+
+
+def replay_heap(records):
+    """Yield the size of the heap after each record, like HighWatermarkFinder
+    computes it, along with the live allocations and mapped ranges."""
+    heap = 0
+    live = {}
+    ranges = []
+    for record in records:
+        if record.allocator == AllocatorType.MMAP:
+            ranges.append((record.address, record.address + record.size, record))
+            heap += record.size
+        elif record.allocator == AllocatorType.MUNMAP:
+            start, end = record.address, record.address + record.size
+            remaining = []
+            for begin, finish, mapping in ranges:
+                heap -= max(0, min(end, finish) - max(start, begin))
+                pieces = ((begin, min(finish, start)), (max(begin, end), finish))
+                remaining.extend(
+                    (begin, finish, mapping)
+                    for begin, finish in pieces
+                    if begin < finish
+                )
+            ranges = remaining
+        elif record.allocator in {
+            AllocatorType.FREE,
+            AllocatorType.PYMALLOC_FREE,
+            AllocatorType.CUSTOM_FREE,
+            AllocatorType.PYMALLOC_ARENA_FREE,
+        }:
+            freed = live.pop(record.address, None)
+            heap -= freed.size if freed else 0
+        else:
+            live[record.address] = record
+            heap += record.size
+        yield heap, live, ranges
+
+
+def totals_by_location(records):
+    totals = collections.Counter()
+    for record in records:
+        location = (tuple(record.stack_trace()), record.tid)
+        totals[location, "size"] += record.size
+        totals[location, "n_allocations"] += record.n_allocations
+    return totals
+
+
 class TestHighWatermark:
     def test_no_allocations_while_tracking(self, tmp_path):
         # GIVEN / WHEN
@@ -806,6 +1422,42 @@ class TestHighWatermark:
         peak_memory = sum(x.size for x in peak_allocations)
         assert peak_memory == 10 * PAGE_SIZE
 
+    def test_munmap_across_large_and_small_mmaps(self, tmp_path):
+        """Deallocate a range that starts in the middle of a large mmap'd region
+        and spans the smaller regions mapped right after it."""
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            buf = MmapAllocator(16 * PAGE_SIZE)
+            buf.munmap(16 * PAGE_SIZE)
+
+            # WHEN
+            large = MmapAllocator(8 * PAGE_SIZE, buf.address)
+            for page in range(8, 16):
+                MmapAllocator(PAGE_SIZE, buf.address + page * PAGE_SIZE)
+            large.munmap(8 * PAGE_SIZE, 4 * PAGE_SIZE)
+            # 4 pages of the large region and the last 4 small regions are left.
+
+            MmapAllocator(10 * PAGE_SIZE)
+
+        # THEN
+        reader = FileReader(output)
+        peak_allocations = list(
+            filter_relevant_allocations(
+                reader.get_high_watermark_allocation_records(), ranged=True
+            )
+        )
+        peak_memory = sum(x.size for x in peak_allocations)
+        assert peak_memory == 18 * PAGE_SIZE
+
+        leaked_allocations = list(
+            filter_relevant_allocations(
+                reader.get_leaked_allocation_records(), ranged=True
+            )
+        )
+        leaked_memory = sum(x.size for x in leaked_allocations)
+        assert leaked_memory == 18 * PAGE_SIZE
+
     def test_partial_munmap_multiple_split_in_middle(self, tmp_path):
         """Deallocate pages in of a larger mmap'd area, splitting it into 3 areas."""
         # GIVEN/WHEN
@@ -841,31 +1493,85 @@ class TestHighWatermark:
         peak_memory = sum(x.size for x in peak_allocations)
         assert peak_memory == 17 * PAGE_SIZE
 
-
-class TestLeaks:
-    def test_leaks_allocations_are_detected(self, tmp_path):
+    def test_only_the_largest_locations_are_returned_when_asked(self, tmp_path):
         # GIVEN
-        allocator = MemoryAllocator()
+        allocators = [MemoryAllocator() for _ in range(4)]
         output = tmp_path / "test.bin"
 
         # WHEN
         with Tracker(output):
-            allocator.valloc(1024)
-        allocator.free()
+            allocators[0].valloc(10 * 1024 * 1024)
+            allocators[1].valloc(40 * 1024 * 1024)
+            allocators[2].valloc(20 * 1024 * 1024)
+            allocators[3].valloc(30 * 1024 * 1024)
+            for allocator in allocators:
+                allocator.free()
 
         # THEN
         reader = FileReader(output)
-        all_allocations = list(
-            filter_relevant_allocations(reader.get_allocation_records())
-        )
-        assert len(all_allocations) == 1
-
-        leaked_allocations = list(
-            filter_relevant_allocations(reader.get_leaked_allocation_records())
-        )
-        assert len(leaked_allocations) == 1
+        all_records = list(reader.get_high_watermark_allocation_records())
+        largest = list(reader.get_high_watermark_allocation_records(largest=2))
+        assert len(all_records) > 2
+        assert sorted(record.size for record in largest) == [
+            30 * 1024 * 1024,
+            40 * 1024 * 1024,
+        ]
+        with pytest.raises(ValueError, match="positive"):
+            list(reader.get_high_watermark_allocation_records(largest=0))
 
-        record = leaked_allocations[0]
+    def test_peak_matches_the_snapshot_at_the_high_water_mark(self, tmp_path):
+        """The peak found in one pass is the heap that a snapshot taken at the
+        high water mark index sees."""
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            churn_malloc_and_mmap()
+
+        # WHEN
+        reader = FileReader(output)
+        heap = [size for size, _, _ in replay_heap(reader.get_allocation_records())]
+        # The high water mark is the last time the peak is reached.
+        peak_index = max(range(len(heap)), key=lambda index: (heap[index], index))
+        ((_, snapshot),) = FileReader(output).get_snapshots(
+            [peak_index], merge_threads=False
+        )
+        peak = FileReader(output).get_high_watermark_allocation_records(
+            merge_threads=False
+        )
+
+        # THEN
+        assert heap[peak_index] == reader.metadata.peak_memory
+        assert sum(record.size for record in snapshot) == reader.metadata.peak_memory
+        expected = totals_by_location(snapshot)
+        # Every valloc call site at every depth, and the mmap call site.
+        assert len(expected) >= 2 * (10 + 7 + 1)
+        assert totals_by_location(peak) == expected
+
+
+class TestLeaks:
+    def test_leaks_allocations_are_detected(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            allocator.valloc(1024)
+        allocator.free()
+
+        # THEN
+        reader = FileReader(output)
+        all_allocations = list(
+            filter_relevant_allocations(reader.get_allocation_records())
+        )
+        assert len(all_allocations) == 1
+
+        leaked_allocations = list(
+            filter_relevant_allocations(reader.get_leaked_allocation_records())
+        )
+        assert len(leaked_allocations) == 1
+
+        record = leaked_allocations[0]
         assert record.n_allocations == 1
         assert record.allocator == AllocatorType.VALLOC
         assert record.size == 1024
@@ -989,6 +1695,34 @@ class TestLeaks:
         assert allocation.size == 1024 * 10
         assert allocation.n_allocations == 10
 
+    def test_leaks_match_what_is_left_after_freeing_in_random_order(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            churn_malloc_and_mmap()
+
+        # WHEN
+        leaks = FileReader(output).get_leaked_allocation_records(merge_threads=False)
+
+        # THEN
+        for _, live, ranges in replay_heap(FileReader(output).get_allocation_records()):
+            pass
+        expected = totals_by_location(live.values())
+        for begin, finish, mapping in ranges:
+            location = (tuple(mapping.stack_trace()), mapping.tid)
+            expected[location, "size"] += finish - begin
+        # How many allocations a partially unmapped range counts for is not
+        # something a replay of the records can tell.
+        actual = totals_by_location(
+            record for record in leaks if record.allocator != AllocatorType.MMAP
+        )
+        for record in leaks:
+            if record.allocator == AllocatorType.MMAP:
+                location = (tuple(record.stack_trace()), record.tid)
+                actual[location, "size"] += record.size
+        assert len(live) > 500
+        assert actual == expected
+
     def test_unmatched_deallocations_are_not_reported(self, tmp_path):
         # GIVEN
         allocator = MemoryAllocator()
@@ -1128,6 +1862,7 @@ class TestTemporaryAllocations:
             2,
             5,
             10,
+            1000,
         ],
     )
     def test_temporary_allocations_outside_buffer_are_not_detected(
@@ -1215,6 +1950,36 @@ class TestTemporaryAllocations:
         assert allocation.size == 1024 * 10
         assert allocation.n_allocations == 10
 
+    def test_repeated_temporary_allocations_are_all_counted(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            for _ in range(100):
+                allocator.valloc(1024)
+                allocator.free()
+
+        # THEN
+        reader = FileReader(output)
+        all_allocations = list(
+            filter_relevant_allocations(reader.get_allocation_records())
+        )
+        assert len(all_allocations) == 100 + 100  # 100 x valloc + 100 x free
+
+        temporary_allocations = list(
+            filter_relevant_allocations(reader.get_temporary_allocation_records())
+        )
+        assert len(temporary_allocations) == 1
+        (allocation,) = temporary_allocations
+        assert allocation.size == 1024 * 100
+        assert allocation.n_allocations == 100
+
+        stats = compute_statistics(str(output))
+        assert stats.allocation_count_by_allocator[AllocatorType.VALLOC.name] == 100
+        assert stats.allocation_count_by_size[1024] >= 100
+
     def test_unmatched_allocations_are_not_reported(self, tmp_path):
         # GIVEN
         allocator = MemoryAllocator()
@@ -1364,6 +2129,130 @@ class TestTemporaryAllocations:
             assert sum(allocation.size for allocation in allocations) == 1234
 
 
+class TestAllocationLifetimes:
+    @staticmethod
+    def _lifetimes_by_size(reader):
+        return {
+            entry.record.size: entry
+            for entry in reader.get_allocation_lifetimes()
+            if entry.record.allocator == AllocatorType.VALLOC
+        }
+
+    def test_lifetimes_count_the_allocations_made_in_between(self, tmp_path):
+        # GIVEN
+        long_lived = MemoryAllocator()
+        short_lived = MemoryAllocator()
+        others = [MemoryAllocator() for _ in range(100)]
+        leaked = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            long_lived.valloc(2048)
+            for allocator in others:
+                allocator.valloc(1)
+            short_lived.valloc(1024)
+            short_lived.free()
+            long_lived.free()
+            for allocator in others:
+                allocator.free()
+            leaked.valloc(4096)
+
+        # THEN
+        lifetimes = self._lifetimes_by_size(FileReader(output))
+        assert lifetimes[2048].freed == 1
+        assert lifetimes[2048].never_freed == 0
+        ((lower_bound, count),) = lifetimes[2048].by_allocations
+        assert lower_bound >= 64
+        assert count == 1
+
+        ((lower_bound, count),) = lifetimes[1024].by_allocations
+        assert lower_bound <= 8
+        assert count == 1
+
+        assert lifetimes[100].record.n_allocations == 100
+        assert lifetimes[100].freed == 100
+        assert sum(count for _, count in lifetimes[100].by_allocations) == 100
+
+        assert lifetimes[4096].freed == 0
+        assert lifetimes[4096].never_freed == 1
+        assert lifetimes[4096].by_allocations == []
+
+    def test_lifetimes_in_time_come_from_the_memory_snapshots(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=5):
+            allocator.valloc(1024)
+            time.sleep(0.2)
+            allocator.free()
+
+        # THEN
+        lifetimes = self._lifetimes_by_size(FileReader(output))
+        ((lower_bound, count),) = lifetimes[1024].by_time
+        assert 64 <= lower_bound
+        assert count == 1
+
+    def test_repeated_allocations_live_for_no_allocations(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            for _ in range(1000):
+                allocator.valloc(1024)
+                allocator.free()
+
+        # THEN
+        lifetimes = self._lifetimes_by_size(FileReader(output))
+        entry = lifetimes[1024 * 1000]
+        assert entry.record.n_allocations == 1000
+        assert entry.freed == 1000
+        assert entry.never_freed == 0
+
+    def test_lifetimes_can_be_kept_per_thread(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        def allocate():
+            allocator = MemoryAllocator()
+            allocator.valloc(1234)
+            allocator.free()
+
+        # WHEN
+        with Tracker(output):
+            threads = [threading.Thread(target=allocate) for _ in range(2)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+
+        # THEN
+        reader = FileReader(output)
+        per_thread = [
+            entry
+            for entry in reader.get_allocation_lifetimes(merge_threads=False)
+            if entry.record.allocator == AllocatorType.VALLOC
+        ]
+        assert len({entry.record.tid for entry in per_thread}) == 2
+        assert all(entry.freed == 1 for entry in per_thread)
+        merged = self._lifetimes_by_size(reader)
+        assert merged[2 * 1234].freed == 2
+
+    def test_lifetimes_of_an_aggregated_capture_are_not_available(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            MemoryAllocator().valloc(1024)
+
+        # WHEN/THEN
+        with pytest.raises(NotImplementedError, match="allocation lifetimes"):
+            list(FileReader(output).get_allocation_lifetimes())
+
+
 class TestHeader:
     def test_get_header(self, monkeypatch, tmpdir):
         # GIVEN
@@ -1420,6 +2309,204 @@ class TestHeader:
         assert metadata.command_line == "python -m pytest"
         assert metadata.peak_memory == 1024 * 100
 
+    @pytest.mark.parametrize("compress_on_exit", [True, False])
+    def test_summary_matches_the_records(self, compress_on_exit, tmp_path):
+        # GIVEN
+        allocators = [MemoryAllocator() for _ in range(10)]
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(
+            destination=FileDestination(output, compress_on_exit=compress_on_exit)
+        ):
+            for allocator in allocators:
+                allocator.valloc(ALLOC_SIZE)
+            time.sleep(0.11)
+            for allocator in allocators[:5]:
+                allocator.free()
+            allocators[0].valloc(ALLOC_SIZE * 2)
+            allocators[0].free()
+
+        reader = FileReader(output)
+        peak = filter_relevant_allocations(
+            reader.get_high_watermark_allocation_records(merge_threads=False)
+        )
+        memory_snapshots = list(reader.get_memory_snapshots())
+        n_records = len(list(reader.get_allocation_records()))
+
+        # THEN
+        assert reader.metadata.peak_memory >= 10 * ALLOC_SIZE
+        assert sum(record.size for record in peak) == 10 * ALLOC_SIZE
+        assert reader.metadata.total_allocations == n_records
+        assert any(record.heap >= 10 * ALLOC_SIZE for record in memory_snapshots)
+        assert sorted(memory_snapshots, key=lambda r: r.time) == memory_snapshots
+
+    def test_uncompressed_file_is_trimmed_to_its_records(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(destination=FileDestination(output, compress_on_exit=False)):
+            for _ in range(100):
+                allocator.valloc(1024)
+                allocator.free()
+
+        # THEN
+        contents = output.read_bytes()
+        assert len(contents) < 1024 * 1024
+        assert not contents.endswith(b"\0")
+        assert len(list(FileReader(output).get_allocation_records())) >= 200
+
+    def test_uncompressed_file_space_is_reserved_while_tracking(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        extent_size = 64 * 1024 * 1024
+
+        # WHEN
+        with Tracker(
+            destination=FileDestination(output, compress_on_exit=False),
+            memory_interval_ms=5,
+        ):
+            allocator.valloc(1024)
+            allocator.free()
+            # Wait for a memory record to hand the buffered records off.
+            deadline = time.monotonic() + 5
+            while output.stat().st_size == 0 and time.monotonic() < deadline:
+                time.sleep(0.01)
+            size_while_tracking = output.stat().st_size
+
+        # THEN
+        assert size_while_tracking == extent_size
+        contents = output.read_bytes()
+        assert 0 < len(contents) < extent_size
+        assert not contents.endswith(b"\0")
+
+    def test_uncompressed_file_can_be_read_after_SIGKILL(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        subprocess_code = textwrap.dedent(
+            f"""
+            import os
+            import signal
+            import time
+            from memray import FileDestination
+            from memray import Tracker
+            from memray._test import MemoryAllocator
+
+            allocator = MemoryAllocator()
+            output = {str(output)!r}
+
+            with Tracker(
+                destination=FileDestination(output, compress_on_exit=False),
+                memory_interval_ms=5,
+            ):
+                allocator.valloc(1024)
+                allocator.free()
+                # The records are handed off with the next memory record.
+                time.sleep(0.1)
+                os.kill(os.getpid(), signal.SIGKILL)
+            """
+        )
+
+        # WHEN
+        process = subprocess.run([sys.executable, "-c", subprocess_code], timeout=5)
+
+        # THEN
+        assert process.returncode == -signal.SIGKILL
+        # The file still has all the space reserved for it.
+        assert output.read_bytes().endswith(b"\0")
+
+        records = list(FileReader(output).get_allocation_records())
+        vallocs = [
+            record
+            for record in filter_relevant_allocations(records)
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert [record.size for record in vallocs] == [1024]
+
+    def test_compressed_file_reads_like_an_uncompressed_one(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        compressed = tmp_path / "compressed.bin"
+        uncompressed = tmp_path / "uncompressed.bin"
+
+        def allocate():
+            for size in range(1, 50_000):
+                allocator.valloc(size)
+                allocator.free()
+
+        # WHEN
+        with Tracker(destination=FileDestination(compressed)):
+            allocate()
+        with Tracker(destination=FileDestination(uncompressed, compress_on_exit=False)):
+            allocate()
+
+        # THEN
+        def sizes(path):
+            return [
+                record.size
+                for record in FileReader(path).get_allocation_records()
+                if record.allocator == AllocatorType.VALLOC
+            ]
+
+        assert compressed.read_bytes()[:4] == b"\x04\x22\x4d\x18"
+        assert sizes(compressed) == sizes(uncompressed) == list(range(1, 50_000))
+
+    def test_compressed_file_without_a_frame_index_can_be_read(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        with Tracker(destination=FileDestination(output)):
+            for size in range(1, 50_000):
+                allocator.valloc(size)
+                allocator.free()
+        contents = output.read_bytes()
+        assert contents.endswith(b"mrfidx01")
+
+        # WHEN
+        output.write_bytes(contents[:-1])
+
+        # THEN
+        sizes = [
+            record.size
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert sizes == list(range(1, 50_000))
+
+    def test_compressed_file_with_a_large_header_can_be_read(
+        self, monkeypatch, tmp_path
+    ):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        # Much larger than the header usually is, so that the whole start of
+        # the stream has to be rewritten when the header is.
+        argv = ["python", "-c", "x" * (1024 * 1024)]
+        monkeypatch.setattr(sys, "argv", argv)
+
+        # WHEN
+        with Tracker(destination=FileDestination(output)):
+            for size in range(1, 10_000):
+                allocator.valloc(size)
+                allocator.free()
+
+        # THEN
+        reader = FileReader(output)
+        records = list(reader.get_allocation_records())
+        sizes = [
+            record.size
+            for record in records
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert output.read_bytes()[:4] == b"\x04\x22\x4d\x18"
+        assert reader.metadata.command_line == " ".join(argv)
+        assert reader.metadata.end_time > reader.metadata.start_time
+        assert reader.metadata.total_allocations == len(records)
+        assert sizes == list(range(1, 10_000))
+
     @pytest.mark.parametrize(
         "allocator, allocator_name",
         [
@@ -1459,6 +2546,72 @@ class TestHeader:
         assert metadata.python_allocator == allocator_name
 
 
+class TestTrackerMetrics:
+    def test_metrics_while_tracking(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, measure_overhead=True) as tracker:
+            for _ in range(100):
+                allocator.valloc(ALLOC_SIZE)
+                allocator.free()
+            metrics = tracker.get_metrics()
+
+        # THEN
+        assert metrics.n_tracked_allocations >= 100
+        assert metrics.allocation_ns > 0
+        assert metrics.n_tracked_deallocations >= 100
+        assert metrics.deallocation_ns > 0
+        assert metrics.n_records_written >= 200
+        assert metrics.bytes_written > 0
+
+    def test_metrics_are_written_to_the_capture_file(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, measure_overhead=True) as tracker:
+            for _ in range(100):
+                allocator.valloc(ALLOC_SIZE)
+                allocator.free()
+            metrics = tracker.get_metrics()
+
+        # THEN
+        written = FileReader(output).tracker_metrics
+        assert written.n_tracked_allocations >= metrics.n_tracked_allocations
+        assert written.allocation_ns >= metrics.allocation_ns
+        assert written.n_records_written >= metrics.n_records_written
+        assert written.bytes_written >= metrics.bytes_written
+
+    def test_overhead_is_not_measured_by_default(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            allocator.valloc(ALLOC_SIZE)
+            allocator.free()
+
+        # THEN
+        metrics = FileReader(output).tracker_metrics
+        assert metrics.n_tracked_allocations == 0
+        assert metrics.allocation_ns == 0
+        assert metrics.n_records_written >= 2
+        assert metrics.bytes_written > 0
+
+    def test_metrics_of_a_tracker_that_is_not_active(self, tmp_path):
+        # GIVEN
+        tracker = Tracker(tmp_path / "test.bin")
+
+        # WHEN/THEN
+        with pytest.raises(RuntimeError, match="not active"):
+            tracker.get_metrics()
+
+
 class TestMemorySnapshots:
     @pytest.mark.valgrind
     def test_memory_snapshots_are_written(self, tmp_path):
@@ -1504,29 +2657,69 @@ class TestMemorySnapshots:
             for prev, _next in zip(memory_snapshots, memory_snapshots[1:])
         )
 
-    def test_temporary_allocations_when_filling_vector_without_preallocating(
-        self, tmp_path
-    ):
+    def test_detailed_memory_counters_are_written(self, tmp_path):
         # GIVEN
+        allocator = MemoryAllocator()
         output = tmp_path / "test.bin"
 
         # WHEN
-        with Tracker(output):
-            elements = fill_cpp_vector(2 << 10)
+        with Tracker(output, memory_interval_ms=5, detailed_memory_counters=True):
+            allocator.valloc(ALLOC_SIZE)
+            time.sleep(0.1)
+            allocator.free()
 
-        # THEN
         reader = FileReader(output)
-        temporary_allocations = list(
-            reader.get_temporary_allocation_records(threshold=1)
-        )
-        assert elements == 512
-        assert len(temporary_allocations) == 1
-        (record,) = temporary_allocations
-        assert record.n_allocations == 10
-        assert record.allocator == AllocatorType.MALLOC
-        assert record.size >= (2 << 10)
+        memory_snapshots = list(reader.get_memory_snapshots())
+        memory_counters = list(reader.get_memory_counters())
 
-    def test_temporary_allocations_when_filling_vector_without_preallocating_small_buffer(
+        # THEN
+        assert memory_counters
+        assert {counters.time for counters in memory_counters} <= {
+            snapshot.time for snapshot in memory_snapshots
+        }
+        assert all(counters.rss > 0 for counters in memory_counters)
+        assert all(counters.minor_faults > 0 for counters in memory_counters)
+        assert all(
+            _next.minor_faults >= prev.minor_faults
+            for prev, _next in zip(memory_counters, memory_counters[1:])
+        )
+
+    def test_detailed_memory_counters_are_not_written_by_default(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=5):
+            time.sleep(0.1)
+
+        # THEN
+        reader = FileReader(output)
+        assert list(reader.get_memory_snapshots())
+        assert not list(reader.get_memory_counters())
+
+    def test_temporary_allocations_when_filling_vector_without_preallocating(
+        self, tmp_path
+    ):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            elements = fill_cpp_vector(2 << 10)
+
+        # THEN
+        reader = FileReader(output)
+        temporary_allocations = list(
+            reader.get_temporary_allocation_records(threshold=1)
+        )
+        assert elements == 512
+        assert len(temporary_allocations) == 1
+        (record,) = temporary_allocations
+        assert record.n_allocations == 10
+        assert record.allocator == AllocatorType.MALLOC
+        assert record.size >= (2 << 10)
+
+    def test_temporary_allocations_when_filling_vector_without_preallocating_small_buffer(
         self, tmp_path
     ):
         # GIVEN
@@ -1548,3 +2741,974 @@ class TestMemorySnapshots:
         assert record.n_allocations == 1
         assert record.allocator == AllocatorType.MALLOC
         assert record.size == 2 << 10
+
+
+@pytest.mark.parametrize("memory_threshold", [float("inf"), 1024 * 5])
+def test_allocations_are_aggregated_by_location_like_in_python(
+    tmp_path, monkeypatch, memory_threshold
+):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    def recursive(n):
+        if n == 0:
+            allocator.valloc(1024)
+            return
+        allocator.valloc(1024)
+        recursive(n - 1)
+
+    def run_in_thread():
+        recursive(3)
+
+    # WHEN
+    with Tracker(output):
+        recursive(5)
+        thread = threading.Thread(target=run_in_thread)
+        thread.start()
+        thread.join()
+
+    # THEN
+    reader = FileReader(output)
+    snapshot = list(reader.get_high_watermark_allocation_records(merge_threads=False))
+    aggregated = tui.aggregate_allocations(snapshot, memory_threshold)
+    monkeypatch.setattr(tui, "aggregate_allocations_by_location", lambda *args: None)
+    expected = tui.aggregate_allocations(snapshot, memory_threshold)
+    assert aggregated == expected
+    assert any(location.function == "recursive" for location in aggregated)
+
+
+def test_flame_graph_is_built_like_in_python(tmp_path, monkeypatch):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    def recursive(n):
+        allocator.valloc(1024)
+        if n:
+            recursive(n - 1)
+
+    def run_in_thread():
+        recursive(3)
+
+    # WHEN
+    with Tracker(output):
+        recursive(5)
+        thread = threading.Thread(target=run_in_thread)
+        thread.start()
+        thread.join()
+
+    # THEN
+    reader = FileReader(output)
+    snapshot = list(reader.get_high_watermark_allocation_records(merge_threads=False))
+    reporter = flamegraph.FlameGraphReporter.from_snapshot(
+        snapshot, memory_records=[], native_traces=False
+    )
+    monkeypatch.setattr(flamegraph, "build_flame_graph", lambda *args: None)
+    expected = flamegraph.FlameGraphReporter.from_snapshot(
+        snapshot, memory_records=[], native_traces=False
+    )
+    assert reporter.data == expected.data
+    assert len(reporter.data["unique_threads"]) == 2
+
+
+def _capture_recursive_allocations(output):
+    allocator = MemoryAllocator()
+
+    def recursive(n):
+        allocator.valloc(1024)
+        if n:
+            recursive(n - 1)
+
+    def run_in_thread():
+        recursive(3)
+
+    with Tracker(output):
+        recursive(5)
+        thread = threading.Thread(target=run_in_thread)
+        thread.start()
+        thread.join()
+
+
+@pytest.mark.parametrize("memory_threshold", [float("inf"), 1024 * 5])
+def test_snapshot_is_aggregated_by_location_like_its_records(
+    tmp_path, memory_threshold
+):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    _capture_recursive_allocations(output)
+
+    # WHEN
+    reader = FileReader(output)
+    snapshot = reader.get_snapshot(merge_threads=False)
+    records = list(reader.get_high_watermark_allocation_records(merge_threads=False))
+
+    # THEN
+    def key(record):
+        return (record.tid, record.size, record.n_allocations, record.stack_trace())
+
+    assert sorted(map(key, snapshot)) == sorted(map(key, records))
+    assert len(snapshot) == len(records)
+    assert snapshot.total_size == sum(record.size for record in records)
+    assert snapshot.total_allocations == sum(
+        record.n_allocations for record in records
+    )
+    assert sorted(snapshot.thread_ids()) == sorted({record.tid for record in records})
+    aggregated = tui.aggregate_allocations(snapshot, memory_threshold)
+    assert aggregated == tui.aggregate_allocations(records, memory_threshold)
+
+
+def test_flame_graph_of_a_snapshot_is_built_like_from_its_records(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    _capture_recursive_allocations(output)
+
+    # WHEN
+    snapshot = FileReader(output).get_snapshot(merge_threads=False)
+    reporter = flamegraph.FlameGraphReporter.from_snapshot(
+        snapshot, memory_records=[], native_traces=False
+    )
+    expected = flamegraph.FlameGraphReporter.from_snapshot(
+        list(snapshot), memory_records=[], native_traces=False
+    )
+
+    # THEN
+    assert reporter.data == expected.data
+    assert len(reporter.data["unique_threads"]) == 2
+
+
+def test_table_rows_of_a_snapshot_match_its_records(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    _capture_recursive_allocations(output)
+
+    # WHEN
+    reader = FileReader(output)
+    snapshot = reader.get_snapshot(merge_threads=False)
+    reporter = table.TableReporter.from_snapshot(
+        snapshot, memory_records=[], native_traces=False
+    )
+    expected = table.TableReporter.from_snapshot(
+        list(snapshot), memory_records=[], native_traces=False
+    )
+
+    # THEN
+    assert reporter.data == expected.data
+    assert {row["tid"] for row in reporter.data} == {
+        record.thread_name for record in snapshot
+    }
+
+
+def test_snapshots_from_different_captures_are_diffed_like_in_python(
+    tmp_path, monkeypatch
+):
+    # GIVEN
+    allocator = MemoryAllocator()
+    before_output = tmp_path / "before.bin"
+    after_output = tmp_path / "after.bin"
+
+    def allocate(size):
+        allocator.valloc(size)
+
+    def capture(output, sizes):
+        with Tracker(output):
+            for size in sizes:
+                allocate(size)
+            allocator.valloc(4096)
+
+    # WHEN
+    capture(before_output, [1024, 2048])
+    capture(after_output, [1024, 1024, 1024])
+
+    # THEN
+    before = list(FileReader(before_output).get_leaked_allocation_records())
+    after = list(FileReader(after_output).get_leaked_allocation_records())
+    reporter = diff.DiffReporter.from_snapshots(before, after)
+    monkeypatch.setattr(diff, "diff_snapshots", lambda *args: None)
+    expected = diff.DiffReporter.from_snapshots(before, after)
+    assert sorted(reporter.deltas, key=repr) == sorted(expected.deltas, key=repr)
+
+    (allocate_delta,) = [
+        delta
+        for delta in reporter.deltas
+        if [frame[0] for frame in delta.stack[:2]] == ["valloc", "allocate"]
+    ]
+    assert allocate_delta.size_before == 1024 + 2048
+    assert allocate_delta.size_after == 3 * 1024
+    assert allocate_delta.n_allocations_before == 2
+    assert allocate_delta.n_allocations_after == 3
+
+
+
+def define_allocating_functions(filename, names):
+    source = "".join(
+        f"def {name}(allocator, size):\n    allocator.valloc(size)\n"
+        for name in names
+    )
+    namespace = {}
+    exec(compile(source, filename, "exec"), namespace)
+    return [namespace[name] for name in names]
+
+
+def test_strings_of_a_capture_are_read_back_intact(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    # Enough names to fill several arenas, names that need an arena of their
+    # own, and the same names in different files.
+    names = [f"function_{i}_{'x' * (i % 100)}" for i in range(2000)]
+    names += [f"long_{i}_{'y' * (16 * 1024 * i)}" for i in range(1, 4)]
+    functions = [
+        (filename, name, function)
+        for filename in ["first.py", "second.py", "z" * 40000 + ".py"]
+        for name, function in zip(
+            names, define_allocating_functions(filename, names)
+        )
+    ]
+    allocators = []
+
+    # WHEN
+    with Tracker(output):
+        for i, (_, _, function) in enumerate(functions):
+            allocators.append(MemoryAllocator())
+            function(allocators[-1], i + 1)
+
+    # THEN
+    vallocs = [
+        record
+        for record in FileReader(output).get_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert len(vallocs) == len(functions)
+    for record in vallocs:
+        filename, name, _ = functions[record.size - 1]
+        assert record.stack_trace()[1][:2] == (name, filename)
+    for allocator in allocators:
+        allocator.free()
+
+
+def test_diff_of_captures_sharing_some_strings(tmp_path, monkeypatch):
+    # GIVEN
+    shared = define_allocating_functions(
+        "shared.py", [f"shared_{i}" for i in range(500)]
+    )
+    # The same names in a file of each capture's own, so that only the frames
+    # with matching names and files are the same stack.
+    before_only = define_allocating_functions(
+        "before.py", [f"shared_{i}" for i in range(250)]
+    )
+    after_only = define_allocating_functions(
+        "after.py", [f"shared_{i}" for i in range(250, 500)]
+    )
+    before_output = tmp_path / "before.bin"
+    after_output = tmp_path / "after.bin"
+
+    def capture(output, functions, size):
+        allocators = [MemoryAllocator() for _ in functions]
+        with Tracker(output):
+            for allocator, function in zip(allocators, functions):
+                function(allocator, size)
+        for allocator in allocators:
+            allocator.free()
+
+    # Each capture interns the strings in a different order.
+    capture(before_output, shared[::2] + before_only + shared[1::2], 1024)
+    capture(after_output, after_only + shared[::-1], 2048)
+
+    # WHEN
+    before = list(FileReader(before_output).get_leaked_allocation_records())
+    after = list(FileReader(after_output).get_leaked_allocation_records())
+    reporter = diff.DiffReporter.from_snapshots(before, after)
+    monkeypatch.setattr(diff, "diff_snapshots", lambda *args: None)
+    expected = diff.DiffReporter.from_snapshots(before, after)
+
+    # THEN
+    assert sorted(reporter.deltas, key=repr) == sorted(expected.deltas, key=repr)
+    by_frame = {
+        delta.stack[1][:2]: delta
+        for delta in reporter.deltas
+        if delta.stack and delta.stack[0][0] == "valloc"
+    }
+    for i in range(500):
+        delta = by_frame[f"shared_{i}", "shared.py"]
+        assert (delta.size_before, delta.size_after) == (1024, 2048)
+    for i in range(250):
+        delta = by_frame[f"shared_{i}", "before.py"]
+        assert (delta.size_before, delta.size_after) == (1024, 0)
+    for i in range(250, 500):
+        delta = by_frame[f"shared_{i}", "after.py"]
+        assert (delta.size_before, delta.size_after) == (0, 2048)
+
+def test_pprof_profile_is_encoded_like_in_python(tmp_path, monkeypatch):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    def allocate(size):
+        allocator.valloc(size)
+
+    # WHEN
+    with Tracker(output):
+        for size in (1024, 2048):
+            allocate(size)
+        allocator.valloc(4096)
+
+    # THEN
+    reader = FileReader(output)
+    records = list(reader.get_leaked_allocation_records())
+
+    def render():
+        reporter = transform.TransformReporter(
+            records, format="pprof", native_traces=False, memory_records=[]
+        )
+        outfile = io.BytesIO()
+        reporter.render_as_pprof(outfile, reader.metadata)
+        return gzip.decompress(outfile.getvalue())
+
+    profile_data = render()
+    monkeypatch.setattr(transform, "encode_pprof_profile", lambda *args: None)
+    assert profile_data == render()
+    assert b"allocate" in profile_data
+
+
+def test_stack_traces_share_their_frames(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    def allocate():
+        allocator.valloc(1024)
+        allocator.free()
+
+    # WHEN
+    with Tracker(output):
+        for _ in range(2):
+            allocate()
+
+    # THEN
+    records = [
+        record
+        for record in FileReader(output).get_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert len(records) == 2
+    first, second = (record.stack_trace() for record in records)
+    assert first == second
+    assert first[0] is second[0]
+    del first[:]
+    assert second == records[1].stack_trace()
+    assert second[0][0] == "valloc"
+
+
+def test_consecutive_native_stacks_are_told_apart(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output, native_traces=True):
+        for _ in range(10):
+            _cython_allocate_in_two_places(ALLOC_SIZE)
+
+    # THEN
+    vallocs = [
+        record
+        for record in FileReader(output).get_allocation_records()
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert len(vallocs) == 20
+    places = [
+        any("allocation_place_a" in frame[0] for frame in record.native_stack_trace())
+        for record in vallocs
+    ]
+    assert places == [True, False] * 10
+    assert len({tuple(record.native_stack_trace()) for record in vallocs[::2]}) == 1
+    assert len({tuple(record.native_stack_trace()) for record in vallocs[1::2]}) == 1
+
+
+class TestAllocationColumns:
+    COLUMNS = ["tid", "address", "size", "allocator", "stack_id", "n_allocations"]
+
+    @staticmethod
+    def _capture(output):
+        allocator = MemoryAllocator()
+
+        def allocate(size):
+            allocator.valloc(size)
+            allocator.free()
+
+        with Tracker(output):
+            for size in (1024, 2048, 4096):
+                allocate(size)
+            allocator.valloc(8192)
+
+    def test_columns_match_the_records(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        self._capture(output)
+        reader = FileReader(output)
+
+        # WHEN
+        batches = list(reader.get_allocation_columns(batch_size=3))
+
+        # THEN
+        assert all(set(batch) == set(self.COLUMNS) for batch in batches)
+        assert all(0 < len(batch["tid"]) <= 3 for batch in batches)
+        columns = {
+            name: [value for batch in batches for value in batch[name].tolist()]
+            for name in self.COLUMNS
+        }
+        records = list(reader.get_allocation_records())
+        assert columns["tid"] == [record.tid for record in records]
+        assert columns["address"] == [record.address for record in records]
+        assert columns["size"] == [record.size for record in records]
+        assert columns["allocator"] == [record.allocator for record in records]
+        assert columns["n_allocations"] == [record.n_allocations for record in records]
+
+        stacks_by_id = collections.defaultdict(set)
+        for stack_id, record in zip(columns["stack_id"], records):
+            stacks_by_id[stack_id].add(tuple(record.stack_trace()))
+        assert all(len(stacks) == 1 for stacks in stacks_by_id.values())
+
+        vallocs = [
+            (size, stack_id)
+            for size, allocator, stack_id in zip(
+                columns["size"], columns["allocator"], columns["stack_id"]
+            )
+            if allocator == AllocatorType.VALLOC
+        ]
+        assert [size for size, _ in vallocs] == [1024, 2048, 4096, 8192]
+        assert len({stack_id for _, stack_id in vallocs[:3]}) == 1
+
+    def test_columns_are_read_only_typed_buffers(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        self._capture(output)
+
+        # WHEN
+        (batch, *_) = FileReader(output).get_allocation_columns()
+
+        # THEN
+        for name, column in batch.items():
+            assert column.readonly
+            assert column.ndim == 1
+            assert column.format == ("B" if name == "allocator" else "Q")
+            assert len(column) == len(batch["tid"])
+        with pytest.raises(TypeError):
+            batch["size"][0] = 0
+
+    def test_columns_outlive_the_reader(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        self._capture(output)
+
+        # WHEN
+        with FileReader(output) as reader:
+            batches = list(reader.get_allocation_columns(batch_size=2))
+
+        # THEN
+        sizes = [size for batch in batches for size in batch["size"].tolist()]
+        assert {1024, 2048, 4096, 8192} <= set(sizes)
+
+    def test_batch_size_must_be_positive(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        self._capture(output)
+
+        # WHEN/THEN
+        with pytest.raises(ValueError, match="batch size"):
+            next(FileReader(output).get_allocation_columns(batch_size=0))
+
+
+class TestAllocationFilter:
+    @staticmethod
+    def _capture(output, **kwargs):
+        allocators = [MemoryAllocator() for _ in range(4)]
+
+        def allocate_in_thread():
+            allocators[1].valloc(2048)
+
+        with Tracker(output, **kwargs):
+            allocators[0].valloc(1024)
+            thread = threading.Thread(target=allocate_in_thread)
+            thread.start()
+            thread.join()
+            allocators[2].valloc(4096)
+            allocators[3].valloc(8192)
+            allocators[3].free()
+        return thread.ident
+
+    @staticmethod
+    def _vallocs(records):
+        return sorted(
+            (record.size, record.tid)
+            for record in records
+            if record.allocator == AllocatorType.VALLOC
+        )
+
+    def test_leaks_of_a_thread(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        thread_id = self._capture(output)
+        reader = FileReader(output)
+        all_leaks = list(reader.get_leaked_allocation_records(merge_threads=False))
+
+        # WHEN
+        leaks = list(
+            reader.get_leaked_allocation_records(
+                merge_threads=False,
+                allocation_filter=AllocationFilter(tid=thread_id),
+            )
+        )
+
+        # THEN
+        assert self._vallocs(leaks) == [(2048, thread_id)]
+        assert leaks == [leak for leak in all_leaks if leak.tid == thread_id]
+
+    def test_high_watermark_of_a_size_range(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        self._capture(output)
+        reader = FileReader(output)
+        allocation_filter = AllocationFilter(min_size=2048, max_size=8192)
+
+        # WHEN
+        peak = list(
+            reader.get_high_watermark_allocation_records(
+                allocation_filter=allocation_filter
+            )
+        )
+
+        # THEN
+        assert [size for size, _ in self._vallocs(peak)] == [2048, 4096, 8192]
+        assert all(2048 <= record.size for record in peak)
+
+    def test_allocations_from_a_file(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        self._capture(output)
+        reader = FileReader(output)
+
+        # WHEN
+        in_this_file = list(
+            reader.get_leaked_allocation_records(
+                allocation_filter=AllocationFilter(filename=Path(__file__).name)
+            )
+        )
+        in_no_file = list(
+            reader.get_leaked_allocation_records(
+                allocation_filter=AllocationFilter(filename="no-such-file.py")
+            )
+        )
+
+        # THEN
+        assert [size for size, _ in self._vallocs(in_this_file)] == [1024, 2048, 4096]
+        assert not in_no_file
+
+    def test_allocations_in_a_time_window(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        self._capture(output)
+        reader = FileReader(output)
+        start_time = reader.metadata.start_time
+        end_time = reader.metadata.end_time
+
+        # WHEN
+        during = list(
+            reader.get_leaked_allocation_records(
+                allocation_filter=AllocationFilter(
+                    start_time=start_time, end_time=end_time
+                )
+            )
+        )
+        after = list(
+            reader.get_leaked_allocation_records(
+                allocation_filter=AllocationFilter(
+                    start_time=end_time + datetime.timedelta(hours=1)
+                )
+            )
+        )
+
+        # THEN
+        assert [size for size, _ in self._vallocs(during)] == [1024, 2048, 4096]
+        assert not after
+
+    def test_statistics_of_a_thread(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        thread_id = self._capture(output)
+
+        # WHEN
+        stats = compute_statistics(
+            str(output), allocation_filter=AllocationFilter(tid=thread_id)
+        )
+
+        # THEN
+        assert stats.allocation_count_by_allocator.get("VALLOC") == 1
+        assert stats.peak_memory_allocated >= 2048
+        assert stats.peak_memory_allocated < 8192
+
+    def test_aggregated_captures_cannot_be_filtered(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        self._capture(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS)
+        reader = FileReader(output)
+
+        # WHEN/THEN
+        with pytest.raises(NotImplementedError, match="filter"):
+            list(
+                reader.get_leaked_allocation_records(
+                    allocation_filter=AllocationFilter(min_size=1)
+                )
+            )
+
+
+class TestSnapshots:
+    def test_snapshots_at_several_indices(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            allocator.valloc(1024)
+            allocator.free()
+            allocator.valloc(2048)
+
+        # THEN
+        reader = FileReader(output)
+        records = list(reader.get_allocation_records())
+        indices = [
+            index
+            for index, record in enumerate(records)
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(indices) == 2
+        (free_index,) = [
+            index
+            for index, record in enumerate(records)
+            if record.allocator == AllocatorType.FREE
+            and record.address == records[indices[0]].address
+        ]
+        indices.insert(1, free_index)
+
+        snapshots = list(reader.get_snapshots(indices, merge_threads=False))
+        assert [index for index, _ in snapshots] == indices
+        assert [
+            [
+                record.size
+                for record in snapshot
+                if record.allocator == AllocatorType.VALLOC
+            ]
+            for _, snapshot in snapshots
+        ] == [[1024], [], [2048]]
+
+    def test_snapshot_past_the_end_is_the_final_heap(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            allocator.valloc(1024)
+
+        # THEN
+        reader = FileReader(output)
+        ((index, snapshot),) = reader.get_snapshots([2**40])
+        assert index == 2**40
+        assert sorted(snapshot, key=lambda record: record.size) == sorted(
+            reader.get_leaked_allocation_records(), key=lambda record: record.size
+        )
+
+    def test_snapshots_need_indices_or_timestamps(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            pass
+        reader = FileReader(output)
+
+        # WHEN/THEN
+        with pytest.raises(ValueError, match="Exactly one"):
+            list(reader.get_snapshots())
+        with pytest.raises(ValueError, match="Exactly one"):
+            list(reader.get_snapshots([0], timestamps=[0]))
+
+    def test_temporal_index_has_the_heap_at_each_memory_snapshot(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=5):
+            time.sleep(0.1)
+            allocator.valloc(ALLOC_SIZE)
+            time.sleep(0.1)
+            allocator.free()
+            time.sleep(0.1)
+
+        # THEN
+        reader = FileReader(output)
+        index = reader.get_temporal_index()
+        assert len(index) == len(list(reader.get_memory_snapshots())) + 1
+
+        def vallocs(records):
+            return [
+                record.size
+                for record in records
+                if record.allocator == AllocatorType.VALLOC
+            ]
+
+        live = [vallocs(index.live_allocation_records(i)) for i in range(len(index))]
+        first = live.index([ALLOC_SIZE])
+        assert 0 < first
+        assert live[-1] == []
+        assert vallocs(index.allocation_records_between(first - 1, first)) == [
+            ALLOC_SIZE
+        ]
+        assert vallocs(index.allocation_records_between(0, first - 1)) == []
+        assert vallocs(index.allocation_records_between(first, len(index) - 1)) == []
+
+        with pytest.raises(IndexError):
+            index.live_allocation_records(len(index))
+        with pytest.raises(IndexError):
+            index.allocation_records_between(1, 0)
+
+
+class TestAggregatedCaptures:
+    @staticmethod
+    def _summarize(records):
+        summary = collections.defaultdict(lambda: [0, 0])
+        for record in records:
+            if record.allocator != AllocatorType.VALLOC:
+                continue
+            entry = summary[tuple(record.stack_trace())]
+            entry[0] += record.size
+            entry[1] += record.n_allocations
+        return dict(summary)
+
+    @staticmethod
+    def _capture(output, **kwargs):
+        size = 1024 * 1024
+        allocators = [MemoryAllocator() for _ in range(3)]
+        peak_allocator = MemoryAllocator()
+
+        def allocate_small():
+            for allocator in allocators:
+                allocator.valloc(size)
+
+        def allocate_big():
+            peak_allocator.valloc(4 * size)
+
+        with Tracker(output, **kwargs):
+            allocate_small()
+            allocators[0].free()
+            allocate_big()
+            peak_allocator.free()
+
+    def test_snapshots_match_the_full_capture(self, tmp_path):
+        # GIVEN
+        full_output = tmp_path / "full.bin"
+        aggregated_output = tmp_path / "aggregated.bin"
+
+        # WHEN
+        self._capture(full_output)
+        self._capture(aggregated_output, file_format=FileFormat.AGGREGATED_ALLOCATIONS)
+
+        # THEN
+        full = FileReader(full_output)
+        aggregated = FileReader(aggregated_output)
+        peak = self._summarize(aggregated.get_high_watermark_allocation_records())
+        leaks = self._summarize(aggregated.get_leaked_allocation_records())
+        assert peak == self._summarize(full.get_high_watermark_allocation_records())
+        assert leaks == self._summarize(full.get_leaked_allocation_records())
+
+        size = 1024 * 1024
+        peak_by_caller = sorted((stack[1][0], entry) for stack, entry in peak.items())
+        leaks_by_caller = sorted((stack[1][0], entry) for stack, entry in leaks.items())
+        assert peak_by_caller == [
+            ("allocate_big", [4 * size, 1]),
+            ("allocate_small", [2 * size, 2]),
+        ]
+        assert leaks_by_caller == [("allocate_small", [2 * size, 2])]
+        assert aggregated.metadata.peak_memory >= 6 * size
+        assert aggregated.metadata.total_allocations > 0
+
+    def test_threads_are_kept_apart(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocate():
+            allocator.valloc(1024)
+
+        # WHEN
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            allocate()
+            thread = threading.Thread(target=allocate)
+            thread.start()
+            thread.join()
+
+        # THEN
+        reader = FileReader(output)
+        records = [
+            record
+            for record in reader.get_leaked_allocation_records(merge_threads=False)
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(records) == 2
+        assert len({record.tid for record in records}) == 2
+        assert {record.stack_trace()[1][0] for record in records} == {"allocate"}
+
+    def test_reports_needing_every_allocation_are_refused(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            MemoryAllocator().valloc(1024)
+        reader = FileReader(output)
+
+        # WHEN/THEN
+        with pytest.raises(NotImplementedError, match="aggregated capture file"):
+            list(reader.get_allocation_records())
+        with pytest.raises(NotImplementedError, match="aggregated capture file"):
+            list(reader.get_temporary_allocation_records())
+        with pytest.raises(NotImplementedError, match="aggregated capture file"):
+            list(reader.get_snapshots([0]))
+        with pytest.raises(NotImplementedError, match="aggregated capture file"):
+            compute_statistics(output)
+
+    def test_profile_intervals_follow_each_stack(self, tmp_path):
+        # GIVEN
+        size = 1024 * 1024
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocate():
+            allocator.valloc(size)
+
+        # WHEN
+        with Tracker(
+            output,
+            file_format=FileFormat.AGGREGATED_ALLOCATIONS,
+            profile_interval_ms=20,
+        ):
+            allocate()
+            time.sleep(0.2)
+            allocator.free()
+            time.sleep(0.2)
+
+        # THEN
+        changes = []
+        for interval in FileReader(output).get_profile_intervals():
+            for allocated, freed, live in zip(
+                interval.allocated, interval.freed, interval.live
+            ):
+                if allocated.allocator != AllocatorType.VALLOC:
+                    continue
+                assert allocated.stack_trace()[1][0] == "allocate"
+                assert freed.stack_trace() == live.stack_trace()
+                changes.append((allocated.size, freed.size, live.size))
+        assert changes == [(size, 0, size), (0, size, 0)]
+
+    def test_profile_intervals_require_the_aggregated_format(self, tmp_path):
+        with pytest.raises(ValueError, match="aggregated file format"):
+            Tracker(tmp_path / "test.bin", profile_interval_ms=20)
+
+
+class TestInternedPythonStacks:
+    @staticmethod
+    def _capture(output, **kwargs):
+        allocator = MemoryAllocator()
+
+        def recurse(depth):
+            if depth:
+                recurse(depth - 1)
+            else:
+                allocator.valloc(1024)
+                allocator.free()
+
+        with Tracker(output, **kwargs):
+            for _ in range(10):
+                recurse(50)
+            allocator.valloc(2048)
+
+        return [
+            (record.size, record.stack_trace())
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+
+    @pytest.mark.parametrize(
+        "extra_kwargs",
+        [{}, {"per_thread_buffers": True}, {"native_traces": True}],
+        ids=["plain", "per_thread_buffers", "native_traces"],
+    )
+    def test_stacks_match_the_ones_from_frame_pushes_and_pops(
+        self, tmp_path, extra_kwargs
+    ):
+        # WHEN
+        expected = self._capture(tmp_path / "pushes_and_pops.bin", **extra_kwargs)
+        interned = self._capture(
+            tmp_path / "interned.bin", intern_python_stacks=True, **extra_kwargs
+        )
+
+        # THEN
+        assert interned == expected
+        assert len(interned) == 11
+        assert [frame[0] for frame in interned[0][1][:3]] == [
+            "valloc",
+            "recurse",
+            "recurse",
+        ]
+        assert len(interned[0][1]) > 50
+
+    def test_stacks_are_cut_to_max_python_depth(self, tmp_path):
+        # WHEN
+        expected = self._capture(tmp_path / "full.bin")
+        truncated = self._capture(tmp_path / "truncated.bin", max_python_depth=5)
+
+        # THEN
+        assert len(truncated) == len(expected) == 11
+        for (_, stack), (_, full_stack) in zip(truncated[:10], expected):
+            assert stack == [*full_stack[:5], ("<truncated>", "", 0)]
+        _, shallow_stack = truncated[10]
+        assert len(shallow_stack) == 6
+        assert shallow_stack[0][0] == "valloc"
+        assert shallow_stack[5] == ("<truncated>", "", 0)
+
+    def test_files_are_smaller_for_recursive_code(self, tmp_path):
+        # GIVEN
+        pushes_and_pops = tmp_path / "pushes_and_pops.bin"
+        interned = tmp_path / "interned.bin"
+
+        # WHEN
+        self._capture(pushes_and_pops, memory_interval_ms=60_000)
+        self._capture(interned, memory_interval_ms=60_000, intern_python_stacks=True)
+
+        # THEN
+        assert interned.stat().st_size < pushes_and_pops.stat().st_size
+
+    def test_aggregated_captures_use_the_interned_stacks(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        allocator = MemoryAllocator()
+
+        def allocate():
+            allocator.valloc(1024)
+
+        # WHEN
+        with Tracker(
+            output,
+            file_format=FileFormat.AGGREGATED_ALLOCATIONS,
+            intern_python_stacks=True,
+        ):
+            allocate()
+
+        # THEN
+        records = [
+            record
+            for record in FileReader(output).get_leaked_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(records) == 1
+        assert [frame[0] for frame in records[0].stack_trace()[:2]] == [
+            "valloc",
+            "allocate",
+        ]
@@ -1,4 +1,5 @@
 import argparse
+import signal
 import sys
 from pathlib import Path
 from unittest.mock import patch
@@ -6,6 +7,7 @@ from unittest.mock import patch
 import pytest
 
 from memray import FileDestination
+from memray import FileFormat
 from memray import SocketDestination
 from memray.commands import main
 from memray.commands.flamegraph import FlamegraphCommand
@@ -65,6 +67,74 @@ class TestRunSubCommand:
             native_traces=True,
         )
 
+    def test_run_with_frame_pointer_unwinding(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            ["run", "--native", "--frame-pointer-unwinding", "-m", "foobar"]
+        )
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=True,
+            frame_pointer_unwinding=True,
+        )
+
+    def test_run_with_asyncio_task_tracing(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--trace-asyncio-tasks", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            trace_asyncio_tasks=True,
+        )
+
+    def test_run_with_detailed_memory_counters(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            [
+                "run",
+                "--detailed-memory-counters",
+                "--memory-interval-ms",
+                "50",
+                "-m",
+                "foobar",
+            ]
+        )
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            memory_interval_ms=50,
+            detailed_memory_counters=True,
+        )
+
+    def test_run_with_overhead_measurement(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--measure-overhead", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            measure_overhead=True,
+        )
+
     def test_run_with_pymalloc_tracing(
         self, getpid_mock, runpy_mock, tracker_mock, validate_mock
     ):
@@ -79,6 +149,190 @@ class TestRunSubCommand:
             trace_python_allocators=True,
         )
 
+    def test_run_with_sampling(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            ["run", "--sampling-interval-bytes", "4096", "-m", "foobar"]
+        )
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            sampling_interval_bytes=4096,
+        )
+
+    def test_run_with_overhead_budget(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--overhead-budget", "2.5", "-m", "foobar"])
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            overhead_budget=2.5,
+        )
+
+    def test_run_with_min_allocation_size(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--min-allocation-size", "512", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            min_allocation_size=512,
+        )
+
+    def test_run_with_regions_only(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--regions-only", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            regions_only=True,
+        )
+
+    def test_run_with_pymalloc_arenas(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--trace-pymalloc-arenas", "-m", "foobar"])
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            trace_pymalloc_arenas=True,
+        )
+
+    def test_run_with_max_stack_depths(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            [
+                "run",
+                "--native",
+                "--max-python-depth",
+                "32",
+                "--max-native-depth",
+                "64",
+                "-m",
+                "foobar",
+            ]
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=True,
+            max_python_depth=32,
+            max_native_depth=64,
+        )
+
+    def test_run_with_flight_recorder(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            [
+                "run",
+                "--flight-recorder-size",
+                "1048576",
+                "--flight-recorder-rss-threshold",
+                "4096",
+                "--flight-recorder-signal",
+                "USR2",
+                "-m",
+                "foobar",
+            ]
+        )
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            flight_recorder_size=1048576,
+            flight_recorder_rss_threshold=4096,
+            flight_recorder_signal=signal.SIGUSR2,
+        )
+
+    def test_run_with_rotation(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            [
+                "run",
+                "--rotation-size",
+                "1048576",
+                "--rotation-interval",
+                "3600",
+                "--rotation-max-files",
+                "4",
+                "-m",
+                "foobar",
+            ]
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            rotation_size=1048576,
+            rotation_interval_s=3600,
+            rotation_max_files=4,
+        )
+
+    def test_rotation_max_files_requires_a_rotation_budget(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--rotation-max-files", "4", "-m", "foobar"])
+        tracker_mock.assert_not_called()
+
+    def test_run_with_aggregated_output(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--aggregate", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            file_format=FileFormat.AGGREGATED_ALLOCATIONS,
+        )
+
+    def test_run_with_profile_intervals(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            ["run", "--aggregate", "--profile-interval-ms", "500", "-m", "foobar"]
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", overwrite=False),
+            native_traces=False,
+            file_format=FileFormat.AGGREGATED_ALLOCATIONS,
+            profile_interval_ms=500,
+        )
+
+    def test_profile_intervals_require_aggregated_output(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--profile-interval-ms", "500", "-m", "foobar"])
+        tracker_mock.assert_not_called()
+
     def test_run_override_output(
         self, getpid_mock, runpy_mock, tracker_mock, validate_mock
     ):
@@ -216,6 +470,35 @@ class TestRunSubCommand:
             native_traces=False,
         )
 
+    def test_run_with_live_remote_and_live_compress(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            [
+                "run",
+                "--live-remote",
+                "--live-port=1111",
+                "--live-compress",
+                "./directory/foobar.py",
+            ]
+        )
+        tracker_mock.assert_called_with(
+            destination=SocketDestination(
+                server_port=1111, address="127.0.0.1", compress=True
+            ),
+            native_traces=False,
+        )
+
+    def test_run_with_live_compress_but_not_live_remote(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--live-compress", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "The --live-compress argument requires --live-remote" in captured.err
+
     def test_run_with_live_port_but_not_live_remote(
         self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
     ):
@@ -243,6 +526,82 @@ class TestRunSubCommand:
             follow_fork=True,
         )
 
+    def test_run_with_frame_pointer_unwinding_without_native(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--frame-pointer-unwinding", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "--frame-pointer-unwinding requires --native" in captured.err
+
+    def test_run_with_pymalloc_arenas_and_python_allocators(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(
+                [
+                    "run",
+                    "--trace-pymalloc-arenas",
+                    "--trace-python-allocators",
+                    "./directory/foobar.py",
+                ]
+            )
+
+        captured = capsys.readouterr()
+        assert (
+            "--trace-pymalloc-arenas cannot be used with --trace-python-allocators"
+            in captured.err
+        )
+
+    @pytest.mark.parametrize("budget", ["-1", "100"])
+    def test_run_with_invalid_overhead_budget(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys, budget
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--overhead-budget", budget, "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "--overhead-budget must be a percentage below 100" in captured.err
+
+    def test_run_with_asyncio_task_tracing_and_live_mode(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--live", "--trace-asyncio-tasks", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "--trace-asyncio-tasks cannot be used with the live TUI" in captured.err
+
+    def test_run_with_detailed_memory_counters_and_live_mode(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(
+                [
+                    "run",
+                    "--live",
+                    "--detailed-memory-counters",
+                    "./directory/foobar.py",
+                ]
+            )
+
+        captured = capsys.readouterr()
+        assert (
+            "--detailed-memory-counters cannot be used with the live TUI"
+            in captured.err
+        )
+
+    @pytest.mark.parametrize("interval", ["0", "-10"])
+    def test_run_with_invalid_memory_interval(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys, interval
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", f"--memory-interval-ms={interval}", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "--memory-interval-ms must be a positive integer" in captured.err
+
     def test_run_with_follow_fork_and_live_mode(
         self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
     ):
@@ -468,6 +827,30 @@ class TestTreeSubCommand:
         assert namespace.results == "results.txt"
         assert namespace.biggest_allocs == 5
 
+    def test_parser_accepts_cache(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN
+        namespace = parser.parse_args(["results.txt", "--cache"])
+        default_namespace = parser.parse_args(["results.txt"])
+
+        # THEN
+        assert namespace.cache_analysis is True
+        assert default_namespace.cache_analysis is False
+
+    def test_parser_accepts_native_symbols_only(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN
+        namespace = parser.parse_args(["results.txt", "--native-symbols-only"])
+        default_namespace = parser.parse_args(["results.txt"])
+
+        # THEN
+        assert namespace.native_symbols_only is True
+        assert default_namespace.native_symbols_only is False
+
 
 class TestTableSubCommand:
     @staticmethod
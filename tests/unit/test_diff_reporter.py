@@ -0,0 +1,96 @@
+from io import StringIO
+
+from memray import AllocatorType
+from memray.reporters.diff import DiffReporter
+from memray.reporters.diff import StackDelta
+from tests.utils import MockAllocationRecord
+
+
+def _record(size, n_allocations, stack):
+    return MockAllocationRecord(
+        tid=1,
+        address=0x1000000,
+        size=size,
+        allocator=AllocatorType.MALLOC,
+        stack_id=1,
+        n_allocations=n_allocations,
+        _stack=stack,
+    )
+
+
+GROWING = [("grow", "/src/a.py", 1), ("main", "/src/main.py", 10)]
+SHRINKING = [("shrink", "/src/b.py", 2), ("main", "/src/main.py", 11)]
+VANISHING = [("vanish", "/src/c.py", 3), ("main", "/src/main.py", 12)]
+APPEARING = [("appear", "/src/d.py", 4), ("main", "/src/main.py", 13)]
+STABLE = [("stable", "/src/e.py", 5), ("main", "/src/main.py", 14)]
+
+
+def test_deltas_are_matched_by_stack_and_sorted_by_change():
+    # GIVEN
+    before = [
+        _record(1000, 1, GROWING),
+        _record(5000, 5, SHRINKING),
+        _record(300, 3, VANISHING),
+        _record(64, 1, STABLE),
+        _record(500, 1, GROWING),
+    ]
+    after = [
+        _record(64, 1, STABLE),
+        _record(200, 2, APPEARING),
+        _record(9000, 3, GROWING),
+        _record(1000, 1, SHRINKING),
+    ]
+
+    # WHEN
+    reporter = DiffReporter.from_snapshots(before, after)
+
+    # THEN
+    assert reporter.deltas == [
+        StackDelta(tuple(GROWING), 1500, 9000, 2, 3),
+        StackDelta(tuple(SHRINKING), 5000, 1000, 5, 1),
+        StackDelta(tuple(VANISHING), 300, 0, 3, 0),
+        StackDelta(tuple(APPEARING), 0, 200, 0, 2),
+        StackDelta(tuple(STABLE), 64, 64, 1, 1),
+    ]
+    assert [delta.status for delta in reporter.deltas] == [
+        "grown",
+        "shrunk",
+        "vanished",
+        "new",
+        "unchanged",
+    ]
+
+
+def test_render_skips_unchanged_stacks_by_default():
+    # GIVEN
+    before = [_record(1000, 1, GROWING), _record(64, 1, STABLE)]
+    after = [_record(3000, 2, GROWING), _record(64, 1, STABLE)]
+    reporter = DiffReporter.from_snapshots(before, after)
+
+    # WHEN
+    output = StringIO()
+    reporter.render(file=output)
+    output_with_unchanged = StringIO()
+    reporter.render(include_unchanged=True, file=output_with_unchanged)
+
+    # THEN
+    assert "grow at" in output.getvalue()
+    assert "+1.953KB" in output.getvalue()
+    assert "1 -> 2" in output.getvalue()
+    assert "stable" not in output.getvalue()
+    assert "stable at" in output_with_unchanged.getvalue()
+
+
+def test_render_limits_the_number_of_rows():
+    # GIVEN
+    before = [_record(1000, 1, GROWING), _record(5000, 5, SHRINKING)]
+    after = [_record(1500, 2, GROWING)]
+    reporter = DiffReporter.from_snapshots(before, after)
+
+    # WHEN
+    output = StringIO()
+    reporter.render(max_rows=1, file=output)
+
+    # THEN
+    assert "shrink" in output.getvalue()
+    assert "grow" not in output.getvalue()
@@ -7,8 +7,11 @@ from unittest.mock import patch
 
 import pytest
 
+from memray import MemorySnapshot
 from memray._errors import MemrayCommandError
 from memray.commands.common import HighWatermarkCommand
+from memray.commands.common import find_process_captures
+from memray.commands.common import merge_memory_records
 
 
 class TestFilenameValidation:
@@ -163,7 +166,12 @@ class TestReportGeneration:
 
         # THEN
         calls = [
-            call(os.fspath(result_path), report_progress=True),
+            call(
+                os.fspath(result_path),
+                report_progress=True,
+                cache_analysis=False,
+                native_symbols_only=False,
+            ),
             call().metadata.has_native_traces.__bool__(),
             call().get_high_watermark_allocation_records(merge_threads=merge_threads),
             call().get_memory_snapshots(),
@@ -193,7 +201,12 @@ class TestReportGeneration:
 
         # THEN
         calls = [
-            call(os.fspath(result_path), report_progress=True),
+            call(
+                os.fspath(result_path),
+                report_progress=True,
+                cache_analysis=False,
+                native_symbols_only=False,
+            ),
             call().metadata.has_native_traces.__bool__(),
             call().get_leaked_allocation_records(merge_threads=merge_threads),
             call().get_memory_snapshots(),
@@ -225,7 +238,12 @@ class TestReportGeneration:
 
         # THEN
         calls = [
-            call(os.fspath(result_path), report_progress=True),
+            call(
+                os.fspath(result_path),
+                report_progress=True,
+                cache_analysis=False,
+                native_symbols_only=False,
+            ),
             call().metadata.has_native_traces.__bool__(),
             call().get_temporary_allocation_records(
                 threshold=3, merge_threads=merge_threads
@@ -236,3 +254,136 @@ class TestReportGeneration:
 
         reporter_factory_mock.assert_called_once()
         reporter_factory_mock().render.assert_called_once()
+
+    def test_reader_caches_the_analysis_when_requested(self, tmp_path):
+        # GIVEN
+        reporter_factory_mock = Mock()
+        command = HighWatermarkCommand(reporter_factory_mock, reporter_name="reporter")
+        result_path = tmp_path / "results.bin"
+        output_file = tmp_path / "output.txt"
+
+        # WHEN
+        with patch("memray.commands.common.FileReader") as reader_mock:
+            command.write_report(
+                result_path=result_path,
+                output_file=output_file,
+                show_memory_leaks=False,
+                temporary_allocation_threshold=-1,
+                cache_analysis=True,
+            )
+
+        # THEN
+        reader_mock.assert_called_once_with(
+            os.fspath(result_path),
+            report_progress=True,
+            cache_analysis=True,
+            native_symbols_only=False,
+        )
+        reporter_factory_mock.assert_called_once()
+
+    def test_reader_resolves_only_native_symbols_when_requested(self, tmp_path):
+        # GIVEN
+        reporter_factory_mock = Mock()
+        command = HighWatermarkCommand(reporter_factory_mock, reporter_name="reporter")
+        result_path = tmp_path / "results.bin"
+        output_file = tmp_path / "output.txt"
+
+        # WHEN
+        with patch("memray.commands.common.FileReader") as reader_mock:
+            command.write_report(
+                result_path=result_path,
+                output_file=output_file,
+                show_memory_leaks=False,
+                temporary_allocation_threshold=-1,
+                native_symbols_only=True,
+            )
+
+        # THEN
+        reader_mock.assert_called_once_with(
+            os.fspath(result_path),
+            report_progress=True,
+            cache_analysis=False,
+            native_symbols_only=True,
+        )
+        reporter_factory_mock.assert_called_once()
+
+    def test_merges_the_captures_of_forked_processes_when_requested(self, tmp_path):
+        # GIVEN
+        reporter_factory_mock = Mock()
+        command = HighWatermarkCommand(reporter_factory_mock, reporter_name="reporter")
+        result_path = tmp_path / "results.bin"
+        for name in ("results.bin", "results.bin.20", "results.bin.3", "other.bin"):
+            (tmp_path / name).touch()
+        output_file = tmp_path / "output.txt"
+
+        # WHEN
+        with patch("memray.commands.common.merge_captures") as merge_captures:
+            merge_captures.return_value = ([1, 2], [], Mock(has_native_traces=False))
+            command.write_report(
+                result_path=result_path,
+                output_file=output_file,
+                show_memory_leaks=False,
+                temporary_allocation_threshold=-1,
+                merge_threads=False,
+                merge_processes=True,
+                other_result_paths=[tmp_path / "other.bin"],
+            )
+
+        # THEN
+        merge_captures.assert_called_once_with(
+            [
+                result_path,
+                tmp_path / "results.bin.3",
+                tmp_path / "results.bin.20",
+                tmp_path / "other.bin",
+            ],
+            False,
+            -1,
+            False,
+            False,
+            False,
+        )
+        ((records,), kwargs) = reporter_factory_mock.call_args
+        assert records == [1, 2]
+        assert kwargs["memory_records"] == []
+        reporter_factory_mock().render.assert_called_once()
+
+
+class TestProcessCaptures:
+    def test_children_captures_follow_the_parent_one_by_pid(self, tmp_path):
+        # GIVEN
+        for name in (
+            "results.bin",
+            "results.bin.1234",
+            "results.bin.99",
+            "results.bin.memray-cache",
+            "results.bin.99.old",
+            "other.bin.5",
+        ):
+            (tmp_path / name).touch()
+
+        # WHEN
+        captures = find_process_captures(tmp_path / "results.bin")
+
+        # THEN
+        assert captures == [
+            tmp_path / "results.bin",
+            tmp_path / "results.bin.99",
+            tmp_path / "results.bin.1234",
+        ]
+
+    def test_memory_of_processes_is_added_up_while_they_run(self):
+        # GIVEN
+        parent = [MemorySnapshot(0, 10, 1), MemorySnapshot(20, 30, 3)]
+        child = [MemorySnapshot(5, 100, 10), MemorySnapshot(10, 200, 20)]
+
+        # WHEN
+        merged = merge_memory_records([parent, child])
+
+        # THEN
+        assert merged == [
+            MemorySnapshot(0, 10, 1),
+            MemorySnapshot(5, 110, 11),
+            MemorySnapshot(10, 210, 21),
+            MemorySnapshot(20, 30, 3),
+        ]
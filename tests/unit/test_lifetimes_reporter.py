@@ -0,0 +1,79 @@
+from io import StringIO
+
+from memray import AllocatorType
+from memray._memray import AllocationLifetimes
+from memray.reporters.lifetimes import LifetimesReporter
+from memray.reporters.lifetimes import StackLifetimes
+from tests.utils import MockAllocationRecord
+
+
+def _lifetimes(size, n_allocations, stack, by_allocations, by_time, never_freed=0):
+    record = MockAllocationRecord(
+        tid=1,
+        address=0x1000000,
+        size=size,
+        allocator=AllocatorType.MALLOC,
+        stack_id=1,
+        n_allocations=n_allocations,
+        _stack=stack,
+    )
+    freed = sum(count for _, count in by_allocations)
+    return AllocationLifetimes(record, freed, never_freed, by_allocations, by_time)
+
+
+CHURNING = [("churn", "/src/a.py", 1), ("main", "/src/main.py", 10)]
+CACHING = [("cache", "/src/b.py", 2), ("main", "/src/main.py", 11)]
+
+
+def test_stacks_are_merged_and_sorted_by_short_lived_allocations():
+    # GIVEN
+    lifetimes = [
+        _lifetimes(8000, 2, CACHING, [(1024, 1), (2048, 1)], [(64, 2)]),
+        _lifetimes(1000, 10, CHURNING, [(0, 6), (4, 4)], [(0, 10)]),
+        _lifetimes(500, 6, CHURNING, [(0, 2), (32, 3)], [(0, 4), (2, 1)], 1),
+    ]
+
+    # WHEN
+    reporter = LifetimesReporter.from_lifetimes(lifetimes, short_lived_threshold=16)
+
+    # THEN
+    assert reporter.stacks == [
+        StackLifetimes(
+            tuple(CHURNING),
+            1500,
+            16,
+            15,
+            1,
+            [(0, 8), (4, 4), (32, 3)],
+            [(0, 14), (2, 1)],
+        ),
+        StackLifetimes(
+            tuple(CACHING), 8000, 2, 2, 0, [(1024, 1), (2048, 1)], [(64, 2)]
+        ),
+    ]
+    assert reporter.stacks[0].freed_within(16) == 12
+    assert reporter.stacks[1].freed_within(16) == 0
+
+
+def test_render_shows_the_median_lifetimes():
+    # GIVEN
+    lifetimes = [
+        _lifetimes(1000, 10, CHURNING, [(0, 2), (4, 8)], [(16, 10)]),
+        _lifetimes(8000, 2, CACHING, [(1024, 2)], [(64, 2)], never_freed=3),
+    ]
+    reporter = LifetimesReporter.from_lifetimes(lifetimes, short_lived_threshold=16)
+
+    # WHEN
+    output = StringIO()
+    reporter.render(file=output)
+    limited_output = StringIO()
+    reporter.render(max_rows=1, file=limited_output)
+
+    # THEN
+    assert "churn" in output.getvalue()
+    assert "100%" in output.getvalue()
+    assert "4-7" in output.getvalue()
+    assert "16-31ms" in output.getvalue()
+    assert "cache" in output.getvalue()
+    assert "1024-2047" in output.getvalue()
+    assert "cache" not in limited_output.getvalue()
@@ -1,5 +1,10 @@
+import base64
+from array import array
+
 import pytest
 
+from memray.reporters.templates import encode_flame_graph
+from memray.reporters.templates import encode_records
 from memray.reporters.templates import get_report_title
 
 
@@ -14,3 +19,104 @@ from memray.reporters.templates import get_report_title
 )
 def test_title_for_regular_report(kind, show_memory_leaks, expected):
     assert get_report_title(kind=kind, show_memory_leaks=show_memory_leaks) == expected
+
+
+def _decode_records(payload, encoded):
+    columns = {}
+    for field, (kind, values) in encoded["fields"].items():
+        if kind == "json":
+            columns[field] = values
+            continue
+        typecode = {"bool": "B", "uint32": "I", "float64": "d", "string": "I"}[kind]
+        decoded = array(typecode, base64.b64decode(values)).tolist()
+        if kind == "bool":
+            decoded = [bool(value) for value in decoded]
+        elif kind == "string":
+            decoded = [payload["strings"][value] for value in decoded]
+        columns[field] = decoded
+    return [
+        {field: values[i] for field, values in columns.items()}
+        for i in range(encoded["length"])
+    ]
+
+
+def test_encoded_records_store_each_string_once():
+    # GIVEN
+    records = [
+        {"tid": "main", "size": 1024, "allocator": "malloc", "n_allocations": 1},
+        {"tid": "main", "size": 2**40, "allocator": "valloc", "n_allocations": 3},
+        {"tid": "worker", "size": 1.5, "allocator": "malloc", "n_allocations": 2},
+    ]
+
+    # WHEN
+    payload = encode_records(records)
+
+    # THEN
+    assert payload["strings"] == ["main", "worker", "malloc", "valloc"]
+    columns = payload["records"]["fields"]
+    assert [columns[field][0] for field in columns] == [
+        "string",
+        "float64",
+        "string",
+        "uint32",
+    ]
+    assert _decode_records(payload, payload["records"]) == records
+
+
+def test_encoded_flame_graph_shares_frames_between_nodes():
+    # GIVEN
+    def node(name, value, children=(), thread_id="main"):
+        return {
+            "name": name,
+            "location": [f"{name}_function", "file.py", "1"],
+            "value": value,
+            "children": list(children),
+            "n_allocations": 1,
+            "thread_id": thread_id,
+            "interesting": True,
+            "import_system": False,
+        }
+
+    root = {
+        **node("<root>", 30),
+        "location": ["&lt;tracker&gt;", "<b>memray</b>", 0],
+        "thread_id": "0x0",
+        "unique_threads": ["main", "worker"],
+    }
+    root["children"] = [
+        node("a", 10, [node("b", 10)]),
+        node(
+            "a",
+            20,
+            [node("c", 5, thread_id="worker"), node("b", 15, thread_id="worker")],
+            thread_id="worker",
+        ),
+    ]
+
+    # WHEN
+    payload = encode_flame_graph(root)
+
+    # THEN
+    frames = _decode_records(payload, payload["frames"])
+    nodes = _decode_records(payload, payload["nodes"])
+    assert [frame["name"] for frame in frames] == ["<root>", "a", "b", "c"]
+    assert [frames[node["frame"]]["name"] for node in nodes] == [
+        "<root>",
+        "a",
+        "b",
+        "a",
+        "c",
+        "b",
+    ]
+    assert [node["parent"] for node in nodes] == [0, 0, 1, 0, 3, 3]
+    assert [node["value"] for node in nodes] == [30, 10, 10, 20, 5, 15]
+    assert [node["thread_id"] for node in nodes] == [
+        "0x0",
+        "main",
+        "main",
+        "worker",
+        "worker",
+        "worker",
+    ]
+    assert frames[0]["lineno"] == 0
+    assert payload["unique_threads"] == ["main", "worker"]
@@ -1,11 +1,108 @@
 import csv
+import gzip
 import json
+from datetime import datetime
+from io import BytesIO
 from io import StringIO
 
 from memray import AllocatorType
+from memray import Metadata
 from memray.reporters.transform import TransformReporter
 from tests.utils import MockAllocationRecord
 
+METADATA = Metadata(
+    start_time=datetime(2023, 1, 1, 12, 0, 0),
+    end_time=datetime(2023, 1, 1, 12, 0, 2),
+    total_allocations=1,
+    total_frames=1,
+    peak_memory=1024,
+    command_line="python fun.py",
+    pid=123,
+    python_allocator="pymalloc",
+    has_native_traces=False,
+)
+
+
+def decode_message(data):
+    """Decode the fields of a protocol buffer message, by field number."""
+    fields = {}
+    pos = 0
+
+    def varint():
+        nonlocal pos
+        value = shift = 0
+        while True:
+            byte = data[pos]
+            pos += 1
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if byte < 0x80:
+                return value
+
+    while pos < len(data):
+        tag = varint()
+        if tag & 7 == 0:
+            value = varint()
+        else:
+            assert tag & 7 == 2
+            length = varint()
+            value = data[pos : pos + length]
+            pos += length
+        fields.setdefault(tag >> 3, []).append(value)
+    return fields
+
+
+def decode_varints(data):
+    values = []
+    value = shift = 0
+    for byte in data:
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if byte < 0x80:
+            values.append(value)
+            value = shift = 0
+    return values
+
+
+def decode_profile(data):
+    """Decode a gzipped pprof profile into its samples.
+
+    Returns the string table, the sample types and every sample as a tuple
+    of its stack (as ``(function, file, line)`` tuples, innermost first), its
+    values and its thread label.
+    """
+    profile = decode_message(gzip.decompress(data))
+    strings = [string.decode() for string in profile.get(6, [])]
+    functions = {}
+    for function in profile.get(5, []):
+        fields = decode_message(function)
+        functions[fields[1][0]] = (strings[fields[2][0]], strings[fields[4][0]])
+    locations = {}
+    for location in profile.get(4, []):
+        fields = decode_message(location)
+        lines = [decode_message(line) for line in fields.get(4, [])]
+        locations[fields[1][0]] = [
+            (*functions[line[1][0]], line.get(2, [0])[0]) for line in lines
+        ]
+    sample_types = []
+    for sample_type in profile[1]:
+        fields = decode_message(sample_type)
+        sample_types.append((strings[fields[1][0]], strings[fields[2][0]]))
+    samples = []
+    for sample in profile.get(2, []):
+        fields = decode_message(sample)
+        stack = [
+            frame
+            for location_id in decode_varints(fields[1][0])
+            for frame in locations[location_id]
+        ]
+        (label,) = [decode_message(label) for label in fields[3]]
+        thread = strings[label[2][0]]
+        assert strings[label[1][0]] == "thread"
+        samples.append((stack, decode_varints(fields[2][0]), thread))
+    default_sample_type = strings[profile[14][0]]
+    return strings, sample_types, default_sample_type, samples
+
 
 class TestGprof2DotTransformReporter:
     def test_empty_report(self):
@@ -373,3 +470,133 @@ class TestCSVTransformReporter:
         assert output_data == [
             ["MALLOC", "1", "1024", "1", "0x1", "me;foo.py;12|you;bar.py;21"]
         ]
+
+
+class TestPprofTransformReporter:
+    def test_empty_report(self):
+        # GIVEN
+        reporter = TransformReporter(
+            [], format="pprof", memory_records=[], native_traces=False
+        )
+        output = BytesIO()
+
+        # WHEN
+        reporter.render_as_pprof(output, metadata=METADATA)
+
+        # THEN
+        strings, sample_types, default_sample_type, samples = decode_profile(
+            output.getvalue()
+        )
+        assert strings[0] == ""
+        assert sample_types == [("inuse_objects", "count"), ("inuse_space", "bytes")]
+        assert default_sample_type == "inuse_space"
+        assert samples == []
+
+    def test_single_allocation(self):
+        # GIVEN
+        peak_allocations = [
+            MockAllocationRecord(
+                tid=1,
+                address=0x1000000,
+                size=1024,
+                allocator=AllocatorType.MALLOC,
+                stack_id=1,
+                n_allocations=3,
+                _stack=[
+                    ("me", "fun.py", 12),
+                    ("you", "bar.py", 21),
+                ],
+            ),
+        ]
+        reporter = TransformReporter(
+            peak_allocations, format="pprof", memory_records=[], native_traces=False
+        )
+        output = BytesIO()
+
+        # WHEN
+        reporter.render_as_pprof(output, metadata=METADATA)
+
+        # THEN
+        *_, samples = decode_profile(output.getvalue())
+        assert samples == [
+            ([("me", "fun.py", 12), ("you", "bar.py", 21)], [3, 1024], "0x1")
+        ]
+
+    def test_single_native_allocation(self):
+        # GIVEN
+        peak_allocations = [
+            MockAllocationRecord(
+                tid=1,
+                address=0x1000000,
+                size=1024,
+                allocator=AllocatorType.MALLOC,
+                stack_id=1,
+                n_allocations=1,
+                _hybrid_stack=[
+                    ("me", "fun.c", 12),
+                ],
+            ),
+        ]
+        reporter = TransformReporter(
+            peak_allocations, format="pprof", memory_records=[], native_traces=True
+        )
+        output = BytesIO()
+
+        # WHEN
+        reporter.render_as_pprof(output, metadata=METADATA)
+
+        # THEN
+        *_, samples = decode_profile(output.getvalue())
+        assert samples == [([("me", "fun.c", 12)], [1, 1024], "0x1")]
+
+    def test_shared_frames_are_deduplicated(self):
+        # GIVEN
+        peak_allocations = [
+            MockAllocationRecord(
+                tid=tid,
+                address=0x1000000,
+                size=1024,
+                allocator=AllocatorType.MALLOC,
+                stack_id=1,
+                n_allocations=1,
+                _stack=[
+                    (function, "fun.py", 12),
+                    ("main", "fun.py", 1),
+                ],
+            )
+            for function, tid in [("me", 1), ("you", 1), ("me", 2)]
+        ]
+        reporter = TransformReporter(
+            peak_allocations, format="pprof", memory_records=[], native_traces=False
+        )
+        output = BytesIO()
+
+        # WHEN
+        reporter.render_as_pprof(output, metadata=METADATA)
+
+        # THEN
+        profile = decode_message(gzip.decompress(output.getvalue()))
+        assert len(profile[4]) == 3  # locations
+        assert len(profile[5]) == 3  # functions
+        strings, *_, samples = decode_profile(output.getvalue())
+        assert len(strings) == len(set(strings))
+        assert [thread for *_, thread in samples] == ["0x1", "0x1", "0x2"]
+
+    def test_temporary_allocations(self):
+        # GIVEN
+        reporter = TransformReporter(
+            [],
+            format="pprof",
+            memory_records=[],
+            native_traces=False,
+            temporary_allocations=True,
+        )
+        output = BytesIO()
+
+        # WHEN
+        reporter.render_as_pprof(output, metadata=METADATA)
+
+        # THEN
+        _, sample_types, default_sample_type, _ = decode_profile(output.getvalue())
+        assert sample_types == [("alloc_objects", "count"), ("alloc_space", "bytes")]
+        assert default_sample_type == "alloc_space"